@@ -17,6 +17,10 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/stats.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
@@ -42,6 +46,168 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/*
+ * With many handlers, rebuilding the pollfds array and having the kernel
+ * scan it on every aio_poll() gets expensive.  Past this many fds the
+ * context switches to an epoll set, which aio_set_fd_handler() keeps up
+ * to date, and stays with it.  If epoll cannot watch one of the fds,
+ * the context goes back to ppoll for good.
+ */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+}
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    return true;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int r;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+
+    event.events = epoll_events_from_pfd(node->pfd.events);
+    event.data.ptr = node;
+    if (!node->pfd.events) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+    } else {
+        r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                      node->pfd.fd, &event);
+    }
+    if (r) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epoll_enabled;
+}
+
+static void aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->epoll_available || ctx->epoll_enabled ||
+        npfd < EPOLL_ENABLE_THRESHOLD) {
+        return;
+    }
+    if (!aio_epoll_try_enable(ctx)) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    struct epoll_event events[128];
+    AioHandler *node;
+    int i, ret = 0;
+
+    if (timeout > 0) {
+        /* epoll_wait only has millisecond resolution */
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN,
+        };
+
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+        timeout = 0;
+    }
+
+    ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events),
+                     timeout < 0 ? -1 : 0);
+    for (i = 0; i < ret; i++) {
+        int ev = events[i].events;
+
+        node = events[i].data.ptr;
+        node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                            (ev & EPOLLOUT ? G_IO_OUT : 0) |
+                            (ev & EPOLLHUP ? G_IO_HUP : 0) |
+                            (ev & EPOLLERR ? G_IO_ERR : 0);
+    }
+    return ret;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epoll_enabled = false;
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd >= 0;
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    if (ctx->epoll_available) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static void aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+#endif
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -49,6 +215,7 @@ void aio_set_fd_handler(AioContext *ctx,
                         void *opaque)
 {
     AioHandler *node;
+    bool is_new = false;
 
     node = find_aio_handler(ctx, fd);
 
@@ -56,6 +223,8 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -78,6 +247,7 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -87,6 +257,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -178,6 +349,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     int ret;
     bool progress;
 
+    stats_counter_inc(ctx->stat_polls);
     progress = false;
 
     /*
@@ -198,6 +370,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return true;
     }
 
+    if (aio_epoll_enabled(ctx)) {
+        /* the epoll set is kept up to date by aio_set_fd_handler() */
+        aio_epoll(ctx, blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0);
+        goto dispatch;
+    }
+
     ctx->walking_handlers++;
 
     g_array_set_size(ctx->pollfds, 0);
@@ -222,6 +400,8 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return progress;
     }
 
+    aio_epoll_check_poll(ctx, ctx->pollfds->len);
+
     /* wait until next event */
     ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
                          ctx->pollfds->len,
@@ -238,6 +418,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+dispatch:
     /* Run dispatch even if there were no readable fds to run timers */
     if (aio_dispatch(ctx)) {
         progress = true;
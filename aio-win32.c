@@ -19,6 +19,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/stats.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -89,6 +90,14 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
@@ -97,6 +106,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     int count;
     int timeout;
 
+    stats_counter_inc(ctx->stat_polls);
     progress = false;
 
     /*
@@ -28,11 +28,15 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/sockets.h"
 #include "sysemu/arch_init.h"
 #include "audio/audio.h"
 #include "hw/i386/pc.h"
@@ -49,6 +53,12 @@
 #include "trace.h"
 #include "exec/cpu-all.h"
 #include "hw/acpi/acpi.h"
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -104,9 +114,19 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
-static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
+
+/* Auto-converge: the vCPUs sleep for mig_throttle_percentage percent of
+   the time, in periods of THROTTLE_TIMESLICE_NS running time */
+#define THROTTLE_TIMESLICE_NS 10000000
+#define THROTTLE_MAX 99
+/* Dirtied bytes per transferred byte that the controller aims at */
+#define THROTTLE_TARGET_RATIO 0.5
+#define THROTTLE_GAIN 20
+
+static int mig_throttle_percentage;
+static QEMUTimer *mig_throttle_timer;
+static void mig_throttle_timer_tick(void *opaque);
+static void mig_throttle_set(int percentage);
 
 /***********************************************************/
 /* ram save/restore */
@@ -118,7 +138,17 @@ static void check_guest_throttling(void);
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
-/* 0x80 is reserved in migration.h start with 0x100 next */
+/* 0x80 is reserved in migration.h */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_COMMAND       0x200
+
+/* Commands carried by RAM_SAVE_FLAG_COMMAND records, as a byte after the
+ * flags */
+#define RAM_COMMAND_CHANNELS          1 /* be32 number of RAM channels */
+#define RAM_COMMAND_POSTCOPY_OPEN     2 /* post-copy page channel follows */
+#define RAM_COMMAND_POSTCOPY_DISCARD  3 /* block id, (be64 start, be64
+                                           length) pairs, (0, 0) ends */
+#define RAM_COMMAND_POSTCOPY_RUN      4 /* pages now come on demand */
 
 
 static struct defconfig_file {
@@ -152,7 +182,7 @@ int qemu_read_default_config_files(bool userconfig)
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
-    return buffer_find_nonzero_offset(p, size) == size;
+    return buffer_is_zero(p, size);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -166,6 +196,8 @@ static struct {
     uint8_t *decoded_buf;
     /* Cache for XBZRLE */
     PageCache *cache;
+    /* Protects the cache against resizing from the monitor */
+    QemuMutex lock;
 } XBZRLE = {
     .encoded_buf = NULL,
     .current_buf = NULL,
@@ -173,14 +205,27 @@ static struct {
     .cache = NULL,
 };
 
+static void XBZRLE_cache_lock(void)
+{
+    qemu_mutex_lock(&XBZRLE.lock);
+}
+
+static void XBZRLE_cache_unlock(void)
+{
+    qemu_mutex_unlock(&XBZRLE.lock);
+}
 
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
+    int64_t ret = pow2floor(new_size);
+
+    XBZRLE_cache_lock();
     if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
+        ret = cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
             TARGET_PAGE_SIZE;
     }
-    return pow2floor(new_size);
+    XBZRLE_cache_unlock();
+    return ret;
 }
 
 /* accounting for migration statistics */
@@ -193,6 +238,9 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t compress_busy;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -252,6 +300,30 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_busy(void)
+{
+    return acct_info.compress_busy;
+}
+
+double compress_mig_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)(acct_info.compress_pages * TARGET_PAGE_SIZE) /
+           acct_info.compress_bytes;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -269,6 +341,36 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return size;
 }
 
+/* Like host_from_stream_offset(), for streams read outside the main loop.
+ * @last_block tracks RAM_SAVE_FLAG_CONTINUE for the stream, and callers use
+ * block->host since the RAM block MRU cache belongs to the main loop.  */
+static RAMBlock *block_from_stream(QEMUFile *f, RAMBlock **last_block,
+                                   ram_addr_t offset, int flags)
+{
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+
+    if (!(flags & RAM_SAVE_FLAG_CONTINUE)) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        *last_block = NULL;
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                *last_block = block;
+                break;
+            }
+        }
+    }
+
+    if (!*last_block || offset >= (*last_block)->length) {
+        return NULL;
+    }
+    return *last_block;
+}
+
 #define ENCODING_FLAG_XBZRLE 0x1
 
 static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
@@ -326,14 +428,217 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
 
 /* This is the last block that we have visited serching for dirty pages
  */
+/* Multi-threaded page compression.  Pages are handed to the threads in
+ * round-robin order, and the output of each thread is written to the
+ * stream when the slot is reused or at the end of the section, so pages
+ * reach the stream in the order they were picked.  A page is found dirty at
+ * most once between two bitmap syncs, so the pages written directly by the
+ * migration thread never overtake a queued copy of themselves.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* the thread owns the slot until busy is cleared */
+    bool busy;
+    bool quit;
+    /* queued page, NULL if the slot is empty */
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *host;
+    /* compressed page and its length, 0 if compression failed */
+    uint8_t *buf;
+    unsigned long len;
+} CompressParam;
+
+static struct {
+    CompressParam *params;
+    int nb_threads;
+    int level;
+    int next;
+} COMPRESS;
+
 static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
+static uint64_t bytes_transferred;
+/* number of dirty bitmap syncs since the start of the migration */
+static uint64_t migration_bitmap_sync_count;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* the guest reported free pages, so the bitmap has holes in the bulk stage */
+static bool ram_free_page_hinted;
+static NotifierList ram_save_notifiers =
+    NOTIFIER_LIST_INITIALIZER(ram_save_notifiers);
+
+void ram_save_add_notifier(Notifier *notify)
+{
+    notifier_list_add(&ram_save_notifiers, notify);
+}
+
+void ram_save_remove_notifier(Notifier *notify)
+{
+    notifier_remove(notify);
+}
+
+static void ram_save_notify(RamSaveEvent event)
+{
+    notifier_list_notify(&ram_save_notifiers, &event);
+}
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->busy) {
+            unsigned long len = compressBound(TARGET_PAGE_SIZE);
+
+            qemu_mutex_unlock(&param->mutex);
+            if (compress2(param->buf, &len, param->host, TARGET_PAGE_SIZE,
+                          COMPRESS.level) != Z_OK) {
+                len = 0;
+            }
+            qemu_mutex_lock(&param->mutex);
+            param->len = len;
+            param->busy = false;
+            qemu_cond_signal(&param->cond);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void compress_threads_create(void)
+{
+    int i;
+
+    COMPRESS.nb_threads = migrate_compress_threads();
+    COMPRESS.level = migrate_compress_level();
+    COMPRESS.next = 0;
+    COMPRESS.params = g_new0(CompressParam, COMPRESS.nb_threads);
+    for (i = 0; i < COMPRESS.nb_threads; i++) {
+        CompressParam *param = &COMPRESS.params[i];
+
+        param->buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_compress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compress_threads_join(void)
+{
+    int i;
+
+    for (i = 0; i < COMPRESS.nb_threads; i++) {
+        CompressParam *param = &COMPRESS.params[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+        qemu_cond_destroy(&param->cond);
+        qemu_mutex_destroy(&param->mutex);
+        g_free(param->buf);
+    }
+    g_free(COMPRESS.params);
+    COMPRESS.params = NULL;
+    COMPRESS.nb_threads = 0;
+}
+
+/* Waits for the thread of @param and writes its page to the stream.
+ * Returns the number of bytes written.  */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    RAMBlock *block;
+    int cont;
+    int bytes_sent;
+
+    qemu_mutex_lock(&param->mutex);
+    while (param->busy) {
+        qemu_cond_wait(&param->cond, &param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    block = param->block;
+    if (!block) {
+        return 0;
+    }
+    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    if (param->len == 0 || param->len >= TARGET_PAGE_SIZE) {
+        /* Incompressible, send the page as it is now */
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, param->host, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    } else {
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent += 4 + param->len;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += param->len;
+    }
+
+    last_sent_block = block;
+    param->block = NULL;
+    return bytes_sent;
+}
+
+/* Hands a page to the next compression thread, writing out the page that
+ * thread compressed before.  Returns the number of bytes written.  */
+static int compress_page_with_threads(QEMUFile *f, RAMBlock *block,
+                                      ram_addr_t offset, uint8_t *host)
+{
+    CompressParam *param = &COMPRESS.params[COMPRESS.next];
+    int bytes_sent;
+
+    qemu_mutex_lock(&param->mutex);
+    if (param->busy) {
+        acct_info.compress_busy++;
+    }
+    qemu_mutex_unlock(&param->mutex);
+    bytes_sent = flush_compressed_page(f, param);
+
+    qemu_mutex_lock(&param->mutex);
+    param->block = block;
+    param->offset = offset;
+    param->host = host;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    COMPRESS.next = (COMPRESS.next + 1) % COMPRESS.nb_threads;
+    return bytes_sent;
+}
+
+/* Writes out all queued pages, oldest first.  Must be called before the
+ * end of each section and before the ram list lock is dropped.  */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int i;
+
+    for (i = 0; i < COMPRESS.nb_threads; i++) {
+        int idx = (COMPRESS.next + i) % COMPRESS.nb_threads;
+
+        bytes_sent += flush_compressed_page(f, &COMPRESS.params[idx]);
+    }
+    return bytes_sent;
+}
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -346,7 +651,7 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
 
     unsigned long next;
 
-    if (ram_bulk_stage && nr > base) {
+    if (ram_bulk_stage && !ram_free_page_hinted && nr > base) {
         next = nr + 1;
     } else {
         next = find_next_bit(migration_bitmap, size, nr);
@@ -395,10 +700,21 @@ static void migration_bitmap_sync(void)
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
+    ram_save_notify(RAM_SAVE_BEFORE_BITMAP_SYNC);
+
     trace_migration_bitmap_sync_start();
+    migration_bitmap_sync_count++;
     address_space_sync_dirty_bitmap(&address_space_memory);
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!(block->length & ~TARGET_PAGE_MASK)) {
+            migration_dirty_pages +=
+                memory_region_sync_dirty_to_bitmap(block->mr, 0,
+                                                   block->length,
+                                                   DIRTY_MEMORY_MIGRATION,
+                                                   migration_bitmap);
+            continue;
+        }
         for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
             if (memory_region_test_and_clear_dirty(block->mr,
                                                    addr, TARGET_PAGE_SIZE,
@@ -415,23 +731,22 @@ static void migration_bitmap_sync(void)
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+            /* Proportional control of the vCPU sleep time: move the
+               throttle by THROTTLE_GAIN points per unit the ratio of
+               dirtied to transferred bytes is off THROTTLE_TARGET_RATIO. */
+            double ratio;
+
             bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
+            ratio = (double)(num_dirty_pages_period * TARGET_PAGE_SIZE) /
+                    MAX(bytes_xfer_now - bytes_xfer_prev, 1);
+            if (s->dirty_pages_rate) {
+                mig_throttle_set(atomic_read(&mig_throttle_percentage) +
+                                 THROTTLE_GAIN *
+                                 (ratio - THROTTLE_TARGET_RATIO));
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         } else {
-             mig_throttle_on = false;
+            mig_throttle_set(0);
         }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
@@ -439,159 +754,695 @@ static void migration_bitmap_sync(void)
         start_time = end_time;
         num_dirty_pages_period = 0;
     }
+
+    ram_save_notify(RAM_SAVE_AFTER_BITMAP_SYNC);
 }
 
 /*
- * ram_save_block: Writes a page of memory to the stream f
- *
- * Returns:  The number of bytes written.
- *           0 means no dirty pages
+ * The guest does not care about the contents of [addr, addr + len), a
+ * host range of guest RAM, so the pages need not be sent unless they are
+ * dirtied again.  Only valid between the RAM_SAVE_AFTER_BITMAP_SYNC and
+ * RAM_SAVE_BEFORE_BITMAP_SYNC notifications: a page that is written after
+ * the hint is then found dirty by the next sync.
  */
-
-static int ram_save_block(QEMUFile *f, bool last_stage)
+void qemu_guest_free_page_hint(void *addr, size_t len)
 {
-    RAMBlock *block = last_seen_block;
-    ram_addr_t offset = last_offset;
-    bool complete_round = false;
-    int bytes_sent = 0;
     MemoryRegion *mr;
-    ram_addr_t current_addr;
+    ram_addr_t ram_addr;
+    ram_addr_t used;
+    unsigned long nr, end;
 
-    if (!block)
-        block = QTAILQ_FIRST(&ram_list.blocks);
+    qemu_mutex_lock_ramlist();
+    if (!migration_bitmap) {
+        goto out;
+    }
 
-    while (true) {
-        mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
-        if (complete_round && block == last_seen_block &&
-            offset >= last_offset) {
+    while (len >= TARGET_PAGE_SIZE) {
+        mr = qemu_ram_addr_from_host(addr, &ram_addr);
+        if (!mr) {
             break;
         }
-        if (offset >= block->length) {
-            offset = 0;
-            block = QTAILQ_NEXT(block, next);
-            if (!block) {
-                block = QTAILQ_FIRST(&ram_list.blocks);
-                complete_round = true;
-                ram_bulk_stage = false;
+        used = memory_region_get_ram_addr(mr) + memory_region_size(mr) -
+               ram_addr;
+        used = MIN(used, len);
+
+        nr = ram_addr >> TARGET_PAGE_BITS;
+        end = (ram_addr + used) >> TARGET_PAGE_BITS;
+        for (; nr < end; nr++) {
+            if (test_and_clear_bit(nr, migration_bitmap)) {
+                migration_dirty_pages--;
             }
-        } else {
-            int ret;
-            uint8_t *p;
-            int cont = (block == last_sent_block) ?
-                RAM_SAVE_FLAG_CONTINUE : 0;
+        }
+        ram_free_page_hinted = true;
 
-            p = memory_region_get_ram_ptr(mr) + offset;
+        addr += used;
+        len -= used;
+    }
 
-            /* In doubt sent page as normal */
-            bytes_sent = -1;
-            ret = ram_control_save_page(f, block->offset,
-                               offset, TARGET_PAGE_SIZE, &bytes_sent);
+out:
+    qemu_mutex_unlock_ramlist();
+}
 
-            if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-                if (ret != RAM_SAVE_CONTROL_DELAYED) {
-                    if (bytes_sent > 0) {
-                        acct_info.norm_pages++;
-                    } else if (bytes_sent == 0) {
-                        acct_info.dup_pages++;
-                    }
-                }
-            } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-                acct_info.dup_pages++;
-                bytes_sent = save_block_hdr(f, block, offset, cont,
-                                            RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, 0);
-                bytes_sent++;
-            } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
+/* Multichannel migration.  Normal pages are queued round-robin to
+ * additional connections, each written by its own thread; everything else
+ * stays on the main channel.  At the end of each section every channel
+ * writes a sync marker, and the destination does not go past the marker
+ * until all channels and the main channel have reached it.  As with
+ * compression, the pages of a section are all distinct, so only the
+ * section boundaries need ordering.
+ */
+#define RAM_CHANNEL_MAGIC     0x514d4348    /* "QMCH" */
+#define RAM_CHANNEL_QUEUE_LEN 64
 
-            /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
-                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-                bytes_sent += TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+typedef struct ChannelPage {
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *host;
+} ChannelPage;
+
+typedef struct SendChannel {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    QEMUFile *file;
+    /* block of the last page written, for RAM_SAVE_FLAG_CONTINUE */
+    RAMBlock *last_block;
+    ChannelPage pages[RAM_CHANNEL_QUEUE_LEN];
+    int head;
+    int count;
+    /* write a sync marker once the queue is empty */
+    bool sync;
+    bool quit;
+} SendChannel;
 
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent > 0) {
-                last_sent_block = block;
-                break;
-            }
+static struct {
+    SendChannel *channels;
+    int nb_channels;
+    int next;
+} SEND_CHANNELS;
+
+static void *do_channel_send(void *opaque)
+{
+    SendChannel *c = opaque;
+
+    qemu_mutex_lock(&c->mutex);
+    while (true) {
+        if (c->count) {
+            ChannelPage page = c->pages[c->head];
+            int cont;
+
+            c->head = (c->head + 1) % RAM_CHANNEL_QUEUE_LEN;
+            c->count--;
+            qemu_cond_signal(&c->cond);
+            qemu_mutex_unlock(&c->mutex);
+
+            cont = (page.block == c->last_block) ?
+                RAM_SAVE_FLAG_CONTINUE : 0;
+            save_block_hdr(c->file, page.block, page.offset, cont,
+                           RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer_async(c->file, page.host, TARGET_PAGE_SIZE);
+            c->last_block = page.block;
+
+            qemu_mutex_lock(&c->mutex);
+        } else if (c->sync) {
+            qemu_mutex_unlock(&c->mutex);
+
+            qemu_put_be64(c->file, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(c->file);
+            /* blocks may go away once the ram list lock is dropped */
+            c->last_block = NULL;
+
+            qemu_mutex_lock(&c->mutex);
+            c->sync = false;
+            qemu_cond_signal(&c->cond);
+        } else if (c->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&c->cond, &c->mutex);
         }
     }
-    last_seen_block = block;
-    last_offset = offset;
+    qemu_mutex_unlock(&c->mutex);
 
-    return bytes_sent;
+    return NULL;
 }
 
-static uint64_t bytes_transferred;
-
-void acct_update_position(QEMUFile *f, size_t size, bool zero)
+static int send_channels_create(QEMUFile *f)
 {
-    uint64_t pages = size / TARGET_PAGE_SIZE;
-    if (zero) {
-        acct_info.dup_pages += pages;
-    } else {
-        acct_info.norm_pages += pages;
-        bytes_transferred += size;
-        qemu_update_position(f, size);
+    MigrationState *s = migrate_get_current();
+    int nb_channels = migrate_multichannel_channels();
+    int i;
+
+    SEND_CHANNELS.channels = g_new0(SendChannel, nb_channels);
+    SEND_CHANNELS.next = 0;
+    for (i = 0; i < nb_channels; i++) {
+        SendChannel *c = &SEND_CHANNELS.channels[i];
+        Error *local_err = NULL;
+
+        c->file = tcp_open_outgoing_channel(s, &local_err);
+        if (!c->file) {
+            fprintf(stderr, "Could not open migration channel: %s\n",
+                    error_get_pretty(local_err));
+            error_free(local_err);
+            return -1;
+        }
+        qemu_put_be32(c->file, RAM_CHANNEL_MAGIC);
+
+        qemu_mutex_init(&c->mutex);
+        qemu_cond_init(&c->cond);
+        qemu_thread_create(&c->thread, do_channel_send, c,
+                           QEMU_THREAD_JOINABLE);
+        SEND_CHANNELS.nb_channels++;
     }
-}
 
-static ram_addr_t ram_save_remaining(void)
-{
-    return migration_dirty_pages;
+    qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+    qemu_put_byte(f, RAM_COMMAND_CHANNELS);
+    qemu_put_be32(f, nb_channels);
+    return 0;
 }
 
-uint64_t ram_bytes_remaining(void)
+static void send_channels_join(void)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
-}
+    int i;
 
-uint64_t ram_bytes_transferred(void)
-{
-    return bytes_transferred;
+    for (i = 0; i < SEND_CHANNELS.nb_channels; i++) {
+        SendChannel *c = &SEND_CHANNELS.channels[i];
+
+        qemu_mutex_lock(&c->mutex);
+        c->quit = true;
+        qemu_cond_signal(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
+        qemu_thread_join(&c->thread);
+        qemu_cond_destroy(&c->cond);
+        qemu_mutex_destroy(&c->mutex);
+        qemu_fclose(c->file);
+    }
+    g_free(SEND_CHANNELS.channels);
+    SEND_CHANNELS.channels = NULL;
+    SEND_CHANNELS.nb_channels = 0;
 }
 
-uint64_t ram_bytes_total(void)
+/* Queues a page on the next channel.  The bytes are charged to the main
+ * channel so that rate limiting and bandwidth accounting see them.
+ * Returns the number of bytes queued.  */
+static int channel_send_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                             uint8_t *host)
 {
-    RAMBlock *block;
-    uint64_t total = 0;
-
-    QTAILQ_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    SendChannel *c = &SEND_CHANNELS.channels[SEND_CHANNELS.next];
+    int bytes_sent = 8 + TARGET_PAGE_SIZE;
 
-    return total;
+    qemu_mutex_lock(&c->mutex);
+    while (c->count == RAM_CHANNEL_QUEUE_LEN) {
+        qemu_cond_wait(&c->cond, &c->mutex);
+    }
+    c->pages[(c->head + c->count) % RAM_CHANNEL_QUEUE_LEN] = (ChannelPage) {
+        .block = block,
+        .offset = offset,
+        .host = host,
+    };
+    c->count++;
+    qemu_cond_signal(&c->cond);
+    qemu_mutex_unlock(&c->mutex);
+
+    SEND_CHANNELS.next = (SEND_CHANNELS.next + 1) % SEND_CHANNELS.nb_channels;
+
+    qemu_update_position(f, bytes_sent);
+    qemu_file_update_transfer(f, bytes_sent);
+    return bytes_sent;
 }
 
-static void migration_end(void)
+/* Ends the section on every channel and waits until all queued pages are
+ * written.  Must be called before the ram list lock is dropped.  */
+static void send_channels_sync(QEMUFile *f)
 {
-    if (migration_bitmap) {
-        memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
-        migration_bitmap = NULL;
+    int i;
+
+    for (i = 0; i < SEND_CHANNELS.nb_channels; i++) {
+        SendChannel *c = &SEND_CHANNELS.channels[i];
+
+        qemu_mutex_lock(&c->mutex);
+        c->sync = true;
+        qemu_cond_signal(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
     }
 
-    if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.decoded_buf);
-        XBZRLE.cache = NULL;
+    for (i = 0; i < SEND_CHANNELS.nb_channels; i++) {
+        SendChannel *c = &SEND_CHANNELS.channels[i];
+        int ret;
+
+        qemu_mutex_lock(&c->mutex);
+        while (c->sync) {
+            qemu_cond_wait(&c->cond, &c->mutex);
+        }
+        qemu_mutex_unlock(&c->mutex);
+
+        ret = qemu_file_get_error(c->file);
+        if (ret) {
+            qemu_file_set_error(f, ret);
+        }
     }
 }
 
-static void ram_migration_cancel(void *opaque)
-{
+/* Post-copy migration.  After a number of precopy rounds the source stops
+ * the guest, sends the list of pages that are still dirty along with the
+ * device state, and the destination starts the guest with those pages
+ * discarded.  userfaultfd turns accesses to missing pages into requests on
+ * a dedicated page connection; the source serves them ahead of the pages
+ * it pushes in the background until every page has been sent.
+ */
+static void migration_end(void);
+
+typedef struct PostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(PostcopyRequest) next;
+} PostcopyRequest;
+
+static struct {
+    /* pages to the destination */
+    QEMUFile *file;
+    /* page requests from the destination */
+    QEMUFile *return_file;
+    QemuThread thread;
+    QemuMutex mutex;
+    QSIMPLEQ_HEAD(, PostcopyRequest) requests;
+    bool active;
+    uint64_t requests_served;
+} POSTCOPY;
+
+static int postcopy_open(QEMUFile *f)
+{
+    Error *local_err = NULL;
+
+    POSTCOPY.file = tcp_open_outgoing_channel(migrate_get_current(),
+                                              &local_err);
+    if (!POSTCOPY.file) {
+        fprintf(stderr, "Could not open post-copy page channel: %s\n",
+                error_get_pretty(local_err));
+        error_free(local_err);
+        return -1;
+    }
+    qemu_put_be32(POSTCOPY.file, RAM_CHANNEL_MAGIC);
+    qemu_fflush(POSTCOPY.file);
+
+    qemu_mutex_init(&POSTCOPY.mutex);
+    QSIMPLEQ_INIT(&POSTCOPY.requests);
+    POSTCOPY.active = false;
+    POSTCOPY.requests_served = 0;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+    qemu_put_byte(f, RAM_COMMAND_POSTCOPY_OPEN);
+    return 0;
+}
+
+static void postcopy_close(void)
+{
+    PostcopyRequest *req, *next_req;
+
+    QSIMPLEQ_FOREACH_SAFE(req, &POSTCOPY.requests, next, next_req) {
+        g_free(req);
+    }
+    QSIMPLEQ_INIT(&POSTCOPY.requests);
+    qemu_mutex_destroy(&POSTCOPY.mutex);
+    qemu_fclose(POSTCOPY.file);
+    POSTCOPY.file = NULL;
+    POSTCOPY.active = false;
+}
+
+bool ram_postcopy_ready(void)
+{
+    /* The first sync happens during setup */
+    return POSTCOPY.file &&
+           migration_bitmap_sync_count > migrate_postcopy_rounds();
+}
+
+void ram_postcopy_begin(void)
+{
+    assert(POSTCOPY.file);
+    POSTCOPY.active = true;
+}
+
+uint64_t ram_postcopy_requests(void)
+{
+    return POSTCOPY.requests_served;
+}
+
+/* Sends the ranges of pages the destination must discard, then switches it
+ * to post-copy.  Called with the guest stopped.  */
+static void postcopy_send_discard(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->length >> TARGET_PAGE_BITS);
+        unsigned long start = find_next_bit(migration_bitmap, last, first);
+
+        if (start >= last) {
+            continue;
+        }
+
+        qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+        qemu_put_byte(f, RAM_COMMAND_POSTCOPY_DISCARD);
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        while (start < last) {
+            unsigned long end = find_next_zero_bit(migration_bitmap, last,
+                                                   start);
+
+            qemu_put_be64(f, (uint64_t)(start - first) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, (uint64_t)(end - start) << TARGET_PAGE_BITS);
+            start = find_next_bit(migration_bitmap, last, end);
+        }
+        qemu_put_be64(f, 0);
+        qemu_put_be64(f, 0);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_COMMAND);
+    qemu_put_byte(f, RAM_COMMAND_POSTCOPY_RUN);
+}
+
+static void *postcopy_return_thread(void *opaque)
+{
+    QEMUFile *f = POSTCOPY.return_file;
+    RAMBlock *last_block = NULL;
+
+    while (true) {
+        ram_addr_t addr = qemu_get_be64(f);
+        int flags = addr & ~TARGET_PAGE_MASK;
+        PostcopyRequest *req;
+        RAMBlock *block;
+
+        addr &= TARGET_PAGE_MASK;
+        /* The destination closes the channel once it has every page */
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+
+        block = block_from_stream(f, &last_block, addr, flags);
+        if (!(flags & RAM_SAVE_FLAG_PAGE) || !block) {
+            fprintf(stderr, "Bad post-copy page request\n");
+            break;
+        }
+
+        req = g_new0(PostcopyRequest, 1);
+        req->block = block;
+        req->offset = addr;
+        qemu_mutex_lock(&POSTCOPY.mutex);
+        QSIMPLEQ_INSERT_TAIL(&POSTCOPY.requests, req, next);
+        qemu_mutex_unlock(&POSTCOPY.mutex);
+    }
+
+    return NULL;
+}
+
+static int postcopy_send_page(RAMBlock *block, ram_addr_t offset,
+                              RAMBlock **last_block)
+{
+    int cont = (block == *last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int bytes_sent;
+
+    bytes_sent = save_block_hdr(POSTCOPY.file, block, offset, cont,
+                                RAM_SAVE_FLAG_PAGE);
+    qemu_put_buffer_async(POSTCOPY.file, block->host + offset,
+                          TARGET_PAGE_SIZE);
+    *last_block = block;
+    acct_info.norm_pages++;
+
+    return bytes_sent + TARGET_PAGE_SIZE;
+}
+
+/*
+ * ram_postcopy_push: Sends every page still dirty after the switch to
+ * post-copy, serving the pages requested by the destination first.
+ * Called from the migration thread with the guest stopped.
+ *
+ * Returns 0 on success, negative errno otherwise.
+ */
+int ram_postcopy_push(void)
+{
+    RAMBlock *block, *last_block = NULL;
+    ram_addr_t offset = 0;
+    int fd;
+    int ret;
+
+    fd = dup(qemu_get_fd(POSTCOPY.file));
+    if (fd < 0) {
+        return -errno;
+    }
+    POSTCOPY.return_file = qemu_fopen_socket(fd, "rb");
+    qemu_thread_create(&POSTCOPY.thread, postcopy_return_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+
+    qemu_mutex_lock_ramlist();
+    ram_bulk_stage = false;
+    block = QTAILQ_FIRST(&ram_list.blocks);
+    while (block && !qemu_file_get_error(POSTCOPY.file)) {
+        PostcopyRequest *req;
+
+        qemu_mutex_lock(&POSTCOPY.mutex);
+        req = QSIMPLEQ_FIRST(&POSTCOPY.requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&POSTCOPY.requests, next);
+        }
+        qemu_mutex_unlock(&POSTCOPY.mutex);
+
+        if (req) {
+            /* The guest is waiting for it.  The page may be clean, e.g. a
+             * zero page the destination never touched; send it anyway.  */
+            unsigned long nr = (req->block->offset + req->offset) >>
+                               TARGET_PAGE_BITS;
+
+            if (test_and_clear_bit(nr, migration_bitmap)) {
+                migration_dirty_pages--;
+            }
+            bytes_transferred += postcopy_send_page(req->block, req->offset,
+                                                    &last_block);
+            qemu_fflush(POSTCOPY.file);
+            POSTCOPY.requests_served++;
+            g_free(req);
+            continue;
+        }
+
+        offset = migration_bitmap_find_and_reset_dirty(block->mr, offset);
+        if (offset >= block->length) {
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            continue;
+        }
+        bytes_transferred += postcopy_send_page(block, offset, &last_block);
+    }
+
+    qemu_put_be64(POSTCOPY.file, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(POSTCOPY.file);
+    ret = qemu_file_get_error(POSTCOPY.file);
+    qemu_mutex_unlock_ramlist();
+
+    /* Pages may still be in flight to the destination: wait for it to
+     * close the channel rather than shutting it down.  */
+    qemu_thread_join(&POSTCOPY.thread);
+    qemu_fclose(POSTCOPY.return_file);
+    POSTCOPY.return_file = NULL;
+
+    migration_end();
+    return ret;
+}
+
+/*
+ * ram_save_block: Writes a page of memory to the stream f
+ *
+ * Returns:  The number of pages found, 0 means no dirty pages.
+ *           The number of bytes written is added to *bytes_written; with
+ *           compression, a page is accounted when it reaches the stream.
+ */
+
+static int ram_save_block(QEMUFile *f, bool last_stage, int *bytes_written)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int pages = 0;
+    int bytes_sent = 0;
+    MemoryRegion *mr;
+    ram_addr_t current_addr;
+
+    if (!block)
+        block = QTAILQ_FIRST(&ram_list.blocks);
+
+    while (true) {
+        mr = block->mr;
+        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        if (complete_round && block == last_seen_block &&
+            offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+                complete_round = true;
+                ram_bulk_stage = false;
+            }
+        } else {
+            int ret;
+            uint8_t *p;
+            int cont = (block == last_sent_block) ?
+                RAM_SAVE_FLAG_CONTINUE : 0;
+
+            p = memory_region_get_ram_ptr(mr) + offset;
+
+            /* In doubt sent page as normal */
+            bytes_sent = -1;
+            ret = ram_control_save_page(f, block->offset,
+                               offset, TARGET_PAGE_SIZE, &bytes_sent);
+
+            if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+                if (ret != RAM_SAVE_CONTROL_DELAYED) {
+                    if (bytes_sent > 0) {
+                        acct_info.norm_pages++;
+                    } else if (bytes_sent == 0) {
+                        acct_info.dup_pages++;
+                    }
+                }
+            } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+                acct_info.dup_pages++;
+                bytes_sent = save_block_hdr(f, block, offset, cont,
+                                            RAM_SAVE_FLAG_COMPRESS);
+                qemu_put_byte(f, 0);
+                bytes_sent++;
+            } else if (migrate_use_compression()) {
+                *bytes_written += compress_page_with_threads(f, block, offset,
+                                                             p);
+                pages = 1;
+                break;
+            } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+                current_addr = block->offset + offset;
+                XBZRLE_cache_lock();
+                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                              offset, cont, last_stage);
+                if (bytes_sent == -1) {
+                    /* Send what the cache holds, so that both sides agree.
+                     * Copy it: the cache reuses its buffers on replacement.
+                     */
+                    if (!last_stage) {
+                        p = get_cached_data(XBZRLE.cache, current_addr);
+                    }
+                    bytes_sent = save_block_hdr(f, block, offset, cont,
+                                                RAM_SAVE_FLAG_PAGE);
+                    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                    bytes_sent += TARGET_PAGE_SIZE;
+                    acct_info.norm_pages++;
+                }
+                XBZRLE_cache_unlock();
+            }
+
+            /* Normal pages go to the RAM channels */
+            if (bytes_sent == -1 && SEND_CHANNELS.nb_channels &&
+                !migrate_use_xbzrle()) {
+                *bytes_written += channel_send_page(f, block, offset, p);
+                acct_info.norm_pages++;
+                pages = 1;
+                break;
+            }
+
+            /* normal page */
+            if (bytes_sent == -1) {
+                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                bytes_sent += TARGET_PAGE_SIZE;
+                acct_info.norm_pages++;
+            }
+
+            /* if page is unmodified, continue to the next */
+            if (bytes_sent > 0) {
+                last_sent_block = block;
+                *bytes_written += bytes_sent;
+                pages = 1;
+                break;
+            }
+        }
+    }
+    last_seen_block = block;
+    last_offset = offset;
+
+    return pages;
+}
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    uint64_t pages = size / TARGET_PAGE_SIZE;
+    if (zero) {
+        acct_info.dup_pages += pages;
+    } else {
+        acct_info.norm_pages += pages;
+        bytes_transferred += size;
+        qemu_update_position(f, size);
+    }
+}
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+static void migration_end(void)
+{
+    mig_throttle_set(0);
+    ram_save_notify(RAM_SAVE_END);
+
+    if (migration_bitmap) {
+        memory_global_dirty_log_stop();
+        g_free(migration_bitmap);
+        migration_bitmap = NULL;
+    }
+
+    XBZRLE_cache_lock();
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        g_free(XBZRLE.decoded_buf);
+        XBZRLE.cache = NULL;
+    }
+    XBZRLE_cache_unlock();
+
+    if (COMPRESS.params) {
+        compress_threads_join();
+    }
+
+    if (SEND_CHANNELS.channels) {
+        send_channels_join();
+    }
+
+    if (POSTCOPY.file) {
+        postcopy_close();
+    }
+}
+
+static void ram_migration_cancel(void *opaque)
+{
     migration_end();
 }
 
@@ -614,13 +1465,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap = bitmap_new(ram_pages);
     bitmap_set(migration_bitmap, 0, ram_pages);
     migration_dirty_pages = ram_pages;
-    mig_throttle_on = false;
-    dirty_rate_high_cnt = 0;
+    mig_throttle_set(0);
 
     if (migrate_use_xbzrle()) {
+        XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
                                   TARGET_PAGE_SIZE);
+        XBZRLE_cache_unlock();
         if (!XBZRLE.cache) {
             DPRINTF("Error creating cache\n");
             return -1;
@@ -630,216 +1482,864 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_compression()) {
+        compress_threads_create();
+        acct_clear();
+    }
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
+    migration_bitmap_sync_count = 0;
+    ram_free_page_hinted = false;
     reset_ram_globals();
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
-    qemu_mutex_unlock_iothread();
+    memory_global_dirty_log_start();
+    migration_bitmap_sync();
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+
+    qemu_mutex_unlock_ramlist();
+
+    /* Snapshots are written to a single stream */
+    if (migrate_postcopy_ram() && f == migrate_get_current()->file) {
+        if (postcopy_open(f) < 0) {
+            return -1;
+        }
+    }
+    if (migrate_use_multichannel() && f == migrate_get_current()->file) {
+        if (send_channels_create(f) < 0) {
+            return -1;
+        }
+        send_channels_sync(f);
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
+    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+    int i;
+    int64_t t0;
+    int total_sent = 0;
+
+    qemu_mutex_lock_ramlist();
+
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+
+    t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        /* no more blocks to sent */
+        if (ram_save_block(f, false, &total_sent) == 0) {
+            break;
+        }
+        acct_info.iterations++;
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) / 1000000;
+            if (t1 > MAX_WAIT) {
+                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
+                        t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+
+    total_sent += flush_compressed_data(f);
+    send_channels_sync(f);
+    qemu_mutex_unlock_ramlist();
+
+    /*
+     * Must occur before EOS (or any QEMUFile operation)
+     * because of RDMA protocol.
+     */
+    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+
+    bytes_transferred += total_sent;
+
+    /*
+     * Do not count these 8 bytes into total_sent, so that we can
+     * return 0 if no page had been dirtied.
+     */
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    bytes_transferred += 8;
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return total_sent;
+}
+
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    if (POSTCOPY.active) {
+        /* The remaining pages follow from ram_postcopy_push() */
+        postcopy_send_discard(f);
+        send_channels_sync(f);
+        qemu_mutex_unlock_ramlist();
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int bytes_sent = 0;
+
+        /* no more blocks to sent */
+        if (ram_save_block(f, true, &bytes_sent) == 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+    bytes_transferred += flush_compressed_data(f);
+    send_channels_sync(f);
+
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    migration_end();
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+
+    if (remaining_size < max_size) {
+        qemu_mutex_lock_iothread();
+        migration_bitmap_sync();
+        qemu_mutex_unlock_iothread();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+    return remaining_size;
+}
+
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    int ret, rc = 0;
+    unsigned int xh_len;
+    int xh_flags;
+
+    if (!XBZRLE.decoded_buf) {
+        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -1;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -1;
+    }
+    /* load data and decode */
+    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+
+    /* decode RLE */
+    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
+                               TARGET_PAGE_SIZE);
+    if (ret == -1) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        rc = -1;
+    } else  if (ret > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
+                ret, TARGET_PAGE_SIZE);
+        abort();
+    }
+
+    return rc;
+}
+
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    static RAMBlock *block = NULL;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return memory_region_get_ram_ptr(block->mr) + offset;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id)))
+            return memory_region_get_ram_ptr(block->mr) + offset;
+    }
+
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+/* Multi-threaded page decompression on the destination.  Pages of a
+ * section are all distinct, so they can be decompressed in any order as
+ * long as every thread is done before the section ends.
+ */
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool busy;
+    bool quit;
+    bool failed;
+    void *host;
+    uint8_t *buf;
+    unsigned long len;
+} DecompressParam;
+
+static struct {
+    DecompressParam *params;
+    int nb_threads;
+    int next;
+} DECOMPRESS;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->busy) {
+            unsigned long len = TARGET_PAGE_SIZE;
+            int ret;
+
+            qemu_mutex_unlock(&param->mutex);
+            ret = uncompress(param->host, &len, param->buf, param->len);
+            qemu_mutex_lock(&param->mutex);
+            if (ret != Z_OK || len != TARGET_PAGE_SIZE) {
+                param->failed = true;
+            }
+            param->busy = false;
+            qemu_cond_signal(&param->cond);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void decompress_threads_create(void)
+{
+    int i;
+
+    DECOMPRESS.nb_threads = migrate_decompress_threads();
+    DECOMPRESS.next = 0;
+    DECOMPRESS.params = g_new0(DecompressParam, DECOMPRESS.nb_threads);
+    for (i = 0; i < DECOMPRESS.nb_threads; i++) {
+        DecompressParam *param = &DECOMPRESS.params[i];
+
+        param->buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_decompress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    for (i = 0; i < DECOMPRESS.nb_threads; i++) {
+        DecompressParam *param = &DECOMPRESS.params[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+        qemu_cond_destroy(&param->cond);
+        qemu_mutex_destroy(&param->mutex);
+        g_free(param->buf);
+    }
+    g_free(DECOMPRESS.params);
+    DECOMPRESS.params = NULL;
+    DECOMPRESS.nb_threads = 0;
+}
+
+/* Returns true if @param finished its page successfully.  */
+static bool wait_for_decompress(DecompressParam *param)
+{
+    bool failed;
+
+    qemu_mutex_lock(&param->mutex);
+    while (param->busy) {
+        qemu_cond_wait(&param->cond, &param->mutex);
+    }
+    failed = param->failed;
+    param->failed = false;
+    qemu_mutex_unlock(&param->mutex);
+
+    return !failed;
+}
+
+static int wait_for_decompress_done(void)
+{
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < DECOMPRESS.nb_threads; i++) {
+        if (!wait_for_decompress(&DECOMPRESS.params[i])) {
+            ret = -EINVAL;
+        }
+    }
+    return ret;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    DecompressParam *param;
+    unsigned int len;
+
+    len = qemu_get_be32(f);
+    if (len == 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+        fprintf(stderr, "Failed to load compressed page - bad length %u\n",
+                len);
+        return -EINVAL;
+    }
+
+    if (!DECOMPRESS.params) {
+        decompress_threads_create();
+    }
+    param = &DECOMPRESS.params[DECOMPRESS.next];
+    if (!wait_for_decompress(param)) {
+        fprintf(stderr, "Failed to load compressed page - bad data\n");
+        return -EINVAL;
+    }
+
+    qemu_get_buffer(f, param->buf, len);
+    qemu_mutex_lock(&param->mutex);
+    param->host = host;
+    param->len = len;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    DECOMPRESS.next = (DECOMPRESS.next + 1) % DECOMPRESS.nb_threads;
+    return 0;
+}
+
+typedef struct RecvChannel {
+    QemuThread thread;
+    QEMUFile *file;
+    RAMBlock *last_block;
+    /* sync markers reached, protected by RECV_CHANNELS.mutex */
+    uint64_t synced;
+    bool failed;
+} RecvChannel;
+
+static struct {
+    RecvChannel *channels;
+    int nb_channels;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* sections completed by all channels */
+    uint64_t epoch;
+    bool quit;
+} RECV_CHANNELS;
+
+static void *do_channel_recv(void *opaque)
+{
+    RecvChannel *c = opaque;
+    QEMUFile *f = c->file;
+
+    if (qemu_get_be32(f) != RAM_CHANNEL_MAGIC) {
+        fprintf(stderr, "Bad migration channel magic\n");
+        goto out;
+    }
+
+    while (true) {
+        ram_addr_t addr = qemu_get_be64(f);
+        int flags = addr & ~TARGET_PAGE_MASK;
+
+        addr &= TARGET_PAGE_MASK;
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+
+        if (flags & RAM_SAVE_FLAG_PAGE) {
+            RAMBlock *block = block_from_stream(f, &c->last_block, addr,
+                                                flags);
+            if (!block) {
+                fprintf(stderr, "Ack, bad migration channel stream!\n");
+                break;
+            }
+            qemu_get_buffer(f, block->host + addr, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_EOS) {
+            bool quit;
+
+            c->last_block = NULL;
+            qemu_mutex_lock(&RECV_CHANNELS.mutex);
+            c->synced++;
+            qemu_cond_broadcast(&RECV_CHANNELS.cond);
+            while (RECV_CHANNELS.epoch < c->synced && !RECV_CHANNELS.quit) {
+                qemu_cond_wait(&RECV_CHANNELS.cond, &RECV_CHANNELS.mutex);
+            }
+            quit = RECV_CHANNELS.quit;
+            qemu_mutex_unlock(&RECV_CHANNELS.mutex);
+            if (quit) {
+                return NULL;
+            }
+        } else {
+            fprintf(stderr, "Unknown flags 0x%x in migration channel\n",
+                    flags);
+            break;
+        }
+    }
+
+out:
+    qemu_mutex_lock(&RECV_CHANNELS.mutex);
+    c->failed = true;
+    qemu_cond_broadcast(&RECV_CHANNELS.cond);
+    qemu_mutex_unlock(&RECV_CHANNELS.mutex);
+
+    return NULL;
+}
+
+static int recv_channels_create(int nb_channels)
+{
+    int i;
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    if (RECV_CHANNELS.channels || nb_channels < 1) {
+        fprintf(stderr, "Bad number of migration channels %d\n",
+                nb_channels);
+        return -EINVAL;
+    }
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
+    qemu_mutex_init(&RECV_CHANNELS.mutex);
+    qemu_cond_init(&RECV_CHANNELS.cond);
+    RECV_CHANNELS.epoch = 0;
+    RECV_CHANNELS.quit = false;
+    RECV_CHANNELS.channels = g_new0(RecvChannel, nb_channels);
+    for (i = 0; i < nb_channels; i++) {
+        RecvChannel *c = &RECV_CHANNELS.channels[i];
+        Error *local_err = NULL;
+
+        c->file = tcp_accept_incoming_channel(&local_err);
+        if (!c->file) {
+            fprintf(stderr, "%s\n", error_get_pretty(local_err));
+            error_free(local_err);
+            return -EINVAL;
+        }
+        qemu_thread_create(&c->thread, do_channel_recv, c,
+                           QEMU_THREAD_JOINABLE);
+        RECV_CHANNELS.nb_channels++;
     }
+    return 0;
+}
 
-    qemu_mutex_unlock_ramlist();
+/* Called at the end of each section of the main channel: waits until
+ * every channel has written its pages of the section and lets them go on
+ * with the next one.  */
+static int recv_channels_sync(void)
+{
+    uint64_t epoch;
+    int ret = 0;
+    int i;
 
-    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
-    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+    qemu_mutex_lock(&RECV_CHANNELS.mutex);
+    epoch = RECV_CHANNELS.epoch + 1;
+    for (i = 0; i < RECV_CHANNELS.nb_channels; i++) {
+        RecvChannel *c = &RECV_CHANNELS.channels[i];
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        while (c->synced < epoch && !c->failed) {
+            qemu_cond_wait(&RECV_CHANNELS.cond, &RECV_CHANNELS.mutex);
+        }
+        if (c->synced < epoch) {
+            ret = -EINVAL;
+        }
+    }
+    RECV_CHANNELS.epoch = epoch;
+    qemu_cond_broadcast(&RECV_CHANNELS.cond);
+    qemu_mutex_unlock(&RECV_CHANNELS.mutex);
 
-    return 0;
+    return ret;
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+void migrate_recv_channels_join(void)
 {
-    int ret;
     int i;
-    int64_t t0;
-    int total_sent = 0;
 
-    qemu_mutex_lock_ramlist();
+    if (!RECV_CHANNELS.channels) {
+        return;
+    }
 
-    if (ram_list.version != last_version) {
-        reset_ram_globals();
+    qemu_mutex_lock(&RECV_CHANNELS.mutex);
+    RECV_CHANNELS.quit = true;
+    qemu_cond_broadcast(&RECV_CHANNELS.cond);
+    qemu_mutex_unlock(&RECV_CHANNELS.mutex);
+
+    for (i = 0; i < RECV_CHANNELS.nb_channels; i++) {
+        RecvChannel *c = &RECV_CHANNELS.channels[i];
+
+        /* Kick threads still blocked in a read */
+        shutdown(qemu_get_fd(c->file), SHUT_RDWR);
+        qemu_thread_join(&c->thread);
+        qemu_fclose(c->file);
     }
+    g_free(RECV_CHANNELS.channels);
+    RECV_CHANNELS.channels = NULL;
+    RECV_CHANNELS.nb_channels = 0;
+    qemu_cond_destroy(&RECV_CHANNELS.cond);
+    qemu_mutex_destroy(&RECV_CHANNELS.mutex);
+}
 
-    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+#ifdef CONFIG_USERFAULTFD
+static struct {
+    /* pages from the source */
+    QEMUFile *file;
+    /* page requests to the source */
+    QEMUFile *return_file;
+    int uffd;
+    int quit_fds[2];
+    QemuThread page_thread;
+    QemuThread fault_thread;
+    /* set once the pages are discarded and userfaultfd is armed */
+    QemuEvent running;
+} POSTCOPY_IN = {
+    .uffd = -1,
+};
 
-    t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+static void *postcopy_fault_thread(void *opaque)
+{
+    RAMBlock *last_block = NULL;
+    struct pollfd pfd[2] = {
+        { .fd = POSTCOPY_IN.uffd, .events = POLLIN },
+        { .fd = POSTCOPY_IN.quit_fds[0], .events = POLLIN },
+    };
 
-        bytes_sent = ram_save_block(f, false);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
+    while (true) {
+        struct uffd_msg msg;
+        uintptr_t addr;
+        RAMBlock *block;
+        int cont;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             break;
         }
-        total_sent += bytes_sent;
-        acct_info.iterations++;
-        check_guest_throttling();
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) / 1000000;
-            if (t1 > MAX_WAIT) {
-                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
-                        t1, i);
+        if (pfd[1].revents) {
+            break;
+        }
+        if (read(POSTCOPY_IN.uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        addr = msg.arg.pagefault.address & ~(uintptr_t)(TARGET_PAGE_SIZE - 1);
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (addr - (uintptr_t)block->host < block->length) {
                 break;
             }
         }
-        i++;
-    }
+        if (!block) {
+            continue;
+        }
 
-    qemu_mutex_unlock_ramlist();
+        cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+        save_block_hdr(POSTCOPY_IN.return_file, block,
+                       addr - (uintptr_t)block->host, cont,
+                       RAM_SAVE_FLAG_PAGE);
+        qemu_fflush(POSTCOPY_IN.return_file);
+        last_block = block;
+        if (qemu_file_get_error(POSTCOPY_IN.return_file)) {
+            break;
+        }
+    }
 
-    /*
-     * Must occur before EOS (or any QEMUFile operation)
-     * because of RDMA protocol.
-     */
-    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+    return NULL;
+}
 
-    bytes_transferred += total_sent;
+static void postcopy_incoming_unregister(void)
+{
+    RAMBlock *block;
 
-    /*
-     * Do not count these 8 bytes into total_sent, so that we can
-     * return 0 if no page had been dirtied.
-     */
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    bytes_transferred += 8;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_range range = {
+            .start = (uintptr_t)block->host,
+            .len = block->length,
+        };
 
-    ret = qemu_file_get_error(f);
-    if (ret < 0) {
-        return ret;
+        ioctl(POSTCOPY_IN.uffd, UFFDIO_UNREGISTER, &range);
     }
-
-    return total_sent;
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+static void *postcopy_page_thread(void *opaque)
 {
-    qemu_mutex_lock_ramlist();
-    migration_bitmap_sync();
+    QEMUFile *f = POSTCOPY_IN.file;
+    RAMBlock *last_block = NULL;
+    uint8_t *buf = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    bool running = false;
+    bool done = false;
 
-    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+    while (true) {
+        ram_addr_t addr = qemu_get_be64(f);
+        int flags = addr & ~TARGET_PAGE_MASK;
+        struct uffdio_copy copy;
+        RAMBlock *block;
 
-    /* try transferring iterative blocks of memory */
+        addr &= TARGET_PAGE_MASK;
+        /* EOF before post-copy started: precopy completed the migration */
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            done = true;
+            break;
+        }
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+        block = block_from_stream(f, &last_block, addr, flags);
+        if (!(flags & RAM_SAVE_FLAG_PAGE) || !block) {
+            fprintf(stderr, "Ack, bad post-copy page stream!\n");
+            break;
+        }
+        qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (!running) {
+            qemu_event_wait(&POSTCOPY_IN.running);
+            running = true;
+        }
+
+        /* Fills the page atomically and wakes up the vCPUs waiting on it */
+        copy.dst = (uintptr_t)(block->host + addr);
+        copy.src = (uintptr_t)buf;
+        copy.len = TARGET_PAGE_SIZE;
+        copy.mode = 0;
+        if (ioctl(POSTCOPY_IN.uffd, UFFDIO_COPY, &copy) < 0 &&
+            errno != EEXIST) {
+            fprintf(stderr, "Failed to place post-copy page: %s\n",
+                    strerror(errno));
             break;
         }
-        bytes_transferred += bytes_sent;
     }
 
-    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    migration_end();
+    if (running) {
+        if (!done) {
+            /* The guest is running with pages that exist nowhere else */
+            fprintf(stderr, "Post-copy migration failed, guest RAM is "
+                    "incomplete\n");
+            exit(EXIT_FAILURE);
+        }
 
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        postcopy_incoming_unregister();
+        if (write(POSTCOPY_IN.quit_fds[1], "", 1) != 1) {
+            perror("post-copy fault thread");
+        }
+        qemu_thread_join(&POSTCOPY_IN.fault_thread);
+        close(POSTCOPY_IN.quit_fds[0]);
+        close(POSTCOPY_IN.quit_fds[1]);
+        close(POSTCOPY_IN.uffd);
+        POSTCOPY_IN.uffd = -1;
+    }
 
-    return 0;
+    qemu_fclose(POSTCOPY_IN.return_file);
+    qemu_fclose(f);
+    qemu_event_destroy(&POSTCOPY_IN.running);
+    qemu_vfree(buf);
+    DPRINTF("post-copy %s\n", done ? "completed" : "not used");
+
+    return NULL;
 }
 
-static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+static int postcopy_incoming_open(void)
 {
-    uint64_t remaining_size;
+    Error *local_err = NULL;
+    int fd;
 
-    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    POSTCOPY_IN.file = tcp_accept_incoming_channel(&local_err);
+    if (!POSTCOPY_IN.file) {
+        fprintf(stderr, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return -EINVAL;
+    }
+    if (qemu_get_be32(POSTCOPY_IN.file) != RAM_CHANNEL_MAGIC) {
+        fprintf(stderr, "Bad post-copy page channel magic\n");
+        qemu_fclose(POSTCOPY_IN.file);
+        return -EINVAL;
+    }
 
-    if (remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        migration_bitmap_sync();
-        qemu_mutex_unlock_iothread();
-        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    fd = dup(qemu_get_fd(POSTCOPY_IN.file));
+    if (fd < 0) {
+        qemu_fclose(POSTCOPY_IN.file);
+        return -errno;
     }
-    return remaining_size;
+    POSTCOPY_IN.return_file = qemu_fopen_socket(fd, "wb");
+
+    qemu_event_init(&POSTCOPY_IN.running, false);
+    qemu_thread_create(&POSTCOPY_IN.page_thread, postcopy_page_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+    return 0;
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+static int postcopy_incoming_discard(QEMUFile *f)
 {
-    int ret, rc = 0;
-    unsigned int xh_len;
-    int xh_flags;
+    RAMBlock *block = NULL;
 
-    if (!XBZRLE.decoded_buf) {
-        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    if (!block_from_stream(f, &block, 0, 0)) {
+        fprintf(stderr, "Unknown block in post-copy discard list\n");
+        return -EINVAL;
     }
 
-    /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
+    while (true) {
+        uint64_t start = qemu_get_be64(f);
+        uint64_t length = qemu_get_be64(f);
 
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
-        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
-        return -1;
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+        if (!length) {
+            return 0;
+        }
+        if (start > block->length || length > block->length - start) {
+            fprintf(stderr, "Bad post-copy discard range for %s\n",
+                    block->idstr);
+            return -EINVAL;
+        }
+        if (qemu_madvise(block->host + start, length, QEMU_MADV_DONTNEED)) {
+            return -errno;
+        }
     }
+}
 
-    if (xh_len > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
-        return -1;
+static int postcopy_incoming_run(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    RAMBlock *block;
+
+    POSTCOPY_IN.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (POSTCOPY_IN.uffd < 0) {
+        fprintf(stderr, "Could not open userfaultfd: %s\n", strerror(errno));
+        return -errno;
+    }
+    if (ioctl(POSTCOPY_IN.uffd, UFFDIO_API, &api) < 0) {
+        fprintf(stderr, "userfaultfd API mismatch: %s\n", strerror(errno));
+        return -errno;
     }
-    /* load data and decode */
-    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
 
-    /* decode RLE */
-    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
-                               TARGET_PAGE_SIZE);
-    if (ret == -1) {
-        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
-        rc = -1;
-    } else  if (ret > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
-                ret, TARGET_PAGE_SIZE);
-        abort();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg = {
+            .range = {
+                .start = (uintptr_t)block->host,
+                .len = block->length,
+            },
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+        };
+
+        if (block->fd >= 0 || block->page_size != TARGET_PAGE_SIZE) {
+            fprintf(stderr, "Post-copy migration needs anonymous RAM with "
+                    "%d byte pages, %s does not qualify\n",
+                    TARGET_PAGE_SIZE, block->idstr);
+            return -EINVAL;
+        }
+        if (ioctl(POSTCOPY_IN.uffd, UFFDIO_REGISTER, &reg) < 0) {
+            fprintf(stderr, "Could not register %s with userfaultfd: %s\n",
+                    block->idstr, strerror(errno));
+            return -errno;
+        }
     }
 
-    return rc;
+    if (qemu_pipe(POSTCOPY_IN.quit_fds) < 0) {
+        return -errno;
+    }
+    qemu_thread_create(&POSTCOPY_IN.fault_thread, postcopy_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    qemu_event_set(&POSTCOPY_IN.running);
+    return 0;
 }
-
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+#else
+static int postcopy_incoming_open(void)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
-
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
-        }
+    fprintf(stderr, "Post-copy migration is not supported on this host\n");
+    return -ENOSYS;
+}
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
-    }
+static int postcopy_incoming_discard(QEMUFile *f)
+{
+    return -ENOSYS;
+}
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+static int postcopy_incoming_run(void)
+{
+    return -ENOSYS;
+}
+#endif
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+static int ram_load_command(QEMUFile *f)
+{
+    int cmd = qemu_get_byte(f);
+
+    switch (cmd) {
+    case RAM_COMMAND_CHANNELS:
+        return recv_channels_create(qemu_get_be32(f));
+    case RAM_COMMAND_POSTCOPY_OPEN:
+        return postcopy_incoming_open();
+    case RAM_COMMAND_POSTCOPY_DISCARD:
+        return postcopy_incoming_discard(f);
+    case RAM_COMMAND_POSTCOPY_RUN:
+        return postcopy_incoming_run();
+    default:
+        fprintf(stderr, "Unknown RAM command %d\n", cmd);
+        return -EINVAL;
     }
-
-    fprintf(stderr, "Can't find block %s!\n", id);
-    return NULL;
 }
 
 /*
@@ -914,13 +2414,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
+        if (flags & RAM_SAVE_FLAG_COMMAND) {
+            ret = ram_load_command(f);
+            if (ret < 0) {
+                goto done;
+            }
+        }
+
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             ch = qemu_get_byte(f);
@@ -930,14 +2438,27 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            ret = load_compressed_page(f, host);
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             if (load_xbzrle(f, addr, host) < 0) {
@@ -955,12 +2476,20 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (wait_for_decompress_done() < 0 && ret == 0) {
+        fprintf(stderr, "Failed to load compressed page - bad data\n");
+        ret = -EINVAL;
+    }
+    if (ret == 0 && RECV_CHANNELS.channels && recv_channels_sync() < 0) {
+        fprintf(stderr, "Failed to load RAM from migration channel\n");
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
 }
 
-SaveVMHandlers savevm_ram_handlers = {
+static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
@@ -969,6 +2498,14 @@ SaveVMHandlers savevm_ram_handlers = {
     .cancel = ram_migration_cancel,
 };
 
+void ram_mig_init(void)
+{
+    qemu_mutex_init(&XBZRLE.lock);
+    mig_throttle_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                      mig_throttle_timer_tick, NULL);
+    register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
+}
+
 struct soundhw {
     const char *name;
     const char *descr;
@@ -1175,51 +2712,65 @@ TargetInfo *qmp_query_target(Error **errp)
     return info;
 }
 
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
+/* Sleeps long enough to leave the vCPU running for only
+   100 - mig_throttle_percentage percent of the time */
 static void mig_sleep_cpu(void *opq)
 {
+    CPUState *cpu = opq;
+    double pct = atomic_read(&mig_throttle_percentage) / 100.0;
+
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep(pct / (1 - pct) * THROTTLE_TIMESLICE_NS / 1000);
     qemu_mutex_lock_iothread();
+    cpu->throttle_scheduled = false;
 }
 
 /* To reduce the dirty rate explicitly disallow the VCPUs from spending
    much time in the VM. The migration thread will try to catchup.
    Workload will experience a performance drop.
 */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
+    int percentage = atomic_read(&mig_throttle_percentage);
+    double pct = percentage / 100.0;
+
+    /* throttling was stopped, do not rearm */
+    if (!percentage) {
+        return;
+    }
 
-    qemu_mutex_lock_iothread();
     CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
+        if (!cpu->throttle_scheduled) {
+            cpu->throttle_scheduled = true;
+            async_run_on_cpu(cpu, mig_sleep_cpu, cpu);
+        }
     }
-    qemu_mutex_unlock_iothread();
+
+    /* one timeslice of running time, plus the sleep */
+    timer_mod(mig_throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+              THROTTLE_TIMESLICE_NS / (1 - pct));
 }
 
-static void check_guest_throttling(void)
+/* Can be called from any thread, with or without the iothread lock */
+static void mig_throttle_set(int percentage)
 {
-    static int64_t t0;
-    int64_t        t1;
+    int old;
 
-    if (!mig_throttle_on) {
+    percentage = MIN(MAX(percentage, 0), THROTTLE_MAX);
+    old = atomic_xchg(&mig_throttle_percentage, percentage);
+    if (percentage == old) {
         return;
     }
+    trace_migration_throttle(percentage);
 
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
+    /* the timer stops by itself once the percentage drops to zero */
+    if (!old) {
+        timer_mod(mig_throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
     }
+}
 
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
-    }
+int64_t migration_throttle_percentage(void)
+{
+    return atomic_read(&mig_throttle_percentage);
 }
@@ -26,6 +26,7 @@
 #include "block/aio.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
+#include "qemu/stats.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
@@ -35,7 +36,9 @@ struct QEMUBH {
     QEMUBHFunc *cb;
     void *opaque;
     QEMUBH *next;
+    QEMUBH *next_scheduled;
     bool scheduled;
+    bool queued;        /* on ctx->scheduled_bh or ctx->running_bh */
     bool idle;
     bool deleted;
 };
@@ -56,45 +59,81 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
     return bh;
 }
 
+/* Move the bottom halves scheduled since the last call to the end of
+ * ctx->running_bh, oldest first.
+ */
+static void aio_bh_take_scheduled(AioContext *ctx)
+{
+    QEMUBH *bh, *next, *list = NULL;
+    QEMUBH **tail;
+
+    bh = atomic_xchg(&ctx->scheduled_bh, NULL);
+    while (bh) {
+        /* Make sure that fetching bh happens before accessing its members */
+        smp_read_barrier_depends();
+        next = bh->next_scheduled;
+        bh->next_scheduled = list;
+        list = bh;
+        bh = next;
+    }
+
+    tail = &ctx->running_bh;
+    while (*tail) {
+        tail = &(*tail)->next_scheduled;
+    }
+    *tail = list;
+}
+
 /* Multiple occurrences of aio_bh_poll cannot be called concurrently */
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
+    QEMUBH *bh, **bhp;
     int ret;
 
     ctx->walking_bh++;
+    aio_bh_take_scheduled(ctx);
 
+    /* A nested aio_bh_poll, called from one of the callbacks, continues
+     * with the bottom halves that are still on ctx->running_bh.
+     */
     ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        /* Make sure that fetching bh happens before accessing its members */
-        smp_read_barrier_depends();
-        next = bh->next;
-        if (!bh->deleted && bh->scheduled) {
-            bh->scheduled = 0;
-            /* Paired with write barrier in bh schedule to ensure reading for
-             * idle & callbacks coming after bh's scheduling.
-             */
-            smp_rmb();
-            if (!bh->idle)
-                ret = 1;
-            bh->idle = 0;
-            bh->cb(bh->opaque);
+    while ((bh = ctx->running_bh)) {
+        ctx->running_bh = bh->next_scheduled;
+        /* From now on qemu_bh_schedule must queue bh again.  Paired with
+         * the barrier in qemu_bh_schedule, so that either we see
+         * bh->scheduled or it sees bh->queued cleared.
+         */
+        atomic_mb_set(&bh->queued, false);
+        if (bh->deleted || !atomic_xchg(&bh->scheduled, false)) {
+            /* canceled after it was scheduled */
+            continue;
+        }
+        if (!bh->idle) {
+            ret = 1;
         }
+        bh->idle = 0;
+        stats_counter_inc(ctx->stat_bh_runs);
+        bh->cb(bh->opaque);
     }
 
     ctx->walking_bh--;
 
     /* remove deleted bhs */
-    if (!ctx->walking_bh) {
+    if (!ctx->walking_bh && atomic_read(&ctx->deleted_bh)) {
+        atomic_mb_set(&ctx->deleted_bh, false);
         qemu_mutex_lock(&ctx->bh_lock);
         bhp = &ctx->first_bh;
         while (*bhp) {
             bh = *bhp;
-            if (bh->deleted) {
+            if (!bh->deleted) {
+                bhp = &bh->next;
+            } else if (atomic_read(&bh->queued)) {
+                /* still linked on ctx->scheduled_bh, try again next time */
+                ctx->deleted_bh = true;
+                bhp = &bh->next;
+            } else {
                 *bhp = bh->next;
                 g_free(bh);
-            } else {
-                bhp = &bh->next;
             }
         }
         qemu_mutex_unlock(&ctx->bh_lock);
@@ -103,29 +142,46 @@ int aio_bh_poll(AioContext *ctx)
     return ret;
 }
 
-void qemu_bh_schedule_idle(QEMUBH *bh)
+/* Mark bh as scheduled and link it on ctx->scheduled_bh unless it is
+ * there already.  Returns false if bh was already scheduled.
+ */
+static bool aio_bh_enqueue(QEMUBH *bh, bool idle)
 {
-    if (bh->scheduled)
-        return;
-    bh->idle = 1;
+    AioContext *ctx = bh->ctx;
+    QEMUBH *old;
+
+    if (atomic_read(&bh->scheduled)) {
+        return false;
+    }
+    bh->idle = idle;
     /* Make sure that idle & any writes needed by the callback are done
      * before the locations are read in the aio_bh_poll.
      */
     smp_wmb();
-    bh->scheduled = 1;
+    if (atomic_xchg(&bh->scheduled, true)) {
+        return false;
+    }
+    if (atomic_xchg(&bh->queued, true)) {
+        /* canceled and scheduled again before aio_bh_poll saw it */
+        return true;
+    }
+    do {
+        old = atomic_read(&ctx->scheduled_bh);
+        bh->next_scheduled = old;
+    } while (atomic_cmpxchg(&ctx->scheduled_bh, old, bh) != old);
+    return true;
+}
+
+void qemu_bh_schedule_idle(QEMUBH *bh)
+{
+    aio_bh_enqueue(bh, true);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    if (bh->scheduled)
-        return;
-    bh->idle = 0;
-    /* Make sure that idle & any writes needed by the callback are done
-     * before the locations are read in the aio_bh_poll.
-     */
-    smp_wmb();
-    bh->scheduled = 1;
-    aio_notify(bh->ctx);
+    if (aio_bh_enqueue(bh, false)) {
+        aio_notify(bh->ctx);
+    }
 }
 
 
@@ -143,30 +199,55 @@ void qemu_bh_delete(QEMUBH *bh)
 {
     bh->scheduled = 0;
     bh->deleted = 1;
+    atomic_mb_set(&bh->ctx->deleted_bh, true);
+}
+
+/* Look for scheduled bottom halves without taking them.  Returns true if
+ * one of them is not idle; *idle is set if there are only idle ones.
+ */
+static bool aio_bh_pending(AioContext *ctx, bool *idle)
+{
+    QEMUBH *lists[2] = { ctx->running_bh, atomic_read(&ctx->scheduled_bh) };
+    QEMUBH *bh;
+    int i;
+
+    *idle = false;
+    for (i = 0; i < ARRAY_SIZE(lists); i++) {
+        /* Only aio_bh_poll, which runs in this thread, takes bottom halves
+         * off the lists, so walking them is safe.
+         */
+        for (bh = lists[i]; bh; bh = bh->next_scheduled) {
+            smp_read_barrier_depends();
+            if (!bh->deleted && bh->scheduled) {
+                if (!bh->idle) {
+                    return true;
+                }
+                *idle = true;
+            }
+        }
+    }
+    return false;
 }
 
 static gboolean
 aio_ctx_prepare(GSource *source, gint    *timeout)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
+    bool idle;
     int deadline;
 
     /* We assume there is no timeout already supplied */
     *timeout = -1;
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            if (bh->idle) {
-                /* idle bottom halves will be polled at least
-                 * every 10ms */
-                *timeout = 10;
-            } else {
-                /* non-idle bottom halves will be executed
-                 * immediately */
-                *timeout = 0;
-                return true;
-            }
-        }
+    if (aio_bh_pending(ctx, &idle)) {
+        /* non-idle bottom halves will be executed
+         * immediately */
+        *timeout = 0;
+        return true;
+    }
+    if (idle) {
+        /* idle bottom halves will be polled at least
+         * every 10ms */
+        *timeout = 10;
     }
 
     deadline = qemu_timeout_ns_to_ms(timerlistgroup_deadline_ns(&ctx->tlg));
@@ -184,12 +265,10 @@ static gboolean
 aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
+    bool idle;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            return true;
-	}
+    if (aio_bh_pending(ctx, &idle) || idle) {
+        return true;
     }
     return aio_pending(ctx) || (timerlistgroup_deadline_ns(&ctx->tlg) == 0);
 }
@@ -216,7 +295,10 @@ aio_ctx_finalize(GSource     *source)
     event_notifier_cleanup(&ctx->notifier);
     qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
+    aio_context_destroy(ctx);
+    rfifolock_destroy(&ctx->lock);
     timerlistgroup_deinit(&ctx->tlg);
+    stats_free(ctx->stats);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -242,7 +324,21 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
 
 void aio_notify(AioContext *ctx)
 {
-    event_notifier_set(&ctx->notifier);
+    /* Write to the eventfd only once until the event loop has consumed it */
+    if (!atomic_xchg(&ctx->notified, true)) {
+        event_notifier_set(&ctx->notifier);
+    }
+}
+
+static void aio_notify_accept(EventNotifier *e)
+{
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    /* Clear the flag first, so that a concurrent aio_notify sets the
+     * notifier again rather than being lost.
+     */
+    atomic_mb_set(&ctx->notified, false);
+    event_notifier_test_and_clear(e);
 }
 
 static void aio_timerlist_notify(void *opaque)
@@ -250,17 +346,27 @@ static void aio_timerlist_notify(void *opaque)
     aio_notify(opaque);
 }
 
+static void aio_rfifolock_cb(void *opaque)
+{
+    /* Kick owner thread in case they are blocked in aio_poll() */
+    aio_notify(opaque);
+}
+
 AioContext *aio_context_new(void)
 {
+    static int aio_context_count;
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    ctx->stats = stats_new("aio-context/%d", aio_context_count++);
+    ctx->stat_polls = stats_add_counter(ctx->stats, "polls");
+    ctx->stat_bh_runs = stats_add_counter(ctx->stats, "bh-runs");
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    aio_context_setup(ctx);
     ctx->thread_pool = NULL;
     qemu_mutex_init(&ctx->bh_lock);
+    rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     event_notifier_init(&ctx->notifier, false);
-    aio_set_event_notifier(ctx, &ctx->notifier, 
-                           (EventNotifierHandler *)
-                           event_notifier_test_and_clear);
+    aio_set_event_notifier(ctx, &ctx->notifier, aio_notify_accept);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
     return ctx;
@@ -275,3 +381,13 @@ void aio_context_unref(AioContext *ctx)
 {
     g_source_unref(&ctx->source);
 }
+
+void aio_context_acquire(AioContext *ctx)
+{
+    rfifolock_lock(&ctx->lock);
+}
+
+void aio_context_release(AioContext *ctx)
+{
+    rfifolock_unlock(&ctx->lock);
+}
@@ -1124,8 +1124,12 @@ static int audio_is_timer_needed (void)
 static void audio_reset_timer (AudioState *s)
 {
     if (audio_is_timer_needed ()) {
-        timer_mod (s->ts,
-            qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + conf.period.ticks);
+        /* Enabling another voice must not push back a pending tick */
+        if (!timer_pending (s->ts)) {
+            s->next_tick =
+                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + conf.period.ticks;
+            timer_mod (s->ts, s->next_tick);
+        }
     }
     else {
         timer_del (s->ts);
@@ -1134,8 +1138,27 @@ static void audio_reset_timer (AudioState *s)
 
 static void audio_timer (void *opaque)
 {
+    AudioState *s = opaque;
+    int64_t now;
+
     audio_run ("timer");
-    audio_reset_timer (opaque);
+
+    if (!audio_is_timer_needed ()) {
+        timer_del (s->ts);
+        return;
+    }
+
+    /*
+     * Keep the ticks on a fixed schedule, so that running late because
+     * the main loop was busy does not delay the following ticks as well.
+     * After falling more than a period behind, start over from now.
+     */
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->next_tick += conf.period.ticks;
+    if (s->next_tick <= now) {
+        s->next_tick = now + conf.period.ticks;
+    }
+    timer_mod (s->ts, s->next_tick);
 }
 
 /*
@@ -193,6 +193,7 @@ struct AudioState {
     void *drv_opaque;
 
     QEMUTimer *ts;
+    int64_t next_tick;
     QLIST_HEAD (card_listhead, QEMUSoundCard) card_head;
     QLIST_HEAD (hw_in_listhead, HWVoiceIn) hw_head_in;
     QLIST_HEAD (hw_out_listhead, HWVoiceOut) hw_head_out;
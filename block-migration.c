@@ -18,6 +18,8 @@
 #include "hw/hw.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/hbitmap.h"
+#include "qemu/host-utils.h"
 #include "migration/block.h"
 #include "migration/migration.h"
 #include "sysemu/blockdev.h"
@@ -30,6 +32,7 @@
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
 #define BLK_MIG_FLAG_ZERO_BLOCK         0x08
+#define BLK_MIG_FLAG_SIZED_BLOCK        0x10
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -56,7 +59,7 @@ typedef struct BlkMigDevState {
     int64_t cur_dirty;
 
     /* Protected by block migration lock.  */
-    unsigned long *aio_bitmap;
+    HBitmap *aio_bitmap;
     int64_t completed_sectors;
 } BlkMigDevState;
 
@@ -66,6 +69,7 @@ typedef struct BlkMigBlock {
     BlkMigDevState *bmds;
     int64_t sector;
     int nr_sectors;
+    bool zero;
     struct iovec iov;
     QEMUIOVector qiov;
     BlockDriverAIOCB *aiocb;
@@ -82,16 +86,21 @@ typedef struct BlkMigState {
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     int64_t total_sector_sum;
     bool zero_blocks;
+    /* dirty tracking granularity, and whether blocks carry their length */
+    int chunk_sectors;
+    bool sized_blocks;
 
     /* Protected by lock.  */
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
     int read_done;
+    int64_t pending_bytes;
 
     /* Only used by migration thread.  Does not need a lock.  */
     int transferred;
     int prev_progress;
     int bulk_completed;
+    BlkMigDevState *bulk_next;
 
     /* Lock must be taken _inside_ the iothread lock.  */
     QemuMutex lock;
@@ -109,6 +118,46 @@ static void blk_mig_unlock(void)
     qemu_mutex_unlock(&block_mig_state.lock);
 }
 
+/* Size of the data of a block in the stream.  Without the length in the
+ * stream every block is BLOCK_SIZE bytes, even at the end of the device.
+ */
+static int blk_data_size(BlkMigBlock *blk)
+{
+    if (block_mig_state.sized_blocks) {
+        return blk->nr_sectors << BDRV_SECTOR_BITS;
+    }
+    return BLOCK_SIZE;
+}
+
+static BlkMigBlock *blk_alloc(BlkMigDevState *bmds, int64_t sector,
+                              int nr_sectors, bool zero)
+{
+    BlkMigBlock *blk = g_malloc0(sizeof(BlkMigBlock));
+
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    blk->zero = zero;
+
+    /* zero blocks are only read from if they must go out as data */
+    if (!zero) {
+        blk->buf = g_malloc(blk_data_size(blk));
+    } else if (!block_mig_state.zero_blocks) {
+        blk->buf = g_malloc0(blk_data_size(blk));
+    }
+
+    blk->iov.iov_base = blk->buf;
+    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+    return blk;
+}
+
+static void blk_free(BlkMigBlock *blk)
+{
+    g_free(blk->buf);
+    g_free(blk);
+}
+
 /* Must run outside of the iothread lock during the bulk phase,
  * or the VM will stall.
  */
@@ -116,12 +165,16 @@ static void blk_mig_unlock(void)
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    int size = blk_data_size(blk);
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        (blk->zero || buffer_is_zero(blk->buf, size))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
+    if (block_mig_state.sized_blocks) {
+        flags |= BLK_MIG_FLAG_SIZED_BLOCK;
+    }
 
     /* sector number and flags */
     qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
@@ -132,6 +185,10 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
+    if (flags & BLK_MIG_FLAG_SIZED_BLOCK) {
+        qemu_put_be32(f, blk->nr_sectors);
+    }
+
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
      * thus if we queue zero blocks we slow down the migration */
@@ -140,7 +197,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         return;
     }
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    qemu_put_buffer(f, blk->buf, size);
 }
 
 int blk_mig_active(void)
@@ -182,11 +239,8 @@ uint64_t blk_mig_bytes_total(void)
 
 static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if ((sector << BDRV_SECTOR_BITS) < bdrv_getlength(bmds->bs)) {
-        return !!(bmds->aio_bitmap[chunk / (sizeof(unsigned long) * 8)] &
-            (1UL << (chunk % (sizeof(unsigned long) * 8))));
+    if (sector < bmds->total_sectors) {
+        return hbitmap_get(bmds->aio_bitmap, sector);
     } else {
         return 0;
     }
@@ -197,35 +251,25 @@ static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 static void bmds_set_aio_inflight(BlkMigDevState *bmds, int64_t sector_num,
                              int nb_sectors, int set)
 {
-    int64_t start, end;
-    unsigned long val, idx, bit;
-
-    start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
-    end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    for (; start <= end; start++) {
-        idx = start / (sizeof(unsigned long) * 8);
-        bit = start % (sizeof(unsigned long) * 8);
-        val = bmds->aio_bitmap[idx];
-        if (set) {
-            val |= 1UL << bit;
-        } else {
-            val &= ~(1UL << bit);
-        }
-        bmds->aio_bitmap[idx] = val;
+    if (set) {
+        hbitmap_set(bmds->aio_bitmap, sector_num, nb_sectors);
+    } else {
+        hbitmap_reset(bmds->aio_bitmap, sector_num, nb_sectors);
     }
 }
 
 static void alloc_aio_bitmap(BlkMigDevState *bmds)
 {
-    BlockDriverState *bs = bmds->bs;
-    int64_t bitmap_size;
+    bmds->aio_bitmap = hbitmap_alloc(bmds->total_sectors,
+                                     ctz32(block_mig_state.chunk_sectors));
+}
 
-    bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-            BDRV_SECTORS_PER_DIRTY_CHUNK * 8 - 1;
-    bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * 8;
+/* Queue a block for flush_blks.  Called with migration lock held.  */
 
-    bmds->aio_bitmap = g_malloc0(bitmap_size);
+static void blk_mig_queue(BlkMigBlock *blk)
+{
+    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+    block_mig_state.read_done++;
 }
 
 /* Never hold migration lock when yielding to the main loop!  */
@@ -237,11 +281,10 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_lock();
     blk->ret = ret;
 
-    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+    blk_mig_queue(blk);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
     block_mig_state.submitted--;
-    block_mig_state.read_done++;
     assert(block_mig_state.submitted >= 0);
     blk_mig_unlock();
 }
@@ -252,9 +295,11 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 {
     int64_t total_sectors = bmds->total_sectors;
     int64_t cur_sector = bmds->cur_sector;
+    int64_t chunk_sectors = block_mig_state.chunk_sectors;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
-    int nr_sectors;
+    int64_t status = BDRV_BLOCK_DATA;
+    int nr_sectors, n;
 
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
@@ -273,35 +318,66 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     bmds->completed_sectors = cur_sector;
 
-    cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+    cur_sector &= ~(chunk_sectors - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
+    /* we are going to transfer full chunks even if they are not allocated;
+     * with the length in the stream several of them can go in one block
+     */
     nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+    if (total_sectors - cur_sector < nr_sectors) {
         nr_sectors = total_sectors - cur_sector;
     }
 
-    blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
+    /* Do not read what is known to be zero.  With a shared base the
+     * unallocated parts were skipped above, and the rest could come from
+     * the base image, which the destination has already.
+     */
+    if (!bmds->shared_base) {
+        qemu_mutex_lock_iothread();
+        status = bdrv_get_block_status(bs, cur_sector, nr_sectors, &n);
+        qemu_mutex_unlock_iothread();
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+        if (status < 0 || n <= 0) {
+            status = BDRV_BLOCK_DATA;
+        } else if (n < nr_sectors && (status & BDRV_BLOCK_ZERO)) {
+            n &= ~(chunk_sectors - 1);
+            if (n) {
+                nr_sectors = n;
+            } else {
+                status = BDRV_BLOCK_DATA;
+            }
+        } else if (n < nr_sectors) {
+            nr_sectors = MIN(QEMU_ALIGN_UP(n, chunk_sectors), nr_sectors);
+        }
+    }
 
-    blk_mig_lock();
-    block_mig_state.submitted++;
-    blk_mig_unlock();
+    blk = blk_alloc(bmds, cur_sector, nr_sectors,
+                    !!(status & BDRV_BLOCK_ZERO));
 
-    qemu_mutex_lock_iothread();
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
+    if (blk->zero) {
+        blk_mig_lock();
+        block_mig_state.pending_bytes += nr_sectors << BDRV_SECTOR_BITS;
+        blk_mig_queue(blk);
+        blk_mig_unlock();
 
-    bdrv_reset_dirty(bs, cur_sector, nr_sectors);
-    qemu_mutex_unlock_iothread();
+        qemu_mutex_lock_iothread();
+        bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+        qemu_mutex_unlock_iothread();
+    } else {
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        block_mig_state.pending_bytes += nr_sectors << BDRV_SECTOR_BITS;
+        bmds_set_aio_inflight(bmds, cur_sector, nr_sectors, 1);
+        blk_mig_unlock();
+
+        qemu_mutex_lock_iothread();
+        blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+
+        bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+        qemu_mutex_unlock_iothread();
+    }
 
     bmds->cur_sector = cur_sector + nr_sectors;
     return (bmds->cur_sector >= total_sectors);
@@ -312,9 +388,10 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 static void set_dirty_tracking(int enable)
 {
     BlkMigDevState *bmds;
+    int granularity = block_mig_state.chunk_sectors << BDRV_SECTOR_BITS;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bdrv_set_dirty_tracking(bmds->bs, enable ? BLOCK_SIZE : 0);
+        bdrv_set_dirty_tracking(bmds->bs, enable ? granularity : 0);
     }
 }
 
@@ -356,11 +433,17 @@ static void init_blk_migration(QEMUFile *f)
 {
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
+    block_mig_state.pending_bytes = 0;
     block_mig_state.transferred = 0;
     block_mig_state.total_sector_sum = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
+    block_mig_state.bulk_next = NULL;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.chunk_sectors =
+        migrate_block_granularity() >> BDRV_SECTOR_BITS;
+    block_mig_state.sized_blocks =
+        block_mig_state.chunk_sectors != BDRV_SECTORS_PER_DIRTY_CHUNK;
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
@@ -370,22 +453,36 @@ static void init_blk_migration(QEMUFile *f)
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
     int64_t completed_sector_sum = 0;
-    BlkMigDevState *bmds;
+    BlkMigDevState *bmds, *start;
     int progress;
     int ret = 0;
 
-    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+    /* Take turns between the devices, so that reads from all of them
+     * overlap instead of copying one device after the other.
+     */
+    bmds = start = block_mig_state.bulk_next ?:
+                   QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+    while (bmds) {
         if (bmds->bulk_completed == 0) {
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
             ret = 1;
             break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        bmds = QSIMPLEQ_NEXT(bmds, entry) ?:
+               QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+        if (bmds == start) {
+            break;
+        }
+    }
+    if (ret) {
+        block_mig_state.bulk_next = QSIMPLEQ_NEXT(bmds, entry);
+    }
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -419,68 +516,81 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
 {
     BlkMigBlock *blk;
+    BlockDriverState *bs = bmds->bs;
     int64_t total_sectors = bmds->total_sectors;
+    int chunk_sectors = block_mig_state.chunk_sectors;
+    int max_sectors;
+    HBitmapIter hbi;
     int64_t sector;
+    uint64_t run;
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        blk_mig_lock();
-        if (bmds_aio_inflight(bmds, sector)) {
-            blk_mig_unlock();
-            bdrv_drain_all();
-        } else {
-            blk_mig_unlock();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
+    if (bmds->cur_dirty >= total_sectors) {
+        return 1;
+    }
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-
-                blk_mig_lock();
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-                blk_mig_unlock();
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    hbitmap_iter_init(&hbi, bs->dirty_bitmap, bmds->cur_dirty);
+    sector = hbitmap_iter_next_run(&hbi, &run);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    blk_mig_lock();
+    if (bmds_aio_inflight(bmds, sector)) {
+        blk_mig_unlock();
+        bdrv_drain_all();
+    } else {
+        blk_mig_unlock();
+    }
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+    /* With the length in the stream, neighbouring dirty chunks are read
+     * and sent together.
+     */
+    max_sectors = block_mig_state.sized_blocks ? BDRV_SECTORS_PER_DIRTY_CHUNK
+                                               : chunk_sectors;
+    nr_sectors = chunk_sectors;
+    blk_mig_lock();
+    while (nr_sectors + chunk_sectors <= max_sectors &&
+           sector + nr_sectors < total_sectors &&
+           nr_sectors < run &&
+           !bmds_aio_inflight(bmds, sector + nr_sectors)) {
+        nr_sectors += chunk_sectors;
+    }
+    blk_mig_unlock();
+
+    if (total_sectors - sector < nr_sectors) {
+        nr_sectors = total_sectors - sector;
+    }
+    blk = blk_alloc(bmds, sector, nr_sectors, false);
+
+    if (is_async) {
+        blk->aiocb = bdrv_aio_readv(bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        block_mig_state.pending_bytes += nr_sectors << BDRV_SECTOR_BITS;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+        blk_mig_unlock();
+    } else {
+        ret = bdrv_read(bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+        blk_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty(bs, sector, nr_sectors);
+    bmds->cur_dirty = sector + nr_sectors;
+
+    return (bmds->cur_dirty >= total_sectors);
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
-    g_free(blk->buf);
-    g_free(blk);
+    blk_free(blk);
     return ret;
 }
 
@@ -531,8 +641,8 @@ static int flush_blks(QEMUFile *f)
         blk_send(f, blk);
         blk_mig_lock();
 
-        g_free(blk->buf);
-        g_free(blk);
+        block_mig_state.pending_bytes -= blk->nr_sectors << BDRV_SECTOR_BITS;
+        blk_free(blk);
 
         block_mig_state.read_done--;
         block_mig_state.transferred++;
@@ -576,14 +686,13 @@ static void blk_mig_cleanup(void)
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.bmds_list, entry);
         bdrv_set_in_use(bmds->bs, 0);
         bdrv_unref(bmds->bs);
-        g_free(bmds->aio_bitmap);
+        hbitmap_free(bmds->aio_bitmap);
         g_free(bmds);
     }
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
-        g_free(blk);
+        blk_free(blk);
     }
     blk_mig_unlock();
 }
@@ -631,9 +740,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     /* control the rate of transfer */
     blk_mig_lock();
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+    while (block_mig_state.pending_bytes < qemu_file_get_rate_limit(f)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
@@ -717,9 +824,7 @@ static uint64_t block_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 
     qemu_mutex_lock_iothread();
     blk_mig_lock();
-    pending = get_remaining_dirty() +
-                       block_mig_state.submitted * BLOCK_SIZE +
-                       block_mig_state.read_done * BLOCK_SIZE;
+    pending = get_remaining_dirty() + block_mig_state.pending_bytes;
 
     /* Report at least one block pending during bulk phase */
     if (pending == 0 && !block_mig_state.bulk_completed) {
@@ -741,7 +846,7 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
     BlockDriverState *bs, *bs_prev = NULL;
     uint8_t *buf;
     int64_t total_sectors = 0;
-    int nr_sectors;
+    int nr_sectors, buf_size;
     int ret;
 
     do {
@@ -773,17 +878,31 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 }
             }
 
-            if (total_sectors - addr < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - addr;
+            if (flags & BLK_MIG_FLAG_SIZED_BLOCK) {
+                nr_sectors = qemu_get_be32(f);
+                if (nr_sectors <= 0 ||
+                    nr_sectors > BDRV_SECTORS_PER_DIRTY_CHUNK ||
+                    nr_sectors > total_sectors - addr) {
+                    error_report("Invalid block of %d sectors at sector %"
+                                 PRId64 " for device %s", nr_sectors, addr,
+                                 device_name);
+                    return -EINVAL;
+                }
+                buf_size = nr_sectors << BDRV_SECTOR_BITS;
             } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+                if (total_sectors - addr < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+                    nr_sectors = total_sectors - addr;
+                } else {
+                    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+                }
+                buf_size = BLOCK_SIZE;
             }
 
             if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
-                ret = bdrv_write_zeroes(bs, addr, nr_sectors);
+                ret = bdrv_write_zeroes(bs, addr, nr_sectors, 0);
             } else {
-                buf = g_malloc(BLOCK_SIZE);
-                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                buf = g_malloc(buf_size);
+                qemu_get_buffer(f, buf, buf_size);
                 ret = bdrv_write(bs, addr, buf, nr_sectors);
                 g_free(buf);
             }
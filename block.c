@@ -27,6 +27,7 @@
 #include "monitor/monitor.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/throttle-groups.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qjson.h"
 #include "sysemu/sysemu.h"
@@ -51,10 +52,10 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
-typedef enum {
-    BDRV_REQ_COPY_ON_READ = 0x1,
-    BDRV_REQ_ZERO_WRITE   = 0x2,
-} BdrvRequestFlags;
+/* Free coroutines kept for each attached device, enough for the requests
+ * that a guest typically has in flight on one disk.
+ */
+#define COROUTINE_POOL_RESERVATION 64
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
@@ -79,12 +80,22 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
                                                int nb_sectors,
+                                               BdrvRequestFlags flags,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
                                                bool is_write);
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors);
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags);
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors);
+static void bdrv_truncate_dirty_bitmaps(BlockDriverState *bs);
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs);
+static int64_t bdrv_latency_start(BlockDriverState *bs,
+                                  enum BlockAcctType type);
+static void bdrv_latency_end(BlockDriverState *bs, enum BlockAcctType type,
+                             enum BlockLatencySource src, int64_t start);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -119,13 +130,7 @@ int is_windows_drive(const char *filename)
 void bdrv_set_io_limits(BlockDriverState *bs,
                         ThrottleConfig *cfg)
 {
-    int i;
-
-    throttle_config(&bs->throttle_state, cfg);
-
-    for (i = 0; i < 2; i++) {
-        qemu_co_enter_next(&bs->throttled_reqs[i]);
-    }
+    throttle_group_config(bs, cfg);
 }
 
 /* this function drain all the throttled IOs */
@@ -154,30 +159,17 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
 
     bdrv_start_throttled_reqs(bs);
 
-    throttle_destroy(&bs->throttle_state);
-}
-
-static void bdrv_throttle_read_timer_cb(void *opaque)
-{
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[0]);
-}
-
-static void bdrv_throttle_write_timer_cb(void *opaque)
-{
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[1]);
+    throttle_group_unregister_bs(bs);
 }
 
-/* should be called before bdrv_set_io_limits if a limit is set */
-void bdrv_io_limits_enable(BlockDriverState *bs)
+/* should be called before bdrv_set_io_limits if a limit is set
+ *
+ * @group: the throttle group to join, NULL for a group of its own
+ */
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group)
 {
     assert(!bs->io_limits_enabled);
-    throttle_init(&bs->throttle_state,
-                  QEMU_CLOCK_VIRTUAL,
-                  bdrv_throttle_read_timer_cb,
-                  bdrv_throttle_write_timer_cb,
-                  bs);
+    throttle_group_register_bs(bs, group ? group : bs->device_name);
     bs->io_limits_enabled = true;
 }
 
@@ -190,27 +182,13 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      int nb_sectors,
                                      bool is_write)
 {
-    /* does this io must wait */
-    bool must_wait = throttle_schedule_timer(&bs->throttle_state, is_write);
+    enum BlockAcctType type = is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ;
+    int64_t start = bdrv_latency_start(bs, type);
 
-    /* if must wait or any request of this type throttled queue the IO */
-    if (must_wait ||
-        !qemu_co_queue_empty(&bs->throttled_reqs[is_write])) {
-        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
-    }
+    throttle_group_co_io_limits_intercept(bs, nb_sectors * BDRV_SECTOR_SIZE,
+                                          is_write);
 
-    /* the IO will be executed, do the accounting */
-    throttle_account(&bs->throttle_state,
-                     is_write,
-                     nb_sectors * BDRV_SECTOR_SIZE);
-
-    /* if the next request must wait -> do nothing */
-    if (throttle_schedule_timer(&bs->throttle_state, is_write)) {
-        return;
-    }
-
-    /* else queue next request for execution */
-    qemu_co_queue_next(&bs->throttled_reqs[is_write]);
+    bdrv_latency_end(bs, type, BDRV_LATENCY_THROTTLE, start);
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -330,6 +308,7 @@ BlockDriverState *bdrv_new(const char *device_name)
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    notifier_with_return_list_init(&bs->after_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
     bs->refcnt = 1;
@@ -764,6 +743,8 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
 
     bs->open_flags = flags;
     bs->buffer_alignment = 512;
+    bs->request_alignment = 512;
+    bs->mem_alignment = 512;
     bs->zero_beyond_eof = true;
     open_flags = bdrv_open_flags(bs, flags);
     bs->read_only = !(open_flags & BDRV_O_RDWR);
@@ -812,6 +793,11 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
         }
         bs->file = file;
         ret = drv->bdrv_open(bs, options, open_flags, &local_err);
+        if (ret >= 0) {
+            /* Buffers of the format driver are handed down to the protocol */
+            bs->mem_alignment = MAX(bs->mem_alignment,
+                                    file->mem_alignment);
+        }
     }
 
     if (ret < 0) {
@@ -1465,6 +1451,7 @@ void bdrv_close(BlockDriverState *bs)
             bs->backing_hd = NULL;
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_all_dirty_bitmaps(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
         if (bs->is_temporary) {
@@ -1511,7 +1498,7 @@ void bdrv_close_all(void)
 /* Check if any requests are in-flight (including throttled requests) */
 static bool bdrv_requests_pending(BlockDriverState *bs)
 {
-    if (!QLIST_EMPTY(&bs->tracked_requests)) {
+    if (!interval_tree_empty(&bs->tracked_requests)) {
         return true;
     }
     if (!qemu_co_queue_empty(&bs->throttled_reqs[0])) {
@@ -1604,15 +1591,19 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->copy_on_read       = bs_src->copy_on_read;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
+    bs_dest->detect_zeroes      = bs_src->detect_zeroes;
 
     /* i/o throttled req */
-    memcpy(&bs_dest->throttle_state,
-           &bs_src->throttle_state,
-           sizeof(ThrottleState));
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->round_robin        = bs_src->round_robin;
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
+    /* latency histograms */
+    memcpy(bs_dest->latency_histogram, bs_src->latency_histogram,
+           sizeof(bs_dest->latency_histogram));
+
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
     bs_dest->on_write_error     = bs_src->on_write_error;
@@ -1623,6 +1614,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dirty bitmap */
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* reference count */
     bs_dest->refcnt             = bs_src->refcnt;
@@ -1660,7 +1652,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1679,7 +1671,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1712,6 +1704,8 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 static void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(!bs->in_use);
@@ -1722,6 +1716,9 @@ static void bdrv_delete(BlockDriverState *bs)
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_latency_histogram_set(bs, i, NULL, 0);
+    }
     g_free(bs);
 }
 
@@ -1733,6 +1730,9 @@ int bdrv_attach_dev(BlockDriverState *bs, void *dev)
     }
     bs->dev = dev;
     bdrv_iostatus_reset(bs);
+
+    /* We're expecting I/O from the device so bump up coroutine pool size */
+    qemu_coroutine_adjust_pool_size(COROUTINE_POOL_RESERVATION);
     return 0;
 }
 
@@ -1749,6 +1749,7 @@ void bdrv_detach_dev(BlockDriverState *bs, void *dev)
 {
     assert(bs->dev == dev);
     bs->dev = NULL;
+    qemu_coroutine_adjust_pool_size(-COROUTINE_POOL_RESERVATION);
     bs->dev_ops = NULL;
     bs->dev_opaque = NULL;
     bs->buffer_alignment = 512;
@@ -1969,6 +1970,22 @@ int bdrv_commit_all(void)
     return 0;
 }
 
+/**
+ * Return the request alignment of the driver in sectors
+ */
+static int bdrv_align_sectors(BlockDriverState *bs)
+{
+    return MAX(bs->request_alignment >> BDRV_SECTOR_BITS, 1);
+}
+
+static bool bdrv_req_is_aligned(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors)
+{
+    int align = bdrv_align_sectors(bs);
+
+    return sector_num % align == 0 && nb_sectors % align == 0;
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -1976,7 +1993,7 @@ int bdrv_commit_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->bs->tracked_requests, &req->node);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -1988,6 +2005,8 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
                                   int64_t sector_num,
                                   int nb_sectors, bool is_write)
 {
+    int align = bdrv_align_sectors(bs);
+
     *req = (BdrvTrackedRequest){
         .bs = bs,
         .sector_num = sector_num,
@@ -1998,7 +2017,11 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_queue_init(&req->wait_queue);
 
-    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    /* Requests are padded to whole blocks of the driver, so they overlap
+     * if they touch the same block */
+    interval_tree_insert(&bs->tracked_requests, &req->node,
+                         QEMU_ALIGN_DOWN(sector_num, align),
+                         QEMU_ALIGN_UP(sector_num + nb_sectors, align));
 }
 
 /**
@@ -2022,26 +2045,14 @@ void bdrv_round_to_clusters(BlockDriverState *bs,
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t sector_num, int nb_sectors) {
-    /*        aaaa   bbbb */
-    if (sector_num >= req->sector_num + req->nb_sectors) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->sector_num >= sector_num + nb_sectors) {
-        return false;
-    }
-    return true;
-}
-
 static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors)
 {
+    IntervalTreeNode *node;
     BdrvTrackedRequest *req;
-    int64_t cluster_sector_num;
+    int64_t cluster_sector_num, cluster_end;
     int cluster_nb_sectors;
-    bool retry;
+    int align = bdrv_align_sectors(bs);
 
     /* If we touch the same cluster it counts as an overlap.  This guarantees
      * that allocating writes will be serialized and not race with each other
@@ -2051,24 +2062,22 @@ static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
      */
     bdrv_round_to_clusters(bs, sector_num, nb_sectors,
                            &cluster_sector_num, &cluster_nb_sectors);
+    cluster_end = QEMU_ALIGN_UP(cluster_sector_num + cluster_nb_sectors,
+                                align);
+    cluster_sector_num = QEMU_ALIGN_DOWN(cluster_sector_num, align);
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (tracked_request_overlaps(req, cluster_sector_num,
-                                         cluster_nb_sectors)) {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                qemu_co_queue_wait(&req->wait_queue);
-                retry = true;
-                break;
-            }
-        }
-    } while (retry);
+    while ((node = interval_tree_find(&bs->tracked_requests,
+                                      cluster_sector_num, cluster_end))) {
+        req = interval_tree_entry(node, BdrvTrackedRequest, node);
+
+        /* Hitting this means there was a reentrant request, for
+         * example, a block driver issuing nested requests.  This must
+         * never happen since it means deadlock.
+         */
+        assert(qemu_coroutine_self() != req->co);
+
+        qemu_co_queue_wait(&req->wait_queue);
+    }
 }
 
 /*
@@ -2397,10 +2406,11 @@ int bdrv_writev(BlockDriverState *bs, int64_t sector_num, QEMUIOVector *qiov)
     return bdrv_rwv_co(bs, sector_num, qiov, true, 0);
 }
 
-int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, BdrvRequestFlags flags)
 {
     return bdrv_rw_co(bs, sector_num, NULL, nb_sectors, true,
-                      BDRV_REQ_ZERO_WRITE);
+                      BDRV_REQ_ZERO_WRITE | flags);
 }
 
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
@@ -2542,6 +2552,113 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
     return 0;
 }
 
+/*
+ * Read from the driver, padding the request to its request alignment.
+ */
+static int coroutine_fn bdrv_aligned_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    int align = bdrv_align_sectors(bs);
+    int64_t start;
+    int head, total;
+    QEMUIOVector bounce_qiov;
+    struct iovec iov;
+    int ret;
+
+    if (bdrv_req_is_aligned(bs, sector_num, nb_sectors)) {
+        return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
+
+    head = sector_num % align;
+    start = sector_num - head;
+    total = QEMU_ALIGN_UP(head + nb_sectors, align);
+
+    iov.iov_len = total * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = drv->bdrv_co_readv(bs, start, total, &bounce_qiov);
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, 0, iov.iov_base + head * BDRV_SECTOR_SIZE,
+                            nb_sectors * BDRV_SECTOR_SIZE);
+    }
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+/*
+ * Write to the driver.  Requests that are not aligned to the request
+ * alignment of the driver are padded with the current contents of the first
+ * and last block; the caller must have serialised the request against
+ * overlapping ones.
+ */
+static int coroutine_fn bdrv_aligned_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    int align = bdrv_align_sectors(bs);
+    int head, tail;
+    uint8_t *head_buf = NULL, *tail_buf = NULL;
+    QEMUIOVector local_qiov, pad_qiov;
+    struct iovec iov;
+    int ret = 0;
+
+    if (bdrv_req_is_aligned(bs, sector_num, nb_sectors)) {
+        return drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+    }
+
+    head = sector_num % align;
+    tail = (align - (sector_num + nb_sectors) % align) % align;
+
+    qemu_iovec_init(&local_qiov, qiov->niov + 2);
+    iov.iov_len = align * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&pad_qiov, &iov, 1);
+
+    if (head) {
+        head_buf = qemu_blockalign(bs, align * BDRV_SECTOR_SIZE);
+        iov.iov_base = head_buf;
+        ret = drv->bdrv_co_readv(bs, sector_num - head, align, &pad_qiov);
+        if (ret < 0) {
+            goto out;
+        }
+        qemu_iovec_add(&local_qiov, head_buf, head * BDRV_SECTOR_SIZE);
+    }
+
+    qemu_iovec_concat(&local_qiov, qiov, 0, nb_sectors * BDRV_SECTOR_SIZE);
+
+    if (tail) {
+        if (head && head + nb_sectors + tail == align) {
+            /* Head and tail are in the same block */
+            tail_buf = head_buf;
+        } else {
+            int64_t tail_sector = sector_num + nb_sectors + tail - align;
+
+            tail_buf = qemu_blockalign(bs, align * BDRV_SECTOR_SIZE);
+            iov.iov_base = tail_buf;
+            ret = drv->bdrv_co_readv(bs, tail_sector, align, &pad_qiov);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+        qemu_iovec_add(&local_qiov,
+                       tail_buf + (align - tail) * BDRV_SECTOR_SIZE,
+                       tail * BDRV_SECTOR_SIZE);
+    }
+
+    ret = drv->bdrv_co_writev(bs, sector_num - head, head + nb_sectors + tail,
+                              &local_qiov);
+
+out:
+    qemu_iovec_destroy(&local_qiov);
+    if (tail_buf != head_buf) {
+        qemu_vfree(tail_buf);
+    }
+    qemu_vfree(head_buf);
+    return ret;
+}
+
 static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
@@ -2573,7 +2690,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     iov.iov_base = bounce_buffer = qemu_blockalign(bs, iov.iov_len);
     qemu_iovec_init_external(&bounce_qiov, &iov, 1);
 
-    ret = drv->bdrv_co_readv(bs, cluster_sector_num, cluster_nb_sectors,
+    ret = bdrv_aligned_readv(bs, cluster_sector_num, cluster_nb_sectors,
                              &bounce_qiov);
     if (ret < 0) {
         goto err;
@@ -2582,12 +2699,12 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     if (drv->bdrv_co_write_zeroes &&
         buffer_is_zero(bounce_buffer, iov.iov_len)) {
         ret = bdrv_co_do_write_zeroes(bs, cluster_sector_num,
-                                      cluster_nb_sectors);
+                                      cluster_nb_sectors, &bounce_qiov, 0);
     } else {
         /* This does not change the data on the disk, it is not necessary
          * to flush even in cache=writethrough mode.
          */
-        ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
+        ret = bdrv_aligned_writev(bs, cluster_sector_num, cluster_nb_sectors,
                                   &bounce_qiov);
     }
 
@@ -2617,6 +2734,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
 {
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    int64_t start;
     int ret;
 
     if (!drv) {
@@ -2633,7 +2751,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         bs->copy_on_read_in_flight++;
     }
 
-    if (bs->copy_on_read_in_flight) {
+    if (bs->copy_on_read_in_flight || bs->serialising_in_flight) {
         wait_for_overlapping_requests(bs, sector_num, nb_sectors);
     }
 
@@ -2643,6 +2761,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     }
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, false);
+    start = bdrv_latency_start(bs, BDRV_ACCT_READ);
 
     if (flags & BDRV_REQ_COPY_ON_READ) {
         int pnum;
@@ -2659,7 +2778,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     }
 
     if (!(bs->zero_beyond_eof && bs->growable)) {
-        ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+        ret = bdrv_aligned_readv(bs, sector_num, nb_sectors, qiov);
     } else {
         /* Read zeros after EOF of growable BDSes */
         int64_t len, total_sectors, max_nb_sectors;
@@ -2673,7 +2792,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         total_sectors = DIV_ROUND_UP(len, BDRV_SECTOR_SIZE);
         max_nb_sectors = MAX(0, total_sectors - sector_num);
         if (max_nb_sectors > 0) {
-            ret = drv->bdrv_co_readv(bs, sector_num,
+            ret = bdrv_aligned_readv(bs, sector_num,
                                      MIN(nb_sectors, max_nb_sectors), qiov);
         } else {
             ret = 0;
@@ -2689,6 +2808,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     }
 
 out:
+    bdrv_latency_end(bs, BDRV_ACCT_READ, BDRV_LATENCY_BACKEND, start);
     tracked_request_end(&req);
 
     if (flags & BDRV_REQ_COPY_ON_READ) {
@@ -2715,17 +2835,63 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
                             BDRV_REQ_COPY_ON_READ);
 }
 
+/*
+ * Returns true if discarding the given range is guaranteed to make it read
+ * back as zeroes.
+ */
+static bool bdrv_can_unmap_zeroes(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors)
+{
+    BlockDriverInfo bdi;
+    int cluster_sectors;
+
+    if (!(bs->open_flags & BDRV_O_UNMAP) || !bs->drv->bdrv_co_discard ||
+        bs->backing_hd) {
+        return false;
+    }
+
+    if (bdrv_get_info(bs, &bdi) < 0 || !bdi.unallocated_blocks_are_zero) {
+        return false;
+    }
+
+    /* Drivers only discard whole clusters */
+    cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+    return cluster_sectors > 0 &&
+           sector_num % cluster_sectors == 0 &&
+           nb_sectors % cluster_sectors == 0;
+}
+
+/*
+ * Writes zeroes to the given range.  If @qiov is non-NULL, it must contain
+ * only zeroes and is used instead of a bounce buffer when the driver can't
+ * write zeroes efficiently.  With BDRV_REQ_MAY_UNMAP the range may be
+ * discarded instead if that is known to zero it.
+ */
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
-    QEMUIOVector qiov;
+    QEMUIOVector bounce_qiov;
     struct iovec iov;
     int ret;
 
     /* TODO Emulate only part of misaligned requests instead of letting block
      * drivers return -ENOTSUP and emulate everything */
 
+    if (!bdrv_req_is_aligned(bs, sector_num, nb_sectors)) {
+        /* Needs read-modify-write, which only bdrv_aligned_writev does */
+        goto emulate;
+    }
+
+    if ((flags & BDRV_REQ_MAY_UNMAP) &&
+        bdrv_can_unmap_zeroes(bs, sector_num, nb_sectors)) {
+        ret = drv->bdrv_co_discard(bs, sector_num, nb_sectors);
+        if (ret == 0) {
+            return 0;
+        }
+    }
+
     /* First try the efficient write zeroes operation */
     if (drv->bdrv_co_write_zeroes) {
         ret = drv->bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
@@ -2734,13 +2900,18 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
         }
     }
 
+emulate:
+    if (qiov) {
+        return bdrv_aligned_writev(bs, sector_num, nb_sectors, qiov);
+    }
+
     /* Fall back to bounce buffer if write zeroes is unsupported */
     iov.iov_len  = nb_sectors * BDRV_SECTOR_SIZE;
     iov.iov_base = qemu_blockalign(bs, iov.iov_len);
     memset(iov.iov_base, 0, iov.iov_len);
-    qemu_iovec_init_external(&qiov, &iov, 1);
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
 
-    ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, &qiov);
+    ret = bdrv_aligned_writev(bs, sector_num, nb_sectors, &bounce_qiov);
 
     qemu_vfree(iov.iov_base);
     return ret;
@@ -2755,6 +2926,8 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 {
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    bool serialise;
+    int64_t start;
     int ret;
 
     if (!bs->drv) {
@@ -2767,7 +2940,14 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         return -EIO;
     }
 
-    if (bs->copy_on_read_in_flight) {
+    /* A read-modify-write must not race with other writes to the same
+     * block, so everyone waits for overlapping requests while there is one */
+    serialise = !bdrv_req_is_aligned(bs, sector_num, nb_sectors);
+    if (serialise) {
+        bs->serialising_in_flight++;
+    }
+
+    if (bs->copy_on_read_in_flight || bs->serialising_in_flight) {
         wait_for_overlapping_requests(bs, sector_num, nb_sectors);
     }
 
@@ -2777,15 +2957,27 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     }
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+    req.qiov = qiov;
+    start = bdrv_latency_start(bs, BDRV_ACCT_WRITE);
 
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
 
+    if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
+        !(flags & BDRV_REQ_ZERO_WRITE) && drv->bdrv_co_write_zeroes &&
+        qemu_iovec_is_zero(qiov)) {
+        trace_bdrv_co_do_writev_detect_zeroes(bs, sector_num, nb_sectors);
+        flags |= BDRV_REQ_ZERO_WRITE;
+        if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
+            flags |= BDRV_REQ_MAY_UNMAP;
+        }
+    }
+
     if (ret < 0) {
         /* Do nothing, write notifier decided to fail this request */
     } else if (flags & BDRV_REQ_ZERO_WRITE) {
-        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
+        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors, qiov, flags);
     } else {
-        ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+        ret = bdrv_aligned_writev(bs, sector_num, nb_sectors, qiov);
     }
 
     if (ret == 0 && !bs->enable_write_cache) {
@@ -2795,6 +2987,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     if (bs->dirty_bitmap) {
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2803,8 +2996,16 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         bs->total_sectors = MAX(bs->total_sectors, sector_num + nb_sectors);
     }
 
+    req.ret = ret;
+    notifier_with_return_list_notify(&bs->after_write_notifiers, &req);
+
+    bdrv_latency_end(bs, BDRV_ACCT_WRITE, BDRV_LATENCY_BACKEND, start);
     tracked_request_end(&req);
 
+    if (serialise) {
+        bs->serialising_in_flight--;
+    }
+
     return ret;
 }
 
@@ -2817,12 +3018,13 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
 }
 
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
-                                      int64_t sector_num, int nb_sectors)
+                                      int64_t sector_num, int nb_sectors,
+                                      BdrvRequestFlags flags)
 {
-    trace_bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+    trace_bdrv_co_write_zeroes(bs, sector_num, nb_sectors, flags);
 
     return bdrv_co_do_writev(bs, sector_num, nb_sectors, NULL,
-                             BDRV_REQ_ZERO_WRITE);
+                             BDRV_REQ_ZERO_WRITE | flags);
 }
 
 /**
@@ -2843,6 +3045,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_truncate_dirty_bitmaps(bs);
         bdrv_dev_resize_cb(bs);
     }
     return ret;
@@ -3319,18 +3522,82 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_co_write_compressed) {
+        if (drv->bdrv_write_compressed) {
+            return bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+        }
+        return -ENOTSUP;
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    }
+
+    assert(!bs->dirty_bitmap);
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
+
+    return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+}
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    RwCo *rwco = opaque;
+
+    rwco->ret = bdrv_co_write_compressed(rwco->bs, rwco->sector_num,
+                                         rwco->qiov->iov[0].iov_base,
+                                         rwco->nb_sectors);
+}
+
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
     if (!drv)
         return -ENOMEDIUM;
+    if (drv->bdrv_co_write_compressed) {
+        Coroutine *co;
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base = (void *)buf,
+            .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+        };
+        RwCo rwco = {
+            .bs = bs,
+            .sector_num = sector_num,
+            .nb_sectors = nb_sectors,
+            .qiov = &qiov,
+            .is_write = true,
+            .ret = NOT_DONE,
+        };
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        if (qemu_in_coroutine()) {
+            /* Fast-path if already in coroutine context */
+            bdrv_write_compressed_co_entry(&rwco);
+        } else {
+            co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+            qemu_coroutine_enter(co, &rwco);
+            while (rwco.ret == NOT_DONE) {
+                qemu_aio_wait();
+            }
+        }
+        return rwco.ret;
+    }
     if (!drv->bdrv_write_compressed)
         return -ENOTSUP;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
     assert(!bs->dirty_bitmap);
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
@@ -3346,6 +3613,25 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return drv->bdrv_get_info(bs, bdi);
 }
 
+/**
+ * Return a host file descriptor from which the contents of @bs can be read
+ * directly, at the same offsets, or -ENOTSUP.  Reads from the descriptor
+ * bypass everything the block layer does for requests, so only the owner of
+ * an otherwise unused BlockDriverState should use it.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd || bs->backing_hd) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs);
+}
+
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
@@ -3554,7 +3840,7 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
-    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
                                  cb, opaque, false);
 }
 
@@ -3564,7 +3850,18 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
-    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
+                                 cb, opaque, true);
+}
+
+BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, BdrvRequestFlags flags,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, flags, opaque);
+
+    return bdrv_co_aio_rw_vector(bs, sector_num, NULL, nb_sectors,
+                                 BDRV_REQ_ZERO_WRITE | flags,
                                  cb, opaque, true);
 }
 
@@ -3836,6 +4133,7 @@ typedef struct BlockDriverAIOCBCoroutine {
     BlockDriverAIOCB common;
     BlockRequest req;
     bool is_write;
+    BdrvRequestFlags flags;
     bool *done;
     QEMUBH* bh;
 } BlockDriverAIOCBCoroutine;
@@ -3879,10 +4177,10 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     }
 
     acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
@@ -3893,6 +4191,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
                                                int nb_sectors,
+                                               BdrvRequestFlags flags,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
                                                bool is_write)
@@ -3905,6 +4204,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     acb->req.nb_sectors = nb_sectors;
     acb->req.qiov = qiov;
     acb->is_write = is_write;
+    acb->flags = flags;
     acb->done = NULL;
 
     co = qemu_coroutine_create(bdrv_co_do_rw);
@@ -4062,14 +4362,10 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
     rwco->ret = bdrv_co_flush(rwco->bs);
 }
 
-int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs)
 {
     int ret;
 
-    if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
-        return 0;
-    }
-
     /* Write back cached data to the OS even with cache=unsafe */
     BLKDBG_EVENT(bs->file, BLKDBG_FLUSH_TO_OS);
     if (bs->drv->bdrv_co_flush_to_os) {
@@ -4125,6 +4421,22 @@ flush_parent:
     return bdrv_co_flush(bs->file);
 }
 
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    int64_t start;
+    int ret;
+
+    if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
+        return 0;
+    }
+
+    start = bdrv_latency_start(bs, BDRV_ACCT_FLUSH);
+    ret = bdrv_co_do_flush(bs);
+    bdrv_latency_end(bs, BDRV_ACCT_FLUSH, BDRV_LATENCY_BACKEND, start);
+
+    return ret;
+}
+
 void bdrv_invalidate_cache(BlockDriverState *bs)
 {
     if (bs->drv && bs->drv->bdrv_invalidate_cache) {
@@ -4193,6 +4505,7 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     if (bs->dirty_bitmap) {
         bdrv_reset_dirty(bs, sector_num, nb_sectors);
     }
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     /* Do nothing if disabled.  */
     if (!(bs->open_flags & BDRV_O_UNMAP)) {
@@ -4333,20 +4646,30 @@ void bdrv_set_buffer_alignment(BlockDriverState *bs, int align)
     bs->buffer_alignment = align;
 }
 
+static size_t bdrv_mem_align(BlockDriverState *bs)
+{
+    if (!bs || !bs->buffer_alignment) {
+        return 512;
+    }
+    return MAX(bs->buffer_alignment, bs->mem_alignment);
+}
+
 void *qemu_blockalign(BlockDriverState *bs, size_t size)
 {
-    return qemu_memalign((bs && bs->buffer_alignment) ? bs->buffer_alignment : 512, size);
+    return qemu_memalign(bdrv_mem_align(bs), size);
 }
 
 /*
- * Check if all memory in this vector is sector aligned.
+ * Check if all memory in this vector is aligned as the driver needs it.
  */
 bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
 {
+    size_t align = bdrv_mem_align(bs);
     int i;
 
     for (i = 0; i < qiov->niov; i++) {
-        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment) {
+        if ((uintptr_t) qiov->iov[i].iov_base % align ||
+            qiov->iov[i].iov_len % align) {
             return false;
         }
     }
@@ -4408,6 +4731,194 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     }
 }
 
+/*
+ * Named dirty bitmaps
+ *
+ * Unlike the anonymous bitmap above, which belongs to whichever block job
+ * enabled dirty tracking, named bitmaps are managed by the user and may
+ * outlive any single job.  A named bitmap records every sector written or
+ * discarded since it was created (or since its contents were last taken by
+ * an incremental backup).  Persistent bitmaps are additionally saved in the
+ * image file by drivers that support it.
+ */
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name, int granularity,
+                                          bool persistent, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t bitmap_size;
+
+    if (!bs->drv) {
+        error_setg(errp, "Device has no medium");
+        return NULL;
+    }
+    if (!name || !name[0]) {
+        error_setg(errp, "Dirty bitmap name must not be empty");
+        return NULL;
+    }
+    if (strlen(name) > BDRV_DIRTY_BITMAP_MAX_NAME_SIZE) {
+        error_setg(errp, "Dirty bitmap name '%s' is too long", name);
+        return NULL;
+    }
+    if (granularity < BDRV_SECTOR_SIZE ||
+        (granularity & (granularity - 1)) != 0) {
+        error_setg(errp, "Dirty bitmap granularity must be a power of 2 "
+                   "and at least %d bytes", BDRV_SECTOR_SIZE);
+        return NULL;
+    }
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Dirty bitmap '%s' already exists", name);
+        return NULL;
+    }
+    if (persistent && (!bs->drv->bdrv_can_store_dirty_bitmaps ||
+                       !bs->drv->bdrv_can_store_dirty_bitmaps(bs))) {
+        error_setg(errp, "Format '%s' used by device '%s' cannot store "
+                   "persistent dirty bitmaps", bs->drv->format_name,
+                   bs->device_name);
+        return NULL;
+    }
+
+    bitmap_size = bdrv_getlength(bs);
+    if (bitmap_size < 0) {
+        error_setg_errno(errp, -bitmap_size, "Could not get image size");
+        return NULL;
+    }
+    bitmap_size >>= BDRV_SECTOR_BITS;
+    granularity >>= BDRV_SECTOR_BITS;
+
+    bitmap = g_malloc0(sizeof(*bitmap));
+    bitmap->name = g_strdup(name);
+    bitmap->size = bitmap_size;
+    bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    bitmap->persistent = persistent;
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+
+    return bitmap;
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    assert(!bitmap->in_use);
+
+    QLIST_REMOVE(bitmap, list);
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+static void bdrv_release_all_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap, *next;
+
+    QLIST_FOREACH_SAFE(bitmap, &bs->dirty_bitmaps, list, next) {
+        bitmap->in_use = false;
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+}
+
+/* Granularity of @bitmap in bytes */
+int bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+void bdrv_dirty_bitmap_set(BdrvDirtyBitmap *bitmap, int64_t cur_sector,
+                           int64_t nr_sectors)
+{
+    if (cur_sector >= bitmap->size) {
+        return;
+    }
+    nr_sectors = MIN(nr_sectors, bitmap->size - cur_sector);
+    if (nr_sectors > 0) {
+        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+    }
+}
+
+/* Sets the bits of @bitmap that are set in @hb, which must have been
+ * returned by bdrv_dirty_bitmap_detach() for the same bitmap. */
+void bdrv_dirty_bitmap_merge(BdrvDirtyBitmap *bitmap, const HBitmap *hb)
+{
+    HBitmapIter hbi;
+    int64_t sector;
+    uint64_t count;
+
+    if (hbitmap_empty(hb)) {
+        return;
+    }
+    hbitmap_iter_init(&hbi, hb, 0);
+    while ((sector = hbitmap_iter_next_run(&hbi, &count)) >= 0) {
+        bdrv_dirty_bitmap_set(bitmap, sector, count);
+    }
+}
+
+/* Takes the current contents of @bitmap and leaves it empty, so that it
+ * starts recording the writes that follow this point in time.  The caller
+ * becomes the owner of the returned HBitmap. */
+HBitmap *bdrv_dirty_bitmap_detach(BdrvDirtyBitmap *bitmap)
+{
+    HBitmap *hb = bitmap->bitmap;
+
+    bitmap->bitmap = hbitmap_alloc(bitmap->size, hbitmap_granularity(hb));
+    return hb;
+}
+
+/* Marks the whole device as dirty in all named bitmaps, e.g. after its
+ * contents were replaced behind the guest's back. */
+void bdrv_dirty_bitmaps_set_all(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        bdrv_dirty_bitmap_set(bitmap, 0, bitmap->size);
+    }
+}
+
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        bdrv_dirty_bitmap_set(bitmap, cur_sector, nr_sectors);
+    }
+}
+
+/* Adapts the named bitmaps to a new device size.  The added sectors, if
+ * any, are marked dirty because their contents have not been backed up. */
+static void bdrv_truncate_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+    HBitmap *old;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        int64_t old_size = bitmap->size;
+
+        old = bitmap->bitmap;
+        bitmap->size = bs->total_sectors;
+        bitmap->bitmap = hbitmap_alloc(bitmap->size,
+                                       hbitmap_granularity(old));
+        bdrv_dirty_bitmap_merge(bitmap, old);
+        if (bitmap->size > old_size) {
+            bdrv_dirty_bitmap_set(bitmap, old_size, bitmap->size - old_size);
+        }
+        hbitmap_free(old);
+    }
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -4487,14 +4998,84 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
     cookie->type = type;
 }
 
+static void bdrv_latency_histogram_add(BlockLatencyHistogram *hist,
+                                       enum BlockLatencySource src,
+                                       uint64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1;
+
+    /* find the first bin whose upper boundary is above the latency */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[src * hist->nbins + lo]++;
+}
+
+/* Returns 0 if the histogram of @type is disabled, so that requests only
+ * read the clock when somebody asked for their latency.
+ */
+static int64_t bdrv_latency_start(BlockDriverState *bs,
+                                  enum BlockAcctType type)
+{
+    return bs->latency_histogram[type].nbins ? get_clock() : 0;
+}
+
+static void bdrv_latency_end(BlockDriverState *bs, enum BlockAcctType type,
+                             enum BlockLatencySource src, int64_t start)
+{
+    BlockLatencyHistogram *hist = &bs->latency_histogram[type];
+
+    /* the histogram may have been enabled while the request ran */
+    if (start && hist->nbins) {
+        bdrv_latency_histogram_add(hist, src, get_clock() - start);
+    }
+}
+
+/**
+ * Replace the latency histogram of @type by an empty one, with the
+ * @nboundaries ascending values in @boundaries (in nanoseconds) as bin
+ * boundaries.  The histogram is disabled if @nboundaries is zero.
+ */
+void bdrv_latency_histogram_set(BlockDriverState *bs, enum BlockAcctType type,
+                                const uint64_t *boundaries, int nboundaries)
+{
+    BlockLatencyHistogram *hist = &bs->latency_histogram[type];
+
+    assert(type < BDRV_MAX_IOTYPE);
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    memset(hist, 0, sizeof(*hist));
+
+    if (nboundaries > 0) {
+        hist->nbins = nboundaries + 1;
+        hist->boundaries = g_memdup(boundaries,
+                                    nboundaries * sizeof(*boundaries));
+        hist->bins = g_new0(uint64_t, BDRV_LATENCY_MAX * hist->nbins);
+    }
+}
+
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    int64_t latency_ns = get_clock() - cookie->start_time_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+
+    if (bs->latency_histogram[cookie->type].nbins) {
+        bdrv_latency_histogram_add(&bs->latency_histogram[cookie->type],
+                                   BDRV_LATENCY_TOTAL, latency_ns);
+    }
 }
 
 void bdrv_img_create(const char *filename, const char *fmt,
@@ -4658,6 +5239,12 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier)
+{
+    notifier_with_return_list_add(&bs->after_write_notifiers, notifier);
+}
+
 int bdrv_amend_options(BlockDriverState *bs, QEMUOptionParameter *options)
 {
     if (bs->drv->bdrv_amend_options == NULL) {
@@ -4684,3 +5271,30 @@ ExtSnapshotPerm bdrv_check_ext_snapshot_forbidden(BlockDriverState *bs)
 {
     return EXT_SNAPSHOT_FORBIDDEN;
 }
+
+/*
+ * Requests issued between bdrv_io_plug() and bdrv_io_unplug() may be queued by
+ * the protocol driver and submitted to the host together when the last
+ * unplug happens.  Calls nest.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
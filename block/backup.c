@@ -28,9 +28,8 @@
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
-    int64_t start;
-    int64_t end;
-    QLIST_ENTRY(CowRequest) list;
+    IntervalTreeNode node;  /* clusters [start, end) */
+    struct BackupBlockJob *job;
     CoQueue wait_queue; /* coroutines blocked on this request */
 } CowRequest;
 
@@ -44,7 +43,11 @@ typedef struct BackupBlockJob {
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
     HBitmap *bitmap;
-    QLIST_HEAD(, CowRequest) inflight_reqs;
+    /* For MIRROR_SYNC_MODE_INCREMENTAL: the named bitmap and the contents it
+     * had when the job was started, i.e. the sectors that must be copied */
+    BdrvDirtyBitmap *sync_bitmap;
+    HBitmap *sync_hbitmap;
+    IntervalTree inflight_reqs;
 } BackupBlockJob;
 
 /* See if in-flight requests overlap and wait for them to complete */
@@ -52,35 +55,28 @@ static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
                                                        int64_t end)
 {
+    IntervalTreeNode *node;
     CowRequest *req;
-    bool retry;
-
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &job->inflight_reqs, list) {
-            if (end > req->start && start < req->end) {
-                qemu_co_queue_wait(&req->wait_queue);
-                retry = true;
-                break;
-            }
-        }
-    } while (retry);
+
+    while ((node = interval_tree_find(&job->inflight_reqs, start, end))) {
+        req = interval_tree_entry(node, CowRequest, node);
+        qemu_co_queue_wait(&req->wait_queue);
+    }
 }
 
 /* Keep track of an in-flight request */
 static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
                                      int64_t start, int64_t end)
 {
-    req->start = start;
-    req->end = end;
+    req->job = job;
     qemu_co_queue_init(&req->wait_queue);
-    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
+    interval_tree_insert(&job->inflight_reqs, &req->node, start, end);
 }
 
 /* Forget about a completed request */
 static void cow_request_end(CowRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->job->inflight_reqs, &req->node);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -138,7 +134,8 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
 
         if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
             ret = bdrv_co_write_zeroes(job->target,
-                                       start * BACKUP_SECTORS_PER_CLUSTER, n);
+                                       start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                       BDRV_REQ_MAY_UNMAP);
         } else {
             ret = bdrv_co_writev(job->target,
                                  start * BACKUP_SECTORS_PER_CLUSTER, n,
@@ -221,6 +218,56 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+/* Mark the clusters that are clean in the sync bitmap as already copied, so
+ * that neither the main loop nor guest writes copy them */
+static void backup_incremental_init_bitmap(BackupBlockJob *job, int64_t end)
+{
+    HBitmapIter hbi;
+    int64_t sector, last_sector, cluster, last;
+    uint64_t count;
+    int64_t nb_sectors = job->common.len / BDRV_SECTOR_SIZE;
+
+    if (!end) {
+        return;
+    }
+    hbitmap_set(job->bitmap, 0, end);
+
+    hbitmap_iter_init(&hbi, job->sync_hbitmap, 0);
+    while ((sector = hbitmap_iter_next_run(&hbi, &count)) >= 0) {
+        last_sector = MIN(sector + count, nb_sectors);
+        cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+        last = DIV_ROUND_UP(last_sector, BACKUP_SECTORS_PER_CLUSTER);
+        hbitmap_reset(job->bitmap, cluster, last - cluster);
+    }
+
+    /* Report the clean part of the device as done */
+    job->common.offset = MAX(0, job->common.len -
+        (int64_t)(end - hbitmap_count(job->bitmap)) * BACKUP_CLUSTER_SIZE);
+}
+
+/* Returns the first cluster starting at @cluster that the main loop must
+ * copy, or @end if there is none */
+static int64_t backup_next_cluster(BackupBlockJob *job, int64_t cluster,
+                                   int64_t end)
+{
+    HBitmapIter hbi;
+    int64_t sector;
+
+    if (!job->sync_hbitmap || cluster >= end) {
+        return cluster;
+    }
+
+    /* The first item returned may be a granule that starts before
+     * @cluster, but is partly within it */
+    hbitmap_iter_init(&hbi, job->sync_hbitmap,
+                      cluster * BACKUP_SECTORS_PER_CLUSTER);
+    sector = hbitmap_iter_next(&hbi);
+    if (sector < 0) {
+        return end;
+    }
+    return MAX(cluster, sector / BACKUP_SECTORS_PER_CLUSTER);
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -233,7 +280,7 @@ static void coroutine_fn backup_run(void *opaque)
     int64_t start, end;
     int ret = 0;
 
-    QLIST_INIT(&job->inflight_reqs);
+    interval_tree_init(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
     start = 0;
@@ -241,6 +288,9 @@ static void coroutine_fn backup_run(void *opaque)
                        BACKUP_SECTORS_PER_CLUSTER);
 
     job->bitmap = hbitmap_alloc(end, 0);
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        backup_incremental_init_bitmap(job, end);
+    }
 
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
@@ -257,8 +307,9 @@ static void coroutine_fn backup_run(void *opaque)
             job->common.busy = true;
         }
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
+        /* FULL, TOP and INCREMENTAL SYNC_MODE's require copying.. */
+        for (start = backup_next_cluster(job, start, end); start < end;
+             start = backup_next_cluster(job, start + 1, end)) {
             bool error_is_read;
 
             if (block_job_is_cancelled(&job->common)) {
@@ -337,6 +388,16 @@ static void coroutine_fn backup_run(void *opaque)
 
     hbitmap_free(job->bitmap);
 
+    if (job->sync_bitmap) {
+        if (ret < 0 || block_job_is_cancelled(&job->common)) {
+            /* Not everything was copied, so the next incremental backup
+             * must pick up the sectors again */
+            bdrv_dirty_bitmap_merge(job->sync_bitmap, job->sync_hbitmap);
+        }
+        hbitmap_free(job->sync_hbitmap);
+        job->sync_bitmap->in_use = false;
+    }
+
     bdrv_iostatus_disable(target);
     bdrv_unref(target);
 
@@ -345,6 +406,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -355,6 +417,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     assert(bs);
     assert(target);
     assert(cb);
+    assert((sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) == !!sync_bitmap);
 
     if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
@@ -380,6 +443,12 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    if (sync_bitmap) {
+        /* From now on the bitmap records the writes for the next backup */
+        job->sync_bitmap = sync_bitmap;
+        job->sync_hbitmap = bdrv_dirty_bitmap_detach(sync_bitmap);
+        sync_bitmap->in_use = true;
+    }
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
@@ -24,6 +24,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Number of coroutines that copy data in parallel */
+    COMMIT_WORKERS = 8,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -37,6 +40,13 @@ typedef struct CommitBlockJob {
     BlockdevOnError on_error;
     int base_flags;
     int orig_overlay_flags;
+
+    int64_t sector_num;         /* start of the next range to copy */
+    int64_t end;
+    int workers;
+    int ret;
+    bool waiting;               /* commit_run() waits for the workers */
+    CoQueue paused_workers;
 } CommitBlockJob;
 
 static int coroutine_fn commit_populate(BlockDriverState *bs,
@@ -59,43 +69,16 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
-static void coroutine_fn commit_run(void *opaque)
+/* Copy the sectors of [sector_num, end) that are allocated above the base */
+static int coroutine_fn commit_range(CommitBlockJob *s, int64_t sector_num,
+                                     int64_t end, void *buf)
 {
-    CommitBlockJob *s = opaque;
-    BlockDriverState *active = s->active;
     BlockDriverState *top = s->top;
     BlockDriverState *base = s->base;
-    BlockDriverState *overlay_bs;
-    int64_t sector_num, end;
-    int ret = 0;
-    int n = 0;
-    void *buf;
-    int bytes_written = 0;
-    int64_t base_len;
-
-    ret = s->common.len = bdrv_getlength(top);
-
-
-    if (s->common.len < 0) {
-        goto exit_restore_reopen;
-    }
-
-    ret = base_len = bdrv_getlength(base);
-    if (base_len < 0) {
-        goto exit_restore_reopen;
-    }
+    int64_t status;
+    int ret, n, pnum;
 
-    if (base_len < s->common.len) {
-        ret = bdrv_truncate(base, s->common.len);
-        if (ret) {
-            goto exit_restore_reopen;
-        }
-    }
-
-    end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
-
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    for (; sector_num < end; sector_num += n) {
         uint64_t delay_ns = 0;
         bool copy;
 
@@ -103,17 +86,34 @@ wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
-        block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
-            break;
+        co_sleep_ns(QEMU_CLOCK_REALTIME, delay_ns);
+        while (block_job_is_paused(&s->common) &&
+               !block_job_is_cancelled(&s->common)) {
+            qemu_co_queue_wait(&s->paused_workers);
+        }
+        if (block_job_is_cancelled(&s->common) || s->ret < 0) {
+            return 0;
         }
         /* Copy if allocated above the base */
         ret = bdrv_is_allocated_above(top, base, sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
+                                      MIN(end - sector_num,
+                                          COMMIT_BUFFER_SIZE /
+                                          BDRV_SECTOR_SIZE),
                                       &n);
         copy = (ret == 1);
-        trace_commit_one_iteration(s, sector_num, n, ret);
+        status = 0;
         if (copy) {
+            /* Zeroes in top need not be read and rewritten */
+            status = bdrv_get_block_status(top, sector_num, n, &pnum);
+            if (status >= 0 && (status & BDRV_BLOCK_ZERO)) {
+                n = pnum;
+            }
+        }
+        trace_commit_one_iteration(s, sector_num, n, ret);
+        if (copy && status >= 0 && (status & BDRV_BLOCK_ZERO)) {
+            ret = bdrv_co_write_zeroes(base, sector_num, n,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else if (copy) {
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
                 if (delay_ns > 0) {
@@ -121,13 +121,12 @@ wait:
                 }
             }
             ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
         }
         if (ret < 0) {
             if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
                 s->on_error == BLOCKDEV_ON_ERROR_REPORT||
                 (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
-                goto exit_free_buf;
+                return ret;
             } else {
                 n = 0;
                 continue;
@@ -136,17 +135,102 @@ wait:
         /* Publish progress */
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
+    return 0;
+}
+
+/* Each worker claims the next COMMIT_BUFFER_SIZE bytes of the image and
+ * copies them, so that reads from the top of one worker overlap with the
+ * writes to the base of the others.  The ranges of the workers are
+ * disjoint, so their writes never overlap.
+ */
+static void coroutine_fn commit_worker(void *opaque)
+{
+    CommitBlockJob *s = opaque;
+    int64_t sector_num, end;
+    void *buf;
+    int ret;
+
+    buf = qemu_blockalign(s->top, COMMIT_BUFFER_SIZE);
+    while (s->sector_num < s->end && s->ret == 0 &&
+           !block_job_is_cancelled(&s->common)) {
+        sector_num = s->sector_num;
+        end = MIN(s->end, sector_num + COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+        s->sector_num = end;
+
+        ret = commit_range(s, sector_num, end, buf);
+        if (ret < 0 && s->ret == 0) {
+            s->ret = ret;
+        }
+    }
+    qemu_vfree(buf);
+
+    /* The last worker wakes up commit_run() */
+    if (--s->workers == 0 && (s->waiting || !s->common.busy)) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn commit_run(void *opaque)
+{
+    CommitBlockJob *s = opaque;
+    BlockDriverState *active = s->active;
+    BlockDriverState *top = s->top;
+    BlockDriverState *base = s->base;
+    BlockDriverState *overlay_bs;
+    int ret = 0;
+    int64_t base_len;
+    int i;
+
+    ret = s->common.len = bdrv_getlength(top);
+
+
+    if (s->common.len < 0) {
+        goto exit_restore_reopen;
+    }
+
+    ret = base_len = bdrv_getlength(base);
+    if (base_len < 0) {
+        goto exit_restore_reopen;
+    }
+
+    if (base_len < s->common.len) {
+        ret = bdrv_truncate(base, s->common.len);
+        if (ret) {
+            goto exit_restore_reopen;
+        }
+    }
+
+    s->end = s->common.len >> BDRV_SECTOR_BITS;
+    s->sector_num = 0;
+    s->ret = 0;
+    qemu_co_queue_init(&s->paused_workers);
 
-    ret = 0;
+    for (i = 0; i < COMMIT_WORKERS; i++) {
+        Coroutine *co = qemu_coroutine_create(commit_worker);
+        s->workers++;
+        qemu_coroutine_enter(co, s);
+    }
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end) {
+    while (s->workers > 0) {
+        if (block_job_is_cancelled(&s->common)) {
+            s->waiting = true;
+            qemu_coroutine_yield();
+            s->waiting = false;
+        } else {
+            /* Returns early when the job is resumed or cancelled */
+            block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, SLICE_TIME);
+        }
+        qemu_co_queue_restart_all(&s->paused_workers);
+    }
+
+    ret = s->ret;
+
+    if (!block_job_is_cancelled(&s->common) && ret == 0) {
         /* success */
+        assert(s->sector_num >= s->end);
         ret = bdrv_drop_intermediate(active, top, base);
     }
 
-exit_free_buf:
-    qemu_vfree(buf);
-
 exit_restore_reopen:
     /* restore base open flags here if appropriate (e.g., change the base back
      * to r/o). These reopens do not need to be atomic, since we won't abort
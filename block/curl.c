@@ -39,9 +39,10 @@
                    CURLPROTO_TFTP)
 
 #define CURL_NUM_STATES 8
-#define CURL_NUM_ACB    8
+#define CURL_MAX_STATES 64
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+#define CURL_CACHE_SIZE (16 * 1024 * 1024)
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -59,12 +60,21 @@ typedef struct CURLAIOCB {
 
     size_t start;
     size_t end;
+    QTAILQ_ENTRY(CURLAIOCB) next;
 } CURLAIOCB;
 
+/* The data of a completed transfer, kept for later reads */
+typedef struct CURLCacheEntry {
+    size_t start;
+    size_t len;
+    char *buf;
+    QTAILQ_ENTRY(CURLCacheEntry) next;
+} CURLCacheEntry;
+
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
-    CURLAIOCB *acb[CURL_NUM_ACB];
+    QTAILQ_HEAD(, CURLAIOCB) acbs;  /* waiting for data of this transfer */
     CURL *curl;
     char *orig_buf;
     size_t buf_start;
@@ -78,14 +88,25 @@ typedef struct CURLState
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
     size_t readahead_size;
     bool accept_range;
+
+    /* Shared by all states, most recently used entry first */
+    QTAILQ_HEAD(CURLCacheHead, CURLCacheEntry) cache;
+    size_t cache_size;
+    size_t cache_max;
+
+    /* Requests waiting for a free state */
+    QTAILQ_HEAD(, CURLAIOCB) pending;
+    QEMUBH *pending_bh;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
 static void curl_multi_do(void *arg);
+static void curl_readv_start(CURLAIOCB *acb);
 
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
                         void *s, void *sp)
@@ -127,28 +148,28 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
     size_t realsize = size * nmemb;
-    int i;
+    CURLAIOCB *acb, *tmp;
 
     DPRINTF("CURL: Just reading %zd bytes\n", realsize);
 
     if (!s || !s->orig_buf)
         goto read_end;
 
+    /* Do not trust the server to send no more than the range */
+    if (realsize > s->buf_len - s->buf_off) {
+        return 0;
+    }
+
     memcpy(s->orig_buf + s->buf_off, ptr, realsize);
     s->buf_off += realsize;
 
-    for(i=0; i<CURL_NUM_ACB; i++) {
-        CURLAIOCB *acb = s->acb[i];
-
-        if (!acb)
-            continue;
-
+    QTAILQ_FOREACH_SAFE(acb, &s->acbs, next, tmp) {
         if ((s->buf_off >= acb->end)) {
+            QTAILQ_REMOVE(&s->acbs, acb, next);
             qemu_iovec_from_buf(acb->qiov, 0, s->orig_buf + acb->start,
                                 acb->end - acb->start);
             acb->common.cb(acb->common.opaque, 0);
             qemu_aio_release(acb);
-            s->acb[i] = NULL;
         }
     }
 
@@ -156,26 +177,50 @@ read_end:
     return realsize;
 }
 
+static void curl_cache_add(BDRVCURLState *s, size_t start, size_t len,
+                           char *buf)
+{
+    CURLCacheEntry *entry;
+
+    if (len == 0 || len > s->cache_max) {
+        g_free(buf);
+        return;
+    }
+
+    entry = g_new(CURLCacheEntry, 1);
+    entry->start = start;
+    entry->len = len;
+    entry->buf = buf;
+    QTAILQ_INSERT_HEAD(&s->cache, entry, next);
+    s->cache_size += len;
+
+    while (s->cache_size > s->cache_max) {
+        entry = QTAILQ_LAST(&s->cache, CURLCacheHead);
+        QTAILQ_REMOVE(&s->cache, entry, next);
+        s->cache_size -= entry->len;
+        g_free(entry->buf);
+        g_free(entry);
+    }
+}
+
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
                          CURLAIOCB *acb)
 {
+    CURLCacheEntry *entry;
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
 
-        if (!state->orig_buf)
-            continue;
-        if (!state->buf_off)
+        if (!state->in_use || !state->orig_buf) {
             continue;
+        }
 
         // Does the existing buffer cover our section?
         if ((start >= state->buf_start) &&
-            (start <= buf_end) &&
-            (end >= state->buf_start) &&
             (end <= buf_end))
         {
             char *buf = state->orig_buf + (start - state->buf_start);
@@ -188,27 +233,54 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
 
         // Wait for unfinished chunks
         if ((start >= state->buf_start) &&
-            (start <= buf_fend) &&
-            (end >= state->buf_start) &&
             (end <= buf_fend))
         {
-            int j;
-
             acb->start = start - state->buf_start;
             acb->end = acb->start + len;
+            QTAILQ_INSERT_TAIL(&state->acbs, acb, next);
+            return FIND_RET_WAIT;
+        }
+    }
 
-            for (j=0; j<CURL_NUM_ACB; j++) {
-                if (!state->acb[j]) {
-                    state->acb[j] = acb;
-                    return FIND_RET_WAIT;
-                }
-            }
+    QTAILQ_FOREACH(entry, &s->cache, next) {
+        if (start >= entry->start && end <= entry->start + entry->len) {
+            qemu_iovec_from_buf(acb->qiov, 0,
+                                entry->buf + (start - entry->start), len);
+            acb->common.cb(acb->common.opaque, 0);
+
+            QTAILQ_REMOVE(&s->cache, entry, next);
+            QTAILQ_INSERT_HEAD(&s->cache, entry, next);
+            return FIND_RET_OK;
         }
     }
 
     return FIND_RET_NONE;
 }
 
+/* Returns how far a transfer that starts at @start can read ahead up to
+ * @end without fetching data that another transfer or the cache has.
+ */
+static size_t curl_readahead_end(BDRVCURLState *s, size_t start, size_t end)
+{
+    CURLCacheEntry *entry;
+    int i;
+
+    for (i = 0; i < s->num_states; i++) {
+        CURLState *state = &s->states[i];
+
+        if (state->in_use && state->orig_buf &&
+            state->buf_start >= start && state->buf_start < end) {
+            end = state->buf_start;
+        }
+    }
+    QTAILQ_FOREACH(entry, &s->cache, next) {
+        if (entry->start >= start && entry->start < end) {
+            end = entry->start;
+        }
+    }
+    return end;
+}
+
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
@@ -238,23 +310,26 @@ static void curl_multi_do(void *arg)
             case CURLMSG_DONE:
             {
                 CURLState *state = NULL;
-                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
+                CURLAIOCB *acb;
 
-                /* ACBs for successful messages get completed in curl_read_cb */
-                if (msg->data.result != CURLE_OK) {
-                    int i;
-                    for (i = 0; i < CURL_NUM_ACB; i++) {
-                        CURLAIOCB *acb = state->acb[i];
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
 
-                        if (acb == NULL) {
-                            continue;
-                        }
+                /* ACBs for successful messages get completed in
+                 * curl_read_cb, those left did not get their data.
+                 */
+                while ((acb = QTAILQ_FIRST(&state->acbs)) != NULL) {
+                    QTAILQ_REMOVE(&state->acbs, acb, next);
+                    acb->common.cb(acb->common.opaque, -EIO);
+                    qemu_aio_release(acb);
+                }
 
-                        acb->common.cb(acb->common.opaque, -EIO);
-                        qemu_aio_release(acb);
-                        state->acb[i] = NULL;
-                    }
+                if (msg->data.result == CURLE_OK) {
+                    curl_cache_add(s, state->buf_start, state->buf_off,
+                                   state->orig_buf);
+                } else {
+                    g_free(state->orig_buf);
                 }
+                state->orig_buf = NULL;
 
                 curl_clean_state(state);
                 break;
@@ -266,35 +341,26 @@ static void curl_multi_do(void *arg)
     } while(msgs_in_queue);
 }
 
-static CURLState *curl_init_state(BDRVCURLState *s)
+static CURLState *curl_find_state(BDRVCURLState *s)
 {
-    CURLState *state = NULL;
-    int i, j;
+    int i;
 
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
-
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
-        }
-        if (!state) {
-            g_usleep(100);
-            curl_multi_do(s);
+    for (i = 0; i < s->num_states; i++) {
+        if (!s->states[i].in_use) {
+            return &s->states[i];
         }
-    } while(!state);
+    }
+    return NULL;
+}
 
+static int curl_init_state(BDRVCURLState *s, CURLState *state)
+{
     if (state->curl)
         goto has_curl;
 
     state->curl = curl_easy_init();
     if (!state->curl)
-        return NULL;
+        return -EIO;
     curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
     curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, 5);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
@@ -324,8 +390,9 @@ static CURLState *curl_init_state(BDRVCURLState *s)
 has_curl:
 
     state->s = s;
+    state->in_use = 1;
 
-    return state;
+    return 0;
 }
 
 static void curl_clean_state(CURLState *s)
@@ -333,6 +400,21 @@ static void curl_clean_state(CURLState *s)
     if (s->s->multi)
         curl_multi_remove_handle(s->s->multi, s->curl);
     s->in_use = 0;
+
+    if (!QTAILQ_EMPTY(&s->s->pending)) {
+        qemu_bh_schedule(s->s->pending_bh);
+    }
+}
+
+static void curl_pending_bh_cb(void *opaque)
+{
+    BDRVCURLState *s = opaque;
+    CURLAIOCB *acb;
+
+    while ((acb = QTAILQ_FIRST(&s->pending)) != NULL && curl_find_state(s)) {
+        QTAILQ_REMOVE(&s->pending, acb, next);
+        curl_readv_start(acb);
+    }
 }
 
 static void curl_parse_filename(const char *filename, QDict *options,
@@ -391,6 +473,16 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Readahead size",
         },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache of data read ahead (0 to disable)",
+        },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of parallel transfers",
+        },
         { /* end of list */ }
     },
 };
@@ -404,6 +496,7 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     Error *local_err = NULL;
     const char *file;
     double d;
+    int i;
 
     static int inited = 0;
 
@@ -428,6 +521,20 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->cache_max = qemu_opt_get_size(opts, "cache-size", CURL_CACHE_SIZE);
+    s->num_states = qemu_opt_get_number(opts, "connections", CURL_NUM_STATES);
+    if (s->num_states < 1 || s->num_states > CURL_MAX_STATES) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "curl 'connections' must be "
+                      "between 1 and %d", CURL_MAX_STATES);
+        goto out_noclean;
+    }
+    s->states = g_new0(CURLState, s->num_states);
+    for (i = 0; i < s->num_states; i++) {
+        QTAILQ_INIT(&s->states[i].acbs);
+    }
+    QTAILQ_INIT(&s->cache);
+    QTAILQ_INIT(&s->pending);
+
     file = qemu_opt_get(opts, "url");
     if (file == NULL) {
         qerror_report(ERROR_CLASS_GENERIC_ERROR, "curl block driver requires "
@@ -442,8 +549,8 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
 
     DPRINTF("CURL: Opening %s\n", file);
     s->url = g_strdup(file);
-    state = curl_init_state(s);
-    if (!state)
+    state = &s->states[0];
+    if (curl_init_state(s, state) < 0)
         goto out_noclean;
 
     // Get file size
@@ -480,6 +587,7 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
     curl_multi_do(s);
+    s->pending_bh = qemu_bh_new(curl_pending_bh_cb, s);
 
     qemu_opts_del(opts);
     return 0;
@@ -489,6 +597,7 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    g_free(s->states);
     g_free(s->url);
     qemu_opts_del(opts);
     return -EINVAL;
@@ -505,16 +614,10 @@ static const AIOCBInfo curl_aiocb_info = {
 };
 
 
-static void curl_readv_bh_cb(void *p)
+static void curl_readv_start(CURLAIOCB *acb)
 {
     CURLState *state;
-
-    CURLAIOCB *acb = p;
     BDRVCURLState *s = acb->common.bs->opaque;
-
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-
     size_t start = acb->sector_num * SECTOR_SIZE;
     size_t end;
 
@@ -531,8 +634,13 @@ static void curl_readv_bh_cb(void *p)
     }
 
     // No cache found, so let's start a new request
-    state = curl_init_state(s);
+    state = curl_find_state(s);
     if (!state) {
+        /* all connections are busy, retry when one is done */
+        QTAILQ_INSERT_TAIL(&s->pending, acb, next);
+        return;
+    }
+    if (curl_init_state(s, state) < 0) {
         acb->common.cb(acb->common.opaque, -EIO);
         qemu_aio_release(acb);
         return;
@@ -541,14 +649,16 @@ static void curl_readv_bh_cb(void *p)
     acb->start = 0;
     acb->end = (acb->nb_sectors * SECTOR_SIZE);
 
+    /* Read ahead, but not into data that is already being fetched */
+    end = MIN(start + acb->end + s->readahead_size, s->len);
+    end = curl_readahead_end(s, start + acb->end, end);
+
     state->buf_off = 0;
-    if (state->orig_buf)
-        g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
+    state->buf_len = MAX(end - start, acb->end);
+    end = start + state->buf_len - 1;
     state->orig_buf = g_malloc(state->buf_len);
-    state->acb[0] = acb;
+    QTAILQ_INSERT_TAIL(&state->acbs, acb, next);
 
     snprintf(state->range, 127, "%zd-%zd", start, end);
     DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
@@ -560,6 +670,16 @@ static void curl_readv_bh_cb(void *p)
 
 }
 
+static void curl_readv_bh_cb(void *p)
+{
+    CURLAIOCB *acb = p;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+
+    curl_readv_start(acb);
+}
+
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -580,10 +700,11 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
 static void curl_close(BlockDriverState *bs)
 {
     BDRVCURLState *s = bs->opaque;
+    CURLCacheEntry *entry;
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
         if (s->states[i].curl) {
@@ -597,6 +718,13 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    qemu_bh_delete(s->pending_bh);
+    while ((entry = QTAILQ_FIRST(&s->cache)) != NULL) {
+        QTAILQ_REMOVE(&s->cache, entry, next);
+        g_free(entry->buf);
+        g_free(entry);
+    }
+    g_free(s->states);
     g_free(s->url);
 }
 
@@ -3,11 +3,9 @@
  *
  * Copyright (C) 2012 Bharata B Rao <bharata@linux.vnet.ibm.com>
  *
- * Pipe handling mechanism in AIO implementation is derived from
- * block/rbd.c. Hence,
- *
- * Copyright (C) 2010-2011 Christian Brunner <chb@muc.de>,
- *                         Josh Durgin <josh.durgin@dreamhost.com>
+ * Completions are handed from the gluster callback threads to the main
+ * loop through a locked queue and an event notifier, so that requests
+ * finishing close together are completed in one pass.
  *
  * This work is licensed under the terms of the GNU GPL, version 2.  See
  * the COPYING file in the top-level directory.
@@ -19,6 +17,8 @@
 #include "block/block_int.h"
 #include "qemu/sockets.h"
 #include "qemu/uri.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
 
 typedef struct GlusterAIOCB {
     BlockDriverAIOCB common;
@@ -26,19 +26,19 @@ typedef struct GlusterAIOCB {
     int ret;
     bool *finished;
     QEMUBH *bh;
+    QSIMPLEQ_ENTRY(GlusterAIOCB) next;
 } GlusterAIOCB;
 
+typedef QSIMPLEQ_HEAD(GlusterAIOCBQueue, GlusterAIOCB) GlusterAIOCBQueue;
+
 typedef struct BDRVGlusterState {
     struct glfs *glfs;
-    int fds[2];
     struct glfs_fd *fd;
-    int event_reader_pos;
-    GlusterAIOCB *event_acb;
+    EventNotifier e;
+    QemuMutex lock;             /* protects completed */
+    GlusterAIOCBQueue completed;
 } BDRVGlusterState;
 
-#define GLUSTER_FD_READ  0
-#define GLUSTER_FD_WRITE 1
-
 typedef struct GlusterConf {
     char *server;
     int port;
@@ -253,24 +253,23 @@ static void qemu_gluster_complete_aio(GlusterAIOCB *acb, BDRVGlusterState *s)
     }
 }
 
-static void qemu_gluster_aio_event_reader(void *opaque)
+static void qemu_gluster_completion_cb(EventNotifier *e)
 {
-    BDRVGlusterState *s = opaque;
-    ssize_t ret;
-
-    do {
-        char *p = (char *)&s->event_acb;
-
-        ret = read(s->fds[GLUSTER_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_acb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_acb)) {
-                s->event_reader_pos = 0;
-                qemu_gluster_complete_aio(s->event_acb, s);
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
+    BDRVGlusterState *s = container_of(e, BDRVGlusterState, e);
+    GlusterAIOCBQueue completed = QSIMPLEQ_HEAD_INITIALIZER(completed);
+    GlusterAIOCB *acb;
+
+    /* Clear before taking the queue, a later completion sets it again */
+    event_notifier_test_and_clear(e);
+
+    qemu_mutex_lock(&s->lock);
+    QSIMPLEQ_CONCAT(&completed, &s->completed);
+    qemu_mutex_unlock(&s->lock);
+
+    while ((acb = QSIMPLEQ_FIRST(&completed))) {
+        QSIMPLEQ_REMOVE_HEAD(&completed, next);
+        qemu_gluster_complete_aio(acb, s);
+    }
 }
 
 /* TODO Convert to fine grained options */
@@ -332,14 +331,13 @@ static int qemu_gluster_open(BlockDriverState *bs,  QDict *options,
         goto out;
     }
 
-    ret = qemu_pipe(s->fds);
+    ret = event_notifier_init(&s->e, false);
     if (ret < 0) {
-        ret = -errno;
         goto out;
     }
-    fcntl(s->fds[GLUSTER_FD_READ], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ],
-        qemu_gluster_aio_event_reader, NULL, s);
+    qemu_mutex_init(&s->lock);
+    QSIMPLEQ_INIT(&s->completed);
+    qemu_aio_set_event_notifier(&s->e, qemu_gluster_completion_cb);
 
 out:
     qemu_opts_del(opts);
@@ -419,17 +417,19 @@ static void gluster_finish_aiocb(struct glfs_fd *fd, ssize_t ret, void *arg)
     GlusterAIOCB *acb = (GlusterAIOCB *)arg;
     BlockDriverState *bs = acb->common.bs;
     BDRVGlusterState *s = bs->opaque;
-    int retval;
+    bool empty;
 
     acb->ret = ret;
-    retval = qemu_write_full(s->fds[GLUSTER_FD_WRITE], &acb, sizeof(acb));
-    if (retval != sizeof(acb)) {
-        /*
-         * Gluster AIO callback thread failed to notify the waiting
-         * QEMU thread about IO completion.
-         */
-        error_report("Gluster AIO completion failed: %s", strerror(errno));
-        abort();
+
+    qemu_mutex_lock(&s->lock);
+    empty = QSIMPLEQ_EMPTY(&s->completed);
+    QSIMPLEQ_INSERT_TAIL(&s->completed, acb, next);
+    qemu_mutex_unlock(&s->lock);
+
+    /* The main loop drains the whole queue, so only the first completion
+     * after it ran needs to wake it up */
+    if (empty) {
+        event_notifier_set(&s->e);
     }
 }
 
@@ -581,9 +581,9 @@ static void qemu_gluster_close(BlockDriverState *bs)
 {
     BDRVGlusterState *s = bs->opaque;
 
-    close(s->fds[GLUSTER_FD_READ]);
-    close(s->fds[GLUSTER_FD_WRITE]);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL);
+    qemu_aio_set_event_notifier(&s->e, NULL);
+    event_notifier_cleanup(&s->e);
+    qemu_mutex_destroy(&s->lock);
 
     if (s->fd) {
         glfs_close(s->fd);
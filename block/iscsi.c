@@ -44,18 +44,42 @@
 #include <block/scsi.h>
 #endif
 
+#define ISCSI_MAX_SESSIONS 16
+
+typedef struct IscsiSession {
+    struct IscsiLun *iscsilun;
+    struct iscsi_context *iscsi;
+    int events;
+    unsigned int in_flight;
+} IscsiSession;
+
+typedef struct IscsiUnmapReq {
+    uint64_t lba;
+    uint32_t num;
+    int ret;
+    bool done;
+    Coroutine *co;
+    QSIMPLEQ_ENTRY(IscsiUnmapReq) next;
+} IscsiUnmapReq;
+
 typedef struct IscsiLun {
+    /* the first session, used for setup and SCSI passthrough */
     struct iscsi_context *iscsi;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
+    AioContext *aio_context;
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int nb_sessions;
+    int next_session;
     QEMUTimer *nop_timer;
     uint8_t lbpme;
     uint8_t lbprz;
     struct scsi_inquiry_logical_block_provisioning lbp;
     struct scsi_inquiry_block_limits bl;
+    QSIMPLEQ_HEAD(, IscsiUnmapReq) unmap_queue;
+    bool unmap_busy;
 } IscsiLun;
 
 typedef struct IscsiTask {
@@ -72,6 +96,7 @@ typedef struct IscsiAIOCB {
     QEMUIOVector *qiov;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     struct scsi_task *task;
     uint8_t *buf;
     int status;
@@ -88,6 +113,29 @@ typedef struct IscsiAIOCB {
 #define MAX_NOP_FAILURES 3
 #define ISCSI_CMD_RETRIES 5
 #define ISCSI_MAX_UNMAP 131072
+#define ISCSI_MAX_UNMAP_DESCRIPTORS 256
+
+/*
+ * Pick the session with the fewest requests in flight.  Ties are broken
+ * round-robin so that a lightly loaded LUN still uses all connections.
+ */
+static IscsiSession *iscsi_get_session(IscsiLun *iscsilun)
+{
+    IscsiSession *best = NULL;
+    int i;
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        int n = (iscsilun->next_session + i) % iscsilun->nb_sessions;
+        IscsiSession *session = &iscsilun->sessions[n];
+
+        if (!best || session->in_flight < best->in_flight) {
+            best = session;
+        }
+    }
+    iscsilun->next_session = (iscsilun->next_session + 1) %
+                             iscsilun->nb_sessions;
+    return best;
+}
 
 static void
 iscsi_bh_cb(void *p)
@@ -99,6 +147,10 @@ iscsi_bh_cb(void *p)
     g_free(acb->buf);
     acb->buf = NULL;
 
+    if (acb->session) {
+        acb->session->in_flight--;
+    }
+
     if (acb->canceled == 0) {
         acb->common.cb(acb->common.opaque, acb->status);
     }
@@ -117,7 +169,7 @@ iscsi_schedule_bh(IscsiAIOCB *acb)
     if (acb->bh) {
         return;
     }
-    acb->bh = qemu_bh_new(iscsi_bh_cb, acb);
+    acb->bh = aio_bh_new(acb->iscsilun->aio_context, iscsi_bh_cb, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -171,7 +223,6 @@ static void
 iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     IscsiAIOCB *acb = (IscsiAIOCB *)blockacb;
-    IscsiLun *iscsilun = acb->iscsilun;
 
     if (acb->status != -EINPROGRESS) {
         return;
@@ -180,7 +231,7 @@ iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
     acb->canceled = 1;
 
     /* send a task mgmt call to the target to cancel the task on the target */
-    iscsi_task_mgmt_abort_task_async(iscsilun->iscsi, acb->task,
+    iscsi_task_mgmt_abort_task_async(acb->session->iscsi, acb->task,
                                      iscsi_abort_task_cb, acb);
 
     while (acb->status == -EINPROGRESS) {
@@ -198,43 +249,52 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_session_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev;
 
     /* We always register a read handler.  */
     ev = POLLIN;
     ev |= iscsi_which_events(iscsi);
-    if (ev != iscsilun->events) {
-        qemu_aio_set_fd_handler(iscsi_get_fd(iscsi),
-                      iscsi_process_read,
-                      (ev & POLLOUT) ? iscsi_process_write : NULL,
-                      iscsilun);
+    if (ev != session->events) {
+        aio_set_fd_handler(session->iscsilun->aio_context,
+                           iscsi_get_fd(iscsi),
+                           iscsi_process_read,
+                           (ev & POLLOUT) ? iscsi_process_write : NULL,
+                           session);
 
     }
 
-    iscsilun->events = ev;
+    session->events = ev;
+}
+
+static void
+iscsi_set_events(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        iscsi_session_set_events(&iscsilun->sessions[i]);
+    }
 }
 
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
 
-    iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLIN);
+    iscsi_session_set_events(session);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
 
-    iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLOUT);
+    iscsi_session_set_events(session);
 }
 
 static int
@@ -302,7 +362,7 @@ static bool is_request_lun_aligned(int64_t sector_num, int nb_sectors,
 static int
 iscsi_aio_writev_acb(IscsiAIOCB *acb)
 {
-    struct iscsi_context *iscsi = acb->iscsilun->iscsi;
+    struct iscsi_context *iscsi = acb->session->iscsi;
     size_t size;
     uint32_t num_sectors;
     uint64_t lba;
@@ -388,7 +448,9 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
     }
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
-    trace_iscsi_aio_writev(iscsilun->iscsi, sector_num, nb_sectors, opaque, acb);
+    acb->session     = iscsi_get_session(iscsilun);
+    trace_iscsi_aio_writev(acb->session->iscsi, sector_num, nb_sectors,
+                           opaque, acb);
 
     acb->iscsilun    = iscsilun;
     acb->qiov        = qiov;
@@ -400,6 +462,7 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
         qemu_aio_release(acb);
         return NULL;
     }
+    acb->session->in_flight++;
 
     iscsi_set_events(iscsilun);
     return &acb->common;
@@ -443,7 +506,7 @@ iscsi_aio_read16_cb(struct iscsi_context *iscsi, int status,
 static int
 iscsi_aio_readv_acb(IscsiAIOCB *acb)
 {
-    struct iscsi_context *iscsi = acb->iscsilun->iscsi;
+    struct iscsi_context *iscsi = acb->session->iscsi;
     size_t size;
     uint64_t lba;
     uint32_t num_sectors;
@@ -523,7 +586,9 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     }
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
-    trace_iscsi_aio_readv(iscsilun->iscsi, sector_num, nb_sectors, opaque, acb);
+    acb->session     = iscsi_get_session(iscsilun);
+    trace_iscsi_aio_readv(acb->session->iscsi, sector_num, nb_sectors,
+                          opaque, acb);
 
     acb->nb_sectors  = nb_sectors;
     acb->sector_num  = sector_num;
@@ -535,6 +600,7 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
         qemu_aio_release(acb);
         return NULL;
     }
+    acb->session->in_flight++;
 
     iscsi_set_events(iscsilun);
     return &acb->common;
@@ -576,7 +642,7 @@ iscsi_synccache10_cb(struct iscsi_context *iscsi, int status,
 static int
 iscsi_aio_flush_acb(IscsiAIOCB *acb)
 {
-    struct iscsi_context *iscsi = acb->iscsilun->iscsi;
+    struct iscsi_context *iscsi = acb->session->iscsi;
 
     acb->canceled   = 0;
     acb->bh         = NULL;
@@ -606,13 +672,16 @@ iscsi_aio_flush(BlockDriverState *bs,
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
+    /* SYNCHRONIZE CACHE applies to the whole LUN, whatever the session */
     acb->iscsilun    = iscsilun;
+    acb->session     = iscsi_get_session(iscsilun);
     acb->retries     = ISCSI_CMD_RETRIES;
 
     if (iscsi_aio_flush_acb(acb) != 0) {
         qemu_aio_release(acb);
         return NULL;
     }
+    acb->session->in_flight++;
 
     iscsi_set_events(iscsilun);
 
@@ -674,6 +743,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session     = &iscsilun->sessions[0];
     acb->canceled    = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
@@ -734,6 +804,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         qemu_aio_release(acb);
         return NULL;
     }
+    acb->session->in_flight++;
 
     /* tell libiscsi to read straight into the buffer we got from ioctl */
     if (acb->task->xfer_dir == SCSI_XFER_READ) {
@@ -818,6 +889,7 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
                                                   int nb_sectors, int *pnum)
 {
     IscsiLun *iscsilun = bs->opaque;
+    IscsiSession *session = iscsi_get_session(iscsilun);
     struct scsi_get_lba_status *lbas = NULL;
     struct scsi_lba_status_descriptor *lbasd = NULL;
     struct IscsiTask iTask;
@@ -840,17 +912,19 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
         goto out;
     }
 
+    session->in_flight++;
 retry:
-    if (iscsi_get_lba_status_task(iscsilun->iscsi, iscsilun->lun,
+    if (iscsi_get_lba_status_task(session->iscsi, iscsilun->lun,
                                   sector_qemu2lun(sector_num, iscsilun),
                                   8 + 16, iscsi_co_generic_cb,
                                   &iTask) == NULL) {
+        session->in_flight--;
         ret = -EIO;
         goto out;
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_session_set_events(session);
         qemu_coroutine_yield();
     }
 
@@ -861,6 +935,7 @@ retry:
         }
         goto retry;
     }
+    session->in_flight--;
 
     if (iTask.status != SCSI_STATUS_GOOD) {
         /* in case the get_lba_status_callout fails (i.e.
@@ -905,13 +980,129 @@ out:
 
 #endif /* LIBISCSI_FEATURE_IOVECTOR */
 
+static int coroutine_fn iscsi_co_unmap_list(IscsiSession *session,
+                                            struct unmap_list *list,
+                                            int nb_list)
+{
+    IscsiLun *iscsilun = session->iscsilun;
+    struct IscsiTask iTask;
+    int ret = 0;
+
+    iscsi_co_init_iscsitask(iscsilun, &iTask);
+    session->in_flight++;
+retry:
+    if (iscsi_unmap_task(session->iscsi, iscsilun->lun, 0, 0, list, nb_list,
+                         iscsi_co_generic_cb, &iTask) == NULL) {
+        ret = -EIO;
+        goto out;
+    }
+
+    while (!iTask.complete) {
+        iscsi_session_set_events(session);
+        qemu_coroutine_yield();
+    }
+
+    if (iTask.task != NULL) {
+        scsi_free_scsi_task(iTask.task);
+        iTask.task = NULL;
+    }
+
+    if (iTask.do_retry) {
+        iTask.complete = 0;
+        goto retry;
+    }
+
+    if (iTask.status == SCSI_STATUS_CHECK_CONDITION) {
+        /* the target might fail with a check condition if it
+           is not happy with the alignment of the UNMAP request
+           we silently fail in this case */
+        goto out;
+    }
+
+    if (iTask.status != SCSI_STATUS_GOOD) {
+        ret = -EIO;
+    }
+
+out:
+    session->in_flight--;
+    return ret;
+}
+
+static uint32_t iscsi_max_unmap(IscsiLun *iscsilun)
+{
+    uint32_t max_unmap = iscsilun->bl.max_unmap;
+
+    if (max_unmap == 0 || max_unmap == 0xffffffff) {
+        max_unmap = ISCSI_MAX_UNMAP;
+    }
+    return max_unmap;
+}
+
+/*
+ * Send the queued discard ranges in as few UNMAP commands as the block
+ * limits of the LUN allow.  While a command is in flight, new ranges
+ * accumulate in the queue and go out together in the next one; adjacent
+ * ranges share a descriptor.
+ */
+static void coroutine_fn iscsi_co_unmap_queue(IscsiLun *iscsilun)
+{
+    IscsiUnmapReq *reqs[ISCSI_MAX_UNMAP_DESCRIPTORS];
+    struct unmap_list list[ISCSI_MAX_UNMAP_DESCRIPTORS];
+    uint32_t max_unmap = iscsi_max_unmap(iscsilun);
+    uint32_t max_desc = iscsilun->bl.max_unmap_bdc;
+    int nb_reqs, nb_list, i, ret;
+
+    if (max_desc == 0) {
+        max_desc = 1;
+    } else if (max_desc > ISCSI_MAX_UNMAP_DESCRIPTORS) {
+        max_desc = ISCSI_MAX_UNMAP_DESCRIPTORS;
+    }
+
+    iscsilun->unmap_busy = true;
+    while (!QSIMPLEQ_EMPTY(&iscsilun->unmap_queue)) {
+        IscsiSession *session = iscsi_get_session(iscsilun);
+        IscsiUnmapReq *req;
+
+        nb_reqs = nb_list = 0;
+        while (nb_reqs < ISCSI_MAX_UNMAP_DESCRIPTORS &&
+               (req = QSIMPLEQ_FIRST(&iscsilun->unmap_queue)) != NULL) {
+            struct unmap_list *last = nb_list ? &list[nb_list - 1] : NULL;
+
+            if (last && last->lba + last->num == req->lba &&
+                last->num + req->num <= max_unmap) {
+                last->num += req->num;
+            } else if (nb_list < max_desc) {
+                list[nb_list].lba = req->lba;
+                list[nb_list].num = req->num;
+                nb_list++;
+            } else {
+                break;
+            }
+            QSIMPLEQ_REMOVE_HEAD(&iscsilun->unmap_queue, next);
+            reqs[nb_reqs++] = req;
+        }
+
+        trace_iscsi_co_unmap(session->iscsi, nb_reqs, nb_list);
+        ret = iscsi_co_unmap_list(session, list, nb_list);
+
+        for (i = 0; i < nb_reqs; i++) {
+            reqs[i]->ret = ret;
+            reqs[i]->done = true;
+            if (reqs[i]->co != qemu_coroutine_self()) {
+                qemu_coroutine_enter(reqs[i]->co, NULL);
+            }
+        }
+    }
+    iscsilun->unmap_busy = false;
+}
+
 static int
 coroutine_fn iscsi_co_discard(BlockDriverState *bs, int64_t sector_num,
                                    int nb_sectors)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct IscsiTask iTask;
-    struct unmap_list list;
+    IscsiUnmapReq req;
+    uint64_t lba;
     uint32_t nb_blocks;
     uint32_t max_unmap;
 
@@ -924,53 +1115,32 @@ coroutine_fn iscsi_co_discard(BlockDriverState *bs, int64_t sector_num,
         return 0;
     }
 
-    list.lba = sector_qemu2lun(sector_num, iscsilun);
+    lba = sector_qemu2lun(sector_num, iscsilun);
     nb_blocks = sector_qemu2lun(nb_sectors, iscsilun);
-
-    max_unmap = iscsilun->bl.max_unmap;
-    if (max_unmap == 0xffffffff) {
-        max_unmap = ISCSI_MAX_UNMAP;
-    }
+    max_unmap = iscsi_max_unmap(iscsilun);
 
     while (nb_blocks > 0) {
-        iscsi_co_init_iscsitask(iscsilun, &iTask);
-        list.num = nb_blocks;
-        if (list.num > max_unmap) {
-            list.num = max_unmap;
-        }
-retry:
-        if (iscsi_unmap_task(iscsilun->iscsi, iscsilun->lun, 0, 0, &list, 1,
-                         iscsi_co_generic_cb, &iTask) == NULL) {
-            return -EIO;
+        req = (IscsiUnmapReq) {
+            .lba = lba,
+            .num = MIN(nb_blocks, max_unmap),
+            .co  = qemu_coroutine_self(),
+        };
+        QSIMPLEQ_INSERT_TAIL(&iscsilun->unmap_queue, &req, next);
+
+        /* whoever is sending UNMAPs already will pick up our range */
+        if (!iscsilun->unmap_busy) {
+            iscsi_co_unmap_queue(iscsilun);
         }
-
-        while (!iTask.complete) {
-            iscsi_set_events(iscsilun);
+        while (!req.done) {
             qemu_coroutine_yield();
         }
 
-        if (iTask.task != NULL) {
-            scsi_free_scsi_task(iTask.task);
-            iTask.task = NULL;
-        }
-
-        if (iTask.do_retry) {
-            goto retry;
+        if (req.ret < 0) {
+            return req.ret;
         }
 
-        if (iTask.status == SCSI_STATUS_CHECK_CONDITION) {
-            /* the target might fail with a check condition if it
-               is not happy with the alignment of the UNMAP request
-               we silently fail in this case */
-            return 0;
-        }
-
-        if (iTask.status != SCSI_STATUS_GOOD) {
-            return -EIO;
-        }
-
-        list.lba += list.num;
-        nb_blocks -= list.num;
+        lba += req.num;
+        nb_blocks -= req.num;
     }
 
     return 0;
@@ -1090,15 +1260,21 @@ static char *parse_initiator_name(const char *target)
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) > MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
 
-    if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+        if (iscsi_get_nops_in_flight(iscsi) > MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            iscsi_reconnect(iscsi);
+        }
+
+        if (iscsi_nop_out_async(iscsi, NULL, NULL, 0, NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
@@ -1181,6 +1357,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "URL to the iscsi image",
         },
+        {
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of iSCSI sessions to spread requests over",
+        },
         { /* end of list */ }
     },
 };
@@ -1216,6 +1397,99 @@ fail:
         return NULL;
 }
 
+/*
+ * Log in to the target on a new session.  Sessions to the same target
+ * must differ in their ISID, so each one gets its own qualifier.
+ */
+static int iscsi_login(IscsiLun *iscsilun, IscsiSession *session,
+                       struct iscsi_url *iscsi_url, const char *initiator_name,
+                       uint32_t isid, int qualifier)
+{
+    struct iscsi_context *iscsi;
+    int ret;
+
+    iscsi = iscsi_create_context(initiator_name);
+    if (iscsi == NULL) {
+        error_report("iSCSI: Failed to create iSCSI context.");
+        return -ENOMEM;
+    }
+
+    if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
+        error_report("iSCSI: Failed to set target name.");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (iscsi_set_isid_random(iscsi, isid, qualifier) != 0) {
+        error_report("iSCSI: Failed to set ISID.");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (iscsi_url->user != NULL) {
+        ret = iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
+                                              iscsi_url->passwd);
+        if (ret != 0) {
+            error_report("Failed to set initiator username and password");
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    /* check if we got CHAP username/password via the options */
+    if (parse_chap(iscsi, iscsi_url->target) != 0) {
+        error_report("iSCSI: Failed to set CHAP user/password");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
+        error_report("iSCSI: Failed to set session type to normal.");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+
+    /* check if we got HEADER_DIGEST via the options */
+    parse_header_digest(iscsi, iscsi_url->target);
+
+    if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
+        error_report("iSCSI: Failed to connect to LUN : %s",
+            iscsi_get_error(iscsi));
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    session->iscsilun = iscsilun;
+    session->iscsi = iscsi;
+    session->events = 0;
+    session->in_flight = 0;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return ret;
+}
+
+static void iscsi_destroy_sessions(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        if (session->events) {
+            aio_set_fd_handler(iscsilun->aio_context,
+                               iscsi_get_fd(session->iscsi),
+                               NULL, NULL, NULL);
+        }
+        iscsi_destroy_context(session->iscsi);
+    }
+    iscsilun->nb_sessions = 0;
+    iscsilun->iscsi = NULL;
+}
+
 /*
  * We support iscsi url's on the form
  * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
@@ -1226,6 +1500,8 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     IscsiLun *iscsilun = bs->opaque;
     struct iscsi_context *iscsi = NULL;
     struct iscsi_url *iscsi_url = NULL;
+    int nb_sessions;
+    uint32_t isid;
     struct scsi_task *task = NULL;
     struct scsi_inquiry_standard *inq = NULL;
     char *initiator_name = NULL;
@@ -1251,6 +1527,13 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     filename = qemu_opt_get(opts, "filename");
+    nb_sessions = qemu_opt_get_number(opts, "sessions", 1);
+    if (nb_sessions < 1 || nb_sessions > ISCSI_MAX_SESSIONS) {
+        error_report("iSCSI: sessions must be between 1 and %d",
+                     ISCSI_MAX_SESSIONS);
+        ret = -EINVAL;
+        goto out;
+    }
 
 
     iscsi_url = iscsi_parse_full_url(iscsi, filename);
@@ -1261,57 +1544,20 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     memset(iscsilun, 0, sizeof(IscsiLun));
+    iscsilun->aio_context = bdrv_get_aio_context(bs);
+    QSIMPLEQ_INIT(&iscsilun->unmap_queue);
 
     initiator_name = parse_initiator_name(iscsi_url->target);
 
-    iscsi = iscsi_create_context(initiator_name);
-    if (iscsi == NULL) {
-        error_report("iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
-    }
-
-    if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
-        error_report("iSCSI: Failed to set target name.");
-        ret = -EINVAL;
-        goto out;
-    }
-
-    if (iscsi_url->user != NULL) {
-        ret = iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
-                                              iscsi_url->passwd);
-        if (ret != 0) {
-            error_report("Failed to set initiator username and password");
-            ret = -EINVAL;
-            goto out;
-        }
-    }
-
-    /* check if we got CHAP username/password via the options */
-    if (parse_chap(iscsi, iscsi_url->target) != 0) {
-        error_report("iSCSI: Failed to set CHAP user/password");
-        ret = -EINVAL;
-        goto out;
-    }
-
-    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
-        error_report("iSCSI: Failed to set session type to normal.");
-        ret = -EINVAL;
-        goto out;
-    }
-
-    iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
-
-    /* check if we got HEADER_DIGEST via the options */
-    parse_header_digest(iscsi, iscsi_url->target);
-
-    if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
-        error_report("iSCSI: Failed to connect to LUN : %s",
-            iscsi_get_error(iscsi));
-        ret = -EINVAL;
+    isid = g_random_int();
+    ret = iscsi_login(iscsilun, &iscsilun->sessions[0], iscsi_url,
+                      initiator_name, isid, 0);
+    if (ret != 0) {
         goto out;
     }
+    iscsilun->nb_sessions = 1;
 
+    iscsi = iscsilun->sessions[0].iscsi;
     iscsilun->iscsi = iscsi;
     iscsilun->lun   = iscsi_url->lun;
 
@@ -1386,9 +1632,27 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         task = NULL;
     }
 
+    /* Passthrough stays on the first session: reservations and task
+     * management are tied to the I_T nexus that issued them.
+     */
+    if (iscsilun->type == TYPE_DISK) {
+        while (iscsilun->nb_sessions < nb_sessions) {
+            int n = iscsilun->nb_sessions;
+
+            ret = iscsi_login(iscsilun, &iscsilun->sessions[n], iscsi_url,
+                              initiator_name, isid, n);
+            if (ret != 0) {
+                goto out;
+            }
+            iscsilun->nb_sessions++;
+        }
+    }
+
 #if defined(LIBISCSI_FEATURE_NOP_COUNTER)
     /* Set up a timer for sending out iSCSI NOPs */
-    iscsilun->nop_timer = timer_new_ms(QEMU_CLOCK_REALTIME, iscsi_nop_timed_event, iscsilun);
+    iscsilun->nop_timer = aio_timer_new(iscsilun->aio_context,
+                                        QEMU_CLOCK_REALTIME, SCALE_MS,
+                                        iscsi_nop_timed_event, iscsilun);
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
 #endif
 
@@ -1405,9 +1669,7 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            iscsi_destroy_context(iscsi);
-        }
+        iscsi_destroy_sessions(iscsilun);
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
     return ret;
@@ -1416,14 +1678,12 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
         timer_free(iscsilun->nop_timer);
     }
-    qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL);
-    iscsi_destroy_context(iscsi);
+    iscsi_destroy_sessions(iscsilun);
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
 
@@ -1497,9 +1757,7 @@ static int iscsi_create(const char *filename, QEMUOptionParameter *options,
 
     ret = 0;
 out:
-    if (iscsilun->iscsi != NULL) {
-        iscsi_destroy_context(iscsilun->iscsi);
-    }
+    iscsi_destroy_sessions(iscsilun);
     g_free(bs->opaque);
     bs->opaque = NULL;
     bdrv_unref(bs);
@@ -18,7 +18,13 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+
+/* The number of operations in flight and the size of the buffer adapt to
+ * the target, see mirror_adapt().
+ */
+#define MIN_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 256
+#define INITIAL_BUF_SIZE (10 << 20)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -37,16 +43,34 @@ typedef struct MirrorBlockJob {
     bool should_complete;
     int64_t sector_num;
     int64_t granularity;
-    size_t buf_size;
+    size_t buf_size;            /* limit of buf_alloc */
+    size_t buf_alloc;
     unsigned long *cow_bitmap;
+    bool unmap;                 /* target ranges may be discarded */
     HBitmapIter hbi;
-    uint8_t *buf;
+    GSList *bufs;
     QSIMPLEQ_HEAD(, MirrorBuffer) buf_free;
     int buf_free_count;
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    int max_in_flight;
     int ret;
+
+    /* latency of the operations since the last adjustment */
+    int64_t window_latency_ns;
+    int window_ops;
+    int64_t base_latency_ns;
+    bool depth_limited;
+    bool buf_limited;
+
+    /* write-blocking mode, see mirror_before_write_notify() */
+    MirrorCopyMode copy_mode;
+    NotifierWithReturn before_write;
+    NotifierWithReturn after_write;
+    QLIST_HEAD(, MirrorActiveOp) active_ops;
+    CoQueue active_wait;
+    bool waiting_for_active;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -54,8 +78,19 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t start_ns;
+    bool zero;                  /* wrote zeroes instead of copying */
 } MirrorOp;
 
+/* A guest write that is mirrored synchronously */
+typedef struct MirrorActiveOp {
+    BdrvTrackedRequest *req;
+    int64_t chunk_num;
+    int nb_chunks;
+    unsigned long *was_dirty;
+    QLIST_ENTRY(MirrorActiveOp) next;
+} MirrorActiveOp;
+
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -69,6 +104,70 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/* Add @size bytes of granularity-sized chunks to the free list */
+static void mirror_add_buffers(MirrorBlockJob *s, size_t size)
+{
+    uint8_t *buf = qemu_blockalign(s->common.bs, size);
+
+    s->bufs = g_slist_prepend(s->bufs, buf);
+    s->buf_alloc += size;
+    while (size != 0) {
+        MirrorBuffer *cur = (MirrorBuffer *)buf;
+        QSIMPLEQ_INSERT_TAIL(&s->buf_free, cur, next);
+        s->buf_free_count++;
+        size -= s->granularity;
+        buf += s->granularity;
+    }
+}
+
+/* Additive increase, multiplicative decrease of the queue depth, based on
+ * the latency of the operations.  The latency stays close to the lowest
+ * one seen as long as the target has spare bandwidth.  When it grows, the
+ * target queues our requests and more of them would only add latency (and
+ * slow down the guest's own I/O).  Once per window of max_in_flight
+ * operations, the depth is lowered if the latency doubled; if it did not
+ * grow, whatever limited the job in the window (depth or buffer) is
+ * raised.
+ */
+static void mirror_adapt(MirrorBlockJob *s, int64_t latency_ns)
+{
+    int64_t avg;
+    size_t grow;
+
+    s->window_latency_ns += latency_ns;
+    if (++s->window_ops < s->max_in_flight) {
+        return;
+    }
+
+    avg = s->window_latency_ns / s->window_ops;
+    if (s->base_latency_ns == 0 || avg < s->base_latency_ns) {
+        s->base_latency_ns = avg;
+    } else {
+        /* follow slow changes of the target */
+        s->base_latency_ns += (avg - s->base_latency_ns) / 16;
+    }
+
+    if (avg > 2 * s->base_latency_ns) {
+        s->max_in_flight = MAX(MIN_IN_FLIGHT, s->max_in_flight * 3 / 4);
+    } else if (avg < s->base_latency_ns + s->base_latency_ns / 4) {
+        grow = MIN(s->buf_alloc, s->buf_size - s->buf_alloc);
+        grow -= grow % s->granularity;
+        if (s->buf_limited && grow) {
+            mirror_add_buffers(s, grow);
+        } else if (s->depth_limited) {
+            s->max_in_flight = MIN(MAX_IN_FLIGHT,
+                                   s->max_in_flight + s->max_in_flight / 4);
+        }
+    }
+
+    trace_mirror_adapt(s, avg, s->base_latency_ns, s->max_in_flight,
+                       s->buf_alloc);
+    s->window_latency_ns = 0;
+    s->window_ops = 0;
+    s->depth_limited = false;
+    s->buf_limited = false;
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -78,6 +177,10 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret);
 
+    if (ret >= 0 && !op->zero) {
+        mirror_adapt(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns);
+    }
+
     s->in_flight--;
     iov = op->qiov.iov;
     for (i = 0; i < op->qiov.niov; i++) {
@@ -95,9 +198,121 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     }
 
     g_slice_free(MirrorOp, op);
+    while (qemu_co_enter_next(&s->active_wait)) {
+        /* guest writes to these chunks can go on */
+    }
     qemu_coroutine_enter(s->common.co, NULL);
 }
 
+/* In write-blocking mode, a guest write to the source is also written to
+ * the target before it completes.  Chunks that were clean before the write
+ * are then still clean, so the job converges even if the guest writes
+ * faster than the job could copy.
+ *
+ * Before the write, wait for copies of the same chunks that are in flight,
+ * because they may have read older data, and keep other copies away until
+ * the write is mirrored.
+ */
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    MirrorActiveOp *op;
+    int64_t chunk_num, end;
+    int i;
+
+    chunk_num = req->sector_num / sectors_per_chunk;
+    end = DIV_ROUND_UP(req->sector_num + req->nb_sectors, sectors_per_chunk);
+
+    while (find_next_bit(s->in_flight_bitmap, end, chunk_num) < end) {
+        qemu_co_queue_wait(&s->active_wait);
+    }
+
+    op = g_new0(MirrorActiveOp, 1);
+    op->req = req;
+    op->chunk_num = chunk_num;
+    op->nb_chunks = end - chunk_num;
+    op->was_dirty = bitmap_new(op->nb_chunks);
+    for (i = 0; i < op->nb_chunks; i++) {
+        int64_t sector_num = (chunk_num + i) * sectors_per_chunk;
+        if (bdrv_get_dirty(s->common.bs, sector_num)) {
+            set_bit(i, op->was_dirty);
+        }
+    }
+    bitmap_set(s->in_flight_bitmap, chunk_num, op->nb_chunks);
+    QLIST_INSERT_HEAD(&s->active_ops, op, next);
+    return 0;
+}
+
+static int coroutine_fn mirror_after_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvTrackedRequest *req = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    MirrorActiveOp *op;
+    int i, ret;
+
+    QLIST_FOREACH(op, &s->active_ops, next) {
+        if (op->req == req) {
+            break;
+        }
+    }
+    if (!op) {
+        /* started before the job registered its notifiers */
+        return 0;
+    }
+
+    if (req->ret >= 0) {
+        trace_mirror_active_write(s, req->sector_num, req->nb_sectors);
+        if (req->qiov) {
+            ret = bdrv_co_writev(s->target, req->sector_num, req->nb_sectors,
+                                 req->qiov);
+        } else {
+            ret = bdrv_co_write_zeroes(s->target, req->sector_num,
+                                       req->nb_sectors, 0);
+        }
+
+        if (ret < 0) {
+            /* the chunks stay dirty and are copied in the background */
+            if (mirror_error_action(s, false, -ret) == BDRV_ACTION_REPORT &&
+                s->ret >= 0) {
+                s->ret = ret;
+            }
+        } else {
+            for (i = 0; i < op->nb_chunks; i++) {
+                if (!test_bit(i, op->was_dirty)) {
+                    bdrv_reset_dirty(s->common.bs,
+                                     (op->chunk_num + i) * sectors_per_chunk,
+                                     sectors_per_chunk);
+                }
+            }
+        }
+    }
+
+    bitmap_clear(s->in_flight_bitmap, op->chunk_num, op->nb_chunks);
+    QLIST_REMOVE(op, next);
+    g_free(op->was_dirty);
+    g_free(op);
+
+    qemu_co_queue_restart_all(&s->active_wait);
+    if (s->waiting_for_active) {
+        s->waiting_for_active = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+    return 0;
+}
+
+/* Yield until an active write completes or an operation is done */
+static void coroutine_fn mirror_wait_for_active(MirrorBlockJob *s)
+{
+    s->waiting_for_active = true;
+    qemu_coroutine_yield();
+    s->waiting_for_active = false;
+}
+
 static void mirror_write_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
@@ -139,8 +354,9 @@ static void mirror_read_complete(void *opaque, int ret)
 static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
+    int nb_sectors, sectors_per_chunk, nb_chunks, pnum;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t status;
     MirrorOp *op;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
@@ -174,10 +390,12 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     next_sector = sector_num;
     next_chunk = sector_num / sectors_per_chunk;
 
-    /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
+    /* Wait for I/O to this cluster (from a previous iteration or from a
+     * guest write in write-blocking mode) to be done.
+     */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_active(s);
     }
 
     do {
@@ -213,6 +431,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
+            s->buf_limited = true;
             qemu_coroutine_yield();
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
@@ -234,6 +453,8 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    op->zero = false;
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -258,27 +479,23 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     bdrv_reset_dirty(source, sector_num, nb_sectors);
 
+    /* Zero or unallocated ranges need not be read; the target can zero
+     * them without writing data, or discard them.
+     */
+    status = bdrv_get_block_status(source, sector_num, nb_sectors, &pnum);
+    op->zero = status >= 0 && (status & BDRV_BLOCK_ZERO) &&
+               pnum >= nb_sectors;
+
     /* Copy the dirty cluster.  */
     s->in_flight++;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
-    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
-                   mirror_read_complete, op);
-}
-
-static void mirror_free_init(MirrorBlockJob *s)
-{
-    int granularity = s->granularity;
-    size_t buf_size = s->buf_size;
-    uint8_t *buf = s->buf;
-
-    assert(s->buf_free_count == 0);
-    QSIMPLEQ_INIT(&s->buf_free);
-    while (buf_size != 0) {
-        MirrorBuffer *cur = (MirrorBuffer *)buf;
-        QSIMPLEQ_INSERT_TAIL(&s->buf_free, cur, next);
-        s->buf_free_count++;
-        buf_size -= granularity;
-        buf += granularity;
+    if (op->zero) {
+        bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                              s->unmap ? BDRV_REQ_MAY_UNMAP : 0,
+                              mirror_write_complete, op);
+    } else {
+        bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
+                       mirror_read_complete, op);
     }
 }
 
@@ -296,6 +513,7 @@ static void coroutine_fn mirror_run(void *opaque)
     int64_t sector_num, end, sectors_per_chunk, length;
     uint64_t last_pause_ns;
     BlockDriverInfo bdi;
+    size_t initial_buf_size;
     char backing_filename[1024];
     int ret = 0;
     int n;
@@ -317,20 +535,34 @@ static void coroutine_fn mirror_run(void *opaque)
      * the destination do COW.  Instead, we copy sectors around the
      * dirty data if needed.  We need a bitmap to do that.
      */
+    initial_buf_size = MIN(s->buf_size, INITIAL_BUF_SIZE);
     bdrv_get_backing_filename(s->target, backing_filename,
                               sizeof(backing_filename));
+    /* The backing file of the target is only opened when the job ends, so
+     * discarding would expose its data.
+     */
+    s->unmap = !backing_filename[0];
     if (backing_filename[0] && !s->target->backing_hd) {
         bdrv_get_info(s->target, &bdi);
         if (s->granularity < bdi.cluster_size) {
             s->buf_size = MAX(s->buf_size, bdi.cluster_size);
+            initial_buf_size = MAX(initial_buf_size, bdi.cluster_size);
             s->cow_bitmap = bitmap_new(length);
         }
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    s->buf = qemu_blockalign(bs, s->buf_size);
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
-    mirror_free_init(s);
+    QSIMPLEQ_INIT(&s->buf_free);
+    initial_buf_size -= initial_buf_size % s->granularity;
+    mirror_add_buffers(s, initial_buf_size);
+
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        s->before_write.notify = mirror_before_write_notify;
+        s->after_write.notify = mirror_after_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+        bdrv_add_after_write_notifier(bs, &s->after_write);
+    }
 
     if (s->mode != MIRROR_SYNC_MODE_NONE) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
@@ -376,9 +608,13 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
+                if (cnt != 0) {
+                    s->depth_limited |= s->in_flight >= s->max_in_flight;
+                    s->buf_limited |= s->buf_free_count == 0;
+                }
                 qemu_coroutine_yield();
                 continue;
             } else if (cnt != 0) {
@@ -450,7 +686,7 @@ static void coroutine_fn mirror_run(void *opaque)
             /* The two disks are in sync.  Exit and report successful
              * completion.
              */
-            assert(QLIST_EMPTY(&bs->tracked_requests));
+            assert(interval_tree_empty(&bs->tracked_requests));
             s->common.cancelled = false;
             break;
         }
@@ -468,7 +704,17 @@ immediate_exit:
     }
 
     assert(s->in_flight == 0);
-    qemu_vfree(s->buf);
+
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        /* let guest writes that are being mirrored finish */
+        notifier_with_return_remove(&s->before_write);
+        while (!QLIST_EMPTY(&s->active_ops)) {
+            mirror_wait_for_active(s);
+        }
+        notifier_with_return_remove(&s->after_write);
+    }
+
+    g_slist_free_full(s->bufs, qemu_vfree);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
     bdrv_set_dirty_tracking(bs, 0);
@@ -535,7 +781,8 @@ static const BlockJobDriver mirror_job_driver = {
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -572,8 +819,12 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->on_target_error = on_target_error;
     s->target = target;
     s->mode = mode;
+    s->copy_mode = copy_mode;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = MIN_IN_FLIGHT;
+    QLIST_INIT(&s->active_ops);
+    qemu_co_queue_init(&s->active_wait);
 
     bdrv_set_dirty_tracking(bs, granularity);
     bdrv_set_enable_write_cache(s->target, true);
@@ -49,29 +49,61 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define NBD_MAX_CONNECTIONS 16
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-typedef struct BDRVNBDState {
+typedef struct BDRVNBDState BDRVNBDState;
+
+typedef struct NBDConnection {
+    BDRVNBDState *s;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
 
     CoMutex send_mutex;
-    CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
+    CoQueue free_reqs;              /* waiting for this connection */
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine **recv_coroutine;     /* max_requests entries */
     struct nbd_reply reply;
+} NBDConnection;
+
+struct BDRVNBDState {
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+
+    /* Requests are spread over the connections, which all talk to the
+     * same export.  At most max_requests requests are in flight on each.
+     */
+    NBDConnection *conns;
+    int nb_conns;
+    int max_requests;
+    CoQueue free_reqs;              /* waiting for any connection */
 
     bool is_unix;
     QemuOpts *socket_opts;
 
     char *export_name; /* An NBD server may export several devices */
-} BDRVNBDState;
+};
+
+static QemuOptsList runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the export",
+        },
+        {
+            .name = "max-requests",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight per connection",
+        },
+        { /* end of list */ }
+    },
+};
 
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
@@ -220,6 +252,32 @@ out:
 static int nbd_config(BDRVNBDState *s, QDict *options)
 {
     Error *local_err = NULL;
+    QemuOpts *opts;
+
+    opts = qemu_opts_create_nofail(&runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    s->nb_conns = qemu_opt_get_number(opts, "connections", 1);
+    s->max_requests = qemu_opt_get_number(opts, "max-requests",
+                                          NBD_DEFAULT_MAX_REQUESTS);
+    qemu_opts_del(opts);
+
+    if (s->nb_conns < 1 || s->nb_conns > NBD_MAX_CONNECTIONS) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "connections must be "
+                      "between 1 and %d", NBD_MAX_CONNECTIONS);
+        return -EINVAL;
+    }
+    if (s->max_requests < 1 || s->max_requests > NBD_MAX_REQUESTS) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "max-requests must be "
+                      "between 1 and %d", NBD_MAX_REQUESTS);
+        return -EINVAL;
+    }
 
     if (qdict_haskey(options, "path")) {
         if (qdict_haskey(options, "host")) {
@@ -256,46 +314,68 @@ static int nbd_config(BDRVNBDState *s, QDict *options)
 }
 
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+/* Return the connection with the fewest requests in flight, waiting until
+ * one of them can accept a request.
+ */
+static NBDConnection *nbd_get_connection(BDRVNBDState *s)
 {
+    NBDConnection *conn;
     int i;
 
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    for (;;) {
+        conn = &s->conns[0];
+        for (i = 1; i < s->nb_conns; i++) {
+            if (s->conns[i].in_flight < conn->in_flight) {
+                conn = &s->conns[i];
+            }
+        }
+        if (conn->in_flight < s->max_requests) {
+            return conn;
+        }
+        qemu_co_queue_wait(&s->free_reqs);
     }
-    s->in_flight++;
+}
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+static void nbd_coroutine_start(NBDConnection *conn,
+                                struct nbd_request *request)
+{
+    BDRVNBDState *s = conn->s;
+    int i;
+
+    while (conn->in_flight >= s->max_requests) {
+        qemu_co_queue_wait(&conn->free_reqs);
+    }
+    conn->in_flight++;
+
+    for (i = 0; i < s->max_requests; i++) {
+        if (conn->recv_coroutine[i] == NULL) {
+            conn->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    assert(i < s->max_requests);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
+    BDRVNBDState *s = conn->s;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (conn->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(conn->sock, &conn->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            conn->reply.handle = 0;
             goto fail;
         }
     }
@@ -303,63 +383,67 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    i = HANDLE_TO_INDEX(conn, conn->reply.handle);
+    if (i >= s->max_requests) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (conn->recv_coroutine[i]) {
+        qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    for (i = 0; i < s->max_requests; i++) {
+        if (conn->recv_coroutine[i]) {
+            qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         }
     }
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *conn = opaque;
+    qemu_coroutine_enter(conn->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *conn,
+                               struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
+    BDRVNBDState *s = conn->s;
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write, s);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    conn->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, nbd_restart_write,
+                            conn);
     if (qiov) {
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 1);
+            socket_set_cork(conn->sock, 1);
         }
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(conn->sock, request);
         if (rc >= 0) {
-            ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+            ret = qemu_co_sendv(conn->sock, qiov->iov, qiov->niov,
                                 offset, request->len);
             if (ret != request->len) {
                 rc = -EIO;
             }
         }
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 0);
+            socket_set_cork(conn->sock, 0);
         }
     } else {
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(conn->sock, request);
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, NULL, conn);
+    conn->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+static void nbd_co_receive_reply(NBDConnection *conn,
+                                 struct nbd_request *request,
                                  struct nbd_reply *reply,
                                  QEMUIOVector *qiov, int offset)
 {
@@ -368,12 +452,12 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
     /* Wait until we're woken up by the read handler.  TODO: perhaps
      * peek at the next reply and avoid yielding if it's ours?  */
     qemu_coroutine_yield();
-    *reply = s->reply;
+    *reply = conn->reply;
     if (reply->handle != request->handle) {
         reply->error = EIO;
     } else {
         if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+            ret = qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
                                 offset, request->len);
             if (ret != request->len) {
                 reply->error = EIO;
@@ -381,22 +465,42 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        conn->reply.handle = 0;
     }
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *conn,
+                              struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    conn->in_flight--;
+    if (!qemu_co_queue_next(&conn->free_reqs)) {
+        qemu_co_queue_next(&conn->s->free_reqs);
     }
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+/* Send a request without payload on @conn and wait for its reply */
+static int nbd_co_request(NBDConnection *conn, struct nbd_request *request)
+{
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    nbd_coroutine_start(conn, request);
+    ret = nbd_co_send_request(conn, request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, request, &reply, NULL, 0);
+    }
+    nbd_coroutine_end(conn, request);
+    return -reply.error;
+}
+
+static int nbd_establish_connection(BlockDriverState *bs, NBDConnection *conn)
 {
     BDRVNBDState *s = bs->opaque;
+    uint32_t nbdflags;
     int sock;
     int ret;
     off_t size;
@@ -418,7 +522,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
+    ret = nbd_receive_negotiate(sock, s->export_name, &nbdflags, &size,
                                 &blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -426,31 +530,44 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return ret;
     }
 
+    if (conn == &s->conns[0]) {
+        s->nbdflags = nbdflags;
+        s->size = size;
+        s->blocksize = blocksize;
+    } else if (nbdflags != s->nbdflags || size != s->size) {
+        /* not the same export, or it changed under our feet */
+        logout("NBD connections disagree about the export\n");
+        closesocket(sock);
+        return -EINVAL;
+    }
+
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qemu_set_nonblock(sock);
-    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL, s);
 
-    s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
+    conn->s = s;
+    conn->sock = sock;
+    conn->recv_coroutine = g_new0(Coroutine *, s->max_requests);
+    qemu_co_mutex_init(&conn->send_mutex);
+    qemu_co_queue_init(&conn->free_reqs);
+    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL, conn);
 
     logout("Established connection with NBD server\n");
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDConnection *conn)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    nbd_send_request(conn->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL);
-    closesocket(s->sock);
+    qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL);
+    closesocket(conn->sock);
+    g_free(conn->recv_coroutine);
 }
 
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
@@ -458,9 +575,9 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 {
     BDRVNBDState *s = bs->opaque;
     int result;
+    int i;
 
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    qemu_co_queue_init(&s->free_reqs);
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, options);
@@ -468,12 +585,23 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return result;
     }
 
-    /* establish TCP connection, return error if it fails
+    /* establish TCP connections, return error if one fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    result = nbd_establish_connection(bs);
+    s->conns = g_new0(NBDConnection, s->nb_conns);
+    for (i = 0; i < s->nb_conns; i++) {
+        result = nbd_establish_connection(bs, &s->conns[i]);
+        if (result < 0) {
+            while (i-- > 0) {
+                nbd_teardown_connection(&s->conns[i]);
+            }
+            g_free(s->conns);
+            s->conns = NULL;
+            return result;
+        }
+    }
 
-    return result;
+    return 0;
 }
 
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
@@ -481,6 +609,7 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int offset)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn = nbd_get_connection(s);
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
@@ -489,14 +618,14 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, offset);
     }
-    nbd_coroutine_end(s, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
@@ -506,6 +635,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn = nbd_get_connection(s);
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
@@ -518,14 +648,14 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0);
     }
-    nbd_coroutine_end(s, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -571,30 +701,30 @@ static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    int i, ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
-    request.type = NBD_CMD_FLUSH;
-    if (s->nbdflags & NBD_FLAG_SEND_FUA) {
-        request.type |= NBD_CMD_FLAG_FUA;
-    }
+    /* The server need not flush the writes that completed on the other
+     * connections, so flush each of them.
+     */
+    for (i = 0; i < s->nb_conns; i++) {
+        request.type = NBD_CMD_FLUSH;
+        if (s->nbdflags & NBD_FLAG_SEND_FUA) {
+            request.type |= NBD_CMD_FLAG_FUA;
+        }
 
-    request.from = 0;
-    request.len = 0;
+        request.from = 0;
+        request.len = 0;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        ret = nbd_co_request(&s->conns[i], &request);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return 0;
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -602,8 +732,6 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
@@ -612,24 +740,21 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(nbd_get_connection(s), &request);
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
+
     g_free(s->export_name);
     qemu_opts_del(s->socket_opts);
 
-    nbd_teardown_connection(bs);
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_teardown_connection(&s->conns[i]);
+    }
+    g_free(s->conns);
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
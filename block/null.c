@@ -0,0 +1,276 @@
+/*
+ * Null block drivers
+ *
+ * Requests complete without touching any storage, either right away or
+ * after a fixed latency, and writes are discarded.  This is useful to
+ * measure the overhead of the block layer and of the emulated devices
+ * on top of it.  null-co implements the coroutine interface and null-aio
+ * the callback-based one, so that both request paths can be measured.
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+#include "block/block_int.h"
+#include "qemu/module.h"
+
+#define NULL_OPT_SIZE       "size"
+#define NULL_OPT_LATENCY    "latency-ns"
+#define NULL_OPT_ZEROES     "read-zeroes"
+
+#define NULL_DEFAULT_SIZE (1ULL << 30)
+
+typedef struct BDRVNullState {
+    int64_t length;
+    int64_t latency_ns;
+    bool read_zeroes;
+} BDRVNullState;
+
+static QemuOptsList runtime_opts = {
+    .name = "null",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = NULL_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the null block device",
+        },
+        {
+            .name = NULL_OPT_LATENCY,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Nanoseconds before a request completes (default 0)",
+        },
+        {
+            .name = NULL_OPT_ZEROES,
+            .type = QEMU_OPT_BOOL,
+            .help = "Zero the buffer of reads (default off)",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* The only valid file names are null-co:// and null-aio:// */
+static void null_co_parse_filename(const char *filename, QDict *options,
+                                   Error **errp)
+{
+    if (!strstart(filename, "null-co://", &filename) || *filename) {
+        error_setg(errp, "The only valid file name is 'null-co://'");
+    }
+}
+
+static void null_aio_parse_filename(const char *filename, QDict *options,
+                                    Error **errp)
+{
+    if (!strstart(filename, "null-aio://", &filename) || *filename) {
+        error_setg(errp, "The only valid file name is 'null-aio://'");
+    }
+}
+
+static int null_file_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVNullState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int ret = 0;
+
+    opts = qemu_opts_create_nofail(&runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->length = qemu_opt_get_size(opts, NULL_OPT_SIZE, NULL_DEFAULT_SIZE);
+    s->length &= ~(int64_t)(BDRV_SECTOR_SIZE - 1);
+    s->latency_ns = qemu_opt_get_number(opts, NULL_OPT_LATENCY, 0);
+    if (s->latency_ns < 0) {
+        error_setg(errp, "latency-ns must not be negative");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->read_zeroes = qemu_opt_get_bool(opts, NULL_OPT_ZEROES, false);
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void null_close(BlockDriverState *bs)
+{
+}
+
+static int64_t null_getlength(BlockDriverState *bs)
+{
+    BDRVNullState *s = bs->opaque;
+
+    return s->length;
+}
+
+static coroutine_fn int null_co_common(BlockDriverState *bs)
+{
+    BDRVNullState *s = bs->opaque;
+
+    if (s->latency_ns) {
+        co_aio_sleep_ns(bdrv_get_aio_context(bs), QEMU_CLOCK_REALTIME,
+                        s->latency_ns);
+    }
+    return 0;
+}
+
+static coroutine_fn int null_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
+{
+    BDRVNullState *s = bs->opaque;
+
+    if (s->read_zeroes) {
+        qemu_iovec_memset(qiov, 0, 0, nb_sectors * BDRV_SECTOR_SIZE);
+    }
+    return null_co_common(bs);
+}
+
+static coroutine_fn int null_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    return null_co_common(bs);
+}
+
+static coroutine_fn int null_co_flush(BlockDriverState *bs)
+{
+    return null_co_common(bs);
+}
+
+typedef struct NullAIOCB {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+    QEMUTimer *timer;
+} NullAIOCB;
+
+static void null_aio_release(NullAIOCB *acb)
+{
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+    }
+    if (acb->timer) {
+        timer_del(acb->timer);
+        timer_free(acb->timer);
+    }
+    qemu_aio_release(acb);
+}
+
+static void null_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    null_aio_release(container_of(blockacb, NullAIOCB, common));
+}
+
+static const AIOCBInfo null_aiocb_info = {
+    .aiocb_size = sizeof(NullAIOCB),
+    .cancel     = null_aio_cancel,
+};
+
+static void null_aio_complete(void *opaque)
+{
+    NullAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, 0);
+    null_aio_release(acb);
+}
+
+static BlockDriverAIOCB *null_aio_common(BlockDriverState *bs,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque)
+{
+    BDRVNullState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    NullAIOCB *acb;
+
+    acb = qemu_aio_get(&null_aiocb_info, bs, cb, opaque);
+    acb->bh = NULL;
+    acb->timer = NULL;
+    if (s->latency_ns) {
+        acb->timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                   null_aio_complete, acb);
+        timer_mod_ns(acb->timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                                 s->latency_ns);
+    } else {
+        acb->bh = aio_bh_new(ctx, null_aio_complete, acb);
+        qemu_bh_schedule(acb->bh);
+    }
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *null_aio_readv(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        QEMUIOVector *qiov, int nb_sectors,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque)
+{
+    BDRVNullState *s = bs->opaque;
+
+    if (s->read_zeroes) {
+        qemu_iovec_memset(qiov, 0, 0, nb_sectors * BDRV_SECTOR_SIZE);
+    }
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriverAIOCB *null_aio_writev(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         QEMUIOVector *qiov, int nb_sectors,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque)
+{
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriverAIOCB *null_aio_flush(BlockDriverState *bs,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque)
+{
+    return null_aio_common(bs, cb, opaque);
+}
+
+static BlockDriver bdrv_null_co = {
+    .format_name            = "null-co",
+    .protocol_name          = "null-co",
+    .instance_size          = sizeof(BDRVNullState),
+
+    .bdrv_parse_filename    = null_co_parse_filename,
+    .bdrv_file_open         = null_file_open,
+    .bdrv_close             = null_close,
+    .bdrv_getlength         = null_getlength,
+
+    .bdrv_co_readv          = null_co_readv,
+    .bdrv_co_writev         = null_co_writev,
+    .bdrv_co_flush_to_disk  = null_co_flush,
+};
+
+static BlockDriver bdrv_null_aio = {
+    .format_name            = "null-aio",
+    .protocol_name          = "null-aio",
+    .instance_size          = sizeof(BDRVNullState),
+
+    .bdrv_parse_filename    = null_aio_parse_filename,
+    .bdrv_file_open         = null_file_open,
+    .bdrv_close             = null_close,
+    .bdrv_getlength         = null_getlength,
+
+    .bdrv_aio_readv         = null_aio_readv,
+    .bdrv_aio_writev        = null_aio_writev,
+    .bdrv_aio_flush         = null_aio_flush,
+};
+
+static void bdrv_null_init(void)
+{
+    bdrv_register(&bdrv_null_co);
+    bdrv_register(&bdrv_null_aio);
+}
+
+block_init(bdrv_null_init);
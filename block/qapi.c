@@ -24,6 +24,7 @@
 
 #include "block/qapi.h"
 #include "block/block_int.h"
+#include "block/throttle-groups.h"
 #include "qmp-commands.h"
 #include "qapi-visit.h"
 #include "qapi/qmp-output-visitor.h"
@@ -212,6 +213,26 @@ void bdrv_query_info(BlockDriverState *bs,
          ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bs->dirty_bitmap));
     }
 
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        BdrvDirtyBitmap *bitmap;
+        BlockDirtyBitmapInfoList **p_next = &info->dirty_bitmaps;
+
+        info->has_dirty_bitmaps = true;
+        QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+            BlockDirtyBitmapInfoList *entry = g_malloc0(sizeof(*entry));
+
+            entry->value = g_malloc0(sizeof(*entry->value));
+            entry->value->name = g_strdup(bitmap->name);
+            entry->value->count =
+                hbitmap_count(bitmap->bitmap) * BDRV_SECTOR_SIZE;
+            entry->value->granularity = bdrv_dirty_bitmap_granularity(bitmap);
+            entry->value->persistent = bitmap->persistent;
+            entry->value->busy = bitmap->in_use;
+            *p_next = entry;
+            p_next = &entry->next;
+        }
+    }
+
     if (bs->drv) {
         info->has_inserted = true;
         info->inserted = g_malloc0(sizeof(*info->inserted));
@@ -228,9 +249,16 @@ void bdrv_query_info(BlockDriverState *bs,
 
         info->inserted->backing_file_depth = bdrv_get_backing_file_depth(bs);
 
+        if (bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF) {
+            info->inserted->has_detect_zeroes = true;
+            info->inserted->detect_zeroes = bs->detect_zeroes;
+        }
+
         if (bs->io_limits_enabled) {
             ThrottleConfig cfg;
-            throttle_get_config(&bs->throttle_state, &cfg);
+            throttle_group_get_config(bs, &cfg);
+            info->inserted->has_group = true;
+            info->inserted->group = g_strdup(throttle_group_get_name(bs));
             info->inserted->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
             info->inserted->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
             info->inserted->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
@@ -267,6 +295,31 @@ void bdrv_query_info(BlockDriverState *bs,
 
             info->inserted->has_iops_size = cfg.op_size;
             info->inserted->iops_size = cfg.op_size;
+
+            info->inserted->has_bps_max_length =
+                cfg.buckets[THROTTLE_BPS_TOTAL].burst_length > 1;
+            info->inserted->bps_max_length =
+                cfg.buckets[THROTTLE_BPS_TOTAL].burst_length;
+            info->inserted->has_bps_rd_max_length =
+                cfg.buckets[THROTTLE_BPS_READ].burst_length > 1;
+            info->inserted->bps_rd_max_length =
+                cfg.buckets[THROTTLE_BPS_READ].burst_length;
+            info->inserted->has_bps_wr_max_length =
+                cfg.buckets[THROTTLE_BPS_WRITE].burst_length > 1;
+            info->inserted->bps_wr_max_length =
+                cfg.buckets[THROTTLE_BPS_WRITE].burst_length;
+            info->inserted->has_iops_max_length =
+                cfg.buckets[THROTTLE_OPS_TOTAL].burst_length > 1;
+            info->inserted->iops_max_length =
+                cfg.buckets[THROTTLE_OPS_TOTAL].burst_length;
+            info->inserted->has_iops_rd_max_length =
+                cfg.buckets[THROTTLE_OPS_READ].burst_length > 1;
+            info->inserted->iops_rd_max_length =
+                cfg.buckets[THROTTLE_OPS_READ].burst_length;
+            info->inserted->has_iops_wr_max_length =
+                cfg.buckets[THROTTLE_OPS_WRITE].burst_length > 1;
+            info->inserted->iops_wr_max_length =
+                cfg.buckets[THROTTLE_OPS_WRITE].burst_length;
         }
 
         bs0 = bs;
@@ -294,8 +347,38 @@ void bdrv_query_info(BlockDriverState *bs,
     qapi_free_BlockInfo(info);
 }
 
+static uint64List *uint64_list(const uint64_t *values, int n)
+{
+    uint64List *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64List *e = g_new0(uint64List, 1);
+
+        e->value = values[i];
+        *p_next = e;
+        p_next = &e->next;
+    }
+    return head;
+}
+
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(const BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    int n = hist->nbins;
+
+    info->boundaries = uint64_list(hist->boundaries, n - 1);
+    info->bins = uint64_list(hist->bins + BDRV_LATENCY_TOTAL * n, n);
+    info->throttle_bins = uint64_list(hist->bins + BDRV_LATENCY_THROTTLE * n,
+                                      n);
+    info->backend_bins = uint64_list(hist->bins + BDRV_LATENCY_BACKEND * n, n);
+    return info;
+}
+
 BlockStats *bdrv_query_stats(const BlockDriverState *bs)
 {
+    const BlockLatencyHistogram *hist = bs->latency_histogram;
     BlockStats *s;
 
     s = g_malloc0(sizeof(*s));
@@ -316,6 +399,42 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (hist[BDRV_ACCT_READ].nbins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BDRV_ACCT_READ]);
+    }
+    if (hist[BDRV_ACCT_WRITE].nbins) {
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BDRV_ACCT_WRITE]);
+    }
+    if (hist[BDRV_ACCT_FLUSH].nbins) {
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BDRV_ACCT_FLUSH]);
+    }
+
+    if (bs->io_limits_enabled) {
+        ThrottleConfig cfg;
+
+        throttle_group_get_levels(bs, &cfg);
+        s->has_throttle_levels = true;
+        s->throttle_levels = g_new0(BlockThrottleLevels, 1);
+        s->throttle_levels->group = g_strdup(throttle_group_get_name(bs));
+        s->throttle_levels->bps = cfg.buckets[THROTTLE_BPS_TOTAL].level;
+        s->throttle_levels->bps_rd = cfg.buckets[THROTTLE_BPS_READ].level;
+        s->throttle_levels->bps_wr = cfg.buckets[THROTTLE_BPS_WRITE].level;
+        s->throttle_levels->iops = cfg.buckets[THROTTLE_OPS_TOTAL].level;
+        s->throttle_levels->iops_rd = cfg.buckets[THROTTLE_OPS_READ].level;
+        s->throttle_levels->iops_wr = cfg.buckets[THROTTLE_OPS_WRITE].level;
+    }
+
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        s->has_cache_stats = true;
+        s->cache_stats = bs->drv->bdrv_get_cache_stats(bs);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
@@ -0,0 +1,466 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/*
+ * Named dirty bitmaps with the persistent flag are written to the image when
+ * it is closed and loaded again when it is opened read/write.  While the image
+ * is open, the on-disk copies are flagged as in use: if QEMU does not get to
+ * store them (e.g. because it crashed), they are considered inconsistent and
+ * the next user gets a bitmap with all bits set.
+ *
+ * The data of a bitmap is a plain bit array, one bit per granule with the
+ * least significant bit of each byte first, stored in contiguous clusters.
+ */
+
+typedef struct QEMU_PACKED QCowDirtyBitmapHeader {
+    /* header is 8 byte aligned */
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t nb_sectors;
+    uint32_t granularity_bits;
+    uint32_t flags;
+    uint16_t name_size;
+    uint8_t  reserved[6];
+    /* name follows */
+} QCowDirtyBitmapHeader;
+
+void qcow2_free_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        g_free(s->bitmaps[i].name);
+    }
+    g_free(s->bitmaps);
+    s->bitmaps = NULL;
+    s->nb_bitmaps = 0;
+}
+
+/* Reads the bitmap directory described by the header extension */
+int qcow2_read_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowDirtyBitmapHeader h;
+    QCowDirtyBitmap *bm;
+    uint64_t offset, end;
+    int i, name_size;
+    int ret;
+
+    if (!s->nb_bitmaps) {
+        s->bitmaps = NULL;
+        return 0;
+    }
+
+    offset = s->bitmap_directory_offset;
+    end = offset + s->bitmap_directory_size;
+    s->bitmaps = g_malloc0(s->nb_bitmaps * sizeof(QCowDirtyBitmap));
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        offset = align_offset(offset, 8);
+        if (offset + sizeof(h) > end) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = bdrv_pread(bs->file, offset, &h, sizeof(h));
+        if (ret < 0) {
+            goto fail;
+        }
+        offset += sizeof(h);
+
+        bm = s->bitmaps + i;
+        bm->data_offset = be64_to_cpu(h.data_offset);
+        bm->data_size = be64_to_cpu(h.data_size);
+        bm->nb_sectors = be64_to_cpu(h.nb_sectors);
+        bm->granularity_bits = be32_to_cpu(h.granularity_bits);
+        bm->flags = be32_to_cpu(h.flags);
+        name_size = be16_to_cpu(h.name_size);
+
+        if (offset + name_size > end) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        bm->name = g_malloc(name_size + 1);
+        ret = bdrv_pread(bs->file, offset, bm->name, name_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        offset += name_size;
+        bm->name[name_size] = '\0';
+    }
+
+    return 0;
+
+fail:
+    qcow2_free_bitmaps(bs);
+    return ret;
+}
+
+static size_t bitmap_directory_size(QCowDirtyBitmap *bitmaps, int nb_bitmaps)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        size = align_offset(size, 8);
+        size += sizeof(QCowDirtyBitmapHeader);
+        size += strlen(bitmaps[i].name);
+    }
+    return size;
+}
+
+/* Writes a bitmap directory of @size bytes to @offset */
+static int write_bitmap_directory(BlockDriverState *bs, uint64_t offset,
+                                  size_t size, QCowDirtyBitmap *bitmaps,
+                                  int nb_bitmaps)
+{
+    QCowDirtyBitmapHeader *h;
+    uint8_t *buf;
+    size_t pos = 0;
+    int i, name_size;
+    int ret;
+
+    buf = g_malloc0(size);
+    for (i = 0; i < nb_bitmaps; i++) {
+        name_size = strlen(bitmaps[i].name);
+        assert(name_size <= BDRV_DIRTY_BITMAP_MAX_NAME_SIZE);
+
+        pos = align_offset(pos, 8);
+        h = (QCowDirtyBitmapHeader *)(buf + pos);
+        h->data_offset = cpu_to_be64(bitmaps[i].data_offset);
+        h->data_size = cpu_to_be64(bitmaps[i].data_size);
+        h->nb_sectors = cpu_to_be64(bitmaps[i].nb_sectors);
+        h->granularity_bits = cpu_to_be32(bitmaps[i].granularity_bits);
+        h->flags = cpu_to_be32(bitmaps[i].flags);
+        h->name_size = cpu_to_be16(name_size);
+        pos += sizeof(*h);
+
+        memcpy(buf + pos, bitmaps[i].name, name_size);
+        pos += name_size;
+    }
+    assert(pos == size);
+
+    ret = bdrv_pwrite_sync(bs->file, offset, buf, size);
+    g_free(buf);
+    return ret;
+}
+
+static uint64_t bitmap_data_size(uint64_t nb_sectors, int granularity_bits)
+{
+    uint64_t nb_bits;
+
+    nb_bits = DIV_ROUND_UP(nb_sectors,
+                           1ULL << (granularity_bits - BDRV_SECTOR_BITS));
+    return DIV_ROUND_UP(nb_bits, 8);
+}
+
+static int load_bitmap_data(BlockDriverState *bs, QCowDirtyBitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    uint64_t gran = 1ULL << (bm->granularity_bits - BDRV_SECTOR_BITS);
+    uint64_t i;
+    uint8_t *buf;
+    int ret;
+
+    if (!bm->data_size) {
+        return 0;
+    }
+
+    buf = g_malloc(bm->data_size);
+    ret = bdrv_pread(bs->file, bm->data_offset, buf, bm->data_size);
+    if (ret < 0) {
+        g_free(buf);
+        return ret;
+    }
+
+    for (i = 0; i < bm->data_size * 8; i++) {
+        if (!(i & 7) && !buf[i >> 3]) {
+            i += 7;
+            continue;
+        }
+        if (buf[i >> 3] & (1 << (i & 7))) {
+            bdrv_dirty_bitmap_set(bitmap, i * gran, gran);
+        }
+    }
+
+    g_free(buf);
+    return 0;
+}
+
+/*
+ * Creates the named dirty bitmaps stored in the image.  Bitmaps that were
+ * left in use by a previous user, or whose size does not match the image,
+ * come up with all bits set.  Unless the image is incoming from migration
+ * (and thus still owned by the source), the stored copies are marked in use.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowDirtyBitmap *bm;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    bool consistent;
+    int i, ret;
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        bm = s->bitmaps + i;
+
+        /* Still present from before the image was reopened */
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            continue;
+        }
+
+        if (bm->granularity_bits < BDRV_SECTOR_BITS ||
+            bm->granularity_bits > 30) {
+            error_setg(errp, "Dirty bitmap '%s' has unsupported granularity "
+                       "(%" PRIu32 " bits)", bm->name, bm->granularity_bits);
+            return -EINVAL;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, bm->name,
+                                          1 << bm->granularity_bits,
+                                          true, &local_err);
+        if (!bitmap) {
+            error_propagate(errp, local_err);
+            return -EINVAL;
+        }
+
+        consistent = !(bm->flags & QCOW2_BITMAP_IN_USE) &&
+                     bm->nb_sectors == bitmap->size &&
+                     bm->data_size == bitmap_data_size(bm->nb_sectors,
+                                                       bm->granularity_bits);
+        if (!consistent) {
+            bdrv_dirty_bitmap_set(bitmap, 0, bitmap->size);
+            continue;
+        }
+
+        ret = load_bitmap_data(bs, bm, bitmap);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read dirty bitmap '%s'",
+                             bm->name);
+            return ret;
+        }
+    }
+
+    if (bs->open_flags & BDRV_O_INCOMING) {
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        s->bitmaps[i].flags |= QCOW2_BITMAP_IN_USE;
+    }
+    ret = write_bitmap_directory(bs, s->bitmap_directory_offset,
+                                 s->bitmap_directory_size,
+                                 s->bitmaps, s->nb_bitmaps);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update dirty bitmap "
+                         "directory");
+        return ret;
+    }
+
+    return 0;
+}
+
+static int store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             QCowDirtyBitmap *bm)
+{
+    HBitmapIter hbi;
+    int gran_bits = hbitmap_granularity(bitmap->bitmap);
+    int64_t sector, offset;
+    uint64_t bit;
+    uint8_t *buf;
+    int ret;
+
+    bm->name = g_strdup(bitmap->name);
+    bm->nb_sectors = bitmap->size;
+    bm->granularity_bits = gran_bits + BDRV_SECTOR_BITS;
+    bm->flags = 0;
+    bm->data_size = bitmap_data_size(bm->nb_sectors, bm->granularity_bits);
+    bm->data_offset = 0;
+
+    if (!bm->data_size) {
+        return 0;
+    }
+
+    buf = g_malloc0(bm->data_size);
+    hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        bit = sector >> gran_bits;
+        buf[bit >> 3] |= 1 << (bit & 7);
+    }
+
+    offset = qcow2_alloc_clusters(bs, bm->data_size);
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    bm->data_offset = offset;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, bm->data_size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, buf, bm->data_size);
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+static void free_bitmap_clusters(BlockDriverState *bs, uint64_t dir_offset,
+                                 uint64_t dir_size, QCowDirtyBitmap *bitmaps,
+                                 int nb_bitmaps)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (bitmaps[i].data_offset) {
+            qcow2_free_clusters(bs, bitmaps[i].data_offset,
+                                bitmaps[i].data_size, QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (dir_offset) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+}
+
+/*
+ * Replaces the bitmaps stored in the image with the persistent dirty bitmaps
+ * of @bs.  The new data and directory are written to newly allocated clusters
+ * first, so a failure at any point leaves the old copies (flagged in use)
+ * referenced by the header.
+ */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    QCowDirtyBitmap *bitmaps = NULL;
+    QCowDirtyBitmap *old_bitmaps = s->bitmaps;
+    int nb_bitmaps = 0, old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_dir_offset = s->bitmap_directory_offset;
+    uint64_t old_dir_size = s->bitmap_directory_size;
+    uint64_t old_autoclear_features = s->autoclear_features;
+    int64_t dir_offset = 0;
+    size_t dir_size = 0;
+    int i, ret;
+
+    /* Version 2 images have no autoclear bits that could protect the
+     * extension against older implementations */
+    if (s->qcow_version >= 3) {
+        QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+            if (bitmap->persistent) {
+                nb_bitmaps++;
+            }
+        }
+    }
+
+    if (!nb_bitmaps && !old_nb_bitmaps) {
+        return 0;
+    }
+
+    if (nb_bitmaps) {
+        bitmaps = g_malloc0(nb_bitmaps * sizeof(QCowDirtyBitmap));
+        i = 0;
+        QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+            if (!bitmap->persistent) {
+                continue;
+            }
+            ret = store_bitmap_data(bs, bitmap, &bitmaps[i++]);
+            if (ret < 0) {
+                nb_bitmaps = i;
+                goto fail;
+            }
+        }
+
+        dir_size = bitmap_directory_size(bitmaps, nb_bitmaps);
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            dir_offset = 0;
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = write_bitmap_directory(bs, dir_offset, dir_size,
+                                     bitmaps, nb_bitmaps);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The header must only point to the new directory once it and the
+     * refcounts of all new clusters are stable on disk */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->bitmaps = bitmaps;
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->bitmaps = old_bitmaps;
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear_features;
+        goto fail;
+    }
+
+    free_bitmap_clusters(bs, old_dir_offset, old_dir_size,
+                         old_bitmaps, old_nb_bitmaps);
+    for (i = 0; i < old_nb_bitmaps; i++) {
+        g_free(old_bitmaps[i].name);
+    }
+    g_free(old_bitmaps);
+
+    return 0;
+
+fail:
+    free_bitmap_clusters(bs, dir_offset, dir_size, bitmaps, nb_bitmaps);
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+    return ret;
+}
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -200,7 +201,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -223,7 +224,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -273,7 +274,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -286,12 +287,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -300,8 +301,8 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) != QCOW2_CLUSTER_COMPRESSED);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -309,12 +310,14 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+        uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                       l2_index + i));
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -425,11 +428,14 @@ out:
  *
  * on exit, *num is the number of contiguous sectors we can read.
  *
+ * If cached_only is true, the lookup never yields: it fails with -EAGAIN
+ * (leaving *num unchanged) if the L2 table isn't cached.
+ *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
  */
-int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int *num, uint64_t *cluster_offset)
+static int get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool cached_only)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l2_index;
@@ -476,18 +482,51 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 table in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
-    if (ret < 0) {
-        return ret;
+    if (cached_only) {
+        if (qcow2_cache_peek(s->l2_table_cache, l2_offset,
+                             (void**) &l2_table) < 0) {
+            return -EAGAIN;
+        }
+    } else {
+        ret = l2_load(bs, l2_offset, &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
     ret = qcow2_get_cluster_type(*cluster_offset);
+    if (s->extended_l2 && ret != QCOW2_CLUSTER_COMPRESSED) {
+        /* Subclusters can only be processed within a single cluster */
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+        int sc = index_in_cluster / s->subcluster_sectors;
+
+        ret = qcow2_get_subcluster_type(*cluster_offset, l2_bitmap, sc);
+        for (c = sc + 1; c < QCOW_EXTL2_SUBCLUSTERS; c++) {
+            if (qcow2_get_subcluster_type(*cluster_offset, l2_bitmap, c)
+                != ret) {
+                break;
+            }
+        }
+        *cluster_offset = ret == QCOW2_CLUSTER_NORMAL
+                        ? *cluster_offset & L2E_OFFSET_MASK : 0;
+
+        if (!cached_only) {
+            qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        nb_available = c * s->subcluster_sectors;
+        goto out;
+    }
+
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
         /* Compressed clusters can only be processed one by one */
@@ -498,26 +537,29 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         if (s->qcow_version < 3) {
             return -EIO;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table,
+                l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
     default:
         abort();
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (!cached_only) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    }
 
     nb_available = (c * s->cluster_sectors);
 
@@ -530,6 +572,24 @@ out:
     return ret;
 }
 
+int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, false);
+}
+
+/*
+ * Like qcow2_get_cluster_offset(), but only succeeds if the lookup can be
+ * completed from the L2 cache without yielding, so it can be used without
+ * holding s->lock.  Returns -EAGAIN if the caller must take the lock and use
+ * qcow2_get_cluster_offset() instead.
+ */
+int qcow2_get_cluster_offset_cached(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, true);
+}
+
 /*
  * get_cluster_table
  *
@@ -581,7 +641,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -599,13 +659,12 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 /*
  * alloc_compressed_cluster_offset
  *
- * For a given offset of the disk image, return cluster offset in
- * qcow2 file.
- *
- * If the offset is not found, allocate a new compressed cluster.
+ * For a given offset of the disk image, allocate space for a new compressed
+ * cluster in the qcow2 file.  The L2 table is not updated, this is done by
+ * qcow2_link_compressed_cluster() after the compressed data has been written.
  *
- * Return the cluster offset if successful,
- * Return 0, otherwise.
+ * Return the L2 entry for the compressed cluster if successful,
+ * Return 0 if the cluster is already allocated or on error.
  *
  */
 
@@ -626,23 +685,49 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
     }
 
+    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+
     cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
     if (cluster_offset < 0) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
     }
 
     nb_csectors = ((cluster_offset + compressed_size - 1) >> 9) -
                   (cluster_offset >> 9);
 
-    cluster_offset |= QCOW_OFLAG_COMPRESSED |
-                      ((uint64_t)nb_csectors << s->csize_shift);
+    return cluster_offset | QCOW_OFLAG_COMPRESSED |
+           ((uint64_t)nb_csectors << s->csize_shift);
+}
+
+/*
+ * Points the L2 entry for @offset to the compressed cluster @l2_entry that
+ * was allocated with qcow2_alloc_compressed_cluster_offset().  If the
+ * cluster was allocated by another request in the meantime, the compressed
+ * cluster is freed and -EEXIST is returned.
+ */
+int qcow2_link_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t l2_entry)
+{
+    BDRVQcowState *s = bs->opaque;
+    int l2_index, ret;
+    uint64_t *l2_table;
+
+    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (get_l2_entry(s, l2_table, l2_index) & L2E_OFFSET_MASK) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        ret = -EEXIST;
+        goto fail;
+    }
 
     /* update L2 table */
 
@@ -650,13 +735,15 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    if (ret < 0) {
-        return 0;
+    set_l2_entry(s, l2_table, l2_index, l2_entry);
+    if (s->extended_l2) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
     }
+    return qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
 
-    return cluster_offset;
+fail:
+    qcow2_free_any_clusters(bs, l2_entry, 1, QCOW2_DISCARD_NEVER);
+    return ret;
 }
 
 static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
@@ -734,11 +821,34 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+
+        if (s->extended_l2) {
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t bits = m->ext_alloc_bits;
+
+            /* Written subclusters become allocated and stop reading as
+             * zeros.  A cluster that moved to a new host cluster either had
+             * no allocated subclusters or was copied in full, so only its
+             * zero bits carry over. */
+            if (m->ext_in_place) {
+                assert((old_entry & L2E_OFFSET_MASK) == cluster_offset);
+                set_l2_bitmap(s, l2_table, l2_index + i,
+                              (bitmap | bits) & ~(bits << 32));
+                continue;
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          ((bitmap & QCOW_EXTL2_ALL_ZERO) | bits)
+                          & ~(bits << 32));
+        }
+
+        if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_table, l2_index + i,
+                     (cluster_offset + (i << s->cluster_bits))
+                     | QCOW_OFLAG_COPIED);
      }
 
 
@@ -756,7 +866,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -778,7 +888,7 @@ static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -829,6 +939,14 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /* With subclusters, COW only covers part of the cluster, but the
+         * L2 bitmap update still needs the whole cluster to itself */
+        if (s->extended_l2) {
+            old_start = old_alloc->offset;
+            old_end = old_alloc->offset
+                    + old_alloc->nb_clusters * s->cluster_size;
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -921,7 +1039,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -937,11 +1055,26 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
             goto out;
         }
 
-        /* We keep all QCOW_OFLAG_COPIED clusters */
-        keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
-                                      QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
+        if (s->extended_l2) {
+            /* Only a single cluster, and only if every subcluster that is
+             * touched already has valid data in it */
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index);
+            uint64_t bits = qcow2_subcluster_bits(s,
+                offset_into_cluster(s, guest_offset),
+                MIN(offset_into_cluster(s, guest_offset) + *bytes,
+                    s->cluster_size));
+
+            if ((bitmap & bits) != bits || (bitmap & (bits << 32))) {
+                ret = 0;
+                goto out;
+            }
+            keep_clusters = 1;
+        } else {
+            /* We keep all QCOW_OFLAG_COPIED clusters */
+            keep_clusters =
+                count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                          QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
+        }
         assert(keep_clusters <= nb_clusters);
 
         *bytes = MIN(*bytes,
@@ -993,12 +1126,18 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *host_offset, unsigned int *nb_clusters)
 {
     BDRVQcowState *s = bs->opaque;
+    int ret;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    ret = qcow2_alloc_reserved_clusters(bs, host_offset, nb_clusters);
+    if (ret != 0) {
+        return ret < 0 ? ret : 0;
+    }
+
     if (*host_offset == 0) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
@@ -1008,7 +1147,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         *host_offset = cluster_offset;
         return 0;
     } else {
-        int ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
+        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
         if (ret < 0) {
             return ret;
         }
@@ -1043,8 +1182,9 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcowState *s = bs->opaque;
     int l2_index;
     uint64_t *l2_table;
-    uint64_t entry;
+    uint64_t entry, bitmap = 0;
     unsigned int nb_clusters;
+    bool in_place = false;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1069,10 +1209,14 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
-    /* For the moment, overwrite compressed clusters one by one */
-    if (entry & QCOW_OFLAG_COMPRESSED) {
+    if (s->extended_l2) {
+        /* Subclusters are allocated one cluster at a time */
+        nb_clusters = 1;
+        bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    } else if (entry & QCOW_OFLAG_COMPRESSED) {
+        /* For the moment, overwrite compressed clusters one by one */
         nb_clusters = 1;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
@@ -1088,18 +1232,33 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    /* Allocate, if necessary at a given offset in the image file */
-    alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
-    }
+    if (s->extended_l2 && qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL
+        && (entry & QCOW_OFLAG_COPIED))
+    {
+        /* Some of the touched subclusters are unallocated, but the host
+         * cluster is ours: fill them in place */
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+        if (*host_offset != 0 &&
+            start_of_cluster(s, *host_offset) != alloc_cluster_offset)
+        {
+            *bytes = 0;
+            return 0;
+        }
+        in_place = true;
+    } else {
+        /* Allocate, if necessary at a given offset in the image file */
+        alloc_cluster_offset = start_of_cluster(s, *host_offset);
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
 
-    /* Can't extend contiguous allocation */
-    if (nb_clusters == 0) {
-        *bytes = 0;
-        return 0;
+        /* Can't extend contiguous allocation */
+        if (nb_clusters == 0) {
+            *bytes = 0;
+            return 0;
+        }
     }
 
     /*
@@ -1124,8 +1283,38 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    int cow_start_sectors = alloc_n_start;
+    int cow_end_sectors = avail_sectors - nb_sectors;
+    uint32_t alloc_bits = 0;
     QCowL2Meta *old_m = *m;
 
+    /*
+     * With subclusters, a fresh or in-place cluster only needs COW for the
+     * partially written subclusters at either end of the request, and only
+     * if they don't contain valid data yet.  Data that is shared with a
+     * snapshot or compressed is copied in full.
+     */
+    if (s->extended_l2) {
+        if (!in_place &&
+            qcow2_get_cluster_type(entry) != QCOW2_CLUSTER_UNALLOCATED)
+        {
+            alloc_bits = QCOW_EXTL2_ALL_ALLOC;
+        } else {
+            uint32_t valid = in_place ? bitmap & ~(bitmap >> 32) : 0;
+            int sc_sectors = s->subcluster_sectors;
+            int first_sc = alloc_n_start / sc_sectors;
+            int last_sc = (nb_sectors - 1) / sc_sectors;
+
+            alloc_bits = qcow2_subcluster_bits(s,
+                                               alloc_n_start * BDRV_SECTOR_SIZE,
+                                               nb_sectors * BDRV_SECTOR_SIZE);
+            cow_start_sectors = (valid & (1U << first_sc)) ? 0 :
+                                alloc_n_start - first_sc * sc_sectors;
+            cow_end_sectors = (valid & (1U << last_sc)) ? 0 :
+                              (last_sc + 1) * sc_sectors - nb_sectors;
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1135,14 +1324,17 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .offset         = start_of_cluster(s, guest_offset),
         .nb_clusters    = nb_clusters,
         .nb_available   = nb_sectors,
+        .ext_alloc_bits = alloc_bits,
+        .ext_in_place   = in_place,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
+            .offset     = (alloc_n_start - cow_start_sectors)
+                          * BDRV_SECTOR_SIZE,
+            .nb_sectors = cow_start_sectors,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
+            .nb_sectors = cow_end_sectors,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1318,29 +1510,208 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *dest;
+    int dest_size;
+    const uint8_t *src;
+    int src_size;
+} Qcow2DecompressData;
+
+static int qcow2_decompress_pool_func(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->dest, data->dest_size,
+                             data->src, data->src_size);
+}
+
+/* Read and decompress the cluster described by the L2 entry @l2_entry */
+static int coroutine_fn qcow2_co_decompress_cluster(BlockDriverState *bs,
+                                                    uint64_t l2_entry,
+                                                    uint8_t *dest)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2DecompressData arg;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret, nb_csectors, sector_offset;
     uint64_t coffset;
 
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
+    coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+
+    iov.iov_len = nb_csectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_readv(bs->file, coffset >> 9, nb_csectors, &qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* inflate is CPU bound, keep it out of the I/O thread */
+    arg = (Qcow2DecompressData) {
+        .dest       = dest,
+        .dest_size  = s->cluster_size,
+        .src        = (uint8_t *)iov.iov_base + sector_offset,
+        .src_size   = iov.iov_len - sector_offset,
+    };
+    if (thread_pool_submit_co(pool, qcow2_decompress_pool_func, &arg) < 0) {
+        ret = -EIO;
+    }
+
+out:
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+static Qcow2CompressedCluster *qcow2_compressed_cache_find(BDRVQcowState *s,
+                                                          uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        if (s->compressed_cache[i].offset == coffset) {
+            return &s->compressed_cache[i];
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+    }
+    return NULL;
+}
+
+/* Returns the least recently used entry that is not being filled, or NULL */
+static Qcow2CompressedCluster *qcow2_compressed_cache_victim(BDRVQcowState *s)
+{
+    Qcow2CompressedCluster *c, *victim = NULL;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        c = &s->compressed_cache[i];
+        if (!c->filling &&
+            (victim == NULL || c->lru_counter < victim->lru_counter)) {
+            victim = c;
         }
-        s->cluster_cache_offset = coffset;
     }
-    return 0;
+    return victim;
+}
+
+/*
+ * Copies @nb_sectors sectors starting at @index_in_cluster of the compressed
+ * cluster described by the L2 entry @l2_entry into @qiov.
+ *
+ * Decompressed clusters are kept in a small LRU cache, keyed by the host
+ * offset of the compressed data, so that sequential reads don't inflate the
+ * same cluster over and over.  Concurrent readers of a cluster that is being
+ * decompressed wait for it instead of doing the work twice.  s->lock need
+ * not be held.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t l2_entry,
+                                          int index_in_cluster, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t coffset = l2_entry & s->cluster_offset_mask;
+    size_t offset = index_in_cluster * BDRV_SECTOR_SIZE;
+    size_t bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    Qcow2CompressedCluster *c;
+    uint8_t *buf;
+    int ret;
+
+    for (;;) {
+        c = qcow2_compressed_cache_find(s, coffset);
+        if (c == NULL || !c->filling) {
+            break;
+        }
+        qemu_co_queue_wait(&c->waiters);
+    }
+
+    if (c) {
+        c->lru_counter = ++s->compressed_lru_counter;
+        qemu_iovec_from_buf(qiov, 0, c->data + offset, bytes);
+        return 0;
+    }
+
+    c = qcow2_compressed_cache_victim(s);
+    if (c == NULL) {
+        /* more decompressions in flight than cache entries */
+        buf = qemu_blockalign(bs, s->cluster_size);
+        ret = qcow2_co_decompress_cluster(bs, l2_entry, buf);
+        if (ret >= 0) {
+            qemu_iovec_from_buf(qiov, 0, buf + offset, bytes);
+        }
+        qemu_vfree(buf);
+        return ret;
+    }
+
+    c->offset = coffset;
+    c->filling = true;
+    ret = qcow2_co_decompress_cluster(bs, l2_entry, c->data);
+    c->filling = false;
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, 0, c->data + offset, bytes);
+        c->lru_counter = ++s->compressed_lru_counter;
+    }
+    if (ret < 0 || c->offset != coffset) {
+        /* failed or invalidated meanwhile */
+        c->offset = -1;
+    }
+    qemu_co_queue_restart_all(&c->waiters);
+    return ret;
+}
+
+/*
+ * Drops the cached clusters whose compressed data lies in the given range of
+ * the image file, which is about to be reused.  Entries that are still being
+ * filled are not reused when they complete.
+ */
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t length)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCluster *c;
+    int i;
+
+    /* compressed data may start in the cluster before the range */
+    offset -= MIN(offset, s->cluster_size);
+    length += s->cluster_size;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        c = &s->compressed_cache[i];
+        if (c->offset != -1 && c->offset - offset < length) {
+            c->offset = -1;
+        }
+    }
+}
+
+void qcow2_compressed_cache_create(BlockDriverState *bs, int num_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    s->compressed_cache = g_new0(Qcow2CompressedCluster, num_clusters);
+    s->compressed_cache_size = num_clusters;
+    for (i = 0; i < num_clusters; i++) {
+        s->compressed_cache[i].offset = -1;
+        s->compressed_cache[i].data = qemu_blockalign(bs, s->cluster_size);
+        qemu_co_queue_init(&s->compressed_cache[i].waiters);
+    }
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        assert(!s->compressed_cache[i].filling);
+        qemu_vfree(s->compressed_cache[i].data);
+    }
+    g_free(s->compressed_cache);
+    s->compressed_cache = NULL;
+    s->compressed_cache_size = 0;
 }
 
 /*
@@ -1368,14 +1739,17 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        set_l2_entry(s, l2_table, l2_index + i, 0);
+        if (s->extended_l2) {
+            set_l2_bitmap(s, l2_table, l2_index + i, 0);
+        }
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1, type);
@@ -1455,11 +1829,19 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
+        if (s->extended_l2) {
+            /* Keep the host cluster, if any, for later writes */
+            if (old_offset & QCOW_OFLAG_COMPRESSED) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i, QCOW_EXTL2_ALL_ZERO);
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
             l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
@@ -1529,6 +1911,9 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     int ret;
     int i, j;
 
+    /* Zero clusters are never used with extended L2 entries */
+    assert(!s->extended_l2);
+
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
@@ -1613,7 +1998,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             }
 
             ret = bdrv_write_zeroes(bs->file, offset / BDRV_SECTOR_SIZE,
-                                    s->cluster_sectors);
+                                    s->cluster_sectors, 0);
             if (ret < 0) {
                 if (!preallocated) {
                     qcow2_free_clusters(bs, offset, s->cluster_size,
@@ -26,7 +26,9 @@
 #include "block/block_int.h"
 #include "block/qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 #include "qapi/qmp/types.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -562,6 +564,11 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
         }
+        if (refcount == 0) {
+            /* the cluster may be reused, decompressed copies are stale */
+            qcow2_compressed_cache_invalidate(bs, cluster_offset,
+                                              s->cluster_size);
+        }
     }
 
     ret = 0;
@@ -705,6 +712,66 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocates data clusters from the allocation reservation, refilling it when
+ * it has run out.  Refcounts of the whole reservation are updated at once when
+ * it is filled, so handing out clusters from it needs no metadata update.
+ *
+ * If *host_offset is non-zero, clusters are only taken if the reservation
+ * continues exactly there.  *nb_clusters may be decreased if the reservation
+ * has fewer clusters left.
+ *
+ * Returns 1 if clusters were allocated and *host_offset is updated, 0 if the
+ * caller must allocate in the normal way, -errno on error.
+ */
+int qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t *host_offset,
+                                  unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->reserve_size == 0 || *nb_clusters > s->reserve_size) {
+        return 0;
+    }
+
+    if (s->reserve_nb_clusters == 0 &&
+        (*host_offset == 0 || *host_offset == s->reserve_offset)) {
+        int64_t offset = qcow2_alloc_clusters(bs, (int64_t)s->reserve_size
+                                                  << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        s->reserve_offset = offset;
+        s->reserve_nb_clusters = s->reserve_size;
+        trace_qcow2_reserve_refill(bs, offset, s->reserve_size);
+    }
+
+    if (s->reserve_nb_clusters == 0 ||
+        (*host_offset != 0 && *host_offset != s->reserve_offset)) {
+        return 0;
+    }
+
+    *nb_clusters = MIN(*nb_clusters, s->reserve_nb_clusters);
+    *host_offset = s->reserve_offset;
+    s->reserve_offset += (uint64_t)*nb_clusters << s->cluster_bits;
+    s->reserve_nb_clusters -= *nb_clusters;
+    return 1;
+}
+
+/* Drop the unused part of the allocation reservation */
+void qcow2_release_reservation(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->reserve_nb_clusters == 0) {
+        return;
+    }
+
+    qcow2_free_clusters(bs, s->reserve_offset,
+                        (int64_t)s->reserve_nb_clusters << s->cluster_bits,
+                        QCOW2_DISCARD_NEVER);
+    s->reserve_nb_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -867,7 +934,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -926,7 +993,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_table, j, offset);
                     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
             }
@@ -990,6 +1057,98 @@ fail:
 
 
 
+/*
+ * The refcounts that are computed from the metadata are kept in chunks that
+ * are only allocated when a cluster in them is referenced.  Most clusters
+ * have a refcount of 1, so a chunk starts out as a bitmap and is converted
+ * to 16 bit counters once one of its clusters is referenced twice.
+ */
+#define CHECK_CHUNK_BITS    15
+#define CHECK_CHUNK_SIZE    (1 << CHECK_CHUNK_BITS)
+
+typedef struct CheckRefcountChunk {
+    unsigned long *used;        /* clusters with a refcount of 1 */
+    uint16_t *refcounts;        /* replaces used once allocated */
+} CheckRefcountChunk;
+
+typedef struct CheckRefcounts {
+    CheckRefcountChunk *chunks;
+    int64_t nb_clusters;
+} CheckRefcounts;
+
+static void check_refcounts_init(CheckRefcounts *r, int64_t nb_clusters)
+{
+    r->chunks = g_new0(CheckRefcountChunk,
+                       DIV_ROUND_UP(nb_clusters, CHECK_CHUNK_SIZE));
+    r->nb_clusters = nb_clusters;
+}
+
+static void check_refcounts_resize(CheckRefcounts *r, int64_t nb_clusters)
+{
+    int64_t old_chunks = DIV_ROUND_UP(r->nb_clusters, CHECK_CHUNK_SIZE);
+    int64_t new_chunks = DIV_ROUND_UP(nb_clusters, CHECK_CHUNK_SIZE);
+
+    assert(nb_clusters >= r->nb_clusters);
+    r->chunks = g_renew(CheckRefcountChunk, r->chunks, new_chunks);
+    memset(&r->chunks[old_chunks], 0,
+           (new_chunks - old_chunks) * sizeof(CheckRefcountChunk));
+    r->nb_clusters = nb_clusters;
+}
+
+static void check_refcounts_destroy(CheckRefcounts *r)
+{
+    int64_t i;
+
+    for (i = 0; i < DIV_ROUND_UP(r->nb_clusters, CHECK_CHUNK_SIZE); i++) {
+        g_free(r->chunks[i].used);
+        g_free(r->chunks[i].refcounts);
+    }
+    g_free(r->chunks);
+}
+
+static uint16_t check_refcounts_get(CheckRefcounts *r, int64_t cluster)
+{
+    CheckRefcountChunk *c = &r->chunks[cluster >> CHECK_CHUNK_BITS];
+    int i = cluster & (CHECK_CHUNK_SIZE - 1);
+
+    if (c->refcounts) {
+        return c->refcounts[i];
+    }
+    return c->used && test_bit(i, c->used);
+}
+
+static void check_refcounts_set(CheckRefcounts *r, int64_t cluster,
+                                uint16_t refcount)
+{
+    CheckRefcountChunk *c = &r->chunks[cluster >> CHECK_CHUNK_BITS];
+    int i = cluster & (CHECK_CHUNK_SIZE - 1);
+    unsigned long j;
+
+    if (!c->refcounts && refcount > 1) {
+        c->refcounts = g_new0(uint16_t, CHECK_CHUNK_SIZE);
+        if (c->used) {
+            for (j = find_first_bit(c->used, CHECK_CHUNK_SIZE);
+                 j < CHECK_CHUNK_SIZE;
+                 j = find_next_bit(c->used, CHECK_CHUNK_SIZE, j + 1)) {
+                c->refcounts[j] = 1;
+            }
+            g_free(c->used);
+            c->used = NULL;
+        }
+    }
+
+    if (c->refcounts) {
+        c->refcounts[i] = refcount;
+    } else if (refcount) {
+        if (!c->used) {
+            c->used = bitmap_new(CHECK_CHUNK_SIZE);
+        }
+        set_bit(i, c->used);
+    } else if (c->used) {
+        clear_bit(i, c->used);
+    }
+}
+
 /*
  * Increases the refcount for a range of clusters in a given refcount table.
  * This is used to construct a temporary refcount table out of L1 and L2 tables
@@ -999,13 +1158,13 @@ fail:
  */
 static void inc_refcounts(BlockDriverState *bs,
                           BdrvCheckResult *res,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
+                          CheckRefcounts *refcounts,
                           int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t start, last, cluster_offset;
-    int k;
+    int64_t k;
+    uint16_t refcount;
 
     if (size <= 0)
         return;
@@ -1019,13 +1178,15 @@ static void inc_refcounts(BlockDriverState *bs,
             fprintf(stderr, "ERROR: invalid cluster offset=0x%" PRIx64 "\n",
                 cluster_offset);
             res->corruptions++;
-        } else if (k >= refcount_table_size) {
+        } else if (k >= refcounts->nb_clusters) {
             fprintf(stderr, "Warning: cluster offset=0x%" PRIx64 " is after "
                 "the end of the image file, can't properly check refcounts.\n",
                 cluster_offset);
             res->check_errors++;
         } else {
-            if (++refcount_table[k] == 0) {
+            refcount = check_refcounts_get(refcounts, k) + 1;
+            check_refcounts_set(refcounts, k, refcount);
+            if (refcount == 0) {
                 fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
                     "\n", cluster_offset);
                 res->corruptions++;
@@ -1034,6 +1195,142 @@ static void inc_refcounts(BlockDriverState *bs,
     }
 }
 
+/*
+ * L2 tables are read ahead with several requests in flight, so that checking
+ * a large image isn't bound by the latency of one read at a time.  The tables
+ * are still handed out in L1 order.
+ */
+#define CHECK_L2_READS_IN_FLIGHT 16
+
+typedef struct CheckL2Read {
+    uint64_t *l2_table;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int l1_index;
+    int ret;                    /* -EINPROGRESS while the read is running */
+} CheckL2Read;
+
+typedef struct CheckL2Prefetch {
+    BlockDriverState *bs;
+    const uint64_t *l1_table;
+    int l1_size;
+    int next;                   /* next L1 index to look at for reading */
+    int first;                  /* the oldest read in reads[] */
+    int nb_reads;
+    int depth;
+    CheckL2Read reads[CHECK_L2_READS_IN_FLIGHT];
+} CheckL2Prefetch;
+
+static void check_l2_read_cb(void *opaque, int ret)
+{
+    CheckL2Read *r = opaque;
+
+    r->ret = ret;
+}
+
+static void check_l2_prefetch_fill(CheckL2Prefetch *p)
+{
+    BDRVQcowState *s = p->bs->opaque;
+    CheckL2Read *r;
+    uint64_t l2_offset;
+
+    while (p->nb_reads < p->depth && p->next < p->l1_size) {
+        l2_offset = p->l1_table[p->next] & L1E_OFFSET_MASK;
+        if (!l2_offset) {
+            p->next++;
+            continue;
+        }
+
+        r = &p->reads[(p->first + p->nb_reads) % p->depth];
+        r->l1_index = p->next++;
+        p->nb_reads++;
+
+        if (l2_offset & (BDRV_SECTOR_SIZE - 1)) {
+            /* corrupted L1 entry; it is reported by the caller */
+            r->ret = bdrv_pread(p->bs->file, l2_offset, r->l2_table,
+                                s->cluster_size);
+            continue;
+        }
+
+        r->ret = -EINPROGRESS;
+        qemu_iovec_init_external(&r->qiov, &r->iov, 1);
+        if (!bdrv_aio_readv(p->bs->file, l2_offset >> BDRV_SECTOR_BITS,
+                            &r->qiov, s->cluster_sectors,
+                            check_l2_read_cb, r)) {
+            r->ret = -EIO;
+        }
+    }
+}
+
+/*
+ * Reads the L2 tables referenced by @l1_table (in CPU byte order) with up to
+ * @depth reads in flight.
+ */
+static void check_l2_prefetch_init(CheckL2Prefetch *p, BlockDriverState *bs,
+                                   const uint64_t *l1_table, int l1_size,
+                                   int depth)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    assert(depth > 0 && depth <= CHECK_L2_READS_IN_FLIGHT);
+    memset(p, 0, sizeof(*p));
+    p->bs = bs;
+    p->l1_table = l1_table;
+    p->l1_size = l1_size;
+    p->depth = depth;
+
+    for (i = 0; i < depth; i++) {
+        p->reads[i].l2_table = qemu_blockalign(bs, s->cluster_size);
+        p->reads[i].iov.iov_base = p->reads[i].l2_table;
+        p->reads[i].iov.iov_len = s->cluster_size;
+    }
+    check_l2_prefetch_fill(p);
+}
+
+/*
+ * Waits for the next L2 table in L1 order.  Returns its L1 index, or -1 if
+ * there are no more L2 tables.  The table in *l2_table is valid until the
+ * next call; *ret is the result of reading it.
+ */
+static int check_l2_prefetch_next(CheckL2Prefetch *p, uint64_t **l2_table,
+                                  int *ret)
+{
+    CheckL2Read *r;
+
+    /* the slot of the previous table can be reused now */
+    if (*l2_table) {
+        p->first = (p->first + 1) % p->depth;
+        p->nb_reads--;
+        check_l2_prefetch_fill(p);
+    }
+
+    if (!p->nb_reads) {
+        *l2_table = NULL;
+        return -1;
+    }
+
+    r = &p->reads[p->first];
+    while (r->ret == -EINPROGRESS) {
+        qemu_aio_wait();
+    }
+    *l2_table = r->l2_table;
+    *ret = r->ret;
+    return r->l1_index;
+}
+
+static void check_l2_prefetch_destroy(CheckL2Prefetch *p)
+{
+    int i;
+
+    for (i = 0; i < p->depth; i++) {
+        while (p->reads[i].ret == -EINPROGRESS) {
+            qemu_aio_wait();
+        }
+        qemu_vfree(p->reads[i].l2_table);
+    }
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
@@ -1048,24 +1345,17 @@ enum {
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
+    CheckRefcounts *refcounts, const uint64_t *l2_table, int64_t l2_offset,
     int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    int i, nb_csectors;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1082,7 +1372,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            inc_refcounts(bs, res, refcounts,
                 l2_entry & ~511, nb_csectors * 512);
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1118,8 +1408,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            inc_refcounts(bs, res, refcount_table,refcount_table_size,
-                offset, s->cluster_size);
+            inc_refcounts(bs, res, refcounts, offset, s->cluster_size);
 
             /* Correct offsets are cluster aligned */
             if (offset & (s->cluster_size - 1)) {
@@ -1131,6 +1420,13 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         case QCOW2_CLUSTER_UNALLOCATED:
+            if (s->extended_l2 &&
+                (get_l2_bitmap(s, l2_table, i) & QCOW_EXTL2_ALL_ALLOC)) {
+                fprintf(stderr, "ERROR: L2 entry %d in table %" PRIx64 ": "
+                    "subclusters are allocated, but there is no host "
+                    "cluster\n", i, l2_offset);
+                res->corruptions++;
+            }
             break;
 
         default:
@@ -1138,13 +1434,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
-
-fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
-    return -EIO;
 }
 
 /*
@@ -1157,20 +1447,19 @@ fail:
  */
 static int check_refcounts_l1(BlockDriverState *bs,
                               BdrvCheckResult *res,
-                              uint16_t *refcount_table,
-                              int refcount_table_size,
+                              CheckRefcounts *refcounts,
                               int64_t l1_table_offset, int l1_size,
                               int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, l2_offset, l1_size2;
-    int i, ret;
+    uint64_t *l1_table, *l2_table = NULL, l2_offset, l1_size2;
+    CheckL2Prefetch prefetch;
+    int i, ret, read_ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    inc_refcounts(bs, res, refcount_table, refcount_table_size,
-        l1_table_offset, l1_size2);
+    inc_refcounts(bs, res, refcounts, l1_table_offset, l1_size2);
 
     /* Read L1 table entries from disk */
     if (l1_size2 == 0) {
@@ -1185,29 +1474,36 @@ static int check_refcounts_l1(BlockDriverState *bs,
     }
 
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                l2_offset, s->cluster_size);
+    check_l2_prefetch_init(&prefetch, bs, l1_table, l1_size,
+                           CHECK_L2_READS_IN_FLIGHT);
+    while ((i = check_l2_prefetch_next(&prefetch, &l2_table,
+                                       &read_ret)) >= 0) {
+        /* Mark L2 table as used */
+        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+        inc_refcounts(bs, res, refcounts, l2_offset, s->cluster_size);
+
+        /* L2 tables are cluster aligned */
+        if (l2_offset & (s->cluster_size - 1)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
+        }
 
-            /* L2 tables are cluster aligned */
-            if (l2_offset & (s->cluster_size - 1)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+        if (read_ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            check_l2_prefetch_destroy(&prefetch);
+            goto fail;
+        }
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
-                goto fail;
-            }
+        /* Process and check L2 entries */
+        ret = check_refcounts_l2(bs, res, refcounts, l2_table, l2_offset,
+                                 flags);
+        if (ret < 0) {
+            check_l2_prefetch_destroy(&prefetch);
+            goto fail;
         }
     }
+    check_l2_prefetch_destroy(&prefetch);
     g_free(l1_table);
     return 0;
 
@@ -1230,20 +1526,24 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
-    int ret;
+    uint64_t *l2_table = NULL;
+    CheckL2Prefetch prefetch;
+    int ret, read_ret;
     int refcount;
     int i, j;
 
-    for (i = 0; i < s->l1_size; i++) {
+    /* Repairing writes L2 tables, which must not be read ahead in case a
+     * corrupted L1 table references one of them twice */
+    check_l2_prefetch_init(&prefetch, bs, s->l1_table, s->l1_size,
+                           fix & BDRV_FIX_ERRORS ? 1
+                                                 : CHECK_L2_READS_IN_FLIGHT);
+
+    while ((i = check_l2_prefetch_next(&prefetch, &l2_table,
+                                       &read_ret)) >= 0) {
         uint64_t l1_entry = s->l1_table[i];
         uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
         bool l2_dirty = false;
 
-        if (!l2_offset) {
-            continue;
-        }
-
         refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
         if (refcount < 0) {
             /* don't print message nor increment check_errors */
@@ -1270,9 +1570,8 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
-        if (ret < 0) {
+        if (read_ret < 0) {
+            ret = read_ret;
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
             res->check_errors++;
@@ -1280,7 +1579,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1298,9 +1597,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1333,7 +1632,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    check_l2_prefetch_destroy(&prefetch);
     return ret;
 }
 
@@ -1463,22 +1762,21 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     int64_t size, i, highest_cluster;
     int nb_clusters, refcount1, refcount2;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
+    CheckRefcounts refcounts;
     int ret;
 
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
-    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
+    check_refcounts_init(&refcounts, nb_clusters);
 
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
-        0, s->cluster_size);
+    inc_refcounts(bs, res, &refcounts, 0, s->cluster_size);
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+    ret = check_refcounts_l1(bs, res, &refcounts,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO);
     if (ret < 0) {
         goto fail;
@@ -1487,17 +1785,25 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* snapshots */
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+        ret = check_refcounts_l1(bs, res, &refcounts,
             sn->l1_table_offset, sn->l1_size, 0);
         if (ret < 0) {
             goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &refcounts,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps */
+    inc_refcounts(bs, res, &refcounts,
+        s->bitmap_directory_offset, s->bitmap_directory_size);
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        inc_refcounts(bs, res, &refcounts,
+            s->bitmaps[i].data_offset, s->bitmaps[i].data_size);
+    }
+
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &refcounts,
         s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
@@ -1522,14 +1828,14 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
+            inc_refcounts(bs, res, &refcounts,
                 offset, s->cluster_size);
-            if (refcount_table[cluster] != 1) {
+            if (check_refcounts_get(&refcounts, cluster) != 1) {
                 fprintf(stderr, "%s refcount block %" PRId64
                     " refcount=%d\n",
                     fix & BDRV_FIX_ERRORS ? "Repairing" :
                                             "ERROR",
-                    i, refcount_table[cluster]);
+                    i, check_refcounts_get(&refcounts, cluster));
 
                 if (fix & BDRV_FIX_ERRORS) {
                     int64_t new_offset;
@@ -1543,15 +1849,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                     /* update refcounts */
                     if ((new_offset >> s->cluster_bits) >= nb_clusters) {
                         /* increase refcount_table size if necessary */
-                        int old_nb_clusters = nb_clusters;
                         nb_clusters = (new_offset >> s->cluster_bits) + 1;
-                        refcount_table = g_realloc(refcount_table,
-                                nb_clusters * sizeof(uint16_t));
-                        memset(&refcount_table[old_nb_clusters], 0, (nb_clusters
-                                - old_nb_clusters) * sizeof(uint16_t));
+                        check_refcounts_resize(&refcounts, nb_clusters);
                     }
-                    refcount_table[cluster]--;
-                    inc_refcounts(bs, res, refcount_table, nb_clusters,
+                    check_refcounts_set(&refcounts, cluster,
+                        check_refcounts_get(&refcounts, cluster) - 1);
+                    inc_refcounts(bs, res, &refcounts,
                             new_offset, s->cluster_size);
 
                     res->corruptions_fixed++;
@@ -1572,7 +1875,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             continue;
         }
 
-        refcount2 = refcount_table[i];
+        refcount2 = check_refcounts_get(&refcounts, i);
 
         if (refcount1 > 0 || refcount2 > 0) {
             highest_cluster = i;
@@ -1623,7 +1926,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    g_free(refcount_table);
+    check_refcounts_destroy(&refcounts);
 
     return ret;
 }
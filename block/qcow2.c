@@ -26,6 +26,7 @@
 #include "qemu/module.h"
 #include <zlib.h>
 #include "qemu/aes.h"
+#include "block/thread-pool.h"
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -57,6 +58,14 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
+
+typedef struct {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED QCowDirtyBitmapExtension;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -154,6 +163,34 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+        {
+            QCowDirtyBitmapExtension bitmap_ext;
+
+            /* If the autoclear bit was cleared, an older implementation has
+             * written to the image and the bitmaps are stale */
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+                break;
+            }
+            if (ext.len != sizeof(bitmap_ext)) {
+                error_setg(errp, "ERROR: ext_dirty_bitmaps: invalid length "
+                           "%u", ext.len);
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &bitmap_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_dirty_bitmaps: "
+                                 "Could not read extension");
+                return ret;
+            }
+            s->nb_bitmaps = be32_to_cpu(bitmap_ext.nb_bitmaps);
+            s->bitmap_directory_size =
+                be64_to_cpu(bitmap_ext.bitmap_directory_size);
+            s->bitmap_directory_offset =
+                be64_to_cpu(bitmap_ext.bitmap_directory_offset);
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -354,6 +391,27 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Generate discard requests when other clusters are freed",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed cluster cache",
+        },
+        {
+            .name = QCOW2_OPT_ALLOC_RESERVE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the host cluster extents reserved for allocating "
+                    "writes (0 disables the reservation)",
+        },
         {
             .name = QCOW2_OPT_OVERLAP,
             .type = QEMU_OPT_STRING,
@@ -421,12 +479,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check;
     int overlap_check_template = 0;
+    uint64_t reserve_size;
+    uint64_t l2_cache_size, refcount_cache_size, compressed_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -548,7 +608,16 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    s->extended_l2 = !!(s->incompatible_features & QCOW2_INCOMPAT_EXTL2);
+    if (s->extended_l2 && s->cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries need a cluster size of at "
+                   "least %d bytes", 1 << QCOW_EXTL2_MIN_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->subcluster_sectors = s->cluster_sectors / QCOW_EXTL2_SUBCLUSTERS;
+    /* L2 is always one cluster, with 8 or 16 bytes per entry */
+    s->l2_bits = s->cluster_bits - 3 - s->extended_l2;
     s->l2_size = 1 << s->l2_bits;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
@@ -594,15 +663,39 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
-
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE,
+                                      L2_CACHE_SIZE * s->cluster_size)
+                    / s->cluster_size;
+    refcount_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+                                            REFCOUNT_CACHE_SIZE *
+                                            s->cluster_size)
+                          / s->cluster_size;
+    compressed_cache_size = qemu_opt_get_size(opts,
+                                              QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                                              COMPRESSED_CACHE_SIZE *
+                                              s->cluster_size)
+                            / s->cluster_size;
+    if (l2_cache_size > INT_MAX || refcount_cache_size > INT_MAX ||
+        compressed_cache_size > INT_MAX) {
+        error_setg(errp, "qcow2 cache size is too large");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_table_cache = qcow2_cache_create(bs, MAX(l2_cache_size,
+                                                   MIN_L2_CACHE_SIZE));
+    s->refcount_block_cache = qcow2_cache_create(bs, MAX(refcount_cache_size,
+                                                         REFCOUNT_CACHE_SIZE));
+
+    qcow2_compressed_cache_create(bs, compressed_cache_size);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -643,9 +736,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    ret = qcow2_read_bitmaps(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read dirty bitmap directory");
+        goto fail;
+    }
+
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -655,6 +754,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->compressed_write_lock);
 
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
@@ -669,14 +769,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (error_is_set(&local_err)) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
@@ -690,6 +782,17 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    reserve_size = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_RESERVE, 0)
+                   >> s->cluster_bits;
+    if (reserve_size > INT_MAX >> s->cluster_bits) {
+        error_setg(errp, "qcow2 option '" QCOW2_OPT_ALLOC_RESERVE "' is too "
+                   "large");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->reserve_size = reserve_size;
+    s->reserve_nb_clusters = 0;
+
     opt_overlap_check = qemu_opt_get(opts, "overlap-check") ?: "cached";
     if (!strcmp(opt_overlap_check, "none")) {
         overlap_check_template = 0;
@@ -703,7 +806,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "Unsupported value '%s' for qcow2 option "
                    "'overlap-check'. Allowed are either of the following: "
                    "none, constant, cached, all", opt_overlap_check);
-        qemu_opts_del(opts);
         ret = -EINVAL;
         goto fail;
     }
@@ -718,6 +820,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     qemu_opts_del(opts);
+    opts = NULL;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         error_setg(errp, "Lazy refcounts require a qcow2 image with at least "
@@ -732,12 +835,24 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         qcow2_check_refcounts(bs, &result, 0);
     }
 #endif
+
+    if ((flags & BDRV_O_RDWR) && !(flags & BDRV_O_CHECK)) {
+        ret = qcow2_load_dirty_bitmaps(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     return ret;
 
  fail:
+    if (opts) {
+        qemu_opts_del(opts);
+    }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
     qcow2_refcount_close(bs);
     g_free(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
@@ -745,8 +860,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
+    qcow2_compressed_cache_destroy(bs);
     return ret;
 }
 
@@ -809,9 +926,14 @@ static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
     int64_t status = 0;
 
     *pnum = nb_sectors;
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
-    qemu_co_mutex_unlock(&s->lock);
+    ret = qcow2_get_cluster_offset_cached(bs, sector_num << 9, pnum,
+                                          &cluster_offset);
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum,
+                                       &cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -858,11 +980,10 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
+    bool locked = false;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (remaining_sectors != 0) {
 
         /* prepare next request */
@@ -872,12 +993,28 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
         }
 
-        ret = qcow2_get_cluster_offset(bs, sector_num << 9,
+        /*
+         * Clusters described by a cached L2 table can be looked up without
+         * s->lock, so reads don't queue up behind allocating writes. Take
+         * the lock only if metadata must be loaded.
+         */
+        ret = qcow2_get_cluster_offset_cached(bs, sector_num << 9,
             &cur_nr_sectors, &cluster_offset);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            locked = true;
+            ret = qcow2_get_cluster_offset(bs, sector_num << 9,
+                &cur_nr_sectors, &cluster_offset);
+        }
         if (ret < 0) {
             goto fail;
         }
 
+        if (locked) {
+            qemu_co_mutex_unlock(&s->lock);
+            locked = false;
+        }
+
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
 
         qemu_iovec_reset(&hd_qiov);
@@ -893,10 +1030,8 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                     sector_num, cur_nr_sectors);
                 if (n1 > 0) {
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
                                         n1, &hd_qiov);
-                    qemu_co_mutex_lock(&s->lock);
                     if (ret < 0) {
                         goto fail;
                     }
@@ -912,15 +1047,12 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_read_compressed(bs, cluster_offset,
+                                           index_in_cluster, cur_nr_sectors,
+                                           &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -947,11 +1079,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
-            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -976,7 +1106,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
+    if (locked) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
 
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
@@ -1005,8 +1137,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -1123,6 +1253,13 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_release_reservation(bs);
+
+    if (!bs->read_only && !(bs->open_flags & BDRV_O_INCOMING)) {
+        qcow2_store_dirty_bitmaps(bs);
+    }
+
     g_free(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1138,10 +1275,10 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs)
@@ -1313,11 +1450,21 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1328,6 +1475,25 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Dirty bitmaps */
+    if (s->qcow_version >= 3 &&
+        (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+        QCowDirtyBitmapExtension bitmap_ext = {
+            .nb_bitmaps              = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size   = cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset = cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             &bitmap_ext, sizeof(bitmap_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1512,6 +1678,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header.incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not write qcow2 header");
@@ -1651,6 +1821,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTL2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTL2 : 0;
         }
         options++;
     }
@@ -1667,6 +1839,20 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
         return -EINVAL;
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 or "
+                       "greater)");
+            return -EINVAL;
+        }
+        if (cluster_size < (1 << QCOW_EXTL2_MIN_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries need a cluster size of at "
+                       "least %d bytes", 1 << QCOW_EXTL2_MIN_CLUSTER_BITS);
+            return -EINVAL;
+        }
+    }
+
     ret = qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, options, version, &local_err);
     if (error_is_set(&local_err)) {
@@ -1769,16 +1955,145 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/*
+ * Compresses @src_size bytes from @src into @dest with raw deflate.
+ *
+ * Returns the compressed size on success, -1 if the compressed data would
+ * not fit into @dest_size bytes and -2 on other errors.
+ */
+static ssize_t qcow2_compress(void *dest, size_t dest_size,
+                              const void *src, size_t src_size)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -2;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK || ret == Z_BUF_ERROR) ? -1 : -2;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = qcow2_compress(data->dest, data->dest_size,
+                               data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * Compression is CPU bound, so it is done in the thread pool.  This way
+ * concurrent compressed writes (e.g. from qemu-img convert -c) are spread
+ * over several host CPUs instead of serializing on the main loop.
+ */
+static ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                              void *dest, size_t dest_size,
+                                              const void *src, size_t src_size)
+{
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData arg = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &arg);
+    return arg.ret;
+}
+
+/*
+ * Writes the compressed data of a cluster at the byte offset @offset.
+ *
+ * Compressed clusters are packed, so the first and last sector of the data
+ * are usually shared with the neighbouring compressed clusters.  Only
+ * these partial sectors need a read-modify-write that must not race with
+ * the neighbours; the full sectors in between are written in parallel with
+ * other requests.
+ */
+static int coroutine_fn qcow2_co_write_compressed_data(BlockDriverState *bs,
+                                                       uint64_t offset,
+                                                       const uint8_t *buf,
+                                                       int len)
+{
+    BDRVQcowState *s = bs->opaque;
+    int head = MIN(len, (int)(-offset & (BDRV_SECTOR_SIZE - 1)));
+    int tail = (len - head) & (BDRV_SECTOR_SIZE - 1);
+    int middle = len - head - tail;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret = 0;
+
+    if (middle) {
+        iov = (struct iovec) {
+            .iov_base   = (uint8_t *)buf + head,
+            .iov_len    = middle,
+        };
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(bs->file, (offset + head) >> BDRV_SECTOR_BITS,
+                             middle >> BDRV_SECTOR_BITS, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (head || tail) {
+        qemu_co_mutex_lock(&s->compressed_write_lock);
+        if (head) {
+            ret = bdrv_pwrite(bs->file, offset, buf, head);
+        }
+        if (tail && ret >= 0) {
+            ret = bdrv_pwrite(bs->file, offset + len - tail,
+                              buf + len - tail, tail);
+        }
+        qemu_co_mutex_unlock(&s->compressed_write_lock);
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    ssize_t out_len;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
+    uint64_t cluster_offset, l2_entry;
+    int ret;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -1798,71 +2113,78 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
             memset(pad_buf, 0, s->cluster_size);
             memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
             qemu_vfree(pad_buf);
         }
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -2) {
         ret = -EINVAL;
         goto fail;
+    } else if (out_len == -1) {
+        /* could not compress: write normal cluster */
+        iov = (struct iovec) {
+            .iov_base   = (uint8_t *)buf,
+            .iov_len    = s->cluster_size,
+        };
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(bs, sector_num, s->cluster_sectors, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+        goto success;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    /* Only the allocation needs s->lock, the data is written without it and
+     * the L2 entry is set once it is on disk */
+    qemu_co_mutex_lock(&s->lock);
+    l2_entry = qcow2_alloc_compressed_cluster_offset(bs, sector_num << 9,
+                                                     out_len);
+    if (!l2_entry) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    cluster_offset = l2_entry & s->cluster_offset_mask;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = qcow2_co_write_compressed_data(bs, cluster_offset, out_buf,
+                                         out_len);
+    if (ret < 0) {
+        goto fail_free;
+    }
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_link_compressed_cluster(bs, sector_num << 9, l2_entry);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        ret = -EIO;
+        goto fail;
     }
 
+success:
     ret = 0;
 fail:
     g_free(out_buf);
     return ret;
+
+fail_free:
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_free_any_clusters(bs, l2_entry, 1, QCOW2_DISCARD_NEVER);
+    qemu_co_mutex_unlock(&s->lock);
+    goto fail;
 }
 
 static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
@@ -1889,11 +2211,19 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     return 0;
 }
 
+static bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return s->qcow_version >= 3 && !bs->read_only;
+}
+
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    bdi->unallocated_blocks_are_zero = true;
     return 0;
 }
 
@@ -1918,12 +2248,44 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .lazy_refcounts     = s->compatible_features &
                                   QCOW2_COMPAT_LAZY_REFCOUNTS,
             .has_lazy_refcounts = true,
+            .extended_l2        = s->extended_l2,
+            .has_extended_l2    = s->extended_l2,
         };
     }
 
     return spec_info;
 }
 
+static BlockCacheStatsList *qcow2_cache_stats_entry(Qcow2Cache *c,
+                                                    const char *name,
+                                                    BlockCacheStatsList *next)
+{
+    BlockCacheStatsList *entry = g_new0(BlockCacheStatsList, 1);
+    BlockCacheStats *stats = g_new0(BlockCacheStats, 1);
+    uint64_t hits, misses;
+    int size;
+
+    qcow2_cache_get_stats(c, &size, &hits, &misses);
+    *stats = (BlockCacheStats){
+        .name   = g_strdup(name),
+        .size   = size,
+        .hits   = hits,
+        .misses = misses,
+    };
+    entry->value = stats;
+    entry->next = next;
+    return entry;
+}
+
+static BlockCacheStatsList *qcow2_get_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockCacheStatsList *list;
+
+    list = qcow2_cache_stats_entry(s->refcount_block_cache, "refcount", NULL);
+    return qcow2_cache_stats_entry(s->l2_table_cache, "l2", list);
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2024,6 +2386,12 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version)
         }
     }
 
+    if (s->incompatible_features & QCOW2_INCOMPAT_EXTL2) {
+        error_report("qcow2_downgrade: Images with extended L2 entries "
+                     "cannot be downgraded.");
+        return -ENOTSUP;
+    }
+
     /* with QCOW2_INCOMPAT_CORRUPT, it is pretty much impossible to get here in
      * the first place; if that happens nonetheless, returning -ENOTSUP is the
      * best thing to do anyway */
@@ -2107,6 +2475,12 @@ static int qcow2_amend_options(BlockDriverState *bs,
             }
         } else if (!strcmp(options[i].name, "lazy_refcounts")) {
             lazy_refcounts = options[i].value.n;
+        } else if (!strcmp(options[i].name, "extended_l2")) {
+            if (options[i].value.n != s->extended_l2) {
+                fprintf(stderr, "Changing the L2 entry format is not "
+                        "supported.\n");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2222,6 +2596,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_EXTL2,
+        .type = OPT_FLAG,
+        .help = "Use extended L2 entries with subcluster allocation",
+    },
     { NULL }
 };
 
@@ -2234,6 +2613,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
     .bdrv_create        = qcow2_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
+    .bdrv_can_store_dirty_bitmaps = qcow2_can_store_dirty_bitmaps,
     .bdrv_co_get_block_status = qcow2_co_get_block_status,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
@@ -2245,7 +2625,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -2254,6 +2634,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_cache_stats   = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
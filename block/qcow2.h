@@ -53,16 +53,31 @@
 
 #define L2_CACHE_SIZE 16
 
+/* Must be at least 2 to cover COW */
+#define MIN_L2_CACHE_SIZE 2
+
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Decompressed clusters */
+#define COMPRESSED_CACHE_SIZE 16
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* With extended L2 entries every cluster is split into this many subclusters,
+ * each of which has an "allocated" and a "reads as zero" bit */
+#define QCOW_EXTL2_SUBCLUSTERS 32
+#define QCOW_EXTL2_MIN_CLUSTER_BITS 14
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
+#define QCOW2_OPT_ALLOC_RESERVE "alloc-reserve"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
 #define QCOW2_OPT_OVERLAP "overlap-check"
 #define QCOW2_OPT_OVERLAP_MAIN_HEADER "overlap-check.main-header"
 #define QCOW2_OPT_OVERLAP_ACTIVE_L1 "overlap-check.active-l1"
@@ -109,6 +124,18 @@ typedef struct QCowSnapshot {
     uint64_t vm_clock_nsec;
 } QCowSnapshot;
 
+typedef struct QCowDirtyBitmap {
+    char *name;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t nb_sectors;
+    uint32_t granularity_bits;
+    uint32_t flags;
+} QCowDirtyBitmap;
+
+/* Dirty bitmap flags */
+#define QCOW2_BITMAP_IN_USE     1
+
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
@@ -129,11 +156,14 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -144,6 +174,15 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -166,6 +205,14 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+typedef struct Qcow2CompressedCluster {
+    uint64_t offset;        /* of the compressed data, -1 if unused */
+    uint8_t *data;
+    uint64_t lru_counter;
+    bool filling;           /* being read and decompressed */
+    CoQueue waiters;        /* for filling to become false */
+} Qcow2CompressedCluster;
+
 typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
@@ -173,6 +220,8 @@ typedef struct BDRVQcowState {
     int l2_bits;
     int l2_size;
     int l1_size;
+    bool extended_l2;
+    int subcluster_sectors;
     int l1_vm_state_index;
     int csize_shift;
     int csize_mask;
@@ -183,9 +232,13 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2CompressedCluster *compressed_cache;
+    int compressed_cache_size;
+    uint64_t compressed_lru_counter;
+
+    /* Compressed clusters share host sectors with their neighbours, so the
+     * read-modify-write of the partial sectors is serialised */
+    CoMutex compressed_write_lock;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -194,6 +247,14 @@ typedef struct BDRVQcowState {
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* Allocating writes take data clusters from an extent whose refcounts
+     * were set in one go.  reserve_size is the number of clusters grabbed at
+     * a time, 0 disables the reservation.
+     */
+    unsigned int reserve_size;
+    uint64_t reserve_offset;
+    unsigned int reserve_nb_clusters;
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -205,6 +266,11 @@ typedef struct BDRVQcowState {
     int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+    int nb_bitmaps;
+    QCowDirtyBitmap *bitmaps;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -270,6 +336,18 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
+    /**
+     * With extended L2 entries, the subclusters that are valid in the new
+     * cluster once the request (including COW) has completed.
+     */
+    uint32_t ext_alloc_bits;
+
+    /**
+     * With extended L2 entries, true if the request writes into an existing
+     * cluster, so that the L2 bitmap must be updated but no cluster freed.
+     */
+    bool ext_in_place;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -383,6 +461,52 @@ static inline int64_t qcow2_vm_state_offset(BDRVQcowState *s)
     return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
 }
 
+/*
+ * L2 entries are 64 bits, or 128 bits with extended L2 entries where the
+ * second half is the subcluster bitmap: bits 0-31 mark allocated
+ * subclusters, bits 32-63 subclusters that read as zeros.
+ */
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[idx << s->extended_l2]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[idx << s->extended_l2] = cpu_to_be64(entry);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    assert(s->extended_l2);
+    return be64_to_cpu(l2_table[(idx << 1) + 1]);
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(s->extended_l2);
+    l2_table[(idx << 1) + 1] = cpu_to_be64(bitmap);
+}
+
+#define QCOW_EXTL2_ALL_ALLOC 0xffffffffULL
+#define QCOW_EXTL2_ALL_ZERO  (QCOW_EXTL2_ALL_ALLOC << 32)
+
+/* Bits for the subclusters covering [start, end) bytes into a cluster */
+static inline uint32_t qcow2_subcluster_bits(BDRVQcowState *s,
+                                             int64_t start, int64_t end)
+{
+    int sc_shift = s->cluster_bits - 5;
+    int first = start >> sc_shift;
+    int last = (end - 1) >> sc_shift;
+    uint64_t bits = (2ULL << last) - (1ULL << first);
+
+    return bits;
+}
+
 static inline int qcow2_get_cluster_type(uint64_t l2_entry)
 {
     if (l2_entry & QCOW_OFLAG_COMPRESSED) {
@@ -396,6 +520,23 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type of subcluster sc described by an extended L2 entry.  The
+ * descriptor must not be that of a compressed cluster.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc)
+{
+    if (l2_bitmap & (1ULL << (32 + sc))) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if (l2_bitmap & (1ULL << sc)) {
+        /* Allocated subclusters need a host cluster */
+        return (l2_entry & L2E_OFFSET_MASK) ? QCOW2_CLUSTER_NORMAL : -EIO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -435,6 +576,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t *host_offset,
+                                  unsigned int *nb_clusters);
+void qcow2_release_reservation(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -459,7 +603,14 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t l2_entry,
+                                          int index_in_cluster, int nb_sectors,
+                                          QEMUIOVector *qiov);
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t length);
+void qcow2_compressed_cache_create(BlockDriverState *bs, int num_clusters);
+void qcow2_compressed_cache_destroy(BlockDriverState *bs);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -467,11 +618,15 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
+int qcow2_get_cluster_offset_cached(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int n_start, int n_end, int *num, uint64_t *host_offset, QCowL2Meta **m);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
+int qcow2_link_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t l2_entry);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
@@ -493,6 +648,12 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmaps(BlockDriverState *bs);
+void qcow2_free_bitmaps(BlockDriverState *bs);
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -510,5 +671,8 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+int qcow2_cache_peek(Qcow2Cache *c, uint64_t offset, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, int *size, uint64_t *hits,
+                           uint64_t *misses);
 
 #endif
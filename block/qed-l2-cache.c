@@ -53,16 +53,18 @@
 #include "trace.h"
 #include "qed.h"
 
-/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
-
 /**
  * Initialize the L2 cache
+ *
+ * @max_entries:    Number of tables to keep cached
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
     QTAILQ_INIT(&l2_cache->entries);
     l2_cache->n_entries = 0;
+    l2_cache->max_entries = max_entries;
+    l2_cache->hits = 0;
+    l2_cache->misses = 0;
 }
 
 /**
@@ -164,7 +166,7 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
     /* Evict an unused cache entry so we have space.  If all entries are in use
      * we can grow the cache temporarily and we try to shrink back down later.
      */
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
         CachedL2Table *next;
         QTAILQ_FOREACH_SAFE(entry, &l2_cache->entries, node, next) {
             if (entry->ref > 1) {
@@ -176,7 +178,7 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
             qed_unref_l2_cache_entry(entry);
 
             /* Stop evicting when we've shrunk back to max size */
-            if (l2_cache->n_entries < MAX_L2_CACHE_SIZE) {
+            if (l2_cache->n_entries < l2_cache->max_entries) {
                 break;
             }
         }
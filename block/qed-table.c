@@ -179,12 +179,69 @@ int qed_read_l1_table_sync(BDRVQEDState *s)
     return ret;
 }
 
-void qed_write_l1_table(BDRVQEDState *s, unsigned int index, unsigned int n,
-                        BlockDriverCompletionFunc *cb, void *opaque)
+static void qed_write_l1_table_cb(void *opaque, int ret);
+
+static void qed_write_l1_pending(BDRVQEDState *s)
 {
+    unsigned int index = s->l1_pending_start;
+    unsigned int n = s->l1_pending_end - index;
+
+    QSIMPLEQ_CONCAT(&s->l1_updates_in_flight, &s->l1_updates_pending);
+
     BLKDBG_EVENT(s->bs->file, BLKDBG_L1_UPDATE);
     qed_write_table(s, s->header.l1_table_offset,
-                    s->l1_table, index, n, false, cb, opaque);
+                    s->l1_table, index, n, false, qed_write_l1_table_cb, s);
+}
+
+static void qed_write_l1_table_cb(void *opaque, int ret)
+{
+    BDRVQEDState *s = opaque;
+    QSIMPLEQ_HEAD(, QEDL1Update) done;
+    QEDL1Update *update;
+
+    QSIMPLEQ_INIT(&done);
+    QSIMPLEQ_CONCAT(&done, &s->l1_updates_in_flight);
+
+    /* Everything that came in meanwhile goes out in one write */
+    if (!QSIMPLEQ_EMPTY(&s->l1_updates_pending)) {
+        qed_write_l1_pending(s);
+    }
+
+    while ((update = QSIMPLEQ_FIRST(&done)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&done, next);
+        update->cb(update->opaque, ret);
+        g_free(update);
+    }
+}
+
+/**
+ * Write out an updated part of the L1 table
+ *
+ * Allocating writes to different L2 tables can update L1 entries in the same
+ * sector at the same time.  These writes must not overtake each other, so
+ * only one L1 write is in flight and the updates that arrive while it runs
+ * are batched into the next one.
+ */
+void qed_write_l1_table(BDRVQEDState *s, unsigned int index, unsigned int n,
+                        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    QEDL1Update *update = g_new(QEDL1Update, 1);
+
+    update->cb = cb;
+    update->opaque = opaque;
+
+    if (QSIMPLEQ_EMPTY(&s->l1_updates_pending)) {
+        s->l1_pending_start = index;
+        s->l1_pending_end = index + n;
+    } else {
+        s->l1_pending_start = MIN(s->l1_pending_start, index);
+        s->l1_pending_end = MAX(s->l1_pending_end, index + n);
+    }
+    QSIMPLEQ_INSERT_TAIL(&s->l1_updates_pending, update, next);
+
+    if (QSIMPLEQ_EMPTY(&s->l1_updates_in_flight)) {
+        qed_write_l1_pending(s);
+    }
 }
 
 int qed_write_l1_table_sync(BDRVQEDState *s, unsigned int index,
@@ -244,9 +301,11 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
     /* Check for cached L2 entry */
     request->l2_table = qed_find_l2_cache_entry(&s->l2_cache, offset);
     if (request->l2_table) {
+        s->l2_cache.hits++;
         cb(opaque, 0);
         return;
     }
+    s->l2_cache.misses++;
 
     request->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
     request->l2_table->table = qed_alloc_table(s);
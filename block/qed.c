@@ -16,6 +16,7 @@
 #include "trace.h"
 #include "qed.h"
 #include "qapi/qmp/qerror.h"
+#include "qapi/qmp/qint.h"
 #include "migration/migration.h"
 
 static void qed_aio_cancel(BlockDriverAIOCB *blockacb)
@@ -284,6 +285,83 @@ static CachedL2Table *qed_new_l2_table(BDRVQEDState *s)
 }
 
 static void qed_aio_next_io(void *opaque, int ret);
+static void qed_start_need_check_timer(BDRVQEDState *s);
+
+static bool qed_allocating_write_reqs_empty(BDRVQEDState *s)
+{
+    return QSIMPLEQ_EMPTY(&s->allocating_write_reqs) &&
+           QLIST_EMPTY(&s->allocating_write_reqs_in_flight);
+}
+
+/**
+ * Check if an allocating write is in flight in an L2 table
+ */
+static bool qed_is_allocating(BDRVQEDState *s, unsigned int l1_index)
+{
+    QEDAIOCB *acb;
+
+    QLIST_FOREACH(acb, &s->allocating_write_reqs_in_flight, alloc_next) {
+        if (acb->alloc_l1_index == l1_index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void qed_start_allocating_write(BDRVQEDState *s, QEDAIOCB *acb,
+                                       unsigned int l1_index)
+{
+    acb->allocating = true;
+    acb->alloc_l1_index = l1_index;
+    QLIST_INSERT_HEAD(&s->allocating_write_reqs_in_flight, acb, alloc_next);
+}
+
+/**
+ * Restart waiting allocating writes whose L2 table has become free
+ *
+ * Requests are let go in queue order, one per L2 table.  They are restarted
+ * only after walking the queue because a restarted request may finish its
+ * allocation right away and call back into this function.
+ */
+static void qed_wake_allocating_write_reqs(BDRVQEDState *s)
+{
+    QSIMPLEQ_HEAD(, QEDAIOCB) ready;
+    QEDAIOCB *acb, *next_acb;
+
+    if (s->allocating_write_reqs_plugged) {
+        return;
+    }
+
+    QSIMPLEQ_INIT(&ready);
+    QSIMPLEQ_FOREACH_SAFE(acb, &s->allocating_write_reqs, next, next_acb) {
+        if (!qed_is_allocating(s, acb->alloc_l1_index)) {
+            QSIMPLEQ_REMOVE(&s->allocating_write_reqs, acb, QEDAIOCB, next);
+            qed_start_allocating_write(s, acb, acb->alloc_l1_index);
+            QSIMPLEQ_INSERT_TAIL(&ready, acb, next);
+        }
+    }
+
+    while ((acb = QSIMPLEQ_FIRST(&ready)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&ready, next);
+        qed_aio_next_io(acb, 0);
+    }
+
+    if (qed_allocating_write_reqs_empty(s) &&
+        (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
+
+static void qed_finish_allocating_write(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    if (!acb->allocating) {
+        return;
+    }
+
+    QLIST_REMOVE(acb, alloc_next);
+    acb->allocating = false;
+    qed_wake_allocating_write_reqs(s);
+}
 
 static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 {
@@ -294,16 +372,10 @@ static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 
 static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
 {
-    QEDAIOCB *acb;
-
     assert(s->allocating_write_reqs_plugged);
 
     s->allocating_write_reqs_plugged = false;
-
-    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-    if (acb) {
-        qed_aio_next_io(acb, 0);
-    }
+    qed_wake_allocating_write_reqs(s);
 }
 
 static void qed_finish_clear_need_check(void *opaque, int ret)
@@ -339,7 +411,7 @@ static void qed_need_check_timer_cb(void *opaque)
     BDRVQEDState *s = opaque;
 
     /* The timer should only fire when allocating writes have drained */
-    assert(!QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+    assert(qed_allocating_write_reqs_empty(s));
 
     trace_qed_need_check_timer_cb(s);
 
@@ -373,16 +445,35 @@ static void bdrv_qed_rebind(BlockDriverState *bs)
     s->bs = bs;
 }
 
+static QemuOptsList qed_runtime_opts = {
+    .name = "qed",
+    .head = QTAILQ_HEAD_INITIALIZER(qed_runtime_opts.head),
+    .desc = {
+        {
+            .name = QED_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int bdrv_qed_open(BlockDriverState *bs, QDict *options, int flags,
                          Error **errp)
 {
     BDRVQEDState *s = bs->opaque;
     QEDHeader le_header;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t table_bytes, l2_cache_size;
     int64_t file_size;
     int ret;
 
     s->bs = bs;
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QLIST_INIT(&s->allocating_write_reqs_in_flight);
+    QSIMPLEQ_INIT(&s->l1_updates_in_flight);
+    QSIMPLEQ_INIT(&s->l1_updates_pending);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -469,8 +560,28 @@ static int bdrv_qed_open(BlockDriverState *bs, QDict *options, int flags,
         bdrv_flush(bs->file);
     }
 
+    opts = qemu_opts_create_nofail(&qed_runtime_opts);
+    if (options) {
+        qemu_opts_absorb_qdict(opts, options, &local_err);
+        if (error_is_set(&local_err)) {
+            error_propagate(errp, local_err);
+            qemu_opts_del(opts);
+            return -EINVAL;
+        }
+    }
+
+    table_bytes = (uint64_t)s->header.cluster_size * s->header.table_size;
+    l2_cache_size = qemu_opt_get_size(opts, QED_OPT_L2_CACHE_SIZE,
+                                      QED_DEFAULT_L2_CACHE_SIZE * table_bytes)
+                    / table_bytes;
+    qemu_opts_del(opts);
+    if (l2_cache_size > INT_MAX) {
+        error_setg(errp, "QED L2 cache size is too large");
+        return -EINVAL;
+    }
+
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, MAX(l2_cache_size, 1));
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -914,21 +1025,12 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
     acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
-     * requests multiple times but rather finish one at a time completely.
+    /* Start allocating writes waiting for the L2 table of this one.  Note
+     * that a request keeps its L2 table until it is finished or moves on to
+     * another L2 table, even if the rest of it needs no allocation.  This
+     * ensures that we don't cycle through requests multiple times.
      */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
-    }
+    qed_finish_allocating_write(s, acb);
 }
 
 /**
@@ -1132,6 +1234,25 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
     qed_aio_write_l2_update(acb, 0, 1);
 }
 
+/**
+ * Continue an allocating write once the need check flag is on disk
+ */
+static void qed_aio_write_need_check_cb(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+    BDRVQEDState *s = acb_to_s(acb);
+
+    qed_unplug_allocating_write_reqs(s);
+
+    if (ret) {
+        qed_aio_complete(acb, ret);
+    } else if (acb->flags & QED_AIOCB_ZERO) {
+        qed_aio_write_zero_cluster(acb, 0);
+    } else {
+        qed_aio_write_prefill(acb, 0);
+    }
+}
+
 /**
  * Write new data cluster
  *
@@ -1143,20 +1264,32 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
 static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
 {
     BDRVQEDState *s = acb_to_s(acb);
+    unsigned int l1_index = qed_l1_index(s, acb->cur_pos);
     BlockDriverCompletionFunc *cb;
 
+    /* Give up the previous L2 table when moving on to the next one */
+    if (acb->allocating && acb->alloc_l1_index != l1_index) {
+        qed_finish_allocating_write(s, acb);
+    }
+
     /* Cancel timer when the first allocating request comes in */
-    if (QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
+    if (qed_allocating_write_reqs_empty(s)) {
         qed_cancel_need_check_timer(s);
     }
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
-    }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs) ||
-        s->allocating_write_reqs_plugged) {
-        return; /* wait for existing request to finish */
+    /* Freeze this request if another allocating write is in progress in the
+     * same L2 table.  It is restarted from the cluster lookup, because the
+     * table may have changed by then.
+     */
+    if (!acb->allocating) {
+        if (s->allocating_write_reqs_plugged ||
+            qed_is_allocating(s, l1_index)) {
+            trace_qed_aio_write_alloc_wait(s, acb, l1_index);
+            acb->alloc_l1_index = l1_index;
+            QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+            return; /* wait for existing request to finish */
+        }
+        qed_start_allocating_write(s, acb, l1_index);
     }
 
     acb->cur_nclusters = qed_bytes_to_clusters(s,
@@ -1177,8 +1310,10 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     }
 
     if (qed_should_set_need_check(s)) {
+        /* Other allocating writes wait until the flag is on disk */
         s->header.features |= QED_F_NEED_CHECK;
-        qed_write_header(s, cb, acb);
+        qed_plug_allocating_write_reqs(s);
+        qed_write_header(s, qed_aio_write_need_check_cb, acb);
     } else {
         cb(acb, 0);
     }
@@ -1352,6 +1487,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->request.l2_table = NULL;
+    acb->allocating = false;
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -1552,10 +1688,35 @@ static int bdrv_qed_change_backing_file(BlockDriverState *bs,
 static void bdrv_qed_invalidate_cache(BlockDriverState *bs)
 {
     BDRVQEDState *s = bs->opaque;
+    QDict *options;
+
+    options = qdict_new();
+    qdict_put(options, QED_OPT_L2_CACHE_SIZE,
+              qint_from_int((uint64_t)s->l2_cache.max_entries *
+                            s->header.cluster_size * s->header.table_size));
 
     bdrv_qed_close(bs);
     memset(s, 0, sizeof(BDRVQEDState));
-    bdrv_qed_open(bs, NULL, bs->open_flags, NULL);
+    bdrv_qed_open(bs, options, bs->open_flags, NULL);
+
+    QDECREF(options);
+}
+
+static BlockCacheStatsList *
+bdrv_qed_get_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQEDState *s = bs->opaque;
+    BlockCacheStatsList *list = g_new0(BlockCacheStatsList, 1);
+    BlockCacheStats *stats = g_new0(BlockCacheStats, 1);
+
+    *stats = (BlockCacheStats){
+        .name   = g_strdup("l2"),
+        .size   = s->l2_cache.max_entries,
+        .hits   = s->l2_cache.hits,
+        .misses = s->l2_cache.misses,
+    };
+    list->value = stats;
+    return list;
 }
 
 static int bdrv_qed_check(BlockDriverState *bs, BdrvCheckResult *result,
@@ -1614,6 +1775,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_get_info            = bdrv_qed_get_info,
     .bdrv_change_backing_file = bdrv_qed_change_backing_file,
     .bdrv_invalidate_cache    = bdrv_qed_invalidate_cache,
+    .bdrv_get_cache_stats     = bdrv_qed_get_cache_stats,
     .bdrv_check               = bdrv_qed_check,
 };
 
@@ -81,8 +81,15 @@ enum {
 
     /* Delay to flush and clean image after last allocating write completes */
     QED_NEED_CHECK_TIMEOUT = 5,    /* in seconds */
+
+    /* Each L2 holds 2GB with the default cluster and table sizes, so this
+     * lets us fully cache a 100GB disk.
+     */
+    QED_DEFAULT_L2_CACHE_SIZE = 50,    /* in tables */
 };
 
+#define QED_OPT_L2_CACHE_SIZE "l2-cache-size"
+
 typedef struct {
     uint32_t magic;                 /* QED\0 */
 
@@ -117,6 +124,9 @@ typedef struct CachedL2Table {
 typedef struct {
     QTAILQ_HEAD(, CachedL2Table) entries;
     unsigned int n_entries;
+    unsigned int max_entries;
+    uint64_t hits;      /* lookups served from the cache */
+    uint64_t misses;    /* lookups that read the table from the image */
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -133,6 +143,9 @@ typedef struct QEDAIOCB {
     QEMUBH *bh;
     int bh_ret;                     /* final return status for completion bh */
     QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next request */
+    QLIST_ENTRY(QEDAIOCB) alloc_next; /* allocating writes in flight */
+    bool allocating;                /* allocating in alloc_l1_index? */
+    unsigned int alloc_l1_index;    /* L2 table being allocated in */
     int flags;                      /* QED_AIOCB_* bits ORed together */
     bool *finished;                 /* signal for cancel completion */
     uint64_t end_pos;               /* request end on block device, in bytes */
@@ -151,6 +164,13 @@ typedef struct QEDAIOCB {
     QEDRequest request;
 } QEDAIOCB;
 
+/* A caller waiting for an L1 table write */
+typedef struct QEDL1Update {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    QSIMPLEQ_ENTRY(QEDL1Update) next;
+} QEDL1Update;
+
 typedef struct {
     BlockDriverState *bs;           /* device */
     uint64_t file_size;             /* length of image file, in bytes */
@@ -163,10 +183,19 @@ typedef struct {
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
+    /* Allocating write requests.  Requests that allocate in different L2
+     * tables run concurrently, the others wait in allocating_write_reqs.
+     */
     QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
+    QLIST_HEAD(, QEDAIOCB) allocating_write_reqs_in_flight;
     bool allocating_write_reqs_plugged;
 
+    /* L1 table updates being written and those batched behind them */
+    QSIMPLEQ_HEAD(, QEDL1Update) l1_updates_in_flight;
+    QSIMPLEQ_HEAD(, QEDL1Update) l1_updates_pending;
+    unsigned int l1_pending_start;
+    unsigned int l1_pending_end;
+
     /* Periodic flush and clear need check flag */
     QEMUTimer *need_check_timer;
 } BDRVQEDState;
@@ -218,7 +247,7 @@ int qed_write_header_sync(BDRVQEDState *s);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
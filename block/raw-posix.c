@@ -55,6 +55,7 @@
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
+#include <scsi/sg.h>
 #endif
 #ifdef CONFIG_FIEMAP
 #include <linux/fiemap.h>
@@ -133,6 +134,9 @@ typedef struct BDRVRawState {
     int64_t fd_error_time;
     int fd_got_error;
     int fd_media_changed;
+    /* asynchronous SG_IO on /dev/sg */
+    bool sg_async;
+    int sg_inflight;
 #endif
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
@@ -231,29 +235,58 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 }
 
 #ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+/*
+ * io_submit() blocks while the filesystem allocates blocks for a write, so
+ * without an explicit aio=native, Linux AIO is only picked for block devices
+ * and for files that are fully allocated.
+ */
+static bool raw_native_aio_is_safe(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        return true;
+    }
+    return S_ISREG(st.st_mode) && st.st_size > 0 &&
+           (int64_t)st.st_blocks * 512 >= st.st_size;
+}
+
+static int raw_set_aio(void **aio_ctx, int *use_aio, int fd, int bdrv_flags)
 {
     int ret = -1;
+    bool native;
+
     assert(aio_ctx != NULL);
     assert(use_aio != NULL);
     /*
      * Currently Linux do AIO only for files opened with O_DIRECT
      * specified so check NOCACHE flag too
      */
-    if ((bdrv_flags & (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) ==
-                      (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) {
+    if (!(bdrv_flags & BDRV_O_NOCACHE) || (bdrv_flags & BDRV_O_THREAD_AIO)) {
+        native = false;
+    } else if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        native = true;
+    } else {
+        native = raw_native_aio_is_safe(fd);
+    }
 
+    if (native) {
         /* if non-NULL, laio_init() has already been run */
         if (*aio_ctx == NULL) {
             *aio_ctx = laio_init();
             if (!*aio_ctx) {
-                goto error;
+                if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+                    goto error;
+                }
+                /* not asked for explicitly, use the thread pool instead */
+                native = false;
             }
         }
-        *use_aio = 1;
-    } else {
-        *use_aio = 0;
     }
+    *use_aio = native;
 
     ret = 0;
 
@@ -262,6 +295,75 @@ error:
 }
 #endif
 
+/*
+ * Find out the request and memory alignment that O_DIRECT needs for this
+ * file, so that the block layer pads and bounces only when it must.
+ */
+static void raw_probe_alignment(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    unsigned int sector_size;
+    size_t align;
+    char *buf;
+
+    /* For /dev/sg devices the alignment is not really used.
+     * With buffered I/O, we don't have any restrictions. */
+    if (bs->sg || !(s->open_flags & O_DIRECT)) {
+        bs->request_alignment = 512;
+        bs->mem_alignment = 512;
+        return;
+    }
+
+    /* Try a few ioctls to get the right size */
+    bs->request_alignment = 0;
+    bs->mem_alignment = 0;
+
+#ifdef BLKSSZGET
+    if (ioctl(s->fd, BLKSSZGET, &sector_size) >= 0) {
+        bs->request_alignment = sector_size;
+    }
+#endif
+#ifdef DKIOCGETBLOCKSIZE
+    if (ioctl(s->fd, DKIOCGETBLOCKSIZE, &sector_size) >= 0) {
+        bs->request_alignment = sector_size;
+    }
+#endif
+#ifdef CONFIG_XFS
+    if (s->is_xfs) {
+        struct dioattr da;
+        if (xfsctl(NULL, s->fd, XFS_IOC_DIOINFO, &da) >= 0) {
+            bs->request_alignment = da.d_miniosz;
+            /* The kernel returns wrong information for d_mem */
+        }
+    }
+#endif
+
+    /* If we could not get the sizes so far, we can only guess them */
+    buf = qemu_memalign(MAX_BLOCKSIZE, 2 * MAX_BLOCKSIZE);
+    for (align = 512; align <= MAX_BLOCKSIZE; align <<= 1) {
+        if (pread(s->fd, buf + align, MAX_BLOCKSIZE, 0) >= 0) {
+            bs->mem_alignment = align;
+            break;
+        }
+    }
+    if (!bs->request_alignment) {
+        for (align = 512; align <= MAX_BLOCKSIZE; align <<= 1) {
+            if (pread(s->fd, buf, align, 0) >= 0) {
+                bs->request_alignment = align;
+                break;
+            }
+        }
+    }
+    qemu_vfree(buf);
+
+    if (bs->request_alignment < 512) {
+        bs->request_alignment = 512;
+    }
+    if (!bs->mem_alignment) {
+        bs->mem_alignment = bs->request_alignment;
+    }
+}
+
 static QemuOptsList raw_runtime_opts = {
     .name = "raw",
     .head = QTAILQ_HEAD_INITIALIZER(raw_runtime_opts.head),
@@ -315,7 +417,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    if (raw_set_aio(&s->aio_ctx, &s->use_aio, fd, bdrv_flags)) {
         qemu_close(fd);
         ret = -errno;
         error_setg_errno(errp, -ret, "Could not set AIO state");
@@ -330,6 +432,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+    raw_probe_alignment(bs);
+
     ret = 0;
 fail:
     qemu_opts_del(opts);
@@ -366,18 +470,6 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     state->opaque = g_malloc0(sizeof(BDRVRawReopenState));
     raw_s = state->opaque;
 
-#ifdef CONFIG_LINUX_AIO
-    raw_s->use_aio = s->use_aio;
-
-    /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
-     * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
-     * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
-        error_setg(errp, "Could not set AIO state");
-        return -1;
-    }
-#endif
-
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
     }
@@ -429,6 +521,21 @@ static int raw_reopen_prepare(BDRVReopenState *state,
             ret = -1;
         }
     }
+
+#ifdef CONFIG_LINUX_AIO
+    raw_s->use_aio = s->use_aio;
+
+    /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
+     * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
+     * won't override aio_ctx if aio_ctx is non-NULL */
+    if (raw_s->fd >= 0 &&
+        raw_set_aio(&s->aio_ctx, &raw_s->use_aio, raw_s->fd, state->flags)) {
+        error_setg(errp, "Could not set AIO state");
+        qemu_close(raw_s->fd);
+        raw_s->fd = -1;
+        ret = -1;
+    }
+#endif
     return ret;
 }
 
@@ -446,6 +553,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->use_aio = raw_s->use_aio;
 #endif
 
+    /* O_DIRECT may have been switched on or off */
+    raw_probe_alignment(state->bs);
+
     g_free(state->opaque);
     state->opaque = NULL;
 }
@@ -839,6 +949,26 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
                        cb, opaque, type);
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -875,6 +1005,13 @@ static void raw_close(BlockDriverState *bs)
     }
 }
 
+static int raw_get_host_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return s->fd;
+}
+
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVRawState *s = bs->opaque;
@@ -1056,15 +1193,33 @@ static int raw_create(const char *filename, QEMUOptionParameter *options,
     int fd;
     int result = 0;
     int64_t total_size = 0;
+    bool prealloc = false;
 
     /* Read out options */
     while (options && options->name) {
         if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
             total_size = options->value.n / BDRV_SECTOR_SIZE;
+        } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
+            if (!options->value.s || !strcmp(options->value.s, "off")) {
+                prealloc = false;
+            } else if (!strcmp(options->value.s, "falloc")) {
+                prealloc = true;
+            } else {
+                error_setg(errp, "Invalid preallocation mode: '%s'",
+                           options->value.s);
+                return -EINVAL;
+            }
         }
         options++;
     }
 
+#ifndef CONFIG_FALLOCATE
+    if (prealloc) {
+        error_setg(errp, "Preallocation is not supported on this host");
+        return -ENOTSUP;
+    }
+#endif
+
     fd = qemu_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
                    0644);
     if (fd < 0) {
@@ -1075,6 +1230,15 @@ static int raw_create(const char *filename, QEMUOptionParameter *options,
             result = -errno;
             error_setg_errno(errp, -result, "Could not resize file");
         }
+#ifdef CONFIG_FALLOCATE
+        /* Allocate the blocks now, so that native AIO can be used on the
+         * image without blocking in io_submit() */
+        if (result == 0 && prealloc && total_size &&
+            fallocate(fd, 0, 0, total_size * BDRV_SECTOR_SIZE) != 0) {
+            result = -errno;
+            error_setg_errno(errp, -result, "Could not preallocate file");
+        }
+#endif
         if (qemu_close(fd) != 0) {
             result = -errno;
             error_setg_errno(errp, -result, "Could not close the new file");
@@ -1205,6 +1369,11 @@ static QEMUOptionParameter raw_create_options[] = {
         .type = OPT_SIZE,
         .help = "Virtual disk size"
     },
+    {
+        .name = BLOCK_OPT_PREALLOC,
+        .type = OPT_STRING,
+        .help = "Preallocation mode (allowed values: off, falloc)"
+    },
     { NULL }
 };
 
@@ -1226,12 +1395,15 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_aio_discard = raw_aio_discard,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
+    .bdrv_get_host_fd = raw_get_host_fd,
 
     .create_options = raw_create_options,
 };
@@ -1402,6 +1574,16 @@ static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
         return ret;
     }
 
+#if defined(__linux__)
+    if (bs->sg) {
+        int version;
+
+        /* the sg v3 interface has asynchronous write()/read() */
+        s->sg_async = ioctl(s->fd, SG_GET_VERSION_NUM, &version) == 0 &&
+                      version >= 30000;
+    }
+#endif
+
     if (flags & BDRV_O_RDWR) {
         ret = check_hdev_writable(s);
         if (ret < 0) {
@@ -1471,6 +1653,103 @@ static int hdev_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
     return ioctl(s->fd, req, buf);
 }
 
+/*
+ * SG_IO on a /dev/sg node goes through the sg driver's asynchronous
+ * interface: write() queues the command and read() returns it once it
+ * completed, so a command in flight does not occupy a thread pool
+ * worker.  The driver takes only SG_MAX_QUEUE commands per file
+ * descriptor, further ones are still issued from the thread pool.
+ */
+typedef struct RawSgAIOCB {
+    BlockDriverAIOCB common;
+    sg_io_hdr_t *io_hdr;
+    int ret;
+} RawSgAIOCB;
+
+static void hdev_sg_cancel(BlockDriverAIOCB *blockacb)
+{
+    RawSgAIOCB *acb = container_of(blockacb, RawSgAIOCB, common);
+
+    /* There is no way to abort a queued sg command, wait for it */
+    while (acb->ret == -EINPROGRESS) {
+        qemu_aio_wait();
+    }
+}
+
+static const AIOCBInfo hdev_sg_aiocb_info = {
+    .aiocb_size         = sizeof(RawSgAIOCB),
+    .cancel             = hdev_sg_cancel,
+};
+
+static void hdev_sg_read(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVRawState *s = bs->opaque;
+    sg_io_hdr_t io_hdr;
+    RawSgAIOCB *acb;
+    int waiting;
+
+    while (ioctl(s->fd, SG_GET_NUM_WAITING, &waiting) == 0 && waiting > 0) {
+        memset(&io_hdr, 0, sizeof(io_hdr));
+        io_hdr.interface_id = 'S';
+        io_hdr.pack_id = -1;
+        if (read(s->fd, &io_hdr, sizeof(io_hdr)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        acb = io_hdr.usr_ptr;
+        acb->io_hdr->status = io_hdr.status;
+        acb->io_hdr->masked_status = io_hdr.masked_status;
+        acb->io_hdr->msg_status = io_hdr.msg_status;
+        acb->io_hdr->sb_len_wr = io_hdr.sb_len_wr;
+        acb->io_hdr->host_status = io_hdr.host_status;
+        acb->io_hdr->driver_status = io_hdr.driver_status;
+        acb->io_hdr->resid = io_hdr.resid;
+        acb->io_hdr->duration = io_hdr.duration;
+        acb->io_hdr->info = io_hdr.info;
+        acb->ret = 0;
+
+        if (--s->sg_inflight == 0) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs), s->fd,
+                               NULL, NULL, NULL);
+        }
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_release(acb);
+    }
+}
+
+static BlockDriverAIOCB *hdev_sg_submit(BlockDriverState *bs,
+        sg_io_hdr_t *io_hdr, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+    RawSgAIOCB *acb;
+    sg_io_hdr_t hdr = *io_hdr;
+    ssize_t ret;
+
+    acb = qemu_aio_get(&hdev_sg_aiocb_info, bs, cb, opaque);
+    acb->io_hdr = io_hdr;
+    acb->ret = -EINPROGRESS;
+    hdr.usr_ptr = acb;
+
+    do {
+        ret = write(s->fd, &hdr, sizeof(hdr));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        /* EDOM means the sg queue is full */
+        qemu_aio_release(acb);
+        return NULL;
+    }
+
+    if (s->sg_inflight++ == 0) {
+        aio_set_fd_handler(bdrv_get_aio_context(bs), s->fd,
+                           hdev_sg_read, NULL, bs);
+    }
+    return &acb->common;
+}
+
 static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -1482,6 +1761,13 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (req == SG_IO && s->sg_async) {
+        BlockDriverAIOCB *sg_acb = hdev_sg_submit(bs, buf, cb, opaque);
+        if (sg_acb) {
+            return sg_acb;
+        }
+    }
+
     acb = g_slice_new(RawPosixAIOData);
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
@@ -1581,12 +1867,15 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
     .bdrv_aio_discard   = hdev_aio_discard,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
+    .bdrv_get_host_fd   = raw_get_host_fd,
 
     /* generic scsi device */
 #ifdef __linux__
@@ -1712,6 +2001,8 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -1822,6 +2113,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -1951,6 +2244,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_aio_plug,
+    .bdrv_io_unplug	= raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -16,6 +16,7 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 
 #include <rbd/librbd.h>
 
@@ -42,6 +43,10 @@
  *
  * Configuration values containing :, @, or = can be escaped with a
  * leading "\".
+ *
+ * The librbd cache can also be tuned with the cache-size, cache-max-dirty,
+ * cache-target-dirty and cache-max-dirty-age block options, which override
+ * the rbd_cache_* Ceph options.
  */
 
 /* rbd_aio_discard added in 0.1.2 */
@@ -51,6 +56,11 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* rbd_get_stripe_unit and rbd_get_stripe_count added in 0.1.5 */
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 5)
+#define LIBRBD_SUPPORTS_STRIPING
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -79,6 +89,7 @@ typedef struct RBDAIOCB {
     struct BDRVRBDState *s;
     int cancelled;
     int status;
+    int pending;                /* RADOSCBs not completed yet */
 } RBDAIOCB;
 
 typedef struct RADOSCB {
@@ -103,6 +114,16 @@ typedef struct BDRVRBDState {
     char *snap;
     int event_reader_pos;
     RADOSCB *event_rcb;
+
+    /* requests are split at multiples of this, see rbd_start_aio() */
+    uint64_t obj_size;
+    uint64_t stripe_unit;
+    uint64_t stripe_count;
+    uint64_t split_size;
+
+    uint64_t nr_requests;
+    uint64_t nr_split_requests;
+    uint64_t nr_rados_requests;
 } BDRVRBDState;
 
 static void rbd_aio_bh_cb(void *opaque);
@@ -370,8 +391,8 @@ static int qemu_rbd_create(const char *filename, QEMUOptionParameter *options,
 
 /*
  * This aio completion is being called from qemu_rbd_aio_event_reader()
- * and runs in qemu context. It schedules a bh, but just in case the aio
- * was not cancelled before.
+ * and runs in qemu context. Once all parts of the request are done, it
+ * schedules a bh, but just in case the aio was not cancelled before.
  */
 static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
@@ -401,10 +422,15 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
             acb->ret = r;
         }
     }
+    g_free(rcb);
+
+    if (--acb->pending > 0) {
+        return;
+    }
+
     /* Note that acb->bh can be NULL in case where the aio was cancelled */
     acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
     qemu_bh_schedule(acb->bh);
-    g_free(rcb);
 }
 
 /*
@@ -443,10 +469,71 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Specification of the rbd image",
         },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the librbd cache (rbd_cache_size)",
+        },
+        {
+            .name = "cache-max-dirty",
+            .type = QEMU_OPT_SIZE,
+            .help = "Dirty data in the librbd cache at which writes block "
+                    "(rbd_cache_max_dirty)",
+        },
+        {
+            .name = "cache-target-dirty",
+            .type = QEMU_OPT_SIZE,
+            .help = "Dirty data in the librbd cache at which writeback "
+                    "starts (rbd_cache_target_dirty)",
+        },
+        {
+            .name = "cache-max-dirty-age",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Seconds that dirty data stays in the librbd cache "
+                    "(rbd_cache_max_dirty_age)",
+        },
         { /* end of list */ }
     },
 };
 
+static const struct {
+    const char *qemu_name;
+    const char *rados_name;
+    bool is_size;
+} qemu_rbd_cache_opts[] = {
+    { "cache-size",             "rbd_cache_size",           true },
+    { "cache-max-dirty",        "rbd_cache_max_dirty",      true },
+    { "cache-target-dirty",     "rbd_cache_target_dirty",   true },
+    { "cache-max-dirty-age",    "rbd_cache_max_dirty_age",  false },
+};
+
+/* Pass the cache options that were given on to librbd */
+static int qemu_rbd_set_cache_opts(rados_t cluster, QemuOpts *opts)
+{
+    int i, r;
+
+    for (i = 0; i < ARRAY_SIZE(qemu_rbd_cache_opts); i++) {
+        const char *name = qemu_rbd_cache_opts[i].qemu_name;
+        const char *rados_name = qemu_rbd_cache_opts[i].rados_name;
+        char buf[32];
+
+        if (!qemu_opt_get(opts, name)) {
+            continue;
+        }
+        /* sizes may have a suffix that librbd does not understand */
+        snprintf(buf, sizeof(buf), "%" PRIu64,
+                 qemu_rbd_cache_opts[i].is_size ?
+                 qemu_opt_get_size(opts, name, 0) :
+                 qemu_opt_get_number(opts, name, 0));
+        r = rados_conf_set(cluster, rados_name, buf);
+        if (r < 0) {
+            error_report("error setting %s", rados_name);
+            return r;
+        }
+    }
+    return 0;
+}
+
 static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
                          Error **errp)
 {
@@ -459,6 +546,7 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *filename;
+    rbd_image_info_t info;
     int r;
 
     opts = qemu_opts_create_nofail(&runtime_opts);
@@ -518,6 +606,11 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    r = qemu_rbd_set_cache_opts(s->cluster, opts);
+    if (r < 0) {
+        goto failed_shutdown;
+    }
+
     r = rados_connect(s->cluster);
     if (r < 0) {
         error_report("error connecting");
@@ -538,6 +631,24 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     bs->read_only = (s->snap != NULL);
 
+    r = rbd_stat(s->image, &info, sizeof(info));
+    if (r < 0) {
+        error_report("error reading the size of %s", s->name);
+        goto failed;
+    }
+    s->obj_size = info.obj_size;
+    s->stripe_unit = info.obj_size;
+    s->stripe_count = 1;
+#ifdef LIBRBD_SUPPORTS_STRIPING
+    if (rbd_get_stripe_unit(s->image, &s->stripe_unit) < 0 ||
+        rbd_get_stripe_count(s->image, &s->stripe_count) < 0) {
+        s->stripe_unit = info.obj_size;
+        s->stripe_count = 1;
+    }
+#endif
+    /* With striping, each stripe unit of a range goes to another object */
+    s->split_size = s->stripe_count > 1 ? s->stripe_unit : s->obj_size;
+
     s->event_reader_pos = 0;
     r = qemu_pipe(s->fds);
     if (r < 0) {
@@ -704,7 +815,7 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     RBDAIOCB *acb;
     RADOSCB *rcb;
     rbd_completion_t c;
-    int64_t off, size;
+    int64_t off, size, len;
     char *buf;
     int r;
 
@@ -724,6 +835,7 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->cancelled = 0;
     acb->bh = NULL;
     acb->status = -EINPROGRESS;
+    acb->pending = 0;
 
     if (cmd == RBD_AIO_WRITE) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -734,42 +846,79 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     off = sector_num * BDRV_SECTOR_SIZE;
     size = nb_sectors * BDRV_SECTOR_SIZE;
 
-    rcb = g_malloc(sizeof(RADOSCB));
-    rcb->done = 0;
-    rcb->acb = acb;
-    rcb->buf = buf;
-    rcb->s = acb->s;
-    rcb->size = size;
-    r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb, &c);
-    if (r < 0) {
-        goto failed;
+    if (cmd != RBD_AIO_FLUSH) {
+        s->nr_requests++;
+        if (size > s->split_size - off % s->split_size) {
+            s->nr_split_requests++;
+        }
     }
 
-    switch (cmd) {
-    case RBD_AIO_WRITE:
-        r = rbd_aio_write(s->image, off, size, buf, c);
-        break;
-    case RBD_AIO_READ:
-        r = rbd_aio_read(s->image, off, size, buf, c);
-        break;
-    case RBD_AIO_DISCARD:
-        r = rbd_aio_discard_wrapper(s->image, off, size, c);
-        break;
-    case RBD_AIO_FLUSH:
-        r = rbd_aio_flush_wrapper(s->image, c);
-        break;
-    default:
-        r = -EINVAL;
-    }
+    /*
+     * Split the request at object (or stripe unit) boundaries, so that
+     * the OSDs that hold the objects work on the parts in parallel.  The
+     * parts complete in qemu_rbd_complete_aio(), which only runs in
+     * qemu context, so none of them can complete before all are queued.
+     */
+    do {
+        len = size;
+        if (cmd != RBD_AIO_FLUSH) {
+            len = MIN(size, s->split_size - off % s->split_size);
+        }
 
-    if (r < 0) {
-        goto failed;
-    }
+        rcb = g_malloc(sizeof(RADOSCB));
+        rcb->done = 0;
+        rcb->acb = acb;
+        rcb->buf = buf;
+        rcb->s = acb->s;
+        rcb->size = len;
+        r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb,
+                                      &c);
+        if (r < 0) {
+            goto failed;
+        }
+
+        switch (cmd) {
+        case RBD_AIO_WRITE:
+            r = rbd_aio_write(s->image, off, len, buf, c);
+            break;
+        case RBD_AIO_READ:
+            r = rbd_aio_read(s->image, off, len, buf, c);
+            break;
+        case RBD_AIO_DISCARD:
+            r = rbd_aio_discard_wrapper(s->image, off, len, c);
+            break;
+        case RBD_AIO_FLUSH:
+            r = rbd_aio_flush_wrapper(s->image, c);
+            break;
+        default:
+            r = -EINVAL;
+        }
+
+        if (r < 0) {
+            rbd_aio_release(c);
+            goto failed;
+        }
+
+        acb->pending++;
+        s->nr_rados_requests++;
+        off += len;
+        size -= len;
+        if (buf) {
+            buf += len;
+        }
+    } while (size > 0);
 
     return &acb->common;
 
 failed:
     g_free(rcb);
+    if (acb->pending > 0) {
+        /* the parts already submitted complete the request */
+        acb->ret = r;
+        acb->error = 1;
+        return &acb->common;
+    }
+    qemu_vfree(acb->bounce);
     qemu_aio_release(acb);
     return NULL;
 }
@@ -806,12 +955,22 @@ static BlockDriverAIOCB *qemu_rbd_aio_flush(BlockDriverState *bs,
 
 #else
 
-static int qemu_rbd_co_flush(BlockDriverState *bs)
-{
 #if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 1)
-    /* rbd_flush added in 0.1.1 */
-    BDRVRBDState *s = bs->opaque;
+static int qemu_rbd_flush_pool_func(void *opaque)
+{
+    BDRVRBDState *s = opaque;
+
     return rbd_flush(s->image);
+}
+#endif
+
+static int coroutine_fn qemu_rbd_co_flush(BlockDriverState *bs)
+{
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 1)
+    /* rbd_flush added in 0.1.1; it blocks, so run it in a worker thread */
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+
+    return thread_pool_submit_co(pool, qemu_rbd_flush_pool_func, bs->opaque);
 #else
     return 0;
 #endif
@@ -833,6 +992,29 @@ static int qemu_rbd_getinfo(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static ImageInfoSpecific *qemu_rbd_get_specific_info(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+    ImageInfoSpecific *spec_info = g_new(ImageInfoSpecific, 1);
+
+    *spec_info = (ImageInfoSpecific){
+        .kind  = IMAGE_INFO_SPECIFIC_KIND_RBD,
+        {
+            .rbd = g_new(ImageInfoSpecificRbd, 1),
+        },
+    };
+    *spec_info->rbd = (ImageInfoSpecificRbd){
+        .object_size    = s->obj_size,
+        .stripe_unit    = s->stripe_unit,
+        .stripe_count   = s->stripe_count,
+        .requests       = s->nr_requests,
+        .split_requests = s->nr_split_requests,
+        .rados_requests = s->nr_rados_requests,
+    };
+
+    return spec_info;
+}
+
 static int64_t qemu_rbd_getlength(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
@@ -1009,6 +1191,7 @@ static BlockDriver bdrv_rbd = {
     .bdrv_create        = qemu_rbd_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_get_info      = qemu_rbd_getinfo,
+    .bdrv_get_specific_info = qemu_rbd_get_specific_info,
     .create_options     = qemu_rbd_create_options,
     .bdrv_getlength     = qemu_rbd_getlength,
     .bdrv_truncate      = qemu_rbd_truncate,
@@ -24,6 +24,9 @@
 #define SD_DEFAULT_ADDR "localhost"
 #define SD_DEFAULT_PORT 7000
 
+#define SD_DEFAULT_CONNECTIONS  1
+#define SD_MAX_CONNECTIONS      16
+
 #define SD_OP_CREATE_AND_WRITE_OBJ  0x01
 #define SD_OP_READ_OBJ       0x02
 #define SD_OP_WRITE_OBJ      0x03
@@ -263,9 +266,11 @@ static inline bool is_snapshot(struct SheepdogInode *inode)
 #endif
 
 typedef struct SheepdogAIOCB SheepdogAIOCB;
+typedef struct SheepdogConn SheepdogConn;
 
 typedef struct AIOReq {
     SheepdogAIOCB *aiocb;
+    SheepdogConn *conn;         /* connection the request was sent on */
     unsigned int iov_offset;
 
     uint64_t oid;
@@ -304,6 +309,20 @@ struct SheepdogAIOCB {
     int nr_pending;
 };
 
+/*
+ * A socket for object requests.  Each connection has its own send lock
+ * and response reader, so requests on different connections are in
+ * flight in parallel.
+ */
+struct SheepdogConn {
+    struct BDRVSheepdogState *s;
+    int fd;
+
+    CoMutex lock;
+    Coroutine *co_send;
+    Coroutine *co_recv;
+};
+
 typedef struct BDRVSheepdogState {
     BlockDriverState *bs;
 
@@ -319,11 +338,11 @@ typedef struct BDRVSheepdogState {
 
     char *host_spec;
     bool is_unix;
-    int fd;
 
-    CoMutex lock;
-    Coroutine *co_send;
-    Coroutine *co_recv;
+    /* object requests are spread round-robin over these */
+    SheepdogConn *conns;
+    int nr_conns;
+    int next_conn;
 
     uint32_t aioreq_seq_num;
 
@@ -403,6 +422,7 @@ static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
 
     aio_req = g_malloc(sizeof(*aio_req));
     aio_req->aiocb = acb;
+    aio_req->conn = NULL;
     aio_req->iov_offset = iov_offset;
     aio_req->oid = oid;
     aio_req->base_oid = base_oid;
@@ -664,7 +684,7 @@ static void coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
                            enum AIOCBState aiocb_type);
 static void coroutine_fn resend_aioreq(BDRVSheepdogState *s, AIOReq *aio_req);
 static int reload_inode(BDRVSheepdogState *s, uint32_t snapid, const char *tag);
-static int get_sheep_fd(BDRVSheepdogState *s);
+static int get_sheep_fd(SheepdogConn *conn);
 static void co_write_request(void *opaque);
 
 static AIOReq *find_pending_req(BDRVSheepdogState *s, uint64_t oid)
@@ -701,22 +721,23 @@ static void coroutine_fn send_pending_req(BDRVSheepdogState *s, uint64_t oid)
 
 static coroutine_fn void reconnect_to_sdog(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
     AIOReq *aio_req, *next;
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL);
-    close(s->fd);
-    s->fd = -1;
+    qemu_aio_set_fd_handler(conn->fd, NULL, NULL, NULL);
+    close(conn->fd);
+    conn->fd = -1;
 
     /* Wait for outstanding write requests to be completed. */
-    while (s->co_send != NULL) {
+    while (conn->co_send != NULL) {
         co_write_request(opaque);
     }
 
     /* Try to reconnect the sheepdog server every one second. */
-    while (s->fd < 0) {
-        s->fd = get_sheep_fd(s);
-        if (s->fd < 0) {
+    while (conn->fd < 0) {
+        conn->fd = get_sheep_fd(conn);
+        if (conn->fd < 0) {
             DPRINTF("Wait for connection to be established\n");
             co_aio_sleep_ns(bdrv_get_aio_context(s->bs), QEMU_CLOCK_REALTIME,
                             1000000000ULL);
@@ -728,9 +749,13 @@ static coroutine_fn void reconnect_to_sdog(void *opaque)
      * resend_aioreq() can yield and newly created requests can be added to the
      * inflight queue before the coroutine is resumed.  To avoid mixing them, we
      * have to move all the inflight requests to the failed queue before
-     * resend_aioreq() is called.
+     * resend_aioreq() is called.  Requests sent over the other connections
+     * are not affected and still get their responses.
      */
     QLIST_FOREACH_SAFE(aio_req, &s->inflight_aio_head, aio_siblings, next) {
+        if (aio_req->conn != conn) {
+            continue;
+        }
         QLIST_REMOVE(aio_req, aio_siblings);
         QLIST_INSERT_HEAD(&s->failed_aio_head, aio_req, aio_siblings);
     }
@@ -748,13 +773,14 @@ static coroutine_fn void reconnect_to_sdog(void *opaque)
  * Receive responses of the I/O requests.
  *
  * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * main loop when the socket of a connection is ready for reading responses.
  */
 static void coroutine_fn aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
     AIOReq *aio_req = NULL;
     SheepdogAIOCB *acb;
@@ -784,7 +810,7 @@ static void coroutine_fn aio_read_response(void *opaque)
     case AIOCB_WRITE_UDATA:
         /* this coroutine context is no longer suitable for co_recv
          * because we may send data to update vdi objects */
-        s->co_recv = NULL;
+        conn->co_recv = NULL;
         if (!is_data_obj(aio_req->oid)) {
             break;
         }
@@ -875,29 +901,29 @@ static void coroutine_fn aio_read_response(void *opaque)
         acb->aio_done_func(acb);
     }
 out:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
     return;
 err:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
     reconnect_to_sdog(opaque);
 }
 
 static void co_read_response(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    if (!s->co_recv) {
-        s->co_recv = qemu_coroutine_create(aio_read_response);
+    if (!conn->co_recv) {
+        conn->co_recv = qemu_coroutine_create(aio_read_response);
     }
 
-    qemu_coroutine_enter(s->co_recv, opaque);
+    qemu_coroutine_enter(conn->co_recv, opaque);
 }
 
 static void co_write_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    qemu_coroutine_enter(s->co_send, NULL);
+    qemu_coroutine_enter(conn->co_send, NULL);
 }
 
 /*
@@ -906,19 +932,54 @@ static void co_write_request(void *opaque)
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(SheepdogConn *conn)
 {
     int fd;
 
-    fd = connect_to_sdog(s);
+    fd = connect_to_sdog(conn->s);
     if (fd < 0) {
         return fd;
     }
 
-    qemu_aio_set_fd_handler(fd, co_read_response, NULL, s);
+    qemu_aio_set_fd_handler(fd, co_read_response, NULL, conn);
     return fd;
 }
 
+/*
+ * Pick the connection for the next object request.  Connections that are
+ * being reestablished are skipped unless all of them are down, in which
+ * case the request is resent once the connection is back.
+ */
+static SheepdogConn *sd_next_conn(BDRVSheepdogState *s)
+{
+    SheepdogConn *conn = NULL;
+    int i;
+
+    for (i = 0; i < s->nr_conns; i++) {
+        conn = &s->conns[s->next_conn];
+        s->next_conn = (s->next_conn + 1) % s->nr_conns;
+        if (conn->fd >= 0) {
+            break;
+        }
+    }
+    return conn;
+}
+
+static void sd_close_conns(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_conns; i++) {
+        if (s->conns[i].fd >= 0) {
+            qemu_aio_set_fd_handler(s->conns[i].fd, NULL, NULL, NULL);
+            closesocket(s->conns[i].fd);
+        }
+    }
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nr_conns = 0;
+}
+
 static int sd_parse_uri(BDRVSheepdogState *s, const char *filename,
                         char *vdi, uint32_t *snapid, char *tag)
 {
@@ -1114,6 +1175,7 @@ static void coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 {
     int nr_copies = s->inode.nr_copies;
     SheepdogObjReq hdr;
+    SheepdogConn *conn;
     unsigned int wlen = 0;
     int ret;
     uint64_t oid = aio_req->oid;
@@ -1163,29 +1225,33 @@ static void coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    qemu_co_mutex_lock(&s->lock);
-    s->co_send = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->fd, co_read_response, co_write_request, s);
-    socket_set_cork(s->fd, 1);
+    conn = sd_next_conn(s);
+    aio_req->conn = conn;
+
+    qemu_co_mutex_lock(&conn->lock);
+    conn->co_send = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, co_write_request,
+                            conn);
+    socket_set_cork(conn->fd, 1);
 
     /* send a header */
-    ret = qemu_co_send(s->fd, &hdr, sizeof(hdr));
+    ret = qemu_co_send(conn->fd, &hdr, sizeof(hdr));
     if (ret != sizeof(hdr)) {
         error_report("failed to send a req, %s", strerror(errno));
         goto out;
     }
 
     if (wlen) {
-        ret = qemu_co_sendv(s->fd, iov, niov, aio_req->iov_offset, wlen);
+        ret = qemu_co_sendv(conn->fd, iov, niov, aio_req->iov_offset, wlen);
         if (ret != wlen) {
             error_report("failed to send a data, %s", strerror(errno));
         }
     }
 out:
-    socket_set_cork(s->fd, 0);
-    qemu_aio_set_fd_handler(s->fd, co_read_response, NULL, s);
-    s->co_send = NULL;
-    qemu_co_mutex_unlock(&s->lock);
+    socket_set_cork(conn->fd, 0);
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, NULL, conn);
+    conn->co_send = NULL;
+    qemu_co_mutex_unlock(&conn->lock);
 }
 
 static int read_write_object(int fd, char *buf, uint64_t oid, uint8_t copies,
@@ -1356,6 +1422,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "URL to the sheepdog image",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections for object requests (default 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -1363,7 +1434,8 @@ static QemuOptsList runtime_opts = {
 static int sd_open(BlockDriverState *bs, QDict *options, int flags,
                    Error **errp)
 {
-    int ret, fd;
+    int ret, fd, i;
+    int64_t nr_conns;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1389,7 +1461,23 @@ static int sd_open(BlockDriverState *bs, QDict *options, int flags,
     QLIST_INIT(&s->inflight_aio_head);
     QLIST_INIT(&s->pending_aio_head);
     QLIST_INIT(&s->failed_aio_head);
-    s->fd = -1;
+
+    nr_conns = qemu_opt_get_number(opts, "connections",
+                                   SD_DEFAULT_CONNECTIONS);
+    if (nr_conns < 1 || nr_conns > SD_MAX_CONNECTIONS) {
+        error_report("connections must be between 1 and %d",
+                     SD_MAX_CONNECTIONS);
+        ret = -EINVAL;
+        goto out;
+    }
+    s->nr_conns = nr_conns;
+    s->next_conn = 0;
+    s->conns = g_new0(SheepdogConn, s->nr_conns);
+    for (i = 0; i < s->nr_conns; i++) {
+        s->conns[i].s = s;
+        s->conns[i].fd = -1;
+        qemu_co_mutex_init(&s->conns[i].lock);
+    }
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
@@ -1402,10 +1490,12 @@ static int sd_open(BlockDriverState *bs, QDict *options, int flags,
     if (ret < 0) {
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
-        ret = s->fd;
-        goto out;
+    for (i = 0; i < s->nr_conns; i++) {
+        s->conns[i].fd = get_sheep_fd(&s->conns[i]);
+        if (s->conns[i].fd < 0) {
+            ret = s->conns[i].fd;
+            goto out;
+        }
     }
 
     ret = find_vdi_name(s, vdi, snapid, tag, &vid, true);
@@ -1450,15 +1540,11 @@ static int sd_open(BlockDriverState *bs, QDict *options, int flags,
 
     bs->total_sectors = s->inode.vdi_size / BDRV_SECTOR_SIZE;
     pstrcpy(s->name, sizeof(s->name), vdi);
-    qemu_co_mutex_init(&s->lock);
     qemu_opts_del(opts);
     g_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
-    }
+    sd_close_conns(s);
     qemu_opts_del(opts);
     g_free(buf);
     return ret;
@@ -1693,8 +1779,7 @@ static void sd_close(BlockDriverState *bs)
         error_report("%s, %s", sd_strerror(rsp->result), s->name);
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL);
-    closesocket(s->fd);
+    sd_close_conns(s);
     g_free(s->host_spec);
 }
 
@@ -164,7 +164,12 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         return -ENOMEDIUM;
     }
     if (drv->bdrv_snapshot_goto) {
-        return drv->bdrv_snapshot_goto(bs, snapshot_id);
+        ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        if (ret == 0) {
+            /* The whole disk may have changed behind the bitmaps' back */
+            bdrv_dirty_bitmaps_set_all(bs);
+        }
+        return ret;
     }
 
     if (bs->file) {
@@ -176,6 +181,9 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
             bs->drv = NULL;
             return open_ret;
         }
+        if (ret == 0) {
+            bdrv_dirty_bitmaps_set_all(bs);
+        }
         return ret;
     }
 
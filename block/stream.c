@@ -82,10 +82,10 @@ static void coroutine_fn stream_run(void *opaque)
     StreamBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
-    int64_t sector_num, end;
+    int64_t sector_num, end, status;
     int error = 0;
     int ret = 0;
-    int n = 0;
+    int n = 0, pnum;
     void *buf;
 
     s->common.len = bdrv_getlength(bs);
@@ -120,6 +120,7 @@ wait:
         }
 
         copy = false;
+        status = 0;
 
         ret = bdrv_is_allocated(bs, sector_num,
                                 STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
@@ -138,8 +139,18 @@ wait:
 
             copy = (ret == 1);
         }
-        trace_stream_one_iteration(s, sector_num, n, ret);
         if (copy) {
+            /* Zeroes in the backing file need not be read and rewritten */
+            status = bdrv_get_block_status(bs->backing_hd, sector_num, n,
+                                           &pnum);
+            if (status >= 0 && (status & BDRV_BLOCK_ZERO)) {
+                n = pnum;
+            }
+        }
+        trace_stream_one_iteration(s, sector_num, n, ret);
+        if (copy && status >= 0 && (status & BDRV_BLOCK_ZERO)) {
+            ret = bdrv_co_write_zeroes(bs, sector_num, n, BDRV_REQ_MAY_UNMAP);
+        } else if (copy) {
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
                 if (delay_ns > 0) {
@@ -0,0 +1,230 @@
+/*
+ * Block I/O throttle groups
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "block/throttle-groups.h"
+#include "qemu/queue.h"
+
+/* The members of a throttle group share one ThrottleState, so the limits
+ * apply to the sum of their I/O.  Every member keeps its own queues of
+ * throttled requests; when the limits allow another request, the members
+ * that have one queued take turns, so that a busy drive cannot starve the
+ * others in the group.
+ *
+ * Every drive with I/O limits is in a group.  Unless a group name is
+ * given, that is a group of its own named after the drive.
+ */
+typedef struct ThrottleGroup {
+    char *name;
+    ThrottleState ts;
+    unsigned refcount;
+
+    /* Members, in round-robin order */
+    QLIST_HEAD(, BlockDriverState) head;
+
+    /* Member whose queued request is served next, for reads and writes */
+    BlockDriverState *tokens[2];
+
+    QTAILQ_ENTRY(ThrottleGroup) list;
+} ThrottleGroup;
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+const char *throttle_group_get_name(const BlockDriverState *bs)
+{
+    return bs->throttle_group->name;
+}
+
+/* Return the member after @bs, in round-robin order */
+static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
+{
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    return next ? next : QLIST_FIRST(&bs->throttle_group->head);
+}
+
+/* Return the first member after @bs, in round-robin order, that has queued
+ * requests of the given type.  If there is none, return @bs.
+ */
+static BlockDriverState *throttle_group_next_pending(BlockDriverState *bs,
+                                                     bool is_write)
+{
+    BlockDriverState *token = bs;
+
+    do {
+        token = throttle_group_next_bs(token);
+        if (!qemu_co_queue_empty(&token->throttled_reqs[is_write])) {
+            return token;
+        }
+    } while (token != bs);
+
+    return bs;
+}
+
+/* Start the next queued request of the group, or arm the timer if the
+ * limits do not allow it yet.  Called after a request has been accounted.
+ */
+static void throttle_group_schedule_next(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token = throttle_group_next_pending(bs, is_write);
+
+    if (qemu_co_queue_empty(&token->throttled_reqs[is_write])) {
+        return;
+    }
+
+    tg->tokens[is_write] = token;
+    if (throttle_schedule_timer(&tg->ts, is_write)) {
+        return;
+    }
+    qemu_co_queue_next(&token->throttled_reqs[is_write]);
+}
+
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+    bool must_wait;
+
+    /* wait if the limits are exceeded, or to let requests queued by this or
+     * any other member go first
+     */
+    must_wait = throttle_schedule_timer(&tg->ts, is_write);
+    if (!must_wait) {
+        token = throttle_group_next_pending(bs, is_write);
+        must_wait = !qemu_co_queue_empty(&token->throttled_reqs[is_write]);
+    }
+    if (must_wait) {
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+    }
+
+    /* the IO will be executed, do the accounting */
+    throttle_account(&tg->ts, is_write, bytes);
+
+    throttle_group_schedule_next(bs, is_write);
+}
+
+static void throttle_group_timer_cb(ThrottleGroup *tg, bool is_write)
+{
+    BlockDriverState *token = tg->tokens[is_write];
+
+    if (!token) {
+        token = QLIST_FIRST(&tg->head);
+    }
+    if (qemu_co_queue_empty(&token->throttled_reqs[is_write])) {
+        token = throttle_group_next_pending(token, is_write);
+    }
+    qemu_co_enter_next(&token->throttled_reqs[is_write]);
+}
+
+static void throttle_group_read_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, false);
+}
+
+static void throttle_group_write_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, true);
+}
+
+/* Set the limits of the group of @bs, and let the queued requests of all
+ * members try again.
+ */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *member;
+    int i;
+
+    throttle_config(&tg->ts, cfg);
+
+    QLIST_FOREACH(member, &tg->head, round_robin) {
+        for (i = 0; i < 2; i++) {
+            qemu_co_enter_next(&member->throttled_reqs[i]);
+        }
+    }
+}
+
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_get_config(&bs->throttle_group->ts, cfg);
+}
+
+/* Like throttle_group_get_config, with the bucket levels brought up to
+ * date
+ */
+void throttle_group_get_levels(const BlockDriverState *bs,
+                               ThrottleConfig *cfg)
+{
+    throttle_get_levels(&bs->throttle_group->ts, cfg);
+}
+
+/* Add @bs to the group called @groupname, creating the group if needed.
+ * A new group has no limits until throttle_group_config is called.
+ */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg;
+
+    assert(!bs->throttle_group);
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(tg->name, groupname)) {
+            break;
+        }
+    }
+
+    if (!tg) {
+        tg = g_new0(ThrottleGroup, 1);
+        tg->name = g_strdup(groupname);
+        throttle_init(&tg->ts, QEMU_CLOCK_VIRTUAL,
+                      throttle_group_read_timer_cb,
+                      throttle_group_write_timer_cb,
+                      tg);
+        QLIST_INIT(&tg->head);
+        QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+    }
+
+    tg->refcount++;
+    bs->throttle_group = tg;
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+}
+
+/* Remove @bs from its group, freeing the group if it was the last member.
+ * @bs must not have throttled requests queued.
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int i;
+
+    assert(qemu_co_queue_empty(&bs->throttled_reqs[0]));
+    assert(qemu_co_queue_empty(&bs->throttled_reqs[1]));
+
+    for (i = 0; i < 2; i++) {
+        if (tg->tokens[i] == bs) {
+            BlockDriverState *next = throttle_group_next_bs(bs);
+
+            tg->tokens[i] = next == bs ? NULL : next;
+        }
+    }
+
+    QLIST_REMOVE(bs, round_robin);
+    bs->throttle_group = NULL;
+
+    if (--tg->refcount == 0) {
+        QTAILQ_REMOVE(&throttle_groups, tg, list);
+        throttle_destroy(&tg->ts);
+        g_free(tg->name);
+        g_free(tg);
+    }
+}
@@ -439,15 +439,17 @@ static int vhdx_log_flush_desc(BlockDriverState *bs, VHDXLogDescriptor *desc,
 
     file_offset = desc->file_offset;
 
-    /* count is only > 1 if we are writing zeroes */
+    /* count is only > 1 if we are writing zeroes.  The caller flushes
+     * once all the descriptors of the log are written back. */
     for (i = 0; i < count; i++) {
-        ret = bdrv_pwrite_sync(bs->file, file_offset, buffer,
-                               VHDX_LOG_SECTOR_SIZE);
+        ret = bdrv_pwrite(bs->file, file_offset, buffer,
+                          VHDX_LOG_SECTOR_SIZE);
         if (ret < 0) {
             goto exit;
         }
         file_offset += VHDX_LOG_SECTOR_SIZE;
     }
+    ret = 0;
 
 exit:
     qemu_vfree(buffer);
@@ -921,7 +923,7 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
         } else if (i == sectors - 1 && trailing_length) {
             /* partial sector at the end of the buffer */
             ret = bdrv_pread(bs->file,
-                            file_offset,
+                            file_offset + trailing_length,
                             merged_sector + trailing_length,
                             VHDX_LOG_SECTOR_SIZE - trailing_length);
             if (ret < 0) {
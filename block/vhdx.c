@@ -1146,6 +1146,32 @@ static void vhdx_update_bat_table_entry(BlockDriverState *bs, BDRVVHDXState *s,
 
 }
 
+/*
+ * Write the BAT entries from first_idx to last_idx, as they are in s->bat,
+ * to the log and flush it.  All the payload blocks that a write request
+ * allocates are logged together, so that the request needs only one log
+ * entry and one round of flushes, rather than one for each block.
+ */
+static int vhdx_log_bat_entries(BlockDriverState *bs, BDRVVHDXState *s,
+                                uint32_t first_idx, uint32_t last_idx)
+{
+    uint32_t count = last_idx - first_idx + 1;
+    uint64_t *entries;
+    uint32_t i;
+    int ret;
+
+    entries = g_new(uint64_t, count);
+    for (i = 0; i < count; i++) {
+        entries[i] = cpu_to_le64(s->bat[first_idx + i]);
+    }
+    ret = vhdx_log_write_and_flush(bs, s, entries,
+                                   count * sizeof(VHDXBatEntry),
+                                   s->bat_offset +
+                                   first_idx * sizeof(VHDXBatEntry));
+    g_free(entries);
+    return ret;
+}
+
 /* Per the spec, on the first write of guest-visible data to the file the
  * data write guid must be updated in the header */
 int vhdx_user_visible_write(BlockDriverState *bs, BDRVVHDXState *s)
@@ -1174,6 +1200,9 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     int bat_state;
     uint64_t bat_prior_offset = 0;
     bool bat_update = false;
+    bool bat_pending = false;
+    uint32_t bat_first = 0, bat_last = 0;
+    int log_ret;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
@@ -1187,6 +1216,9 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     while (nb_sectors > 0) {
         bool use_zero_buffers = false;
         bat_update = false;
+        qemu_vfree(iov1.iov_base);
+        qemu_vfree(iov2.iov_base);
+        iov1.iov_base = iov2.iov_base = NULL;
         if (s->params.data_bits & VHDX_PARAMS_HAS_PARENT) {
             /* not supported yet */
             ret = -ENOTSUP;
@@ -1230,14 +1262,14 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                                       sinfo.bytes_avail);
 
                     /* zero fill the back, if any */
-                    if ((sinfo.bytes_avail - sinfo.block_offset) <
+                    if ((sinfo.bytes_avail + sinfo.block_offset) <
                          s->block_size) {
                         iov2.iov_len = s->block_size -
                                       (sinfo.bytes_avail + sinfo.block_offset);
                         iov2.iov_base = qemu_blockalign(bs, iov2.iov_len);
                         memset(iov2.iov_base, 0, iov2.iov_len);
                         qemu_iovec_concat_iov(&hd_qiov, &iov2, 1, 0,
-                                              sinfo.block_offset);
+                                              iov2.iov_len);
                         sectors_to_write += iov2.iov_len >> BDRV_SECTOR_BITS;
                     }
                 }
@@ -1297,14 +1329,13 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             }
 
             if (bat_update) {
-                /* this will update the BAT entry into the log journal, and
-                 * then flush the log journal out to disk */
-                ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
-                                                sizeof(VHDXBatEntry),
-                                                bat_entry_offset);
-                if (ret < 0) {
-                    goto exit;
+                /* the data is in place; the BAT entry goes to the log
+                 * together with the others changed by this request */
+                if (!bat_pending) {
+                    bat_first = sinfo.bat_idx;
+                    bat_pending = true;
                 }
+                bat_last = sinfo.bat_idx;
             }
 
             nb_sectors -= sinfo.sectors_avail;
@@ -1325,6 +1356,15 @@ error_bat_restore:
                                     &bat_entry_offset, bat_state);
     }
 exit:
+    if (bat_pending) {
+        /* this will write the BAT entries into the log journal, and then
+         * flush the log journal out to disk.  Blocks whose data was written
+         * before an error must be logged too. */
+        log_ret = vhdx_log_bat_entries(bs, s, bat_first, bat_last);
+        if (log_ret < 0 && ret >= 0) {
+            ret = log_ret;
+        }
+    }
     qemu_vfree(iov1.iov_base);
     qemu_vfree(iov2.iov_base);
     qemu_co_mutex_unlock(&s->lock);
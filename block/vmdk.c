@@ -81,8 +81,11 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
+/* default number of grain tables cached for each extent */
 #define L2_CACHE_SIZE 16
 
+#define VMDK_OPT_L2_CACHE_SIZE "l2-cache-size"
+
 typedef struct VmdkExtent {
     BlockDriverState *file;
     bool flat;
@@ -101,16 +104,24 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_size;     /* number of cached grain tables */
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t *l2_cache_offsets;
+    uint64_t *l2_cache_lru;         /* time of the last use of each table */
+    uint64_t l2_cache_clock;
 
     int64_t cluster_sectors;
     char *type;
+
+    /* Protects the grain table cache and cluster allocation.  Data in
+     * allocated clusters never moves, so reads only hold it for the lookup.
+     */
+    CoMutex lock;
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
-    CoMutex lock;
+    CoMutex lock;                   /* protects the CID */
+    uint64_t l2_cache_bytes;        /* cache size per extent, 0 for default */
     uint64_t desc_offset;
     bool cid_updated;
     bool cid_checked;
@@ -216,6 +227,8 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_lru);
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -320,6 +333,17 @@ static int vmdk_is_cid_valid(BlockDriverState *bs)
     return 1;
 }
 
+static int coroutine_fn vmdk_co_is_cid_valid(BlockDriverState *bs)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = vmdk_is_cid_valid(bs);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
 /* Queue extents, if any, for reopen() */
 static int vmdk_reopen_prepare(BDRVReopenState *state,
                                BlockReopenQueue *queue, Error **errp)
@@ -443,6 +467,8 @@ static int vmdk_add_extent(BlockDriverState *bs,
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
                             Error **errp)
 {
+    BDRVVmdkState *s = bs->opaque;
+    uint64_t table_bytes = extent->l2_size * sizeof(uint32_t);
     int ret;
     int l1_size, i;
 
@@ -480,8 +506,14 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    extent->l2_cache_size = L2_CACHE_SIZE;
+    if (s->l2_cache_bytes) {
+        extent->l2_cache_size = MAX(MIN(s->l2_cache_bytes / table_bytes,
+                                        extent->l1_size), 1);
+    }
+    extent->l2_cache = g_malloc(table_bytes * extent->l2_cache_size);
+    extent->l2_cache_offsets = g_new0(uint32_t, extent->l2_cache_size);
+    extent->l2_cache_lru = g_new0(uint64_t, extent->l2_cache_size);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -837,11 +869,36 @@ exit:
     return ret;
 }
 
+static QemuOptsList vmdk_runtime_opts = {
+    .name = "vmdk",
+    .head = QTAILQ_HEAD_INITIALIZER(vmdk_runtime_opts.head),
+    .desc = {
+        {
+            .name = VMDK_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum grain table cache size of each extent",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
-    int ret;
+    int ret, i;
     BDRVVmdkState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+
+    opts = qemu_opts_create_nofail(&vmdk_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->l2_cache_bytes = qemu_opt_get_size(opts, VMDK_OPT_L2_CACHE_SIZE, 0);
+    qemu_opts_del(opts);
 
     if (vmdk_open_sparse(bs, bs->file, flags, errp) == 0) {
         s->desc_offset = 0x200;
@@ -860,6 +917,11 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
     s->parent_cid = vmdk_read_cid(bs, 1);
     qemu_co_mutex_init(&s->lock);
 
+    /* Only now, because adding extents moves the array around */
+    for (i = 0; i < s->num_extents; i++) {
+        qemu_co_mutex_init(&s->extents[i].lock);
+    }
+
     /* Disable migration when VMDK images are used */
     error_set(&s->migration_blocker,
               QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
@@ -889,7 +951,7 @@ static int get_whole_cluster(BlockDriverState *bs,
     if (bs->backing_hd) {
         whole_grain =
             qemu_blockalign(bs, extent->cluster_sectors << BDRV_SECTOR_BITS);
-        if (!vmdk_is_cid_valid(bs)) {
+        if (!vmdk_co_is_cid_valid(bs)) {
             ret = VMDK_ERROR;
             goto exit;
         }
@@ -955,8 +1017,8 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table;
+    int min_index, i;
+    uint32_t *l2_table;
     bool zeroed = false;
 
     if (m_data) {
@@ -976,28 +1038,22 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
+            extent->l2_cache_lru[i] = ++extent->l2_cache_clock;
             l2_table = extent->l2_cache + (i * extent->l2_size);
             goto found;
         }
     }
-    /* not found: load a new entry in the least used one */
+    /* not found: load it in place of the least recently used one */
     min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
+    for (i = 1; i < extent->l2_cache_size; i++) {
+        if (extent->l2_cache_lru[i] < extent->l2_cache_lru[min_index]) {
             min_index = i;
         }
     }
     l2_table = extent->l2_cache + (min_index * extent->l2_size);
+    extent->l2_cache_offsets[min_index] = 0;
     if (bdrv_pread(
                 extent->file,
                 (int64_t)l2_offset * 512,
@@ -1008,7 +1064,7 @@ static int get_cluster_offset(BlockDriverState *bs,
     }
 
     extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
+    extent->l2_cache_lru[min_index] = ++extent->l2_cache_clock;
  found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
@@ -1089,10 +1145,10 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
     if (!extent) {
         return 0;
     }
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_mutex_lock(&extent->lock);
     ret = get_cluster_offset(bs, extent, NULL,
                             sector_num * 512, 0, &offset);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_mutex_unlock(&extent->lock);
 
     switch (ret) {
     case VMDK_ERROR:
@@ -1229,8 +1285,8 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1244,9 +1300,11 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (!extent) {
             return -EIO;
         }
+        qemu_co_mutex_lock(&extent->lock);
         ret = get_cluster_offset(
                             bs, extent, NULL,
                             sector_num << 9, 0, &cluster_offset);
+        qemu_co_mutex_unlock(&extent->lock);
         extent_begin_sector = extent->end_sector - extent->sectors;
         extent_relative_sector_num = sector_num - extent_begin_sector;
         index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
@@ -1257,7 +1315,7 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (ret != VMDK_OK) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd && ret != VMDK_ZEROED) {
-                if (!vmdk_is_cid_valid(bs)) {
+                if (!vmdk_co_is_cid_valid(bs)) {
                     return -EINVAL;
                 }
                 ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
@@ -1285,12 +1343,92 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
 static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
                                      uint8_t *buf, int nb_sectors)
 {
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    return vmdk_read(bs, sector_num, buf, nb_sectors);
+}
+
+/*
+ * Write to the cluster of @extent that contains @sector_num, allocating it
+ * if needed, and store the number of sectors that were handled in @pnum.
+ * Must be called with the extent lock held.  See vmdk_write for @zeroed and
+ * @zero_dry_run.
+ */
+static int coroutine_fn vmdk_write_cluster(BlockDriverState *bs,
+                                           VmdkExtent *extent,
+                                           int64_t sector_num,
+                                           const uint8_t *buf, int nb_sectors,
+                                           bool zeroed, bool zero_dry_run,
+                                           int *pnum)
+{
+    int n, ret;
+    int64_t index_in_cluster;
+    uint64_t extent_begin_sector, extent_relative_sector_num;
+    uint64_t cluster_offset;
+    VmdkMetaData m_data;
+
+    ret = get_cluster_offset(
+                            bs,
+                            extent,
+                            &m_data,
+                            sector_num << 9, !extent->compressed,
+                            &cluster_offset);
+    if (extent->compressed) {
+        if (ret == VMDK_OK) {
+            /* Refuse write to allocated cluster for streamOptimized */
+            error_report("Could not write to allocated cluster"
+                          " for streamOptimized");
+            return -EIO;
+        } else {
+            /* allocate */
+            ret = get_cluster_offset(
+                                    bs,
+                                    extent,
+                                    &m_data,
+                                    sector_num << 9, 1,
+                                    &cluster_offset);
+        }
+    }
+    if (ret == VMDK_ERROR) {
+        return -EINVAL;
+    }
+    extent_begin_sector = extent->end_sector - extent->sectors;
+    extent_relative_sector_num = sector_num - extent_begin_sector;
+    index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
+    n = extent->cluster_sectors - index_in_cluster;
+    if (n > nb_sectors) {
+        n = nb_sectors;
+    }
+    if (zeroed) {
+        /* Do zeroed write, buf is ignored */
+        if (extent->has_zero_grain &&
+                index_in_cluster == 0 &&
+                n >= extent->cluster_sectors) {
+            n = extent->cluster_sectors;
+            if (!zero_dry_run) {
+                m_data.offset = VMDK_GTE_ZEROED;
+                /* update L2 tables */
+                if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
+                    return -EIO;
+                }
+            }
+        } else {
+            return -ENOTSUP;
+        }
+    } else {
+        ret = vmdk_write_extent(extent,
+                        cluster_offset, index_in_cluster * 512,
+                        buf, n, sector_num);
+        if (ret) {
+            return ret;
+        }
+        if (m_data.valid) {
+            /* update L2 tables */
+            if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
+                return -EIO;
+            }
+        }
+    }
+    *pnum = n;
+    return 0;
 }
 
 /**
@@ -1301,19 +1439,18 @@ static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
  *                with each cluster. By dry run we can find if the zero write
  *                is possible without modifying image data.
  *
+ * Each cluster is written with only the lock of its extent held, so that
+ * requests to different extents proceed in parallel.
+ *
  * Returns: error code with 0 for success.
  */
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                      const uint8_t *buf, int nb_sectors,
-                      bool zeroed, bool zero_dry_run)
+static int coroutine_fn vmdk_write(BlockDriverState *bs, int64_t sector_num,
+                                   const uint8_t *buf, int nb_sectors,
+                                   bool zeroed, bool zero_dry_run)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
     int n, ret;
-    int64_t index_in_cluster;
-    uint64_t extent_begin_sector, extent_relative_sector_num;
-    uint64_t cluster_offset;
-    VmdkMetaData m_data;
 
     if (sector_num > bs->total_sectors) {
         error_report("Wrong offset: sector_num=0x%" PRIx64
@@ -1327,67 +1464,12 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         if (!extent) {
             return -EIO;
         }
-        ret = get_cluster_offset(
-                                bs,
-                                extent,
-                                &m_data,
-                                sector_num << 9, !extent->compressed,
-                                &cluster_offset);
-        if (extent->compressed) {
-            if (ret == VMDK_OK) {
-                /* Refuse write to allocated cluster for streamOptimized */
-                error_report("Could not write to allocated cluster"
-                              " for streamOptimized");
-                return -EIO;
-            } else {
-                /* allocate */
-                ret = get_cluster_offset(
-                                        bs,
-                                        extent,
-                                        &m_data,
-                                        sector_num << 9, 1,
-                                        &cluster_offset);
-            }
-        }
-        if (ret == VMDK_ERROR) {
-            return -EINVAL;
-        }
-        extent_begin_sector = extent->end_sector - extent->sectors;
-        extent_relative_sector_num = sector_num - extent_begin_sector;
-        index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
-        n = extent->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors) {
-            n = nb_sectors;
-        }
-        if (zeroed) {
-            /* Do zeroed write, buf is ignored */
-            if (extent->has_zero_grain &&
-                    index_in_cluster == 0 &&
-                    n >= extent->cluster_sectors) {
-                n = extent->cluster_sectors;
-                if (!zero_dry_run) {
-                    m_data.offset = VMDK_GTE_ZEROED;
-                    /* update L2 tables */
-                    if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
-                        return -EIO;
-                    }
-                }
-            } else {
-                return -ENOTSUP;
-            }
-        } else {
-            ret = vmdk_write_extent(extent,
-                            cluster_offset, index_in_cluster * 512,
-                            buf, n, sector_num);
-            if (ret) {
-                return ret;
-            }
-            if (m_data.valid) {
-                /* update L2 tables */
-                if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
-                    return -EIO;
-                }
-            }
+        qemu_co_mutex_lock(&extent->lock);
+        ret = vmdk_write_cluster(bs, extent, sector_num, buf, nb_sectors,
+                                 zeroed, zero_dry_run, &n);
+        qemu_co_mutex_unlock(&extent->lock);
+        if (ret) {
+            return ret;
         }
         nb_sectors -= n;
         sector_num += n;
@@ -1396,11 +1478,16 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
-            ret = vmdk_write_cid(bs, time(NULL));
-            if (ret < 0) {
-                return ret;
+            qemu_co_mutex_lock(&s->lock);
+            if (!s->cid_updated) {
+                ret = vmdk_write_cid(bs, time(NULL));
+                if (ret < 0) {
+                    qemu_co_mutex_unlock(&s->lock);
+                    return ret;
+                }
+                s->cid_updated = true;
             }
-            s->cid_updated = true;
+            qemu_co_mutex_unlock(&s->lock);
         }
     }
     return 0;
@@ -1409,12 +1496,7 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
 static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
                                       const uint8_t *buf, int nb_sectors)
 {
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    return vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
 }
 
 static int coroutine_fn vmdk_co_write_zeroes(BlockDriverState *bs,
@@ -1422,15 +1504,13 @@ static int coroutine_fn vmdk_co_write_zeroes(BlockDriverState *bs,
                                              int nb_sectors)
 {
     int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
+
     /* write zeroes could fail if sectors not aligned to cluster, test it with
      * dry_run == true before really updating image */
     ret = vmdk_write(bs, sector_num, NULL, nb_sectors, true, true);
     if (!ret) {
         ret = vmdk_write(bs, sector_num, NULL, nb_sectors, true, false);
     }
-    qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
 
@@ -24,6 +24,9 @@
  */
 #include <sys/stat.h>
 #include <dirent.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
@@ -339,6 +342,8 @@ typedef struct BDRVVVFATState {
     uint32_t max_fat_value;
 
     int current_fd;
+    void *current_map;          /* current_fd mapped, or NULL */
+    size_t current_map_size;
     mapping_t* current_mapping;
     unsigned char* cluster; /* points to current cluster */
     unsigned char* cluster_buffer; /* points to a buffer to hold temp data */
@@ -1206,6 +1211,12 @@ static inline void vvfat_close_current_file(BDRVVVFATState *s)
 {
     if(s->current_mapping) {
 	s->current_mapping = NULL;
+#ifndef _WIN32
+        if (s->current_map) {
+            munmap(s->current_map, s->current_map_size);
+        }
+#endif
+        s->current_map = NULL;
 	if (s->current_fd) {
 		qemu_close(s->current_fd);
 		s->current_fd = 0;
@@ -1270,6 +1281,27 @@ static int open_file(BDRVVVFATState* s,mapping_t* mapping)
 	vvfat_close_current_file(s);
 	s->current_fd = fd;
 	s->current_mapping = mapping;
+#ifndef _WIN32
+        /*
+         * Clusters are served straight from the page cache when the file
+         * can be mapped.  As with read(), the host tree must not change
+         * while it is exported; a file that is truncated while mapped will
+         * fault.
+         */
+        {
+            struct stat st;
+
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                s->current_map = mmap(NULL, st.st_size, PROT_READ,
+                                      MAP_SHARED, fd, 0);
+                if (s->current_map == MAP_FAILED) {
+                    s->current_map = NULL;
+                } else {
+                    s->current_map_size = st.st_size;
+                }
+            }
+        }
+#endif
     }
     return 0;
 }
@@ -1309,6 +1341,14 @@ read_cluster_directory:
 	assert(s->current_fd);
 
 	offset=s->cluster_size*(cluster_num-s->current_mapping->begin)+s->current_mapping->info.file.offset;
+        if (s->current_map &&
+            offset + s->cluster_size <= s->current_map_size) {
+            s->cluster = (unsigned char *)s->current_map + offset;
+            s->current_cluster = cluster_num;
+            return 0;
+        }
+
+        /* the last, partial cluster of the file is copied and padded */
 	if(lseek(s->current_fd, offset, SEEK_SET)!=offset)
 	    return -3;
 	s->cluster=s->cluster_buffer;
@@ -1317,6 +1357,7 @@ read_cluster_directory:
 	    s->current_cluster = -1;
 	    return -1;
 	}
+        memset(s->cluster + result, 0, s->cluster_size - result);
 	s->current_cluster = cluster_num;
     }
     return 0;
@@ -42,6 +42,7 @@
 #include "qapi/qmp-output-visitor.h"
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
+#include "block/throttle-groups.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "sysemu/arch_init.h"
@@ -288,6 +289,21 @@ static int parse_block_error_action(const char *buf, bool is_read, Error **errp)
     }
 }
 
+static BlockdevDetectZeroesOptions parse_detect_zeroes(const char *buf,
+                                                       Error **errp)
+{
+    int i;
+
+    for (i = 0; i < BLOCKDEV_DETECT_ZEROES_OPTIONS_MAX; i++) {
+        if (!strcmp(buf, BlockdevDetectZeroesOptions_lookup[i])) {
+            return i;
+        }
+    }
+
+    error_setg(errp, "'%s' invalid detect-zeroes option", buf);
+    return BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
+}
+
 static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
 {
     if (throttle_conflicting(cfg)) {
@@ -297,7 +313,9 @@ static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
     }
 
     if (!throttle_is_valid(cfg)) {
-        error_setg(errp, "bps/iops/maxs values must be 0 or greater");
+        error_setg(errp, "bps/iops/maxs values must be 0 or greater, and "
+                         "max values of at least the average are needed "
+                         "for a burst length above one second");
         return false;
     }
 
@@ -314,6 +332,7 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     const char *buf;
     const char *file = NULL;
     const char *serial;
+    const char *throttling_group;
     int ro = 0;
     int bdrv_flags = 0;
     int on_read_error, on_write_error;
@@ -321,6 +340,7 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     ThrottleConfig cfg;
     int snapshot = 0;
     bool copy_on_read;
+    BlockdevDetectZeroesOptions detect_zeroes;
     int ret;
     Error *error = NULL;
     QemuOpts *opts;
@@ -364,6 +384,21 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
         }
     }
 
+    detect_zeroes = BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
+    if ((buf = qemu_opt_get(opts, "detect-zeroes")) != NULL) {
+        detect_zeroes = parse_detect_zeroes(buf, &error);
+        if (error_is_set(&error)) {
+            error_propagate(errp, error);
+            goto early_err;
+        }
+        if (detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP &&
+            !(bdrv_flags & BDRV_O_UNMAP)) {
+            error_setg(errp, "setting detect-zeroes to unmap is not allowed "
+                             "without setting discard operation to unmap");
+            goto early_err;
+        }
+    }
+
     if (qemu_opt_get_bool(opts, "cache.writeback", true)) {
         bdrv_flags |= BDRV_O_CACHE_WB;
     }
@@ -379,7 +414,7 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
         if (!strcmp(buf, "native")) {
             bdrv_flags |= BDRV_O_NATIVE_AIO;
         } else if (!strcmp(buf, "threads")) {
-            /* this is the default */
+            bdrv_flags |= BDRV_O_THREAD_AIO;
         } else {
            error_setg(errp, "invalid aio option");
            goto early_err;
@@ -430,8 +465,23 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     cfg.buckets[THROTTLE_OPS_WRITE].max =
         qemu_opt_get_number(opts, "throttling.iops-write-max", 0);
 
+    cfg.buckets[THROTTLE_BPS_TOTAL].burst_length =
+        qemu_opt_get_number(opts, "throttling.bps-total-max-length", 1);
+    cfg.buckets[THROTTLE_BPS_READ].burst_length =
+        qemu_opt_get_number(opts, "throttling.bps-read-max-length", 1);
+    cfg.buckets[THROTTLE_BPS_WRITE].burst_length =
+        qemu_opt_get_number(opts, "throttling.bps-write-max-length", 1);
+    cfg.buckets[THROTTLE_OPS_TOTAL].burst_length =
+        qemu_opt_get_number(opts, "throttling.iops-total-max-length", 1);
+    cfg.buckets[THROTTLE_OPS_READ].burst_length =
+        qemu_opt_get_number(opts, "throttling.iops-read-max-length", 1);
+    cfg.buckets[THROTTLE_OPS_WRITE].burst_length =
+        qemu_opt_get_number(opts, "throttling.iops-write-max-length", 1);
+
     cfg.op_size = qemu_opt_get_number(opts, "throttling.iops-size", 0);
 
+    throttling_group = qemu_opt_get(opts, "throttling.group");
+
     if (!check_throttle_config(&cfg, &error)) {
         error_propagate(errp, error);
         goto early_err;
@@ -479,10 +529,11 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    dinfo->bdrv->detect_zeroes = detect_zeroes;
 
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(dinfo->bdrv);
+        bdrv_io_limits_enable(dinfo->bdrv, throttling_group);
         bdrv_set_io_limits(dinfo->bdrv, &cfg);
     }
 
@@ -651,6 +702,21 @@ DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     qemu_opt_rename(all_opts,
                     "iops_size", "throttling.iops-size");
 
+    qemu_opt_rename(all_opts, "group", "throttling.group");
+
+    qemu_opt_rename(all_opts, "bps_max_length",
+                    "throttling.bps-total-max-length");
+    qemu_opt_rename(all_opts, "bps_rd_max_length",
+                    "throttling.bps-read-max-length");
+    qemu_opt_rename(all_opts, "bps_wr_max_length",
+                    "throttling.bps-write-max-length");
+    qemu_opt_rename(all_opts, "iops_max_length",
+                    "throttling.iops-total-max-length");
+    qemu_opt_rename(all_opts, "iops_rd_max_length",
+                    "throttling.iops-read-max-length");
+    qemu_opt_rename(all_opts, "iops_wr_max_length",
+                    "throttling.iops-write-max-length");
+
     qemu_opt_rename(all_opts, "readonly", "read-only");
 
     value = qemu_opt_get(all_opts, "cache");
@@ -1311,6 +1377,7 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
                      backup->has_speed, backup->speed,
                      backup->has_on_source_error, backup->on_source_error,
                      backup->has_on_target_error, backup->on_target_error,
+                     backup->has_bitmap, backup->bitmap,
                      &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
@@ -1575,7 +1642,22 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_wr_max,
                                int64_t iops_wr_max,
                                bool has_iops_size,
-                               int64_t iops_size, Error **errp)
+                               int64_t iops_size,
+                               bool has_group,
+                               const char *group,
+                               bool has_bps_max_length,
+                               int64_t bps_max_length,
+                               bool has_bps_rd_max_length,
+                               int64_t bps_rd_max_length,
+                               bool has_bps_wr_max_length,
+                               int64_t bps_wr_max_length,
+                               bool has_iops_max_length,
+                               int64_t iops_max_length,
+                               bool has_iops_rd_max_length,
+                               int64_t iops_rd_max_length,
+                               bool has_iops_wr_max_length,
+                               int64_t iops_wr_max_length,
+                               Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -1618,21 +1700,125 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         cfg.op_size = iops_size;
     }
 
+    if ((has_bps_max_length && bps_max_length < 1) ||
+        (has_bps_rd_max_length && bps_rd_max_length < 1) ||
+        (has_bps_wr_max_length && bps_wr_max_length < 1) ||
+        (has_iops_max_length && iops_max_length < 1) ||
+        (has_iops_rd_max_length && iops_rd_max_length < 1) ||
+        (has_iops_wr_max_length && iops_wr_max_length < 1)) {
+        error_setg(errp, "max_length values must be 1 or greater");
+        return;
+    }
+    if (has_bps_max_length) {
+        cfg.buckets[THROTTLE_BPS_TOTAL].burst_length = bps_max_length;
+    }
+    if (has_bps_rd_max_length) {
+        cfg.buckets[THROTTLE_BPS_READ].burst_length = bps_rd_max_length;
+    }
+    if (has_bps_wr_max_length) {
+        cfg.buckets[THROTTLE_BPS_WRITE].burst_length = bps_wr_max_length;
+    }
+    if (has_iops_max_length) {
+        cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = iops_max_length;
+    }
+    if (has_iops_rd_max_length) {
+        cfg.buckets[THROTTLE_OPS_READ].burst_length = iops_rd_max_length;
+    }
+    if (has_iops_wr_max_length) {
+        cfg.buckets[THROTTLE_OPS_WRITE].burst_length = iops_wr_max_length;
+    }
+
     if (!check_throttle_config(&cfg, errp)) {
         return;
     }
 
-    if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !throttle_enabled(&cfg)) {
+    if (bs->io_limits_enabled &&
+        (!throttle_enabled(&cfg) ||
+         (has_group && strcmp(group, throttle_group_get_name(bs))))) {
+        /* leave the current group */
         bdrv_io_limits_disable(bs);
     }
 
+    if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
+        bdrv_io_limits_enable(bs, has_group ? group : NULL);
+    }
+
     if (bs->io_limits_enabled) {
         bdrv_set_io_limits(bs, &cfg);
     }
 }
 
+static bool latency_histogram_check(uint64List *boundaries, Error **errp)
+{
+    uint64_t prev = 0;
+
+    for (; boundaries; boundaries = boundaries->next) {
+        if (boundaries->value <= prev) {
+            error_setg(errp, "latency histogram boundaries must be positive "
+                       "and strictly ascending");
+            return false;
+        }
+        prev = boundaries->value;
+    }
+    return true;
+}
+
+static void latency_histogram_set(BlockDriverState *bs,
+                                  enum BlockAcctType type,
+                                  uint64List *boundaries)
+{
+    uint64_t *values = NULL;
+    uint64List *e;
+    int n = 0;
+
+    for (e = boundaries; e; e = e->next) {
+        values = g_renew(uint64_t, values, n + 1);
+        values[n++] = e->value;
+    }
+    bdrv_latency_histogram_set(bs, type, values, n);
+    g_free(values);
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_boundaries_read) {
+        boundaries_read = boundaries;
+    }
+    if (!has_boundaries_write) {
+        boundaries_write = boundaries;
+    }
+    if (!has_boundaries_flush) {
+        boundaries_flush = boundaries;
+    }
+
+    if (!latency_histogram_check(boundaries_read, errp) ||
+        !latency_histogram_check(boundaries_write, errp) ||
+        !latency_histogram_check(boundaries_flush, errp)) {
+        return;
+    }
+
+    latency_histogram_set(bs, BDRV_ACCT_READ, boundaries_read);
+    latency_histogram_set(bs, BDRV_ACCT_WRITE, boundaries_write);
+    latency_histogram_set(bs, BDRV_ACCT_FLUSH, boundaries_flush);
+}
+
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *id = qdict_get_str(qdict, "id");
@@ -1712,6 +1898,54 @@ void qmp_block_resize(const char *device, int64_t size, Error **errp)
     }
 }
 
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_granularity) {
+        granularity = 65536;
+    }
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    bdrv_create_dirty_bitmap(bs, name, granularity, persistent, errp);
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return;
+    }
+    if (bitmap->in_use) {
+        error_setg(errp, "Dirty bitmap '%s' is in use", name);
+        return;
+    }
+
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
 static void block_job_cb(void *opaque, int ret)
 {
     BlockDriverState *bs = opaque;
@@ -1835,12 +2069,14 @@ void qmp_drive_backup(const char *device, const char *target,
                       bool has_speed, int64_t speed,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_bitmap, const char *bitmap,
                       Error **errp)
 {
     BlockDriverState *bs;
     BlockDriverState *target_bs;
     BlockDriverState *source = NULL;
     BlockDriver *drv = NULL;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
     Error *local_err = NULL;
     int flags;
     int64_t size;
@@ -1886,6 +2122,26 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!has_bitmap) {
+            error_set(errp, QERR_MISSING_PARAMETER, "bitmap");
+            return;
+        }
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+        if (sync_bitmap->in_use) {
+            error_setg(errp, "Dirty bitmap '%s' is in use", bitmap);
+            return;
+        }
+    } else if (has_bitmap) {
+        error_setg(errp, "A dirty bitmap can only be used with sync mode "
+                   "'incremental'");
+        return;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
 
     /* See if we have a backing HD we can use to create our new image
@@ -1931,7 +2187,8 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
-    backup_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -1940,7 +2197,7 @@ void qmp_drive_backup(const char *device, const char *target,
     }
 }
 
-#define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
+#define DEFAULT_MIRROR_BUF_SIZE   (256 << 20)
 
 void qmp_drive_mirror(const char *device, const char *target,
                       bool has_format, const char *format,
@@ -1951,6 +2208,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1979,6 +2237,15 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
+
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "sync",
+                  "'top', 'full' or 'none'");
+        return;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
@@ -2072,7 +2339,7 @@ void qmp_drive_mirror(const char *device, const char *target,
     }
 
     mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
-                 on_source_error, on_target_error,
+                 copy_mode, on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -2251,6 +2518,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "discard",
             .type = QEMU_OPT_STRING,
             .help = "discard operation (ignore/off, unmap/on)",
+        },{
+            .name = "detect-zeroes",
+            .type = QEMU_OPT_STRING,
+            .help = "try to optimize zero writes (off, on, unmap)",
         },{
             .name = "cache.writeback",
             .type = QEMU_OPT_BOOL,
@@ -2335,10 +2606,38 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.bps-write-max",
             .type = QEMU_OPT_NUMBER,
             .help = "total bytes write burst",
+        },{
+            .name = "throttling.bps-total-max-length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes burst length, in seconds",
+        },{
+            .name = "throttling.bps-read-max-length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes read burst length, in seconds",
+        },{
+            .name = "throttling.bps-write-max-length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes write burst length, in seconds",
+        },{
+            .name = "throttling.iops-total-max-length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations burst length, in seconds",
+        },{
+            .name = "throttling.iops-read-max-length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations read burst length, in seconds",
+        },{
+            .name = "throttling.iops-write-max-length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations write burst length, in seconds",
         },{
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the block throttling group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
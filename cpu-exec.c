@@ -174,6 +174,39 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Look the current state up in the jump cache only, NULL on a miss */
+static inline TranslationBlock *tb_find_cached(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (!tb || tb->pc != pc || tb->cs_base != cs_base ||
+        tb->flags != flags) {
+        return NULL;
+    }
+    return tb;
+}
+
+/* Whether dispatching to a block found in the jump cache still needs
+   tb_lock: chaining patches the code of the previous block, and
+   counting executions may retranslate the block.  */
+static inline bool tb_dispatch_needs_lock(TranslationBlock *tb,
+                                          uintptr_t next_tb)
+{
+    if (next_tb != 0 || unlikely(tb_profile_enabled)) {
+        return true;
+    }
+#ifdef TARGET_HAS_TB_TRACE
+    if (tb->cflags == 0 && tb->exec_count < TB_TRACE_THRESHOLD) {
+        return true;
+    }
+#endif
+    return false;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -595,29 +628,52 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS */
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
-                tb = tb_find_fast(env);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                /* Blocks are only freed by tb_flush, so most dispatches,
+                   in particular those after an indirect branch, can use
+                   the jump cache without serializing guest threads on
+                   tb_lock.  */
+                tb = tb_find_cached(env);
+                if (unlikely(!tb || tb_dispatch_needs_lock(tb, next_tb))) {
+                    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+                    tb = tb_find_fast(env);
+                    /* Note: we do it here to avoid a gcc bug on Mac OS X when
+                       doing it in tb_find_slow */
+                    if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
+                        /* as some TB could have been invalidated because
+                           of memory exceptions while generating the code, we
+                           must recompute the hash index here */
+                        next_tb = 0;
+                        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                    }
+#ifdef TARGET_HAS_TB_TRACE
+                    if (unlikely(++tb->exec_count == TB_TRACE_THRESHOLD) &&
+                        tb->cflags == 0) {
+                        tb = tb_gen_trace(env, tb);
+                        next_tb = 0;
+                    }
+#else
+                    if (unlikely(tb_profile_enabled)) {
+                        tb->exec_count++;
+                    }
+#endif
+                    if (unlikely(tb_profile_enabled)) {
+                        /* count every execution of the TB */
+                        next_tb = 0;
+                    }
+                    /* see if we can patch the calling TB. When the TB
+                       spans two pages, we cannot safely do a direct
+                       jump. */
+                    if (next_tb != 0 && tb->page_addr[1] == -1) {
+                        tb_add_jump((TranslationBlock *)
+                                    (next_tb & ~TB_EXIT_MASK),
+                                    next_tb & TB_EXIT_MASK, tb);
+                    }
+                    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
                 }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
                 }
-                /* see if we can patch the calling TB. When the TB
-                   spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
-                }
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -38,6 +38,8 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/rcu.h"
+#include "qemu/processor.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -46,6 +48,12 @@
 #ifdef CONFIG_LINUX
 
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sched.h>
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
 
 #ifndef PR_MCE_KILL
 #define PR_MCE_KILL 33
@@ -70,7 +78,7 @@ bool cpu_is_stopped(CPUState *cpu)
 
 static bool cpu_thread_is_idle(CPUState *cpu)
 {
-    if (cpu->stop || cpu->queued_work_first) {
+    if (cpu->stop || atomic_read(&cpu->queued_work)) {
         return false;
     }
     if (cpu_is_stopped(cpu)) {
@@ -498,28 +506,22 @@ void hw_error(const char *fmt, ...)
 
 void cpu_synchronize_all_states(void)
 {
-    CPUState *cpu;
-
-    CPU_FOREACH(cpu) {
-        cpu_synchronize_state(cpu);
+    if (kvm_enabled()) {
+        kvm_cpu_synchronize_all_states();
     }
 }
 
 void cpu_synchronize_all_post_reset(void)
 {
-    CPUState *cpu;
-
-    CPU_FOREACH(cpu) {
-        cpu_synchronize_post_reset(cpu);
+    if (kvm_enabled()) {
+        kvm_cpu_synchronize_all_post_reset();
     }
 }
 
 void cpu_synchronize_all_post_init(void)
 {
-    CPUState *cpu;
-
-    CPU_FOREACH(cpu) {
-        cpu_synchronize_post_init(cpu);
+    if (kvm_enabled()) {
+        kvm_cpu_synchronize_all_post_init();
     }
 }
 
@@ -731,6 +733,33 @@ void qemu_init_cpu_loop(void)
     qemu_thread_get_self(&io_thread);
 }
 
+/*
+ * cpu->queued_work is a lock-free stack: producers push with a
+ * compare-and-swap, and the vCPU thread takes the whole list at once.
+ */
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    struct qemu_work_item *head;
+
+    wi->done = false;
+    do {
+        head = atomic_read(&cpu->queued_work);
+        wi->next = head;
+    } while (atomic_cmpxchg(&cpu->queued_work, head, wi) != head);
+
+    qemu_cpu_kick(cpu);
+}
+
+static void wait_work_on_cpu(struct qemu_work_item *wi)
+{
+    while (!atomic_mb_read(&wi->done)) {
+        CPUState *self_cpu = current_cpu;
+
+        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        current_cpu = self_cpu;
+    }
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -743,22 +772,39 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi.func = func;
     wi.data = data;
     wi.free = false;
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
+    queue_work_on_cpu(cpu, &wi);
+    wait_work_on_cpu(&wi);
+}
+
+void run_on_all_cpus(void (*func)(void *data))
+{
+    struct qemu_work_item *items;
+    CPUState *cpu;
+    int i, n = 0;
+
+    CPU_FOREACH(cpu) {
+        n++;
     }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
-    wi.done = false;
 
-    qemu_cpu_kick(cpu);
-    while (!wi.done) {
-        CPUState *self_cpu = current_cpu;
+    /* Queue everything first, so that the vCPUs run @func in parallel.  */
+    items = g_new0(struct qemu_work_item, n);
+    i = 0;
+    CPU_FOREACH(cpu) {
+        if (qemu_cpu_is_self(cpu)) {
+            func(cpu);
+            items[i].done = true;
+        } else {
+            items[i].func = func;
+            items[i].data = cpu;
+            queue_work_on_cpu(cpu, &items[i]);
+        }
+        i++;
+    }
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
-        current_cpu = self_cpu;
+    for (i = 0; i < n; i++) {
+        wait_work_on_cpu(&items[i]);
     }
+    g_free(items);
 }
 
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
@@ -774,35 +820,36 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->func = func;
     wi->data = data;
     wi->free = true;
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
-    }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
-
-    qemu_cpu_kick(cpu);
+    queue_work_on_cpu(cpu, wi);
 }
 
 static void flush_queued_work(CPUState *cpu)
 {
-    struct qemu_work_item *wi;
+    struct qemu_work_item *wi, *next, *list = NULL;
 
-    if (cpu->queued_work_first == NULL) {
+    if (atomic_read(&cpu->queued_work) == NULL) {
         return;
     }
 
-    while ((wi = cpu->queued_work_first)) {
-        cpu->queued_work_first = wi->next;
+    /* Take the whole stack, and reverse it to run items in FIFO order.  */
+    wi = atomic_xchg(&cpu->queued_work, NULL);
+    while (wi) {
+        next = wi->next;
+        wi->next = list;
+        list = wi;
+        wi = next;
+    }
+
+    for (wi = list; wi; wi = next) {
+        /* Synchronous items may go away as soon as they are done.  */
+        next = wi->next;
         wi->func(wi->data);
-        wi->done = true;
         if (wi->free) {
             g_free(wi);
+        } else {
+            atomic_mb_set(&wi->done, true);
         }
     }
-    cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
@@ -837,8 +884,43 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+/* Spin time before a halted vCPU goes to sleep, zero disables polling.  */
+static int64_t kvm_halt_poll_ns;
+
+/*
+ * Wait for up to kvm_halt_poll_ns for work to arrive, with the iothread
+ * mutex released so that it can be delivered.  This avoids the signal and
+ * condition variable round trip when the guest idles only briefly.
+ */
+static void qemu_kvm_halt_poll(CPUState *cpu)
+{
+    int64_t start;
+
+    if (!kvm_halt_poll_ns || cpu_is_stopped(cpu) ||
+        !cpu_thread_is_idle(cpu)) {
+        return;
+    }
+
+    qemu_mutex_unlock(&qemu_global_mutex);
+    start = get_clock();
+    while (!atomic_read(&cpu->interrupt_request) &&
+           !atomic_read(&cpu->queued_work) &&
+           !atomic_read(&cpu->stop) &&
+           get_clock() - start < kvm_halt_poll_ns) {
+        cpu_relax();
+    }
+    qemu_mutex_lock(&qemu_global_mutex);
+
+    if (cpu_thread_is_idle(cpu)) {
+        cpu->halt_poll_fail++;
+    } else {
+        cpu->halt_poll_success++;
+    }
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
+    qemu_kvm_halt_poll(cpu);
     while (cpu_thread_is_idle(cpu)) {
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
@@ -852,6 +934,8 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     CPUState *cpu = arg;
     int r;
 
+    rcu_register_thread();
+
     qemu_mutex_lock(&qemu_global_mutex);
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
@@ -892,6 +976,8 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
     sigset_t waitset;
     int r;
 
+    rcu_register_thread();
+
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
@@ -930,6 +1016,8 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
+    rcu_register_thread();
+
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
 
@@ -1142,6 +1230,9 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
 static void qemu_kvm_start_vcpu(CPUState *cpu)
 {
+    kvm_halt_poll_ns = qemu_opt_get_number(qemu_get_machine_opts(),
+                                           "kvm_halt_poll_ns", 0);
+
     cpu->thread = g_malloc0(sizeof(QemuThread));
     cpu->halt_cond = g_malloc0(sizeof(QemuCond));
     qemu_cond_init(cpu->halt_cond);
@@ -1297,6 +1388,57 @@ static void tcg_exec_all(void)
     exit_request = 0;
 }
 
+#ifdef CONFIG_LINUX
+/* Add the CPUs listed in /sys for host node @node (e.g. "0-7,16-23").  */
+static void numa_add_host_node_cpus(int node, cpu_set_t *set)
+{
+    char *path, *contents, *p;
+    unsigned long first, last;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        fprintf(stderr, "qemu: cannot read %s\n", path);
+        g_free(path);
+        return;
+    }
+
+    p = contents;
+    while (*p >= '0' && *p <= '9') {
+        first = last = strtoul(p, &p, 10);
+        if (*p == '-') {
+            last = strtoul(p + 1, &p, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    g_free(contents);
+    g_free(path);
+}
+
+static void numa_pin_vcpu(CPUState *cpu, int nodenr)
+{
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO(&set);
+    for (i = find_first_bit(node_host_nodes[nodenr], MAX_NODES);
+         i < MAX_NODES;
+         i = find_next_bit(node_host_nodes[nodenr], MAX_NODES, i + 1)) {
+        numa_add_host_node_cpus(i, &set);
+    }
+
+    if (CPU_COUNT(&set) == 0 ||
+        sched_setaffinity(cpu->thread_id, sizeof(set), &set) < 0) {
+        fprintf(stderr, "qemu: cannot pin CPU #%d to its NUMA host nodes\n",
+                cpu->cpu_index);
+    }
+}
+#endif
+
 void set_numa_modes(void)
 {
     CPUState *cpu;
@@ -1308,7 +1450,39 @@ void set_numa_modes(void)
                 cpu->numa_node = i;
             }
         }
+#ifdef CONFIG_LINUX
+        /* With TCG, all vCPUs share a single thread.  */
+        if (nb_numa_nodes && node_pin_vcpus[cpu->numa_node] &&
+            !tcg_enabled()) {
+            numa_pin_vcpu(cpu, cpu->numa_node);
+        }
+#endif
+    }
+}
+
+/*
+ * Apply the host memory policy of each guest NUMA node to its part of the
+ * guest RAM at @host.  Nodes are laid out consecutively, in the same order
+ * as in the tables that are passed to the firmware.
+ */
+void numa_bind_ram(void *host, uint64_t size)
+{
+#if defined(CONFIG_LINUX) && defined(__NR_mbind)
+    uint64_t offset = 0, len;
+    int i;
+
+    for (i = 0; i < nb_numa_nodes && offset < size; i++) {
+        len = MIN(node_mem[i], size - offset);
+        if (node_host_policy[i] != NUMA_POLICY_DEFAULT && len &&
+            syscall(__NR_mbind, (char *)host + offset, len,
+                    node_host_policy[i], node_host_nodes[i], MAX_NODES + 1,
+                    MPOL_MF_MOVE) < 0) {
+            fprintf(stderr, "qemu: cannot bind RAM of NUMA node %d: %s\n",
+                    i, strerror(errno));
+        }
+        offset += len;
     }
+#endif
 }
 
 void list_cpus(FILE *f, fprintf_function cpu_fprintf, const char *optarg)
@@ -1324,6 +1498,8 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     CpuInfoList *head = NULL, *cur_item = NULL;
     CPUState *cpu;
 
+    cpu_synchronize_all_states();
+
     CPU_FOREACH(cpu) {
         CpuInfoList *info;
 #if defined(TARGET_I386)
@@ -1340,14 +1516,18 @@ CpuInfoList *qmp_query_cpus(Error **errp)
         CPUMIPSState *env = &mips_cpu->env;
 #endif
 
-        cpu_synchronize_state(cpu);
-
         info = g_malloc0(sizeof(*info));
         info->value = g_malloc0(sizeof(*info->value));
         info->value->CPU = cpu->cpu_index;
         info->value->current = (cpu == first_cpu);
         info->value->halted = cpu->halted;
         info->value->thread_id = cpu->thread_id;
+        if (kvm_halt_poll_ns) {
+            info->value->has_halt_poll_success = true;
+            info->value->halt_poll_success = cpu->halt_poll_success;
+            info->value->has_halt_poll_fail = true;
+            info->value->halt_poll_fail = cpu->halt_poll_fail;
+        }
 #if defined(TARGET_I386)
         info->value->has_pc = true;
         info->value->pc = env->eip + env->segs[R_CS].base;
@@ -26,12 +26,16 @@
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "qemu/timer.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+int tlb_victim_hit_count;
+int tlb_fill_count;
+int tlb_resize_count;
 
 static const CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read  = -1,
@@ -52,10 +56,95 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
+
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* A table that stays mostly empty for this long is shrunk.  */
+#define TLB_RESIZE_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
+                             size_t max_entries)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = max_entries;
+}
+
+static void tlb_mmu_alloc(CPUArchState *env, int mmu_idx, size_t n_entries)
+{
+    env->tlb_mask[mmu_idx] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    env->tlb_table[mmu_idx] = g_new(CPUTLBEntry, n_entries);
+    env->iotlb[mmu_idx] = g_new(hwaddr, n_entries);
+}
+
+/* Called from tlb_flush, before the table of @mmu_idx is emptied.
+ *
+ * The table doubles when more than 70% of its entries were in use at
+ * some point since the window began; this is what makes memory-hungry
+ * guests take fewer tlb_fill() calls.  It shrinks once a whole window
+ * passed with less than 30% of the entries used, which is the common
+ * case for guests that flush all the time: they never get to fill a
+ * large table, and flushing it costs a memset of its whole size.
+ */
+static void tlb_mmu_resize(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t new_size = old_size;
+    size_t rate;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool window_expired = now > desc->window_begin_ns + TLB_RESIZE_WINDOW_NS;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(desc->window_max_entries);
+        size_t expected_rate = desc->window_max_entries * 100 / MAX(ceil, 1);
+
+        /* Do not shrink to a size that would be grown back right away.  */
+        if (expected_rate > 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    g_free(env->tlb_table[mmu_idx]);
+    g_free(env->iotlb[mmu_idx]);
+    tlb_mmu_alloc(env, mmu_idx, new_size);
+    tlb_window_reset(desc, now, 0);
+    tlb_resize_count++;
+}
+#endif
+
+void tlb_init(CPUArchState *env)
+{
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_window_reset(&env->tlb_desc[mmu_idx], now, 0);
+        env->tlb_desc[mmu_idx].n_used_entries = 0;
+        tlb_mmu_alloc(env, mmu_idx, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+#endif
+    tlb_flush(env, 1);
+}
+
 void tlb_flush(CPUArchState *env, int flush_global)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    int i;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -64,22 +153,39 @@ void tlb_flush(CPUArchState *env, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    for (i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        uintptr_t i, n;
 
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+        tlb_mmu_resize(env, mmu_idx);
+        env->tlb_desc[mmu_idx].n_used_entries = 0;
+#endif
+        n = tlb_n_entries(env, mmu_idx);
+        for (i = 0; i < n; i++) {
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
+
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
     }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
+    env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *tlb_entry)
+{
+    return (tlb_entry->addr_read & tlb_entry->addr_write &
+            tlb_entry->addr_code & TLB_INVALID_MASK) != 0;
+}
+
+/* Return true if the entry was flushed.  */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -88,13 +194,14 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         *tlb_entry = s_cputlb_empty_entry;
+        return true;
     }
+    return false;
 }
 
 void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    int i;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
@@ -115,9 +222,23 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        uintptr_t i = tlb_index(env, mmu_idx, addr);
+
+        if (tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr)) {
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+            env->tlb_desc[mmu_idx].n_used_entries--;
+#endif
+        }
+    }
+
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
@@ -179,12 +300,17 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
 
         env = cpu->env_ptr;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            unsigned int i;
+            uintptr_t i, n = tlb_n_entries(env, mmu_idx);
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = 0; i < n; i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -200,14 +326,22 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 {
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        uintptr_t i = tlb_index(env, mmu_idx, vaddr);
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -278,9 +412,22 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(env, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+
+    /* do not discard the translation in te, evict it into the victim tlb */
+    if (!tlb_entry_is_empty(te)) {
+        unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    } else {
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+        env->tlb_desc[mmu_idx].n_used_entries++;
+#endif
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -320,8 +467,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     void *p;
     MemoryRegion *mr;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
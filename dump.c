@@ -11,6 +11,8 @@
  *
  */
 
+#include <zlib.h>
+
 #include "qemu-common.h"
 #include "elf.h"
 #include "cpu.h"
@@ -23,6 +25,10 @@
 #include "sysemu/memory_mapping.h"
 #include "sysemu/cpus.h"
 #include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qapi/qmp-input-visitor.h"
+#include "qapi-visit.h"
 #include "qmp-commands.h"
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
@@ -58,7 +64,24 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
-typedef struct DumpState {
+/* number of threads compressing the pages of a kdump-compressed dump */
+#define DUMP_COMPRESS_THREADS 4
+/* number of pages that are compressed before the results are written */
+#define DUMP_BATCH_PAGES 256
+/* size of the buffers for page descriptors and page data */
+#define DUMP_CACHE_SIZE (64 * TARGET_PAGE_SIZE)
+
+typedef struct DumpState DumpState;
+
+typedef struct DumpCompressWorker {
+    DumpState *s;
+    QemuThread thread;
+    QemuSemaphore start;
+    int index;
+    bool quit;
+} DumpCompressWorker;
+
+struct DumpState {
     GuestPhysBlockList guest_phys_blocks;
     ArchDumpInfo dump_info;
     MemoryMappingList list;
@@ -76,19 +99,66 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
-} DumpState;
+
+    DumpGuestMemoryFormat format;
+    bool detached;
+    QemuThread thread;
+    DumpStatus status;
+    Error *error;               /* why a detached dump failed */
+    int64_t total_size;         /* bytes of guest memory to dump */
+    int64_t written_size;       /* bytes of guest memory dumped so far */
+    int nr_cpus;
+
+    /* kdump-compressed format */
+    uint64_t max_mapnr;         /* highest guest pfn + 1 */
+    size_t len_dump_bitmap;     /* size of each of the two bitmaps */
+    uint64_t num_dumpable;      /* number of pages in the dump */
+    off_t offset_dump_bitmap;
+    off_t offset_page;
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+
+    /* the batch of pages being compressed by the workers */
+    DumpCompressWorker *workers;
+    int nr_workers;
+    QemuSemaphore batch_done;
+    int batch_count;
+    size_t compress_bound;
+    const uint8_t *batch_src[DUMP_BATCH_PAGES];
+    size_t batch_len[DUMP_BATCH_PAGES];     /* 0 for a zero page */
+    bool batch_compressed[DUMP_BATCH_PAGES];
+    uint8_t *batch_buf;         /* compressed pages */
+    uint8_t *batch_copy;        /* pages only partly backed by a block */
+};
+
+static DumpState dump_state_global = { .status = DUMP_STATUS_NONE };
+
+/* how much guest memory a dump in the monitor coroutine writes between
+ * two trips through the main loop
+ */
+#define DUMP_YIELD_SIZE     (16 * 1024 * 1024)
+
+static void dump_stop_workers(DumpState *s);
 
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
 
+    dump_stop_workers(s);
     guest_phys_blocks_free(&s->guest_phys_blocks);
     memory_mapping_list_free(&s->list);
     if (s->fd != -1) {
         close(s->fd);
+        s->fd = -1;
     }
     if (s->resume) {
+        if (s->detached) {
+            qemu_mutex_lock_iothread();
+        }
         vm_start();
+        if (s->detached) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 
     return ret;
@@ -271,7 +341,7 @@ static inline int cpu_index(CPUState *cpu)
     return cpu->cpu_index + 1;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(WriteCoreDumpFunction f, DumpState *s)
 {
     CPUState *cpu;
     int ret;
@@ -279,7 +349,7 @@ static int write_elf64_notes(DumpState *s)
 
     CPU_FOREACH(cpu) {
         id = cpu_index(cpu);
-        ret = cpu_write_elf64_note(fd_write_vmcore, cpu, id, s);
+        ret = cpu_write_elf64_note(f, cpu, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -287,7 +357,7 @@ static int write_elf64_notes(DumpState *s)
     }
 
     CPU_FOREACH(cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, cpu, s);
+        ret = cpu_write_elf64_qemunote(f, cpu, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -321,7 +391,7 @@ static int write_elf32_note(DumpState *s)
     return 0;
 }
 
-static int write_elf32_notes(DumpState *s)
+static int write_elf32_notes(WriteCoreDumpFunction f, DumpState *s)
 {
     CPUState *cpu;
     int ret;
@@ -329,7 +399,7 @@ static int write_elf32_notes(DumpState *s)
 
     CPU_FOREACH(cpu) {
         id = cpu_index(cpu);
-        ret = cpu_write_elf32_note(fd_write_vmcore, cpu, id, s);
+        ret = cpu_write_elf32_note(f, cpu, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -337,7 +407,7 @@ static int write_elf32_notes(DumpState *s)
     }
 
     CPU_FOREACH(cpu) {
-        ret = cpu_write_elf32_qemunote(fd_write_vmcore, cpu, s);
+        ret = cpu_write_elf32_qemunote(f, cpu, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -390,6 +460,18 @@ static int write_data(DumpState *s, void *buf, int length)
     return 0;
 }
 
+/* account for @size bytes of guest memory written to the vmcore */
+static void dump_progress(DumpState *s, int64_t size)
+{
+    int64_t before = s->written_size;
+
+    s->written_size += size;
+    if (!s->detached && qemu_in_coroutine() &&
+        before / DUMP_YIELD_SIZE != s->written_size / DUMP_YIELD_SIZE) {
+        monitor_co_yield();
+    }
+}
+
 /* write the memroy to vmcore. 1 page per I/O. */
 static int write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
                         int64_t size)
@@ -403,6 +485,7 @@ static int write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
         if (ret < 0) {
             return ret;
         }
+        dump_progress(s, TARGET_PAGE_SIZE);
     }
 
     if ((size % TARGET_PAGE_SIZE) != 0) {
@@ -411,6 +494,7 @@ static int write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
         if (ret < 0) {
             return ret;
         }
+        dump_progress(s, size % TARGET_PAGE_SIZE);
     }
 
     return 0;
@@ -574,7 +658,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -597,7 +681,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf32_notes(s) < 0) {
+        if (write_elf32_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
     }
@@ -686,6 +770,722 @@ static int create_vmcore(DumpState *s)
     return 0;
 }
 
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    /* note_buf is not enough */
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+
+    return 0;
+}
+
+/* write a buffer in the flattened format, @offset is its place in the file */
+static int write_buffer(int fd, off_t offset, const void *buf, size_t size)
+{
+    MakedumpfileDataHeader mdh;
+    size_t written_size;
+
+    mdh.offset = cpu_to_be64(offset);
+    mdh.buf_size = cpu_to_be64(size);
+
+    written_size = qemu_write_full(fd, &mdh, sizeof(mdh));
+    if (written_size != sizeof(mdh)) {
+        return -1;
+    }
+
+    written_size = qemu_write_full(fd, buf, size);
+    if (written_size != size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_start_flat_header(int fd)
+{
+    uint8_t *buf;
+    MakedumpfileHeader mh;
+    size_t written_size;
+    int ret = 0;
+
+    memset(&mh, 0, sizeof(mh));
+    strncpy(mh.signature, MAKEDUMPFILE_SIGNATURE, sizeof(mh.signature));
+    mh.type = cpu_to_be64(TYPE_FLAT_HEADER);
+    mh.version = cpu_to_be64(VERSION_FLAT_HEADER);
+
+    buf = g_malloc0(MAX_SIZE_MDF_HEADER);
+    memcpy(buf, &mh, sizeof(mh));
+
+    written_size = qemu_write_full(fd, buf, MAX_SIZE_MDF_HEADER);
+    if (written_size != MAX_SIZE_MDF_HEADER) {
+        ret = -1;
+    }
+
+    g_free(buf);
+    return ret;
+}
+
+static int write_end_flat_header(int fd)
+{
+    MakedumpfileDataHeader mdh;
+    size_t written_size;
+
+    mdh.offset = END_FLAG_FLAT_HEADER;
+    mdh.buf_size = END_FLAG_FLAT_HEADER;
+
+    written_size = qemu_write_full(fd, &mdh, sizeof(mdh));
+    if (written_size != sizeof(mdh)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static const char *dump_machine_name(DumpState *s)
+{
+    switch (s->dump_info.d_machine) {
+    case EM_X86_64:
+        return "x86_64";
+    case EM_386:
+        return "i686";
+    case EM_PPC64:
+        return "ppc64";
+    case EM_S390:
+        return "s390x";
+    default:
+        return "";
+    }
+}
+
+/* write common header, sub header and elf note to vmcore */
+static int create_header32(DumpState *s)
+{
+    int ret = 0;
+    DiskDumpHeader32 *dh = NULL;
+    KdumpSubHeader32 *kh = NULL;
+    size_t size;
+    int endian = s->dump_info.d_endian;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t status = 0;
+    uint64_t offset_note;
+
+    /* write common header, the version of kdump-compressed format is 6th */
+    size = sizeof(DiskDumpHeader32);
+    dh = g_malloc0(size);
+
+    strncpy(dh->signature, KDUMP_SIGNATURE, strlen(KDUMP_SIGNATURE));
+    dh->header_version = cpu_convert_to_target32(6, endian);
+    block_size = TARGET_PAGE_SIZE;
+    dh->block_size = cpu_convert_to_target32(block_size, endian);
+    sub_hdr_size = sizeof(struct KdumpSubHeader32) + s->note_size;
+    sub_hdr_size = DIV_ROUND_UP(sub_hdr_size, block_size);
+    dh->sub_hdr_size = cpu_convert_to_target32(sub_hdr_size, endian);
+    /* dh->max_mapnr may be truncated, full 64bit is in kh.max_mapnr_64 */
+    dh->max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                            endian);
+    dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+    bitmap_blocks = DIV_ROUND_UP(s->len_dump_bitmap, block_size) * 2;
+    dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    strncpy(dh->utsname.machine, dump_machine_name(s),
+            sizeof(dh->utsname.machine) - 1);
+
+    status |= DUMP_DH_COMPRESSED_ZLIB;
+    dh->status = cpu_convert_to_target32(status, endian);
+
+    if (write_buffer(s->fd, 0, dh, size) < 0) {
+        dump_error(s, "dump: failed to write disk dump header.\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* write sub header */
+    size = sizeof(KdumpSubHeader32);
+    kh = g_malloc0(size);
+
+    /* 64bit max_mapnr_64 */
+    kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    kh->phys_base = cpu_convert_to_target32(PHYS_BASE, endian);
+    kh->dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+
+    offset_note = DISKDUMP_HEADER_BLOCKS * block_size + size;
+    kh->offset_note = cpu_convert_to_target64(offset_note, endian);
+    kh->note_size = cpu_convert_to_target32(s->note_size, endian);
+
+    if (write_buffer(s->fd, DISKDUMP_HEADER_BLOCKS * block_size, kh,
+                     size) < 0) {
+        dump_error(s, "dump: failed to write kdump sub header.\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* write note */
+    s->note_buf = g_malloc0(s->note_size);
+    s->note_buf_offset = 0;
+
+    /* use s->note_buf to store notes temporarily */
+    if (write_elf32_notes(buf_write_note, s) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (write_buffer(s->fd, offset_note, s->note_buf, s->note_size) < 0) {
+        dump_error(s, "dump: failed to write notes.\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* get offset of dump_bitmap */
+    s->offset_dump_bitmap = (DISKDUMP_HEADER_BLOCKS + sub_hdr_size) *
+                            block_size;
+
+    /* get offset of page */
+    s->offset_page = (DISKDUMP_HEADER_BLOCKS + sub_hdr_size + bitmap_blocks) *
+                     block_size;
+
+out:
+    g_free(dh);
+    g_free(kh);
+    g_free(s->note_buf);
+    s->note_buf = NULL;
+
+    return ret;
+}
+
+/* write common header, sub header and elf note to vmcore */
+static int create_header64(DumpState *s)
+{
+    int ret = 0;
+    DiskDumpHeader64 *dh = NULL;
+    KdumpSubHeader64 *kh = NULL;
+    size_t size;
+    int endian = s->dump_info.d_endian;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t status = 0;
+    uint64_t offset_note;
+
+    /* write common header, the version of kdump-compressed format is 6th */
+    size = sizeof(DiskDumpHeader64);
+    dh = g_malloc0(size);
+
+    strncpy(dh->signature, KDUMP_SIGNATURE, strlen(KDUMP_SIGNATURE));
+    dh->header_version = cpu_convert_to_target32(6, endian);
+    block_size = TARGET_PAGE_SIZE;
+    dh->block_size = cpu_convert_to_target32(block_size, endian);
+    sub_hdr_size = sizeof(struct KdumpSubHeader64) + s->note_size;
+    sub_hdr_size = DIV_ROUND_UP(sub_hdr_size, block_size);
+    dh->sub_hdr_size = cpu_convert_to_target32(sub_hdr_size, endian);
+    /* dh->max_mapnr may be truncated, full 64bit is in kh.max_mapnr_64 */
+    dh->max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                            endian);
+    dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+    bitmap_blocks = DIV_ROUND_UP(s->len_dump_bitmap, block_size) * 2;
+    dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    strncpy(dh->utsname.machine, dump_machine_name(s),
+            sizeof(dh->utsname.machine) - 1);
+
+    status |= DUMP_DH_COMPRESSED_ZLIB;
+    dh->status = cpu_convert_to_target32(status, endian);
+
+    if (write_buffer(s->fd, 0, dh, size) < 0) {
+        dump_error(s, "dump: failed to write disk dump header.\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* write sub header */
+    size = sizeof(KdumpSubHeader64);
+    kh = g_malloc0(size);
+
+    /* 64bit max_mapnr_64 */
+    kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    kh->phys_base = cpu_convert_to_target64(PHYS_BASE, endian);
+    kh->dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+
+    offset_note = DISKDUMP_HEADER_BLOCKS * block_size + size;
+    kh->offset_note = cpu_convert_to_target64(offset_note, endian);
+    kh->note_size = cpu_convert_to_target64(s->note_size, endian);
+
+    if (write_buffer(s->fd, DISKDUMP_HEADER_BLOCKS * block_size, kh,
+                     size) < 0) {
+        dump_error(s, "dump: failed to write kdump sub header.\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* write note */
+    s->note_buf = g_malloc0(s->note_size);
+    s->note_buf_offset = 0;
+
+    /* use s->note_buf to store notes temporarily */
+    if (write_elf64_notes(buf_write_note, s) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (write_buffer(s->fd, offset_note, s->note_buf, s->note_size) < 0) {
+        dump_error(s, "dump: failed to write notes.\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* get offset of dump_bitmap */
+    s->offset_dump_bitmap = (DISKDUMP_HEADER_BLOCKS + sub_hdr_size) *
+                            block_size;
+
+    /* get offset of page */
+    s->offset_page = (DISKDUMP_HEADER_BLOCKS + sub_hdr_size + bitmap_blocks) *
+                     block_size;
+
+out:
+    g_free(dh);
+    g_free(kh);
+    g_free(s->note_buf);
+    s->note_buf = NULL;
+
+    return ret;
+}
+
+static int write_dump_header(DumpState *s)
+{
+    if (s->dump_info.d_class == ELFCLASS32) {
+        return create_header32(s);
+    } else {
+        return create_header64(s);
+    }
+}
+
+static bool dump_bitmap_test(const uint8_t *bitmap, uint64_t pfn)
+{
+    return bitmap[pfn / CHAR_BIT] & (1 << (pfn % CHAR_BIT));
+}
+
+/*
+ * Set a bit for every page backed by guest memory, even partly, and write
+ * the bitmap out twice: makedumpfile keeps a bitmap of the valid pages and
+ * one of the dumped pages, and all valid pages are dumped here.
+ */
+static int write_dump_bitmap(DumpState *s, uint8_t *bitmap)
+{
+    GuestPhysBlock *block;
+    uint64_t pfn, first, last;
+
+    s->num_dumpable = 0;
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        first = block->target_start >> TARGET_PAGE_BITS;
+        last = (block->target_end - 1) >> TARGET_PAGE_BITS;
+        for (pfn = first; pfn <= last; pfn++) {
+            if (!dump_bitmap_test(bitmap, pfn)) {
+                bitmap[pfn / CHAR_BIT] |= 1 << (pfn % CHAR_BIT);
+                s->num_dumpable++;
+            }
+        }
+    }
+    s->total_size = s->num_dumpable * TARGET_PAGE_SIZE;
+
+    if (write_buffer(s->fd, s->offset_dump_bitmap, bitmap,
+                     s->len_dump_bitmap) < 0 ||
+        write_buffer(s->fd, s->offset_dump_bitmap + s->len_dump_bitmap,
+                     bitmap, s->len_dump_bitmap) < 0) {
+        dump_error(s, "dump: failed to write dump_bitmap.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the contents of page @pfn.  @cursor walks the guest physical
+ * blocks, so the pages must be requested in ascending order.  A page that
+ * is only partly backed by guest memory is assembled in @copy.
+ */
+static const uint8_t *dump_get_page(uint64_t pfn, GuestPhysBlock **cursor,
+                                    uint8_t *copy)
+{
+    hwaddr addr = pfn << TARGET_PAGE_BITS;
+    GuestPhysBlock *block = *cursor;
+    hwaddr start, end;
+
+    while (block->target_end <= addr) {
+        block = QTAILQ_NEXT(block, next);
+    }
+    *cursor = block;
+
+    if (block->target_start <= addr &&
+        block->target_end >= addr + TARGET_PAGE_SIZE) {
+        return block->host_addr + (addr - block->target_start);
+    }
+
+    memset(copy, 0, TARGET_PAGE_SIZE);
+    for (; block && block->target_start < addr + TARGET_PAGE_SIZE;
+         block = QTAILQ_NEXT(block, next)) {
+        start = MAX(addr, block->target_start);
+        end = MIN(addr + TARGET_PAGE_SIZE, block->target_end);
+        memcpy(copy + (start - addr),
+               block->host_addr + (start - block->target_start),
+               end - start);
+    }
+
+    return copy;
+}
+
+static void dump_compress_batch(DumpState *s, int index)
+{
+    uint8_t *dst;
+    uLongf len;
+    int i;
+
+    for (i = index; i < s->batch_count; i += s->nr_workers) {
+        if (buffer_is_zero(s->batch_src[i], TARGET_PAGE_SIZE)) {
+            s->batch_len[i] = 0;
+            continue;
+        }
+
+        dst = s->batch_buf + i * s->compress_bound;
+        len = s->compress_bound;
+        if (compress2(dst, &len, s->batch_src[i], TARGET_PAGE_SIZE,
+                      Z_BEST_SPEED) == Z_OK && len < TARGET_PAGE_SIZE) {
+            s->batch_len[i] = len;
+            s->batch_compressed[i] = true;
+        } else {
+            /* not worth it, store the page as it is */
+            s->batch_len[i] = TARGET_PAGE_SIZE;
+            s->batch_compressed[i] = false;
+        }
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressWorker *w = opaque;
+    DumpState *s = w->s;
+
+    for (;;) {
+        qemu_sem_wait(&w->start);
+        if (w->quit) {
+            break;
+        }
+        dump_compress_batch(s, w->index);
+        qemu_sem_post(&s->batch_done);
+    }
+
+    return NULL;
+}
+
+static void dump_start_workers(DumpState *s)
+{
+    DumpCompressWorker *w;
+    int i;
+
+    s->compress_bound = compressBound(TARGET_PAGE_SIZE);
+    s->batch_buf = g_malloc(DUMP_BATCH_PAGES * s->compress_bound);
+    s->batch_copy = g_malloc(DUMP_BATCH_PAGES * TARGET_PAGE_SIZE);
+    s->batch_count = 0;
+    qemu_sem_init(&s->batch_done, 0);
+
+    s->nr_workers = DUMP_COMPRESS_THREADS;
+    s->workers = g_new0(DumpCompressWorker, s->nr_workers);
+    for (i = 0; i < s->nr_workers; i++) {
+        w = &s->workers[i];
+        w->s = s;
+        w->index = i;
+        qemu_sem_init(&w->start, 0);
+        qemu_thread_create(&w->thread, dump_compress_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_stop_workers(DumpState *s)
+{
+    DumpCompressWorker *w;
+    int i;
+
+    if (!s->workers) {
+        return;
+    }
+
+    for (i = 0; i < s->nr_workers; i++) {
+        w = &s->workers[i];
+        w->quit = true;
+        qemu_sem_post(&w->start);
+        qemu_thread_join(&w->thread);
+        qemu_sem_destroy(&w->start);
+    }
+    qemu_sem_destroy(&s->batch_done);
+
+    g_free(s->workers);
+    s->workers = NULL;
+    g_free(s->batch_buf);
+    s->batch_buf = NULL;
+    g_free(s->batch_copy);
+    s->batch_copy = NULL;
+}
+
+typedef struct DataCache {
+    int fd;             /* fd of the file where to write the cached data */
+    uint8_t *buf;       /* buffer for cached data */
+    size_t buf_size;    /* size of the buf */
+    size_t data_size;   /* size of cached data in buf */
+    off_t offset;       /* offset of the file */
+} DataCache;
+
+static void prepare_data_cache(DataCache *data_cache, DumpState *s,
+                               off_t offset)
+{
+    data_cache->fd = s->fd;
+    data_cache->data_size = 0;
+    data_cache->buf_size = DUMP_CACHE_SIZE;
+    data_cache->buf = g_malloc0(DUMP_CACHE_SIZE);
+    data_cache->offset = offset;
+}
+
+static int write_cache(DataCache *dc, const void *buf, size_t size,
+                       bool flag_sync)
+{
+    /*
+     * dc->buf_size should not be less than size, otherwise dc will never be
+     * enough
+     */
+    assert(size <= dc->buf_size);
+
+    /*
+     * if flag_sync is set, synchronize data in dc->buf into vmcore.
+     * otherwise check if the space is enough for caching data in buf, if not,
+     * write the data in dc->buf to dc->fd and reset dc->buf
+     */
+    if ((!flag_sync && dc->data_size + size > dc->buf_size) ||
+        (flag_sync && dc->data_size > 0)) {
+        if (write_buffer(dc->fd, dc->offset, dc->buf, dc->data_size) < 0) {
+            return -1;
+        }
+
+        dc->offset += dc->data_size;
+        dc->data_size = 0;
+    }
+
+    if (!flag_sync) {
+        memcpy(dc->buf + dc->data_size, buf, size);
+        dc->data_size += size;
+    }
+
+    return 0;
+}
+
+static void free_data_cache(DataCache *data_cache)
+{
+    g_free(data_cache->buf);
+}
+
+/* let the workers compress the batch, then write it out in order */
+static int dump_flush_batch(DumpState *s, DataCache *page_desc,
+                            DataCache *page_data, PageDescriptor *pd_zero,
+                            off_t *offset_data)
+{
+    int endian = s->dump_info.d_endian;
+    PageDescriptor pd;
+    const void *data;
+    int i;
+
+    for (i = 0; i < s->nr_workers; i++) {
+        qemu_sem_post(&s->workers[i].start);
+    }
+    for (i = 0; i < s->nr_workers; i++) {
+        qemu_sem_wait(&s->batch_done);
+    }
+
+    for (i = 0; i < s->batch_count; i++) {
+        if (s->batch_len[i] == 0) {
+            /* all zero pages share the page written first */
+            if (write_cache(page_desc, pd_zero, sizeof(*pd_zero), false) < 0) {
+                return -1;
+            }
+        } else {
+            if (s->batch_compressed[i]) {
+                pd.flags = cpu_convert_to_target32(DUMP_DH_COMPRESSED_ZLIB,
+                                                   endian);
+                data = s->batch_buf + i * s->compress_bound;
+            } else {
+                pd.flags = cpu_convert_to_target32(0, endian);
+                data = s->batch_src[i];
+            }
+            pd.size = cpu_convert_to_target32(s->batch_len[i], endian);
+            pd.page_flags = cpu_convert_to_target64(0, endian);
+            pd.offset = cpu_convert_to_target64(*offset_data, endian);
+            *offset_data += s->batch_len[i];
+
+            if (write_cache(page_desc, &pd, sizeof(pd), false) < 0 ||
+                write_cache(page_data, data, s->batch_len[i], false) < 0) {
+                return -1;
+            }
+        }
+        dump_progress(s, TARGET_PAGE_SIZE);
+    }
+    s->batch_count = 0;
+
+    return 0;
+}
+
+/*
+ * The page descriptors, one per bit set in the bitmap, come first and are
+ * followed by the page data.  Zero pages are not stored, their descriptors
+ * point to a single zero page at the start of the data.
+ */
+static int write_dump_pages(DumpState *s, const uint8_t *bitmap)
+{
+    int ret = 0;
+    int endian = s->dump_info.d_endian;
+    DataCache page_desc, page_data;
+    PageDescriptor pd_zero;
+    GuestPhysBlock *cursor;
+    uint8_t *zero_page;
+    off_t offset_desc, offset_data;
+    uint64_t pfn;
+
+    /* get offset of page_desc and page_data in dump file */
+    offset_desc = s->offset_page;
+    offset_data = offset_desc + sizeof(PageDescriptor) * s->num_dumpable;
+
+    prepare_data_cache(&page_desc, s, offset_desc);
+    prepare_data_cache(&page_data, s, offset_data);
+
+    /* prepare zero page */
+    zero_page = g_malloc0(TARGET_PAGE_SIZE);
+    pd_zero.size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    pd_zero.flags = cpu_convert_to_target32(0, endian);
+    pd_zero.offset = cpu_convert_to_target64(offset_data, endian);
+    pd_zero.page_flags = cpu_convert_to_target64(0, endian);
+    ret = write_cache(&page_data, zero_page, TARGET_PAGE_SIZE, false);
+    g_free(zero_page);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write page data(zero page).\n");
+        goto out;
+    }
+    offset_data += TARGET_PAGE_SIZE;
+
+    dump_start_workers(s);
+
+    cursor = QTAILQ_FIRST(&s->guest_phys_blocks.head);
+    for (pfn = 0; pfn < s->max_mapnr; pfn++) {
+        if (!bitmap[pfn / CHAR_BIT]) {
+            pfn |= CHAR_BIT - 1;
+            continue;
+        }
+        if (!dump_bitmap_test(bitmap, pfn)) {
+            continue;
+        }
+
+        s->batch_src[s->batch_count] =
+            dump_get_page(pfn, &cursor,
+                          s->batch_copy + s->batch_count * TARGET_PAGE_SIZE);
+        if (++s->batch_count == DUMP_BATCH_PAGES) {
+            ret = dump_flush_batch(s, &page_desc, &page_data, &pd_zero,
+                                   &offset_data);
+            if (ret < 0) {
+                dump_error(s, "dump: failed to write page data.\n");
+                goto out;
+            }
+        }
+    }
+
+    if (s->batch_count) {
+        ret = dump_flush_batch(s, &page_desc, &page_data, &pd_zero,
+                               &offset_data);
+        if (ret < 0) {
+            dump_error(s, "dump: failed to write page data.\n");
+            goto out;
+        }
+    }
+
+    ret = write_cache(&page_desc, NULL, 0, true);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to sync cache for page_desc.\n");
+        goto out;
+    }
+    ret = write_cache(&page_data, NULL, 0, true);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to sync cache for page_data.\n");
+        goto out;
+    }
+
+out:
+    free_data_cache(&page_desc);
+    free_data_cache(&page_data);
+
+    return ret;
+}
+
+static int create_kdump_vmcore(DumpState *s)
+{
+    uint8_t *bitmap;
+    int ret;
+
+    /*
+     * the kdump-compressed format is:
+     *                                               File offset
+     *  +------------------------------------------+ 0x0
+     *  |    main header (struct disk_dump_header) |
+     *  |------------------------------------------+ block 1
+     *  |    sub header (struct kdump_sub_header)  |
+     *  |------------------------------------------+ block 2
+     *  |            1st-dump_bitmap               |
+     *  |------------------------------------------+ block 2 + X blocks
+     *  |            2nd-dump_bitmap               | (aligned by block)
+     *  |------------------------------------------+ block 2 + 2 * X blocks
+     *  |  page desc for pfn 0 (struct page_desc)  | (aligned by block)
+     *  |  page desc for pfn 1 (struct page_desc)  |
+     *  |                    :                     |
+     *  |------------------------------------------| (not aligned by block)
+     *  |         page data (pfn 0)                |
+     *  |         page data (pfn 1)                |
+     *  |                        :                 |
+     *  +------------------------------------------+
+     */
+
+    ret = write_start_flat_header(s->fd);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write start flat header.\n");
+        return -1;
+    }
+
+    ret = write_dump_header(s);
+    if (ret < 0) {
+        return -1;
+    }
+
+    bitmap = g_malloc0(s->len_dump_bitmap);
+
+    ret = write_dump_bitmap(s, bitmap);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = write_dump_pages(s, bitmap);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = write_end_flat_header(s->fd);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write end flat header.\n");
+        goto out;
+    }
+
+    dump_completed(s);
+
+out:
+    g_free(bitmap);
+    return ret;
+}
+
 static ram_addr_t get_start_block(DumpState *s)
 {
     GuestPhysBlock *block;
@@ -714,10 +1514,32 @@ static ram_addr_t get_start_block(DumpState *s)
     return -1;
 }
 
+/* number of bytes of guest memory that the dump covers */
+static int64_t dump_calculate_size(DumpState *s)
+{
+    GuestPhysBlock *block;
+    int64_t start, end, total = 0;
+
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        start = block->target_start;
+        end = block->target_end;
+        if (s->has_filter) {
+            start = MAX(start, s->begin);
+            end = MIN(end, s->begin + s->length);
+        }
+        if (start < end) {
+            total += end - start;
+        }
+    }
+
+    return total;
+}
+
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
                      int64_t begin, int64_t length, Error **errp)
 {
     CPUState *cpu;
+    GuestPhysBlock *last_block;
     int nr_cpus;
     Error *err = NULL;
     int ret;
@@ -738,6 +1560,7 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         nr_cpus++;
     }
 
+    s->nr_cpus = nr_cpus;
     s->errp = errp;
     s->fd = fd;
     s->has_filter = has_filter;
@@ -752,6 +1575,7 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         error_set(errp, QERR_INVALID_PARAMETER, "begin");
         goto cleanup;
     }
+    s->total_size = dump_calculate_size(s);
 
     /* get dump info: endian, class and architecture.
      * If the target architecture is not supported, cpu_get_dump_info() will
@@ -786,6 +1610,15 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         memory_mapping_filter(&s->list, s->begin, s->length);
     }
 
+    if (s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        last_block = QTAILQ_LAST(&s->guest_phys_blocks.head,
+                                 GuestPhysBlockHead);
+        s->max_mapnr = DIV_ROUND_UP(last_block->target_end, TARGET_PAGE_SIZE);
+        s->len_dump_bitmap = ROUND_UP(DIV_ROUND_UP(s->max_mapnr, CHAR_BIT),
+                                      TARGET_PAGE_SIZE);
+        return 0;
+    }
+
     /*
      * calculate phdr_num
      *
@@ -840,15 +1673,55 @@ cleanup:
     return -1;
 }
 
+static void dump_process(DumpState *s, Error **errp)
+{
+    int ret;
+
+    if (s->format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        ret = create_vmcore(s);
+    } else {
+        ret = create_kdump_vmcore(s);
+    }
+
+    if (ret < 0 && !error_is_set(errp)) {
+        error_set(errp, QERR_IO_ERROR);
+    }
+
+    atomic_mb_set(&s->status,
+                  ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    dump_process(s, &s->error);
+    return NULL;
+}
+
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
+                           bool has_detach, bool detach,
+                           bool has_format, DumpGuestMemoryFormat format,
                            Error **errp)
 {
     const char *p;
     int fd = -1;
-    DumpState *s;
+    DumpState *s = &dump_state_global;
     int ret;
 
+    if (atomic_mb_read(&s->status) == DUMP_STATUS_ACTIVE) {
+        error_setg(errp, "There's a dump in process");
+        return;
+    }
+
+    if (has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF &&
+        (paging || has_begin || has_length)) {
+        error_setg(errp, "kdump-compressed format doesn't support paging or "
+                   "filter");
+        return;
+    }
+
     if (has_begin && !has_length) {
         error_set(errp, QERR_MISSING_PARAMETER, "length");
         return;
@@ -880,17 +1753,99 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc0(sizeof(DumpState));
+    error_free(s->error);
+    memset(s, 0, sizeof(*s));
+    s->format = has_format ? format : DUMP_GUEST_MEMORY_FORMAT_ELF;
+    s->detached = has_detach && detach;
+    atomic_mb_set(&s->status, DUMP_STATUS_ACTIVE);
 
     ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
     if (ret < 0) {
-        g_free(s);
+        atomic_mb_set(&s->status, DUMP_STATUS_FAILED);
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
-        error_set(errp, QERR_IO_ERROR);
+    if (s->detached) {
+        /* the guest stays stopped, only the monitor gets back control */
+        s->errp = &s->error;
+        qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_DETACHED);
+    } else {
+        dump_process(s, errp);
+    }
+}
+
+/*
+ * QMP handler that runs in a coroutine (MONITOR_CMD_COROUTINE): a dump
+ * that is not detached returns to the main loop every DUMP_YIELD_SIZE
+ * bytes, so the monitor answers again only when the dump is complete but
+ * the rest of QEMU keeps running meanwhile.
+ */
+int qmp_co_dump_guest_memory(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data, Error **errp)
+{
+    QmpInputVisitor *mi;
+    Visitor *v;
+    Error *local_err = NULL;
+    bool paging = false;
+    char *protocol = NULL;
+    bool has_begin = false, has_length = false;
+    bool has_detach = false, has_format = false;
+    int64_t begin = 0, length = 0;
+    bool detach = false;
+    DumpGuestMemoryFormat format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+
+    mi = qmp_input_visitor_new_strict(QOBJECT(qdict));
+    v = qmp_input_get_visitor(mi);
+    visit_type_bool(v, &paging, "paging", &local_err);
+    visit_type_str(v, &protocol, "protocol", &local_err);
+    visit_start_optional(v, &has_begin, "begin", &local_err);
+    if (has_begin) {
+        visit_type_int(v, &begin, "begin", &local_err);
+    }
+    visit_end_optional(v, &local_err);
+    visit_start_optional(v, &has_length, "length", &local_err);
+    if (has_length) {
+        visit_type_int(v, &length, "length", &local_err);
+    }
+    visit_end_optional(v, &local_err);
+    visit_start_optional(v, &has_detach, "detach", &local_err);
+    if (has_detach) {
+        visit_type_bool(v, &detach, "detach", &local_err);
+    }
+    visit_end_optional(v, &local_err);
+    visit_start_optional(v, &has_format, "format", &local_err);
+    if (has_format) {
+        visit_type_DumpGuestMemoryFormat(v, &format, "format", &local_err);
+    }
+    visit_end_optional(v, &local_err);
+    qmp_input_visitor_cleanup(mi);
+
+    if (!local_err) {
+        qmp_dump_guest_memory(paging, protocol, has_begin, begin,
+                              has_length, length, has_detach, detach,
+                              has_format, format, &local_err);
+    }
+    g_free(protocol);
+
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -1;
+    }
+    return 0;
+}
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpState *s = &dump_state_global;
+    DumpQueryResult *result = g_new0(DumpQueryResult, 1);
+
+    result->status = atomic_mb_read(&s->status);
+    result->completed = s->written_size;
+    result->total = s->total_size;
+    if (result->status == DUMP_STATUS_FAILED && s->error) {
+        result->has_error = true;
+        result->error = g_strdup(error_get_pretty(s->error));
     }
 
-    g_free(s);
+    return result;
 }
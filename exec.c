@@ -36,6 +36,9 @@
 #include "qemu/timer.h"
 #include "qemu/config-file.h"
 #include "exec/memory.h"
+#include "qemu/rcu.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
 #include "sysemu/dma.h"
 #include "exec/address-spaces.h"
 #if defined(CONFIG_USER_ONLY)
@@ -91,6 +94,8 @@ struct PhysPageEntry {
 typedef PhysPageEntry Node[L2_SIZE];
 
 struct AddressSpaceDispatch {
+    struct rcu_head rcu;
+
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -100,6 +105,19 @@ struct AddressSpaceDispatch {
     AddressSpace *as;
 };
 
+/* Number of address_space_map() bounce pages each address space can have
+ * outstanding at once, for DMA to memory that is not directly accessible.
+ */
+#define BOUNCE_BUFFERS 16
+
+typedef struct BounceBuffer {
+    MemoryRegion *mr;
+    void *buffer;
+    hwaddr addr;
+    hwaddr len;
+    bool in_use;
+} BounceBuffer;
+
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
@@ -114,6 +132,8 @@ typedef struct subpage_t {
 #define PHYS_SECTION_WATCH 3
 
 typedef struct PhysPageMap {
+    struct rcu_head rcu;
+
     unsigned sections_nb;
     unsigned sections_nb_alloc;
     unsigned nodes_nb;
@@ -264,6 +284,9 @@ address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *x
     return section;
 }
 
+/* Called from RCU critical section, or with the iothread mutex held.  The
+ * returned MemoryRegion is only valid for as long as either is the case.
+ */
 MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
                                       hwaddr *xlat, hwaddr *plen,
                                       bool is_write)
@@ -274,7 +297,8 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     hwaddr len = *plen;
 
     for (;;) {
-        section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
+        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        section = address_space_translate_internal(d, addr, &addr, plen, true);
         mr = section->mr;
 
         if (!mr->iommu_ops) {
@@ -381,6 +405,7 @@ void cpu_exec_init(CPUArchState *env)
     QTAILQ_INIT(&env->watchpoints);
 #ifndef CONFIG_USER_ONLY
     cpu->thread_id = qemu_get_thread_id();
+    tlb_init(env);
 #endif
     QTAILQ_INSERT_TAIL(&cpus, cpu, node);
 #if defined(CONFIG_USER_ONLY)
@@ -681,6 +706,127 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/* Note: start and length must be page aligned and within the same ram
+ * block.  @bitmap is indexed by ram_addr_t page number.  Returns the number
+ * of bits newly set in @bitmap.  */
+uint64_t cpu_physical_memory_sync_dirty_bitmap(ram_addr_t start,
+                                               ram_addr_t length,
+                                               int dirty_flag,
+                                               unsigned long *bitmap)
+{
+    /* dirty_flag replicated into every byte of a long */
+    const unsigned long mask = (~0UL / 0xff) * (uint8_t)dirty_flag;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = (start + length) >> TARGET_PAGE_BITS;
+    uint64_t num_dirty = 0;
+    bool found = false;
+
+    assert(!(start & ~TARGET_PAGE_MASK) && !(length & ~TARGET_PAGE_MASK));
+
+    while (page < end) {
+        if (page % sizeof(unsigned long) == 0 &&
+            end - page >= sizeof(unsigned long)) {
+            /* Check the flags of sizeof(long) pages with a single load */
+            unsigned long *flags =
+                (unsigned long *)&ram_list.phys_dirty[page];
+            unsigned long dirty = *flags & mask;
+
+            if (dirty) {
+                unsigned long *word = &bitmap[BIT_WORD(page)];
+                unsigned long bits = 0;
+                int i;
+
+                *flags &= ~mask;
+                for (i = 0; i < sizeof(unsigned long); i++) {
+                    if (((uint8_t *)&dirty)[i]) {
+                        bits |= 1UL << i;
+                    }
+                }
+                bits <<= page % BITS_PER_LONG;
+                num_dirty += ctpopl(bits & ~*word);
+                *word |= bits;
+                found = true;
+            }
+            page += sizeof(unsigned long);
+        } else {
+            if (ram_list.phys_dirty[page] & dirty_flag) {
+                ram_list.phys_dirty[page] &= ~dirty_flag;
+                if (!test_and_set_bit(page, bitmap)) {
+                    num_dirty++;
+                }
+                found = true;
+            }
+            page++;
+        }
+    }
+
+    if (found && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, start + length, length);
+    }
+    return num_dirty;
+}
+
+struct DirtyBitmapSnapshot {
+    ram_addr_t start;
+    ram_addr_t end;
+    unsigned long dirty[];
+};
+
+/* Note: start and end must be within the same ram block.  */
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty(
+    ram_addr_t start, ram_addr_t length, int dirty_flag)
+{
+    const unsigned long mask = (~0UL / 0xff) * (uint8_t)dirty_flag;
+    DirtyBitmapSnapshot *snap;
+    unsigned long first, page, end;
+    bool found = false;
+
+    first = start >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+
+    snap = g_malloc0(sizeof(*snap) +
+                     BITS_TO_LONGS(end - first) * sizeof(unsigned long));
+    snap->start = first << TARGET_PAGE_BITS;
+    snap->end = end << TARGET_PAGE_BITS;
+
+    for (page = first; page < end; ) {
+        if (page % sizeof(unsigned long) == 0 &&
+            end - page >= sizeof(unsigned long) &&
+            !(*(unsigned long *)&ram_list.phys_dirty[page] & mask)) {
+            /* Skip sizeof(long) clean pages with a single load */
+            page += sizeof(unsigned long);
+            continue;
+        }
+        if (ram_list.phys_dirty[page] & dirty_flag) {
+            ram_list.phys_dirty[page] &= ~dirty_flag;
+            set_bit(page - first, snap->dirty);
+            found = true;
+        }
+        page++;
+    }
+
+    if (found && tcg_enabled()) {
+        tlb_reset_dirty_range_all(snap->start, snap->end,
+                                  snap->end - snap->start);
+    }
+    return snap;
+}
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length)
+{
+    unsigned long page, end;
+
+    assert(start >= snap->start);
+    assert(start + length <= snap->end);
+
+    page = ((start & TARGET_PAGE_MASK) - snap->start) >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(start + length);
+    end = (end - snap->start) >> TARGET_PAGE_BITS;
+    return find_next_bit(snap->dirty, end, page) < end;
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -964,11 +1110,10 @@ static void *file_ram_alloc(RAMBlock *block,
         perror("ftruncate");
 
 #ifdef MAP_POPULATE
-    /* NB: MAP_POPULATE won't exhaustively alloc all phys pages in the case
-     * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
-     * to sidestep this quirk.
+    /* For mem_prealloc we mmap as MAP_SHARED, so that every page touched
+     * by os_mem_prealloc is really allocated in the file.
      */
-    flags = mem_prealloc ? MAP_POPULATE | MAP_SHARED : MAP_PRIVATE;
+    flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
     area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
 #else
     area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
@@ -978,7 +1123,15 @@ static void *file_ram_alloc(RAMBlock *block,
         close(fd);
         return (NULL);
     }
+
+    /* MAP_POPULATE faults the pages in from a single thread, which takes
+     * very long for large guests.  Touch them from one thread per vCPU.
+     */
+    if (mem_prealloc) {
+        os_mem_prealloc(area, memory, hpagesize, smp_cpus);
+    }
     block->fd = fd;
+    block->page_size = hpagesize;
     return area;
 }
 #else
@@ -1106,6 +1259,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
     new_block->fd = -1;
+    new_block->page_size = getpagesize();
 
     /* This assumes the iothread lock is taken here too.  */
     qemu_mutex_lock_ramlist();
@@ -1287,6 +1441,35 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
 }
 #endif /* !_WIN32 */
 
+/* Return true if the RAM block containing @addr was handed in through
+   qemu_ram_alloc_from_ptr.  Such blocks may be backed by device MMIO
+   (e.g. mmap'd PCI BARs) and must not be touched speculatively.  */
+bool qemu_ram_is_prealloc(ram_addr_t addr)
+{
+    return qemu_get_ram_block(addr)->flags & RAM_PREALLOC_MASK;
+}
+
+/* Return the page size backing the RAM block containing addr, larger than
+   the host page size for -mem-path hugetlbfs blocks.  */
+ram_addr_t qemu_ram_pagesize(ram_addr_t addr)
+{
+    return qemu_get_ram_block(addr)->page_size;
+}
+
+/* Return the file descriptor backing the RAM block containing addr, or
+   -1 if the block is not backed by a file (see -mem-path).  */
+int qemu_get_ram_fd(ram_addr_t addr)
+{
+    return qemu_get_ram_block(addr)->fd;
+}
+
+/* Return the host address at which the RAM block containing addr starts.
+   An fd returned by qemu_get_ram_fd() maps to this address at offset 0.  */
+void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
+{
+    return qemu_get_ram_block(addr)->host;
+}
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
    With the exception of the softmmu code in this file, this should
    only be used for local memory (e.g. video ram) that the device owns,
@@ -1633,6 +1816,11 @@ static void io_mem_init(void)
                           "watch", UINT64_MAX);
 }
 
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    g_free(d);
+}
+
 static void mem_begin(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
@@ -1652,8 +1840,10 @@ static void mem_commit(MemoryListener *listener)
     next->nodes = next_map.nodes;
     next->sections = next_map.sections;
 
-    as->dispatch = next;
-    g_free(cur);
+    atomic_rcu_set(&as->dispatch, next);
+    if (cur) {
+        call_rcu(cur, address_space_dispatch_free, rcu);
+    }
 }
 
 static void core_begin(MemoryListener *listener)
@@ -1679,7 +1869,7 @@ static void core_begin(MemoryListener *listener)
  */
 static void core_commit(MemoryListener *listener)
 {
-    phys_sections_free(prev_map);
+    call_rcu(prev_map, phys_sections_free, rcu);
 }
 
 static void tcg_commit(MemoryListener *listener)
@@ -1729,15 +1919,27 @@ void address_space_init_dispatch(AddressSpace *as)
         .priority = 0,
     };
     memory_listener_register(&as->dispatch_listener, as);
+    as->bounce = g_new0(BounceBuffer, BOUNCE_BUFFERS);
+    as->bounce_in_use = 0;
 }
 
 void address_space_destroy_dispatch(AddressSpace *as)
 {
     AddressSpaceDispatch *d = as->dispatch;
+    int i;
+
+    assert(!as->bounce_in_use);
+    for (i = 0; i < BOUNCE_BUFFERS; i++) {
+        qemu_vfree(as->bounce[i].buffer);
+    }
+    g_free(as->bounce);
+    as->bounce = NULL;
 
     memory_listener_unregister(&as->dispatch_listener);
-    g_free(d);
-    as->dispatch = NULL;
+    atomic_rcu_set(&as->dispatch, NULL);
+    if (d) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
 }
 
 static void memory_map_init(void)
@@ -1865,6 +2067,74 @@ static int memory_access_size(MemoryRegion *mr, unsigned l, hwaddr addr)
     return l;
 }
 
+bool address_space_rw_unlocked(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write)
+{
+    AddressSpaceDispatch *d;
+    MemoryRegionSection *section;
+    MemoryRegion *mr;
+    hwaddr addr1, l = len;
+    uint64_t val;
+    bool done = false;
+
+    rcu_read_lock();
+    d = atomic_rcu_read(&as->dispatch);
+    if (!d) {
+        goto out;
+    }
+
+    section = address_space_translate_internal(d, addr, &addr1, &l, true);
+    mr = section->mr;
+    if (!mr->thread_safe || mr->iommu_ops || mr->flush_coalesced_mmio ||
+        memory_access_is_direct(mr, is_write) || l < len ||
+        memory_access_size(mr, l, addr1) != len) {
+        goto out;
+    }
+
+    if (is_write) {
+        switch (len) {
+        case 8:
+            val = ldq_p(buf);
+            break;
+        case 4:
+            val = ldl_p(buf);
+            break;
+        case 2:
+            val = lduw_p(buf);
+            break;
+        case 1:
+            val = ldub_p(buf);
+            break;
+        default:
+            abort();
+        }
+        io_mem_write(mr, addr1, val, len);
+    } else {
+        io_mem_read(mr, addr1, &val, len);
+        switch (len) {
+        case 8:
+            stq_p(buf, val);
+            break;
+        case 4:
+            stl_p(buf, val);
+            break;
+        case 2:
+            stw_p(buf, val);
+            break;
+        case 1:
+            stb_p(buf, val);
+            break;
+        default:
+            abort();
+        }
+    }
+    done = true;
+
+out:
+    rcu_read_unlock();
+    return done;
+}
+
 bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write)
 {
@@ -2005,14 +2275,6 @@ void cpu_physical_memory_write_rom(hwaddr addr,
     }
 }
 
-typedef struct {
-    MemoryRegion *mr;
-    void *buffer;
-    hwaddr addr;
-    hwaddr len;
-} BounceBuffer;
-
-static BounceBuffer bounce;
 
 typedef struct MapClient {
     void *opaque;
@@ -2098,23 +2360,36 @@ void *address_space_map(AddressSpace *as,
     l = len;
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
     if (!memory_access_is_direct(mr, is_write)) {
-        if (bounce.buffer) {
+        BounceBuffer *bounce = NULL;
+        int i;
+
+        for (i = 0; i < BOUNCE_BUFFERS; i++) {
+            if (!as->bounce[i].in_use) {
+                bounce = &as->bounce[i];
+                break;
+            }
+        }
+        if (!bounce) {
             return NULL;
         }
-        /* Avoid unbounded allocations */
+        /* Avoid unbounded allocations; the page is kept for reuse */
         l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        if (!bounce->buffer) {
+            bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+        }
+        bounce->in_use = true;
+        bounce->addr = addr;
+        bounce->len = l;
+        as->bounce_in_use++;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
-            address_space_read(as, addr, bounce.buffer, l);
+            address_space_read(as, addr, bounce->buffer, l);
         }
 
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -2144,10 +2419,27 @@ void *address_space_map(AddressSpace *as,
  * Will also mark the memory as dirty if is_write == 1.  access_len gives
  * the amount of memory that was actually read or written by the caller.
  */
+static BounceBuffer *address_space_find_bounce(AddressSpace *as, void *buffer)
+{
+    int i;
+
+    if (!as->bounce_in_use) {
+        return NULL;
+    }
+    for (i = 0; i < BOUNCE_BUFFERS; i++) {
+        if (as->bounce[i].in_use && as->bounce[i].buffer == buffer) {
+            return &as->bounce[i];
+        }
+    }
+    return NULL;
+}
+
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = address_space_find_bounce(as, buffer);
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -2171,11 +2463,11 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, bounce->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
+    bounce->in_use = false;
+    as->bounce_in_use--;
+    memory_region_unref(bounce->mr);
     cpu_notify_map_clients();
 }
 
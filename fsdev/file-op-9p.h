@@ -75,6 +75,7 @@ typedef struct FsDriverEntry {
     char *fsdev_id;
     char *path;
     int export_flags;
+    int64_t cache_ttl;
     FileOperations *ops;
 } FsDriverEntry;
 
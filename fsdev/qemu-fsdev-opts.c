@@ -30,6 +30,9 @@ static QemuOptsList qemu_fsdev_opts = {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
 
+        }, {
+            .name = "cache_ttl",
+            .type = QEMU_OPT_NUMBER,
         }, {
             .name = "socket",
             .type = QEMU_OPT_STRING,
@@ -65,6 +68,9 @@ static QemuOptsList qemu_virtfs_opts = {
         }, {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
+        }, {
+            .name = "cache_ttl",
+            .type = QEMU_OPT_NUMBER,
         }, {
             .name = "socket",
             .type = QEMU_OPT_STRING,
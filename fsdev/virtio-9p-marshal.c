@@ -23,6 +23,7 @@
 #include <errno.h>
 
 #include "qemu/compiler.h"
+#include "qemu/iov.h"
 #include "virtio-9p-marshal.h"
 #include "qemu/bswap.h"
 
@@ -57,77 +58,59 @@ void v9fs_string_copy(V9fsString *lhs, V9fsString *rhs)
 }
 
 
-static ssize_t v9fs_packunpack(void *addr, struct iovec *sg, int sg_count,
-                               size_t offset, size_t size, int pack)
+/*
+ * The PDU is walked with a cursor, so that each field does not have to
+ * look for its offset from the start of the scatter-gather list.
+ */
+static ssize_t v9fs_cursor_unpack(IOVCursor *cur, void *dst, size_t size)
 {
-    int i = 0;
-    size_t copied = 0;
-    size_t req_size = size;
-
-
-    for (i = 0; size && i < sg_count; i++) {
-        size_t len;
-        if (offset >= sg[i].iov_len) {
-            /* skip this sg */
-            offset -= sg[i].iov_len;
-            continue;
-        } else {
-            len = MIN(sg[i].iov_len - offset, size);
-            if (pack) {
-                memcpy(sg[i].iov_base + offset, addr, len);
-            } else {
-                memcpy(addr, sg[i].iov_base + offset, len);
-            }
-            size -= len;
-            copied += len;
-            addr += len;
-            if (size) {
-                offset = 0;
-                continue;
-            }
-        }
-    }
-    if (copied < req_size) {
-        /*
-         * We copied less that requested size. error out
-         */
+    if (iov_cursor_to_buf(cur, dst, size) < size) {
         return -ENOBUFS;
     }
-    return copied;
+    return size;
 }
 
-static ssize_t v9fs_unpack(void *dst, struct iovec *out_sg, int out_num,
-                           size_t offset, size_t size)
+static ssize_t v9fs_cursor_pack(IOVCursor *cur, const void *src, size_t size)
 {
-    return v9fs_packunpack(dst, out_sg, out_num, offset, size, 0);
+    if (iov_cursor_from_buf(cur, src, size) < size) {
+        return -ENOBUFS;
+    }
+    return size;
 }
 
 ssize_t v9fs_pack(struct iovec *in_sg, int in_num, size_t offset,
                   const void *src, size_t size)
 {
-    return v9fs_packunpack((void *)src, in_sg, in_num, offset, size, 1);
+    IOVCursor cur;
+
+    iov_cursor_init(&cur, in_sg, in_num);
+    iov_cursor_skip(&cur, offset);
+    return v9fs_cursor_pack(&cur, src, size);
 }
 
-ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
-                       int bswap, const char *fmt, ...)
+static ssize_t v9fs_cursor_unmarshal(IOVCursor *cur, int bswap,
+                                     const char *fmt, ...);
+static ssize_t v9fs_cursor_marshal(IOVCursor *cur, int bswap,
+                                   const char *fmt, ...);
+
+static ssize_t v9fs_vunmarshal(IOVCursor *cur, int bswap, const char *fmt,
+                               va_list ap)
 {
     int i;
-    va_list ap;
     ssize_t copied = 0;
-    size_t old_offset = offset;
+    size_t old_pos = cur->pos;
 
-    va_start(ap, fmt);
     for (i = 0; fmt[i]; i++) {
         switch (fmt[i]) {
         case 'b': {
             uint8_t *valp = va_arg(ap, uint8_t *);
-            copied = v9fs_unpack(valp, out_sg, out_num, offset, sizeof(*valp));
+            copied = v9fs_cursor_unpack(cur, valp, sizeof(*valp));
             break;
         }
         case 'w': {
             uint16_t val, *valp;
             valp = va_arg(ap, uint16_t *);
-            copied = v9fs_unpack(&val, out_sg, out_num, offset, sizeof(val));
+            copied = v9fs_cursor_unpack(cur, &val, sizeof(val));
             if (bswap) {
                 *valp = le16_to_cpu(val);
             } else {
@@ -138,7 +121,7 @@ ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
         case 'd': {
             uint32_t val, *valp;
             valp = va_arg(ap, uint32_t *);
-            copied = v9fs_unpack(&val, out_sg, out_num, offset, sizeof(val));
+            copied = v9fs_cursor_unpack(cur, &val, sizeof(val));
             if (bswap) {
                 *valp = le32_to_cpu(val);
             } else {
@@ -149,7 +132,7 @@ ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
         case 'q': {
             uint64_t val, *valp;
             valp = va_arg(ap, uint64_t *);
-            copied = v9fs_unpack(&val, out_sg, out_num, offset, sizeof(val));
+            copied = v9fs_cursor_unpack(cur, &val, sizeof(val));
             if (bswap) {
                 *valp = le64_to_cpu(val);
             } else {
@@ -159,13 +142,10 @@ ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
         }
         case 's': {
             V9fsString *str = va_arg(ap, V9fsString *);
-            copied = v9fs_unmarshal(out_sg, out_num, offset, bswap,
-                                    "w", &str->size);
+            copied = v9fs_cursor_unmarshal(cur, bswap, "w", &str->size);
             if (copied > 0) {
-                offset += copied;
                 str->data = g_malloc(str->size + 1);
-                copied = v9fs_unpack(str->data, out_sg, out_num, offset,
-                                     str->size);
+                copied = v9fs_cursor_unpack(cur, str->data, str->size);
                 if (copied > 0) {
                     str->data[str->size] = 0;
                 } else {
@@ -176,13 +156,14 @@ ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
         }
         case 'Q': {
             V9fsQID *qidp = va_arg(ap, V9fsQID *);
-            copied = v9fs_unmarshal(out_sg, out_num, offset, bswap, "bdq",
-                                    &qidp->type, &qidp->version, &qidp->path);
+            copied = v9fs_cursor_unmarshal(cur, bswap, "bdq",
+                                           &qidp->type, &qidp->version,
+                                           &qidp->path);
             break;
         }
         case 'S': {
             V9fsStat *statp = va_arg(ap, V9fsStat *);
-            copied = v9fs_unmarshal(out_sg, out_num, offset, bswap,
+            copied = v9fs_cursor_unmarshal(cur, bswap,
                                     "wwdQdddqsssssddd",
                                     &statp->size, &statp->type, &statp->dev,
                                     &statp->qid, &statp->mode, &statp->atime,
@@ -195,7 +176,7 @@ ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
         }
         case 'I': {
             V9fsIattr *iattr = va_arg(ap, V9fsIattr *);
-            copied = v9fs_unmarshal(out_sg, out_num, offset, bswap,
+            copied = v9fs_cursor_unmarshal(cur, bswap,
                                     "ddddqqqqq",
                                     &iattr->valid, &iattr->mode,
                                     &iattr->uid, &iattr->gid, &iattr->size,
@@ -207,30 +188,25 @@ ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
             break;
         }
         if (copied < 0) {
-            va_end(ap);
             return copied;
         }
-        offset += copied;
     }
-    va_end(ap);
 
-    return offset - old_offset;
+    return cur->pos - old_pos;
 }
 
-ssize_t v9fs_marshal(struct iovec *in_sg, int in_num, size_t offset,
-                     int bswap, const char *fmt, ...)
+static ssize_t v9fs_vmarshal(IOVCursor *cur, int bswap, const char *fmt,
+                             va_list ap)
 {
     int i;
-    va_list ap;
     ssize_t copied = 0;
-    size_t old_offset = offset;
+    size_t old_pos = cur->pos;
 
-    va_start(ap, fmt);
     for (i = 0; fmt[i]; i++) {
         switch (fmt[i]) {
         case 'b': {
             uint8_t val = va_arg(ap, int);
-            copied = v9fs_pack(in_sg, in_num, offset, &val, sizeof(val));
+            copied = v9fs_cursor_pack(cur, &val, sizeof(val));
             break;
         }
         case 'w': {
@@ -240,7 +216,7 @@ ssize_t v9fs_marshal(struct iovec *in_sg, int in_num, size_t offset,
             } else {
                 val =  va_arg(ap, int);
             }
-            copied = v9fs_pack(in_sg, in_num, offset, &val, sizeof(val));
+            copied = v9fs_cursor_pack(cur, &val, sizeof(val));
             break;
         }
         case 'd': {
@@ -250,7 +226,7 @@ ssize_t v9fs_marshal(struct iovec *in_sg, int in_num, size_t offset,
             } else {
                 val =  va_arg(ap, uint32_t);
             }
-            copied = v9fs_pack(in_sg, in_num, offset, &val, sizeof(val));
+            copied = v9fs_cursor_pack(cur, &val, sizeof(val));
             break;
         }
         case 'q': {
@@ -260,28 +236,27 @@ ssize_t v9fs_marshal(struct iovec *in_sg, int in_num, size_t offset,
             } else {
                 val =  va_arg(ap, uint64_t);
             }
-            copied = v9fs_pack(in_sg, in_num, offset, &val, sizeof(val));
+            copied = v9fs_cursor_pack(cur, &val, sizeof(val));
             break;
         }
         case 's': {
             V9fsString *str = va_arg(ap, V9fsString *);
-            copied = v9fs_marshal(in_sg, in_num, offset, bswap,
-                                  "w", str->size);
+            copied = v9fs_cursor_marshal(cur, bswap, "w", str->size);
             if (copied > 0) {
-                offset += copied;
-                copied = v9fs_pack(in_sg, in_num, offset, str->data, str->size);
+                copied = v9fs_cursor_pack(cur, str->data, str->size);
             }
             break;
         }
         case 'Q': {
             V9fsQID *qidp = va_arg(ap, V9fsQID *);
-            copied = v9fs_marshal(in_sg, in_num, offset, bswap, "bdq",
-                                  qidp->type, qidp->version, qidp->path);
+            copied = v9fs_cursor_marshal(cur, bswap, "bdq",
+                                         qidp->type, qidp->version,
+                                         qidp->path);
             break;
         }
         case 'S': {
             V9fsStat *statp = va_arg(ap, V9fsStat *);
-            copied = v9fs_marshal(in_sg, in_num, offset, bswap,
+            copied = v9fs_cursor_marshal(cur, bswap,
                                   "wwdQdddqsssssddd",
                                   statp->size, statp->type, statp->dev,
                                   &statp->qid, statp->mode, statp->atime,
@@ -293,7 +268,7 @@ ssize_t v9fs_marshal(struct iovec *in_sg, int in_num, size_t offset,
         }
         case 'A': {
             V9fsStatDotl *statp = va_arg(ap, V9fsStatDotl *);
-            copied = v9fs_marshal(in_sg, in_num, offset, bswap,
+            copied = v9fs_cursor_marshal(cur, bswap,
                                    "qQdddqqqqqqqqqqqqqqq",
                                    statp->st_result_mask,
                                    &statp->qid, statp->st_mode,
@@ -312,12 +287,65 @@ ssize_t v9fs_marshal(struct iovec *in_sg, int in_num, size_t offset,
             break;
         }
         if (copied < 0) {
-            va_end(ap);
             return copied;
         }
-        offset += copied;
     }
+
+    return cur->pos - old_pos;
+}
+
+static ssize_t v9fs_cursor_unmarshal(IOVCursor *cur, int bswap,
+                                     const char *fmt, ...)
+{
+    va_list ap;
+    ssize_t ret;
+
+    va_start(ap, fmt);
+    ret = v9fs_vunmarshal(cur, bswap, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+static ssize_t v9fs_cursor_marshal(IOVCursor *cur, int bswap,
+                                   const char *fmt, ...)
+{
+    va_list ap;
+    ssize_t ret;
+
+    va_start(ap, fmt);
+    ret = v9fs_vmarshal(cur, bswap, fmt, ap);
     va_end(ap);
+    return ret;
+}
+
+ssize_t v9fs_unmarshal(struct iovec *out_sg, int out_num, size_t offset,
+                       int bswap, const char *fmt, ...)
+{
+    IOVCursor cur;
+    va_list ap;
+    ssize_t ret;
 
-    return offset - old_offset;
+    iov_cursor_init(&cur, out_sg, out_num);
+    iov_cursor_skip(&cur, offset);
+
+    va_start(ap, fmt);
+    ret = v9fs_vunmarshal(&cur, bswap, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+ssize_t v9fs_marshal(struct iovec *in_sg, int in_num, size_t offset,
+                     int bswap, const char *fmt, ...)
+{
+    IOVCursor cur;
+    va_list ap;
+    ssize_t ret;
+
+    iov_cursor_init(&cur, in_sg, in_num);
+    iov_cursor_skip(&cur, offset);
+
+    va_start(ap, fmt);
+    ret = v9fs_vmarshal(&cur, bswap, fmt, ap);
+    va_end(ap);
+    return ret;
 }
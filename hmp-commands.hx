@@ -309,19 +309,25 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to keep the VM running while its memory is saved",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the virtual machine keeps running while its memory is
+written, like during live migration, and is only stopped for the final
+pass and the disk snapshots. The final pass aims to fit in the maximum
+migration downtime, see @code{migrate_set_downtime}.
 ETEXI
 
     {
@@ -366,6 +372,24 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "option:s?",
+        .params     = "[on|off]",
+        .help       = "start or stop counting executions of translation blocks",
+        .mhandler.cmd = do_tb_profile,
+    },
+
+STEXI
+@item tb-profile [off]
+@findex tb-profile
+Count the executions, softmmu TLB misses and translation time of each
+translation block (TCG only).  Starting the profile flushes the
+translated code and disables block chaining, so the guest runs slower
+until it is stopped with option off.  The results are shown by
+@code{info tb-profile}.
 ETEXI
 
     {
@@ -971,6 +995,22 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the migration parameter @var{parameter} (compress-level,
+compress-threads, decompress-threads, channels, postcopy-rounds or
+block-granularity) to @var{value}.
 ETEXI
 
     {
@@ -993,9 +1033,11 @@ ETEXI
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,detach:-d,zlib:-z,filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-d] [-z] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -d: run the dump in the background"
+                      "\n\t\t\t -z: kdump-compressed format, with zlib"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -1003,12 +1045,16 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-d] [-z] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+    detach: run the dump in the background, use "info dump" to follow it
+      zlib: write a kdump-compressed file with zlib-compressed pages, in the
+            flattened format ("makedumpfile -R" converts it for crash).
+            Can't be used with paging, begin and length.
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1662,6 +1708,9 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tb-profile [@var{count}]
+show the @var{count} most executed translation blocks (20 by default),
+see @code{tb-profile}
 @item info numa
 show NUMA information
 @item info kvm
@@ -1698,6 +1747,10 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info migrate_parameters
+show current migration parameters
+@item info dump
+show the progress of the last dump-guest-memory
 @item info balloon
 show balloon information
 @item info qtree
@@ -1708,6 +1761,8 @@ show qdev device model list
 show roms
 @item info tpm
 show the TPM device
+@item info iothreads
+show iothreads
 @end table
 ETEXI
 
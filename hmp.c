@@ -68,6 +68,14 @@ void hmp_info_kvm(Monitor *mon, const QDict *qdict)
     } else {
         monitor_printf(mon, "not compiled\n");
     }
+    if (info->has_msi_route_cache) {
+        monitor_printf(mon, "msi routes: %" PRId64 " hits: %" PRId64
+                       " misses: %" PRId64 " evictions: %" PRId64 "\n",
+                       info->msi_route_cache->routes,
+                       info->msi_route_cache->hits,
+                       info->msi_route_cache->misses,
+                       info->msi_route_cache->evictions);
+    }
 
     qapi_free_KvmInfo(info);
 }
@@ -160,6 +168,13 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
                            info->expected_downtime);
         }
+        if (info->has_converging && !info->converging) {
+            monitor_printf(mon, "not converging\n");
+        }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
@@ -191,6 +206,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->has_postcopy_requests) {
+            monitor_printf(mon, "postcopy requests: %" PRIu64 " pages\n",
+                           info->ram->postcopy_requests);
+        }
     }
 
     if (info->has_disk) {
@@ -215,6 +234,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        monitor_printf(mon, "compression pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compression busy: %" PRIu64 "\n",
+                       info->compression->busy);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -244,6 +274,25 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    monitor_printf(mon, "parameters: compress-level: %" PRId64
+                   " compress-threads: %" PRId64
+                   " decompress-threads: %" PRId64
+                   " channels: %" PRId64
+                   " postcopy-rounds: %" PRId64
+                   " block-granularity: %" PRId64 "\n",
+                   params->compress_level, params->compress_threads,
+                   params->decompress_threads, params->channels,
+                   params->postcopy_rounds, params->block_granularity);
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -276,7 +325,14 @@ void hmp_info_cpus(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, " (halted)");
         }
 
-        monitor_printf(mon, " thread_id=%" PRId64 "\n", cpu->value->thread_id);
+        monitor_printf(mon, " thread_id=%" PRId64, cpu->value->thread_id);
+        if (cpu->value->has_halt_poll_success) {
+            monitor_printf(mon, " halt_poll=%" PRId64 "/%" PRId64,
+                           cpu->value->halt_poll_success,
+                           cpu->value->halt_poll_success +
+                           cpu->value->halt_poll_fail);
+        }
+        monitor_printf(mon, "\n");
     }
 
     qapi_free_CpuInfoList(cpu_list);
@@ -352,7 +408,8 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             " iops_max=%" PRId64
                             " iops_rd_max=%" PRId64
                             " iops_wr_max=%" PRId64
-                            " iops_size=%" PRId64 "\n",
+                            " iops_size=%" PRId64
+                            " group=%s\n",
                             info->value->inserted->bps,
                             info->value->inserted->bps_rd,
                             info->value->inserted->bps_wr,
@@ -365,7 +422,8 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             info->value->inserted->iops_max,
                             info->value->inserted->iops_rd_max,
                             info->value->inserted->iops_wr_max,
-                            info->value->inserted->iops_size);
+                            info->value->inserted->iops_size,
+                            info->value->inserted->group);
         }
 
         if (verbose) {
@@ -711,6 +769,19 @@ void hmp_info_tpm(Monitor *mon, const QDict *qdict)
     qapi_free_TPMInfoList(info_list);
 }
 
+void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
+{
+    IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
+    IOThreadInfoList *info;
+
+    for (info = info_list; info; info = info->next) {
+        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
+                       info->value->id, info->value->thread_id);
+    }
+
+    qapi_free_IOThreadInfoList(info_list);
+}
+
 void hmp_quit(Monitor *mon, const QDict *qdict)
 {
     monitor_suspend(mon);
@@ -921,7 +992,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, &errp);
+                     false, 0, false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
 
@@ -949,7 +1020,8 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
 
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0, false, 0, false, 0, &errp);
+                     true, mode, false, 0, false, 0, false, 0,
+                     false, NULL, &errp);
     hmp_handle_error(mon, &errp);
 }
 
@@ -1060,6 +1132,41 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (strcmp(param, "compress-level") == 0) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0,
+                                   false, 0, false, 0, false, 0, &err);
+    } else if (strcmp(param, "compress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0,
+                                   false, 0, false, 0, false, 0, &err);
+    } else if (strcmp(param, "decompress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value,
+                                   false, 0, false, 0, false, 0, &err);
+    } else if (strcmp(param, "channels") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   true, value, false, 0, false, 0, &err);
+    } else if (strcmp(param, "postcopy-rounds") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   false, 0, true, value, false, 0, &err);
+    } else if (strcmp(param, "block-granularity") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   false, 0, false, 0, true, value, &err);
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1148,6 +1255,20 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               false,
                               0,
                               false, /* No default I/O size */
+                              0,
+                              false, /* keep the throttle group */
+                              NULL,
+                              false, /* no burst length via HMP */
+                              0,
+                              false,
+                              0,
+                              false,
+                              0,
+                              false,
+                              0,
+                              false,
+                              0,
+                              false,
                               0, &err);
     hmp_handle_error(mon, &err);
 }
@@ -1304,6 +1425,9 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int detach = qdict_get_try_bool(qdict, "detach", 0);
+    int zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    DumpGuestMemoryFormat format = DUMP_GUEST_MEMORY_FORMAT_ELF;
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
@@ -1317,15 +1441,34 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     if (has_length) {
         length = qdict_get_int(qdict, "length");
     }
+    if (zlib) {
+        format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB;
+    }
 
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          &errp);
+                          true, detach, true, format, &errp);
     hmp_handle_error(mon, &errp);
     g_free(prot);
 }
 
+void hmp_info_dump(Monitor *mon, const QDict *qdict)
+{
+    DumpQueryResult *result = qmp_query_dump(NULL);
+
+    monitor_printf(mon, "Status: %s\n", DumpStatus_lookup[result->status]);
+    if (result->status == DUMP_STATUS_ACTIVE) {
+        monitor_printf(mon, "Finished: %.1f %%\n",
+                       result->total ?
+                       100.0 * result->completed / result->total : 0.0);
+    }
+    if (result->has_error) {
+        monitor_printf(mon, "Error: %s\n", result->error);
+    }
+    qapi_free_DumpQueryResult(result);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -39,6 +39,99 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Size of each dirent on the wire: size of qid (13) + size of offset (8)
+ * size of type (1) + size of name.size (2) + strlen(name.data)
+ */
+static int32_t v9fs_dirent_wire_size(struct dirent *dent)
+{
+    return 24 + 2 + strlen(dent->d_name);
+}
+
+static int do_readdir_many(V9fsState *s, V9fsFidState *fidp, off_t offset,
+                           int32_t maxsize, V9fsDirEnt **entries)
+{
+    V9fsDirEnt **tail = entries;
+    struct dirent *dent, *result;
+    off_t saved_dir_pos;
+    int32_t size = 0, len;
+    int err = 0;
+
+    if (offset == 0) {
+        s->ops->rewinddir(&s->ctx, &fidp->fs);
+    } else {
+        s->ops->seekdir(&s->ctx, &fidp->fs, offset);
+    }
+
+    saved_dir_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+    if (saved_dir_pos < 0) {
+        return -errno;
+    }
+
+    dent = g_malloc(sizeof(struct dirent));
+    while (1) {
+        errno = 0;
+        s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+        if (!result) {
+            if (errno) {
+                err = -errno;
+            }
+            break;
+        }
+        len = v9fs_dirent_wire_size(dent);
+        if (size + len > maxsize) {
+            /* Ran out of buffer, the next request starts with this entry */
+            s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+            break;
+        }
+        *tail = g_malloc(sizeof(V9fsDirEnt));
+        (*tail)->dent = dent;
+        (*tail)->next = NULL;
+        tail = &(*tail)->next;
+
+        size += len;
+        saved_dir_pos = dent->d_off;
+        dent = g_malloc(sizeof(struct dirent));
+    }
+    g_free(dent);
+    return err;
+}
+
+/*
+ * Position the directory stream at @offset (0 rewinds it) and read as many
+ * entries as fit in @maxsize bytes of an Rreaddir reply, all in a single
+ * trip to the worker thread.  The stream is left after the last returned
+ * entry.  On success the entries are returned in @entries, which the caller
+ * frees with v9fs_free_dirents() even on failure.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp, off_t offset,
+                         int32_t maxsize, V9fsDirEnt **entries)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            err = do_readdir_many(s, fidp, offset, maxsize, entries);
+        });
+    return err;
+}
+
+void v9fs_free_dirents(V9fsDirEnt *e)
+{
+    V9fsDirEnt *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        g_free(e->dent);
+        g_free(e);
+    }
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -114,6 +207,7 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -140,6 +140,8 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
     cred.fc_mode = mode & 07777;
     cred.fc_uid = fidp->uid;
     cred.fc_gid = gid;
+    /* fidp->path changes to the new file, drop the directory now */
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     /*
      * Hold the directory fid lock so that directory path name
      * don't change. Read lock is fine because this fid cannot
@@ -169,6 +171,7 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     v9fs_path_unlock(s);
     if (!err) {
         total_open_fd++;
@@ -236,6 +239,7 @@ int v9fs_co_link(V9fsPDU *pdu, V9fsFidState *oldfid,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, &newdirfid->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -256,6 +260,7 @@ int v9fs_co_pwritev(V9fsPDU *pdu, V9fsFidState *fidp,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     return err;
 }
 
@@ -88,6 +88,7 @@ int v9fs_co_chmod(V9fsPDU *pdu, V9fsPath *path, mode_t mode)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -109,6 +110,7 @@ int v9fs_co_utimensat(V9fsPDU *pdu, V9fsPath *path,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -133,6 +135,7 @@ int v9fs_co_chown(V9fsPDU *pdu, V9fsPath *path, uid_t uid, gid_t gid)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -153,6 +156,7 @@ int v9fs_co_truncate(V9fsPDU *pdu, V9fsPath *path, off_t size)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -191,6 +195,7 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -212,6 +217,7 @@ int v9fs_co_remove(V9fsPDU *pdu, V9fsPath *path)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     v9fs_path_unlock(s);
     return err;
 }
@@ -232,6 +238,7 @@ int v9fs_co_unlinkat(V9fsPDU *pdu, V9fsPath *path, V9fsString *name, int flags)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     v9fs_path_unlock(s);
     return err;
 }
@@ -252,6 +259,7 @@ int v9fs_co_rename(V9fsPDU *pdu, V9fsPath *oldpath, V9fsPath *newpath)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -272,6 +280,7 @@ int v9fs_co_renameat(V9fsPDU *pdu, V9fsPath *olddirpath, V9fsString *oldname,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -309,6 +318,7 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &dfidp->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -126,6 +126,7 @@ static int virtio_9p_device_init(VirtIODevice *vdev)
         goto out;
     }
     v9fs_path_free(&path);
+    v9fs_attr_cache_init(s, fse->cache_ttl);
 
     return 0;
 out:
@@ -18,6 +18,7 @@
 #include "fsdev/qemu-fsdev.h"
 #include "virtio-9p-xattr.h"
 #include "virtio-9p-coth.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "migration/migration.h"
 
@@ -166,6 +167,123 @@ int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
     return err;
 }
 
+/*
+ * Attribute cache
+ *
+ * A walk has to lstat every path component.  With cache_ttl set on the
+ * fsdev, the results are kept for that many milliseconds so that walking
+ * the same paths again does not need a trip to the worker thread.
+ * Changes made through this server drop the affected entries, changes
+ * made directly on the host are only noticed when the entry expires.
+ */
+#define V9FS_ATTR_CACHE_MAX 4096
+
+typedef struct V9fsAttrCacheEntry {
+    V9fsPath path;
+    struct stat stbuf;
+    int64_t expires;
+} V9fsAttrCacheEntry;
+
+static guint v9fs_path_hash(gconstpointer key)
+{
+    const V9fsPath *path = key;
+    guint hash = 5381;
+    int i;
+
+    /* handle based drivers store binary data in the path */
+    for (i = 0; i < path->size; i++) {
+        hash = hash * 33 + (unsigned char)path->data[i];
+    }
+    return hash;
+}
+
+static gboolean v9fs_path_equal(gconstpointer a, gconstpointer b)
+{
+    const V9fsPath *p1 = a, *p2 = b;
+
+    return p1->size == p2->size && !memcmp(p1->data, p2->data, p1->size);
+}
+
+static void v9fs_attr_cache_free_entry(gpointer data)
+{
+    V9fsAttrCacheEntry *entry = data;
+
+    v9fs_path_free(&entry->path);
+    g_free(entry);
+}
+
+void v9fs_attr_cache_init(V9fsState *s, int64_t ttl)
+{
+    s->attr_cache_ttl = ttl;
+    s->attr_cache_gen = 0;
+    s->attr_cache = NULL;
+    if (ttl > 0) {
+        s->attr_cache = g_hash_table_new_full(v9fs_path_hash, v9fs_path_equal,
+                                              NULL,
+                                              v9fs_attr_cache_free_entry);
+    }
+}
+
+/*
+ * Must be called after the change is done.  Bumping the generation
+ * keeps an lstat that raced with the change from being cached.
+ */
+void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path)
+{
+    if (s->attr_cache) {
+        s->attr_cache_gen++;
+        g_hash_table_remove(s->attr_cache, path);
+    }
+}
+
+/* For changes to the namespace, which affect every path below them */
+void v9fs_attr_cache_flush(V9fsState *s)
+{
+    if (s->attr_cache) {
+        s->attr_cache_gen++;
+        g_hash_table_remove_all(s->attr_cache);
+    }
+}
+
+static int v9fs_cached_lstat(V9fsPDU *pdu, V9fsPath *path,
+                             struct stat *stbuf)
+{
+    V9fsState *s = pdu->s;
+    V9fsAttrCacheEntry *entry;
+    uint64_t gen;
+    int64_t now;
+    int err;
+
+    if (!s->attr_cache) {
+        return v9fs_co_lstat(pdu, path, stbuf);
+    }
+
+    entry = g_hash_table_lookup(s->attr_cache, path);
+    if (entry &&
+        entry->expires > qemu_clock_get_ms(QEMU_CLOCK_REALTIME)) {
+        *stbuf = entry->stbuf;
+        return 0;
+    }
+
+    gen = s->attr_cache_gen;
+    err = v9fs_co_lstat(pdu, path, stbuf);
+    if (err < 0 || gen != s->attr_cache_gen) {
+        return err;
+    }
+
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (g_hash_table_size(s->attr_cache) >= V9FS_ATTR_CACHE_MAX) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+    entry = g_malloc0(sizeof(*entry));
+    v9fs_path_copy(&entry->path, path);
+    entry->stbuf = *stbuf;
+    entry->expires = now + s->attr_cache_ttl;
+    /* replace, not insert, so that the key of the old entry is not kept */
+    g_hash_table_replace(s->attr_cache, &entry->path, entry);
+    return 0;
+}
+
 /*
  * Return TRUE if s1 is an ancestor of s2.
  *
@@ -628,7 +746,9 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->id = id;
 
     /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    virtqueue_push(s->vq, pdu->elem, len);
+    g_free(pdu->elem);
+    pdu->elem = NULL;
 
     /* FIXME: we should batch these completions */
     virtio_notify(VIRTIO_DEVICE(s), s->vq);
@@ -1275,7 +1395,7 @@ static void v9fs_walk(void *opaque)
         if (err < 0) {
             goto out;
         }
-        err = v9fs_co_lstat(pdu, &path, &stbuf);
+        err = v9fs_cached_lstat(pdu, &path, &stbuf);
         if (err < 0) {
             goto out;
         }
@@ -1568,7 +1688,7 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
         return err;
     }
     offset += err;
-    err = v9fs_pack(pdu->elem.in_sg, pdu->elem.in_num, offset,
+    err = v9fs_pack(pdu->elem->in_sg, pdu->elem->in_num, offset,
                     ((char *)fidp->fs.xattr.value) + off,
                     read_count);
     if (err < 0) {
@@ -1659,11 +1779,11 @@ static void v9fs_init_qiov_from_pdu(QEMUIOVector *qiov, V9fsPDU *pdu,
     unsigned int niov;
 
     if (is_write) {
-        iov = pdu->elem.out_sg;
-        niov = pdu->elem.out_num;
+        iov = pdu->elem->out_sg;
+        niov = pdu->elem->out_num;
     } else {
-        iov = pdu->elem.in_sg;
-        niov = pdu->elem.in_num;
+        iov = pdu->elem->in_sg;
+        niov = pdu->elem->in_num;
     }
 
     qemu_iovec_init_external(&elem, iov, niov);
@@ -1755,48 +1875,27 @@ out_nofid:
     complete_pdu(s, pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
-{
-    /*
-     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
-     * size of type (1) + size of name.size (2) + strlen(name.data)
-     */
-    return 24 + v9fs_string_size(name);
-}
-
-static int v9fs_do_readdir(V9fsPDU *pdu,
-                           V9fsFidState *fidp, int32_t max_count)
+static int v9fs_do_readdir(V9fsPDU *pdu, V9fsFidState *fidp,
+                           off_t offset, int32_t max_count)
 {
     size_t size;
     V9fsQID qid;
     V9fsString name;
     int len, err = 0;
     int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    struct dirent *dent;
+    V9fsDirEnt *entries, *e;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    err = v9fs_co_readdir_many(pdu, fidp, offset, max_count, &entries);
+    if (err < 0) {
+        v9fs_free_dirents(entries);
+        return err;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
-    while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
-        }
+    for (e = entries; e; e = e->next) {
+        dent = e->dent;
         v9fs_string_init(&name);
         v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
         /*
          * Fill up just the path field of qid because the client uses
          * only that. To fill the entire qid structure we will have
@@ -1812,17 +1911,19 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
                           &qid, dent->d_off,
                           dent->d_type, &name);
+        v9fs_string_free(&name);
         if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return len;
+            err = len;
+            break;
         }
         count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
+        offset = dent->d_off;
     }
-    g_free(dent);
+    if (e) {
+        /* Set dir back to the first entry that was not returned */
+        v9fs_co_seekdir(pdu, fidp, offset);
+    }
+    v9fs_free_dirents(entries);
     if (err < 0) {
         return err;
     }
@@ -1857,12 +1958,7 @@ static void v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out;
     }
-    if (initial_offset == 0) {
-        v9fs_co_rewinddir(pdu, fidp);
-    } else {
-        v9fs_co_seekdir(pdu, fidp, initial_offset);
-    }
-    count = v9fs_do_readdir(pdu, fidp, max_count);
+    count = v9fs_do_readdir(pdu, fidp, initial_offset, max_count);
     if (count < 0) {
         retval = count;
         goto out;
@@ -3248,16 +3344,15 @@ void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsState *s = (V9fsState *)vdev;
     V9fsPDU *pdu;
-    ssize_t len;
 
     while ((pdu = alloc_pdu(s)) &&
-            (len = virtqueue_pop(vq, &pdu->elem)) != 0) {
+           (pdu->elem = virtqueue_pop(vq, sizeof(VirtQueueElement))) != NULL) {
         uint8_t *ptr;
         pdu->s = s;
-        BUG_ON(pdu->elem.out_num == 0 || pdu->elem.in_num == 0);
-        BUG_ON(pdu->elem.out_sg[0].iov_len < 7);
+        BUG_ON(pdu->elem->out_num == 0 || pdu->elem->in_num == 0);
+        BUG_ON(pdu->elem->out_sg[0].iov_len < 7);
 
-        ptr = pdu->elem.out_sg[0].iov_base;
+        ptr = pdu->elem->out_sg[0].iov_base;
 
         pdu->size = le32_to_cpu(*(uint32_t *)ptr);
         pdu->id = ptr[4];
@@ -134,7 +134,7 @@ struct V9fsPDU
     uint8_t id;
     uint8_t cancelled;
     CoQueue complete;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     struct V9fsState *s;
     QLIST_ENTRY(V9fsPDU) next;
 };
@@ -225,6 +225,10 @@ typedef struct V9fsState
     int32_t root_fid;
     Error *migration_blocker;
     V9fsConf fsconf;
+    /* lstat results of walked paths, NULL if disabled */
+    GHashTable *attr_cache;
+    int64_t attr_cache_ttl;
+    uint64_t attr_cache_gen;
 } V9fsState;
 
 typedef struct V9fsStatState {
@@ -395,11 +399,15 @@ extern void v9fs_path_free(V9fsPath *path);
 extern void v9fs_path_copy(V9fsPath *lhs, V9fsPath *rhs);
 extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
+extern void v9fs_attr_cache_init(V9fsState *s, int64_t ttl);
+extern void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path);
+extern void v9fs_attr_cache_flush(V9fsState *s);
 
 #define pdu_marshal(pdu, offset, fmt, args...)  \
-    v9fs_marshal(pdu->elem.in_sg, pdu->elem.in_num, offset, 1, fmt, ##args)
+    v9fs_marshal(pdu->elem->in_sg, pdu->elem->in_num, offset, 1, fmt, ##args)
 #define pdu_unmarshal(pdu, offset, fmt, args...)  \
-    v9fs_unmarshal(pdu->elem.out_sg, pdu->elem.out_num, offset, 1, fmt, ##args)
+    v9fs_unmarshal(pdu->elem->out_sg, pdu->elem->out_num, offset, 1, \
+                   fmt, ##args)
 
 #define TYPE_VIRTIO_9P "virtio-9p-device"
 #define VIRTIO_9P(obj) \
@@ -13,6 +13,15 @@
  */
 
 #include "ioq.h"
+#include "qemu/iov.h"
+
+/* A single iocb submitted on behalf of several contiguous queued iocbs */
+typedef struct {
+    struct iocb iocb;
+    unsigned int nreqs;
+    struct iocb **reqs;             /* original iocbs, in offset order */
+    size_t *lens;                   /* byte count of each original iocb */
+} IOQueueMerge;
 
 void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
 {
@@ -39,6 +48,13 @@ void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
 
     ioq->queue = g_malloc0(sizeof ioq->queue[0] * max_reqs);
     ioq->queue_idx = 0;
+
+    ioq->merge_max_iov = 0;
+}
+
+void ioq_set_merge(IOQueue *ioq, unsigned int max_iov)
+{
+    ioq->merge_max_iov = MIN(max_iov, IOV_MAX);
 }
 
 void ioq_cleanup(IOQueue *ioq)
@@ -87,18 +103,154 @@ struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
     return iocb;
 }
 
+static size_t ioq_iocb_len(struct iocb *iocb)
+{
+    return iov_size(iocb->u.c.buf, iocb->u.c.nbytes);
+}
+
+/* Can @next extend the run ending with @prev that already holds @niov iovecs? */
+static bool ioq_can_merge(IOQueue *ioq, struct iocb *prev, size_t prev_len,
+                          struct iocb *next, unsigned int niov)
+{
+    return next->aio_lio_opcode == prev->aio_lio_opcode &&
+           next->u.c.offset == prev->u.c.offset + prev_len &&
+           niov + next->u.c.nbytes <= ioq->merge_max_iov;
+}
+
+/* Replace queue[start..start+count) with one iocb covering all of them */
+static struct iocb *ioq_merge(IOQueue *ioq, unsigned int start,
+                              unsigned int count, unsigned int niov)
+{
+    IOQueueMerge *merge = g_slice_new(IOQueueMerge);
+    struct iocb *first = ioq->queue[start];
+    struct iovec *iov = g_new(struct iovec, niov);
+    unsigned int i, n = 0;
+
+    merge->nreqs = count;
+    merge->reqs = g_new(struct iocb *, count);
+    merge->lens = g_new(size_t, count);
+    for (i = 0; i < count; i++) {
+        struct iocb *iocb = ioq->queue[start + i];
+
+        memcpy(&iov[n], iocb->u.c.buf, iocb->u.c.nbytes * sizeof(*iov));
+        n += iocb->u.c.nbytes;
+        merge->reqs[i] = iocb;
+        merge->lens[i] = ioq_iocb_len(iocb);
+    }
+
+    if (first->aio_lio_opcode == IO_CMD_PREADV) {
+        io_prep_preadv(&merge->iocb, ioq->fd, iov, niov, first->u.c.offset);
+    } else {
+        io_prep_pwritev(&merge->iocb, ioq->fd, iov, niov, first->u.c.offset);
+    }
+    io_set_eventfd(&merge->iocb, event_notifier_get_fd(&ioq->io_notifier));
+
+    /* Plain iocbs have data == NULL since io_prep_*() clears the iocb */
+    merge->iocb.data = merge;
+    return &merge->iocb;
+}
+
+static void ioq_merge_free(IOQueueMerge *merge)
+{
+    g_free(merge->reqs);
+    g_free(merge->lens);
+    g_slice_free(IOQueueMerge, merge);
+}
+
+/* Coalesce runs of contiguous queued iocbs in place, returns new length */
+static unsigned int ioq_merge_queue(IOQueue *ioq)
+{
+    unsigned int i = 0, out = 0;
+
+    while (i < ioq->queue_idx) {
+        struct iocb *prev = ioq->queue[i];
+        size_t prev_len = ioq_iocb_len(prev);
+        unsigned int niov = prev->u.c.nbytes;
+        unsigned int count = 1;
+
+        while (i + count < ioq->queue_idx &&
+               ioq_can_merge(ioq, prev, prev_len,
+                             ioq->queue[i + count], niov)) {
+            prev = ioq->queue[i + count];
+            prev_len = ioq_iocb_len(prev);
+            niov += prev->u.c.nbytes;
+            count++;
+        }
+
+        if (count > 1) {
+            ioq->queue[out++] = ioq_merge(ioq, i, count, niov);
+        } else {
+            ioq->queue[out++] = ioq->queue[i];
+        }
+        i += count;
+    }
+    return out;
+}
+
 int ioq_submit(IOQueue *ioq)
 {
-    int rc = io_submit(ioq->io_ctx, ioq->queue_idx, ioq->queue);
+    unsigned int nreqs = ioq->queue_idx;
+    unsigned int n = nreqs;
+    unsigned int i;
+    int rc;
+
+    if (ioq->merge_max_iov && nreqs > 1) {
+        n = ioq_merge_queue(ioq);
+    }
+
+    rc = io_submit(ioq->io_ctx, n, ioq->queue);
+
+    /* The kernel has copied the iovecs, merged arrays can go now */
+    for (i = 0; i < n; i++) {
+        IOQueueMerge *merge = ioq->queue[i]->data;
+
+        if (merge) {
+            g_free(merge->iocb.u.c.buf);
+            merge->iocb.u.c.buf = NULL;
+            if (rc < 0 || i >= rc) {
+                ioq_merge_free(merge);
+            }
+        }
+    }
+
     ioq->queue_idx = 0; /* reset */
-    return rc;
+    return rc == (int)n ? nreqs : rc;
+}
+
+/* Split the result of a merged iocb across the requests it covered.  A short
+ * transfer completes the fully covered requests and fails the rest.
+ */
+static int ioq_complete_merge(IOQueue *ioq, IOQueueMerge *merge, ssize_t ret,
+                              IOQueueCompletion *completion, void *opaque)
+{
+    unsigned int i, nreqs = merge->nreqs;
+
+    for (i = 0; i < nreqs; i++) {
+        struct iocb *iocb = merge->reqs[i];
+        ssize_t req_ret;
+
+        if (ret < 0) {
+            req_ret = ret;
+        } else if (ret >= merge->lens[i]) {
+            req_ret = merge->lens[i];
+            ret -= merge->lens[i];
+        } else {
+            req_ret = -EIO;
+            ret = 0;
+        }
+        completion(iocb, req_ret, opaque);
+        ioq_put_iocb(ioq, iocb);
+    }
+
+    ioq_merge_free(merge);
+    return nreqs;
 }
 
 int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
                        void *opaque)
 {
     struct io_event events[ioq->max_reqs];
-    int nevents, i;
+    int nevents, i, ncompleted = 0;
 
     do {
         nevents = io_getevents(ioq->io_ctx, 0, ioq->max_reqs, events, NULL);
@@ -109,9 +261,16 @@ int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
 
     for (i = 0; i < nevents; i++) {
         ssize_t ret = ((uint64_t)events[i].res2 << 32) | events[i].res;
+        IOQueueMerge *merge = events[i].obj->data;
 
+        if (merge) {
+            ncompleted += ioq_complete_merge(ioq, merge, ret,
+                                             completion, opaque);
+            continue;
+        }
         completion(events[i].obj, ret, opaque);
         ioq_put_iocb(ioq, events[i].obj);
+        ncompleted++;
     }
-    return nevents;
+    return ncompleted;
 }
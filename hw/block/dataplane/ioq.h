@@ -34,9 +34,15 @@ typedef struct {
     /* Multiple requests are queued up before submitting them all in one go */
     struct iocb **queue;            /* queued iocbs */
     unsigned int queue_idx;
+
+    /* Contiguous queued reads or writes are coalesced into one iocb of at
+     * most merge_max_iov iovecs on submit, 0 disables merging.
+     */
+    unsigned int merge_max_iov;
 } IOQueue;
 
 void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs);
+void ioq_set_merge(IOQueue *ioq, unsigned int max_iov);
 void ioq_cleanup(IOQueue *ioq);
 EventNotifier *ioq_get_notifier(IOQueue *ioq);
 struct iocb *ioq_get_iocb(IOQueue *ioq);
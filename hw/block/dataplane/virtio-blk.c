@@ -16,6 +16,9 @@
 #include "qemu/iov.h"
 #include "qemu/thread.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
 #include "hw/virtio/dataplane/vring.h"
 #include "ioq.h"
 #include "block/block.h"
@@ -37,20 +40,36 @@ typedef struct {
     QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
     unsigned int head;              /* vring descriptor index */
     struct iovec *bounce_iov;       /* used if guest buffers are unaligned */
-    QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
+    QEMUIOVector *read_qiov;        /* guest buffers of a read, for the bounce
+                                       buffer copy and dirty logging */
 } VirtIOBlockRequest;
 
-struct VirtIOBlockDataPlane {
-    bool started;
-    bool starting;
-    bool stopping;
-    QEMUBH *start_bh;
-    QemuThread thread;
+typedef struct VirtIOBlockDataPlaneQueue VirtIOBlockDataPlaneQueue;
 
-    VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
+/* Request forwarded to the block layer when the image is not a raw file */
+typedef struct VirtIOBlockBdrvRequest {
+    VirtIOBlockDataPlaneQueue *q;
+    uint32_t type;                  /* VIRTIO_BLK_T_IN, _OUT or _FLUSH */
+    int64_t sector;
+    QEMUIOVector qiov;              /* copy of the guest buffer iovecs */
+    unsigned int head;              /* vring descriptor index */
+    QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
+    BlockAcctCookie acct;
+    int ret;
+    QSIMPLEQ_ENTRY(VirtIOBlockBdrvRequest) next;
+} VirtIOBlockBdrvRequest;
+
+/* Each virtqueue is serviced by its own thread with its own AioContext and
+ * Linux AIO context so that queues never contend with each other.  When the
+ * device is assigned to an IOThread, all queues share its AioContext and
+ * thread instead.
+ */
+struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    unsigned int index;             /* virtqueue index */
+    QemuThread thread;
+    bool exited;                    /* thread has left its loop */
 
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
 
@@ -63,27 +82,56 @@ struct VirtIOBlockDataPlane {
     EventNotifier io_notifier;      /* Linux AIO completion */
     EventNotifier host_notifier;    /* doorbell */
 
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       dataplane thread) */
+    IOQueue ioqueue;                /* Linux AIO queue */
     VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
                                              queue */
 
     unsigned int num_reqs;
+
+    int64_t poll_ns;                /* current busy-poll window */
+
+    /* Block layer mode.  The BlockDriverState belongs to the main loop, so
+     * requests are passed to it through bdrv_bh and completions come back on
+     * bdrv_notifier.  Both lists are protected by bdrv_lock.
+     */
+    QemuMutex bdrv_lock;
+    QSIMPLEQ_HEAD(, VirtIOBlockBdrvRequest) bdrv_submitted;
+    QSIMPLEQ_HEAD(, VirtIOBlockBdrvRequest) bdrv_completed;
+    QEMUBH *bdrv_bh;
+    EventNotifier bdrv_notifier;
+};
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    QEMUBH *start_bh;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor, -1 when requests
+                                       go through the block layer */
+    IOThread *iothread;             /* runs all queues, or NULL */
+
+    VirtIODevice *vdev;
+    unsigned int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
+
+    int64_t poll_max_ns;            /* busy-poll limit, 0 disables polling */
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
 static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
     struct virtio_blk_inhdr hdr;
     int len;
@@ -96,11 +144,16 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
         len = 0;
     }
 
-    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+    trace_virtio_blk_data_plane_complete_request(q->s, q->index, req->head,
+                                                 ret);
 
     if (req->read_qiov) {
-        assert(req->bounce_iov);
-        qemu_iovec_from_buf(req->read_qiov, 0, req->bounce_iov->iov_base, len);
+        if (req->bounce_iov) {
+            qemu_iovec_from_buf(req->read_qiov, 0, req->bounce_iov->iov_base,
+                                len);
+        }
+        hostmem_set_dirty_iov(&q->vring.hostmem, req->read_qiov->iov,
+                              req->read_qiov->niov);
         qemu_iovec_destroy(req->read_qiov);
         g_slice_free(QEMUIOVector, req->read_qiov);
     }
@@ -111,6 +164,8 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
     }
 
     qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
+    hostmem_set_dirty_iov(&q->vring.hostmem, req->inhdr->iov,
+                          req->inhdr->niov);
     qemu_iovec_destroy(req->inhdr);
     g_slice_free(QEMUIOVector, req->inhdr);
 
@@ -118,12 +173,13 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * written to, but for virtio-blk it seems to be the number of bytes
      * transferred plus the status bytes.
      */
-    vring_push(&s->vring, req->head, len + sizeof(hdr));
+    vring_push(&q->vring, req->head, len + sizeof(hdr));
 
-    s->num_reqs--;
+    q->num_reqs--;
 }
 
-static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
+static void complete_request_early(VirtIOBlockDataPlaneQueue *q,
+                                   unsigned int head,
                                    QEMUIOVector *inhdr, unsigned char status)
 {
     struct virtio_blk_inhdr hdr = {
@@ -131,27 +187,29 @@ static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
     };
 
     qemu_iovec_from_buf(inhdr, 0, &hdr, sizeof(hdr));
+    hostmem_set_dirty_iov(&q->vring.hostmem, inhdr->iov, inhdr->niov);
     qemu_iovec_destroy(inhdr);
     g_slice_free(QEMUIOVector, inhdr);
 
-    vring_push(&s->vring, head, sizeof(hdr));
-    notify_guest(s);
+    vring_push(&q->vring, head, sizeof(hdr));
+    notify_guest(q);
 }
 
 /* Get disk serial number */
-static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+static void do_get_id_cmd(VirtIOBlockDataPlaneQueue *q,
                           struct iovec *iov, unsigned int iov_cnt,
                           unsigned int head, QEMUIOVector *inhdr)
 {
     char id[VIRTIO_BLK_ID_BYTES];
 
     /* Serial number not NUL-terminated when shorter than buffer */
-    strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
+    strncpy(id, q->s->blk->serial ? q->s->blk->serial : "", sizeof(id));
     iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
-    complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+    hostmem_set_dirty_iov(&q->vring.hostmem, iov, iov_cnt);
+    complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+static int do_rdwr_cmd(VirtIOBlockDataPlaneQueue *q, bool read,
                        struct iovec *iov, unsigned int iov_cnt,
                        long long offset, unsigned int head,
                        QEMUIOVector *inhdr)
@@ -160,17 +218,22 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
     QEMUIOVector qiov;
     struct iovec *bounce_iov = NULL;
     QEMUIOVector *read_qiov = NULL;
+    VirtIOBlockDataPlane *s = q->s;
 
     qemu_iovec_init_external(&qiov, iov, iov_cnt);
+    if (read) {
+        /* The iovec array does not outlive handle_notify() but completion
+         * needs the guest buffers to copy back from a bounce buffer and to
+         * mark them dirty.
+         */
+        read_qiov = g_slice_new(QEMUIOVector);
+        qemu_iovec_init(read_qiov, iov_cnt);
+        qemu_iovec_concat_iov(read_qiov, iov, iov_cnt, 0, qiov.size);
+    }
     if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
         void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
 
-        if (read) {
-            /* Need to copy back from bounce buffer on completion */
-            read_qiov = g_slice_new(QEMUIOVector);
-            qemu_iovec_init(read_qiov, iov_cnt);
-            qemu_iovec_concat_iov(read_qiov, iov, iov_cnt, 0, qiov.size);
-        } else {
+        if (!read) {
             qemu_iovec_to_buf(&qiov, 0, bounce_buffer, qiov.size);
         }
 
@@ -182,7 +245,7 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
         iov_cnt = 1;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    iocb = ioq_rdwr(&q->ioqueue, read, iov, iov_cnt, offset);
 
     /* Fill in virtio block metadata needed for completion */
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
@@ -193,11 +256,92 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
     return 0;
 }
 
+/* Runs in the main loop with the global mutex held */
+static void bdrv_request_cb(void *opaque, int ret)
+{
+    VirtIOBlockBdrvRequest *req = opaque;
+    VirtIOBlockDataPlaneQueue *q = req->q;
+
+    bdrv_acct_done(q->s->blk->conf.bs, &req->acct);
+    req->ret = ret;
+
+    qemu_mutex_lock(&q->bdrv_lock);
+    QSIMPLEQ_INSERT_TAIL(&q->bdrv_completed, req, next);
+    qemu_mutex_unlock(&q->bdrv_lock);
+
+    event_notifier_set(&q->bdrv_notifier);
+}
+
+/* Runs in the main loop with the global mutex held */
+static void bdrv_submit_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+    BlockDriverState *bs = q->s->blk->conf.bs;
+    QSIMPLEQ_HEAD(, VirtIOBlockBdrvRequest) reqs;
+    VirtIOBlockBdrvRequest *req, *next_req;
+
+    QSIMPLEQ_INIT(&reqs);
+    qemu_mutex_lock(&q->bdrv_lock);
+    QSIMPLEQ_CONCAT(&reqs, &q->bdrv_submitted);
+    qemu_mutex_unlock(&q->bdrv_lock);
+
+    QSIMPLEQ_FOREACH_SAFE(req, &reqs, next, next_req) {
+        switch (req->type) {
+        case VIRTIO_BLK_T_IN:
+            bdrv_acct_start(bs, &req->acct, req->qiov.size, BDRV_ACCT_READ);
+            bdrv_aio_readv(bs, req->sector, &req->qiov,
+                           req->qiov.size / BDRV_SECTOR_SIZE,
+                           bdrv_request_cb, req);
+            break;
+        case VIRTIO_BLK_T_OUT:
+            bdrv_acct_start(bs, &req->acct, req->qiov.size, BDRV_ACCT_WRITE);
+            bdrv_aio_writev(bs, req->sector, &req->qiov,
+                            req->qiov.size / BDRV_SECTOR_SIZE,
+                            bdrv_request_cb, req);
+            break;
+        case VIRTIO_BLK_T_FLUSH:
+            bdrv_acct_start(bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+            bdrv_aio_flush(bs, bdrv_request_cb, req);
+            break;
+        default:
+            abort();
+        }
+    }
+}
+
+static void do_bdrv_cmd(VirtIOBlockDataPlaneQueue *q, uint32_t type,
+                        struct iovec *iov, unsigned int iov_cnt,
+                        int64_t sector, unsigned int head, QEMUIOVector *inhdr)
+{
+    VirtIOBlockBdrvRequest *req = g_slice_new0(VirtIOBlockBdrvRequest);
+
+    req->q = q;
+    req->type = type;
+    req->sector = sector;
+    req->head = head;
+    req->inhdr = inhdr;
+
+    /* The iovec array is only valid during handle_notify(), the guest
+     * buffers it points to stay mapped until the request is pushed back.
+     */
+    qemu_iovec_init(&req->qiov, iov_cnt);
+    qemu_iovec_concat_iov(&req->qiov, iov, iov_cnt, 0,
+                          iov_size(iov, iov_cnt));
+
+    qemu_mutex_lock(&q->bdrv_lock);
+    QSIMPLEQ_INSERT_TAIL(&q->bdrv_submitted, req, next);
+    qemu_mutex_unlock(&q->bdrv_lock);
+
+    q->num_reqs++;
+    qemu_bh_schedule(q->bdrv_bh);
+}
+
 static int process_request(IOQueue *ioq, struct iovec iov[],
                            unsigned int out_num, unsigned int in_num,
                            unsigned int head)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
+    VirtIOBlockDataPlaneQueue *q = container_of(ioq, VirtIOBlockDataPlaneQueue,
+                                                ioqueue);
     struct iovec *in_iov = &iov[out_num];
     struct virtio_blk_outhdr outhdr;
     QEMUIOVector *inhdr;
@@ -229,29 +373,43 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
+        if (q->s->fd < 0) {
+            do_bdrv_cmd(q, outhdr.type, in_iov, in_num, outhdr.sector,
+                        head, inhdr);
+            return 0;
+        }
+        do_rdwr_cmd(q, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, head, inhdr);
+        if (q->s->fd < 0) {
+            do_bdrv_cmd(q, outhdr.type, iov, out_num, outhdr.sector,
+                        head, inhdr);
+            return 0;
+        }
+        do_rdwr_cmd(q, false, iov, out_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
         /* TODO support SCSI commands */
-        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        complete_request_early(q, head, inhdr, VIRTIO_BLK_S_UNSUPP);
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
+        if (q->s->fd < 0) {
+            do_bdrv_cmd(q, outhdr.type, NULL, 0, 0, head, inhdr);
+            return 0;
+        }
         /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
-        if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+        if (qemu_fdatasync(q->s->fd) < 0) {
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_IOERR);
         } else {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
         }
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
-        do_get_id_cmd(s, in_iov, in_num, head, inhdr);
+        do_get_id_cmd(q, in_iov, in_num, head, inhdr);
         return 0;
 
     default:
@@ -264,8 +422,9 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
 static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIODevice *vdev = q->s->vdev;
 
     /* There is one array of iovecs into which all new requests are extracted
      * from the vring.  Requests are read from the vring and the translated
@@ -292,22 +451,22 @@ static void handle_notify(EventNotifier *e)
     unsigned int out_num = 0, in_num = 0;
     unsigned int num_queued;
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    event_notifier_test_and_clear(&q->host_notifier);
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(vdev, &q->vring);
 
         for (;;) {
-            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            head = vring_pop(vdev, &q->vring, iov, end, &out_num, &in_num);
             if (head < 0) {
                 break; /* no more requests */
             }
 
-            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
-                                                        head);
+            trace_virtio_blk_data_plane_process_request(q->s, q->index,
+                                                        out_num, in_num, head);
 
-            if (process_request(&s->ioqueue, iov, out_num, in_num, head) < 0) {
-                vring_set_broken(&s->vring);
+            if (process_request(&q->ioqueue, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&q->vring);
                 break;
             }
             iov += out_num + in_num;
@@ -317,7 +476,7 @@ static void handle_notify(EventNotifier *e)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(vdev, &q->vring)) {
                 break;
             }
         } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
@@ -329,11 +488,11 @@ static void handle_notify(EventNotifier *e)
         }
     }
 
-    num_queued = ioq_num_queued(&s->ioqueue);
+    num_queued = ioq_num_queued(&q->ioqueue);
     if (num_queued > 0) {
-        s->num_reqs += num_queued;
+        q->num_reqs += num_queued;
 
-        int rc = ioq_submit(&s->ioqueue);
+        int rc = ioq_submit(&q->ioqueue);
         if (unlikely(rc < 0)) {
             fprintf(stderr, "ioq_submit failed %d\n", rc);
             exit(1);
@@ -343,41 +502,221 @@ static void handle_notify(EventNotifier *e)
 
 static void handle_io(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                io_notifier);
 
-    event_notifier_test_and_clear(&s->io_notifier);
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
+    event_notifier_test_and_clear(&q->io_notifier);
+    if (ioq_run_completion(&q->ioqueue, complete_request, q) > 0) {
+        notify_guest(q);
     }
 
     /* If there were more requests than iovecs, the vring will not be empty yet
      * so check again.  There should now be enough resources to process more
      * requests.
      */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->host_notifier);
+    if (unlikely(vring_more_avail(&q->vring))) {
+        handle_notify(&q->host_notifier);
+    }
+}
+
+/* Push block layer completions back onto the vring, returns their number */
+static int bdrv_run_completion(VirtIOBlockDataPlaneQueue *q)
+{
+    QSIMPLEQ_HEAD(, VirtIOBlockBdrvRequest) reqs;
+    VirtIOBlockBdrvRequest *req, *next_req;
+    int n = 0;
+
+    QSIMPLEQ_INIT(&reqs);
+    qemu_mutex_lock(&q->bdrv_lock);
+    QSIMPLEQ_CONCAT(&reqs, &q->bdrv_completed);
+    qemu_mutex_unlock(&q->bdrv_lock);
+
+    QSIMPLEQ_FOREACH_SAFE(req, &reqs, next, next_req) {
+        struct virtio_blk_inhdr hdr;
+        int len = 0;
+
+        trace_virtio_blk_data_plane_complete_request(q->s, q->index,
+                                                     req->head, req->ret);
+
+        if (req->ret == 0) {
+            hdr.status = VIRTIO_BLK_S_OK;
+            if (req->type != VIRTIO_BLK_T_FLUSH) {
+                len = req->qiov.size;
+            }
+        } else {
+            hdr.status = VIRTIO_BLK_S_IOERR;
+        }
+
+        if (req->type == VIRTIO_BLK_T_IN) {
+            hostmem_set_dirty_iov(&q->vring.hostmem, req->qiov.iov,
+                                  req->qiov.niov);
+        }
+
+        qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
+        hostmem_set_dirty_iov(&q->vring.hostmem, req->inhdr->iov,
+                              req->inhdr->niov);
+        qemu_iovec_destroy(req->inhdr);
+        g_slice_free(QEMUIOVector, req->inhdr);
+
+        vring_push(&q->vring, req->head, len + sizeof(hdr));
+
+        qemu_iovec_destroy(&req->qiov);
+        g_slice_free(VirtIOBlockBdrvRequest, req);
+        q->num_reqs--;
+        n++;
+    }
+    return n;
+}
+
+static void handle_bdrv_complete(EventNotifier *e)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                bdrv_notifier);
+
+    event_notifier_test_and_clear(&q->bdrv_notifier);
+    if (bdrv_run_completion(q) > 0) {
+        notify_guest(q);
+    }
+
+    /* As in handle_io(), requests may have been left in the vring when the
+     * iovecs ran out.
+     */
+    if (unlikely(vring_more_avail(&q->vring))) {
+        handle_notify(&q->host_notifier);
+    }
+}
+
+/* Busy-poll the avail ring and the Linux AIO completion ring for up to
+ * q->poll_ns instead of sleeping on the doorbell and completion eventfds.
+ * Guest->host notifies stay disabled while polling so the guest does not
+ * take vmexits for kicks nobody waits for.
+ *
+ * Returns true if any request was submitted or completed.
+ */
+static bool data_plane_poll(VirtIOBlockDataPlaneQueue *q)
+{
+    VirtIODevice *vdev = q->s->vdev;
+    int64_t deadline = get_clock() + q->poll_ns;
+    bool progress = false;
+
+    vring_disable_notification(vdev, &q->vring);
+    do {
+        if (vring_more_avail(&q->vring)) {
+            handle_notify(&q->host_notifier);
+            vring_disable_notification(vdev, &q->vring);
+            progress = true;
+        }
+        if (q->num_reqs > 0 && q->s->fd < 0) {
+            if (bdrv_run_completion(q) > 0) {
+                event_notifier_test_and_clear(&q->bdrv_notifier);
+                notify_guest(q);
+                progress = true;
+            }
+        } else if (q->num_reqs > 0 &&
+                   ioq_run_completion(&q->ioqueue, complete_request, q) > 0) {
+            /* Swallow the eventfd signal for the completions reaped here */
+            event_notifier_test_and_clear(&q->io_notifier);
+            notify_guest(q);
+            progress = true;
+        }
+    } while (!progress && !q->s->stopping && get_clock() < deadline);
+
+    /* The guest may have added descriptors just before notifies came back */
+    if (!vring_enable_notification(vdev, &q->vring)) {
+        handle_notify(&q->host_notifier);
+        progress = true;
+    }
+    return progress;
+}
+
+/* Self-tune the poll window from its hit rate: halve it whenever a poll
+ * expires without finding work (block_ns < 0), grow it when a blocking wait
+ * ends sooner than the limit, i.e. when a longer window would have caught the
+ * event without sleeping.
+ */
+static void data_plane_poll_adjust(VirtIOBlockDataPlaneQueue *q,
+                                   int64_t block_ns)
+{
+    int64_t max_ns = q->s->poll_max_ns;
+    int64_t old_ns = q->poll_ns;
+
+    if (block_ns < 0) {
+        q->poll_ns /= 2;
+    } else if (block_ns < max_ns) {
+        q->poll_ns = MIN(MAX(q->poll_ns * 2, block_ns), max_ns);
+    }
+    if (q->poll_ns != old_ns) {
+        trace_virtio_blk_data_plane_poll_adjust(q->s, q->index, q->poll_ns);
     }
 }
 
 static void *data_plane_thread(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
+    int64_t start;
 
-    while (!s->stopping || s->num_reqs > 0) {
-        aio_poll(s->ctx, true);
+    while (!q->s->stopping || q->num_reqs > 0) {
+        if (q->poll_ns) {
+            if (data_plane_poll(q)) {
+                continue;
+            }
+            data_plane_poll_adjust(q, -1);
+        }
+        if (!q->s->poll_max_ns) {
+            aio_poll(q->ctx, true);
+            continue;
+        }
+        start = get_clock();
+        aio_poll(q->ctx, true);
+        data_plane_poll_adjust(q, get_clock() - start);
     }
+
+    /* virtio_blk_data_plane_stop() may be waiting in the main loop */
+    atomic_mb_set(&q->exited, true);
+    aio_notify(qemu_get_aio_context());
     return NULL;
 }
 
+/* Stop the queues of a device that runs in an IOThread.  The caller holds
+ * the AioContext, so the IOThread cannot run handlers meanwhile.  Requests
+ * that the guest adds from now on stay in the vrings for virtio-blk, those
+ * already in flight are completed here.
+ */
+static void iothread_drain(VirtIOBlockDataPlane *s)
+{
+    AioContext *ctx = iothread_get_aio_context(s->iothread);
+    unsigned int n, num_reqs;
+
+    for (n = 0; n < s->num_queues; n++) {
+        aio_set_event_notifier(ctx, &s->queues[n].host_notifier, NULL);
+    }
+
+    for (;;) {
+        num_reqs = 0;
+        for (n = 0; n < s->num_queues; n++) {
+            num_reqs += s->queues[n].num_reqs;
+        }
+        if (!num_reqs) {
+            break;
+        }
+        if (s->fd < 0) {
+            bdrv_drain_all();
+        }
+        aio_poll(ctx, true);
+    }
+}
+
 static void start_data_plane_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    unsigned int i;
 
     qemu_bh_delete(s->start_bh);
     s->start_bh = NULL;
-    qemu_thread_create(&s->thread, data_plane_thread,
-                       s, QEMU_THREAD_JOINABLE);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_thread_create(&s->queues[i].thread, data_plane_thread,
+                           &s->queues[i], QEMU_THREAD_JOINABLE);
+    }
 }
 
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
@@ -403,28 +742,33 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return false;
     }
 
+    /* Raw images opened with cache=none,aio=native are accessed directly
+     * with Linux AIO.  Other drives go through the block layer, so image
+     * formats, I/O throttling and block jobs keep working.
+     */
+    fd = raw_get_aio_fd(blk->conf.bs);
+
     /* If dataplane is (re-)enabled while the guest is running there could be
      * block jobs that can conflict.
      */
-    if (bdrv_in_use(blk->conf.bs)) {
+    if (fd >= 0 && bdrv_in_use(blk->conf.bs)) {
         error_report("cannot start dataplane thread while device is in use");
         return false;
     }
 
-    fd = raw_get_aio_fd(blk->conf.bs);
-    if (fd < 0) {
-        error_report("drive is incompatible with x-data-plane, "
-                     "use format=raw,cache=none,aio=native");
-        return false;
-    }
-
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->fd = fd;
     s->blk = blk;
+    s->iothread = blk->iothread;
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    s->poll_max_ns = (int64_t)blk->poll_us * 1000;
 
     /* Prevent block operations that conflict with data plane thread */
-    bdrv_set_in_use(blk->conf.bs, 1);
+    if (fd >= 0) {
+        bdrv_set_in_use(blk->conf.bs, 1);
+    }
 
     *dataplane = s;
     return true;
@@ -437,7 +781,10 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     }
 
     virtio_blk_data_plane_stop(s);
-    bdrv_set_in_use(s->blk->conf.bs, 0);
+    if (s->fd >= 0) {
+        bdrv_set_in_use(s->blk->conf.bs, 0);
+    }
+    g_free(s->queues);
     g_free(s);
 }
 
@@ -445,7 +792,9 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOBlockDataPlaneQueue *q;
     VirtQueue *vq;
+    unsigned int n;
     int i;
 
     if (s->started) {
@@ -458,46 +807,99 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        s->starting = false;
-        return;
+    for (n = 0; n < s->num_queues; n++) {
+        if (!vring_setup(&s->queues[n].vring, s->vdev, n)) {
+            while (n-- > 0) {
+                vring_teardown(&s->queues[n].vring, s->vdev, n);
+            }
+            s->starting = false;
+            return;
+        }
     }
 
-    s->ctx = aio_context_new();
-
-    /* Set up guest notifier (irq) */
-    if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
+    /* Set up guest notifiers (irq).  With MSI-X every queue is routed to its
+     * own vector so the guest can steer completions of each queue to the vCPU
+     * that submits on it.
+     */
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
-    /* Set up virtqueue notify */
-    if (k->set_host_notifier(qbus->parent, 0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
+    if (s->iothread) {
+        /* The IOThread is running, keep it out while handlers are added */
+        aio_context_acquire(iothread_get_aio_context(s->iothread));
+    }
+
+    for (n = 0; n < s->num_queues; n++) {
+        q = &s->queues[n];
+        vq = virtio_get_queue(s->vdev, n);
+        q->s = s;
+        q->index = n;
+        q->num_reqs = 0;
+        q->exited = false;
+        q->poll_ns = s->poll_max_ns;
+        if (s->iothread) {
+            q->ctx = iothread_get_aio_context(s->iothread);
+            aio_context_ref(q->ctx);
+        } else {
+            q->ctx = aio_context_new();
+        }
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, n, true) != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier\n");
+            exit(1);
+        }
+        q->host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify);
+
+        if (s->fd < 0) {
+            /* Set up block layer request forwarding */
+            qemu_mutex_init(&q->bdrv_lock);
+            QSIMPLEQ_INIT(&q->bdrv_submitted);
+            QSIMPLEQ_INIT(&q->bdrv_completed);
+            q->bdrv_bh = qemu_bh_new(bdrv_submit_bh, q);
+            if (event_notifier_init(&q->bdrv_notifier, 0) != 0) {
+                fprintf(stderr, "virtio-blk failed to create notifier\n");
+                exit(1);
+            }
+            aio_set_event_notifier(q->ctx, &q->bdrv_notifier,
+                                   handle_bdrv_complete);
+            continue;
+        }
+
+        /* Set up ioqueue */
+        ioq_init(&q->ioqueue, s->fd, REQ_MAX);
+        ioq_set_merge(&q->ioqueue, s->blk->merge_iov);
+        for (i = 0; i < ARRAY_SIZE(q->requests); i++) {
+            ioq_put_iocb(&q->ioqueue, &q->requests[i].iocb);
+        }
+        q->io_notifier = *ioq_get_notifier(&q->ioqueue);
+        aio_set_event_notifier(q->ctx, &q->io_notifier, handle_io);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    if (s->iothread) {
+        aio_context_release(iothread_get_aio_context(s->iothread));
     }
-    s->io_notifier = *ioq_get_notifier(&s->ioqueue);
-    aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io);
 
     s->starting = false;
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    /* Kick right away to begin processing requests already in vrings */
+    for (n = 0; n < s->num_queues; n++) {
+        vq = virtio_get_queue(s->vdev, n);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
 
-    /* Spawn thread in BH so it inherits iothread cpusets */
+    if (s->iothread) {
+        return;
+    }
+
+    /* Spawn threads in BH so they inherit iothread cpusets */
     s->start_bh = qemu_bh_new(start_data_plane_bh, s);
     qemu_bh_schedule(s->start_bh);
 }
@@ -506,33 +908,78 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOBlockDataPlaneQueue *q;
+    unsigned int n;
+    bool exited;
+
     if (!s->started || s->stopping) {
         return;
     }
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    /* Stop thread or cancel pending thread creation BH */
-    if (s->start_bh) {
+    /* Stop threads or cancel pending thread creation BH */
+    if (s->iothread) {
+        aio_context_acquire(iothread_get_aio_context(s->iothread));
+        iothread_drain(s);
+    } else if (s->start_bh) {
         qemu_bh_delete(s->start_bh);
         s->start_bh = NULL;
     } else {
-        aio_notify(s->ctx);
-        qemu_thread_join(&s->thread);
+        for (n = 0; n < s->num_queues; n++) {
+            aio_notify(s->queues[n].ctx);
+        }
+
+        /* Threads in block layer mode only finish once their in-flight
+         * requests complete, which happens in the main loop.
+         */
+        while (s->fd < 0) {
+            exited = true;
+            for (n = 0; n < s->num_queues; n++) {
+                exited &= atomic_mb_read(&s->queues[n].exited);
+            }
+            if (exited) {
+                break;
+            }
+            bdrv_drain_all();
+            aio_poll(qemu_get_aio_context(), true);
+        }
+
+        for (n = 0; n < s->num_queues; n++) {
+            qemu_thread_join(&s->queues[n].thread);
+        }
     }
 
-    aio_set_event_notifier(s->ctx, &s->io_notifier, NULL);
-    ioq_cleanup(&s->ioqueue);
+    for (n = 0; n < s->num_queues; n++) {
+        q = &s->queues[n];
+
+        if (s->fd < 0) {
+            aio_set_event_notifier(q->ctx, &q->bdrv_notifier, NULL);
+            event_notifier_cleanup(&q->bdrv_notifier);
+            qemu_bh_delete(q->bdrv_bh);
+            q->bdrv_bh = NULL;
+            qemu_mutex_destroy(&q->bdrv_lock);
+        } else {
+            aio_set_event_notifier(q->ctx, &q->io_notifier, NULL);
+            ioq_cleanup(&q->ioqueue);
+        }
+
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL);
+        k->set_host_notifier(qbus->parent, n, false);
 
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
-    k->set_host_notifier(qbus->parent, 0, false);
+        aio_context_unref(q->ctx);
+    }
 
-    aio_context_unref(s->ctx);
+    if (s->iothread) {
+        aio_context_release(iothread_get_aio_context(s->iothread));
+    }
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (n = 0; n < s->num_queues; n++) {
+        vring_teardown(&s->queues[n].vring, s->vdev, n);
+    }
     s->started = false;
     s->stopping = false;
 }
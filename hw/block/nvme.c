@@ -24,10 +24,14 @@
 #include <hw/hw.h>
 #include <hw/pci/msix.h>
 #include <hw/pci/pci.h>
+#include <qemu/atomic.h>
+#include <qemu/event_notifier.h>
+#include <sysemu/kvm.h>
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
+static void nvme_set_cq_head(NvmeCtrl *n, NvmeCQueue *cq, uint16_t new_head);
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -139,6 +143,140 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+static uint16_t nvme_map_sgl_data(QEMUSGList *qsg, NvmeSglDescriptor *desc,
+    uint32_t *len)
+{
+    uint32_t dlen = le32_to_cpu(desc->len);
+
+    if (NVME_SGL_TYPE(desc->type) != NVME_SGL_DESCR_TYPE_DATA_BLOCK ||
+        NVME_SGL_SUBTYPE(desc->type)) {
+        return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+    }
+    /* every data block must make progress, or a guest could loop us */
+    if (!dlen || dlen > *len) {
+        return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+    }
+
+    qemu_sglist_add(qsg, le64_to_cpu(desc->addr), dlen);
+    *len -= dlen;
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_map_sgl(QEMUSGList *qsg, NvmeSglDescriptor *sgl,
+    uint32_t len, NvmeCtrl *n)
+{
+    NvmeSglDescriptor segment[NVME_SGL_SEGMENT_MAX];
+    NvmeSglDescriptor desc = *sgl;
+    uint32_t seg_len, nsgld, i;
+    uint8_t seg_type;
+    uint16_t status = NVME_SUCCESS;
+
+    pci_dma_sglist_init(qsg, &n->parent_obj, 1);
+
+    if (NVME_SGL_TYPE(desc.type) == NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+        status = nvme_map_sgl_data(qsg, &desc, &len);
+        goto out;
+    }
+
+    for (;;) {
+        seg_type = NVME_SGL_TYPE(desc.type);
+        if ((seg_type != NVME_SGL_DESCR_TYPE_SEGMENT &&
+             seg_type != NVME_SGL_DESCR_TYPE_LAST_SEGMENT) ||
+            NVME_SGL_SUBTYPE(desc.type)) {
+            status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+            goto out;
+        }
+
+        seg_len = le32_to_cpu(desc.len);
+        nsgld = seg_len / sizeof(*segment);
+        if (!nsgld || seg_len % sizeof(*segment)) {
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto out;
+        }
+        if (nsgld > NVME_SGL_SEGMENT_MAX) {
+            status = NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR;
+            goto out;
+        }
+        pci_dma_read(&n->parent_obj, le64_to_cpu(desc.addr), segment,
+            seg_len);
+
+        /* the last descriptor of a non-final segment points to the next */
+        if (seg_type == NVME_SGL_DESCR_TYPE_SEGMENT && !--nsgld) {
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto out;
+        }
+        for (i = 0; i < nsgld; i++) {
+            status = nvme_map_sgl_data(qsg, &segment[i], &len);
+            if (status) {
+                goto out;
+            }
+        }
+        if (seg_type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+            break;
+        }
+        desc = segment[nsgld];
+    }
+
+ out:
+    if (!status && len) {
+        status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+    }
+    if (status) {
+        qemu_sglist_destroy(qsg);
+    }
+    return status;
+}
+
+/*
+ * Map the guest buffers of a request straight into an iovec, so that the
+ * whole transfer is a single block layer request.  Returns false if any
+ * part is not directly accessible RAM; the caller then goes through the
+ * bounce-capable dma-helpers instead.
+ */
+static bool nvme_map_iov(NvmeRequest *req, DMADirection dir)
+{
+    QEMUSGList *qsg = &req->qsg;
+    int i;
+
+    req->direct = false;
+    if (qsg->nsg > IOV_MAX) {
+        return false;
+    }
+
+    qemu_iovec_init(&req->iov, qsg->nsg);
+    for (i = 0; i < qsg->nsg; i++) {
+        dma_addr_t len = qsg->sg[i].len;
+        void *mem = dma_memory_map(qsg->as, qsg->sg[i].base, &len, dir);
+
+        if (!mem || len != qsg->sg[i].len) {
+            if (mem) {
+                dma_memory_unmap(qsg->as, mem, len, dir, 0);
+            }
+            for (i = 0; i < req->iov.niov; i++) {
+                dma_memory_unmap(qsg->as, req->iov.iov[i].iov_base,
+                    req->iov.iov[i].iov_len, dir, 0);
+            }
+            qemu_iovec_destroy(&req->iov);
+            return false;
+        }
+        qemu_iovec_add(&req->iov, mem, len);
+    }
+    req->direct = true;
+    return true;
+}
+
+static void nvme_unmap_iov(NvmeRequest *req, DMADirection dir)
+{
+    int i;
+
+    for (i = 0; i < req->iov.niov; i++) {
+        dma_memory_unmap(req->qsg.as, req->iov.iov[i].iov_base,
+            req->iov.iov[i].iov_len, dir, req->iov.iov[i].iov_len);
+    }
+    qemu_iovec_destroy(&req->iov);
+    req->direct = false;
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
@@ -154,6 +292,130 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return NVME_SUCCESS;
 }
 
+/*
+ * Shadow doorbells: once the guest issued Doorbell Buffer Config, it
+ * writes the SQ tail and CQ head of every I/O queue to a page in its own
+ * memory, and only rings the MMIO doorbell when the value moves past the
+ * event index that the controller publishes in a second page.
+ */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < sq->size) {
+        sq->tail = v;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < cq->size) {
+        cq->head = v;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
+static bool nvme_cq_full_dbbuf(NvmeCQueue *cq)
+{
+    if (!cq->db_addr) {
+        return nvme_cq_full(cq);
+    }
+
+    nvme_update_cq_head(cq);
+    if (!nvme_cq_full(cq)) {
+        return false;
+    }
+
+    /* ask for a doorbell write when the guest frees an entry */
+    nvme_update_cq_eventidx(cq);
+    smp_mb();
+    nvme_update_cq_head(cq);
+    return nvme_cq_full(cq);
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+    uint32_t v;
+
+    if (event_notifier_test_and_clear(e)) {
+        pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+        nvme_set_cq_head(cq->ctrl, cq, le32_to_cpu(v));
+    }
+}
+
+static void nvme_init_ioeventfd(NvmeCtrl *n, EventNotifier *e, hwaddr offset,
+                                EventNotifierHandler *handler, bool *enabled)
+{
+    if (!kvm_has_many_ioeventfds() || event_notifier_init(e, 0) < 0) {
+        return;
+    }
+    event_notifier_set_handler(e, handler);
+    memory_region_add_eventfd(&n->iomem, offset, 4, false, 0, e);
+    *enabled = true;
+}
+
+static void nvme_cleanup_ioeventfd(NvmeCtrl *n, EventNotifier *e,
+                                   hwaddr offset, bool *enabled)
+{
+    if (!*enabled) {
+        return;
+    }
+    memory_region_del_eventfd(&n->iomem, offset, 4, false, 0, e);
+    event_notifier_set_handler(e, NULL);
+    event_notifier_cleanup(e);
+    *enabled = false;
+}
+
+static void nvme_init_sq_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    if (!sq->ioeventfd_enabled) {
+        nvme_init_ioeventfd(n, &sq->notifier, 0x1000 + (sq->sqid << 3),
+                            nvme_sq_notifier, &sq->ioeventfd_enabled);
+    }
+}
+
+static void nvme_init_cq_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    if (!cq->ioeventfd_enabled) {
+        nvme_init_ioeventfd(n, &cq->notifier,
+                            0x1000 + (cq->cqid << 3) + (1 << 2),
+                            nvme_cq_notifier, &cq->ioeventfd_enabled);
+    }
+}
+
 static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
@@ -164,7 +426,7 @@ static void nvme_post_cqes(void *opaque)
         NvmeSQueue *sq;
         hwaddr addr;
 
-        if (nvme_cq_full(cq)) {
+        if (nvme_cq_full(cq) && nvme_cq_full_dbbuf(cq)) {
             break;
         }
 
@@ -198,6 +460,10 @@ static void nvme_rw_cb(void *opaque, int ret)
     NvmeCQueue *cq = n->cq[sq->cqid];
 
     bdrv_acct_done(n->conf.bs, &req->acct);
+    if (req->direct) {
+        nvme_unmap_iov(req, req->acct.type == BDRV_ACCT_WRITE ?
+            DMA_DIRECTION_TO_DEVICE : DMA_DIRECTION_FROM_DEVICE);
+    }
     if (!ret) {
         req->status = NVME_SUCCESS;
     } else {
@@ -222,20 +488,44 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     uint64_t data_size = nlb << data_shift;
     uint64_t aio_slba  = slba << (data_shift - BDRV_SECTOR_BITS);
     int is_write = rw->opcode == NVME_CMD_WRITE ? 1 : 0;
+    uint16_t status;
 
     if ((slba + nlb) > ns->id_ns.nsze) {
         return NVME_LBA_RANGE | NVME_DNR;
     }
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
+
+    switch (NVME_CMD_FLAGS_PSDT(rw->flags)) {
+    case NVME_PSDT_PRP:
+        if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        break;
+    case NVME_PSDT_SGL_MPTR_CONTIG:
+        status = nvme_map_sgl(&req->qsg, (NvmeSglDescriptor *)&rw->prp1,
+            data_size, n);
+        if (status) {
+            return status;
+        }
+        break;
+    default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     assert((nlb << data_shift) == req->qsg.size);
 
     dma_acct_start(n->conf.bs, &req->acct, &req->qsg, is_write ?
         BDRV_ACCT_WRITE : BDRV_ACCT_READ);
-    req->aiocb = is_write ?
-        dma_bdrv_write(n->conf.bs, &req->qsg, aio_slba, nvme_rw_cb, req) :
-        dma_bdrv_read(n->conf.bs, &req->qsg, aio_slba, nvme_rw_cb, req);
+    if (nvme_map_iov(req, is_write ? DMA_DIRECTION_TO_DEVICE :
+                     DMA_DIRECTION_FROM_DEVICE)) {
+        req->aiocb = is_write ?
+            bdrv_aio_writev(n->conf.bs, aio_slba, &req->iov,
+                data_size >> BDRV_SECTOR_BITS, nvme_rw_cb, req) :
+            bdrv_aio_readv(n->conf.bs, aio_slba, &req->iov,
+                data_size >> BDRV_SECTOR_BITS, nvme_rw_cb, req);
+    } else {
+        req->aiocb = is_write ?
+            dma_bdrv_write(n->conf.bs, &req->qsg, aio_slba, nvme_rw_cb, req) :
+            dma_bdrv_read(n->conf.bs, &req->qsg, aio_slba, nvme_rw_cb, req);
+    }
 
     return NVME_NO_COMPLETE;
 }
@@ -264,6 +554,8 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
+    nvme_cleanup_ioeventfd(n, &sq->notifier, 0x1000 + (sq->sqid << 3),
+                           &sq->ioeventfd_enabled);
     timer_del(sq->timer);
     timer_free(sq->timer);
     g_free(sq->io_req);
@@ -328,6 +620,9 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
     sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (sqid && n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(n, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
@@ -369,6 +664,9 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
+    nvme_cleanup_ioeventfd(n, &cq->notifier,
+                           0x1000 + (cq->cqid << 3) + (1 << 2),
+                           &cq->ioeventfd_enabled);
     timer_del(cq->timer);
     timer_free(cq->timer);
     msix_vector_unuse(&n->parent_obj, cq->vector);
@@ -411,6 +709,9 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (cqid && n->dbbuf_enabled) {
+        nvme_init_cq_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -495,6 +796,33 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+        !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* the admin queue always uses the MMIO doorbells */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -512,6 +840,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -528,6 +858,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -545,6 +879,13 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr) {
+            /* the guest need not ring until it moves past what we saw */
+            nvme_update_sq_eventidx(sq);
+            smp_mb();
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
@@ -563,6 +904,10 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
         }
     }
 
+    n->dbbuf_dbs = 0;
+    n->dbbuf_eis = 0;
+    n->dbbuf_enabled = false;
+
     bdrv_flush(n->conf.bs);
     n->bar.cc = 0;
 }
@@ -663,6 +1008,29 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
     return val;
 }
 
+static void nvme_set_cq_head(NvmeCtrl *n, NvmeCQueue *cq, uint16_t new_head)
+{
+    int start_sqs;
+
+    if (new_head >= cq->size) {
+        return;
+    }
+
+    start_sqs = nvme_cq_full(cq) ? 1 : 0;
+    cq->head = new_head;
+    if (start_sqs) {
+        NvmeSQueue *sq;
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
+        timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+
+    if (cq->tail != cq->head) {
+        nvme_isr_notify(n, cq);
+    }
+}
+
 static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 {
     uint32_t qid;
@@ -673,32 +1041,13 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
     if (((addr - 0x1000) >> 2) & 1) {
         uint16_t new_head = val & 0xffff;
-        int start_sqs;
-        NvmeCQueue *cq;
 
         qid = (addr - (0x1000 + (1 << 2))) >> 3;
         if (nvme_check_cqid(n, qid)) {
             return;
         }
 
-        cq = n->cq[qid];
-        if (new_head >= cq->size) {
-            return;
-        }
-
-        start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-        }
-
-        if (cq->tail != cq->head) {
-            nvme_isr_notify(n, cq);
-        }
+        nvme_set_cq_head(n, n->cq[qid], new_head);
     } else {
         uint16_t new_tail = val & 0xffff;
         NvmeSQueue *sq;
@@ -793,7 +1142,8 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
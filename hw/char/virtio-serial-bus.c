@@ -60,7 +60,7 @@ static bool use_multiport(VirtIOSerial *vser)
 static size_t write_to_port(VirtIOSerialPort *port,
                             const uint8_t *buf, size_t size)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
     size_t offset;
 
@@ -73,15 +73,17 @@ static size_t write_to_port(VirtIOSerialPort *port,
     while (offset < size) {
         size_t len;
 
-        if (!virtqueue_pop(vq, &elem)) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
             break;
         }
 
-        len = iov_from_buf(elem.in_sg, elem.in_num, 0,
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0,
                            buf + offset, size - offset);
         offset += len;
 
-        virtqueue_push(vq, &elem, len);
+        virtqueue_push(vq, elem, len);
+        g_free(elem);
     }
 
     virtio_notify(VIRTIO_DEVICE(port->vser), vq);
@@ -90,17 +92,144 @@ static size_t write_to_port(VirtIOSerialPort *port,
 
 static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
     if (!virtio_queue_ready(vq)) {
         return;
     }
-    while (virtqueue_pop(vq, &elem)) {
-        virtqueue_push(vq, &elem, 0);
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
     }
     virtio_notify(vdev, vq);
 }
 
+/* Maximum number of iovecs handed to have_datav at once */
+#define VIRTIO_SERIAL_BATCH_IOV 64
+
+/*
+ * Pass the data of as many elements as fit in one batch to have_datav.
+ * Elements are only pushed once they have been consumed completely; the
+ * first one that was not becomes port->elem, exactly as if the data had
+ * been passed element by element, and the ones after it are given back to
+ * the queue.
+ */
+static void do_flush_queued_data_batched(VirtIOSerialPort *port,
+                                         VirtQueue *vq,
+                                         VirtIOSerialPortClass *vsc)
+{
+    VirtQueueElement *elems[VIRTIO_SERIAL_BATCH_IOV];
+    unsigned int start_idx[VIRTIO_SERIAL_BATCH_IOV];
+    unsigned int end_idx[VIRTIO_SERIAL_BATCH_IOV];
+    size_t start_offset[VIRTIO_SERIAL_BATCH_IOV];
+    size_t elem_bytes[VIRTIO_SERIAL_BATCH_IOV];
+    bool elem_complete[VIRTIO_SERIAL_BATCH_IOV];
+    struct iovec iov[VIRTIO_SERIAL_BATCH_IOV];
+
+    while (!port->throttled) {
+        unsigned int n = 0, iovcnt = 0, pushed = 0, i, k;
+        size_t total = 0;
+        ssize_t ret;
+
+        while (n < VIRTIO_SERIAL_BATCH_IOV &&
+               iovcnt < VIRTIO_SERIAL_BATCH_IOV) {
+            VirtQueueElement *elem;
+            size_t offset;
+
+            /* The element that was left off mid-way comes first */
+            if (n == 0 && port->elem) {
+                elem = port->elem;
+                port->elem = NULL;
+                i = port->iov_idx;
+                offset = port->iov_offset;
+            } else {
+                elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+                if (!elem) {
+                    break;
+                }
+                i = 0;
+                offset = 0;
+            }
+
+            elems[n] = elem;
+            start_idx[n] = i;
+            start_offset[n] = offset;
+            elem_bytes[n] = 0;
+            for (; i < elem->out_num && iovcnt < VIRTIO_SERIAL_BATCH_IOV;
+                 i++) {
+                iov[iovcnt].iov_base = elem->out_sg[i].iov_base + offset;
+                iov[iovcnt].iov_len = elem->out_sg[i].iov_len - offset;
+                elem_bytes[n] += iov[iovcnt].iov_len;
+                iovcnt++;
+                offset = 0;
+            }
+            end_idx[n] = i;
+            elem_complete[n] = (i == elem->out_num);
+            total += elem_bytes[n];
+            n++;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        ret = total ? vsc->have_datav(port, iov, iovcnt) : 0;
+        if (!port->throttled) {
+            /* as with have_data, unthrottled short writes drop the data */
+            ret = total;
+        } else if (ret < 0) {
+            ret = 0;
+        }
+
+        for (k = 0; k < n; k++) {
+            if (elem_complete[k] && (size_t)ret >= elem_bytes[k]) {
+                ret -= elem_bytes[k];
+                virtqueue_fill(vq, elems[k], 0, pushed++);
+                g_free(elems[k]);
+                continue;
+            }
+
+            /* Partially consumed, continue from there next time */
+            port->elem = elems[k];
+            if (!port->throttled) {
+                /* the batch ended within the element */
+                port->iov_idx = end_idx[k];
+                port->iov_offset = 0;
+                break;
+            }
+            port->iov_idx = start_idx[k];
+            port->iov_offset = start_offset[k];
+            while (ret > 0) {
+                size_t left = port->elem->out_sg[port->iov_idx].iov_len -
+                              port->iov_offset;
+
+                if ((size_t)ret < left) {
+                    port->iov_offset += ret;
+                    break;
+                }
+                ret -= left;
+                port->iov_idx++;
+                port->iov_offset = 0;
+            }
+            break;
+        }
+
+        /* The remaining elements were not consumed at all */
+        for (i = n; i > k + 1; i--) {
+            virtqueue_discard(vq, elems[i - 1], 0);
+            g_free(elems[i - 1]);
+        }
+
+        if (pushed) {
+            virtqueue_flush(vq, pushed);
+        }
+        if (!port->elem && n < VIRTIO_SERIAL_BATCH_IOV &&
+            iovcnt < VIRTIO_SERIAL_BATCH_IOV) {
+            /* the queue is empty */
+            break;
+        }
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -111,25 +240,32 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
 
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
 
+    if (vsc->have_datav) {
+        do_flush_queued_data_batched(port, vq, vsc);
+        virtio_notify(vdev, vq);
+        return;
+    }
+
     while (!port->throttled) {
         unsigned int i;
 
         /* Pop an elem only if we haven't left off a previous one mid-way */
-        if (!port->elem.out_num) {
-            if (!virtqueue_pop(vq, &port->elem)) {
+        if (!port->elem) {
+            port->elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+            if (!port->elem) {
                 break;
             }
             port->iov_idx = 0;
             port->iov_offset = 0;
         }
 
-        for (i = port->iov_idx; i < port->elem.out_num; i++) {
+        for (i = port->iov_idx; i < port->elem->out_num; i++) {
             size_t buf_size;
             ssize_t ret;
 
-            buf_size = port->elem.out_sg[i].iov_len - port->iov_offset;
+            buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
             ret = vsc->have_data(port,
-                                  port->elem.out_sg[i].iov_base
+                                  port->elem->out_sg[i].iov_base
                                   + port->iov_offset,
                                   buf_size);
             if (port->throttled) {
@@ -144,8 +280,9 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
         if (port->throttled) {
             break;
         }
-        virtqueue_push(vq, &port->elem, 0);
-        port->elem.out_num = 0;
+        virtqueue_push(vq, port->elem, 0);
+        g_free(port->elem);
+        port->elem = NULL;
     }
     virtio_notify(vdev, vq);
 }
@@ -162,20 +299,22 @@ static void flush_queued_data(VirtIOSerialPort *port)
 
 static size_t send_control_msg(VirtIOSerial *vser, void *buf, size_t len)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
 
     vq = vser->c_ivq;
     if (!virtio_queue_ready(vq)) {
         return 0;
     }
-    if (!virtqueue_pop(vq, &elem)) {
+    elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+    if (!elem) {
         return 0;
     }
 
-    memcpy(elem.in_sg[0].iov_base, buf, len);
+    memcpy(elem->in_sg[0].iov_base, buf, len);
 
-    virtqueue_push(vq, &elem, len);
+    virtqueue_push(vq, elem, len);
+    g_free(elem);
     virtio_notify(VIRTIO_DEVICE(vser), vq);
     return len;
 }
@@ -388,7 +527,7 @@ static void control_in(VirtIODevice *vdev, VirtQueue *vq)
 
 static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtIOSerial *vser;
     uint8_t *buf;
     size_t len;
@@ -397,10 +536,10 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 
     len = 0;
     buf = NULL;
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         size_t cur_len;
 
-        cur_len = iov_size(elem.out_sg, elem.out_num);
+        cur_len = iov_size(elem->out_sg, elem->out_num);
         /*
          * Allocate a new buf only if we didn't have one previously or
          * if the size of the buf differs
@@ -411,10 +550,11 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
             buf = g_malloc(cur_len);
             len = cur_len;
         }
-        iov_to_buf(elem.out_sg, elem.out_num, 0, buf, cur_len);
+        iov_to_buf(elem->out_sg, elem->out_num, 0, buf, cur_len);
 
         handle_control_message(vser, buf, cur_len);
-        virtqueue_push(vq, &elem, 0);
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
     }
     g_free(buf);
     virtio_notify(vdev, vq);
@@ -561,7 +701,7 @@ static void virtio_serial_save(QEMUFile *f, void *opaque)
         qemu_put_byte(f, port->host_connected);
 
 	elem_popped = 0;
-        if (port->elem.out_num) {
+        if (port->elem) {
             elem_popped = 1;
         }
         qemu_put_be32s(f, &elem_popped);
@@ -569,8 +709,7 @@ static void virtio_serial_save(QEMUFile *f, void *opaque)
             qemu_put_be32s(f, &port->iov_idx);
             qemu_put_be64s(f, &port->iov_offset);
 
-            qemu_put_buffer(f, (unsigned char *)&port->elem,
-                            sizeof(port->elem));
+            qemu_put_virtqueue_element(f, port->elem);
         }
     }
 }
@@ -645,12 +784,8 @@ static int fetch_active_ports_list(QEMUFile *f, int version_id,
                 qemu_get_be32s(f, &port->iov_idx);
                 qemu_get_be64s(f, &port->iov_offset);
 
-                qemu_get_buffer(f, (unsigned char *)&port->elem,
-                                sizeof(port->elem));
-                virtqueue_map_sg(port->elem.in_sg, port->elem.in_addr,
-                                 port->elem.in_num, 1);
-                virtqueue_map_sg(port->elem.out_sg, port->elem.out_addr,
-                                 port->elem.out_num, 1);
+                port->elem =
+                    qemu_get_virtqueue_element(f, sizeof(VirtQueueElement));
 
                 /*
                  *  Port was throttled on source machine.  Let's
@@ -803,6 +938,11 @@ static void remove_port(VirtIOSerial *vser, uint32_t port_id)
     assert(port);
 
     /* Flush out any unconsumed buffers first */
+    if (port->elem) {
+        virtqueue_push(port->ovq, port->elem, 0);
+        g_free(port->elem);
+        port->elem = NULL;
+    }
     discard_vq_data(port->ovq, VIRTIO_DEVICE(port->vser));
 
     send_control_event(vser, port->id, VIRTIO_CONSOLE_PORT_REMOVE, 1);
@@ -858,7 +998,7 @@ static int virtser_port_qdev_init(DeviceState *qdev)
         return ret;
     }
 
-    port->elem.out_num = 0;
+    port->elem = NULL;
 
     QTAILQ_INSERT_TAIL(&port->vser->ports, port, next);
     port->ivq = port->vser->ivqs[port->id];
@@ -53,6 +53,9 @@
 #include "exec/address-spaces.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 bool rom_file_in_ram = true;
 
@@ -578,6 +581,7 @@ struct Rom {
     size_t datasize;
 
     uint8_t *data;
+    bool mapped;    /* data is a private mapping of the file */
     MemoryRegion *mr;
     int isrom;
     char *fw_dir;
@@ -608,6 +612,46 @@ static void rom_insert(Rom *rom)
     QTAILQ_INSERT_TAIL(&roms, rom, next);
 }
 
+static void rom_free_data(Rom *rom)
+{
+#ifndef _WIN32
+    if (rom->mapped) {
+        munmap(rom->data, rom->datasize);
+        rom->mapped = false;
+        rom->data = NULL;
+        return;
+    }
+#endif
+    g_free(rom->data);
+    rom->data = NULL;
+}
+
+/*
+ * Map the file instead of reading it, so that only the pages that are
+ * actually used are read from disk.  Boards may patch the contents through
+ * rom_ptr(), the mapping is private so that does not reach the file.
+ */
+static bool rom_map_file(Rom *rom, int fd)
+{
+#ifndef _WIN32
+    void *data;
+
+    if (!rom->datasize) {
+        return false;
+    }
+    data = mmap(NULL, rom->datasize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    rom->data = data;
+    rom->mapped = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void *rom_set_mr(Rom *rom, Object *owner, const char *name)
 {
     void *data;
@@ -651,13 +695,16 @@ int rom_add_file(const char *file, const char *fw_dir,
     rom->addr     = addr;
     rom->romsize  = lseek(fd, 0, SEEK_END);
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
-        goto err;
+    if (!rom_map_file(rom, fd)) {
+        rom->data = g_malloc0(rom->datasize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->datasize);
+        if (rc != rom->datasize) {
+            fprintf(stderr,
+                    "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                    rom->name, rc, rom->datasize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
@@ -693,7 +740,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     g_free(rom);
@@ -782,8 +829,7 @@ static void rom_reset(void *unused)
         }
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
     }
 }
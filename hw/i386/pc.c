@@ -1168,6 +1168,10 @@ FWCfgState *pc_memory_init(MemoryRegion *system_memory,
     ram = g_malloc(sizeof(*ram));
     memory_region_init_ram(ram, NULL, "pc.ram",
                            below_4g_mem_size + above_4g_mem_size);
+    if (!xen_enabled()) {
+        numa_bind_ram(memory_region_get_ram_ptr(ram),
+                      below_4g_mem_size + above_4g_mem_size);
+    }
     vmstate_register_ram_global(ram);
     *ram_memory = ram;
     ram_below_4g = g_malloc(sizeof(*ram_below_4g));
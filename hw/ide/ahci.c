@@ -521,6 +521,8 @@ static void ahci_reset_port(AHCIState *s, int port)
         qemu_sglist_destroy(&ncq_tfs->sglist);
         ncq_tfs->used = 0;
     }
+    qemu_bh_cancel(d->ncq_bh);
+    d->ncq_done = 0;
 
     s->dev[port].port_state = STATE_RUN;
     if (!ide_state->bs) {
@@ -712,28 +714,47 @@ out:
     return r;
 }
 
+/*
+ * Report all NCQ commands that completed since the last run in a single
+ * Set Device Bits FIS, so that a burst of completions raises one
+ * interrupt instead of one per tag.
+ */
+static void ncq_complete_bh(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+    uint32_t done = ad->ncq_done;
+
+    if (!done) {
+        return;
+    }
+    ad->ncq_done = 0;
+
+    /* Clear the bits for these tags in SActive */
+    ad->port_regs.scr_act &= ~done;
+
+    ahci_write_fis_sdb(ad->hba, ad->port_no, done);
+}
+
 static void ncq_cb(void *opaque, int ret)
 {
     NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
-    IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
-
-    /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+    AHCIDevice *ad = ncq_tfs->drive;
+    IDEState *ide_state = &ad->port.ifs[0];
 
     if (ret < 0) {
         /* error */
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
-        ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
-    } else {
+        ad->port_regs.scr_err |= (1 << ncq_tfs->tag);
+    } else if (!ad->ncq_done || !(ide_state->status & ERR_STAT)) {
+        /* don't hide an error that goes out in the same FIS */
         ide_state->status = READY_STAT | SEEK_STAT;
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
+    ad->ncq_done |= (1 << ncq_tfs->tag);
+    qemu_bh_schedule(ad->ncq_bh);
 
-    DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
-            ncq_tfs->tag);
+    DPRINTF(ad->port_no, "NCQ transfer tag %d finished\n", ncq_tfs->tag);
 
     bdrv_acct_done(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct);
     qemu_sglist_destroy(&ncq_tfs->sglist);
@@ -1183,11 +1204,17 @@ void ahci_init(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->ncq_bh = qemu_bh_new(ncq_complete_bh, ad);
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_delete(s->dev[i].ncq_bh);
+    }
     memory_region_destroy(&s->mem);
     memory_region_destroy(&s->idp);
     g_free(s->dev);
@@ -1219,6 +1246,24 @@ void ahci_reset(AHCIState *s)
     }
 }
 
+static bool ahci_ncq_done_needed(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+
+    return ad->ncq_done != 0;
+}
+
+/* NCQ completions that were not reported to the guest yet */
+static const VMStateDescription vmstate_ahci_ncq_done = {
+    .name = "ahci port/ncq_done",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT32(ncq_done, AHCIDevice),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_ahci_device = {
     .name = "ahci port",
     .version_id = 1,
@@ -1245,6 +1290,14 @@ static const VMStateDescription vmstate_ahci_device = {
         VMSTATE_BOOL(init_d2h_sent, AHCIDevice),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_ahci_ncq_done,
+            .needed = ahci_ncq_done_needed,
+        }, {
+            /* empty */
+        }
+    },
 };
 
 static int ahci_state_post_load(void *opaque, int version_id)
@@ -1271,6 +1324,9 @@ static int ahci_state_post_load(void *opaque, int version_id)
             pr->cmd_issue &= ~(1 << ad->busy_slot);
             ad->busy_slot = -1;
         }
+        if (ad->ncq_done) {
+            qemu_bh_schedule(ad->ncq_bh);
+        }
         check_cmd(s, i);
     }
 
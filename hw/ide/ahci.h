@@ -279,6 +279,8 @@ struct AHCIDevice {
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    QEMUBH *ncq_bh;
+    uint32_t ncq_done;
     uint8_t *lst;
     uint8_t *res_fis;
     bool done_atapi_packet;
@@ -28,6 +28,7 @@
 
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
 
 #define PCI_VENDOR_ID_IVSHMEM   PCI_VENDOR_ID_REDHAT_QUMRANET
 #define PCI_DEVICE_ID_IVSHMEM   0x1110
@@ -40,6 +41,11 @@
 
 #define IVSHMEM_REG_BAR_SIZE 0x100
 
+/* map the shared memory so that the host can back it with large pages */
+#define IVSHMEM_MAP_ALIGN (2 * 1024 * 1024)
+
+#define HUGETLBFS_MAGIC 0x958458f6
+
 //#define DEBUG_IVSHMEM
 #ifdef DEBUG_IVSHMEM
 #define IVSHMEM_DPRINTF(fmt, ...)        \
@@ -60,6 +66,9 @@ typedef struct Peer {
 typedef struct EventfdEntry {
     PCIDevice *pdev;
     int vector;
+    int virq;           /* KVM MSI route of the vector, or -1 */
+    MSIMessage msg;
+    bool irqfd;         /* our eventfd for the vector drives virq */
 } EventfdEntry;
 
 typedef struct IVShmemState {
@@ -94,10 +103,12 @@ typedef struct IVShmemState {
     uint32_t vectors;
     uint32_t features;
     EventfdEntry *eventfd_table;
+    bool msi_irqfd;     /* interrupts are injected by KVM irqfds */
 
     Error *migration_blocker;
 
     char * shmobj;
+    char * mempath;
     char * sizearg;
     char * role;
     int role_val;   /* scalar to avoid multiple string comparisons */
@@ -337,6 +348,60 @@ static int check_shm_size(IVShmemState *s, int fd) {
     }
 }
 
+static size_t ivshmem_fd_pagesize(int fd)
+{
+    struct statfs fs;
+    int ret;
+
+    do {
+        ret = fstatfs(fd, &fs);
+    } while (ret != 0 && errno == EINTR);
+
+    if (ret == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+        return fs.f_bsize;
+    }
+    return getpagesize();
+}
+
+/* Map the shared memory at an address aligned to the page size of the
+ * backing file, and to IVSHMEM_MAP_ALIGN, so that KVM can map it into the
+ * guest with large pages.  The BAR itself is naturally aligned. */
+static void *ivshmem_map(IVShmemState *s, int fd)
+{
+    size_t pagesize = ivshmem_fd_pagesize(fd);
+    size_t size = s->ivshmem_size;
+    size_t align = MAX(pagesize, IVSHMEM_MAP_ALIGN);
+    uint8_t *area, *ptr;
+
+    if (size & (pagesize - 1)) {
+        fprintf(stderr, "ivshmem: size must be a multiple of the page size "
+                "of the shared memory (%zu)\n", pagesize);
+        exit(1);
+    }
+
+    /* reserve an aligned range of addresses, then map the memory over it */
+    area = mmap(NULL, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+    if (area == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    ptr = (uint8_t *)ROUND_UP((uintptr_t)area, align);
+    if (mmap(ptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        munmap(area, size + align);
+        return MAP_FAILED;
+    }
+
+    if (ptr > area) {
+        munmap(area, ptr - area);
+    }
+    if (ptr - area < align) {
+        munmap(ptr + size, align - (ptr - area));
+    }
+
+    return ptr;
+}
+
 /* create the shared memory BAR when we are not using the server, so we can
  * create the BAR and map the memory immediately */
 static void create_shared_memory_BAR(IVShmemState *s, int fd) {
@@ -345,7 +410,12 @@ static void create_shared_memory_BAR(IVShmemState *s, int fd) {
 
     s->shm_fd = fd;
 
-    ptr = mmap(0, s->ivshmem_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    ptr = ivshmem_map(s, fd);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "ivshmem: could not map shared memory: %s\n",
+                strerror(errno));
+        exit(1);
+    }
 
     memory_region_init_ram_ptr(&s->ivshmem, OBJECT(s), "ivshmem.bar2",
                                s->ivshmem_size, ptr);
@@ -376,10 +446,106 @@ static void ivshmem_del_eventfd(IVShmemState *s, int posn, int i)
                               &s->peers[posn].eventfds[i]);
 }
 
+/* the eventfd through which peers interrupt us on @vector, if known yet */
+static EventNotifier *ivshmem_own_eventfd(IVShmemState *s, unsigned vector)
+{
+    if (s->vm_id < 0 || s->vm_id >= s->nb_peers ||
+        vector >= s->peers[s->vm_id].nb_eventfds) {
+        return NULL;
+    }
+    return &s->peers[s->vm_id].eventfds[vector];
+}
+
+static int ivshmem_irqfd_attach(IVShmemState *s, unsigned vector)
+{
+    EventfdEntry *entry = &s->eventfd_table[vector];
+    EventNotifier *n = ivshmem_own_eventfd(s, vector);
+    int ret;
+
+    if (!n || entry->virq < 0 || entry->irqfd) {
+        return 0;
+    }
+
+    ret = kvm_irqchip_add_irqfd_notifier(kvm_state, n, NULL, entry->virq);
+    if (ret < 0) {
+        return ret;
+    }
+    entry->irqfd = true;
+    return 0;
+}
+
+static void ivshmem_irqfd_detach(IVShmemState *s, unsigned vector)
+{
+    EventfdEntry *entry = &s->eventfd_table[vector];
+    int ret;
+
+    if (!entry->irqfd) {
+        return;
+    }
+
+    ret = kvm_irqchip_remove_irqfd_notifier(kvm_state,
+                                            ivshmem_own_eventfd(s, vector),
+                                            entry->virq);
+    assert(ret == 0);
+    entry->irqfd = false;
+}
+
+static int ivshmem_vector_unmask(PCIDevice *dev, unsigned vector,
+                                 MSIMessage msg)
+{
+    IVShmemState *s = IVSHMEM(dev);
+    EventfdEntry *entry = &s->eventfd_table[vector];
+    int ret;
+
+    if (entry->virq < 0) {
+        ret = kvm_irqchip_add_msi_route(kvm_state, msg);
+        if (ret < 0) {
+            return ret;
+        }
+        entry->virq = ret;
+    } else if (entry->msg.address != msg.address ||
+               entry->msg.data != msg.data) {
+        ret = kvm_irqchip_update_msi_route(kvm_state, entry->virq, msg);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    entry->msg = msg;
+
+    return ivshmem_irqfd_attach(s, vector);
+}
+
+static void ivshmem_vector_mask(PCIDevice *dev, unsigned vector)
+{
+    ivshmem_irqfd_detach(IVSHMEM(dev), vector);
+}
+
+static void ivshmem_vector_poll(PCIDevice *dev, unsigned int vector_start,
+                                unsigned int vector_end)
+{
+    IVShmemState *s = IVSHMEM(dev);
+    EventNotifier *n;
+    unsigned int vector;
+
+    for (vector = vector_start; vector < vector_end; vector++) {
+        n = ivshmem_own_eventfd(s, vector);
+        if (n && msix_is_masked(dev, vector) &&
+            event_notifier_test_and_clear(n)) {
+            msix_set_pending(dev, vector);
+        }
+    }
+}
+
 static void close_guest_eventfds(IVShmemState *s, int posn)
 {
     int i, guest_curr_max;
 
+    if (s->msi_irqfd && posn == s->vm_id) {
+        for (i = 0; i < s->peers[posn].nb_eventfds; i++) {
+            ivshmem_irqfd_detach(s, i);
+        }
+    }
+
     if (!ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
         return;
     }
@@ -473,8 +639,13 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
         }
 
         /* mmap the region and map into the BAR2 */
-        map_ptr = mmap(0, s->ivshmem_size, PROT_READ|PROT_WRITE, MAP_SHARED,
-                                                            incoming_fd, 0);
+        map_ptr = ivshmem_map(s, incoming_fd);
+        if (map_ptr == MAP_FAILED) {
+            fprintf(stderr, "ivshmem: could not map shared memory: %s\n",
+                    strerror(errno));
+            close(incoming_fd);
+            return;
+        }
         memory_region_init_ram_ptr(&s->ivshmem, OBJECT(s),
                                    "ivshmem.bar2", s->ivshmem_size, map_ptr);
         vmstate_register_ram(&s->ivshmem, DEVICE(s));
@@ -494,6 +665,13 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
      * guests for each VM */
     guest_max_eventfd = s->peers[incoming_posn].nb_eventfds;
 
+    if (guest_max_eventfd >= s->vectors) {
+        fprintf(stderr, "ivshmem: too many eventfds for VM %ld\n",
+                incoming_posn);
+        close(incoming_fd);
+        return;
+    }
+
     if (guest_max_eventfd == 0) {
         /* one eventfd per MSI vector */
         s->peers[incoming_posn].eventfds = g_new(EventNotifier, s->vectors);
@@ -514,9 +692,18 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
     }
 
     if (incoming_posn == s->vm_id) {
-        s->eventfd_chr[guest_max_eventfd] = create_eventfd_chr_device(s,
-                   &s->peers[s->vm_id].eventfds[guest_max_eventfd],
-                   guest_max_eventfd);
+        if (s->msi_irqfd) {
+            /* KVM injects the interrupt, bypassing QEMU */
+            if (!msix_is_masked(PCI_DEVICE(s), guest_max_eventfd) &&
+                ivshmem_irqfd_attach(s, guest_max_eventfd) < 0) {
+                fprintf(stderr, "ivshmem: could not set up irqfd for "
+                        "vector %d\n", guest_max_eventfd);
+            }
+        } else {
+            s->eventfd_chr[guest_max_eventfd] = create_eventfd_chr_device(s,
+                       &s->peers[s->vm_id].eventfds[guest_max_eventfd],
+                       guest_max_eventfd);
+        }
     }
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
@@ -578,6 +765,8 @@ static uint64_t ivshmem_get_size(IVShmemState * s) {
 
 static void ivshmem_setup_msi(IVShmemState * s)
 {
+    int i;
+
     if (msix_init_exclusive_bar(PCI_DEVICE(s), s->vectors, 1)) {
         IVSHMEM_DPRINTF("msix initialization failed\n");
         exit(1);
@@ -587,8 +776,19 @@ static void ivshmem_setup_msi(IVShmemState * s)
 
     /* allocate QEMU char devices for receiving interrupts */
     s->eventfd_table = g_malloc0(s->vectors * sizeof(EventfdEntry));
+    for (i = 0; i < s->vectors; i++) {
+        s->eventfd_table[i].virq = -1;
+    }
 
     ivshmem_use_msix(s);
+
+    /* let KVM deliver the interrupts of all vectors if it can */
+    if (kvm_msi_via_irqfd_enabled() &&
+        msix_set_vector_notifiers(PCI_DEVICE(s), ivshmem_vector_unmask,
+                                  ivshmem_vector_mask,
+                                  ivshmem_vector_poll) == 0) {
+        s->msi_irqfd = true;
+    }
 }
 
 static void ivshmem_save(QEMUFile* f, void *opaque)
@@ -662,11 +862,9 @@ static int pci_ivshmem_init(PCIDevice *dev)
     register_savevm(DEVICE(dev), "ivshmem", 0, 0, ivshmem_save, ivshmem_load,
                                                                         dev);
 
-    /* IRQFD requires MSI */
-    if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD) &&
-        !ivshmem_has_feature(s, IVSHMEM_MSI)) {
-        fprintf(stderr, "ivshmem: ioeventfd/irqfd requires MSI\n");
-        exit(1);
+    /* doorbell writes to any peer and vector are handled by KVM */
+    if (kvm_enabled() && !kvm_has_many_ioeventfds()) {
+        s->features &= ~(1 << IVSHMEM_IOEVENTFD);
     }
 
     /* check that role is reasonable */
@@ -744,16 +942,31 @@ static int pci_ivshmem_init(PCIDevice *dev)
         /* just map the file immediately, we're not using a server */
         int fd;
 
-        if (s->shmobj == NULL) {
-            fprintf(stderr, "Must specify 'chardev' or 'shm' to ivshmem\n");
+        if (s->shmobj == NULL && s->mempath == NULL) {
+            fprintf(stderr, "Must specify 'chardev', 'shm' or 'mem-path' to "
+                    "ivshmem\n");
             exit(1);
         }
 
-        IVSHMEM_DPRINTF("using shm_open (shm object = %s)\n", s->shmobj);
+        IVSHMEM_DPRINTF("using shm_open (shm object = %s)\n",
+                        s->mempath ? s->mempath : s->shmobj);
 
         /* try opening with O_EXCL and if it succeeds zero the memory
          * by truncating to 0 */
-        if ((fd = shm_open(s->shmobj, O_CREAT|O_RDWR|O_EXCL,
+        if (s->mempath) {
+            /* a file, e.g. on hugetlbfs, instead of a POSIX shm object */
+            if ((fd = open(s->mempath, O_CREAT|O_RDWR|O_EXCL,
+                           S_IRWXU|S_IRWXG|S_IRWXO)) > 0) {
+                if (ftruncate(fd, s->ivshmem_size) != 0) {
+                    fprintf(stderr,
+                            "ivshmem: could not truncate shared file\n");
+                }
+            } else if ((fd = open(s->mempath, O_CREAT|O_RDWR,
+                                  S_IRWXU|S_IRWXG|S_IRWXO)) < 0) {
+                fprintf(stderr, "ivshmem: could not open shared file\n");
+                exit(-1);
+            }
+        } else if ((fd = shm_open(s->shmobj, O_CREAT|O_RDWR|O_EXCL,
                         S_IRWXU|S_IRWXG|S_IRWXO)) > 0) {
            /* truncate file to length PCI device's memory */
             if (ftruncate(fd, s->ivshmem_size) != 0) {
@@ -783,6 +996,16 @@ static int pci_ivshmem_init(PCIDevice *dev)
 static void pci_ivshmem_uninit(PCIDevice *dev)
 {
     IVShmemState *s = IVSHMEM(dev);
+    int i;
+
+    if (s->msi_irqfd) {
+        msix_unset_vector_notifiers(dev);
+        for (i = 0; i < s->vectors; i++) {
+            if (s->eventfd_table[i].virq >= 0) {
+                kvm_irqchip_release_virq(kvm_state, s->eventfd_table[i].virq);
+            }
+        }
+    }
 
     if (s->migration_blocker) {
         migrate_del_blocker(s->migration_blocker);
@@ -801,9 +1024,10 @@ static Property ivshmem_properties[] = {
     DEFINE_PROP_CHR("chardev", IVShmemState, server_chr),
     DEFINE_PROP_STRING("size", IVShmemState, sizearg),
     DEFINE_PROP_UINT32("vectors", IVShmemState, vectors, 1),
-    DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD, false),
+    DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD, true),
     DEFINE_PROP_BIT("msi", IVShmemState, features, IVSHMEM_MSI, true),
     DEFINE_PROP_STRING("shm", IVShmemState, shmobj),
+    DEFINE_PROP_STRING("mem-path", IVShmemState, mempath),
     DEFINE_PROP_STRING("role", IVShmemState, role),
     DEFINE_PROP_UINT32("use64", IVShmemState, ivshmem_64bit, 1),
     DEFINE_PROP_END_OF_LIST(),
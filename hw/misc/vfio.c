@@ -20,25 +20,37 @@
 
 #include <dirent.h>
 #include <linux/vfio.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "block/aio.h"
+#include "block/thread-pool.h"
 #include "config.h"
 #include "exec/address-spaces.h"
 #include "exec/memory.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
+#include "migration/migration.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qerror.h"
 #include "qemu-common.h"
+#include "qemu/atomic.h"
 #include "qemu/error-report.h"
 #include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
 #include "qemu/queue.h"
 #include "qemu/range.h"
+#include "qemu/thread.h"
+#include "qmp-commands.h"
 #include "sysemu/kvm.h"
 #include "sysemu/sysemu.h"
+#include "trace.h"
 
 /* #define DEBUG_VFIO */
 #ifdef DEBUG_VFIO
@@ -92,8 +104,26 @@ typedef struct VFIOBAR {
     bool ioport;
     bool mem64;
     QLIST_HEAD(, VFIOQuirk) quirks;
+    uint64_t reads; /* trapped accesses, excluding quirks */
+    uint64_t writes;
+    uint64_t read_ns; /* cumulative time spent in the device fd access */
+    uint64_t write_ns;
 } VFIOBAR;
 
+/*
+ * A write-only register on a trapped BAR which the guest writes with a
+ * known value, forwarded to the device from a helper thread through a
+ * KVM ioeventfd so the vCPU does not wait for the pwrite.
+ */
+typedef struct VFIODoorbell {
+    struct VFIOBAR *bar;
+    hwaddr offset;
+    unsigned size;
+    uint64_t data;
+    EventNotifier e;
+    QLIST_ENTRY(VFIODoorbell) next;
+} VFIODoorbell;
+
 typedef struct VFIOVGARegion {
     MemoryRegion mem;
     off_t offset;
@@ -116,6 +146,8 @@ typedef struct VFIOINTx {
     PCIINTxRoute route; /* routing info for QEMU bypass */
     uint32_t mmap_timeout; /* delay to re-enable mmaps after interrupt */
     QEMUTimer *mmap_timer; /* enable mmaps after periods w/o interrupts */
+    uint64_t user_interrupts; /* interrupts signaled through QEMU */
+    uint64_t user_eois; /* EOIs, ie. unmasks, performed by QEMU */
 } VFIOINTx;
 
 typedef struct VFIOMSIVector {
@@ -123,6 +155,8 @@ typedef struct VFIOMSIVector {
     struct VFIODevice *vdev; /* back pointer to device */
     MSIMessage msg; /* cache the MSI message so we know when it changes */
     int virq; /* KVM irqchip route for QEMU bypass */
+    bool irqfd; /* interrupt eventfd attached to the KVM route */
+    bool irqfd_pending; /* attach once the KVM route is committed */
     bool use;
 } VFIOMSIVector;
 
@@ -135,8 +169,32 @@ enum {
 
 struct VFIOGroup;
 
+/*
+ * A DMA map or unmap request queued by the memory listener and flushed
+ * to the IOMMU when the memory transaction commits.
+ */
+typedef struct VFIODMARange {
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr; /* NULL for unmap requests */
+    bool readonly;
+    MemoryRegion *mr; /* reference held until the request is flushed */
+    QSIMPLEQ_ENTRY(VFIODMARange) next;
+} VFIODMARange;
+
+/* A range currently mapped through the IOMMU */
+typedef struct VFIODMAMapping {
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+    bool pinned; /* backed by QEMU allocated RAM the kernel had to pin */
+    bool superpage; /* hugepage aligned in both IOVA and host memory */
+} VFIODMAMapping;
+
 typedef struct VFIOContainer {
     int fd; /* /dev/vfio/vfio, empowered by the attached groups */
+    AddressSpace *space; /* DMA address space of the attached devices */
     struct {
         /* enable abstraction to support various iommu backends */
         union {
@@ -144,10 +202,33 @@ typedef struct VFIOContainer {
         };
         void (*release)(struct VFIOContainer *);
     } iommu_data;
+    bool in_transaction; /* queue DMA requests until the listener commits */
+    uint32_t map_threads; /* worker threads used to map large batches */
+    GArray *mappings; /* live VFIODMAMapping, sorted by iova, disjoint */
+    uint64_t mapped_bytes;
+    uint64_t pinned_bytes;
+    uint64_t superpage_bytes;
+    uint64_t map_calls; /* updated atomically, maps may run in workers */
+    uint64_t unmap_calls;
+    uint64_t map_ns;
+    QSIMPLEQ_HEAD(, VFIODMARange) pending_unmap;
+    QSIMPLEQ_HEAD(, VFIODMARange) pending_map;
+    QLIST_HEAD(, VFIOGuestIOMMU) giommu_list;
     QLIST_HEAD(, VFIOGroup) group_list;
     QLIST_ENTRY(VFIOContainer) next;
 } VFIOContainer;
 
+/* A guest visible IOMMU in the container's address space */
+typedef struct VFIOGuestIOMMU {
+    VFIOContainer *container;
+    MemoryRegion *iommu;
+    hwaddr iova_offset; /* IOVA of the start of the IOMMU region */
+    hwaddr start; /* part of the IOMMU region covered by the section */
+    hwaddr end;
+    Notifier n;
+    QLIST_ENTRY(VFIOGuestIOMMU) next;
+} VFIOGuestIOMMU;
+
 /* Cache of MSI-X setup plus extra mmap and memory region for split BAR map */
 typedef struct VFIOMSIXInfo {
     uint8_t table_bar;
@@ -165,25 +246,47 @@ typedef struct VFIODevice {
     VFIOINTx intx;
     unsigned int config_size;
     uint8_t *emulated_config_bits; /* QEMU emulated bits, little-endian */
+    uint8_t *config_shadow; /* copy of read-only physical config space */
+    uint8_t *shadow_config_bits; /* bits served from config_shadow */
     off_t config_offset; /* Offset of config space region within device fd */
     unsigned int rom_size;
     off_t rom_offset; /* Offset of ROM region within device fd */
     void *rom;
+    char *rom_cache_dir;
+    void *rom_cache; /* private mapping of the shared ROM cache file */
+    uint32_t rom_cache_size;
     int msi_cap_size;
     VFIOMSIVector *msi_vectors;
     VFIOMSIXInfo *msix;
+    Notifier kvm_routes_notifier;
     int nr_vectors; /* Number of MSI/MSIX vectors currently in use */
+    uint64_t msi_user_interrupts; /* MSI/X interrupts injected by QEMU */
     int interrupt; /* Current interrupt type */
     VFIOBAR bars[PCI_NUM_REGIONS - 1]; /* No ROM */
     VFIOVGA vga; /* 0xa0000, 0x3b0, 0x3c0 */
     PCIHostDeviceAddress host;
+    char name[16]; /* host address as a string, for tracing */
     QLIST_ENTRY(VFIODevice) next;
     struct VFIOGroup *group;
     EventNotifier err_notifier;
+    char *doorbells_str;
+    char *vfiofd_name; /* pre-opened container, monitor fd name or number */
+    char *vfiogroupfd_name; /* pre-opened group */
+    QLIST_HEAD(, VFIODoorbell) doorbells;
+    int nr_doorbells;
+    QemuThread doorbell_thread;
+    EventNotifier doorbell_stop;
     uint32_t features;
 #define VFIO_FEATURE_ENABLE_VGA_BIT 0
 #define VFIO_FEATURE_ENABLE_VGA (1 << VFIO_FEATURE_ENABLE_VGA_BIT)
+#define VFIO_FEATURE_ENABLE_MSIX_MMAP_BIT 1
+#define VFIO_FEATURE_ENABLE_MSIX_MMAP (1 << VFIO_FEATURE_ENABLE_MSIX_MMAP_BIT)
+#define VFIO_FEATURE_ENABLE_SUBPAGE_BIT 2
+#define VFIO_FEATURE_ENABLE_SUBPAGE (1 << VFIO_FEATURE_ENABLE_SUBPAGE_BIT)
+#define VFIO_FEATURE_ENABLE_MIGRATION_BIT 3
+#define VFIO_FEATURE_ENABLE_MIGRATION (1 << VFIO_FEATURE_ENABLE_MIGRATION_BIT)
     int32_t bootindex;
+    uint32_t dma_map_threads;
     uint8_t pm_cap;
     bool reset_works;
     bool has_vga;
@@ -191,6 +294,10 @@ typedef struct VFIODevice {
     bool has_flr;
     bool has_pm_reset;
     bool needs_reset;
+    bool reset_pending; /* asynchronous hot reset in flight */
+    bool dma_stopped; /* bus master cleared for the final migration stage */
+    Error *migration_blocker;
+    VMChangeStateEntry *vm_state;
 } VFIODevice;
 
 typedef struct VFIOGroup {
@@ -227,6 +334,18 @@ static void vfio_pci_write_config(PCIDevice *pdev, uint32_t addr,
                                   uint32_t val, int len);
 static void vfio_mmap_set_enabled(VFIODevice *vdev, bool enabled);
 
+/*
+ * Wait for an asynchronous hot reset covering @vdev to complete.  The
+ * completion is delivered through a bottom half in the main AioContext,
+ * so poll it here like bdrv_drain_all() does.
+ */
+static void vfio_pci_reset_wait(VFIODevice *vdev)
+{
+    while (vdev->reset_pending) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
 /*
  * Common VFIO interrupt disable
  */
@@ -310,11 +429,10 @@ static void vfio_intx_interrupt(void *opaque)
         return;
     }
 
-    DPRINTF("%s(%04x:%02x:%02x.%x) Pin %c\n", __func__, vdev->host.domain,
-            vdev->host.bus, vdev->host.slot, vdev->host.function,
-            'A' + vdev->intx.pin);
+    trace_vfio_intx_interrupt(vdev->name, 'A' + vdev->intx.pin);
 
     vdev->intx.pending = true;
+    vdev->intx.user_interrupts++;
     pci_irq_assert(&vdev->pdev);
     vfio_mmap_set_enabled(vdev, false);
     if (vdev->intx.mmap_timeout) {
@@ -329,10 +447,10 @@ static void vfio_eoi(VFIODevice *vdev)
         return;
     }
 
-    DPRINTF("%s(%04x:%02x:%02x.%x) EOI\n", __func__, vdev->host.domain,
-            vdev->host.bus, vdev->host.slot, vdev->host.function);
+    trace_vfio_eoi(vdev->name);
 
     vdev->intx.pending = false;
+    vdev->intx.user_eois++;
     pci_irq_deassert(&vdev->pdev);
     vfio_unmask_intx(vdev);
 }
@@ -592,21 +710,8 @@ static void vfio_msi_interrupt(void *opaque)
         return;
     }
 
-#ifdef VFIO_DEBUG
-    MSIMessage msg;
-
-    if (vdev->interrupt == VFIO_INT_MSIX) {
-        msg = msi_get_message(&vdev->pdev, nr);
-    } else if (vdev->interrupt == VFIO_INT_MSI) {
-        msg = msix_get_message(&vdev->pdev, nr);
-    } else {
-        abort();
-    }
-
-    DPRINTF("%s(%04x:%02x:%02x.%x) vector %d 0x%"PRIx64"/0x%x\n", __func__,
-            vdev->host.domain, vdev->host.bus, vdev->host.slot,
-            vdev->host.function, nr, msg.address, msg.data);
-#endif
+    trace_vfio_msi_interrupt(vdev->name, nr);
+    vdev->msi_user_interrupts++;
 
     if (vdev->interrupt == VFIO_INT_MSIX) {
         msix_notify(&vdev->pdev, nr);
@@ -649,76 +754,189 @@ static int vfio_enable_vectors(VFIODevice *vdev, bool msix)
     return ret;
 }
 
+static int vfio_set_vector_trigger(VFIODevice *vdev, int index,
+                                   unsigned int nr, int32_t fd)
+{
+    struct vfio_irq_set *irq_set;
+    int ret, argsz;
+    int32_t *pfd;
+
+    argsz = sizeof(*irq_set) + sizeof(*pfd);
+
+    irq_set = g_malloc0(argsz);
+    irq_set->argsz = argsz;
+    irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
+    irq_set->index = index;
+    irq_set->start = nr;
+    irq_set->count = 1;
+    pfd = (int32_t *)&irq_set->data;
+
+    *pfd = fd;
+
+    ret = ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, irq_set);
+    g_free(irq_set);
+
+    return ret;
+}
+
+static int vfio_attach_kvm_msi_virq(VFIOMSIVector *vector)
+{
+    if (!vector->irqfd) {
+        if (kvm_irqchip_add_irqfd_notifier(kvm_state, &vector->interrupt,
+                                           NULL, vector->virq) < 0) {
+            kvm_irqchip_release_virq(kvm_state, vector->virq);
+            vector->virq = -1;
+            return -1;
+        }
+        vector->irqfd = true;
+    }
+
+    qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                        NULL, NULL, NULL);
+    return 0;
+}
+
+/*
+ * Attempt to route a vector through the KVM irqchip, leaving QEMU to
+ * handle the eventfd if that is not possible.
+ */
+static void vfio_add_kvm_msi_virq(VFIOMSIVector *vector, MSIMessage *msg,
+                                  bool msix, IOHandler *handler)
+{
+    int fd = event_notifier_get_fd(&vector->interrupt);
+
+    if ((msix && !VFIO_ALLOW_KVM_MSIX) || (!msix && !VFIO_ALLOW_KVM_MSI) ||
+        !msg) {
+        goto fail;
+    }
+
+    if (vector->virq < 0) {
+        vector->virq = kvm_irqchip_add_msi_route(kvm_state, *msg);
+        if (vector->virq < 0) {
+            goto fail;
+        }
+    } else if (msix && !vector->irqfd) {
+        /*
+         * An unmasked MSI-X vector: QEMU keeps handling the eventfd until
+         * the routing table is committed, so that a guest unmasking many
+         * vectors in a row costs a single commit.
+         */
+        vector->msg = *msg;
+        if (kvm_irqchip_update_msi_route_deferred(kvm_state, vector->virq,
+                                                  *msg) > 0) {
+            vector->irqfd_pending = true;
+            qemu_set_fd_handler(fd, handler, NULL, vector);
+            return;
+        }
+    } else if (msg->address != vector->msg.address ||
+               msg->data != vector->msg.data) {
+        kvm_irqchip_update_msi_route(kvm_state, vector->virq, *msg);
+    }
+    vector->msg = *msg;
+
+    if (vfio_attach_kvm_msi_virq(vector) < 0) {
+        goto fail;
+    }
+    return;
+
+fail:
+    qemu_set_fd_handler(fd, handler, NULL, vector);
+}
+
+static void vfio_kvm_routes_committed(Notifier *notifier, void *data)
+{
+    VFIODevice *vdev = container_of(notifier, VFIODevice,
+                                    kvm_routes_notifier);
+    int i;
+
+    for (i = 0; i < vdev->nr_vectors; i++) {
+        VFIOMSIVector *vector = &vdev->msi_vectors[i];
+
+        if (vector->irqfd_pending) {
+            vector->irqfd_pending = false;
+            vfio_attach_kvm_msi_virq(vector);
+        }
+    }
+}
+
+/* Detach the vector from KVM, interrupts are then handled by QEMU */
+static void vfio_detach_kvm_msi_virq(VFIOMSIVector *vector)
+{
+    vector->irqfd_pending = false;
+    if (vector->irqfd) {
+        kvm_irqchip_remove_irqfd_notifier(kvm_state, &vector->interrupt,
+                                          vector->virq);
+        vector->irqfd = false;
+        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                            vfio_msi_interrupt, NULL, vector);
+    }
+}
+
+static void vfio_remove_kvm_msi_virq(VFIOMSIVector *vector)
+{
+    vfio_detach_kvm_msi_virq(vector);
+    if (vector->virq >= 0) {
+        kvm_irqchip_release_virq(kvm_state, vector->virq);
+        vector->virq = -1;
+    }
+    qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                        NULL, NULL, NULL);
+}
+
+/*
+ * We don't want to have the host allocate all possible MSI vectors for a
+ * device if they're not in use, but growing the vector count requires
+ * disabling and re-enabling the whole index.  Grow geometrically so that
+ * a guest bringing up vectors in order costs O(log n) re-enables, the
+ * extra vectors are left without a trigger until used.
+ */
+static unsigned int vfio_msix_grow_vectors(VFIODevice *vdev, unsigned int nr)
+{
+    return MAX(nr + 1, MIN(vdev->msix->entries, vdev->nr_vectors * 2));
+}
+
 static int vfio_msix_vector_do_use(PCIDevice *pdev, unsigned int nr,
                                    MSIMessage *msg, IOHandler *handler)
 {
     VFIODevice *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
     VFIOMSIVector *vector;
+    bool new_vector = false;
     int ret;
 
-    DPRINTF("%s(%04x:%02x:%02x.%x) vector %d used\n", __func__,
-            vdev->host.domain, vdev->host.bus, vdev->host.slot,
-            vdev->host.function, nr);
-
     vector = &vdev->msi_vectors[nr];
-    vector->vdev = vdev;
-    vector->use = true;
-
-    msix_vector_use(pdev, nr);
 
-    if (event_notifier_init(&vector->interrupt, 0)) {
-        error_report("vfio: Error: event_notifier_init failed");
+    if (!vector->use) {
+        vector->vdev = vdev;
+        vector->virq = -1;
+        if (event_notifier_init(&vector->interrupt, 0)) {
+            error_report("vfio: Error: event_notifier_init failed");
+        }
+        vector->use = true;
+        msix_vector_use(pdev, nr);
+        new_vector = true;
     }
 
+    vfio_add_kvm_msi_virq(vector, msg, true, handler);
+    trace_vfio_msix_vector_use(vdev->name, nr, vector->irqfd);
+
     /*
-     * Attempt to enable route through KVM irqchip,
-     * default to userspace handling if unavailable.
+     * A vector that was only masked keeps its eventfd attached to the
+     * device, nothing more to do unless this is its first use.
      */
-    vector->virq = msg && VFIO_ALLOW_KVM_MSIX ?
-                   kvm_irqchip_add_msi_route(kvm_state, *msg) : -1;
-    if (vector->virq < 0 ||
-        kvm_irqchip_add_irqfd_notifier(kvm_state, &vector->interrupt,
-                                       NULL, vector->virq) < 0) {
-        if (vector->virq >= 0) {
-            kvm_irqchip_release_virq(kvm_state, vector->virq);
-            vector->virq = -1;
-        }
-        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                            handler, NULL, vector);
+    if (!new_vector) {
+        return 0;
     }
 
-    /*
-     * We don't want to have the host allocate all possible MSI vectors
-     * for a device if they're not in use, so we shutdown and incrementally
-     * increase them as needed.
-     */
     if (vdev->nr_vectors < nr + 1) {
         vfio_disable_irqindex(vdev, VFIO_PCI_MSIX_IRQ_INDEX);
-        vdev->nr_vectors = nr + 1;
+        vdev->nr_vectors = vfio_msix_grow_vectors(vdev, nr);
         ret = vfio_enable_vectors(vdev, true);
         if (ret) {
             error_report("vfio: failed to enable vectors, %d", ret);
         }
     } else {
-        int argsz;
-        struct vfio_irq_set *irq_set;
-        int32_t *pfd;
-
-        argsz = sizeof(*irq_set) + sizeof(*pfd);
-
-        irq_set = g_malloc0(argsz);
-        irq_set->argsz = argsz;
-        irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
-                         VFIO_IRQ_SET_ACTION_TRIGGER;
-        irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
-        irq_set->start = nr;
-        irq_set->count = 1;
-        pfd = (int32_t *)&irq_set->data;
-
-        *pfd = event_notifier_get_fd(&vector->interrupt);
-
-        ret = ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, irq_set);
-        g_free(irq_set);
+        ret = vfio_set_vector_trigger(vdev, VFIO_PCI_MSIX_IRQ_INDEX, nr,
+                                      event_notifier_get_fd(&vector->interrupt));
         if (ret) {
             error_report("vfio: failed to modify vector, %d", ret);
         }
@@ -733,53 +951,32 @@ static int vfio_msix_vector_use(PCIDevice *pdev,
     return vfio_msix_vector_do_use(pdev, nr, &msg, vfio_msi_interrupt);
 }
 
+/*
+ * Guests mask MSI-X vectors frequently, some on every interrupt.  Rather
+ * than tearing down the vector in the host, which costs an ioctl on both
+ * mask and unmask, only detach it from the KVM irqchip.  If it fires while
+ * masked QEMU catches it and the MSI-X core records it as pending, to be
+ * re-asserted on unmask.
+ */
 static void vfio_msix_vector_release(PCIDevice *pdev, unsigned int nr)
 {
     VFIODevice *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
     VFIOMSIVector *vector = &vdev->msi_vectors[nr];
-    int argsz;
-    struct vfio_irq_set *irq_set;
-    int32_t *pfd;
-
-    DPRINTF("%s(%04x:%02x:%02x.%x) vector %d released\n", __func__,
-            vdev->host.domain, vdev->host.bus, vdev->host.slot,
-            vdev->host.function, nr);
-
-    /*
-     * XXX What's the right thing to do here?  This turns off the interrupt
-     * completely, but do we really just want to switch the interrupt to
-     * bouncing through userspace and let msix.c drop it?  Not sure.
-     */
-    msix_vector_unuse(pdev, nr);
-
-    argsz = sizeof(*irq_set) + sizeof(*pfd);
-
-    irq_set = g_malloc0(argsz);
-    irq_set->argsz = argsz;
-    irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
-                     VFIO_IRQ_SET_ACTION_TRIGGER;
-    irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
-    irq_set->start = nr;
-    irq_set->count = 1;
-    pfd = (int32_t *)&irq_set->data;
-
-    *pfd = -1;
 
-    ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, irq_set);
+    trace_vfio_msix_vector_release(vdev->name, nr);
 
-    g_free(irq_set);
+    vfio_detach_kvm_msi_virq(vector);
+}
 
-    if (vector->virq < 0) {
-        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                            NULL, NULL, NULL);
-    } else {
-        kvm_irqchip_remove_irqfd_notifier(kvm_state, &vector->interrupt,
-                                          vector->virq);
-        kvm_irqchip_release_virq(kvm_state, vector->virq);
-        vector->virq = -1;
-    }
+/* Disconnect a vector from the device and free it entirely */
+static void vfio_msix_vector_teardown(VFIODevice *vdev, unsigned int nr)
+{
+    VFIOMSIVector *vector = &vdev->msi_vectors[nr];
 
+    vfio_set_vector_trigger(vdev, VFIO_PCI_MSIX_IRQ_INDEX, nr, -1);
+    vfio_remove_kvm_msi_virq(vector);
     event_notifier_cleanup(&vector->interrupt);
+    msix_vector_unuse(&vdev->pdev, nr);
     vector->use = false;
 }
 
@@ -805,13 +1002,16 @@ static void vfio_enable_msix(VFIODevice *vdev)
      * like the guest view.
      */
     vfio_msix_vector_do_use(&vdev->pdev, 0, NULL, NULL);
-    vfio_msix_vector_release(&vdev->pdev, 0);
+    vfio_msix_vector_teardown(vdev, 0);
 
     if (msix_set_vector_notifiers(&vdev->pdev, vfio_msix_vector_use,
                                   vfio_msix_vector_release, NULL)) {
         error_report("vfio: msix_set_vector_notifiers failed");
     }
 
+    vdev->kvm_routes_notifier.notify = vfio_kvm_routes_committed;
+    kvm_irqchip_add_routes_notifier(&vdev->kvm_routes_notifier);
+
     DPRINTF("%s(%04x:%02x:%02x.%x)\n", __func__, vdev->host.domain,
             vdev->host.bus, vdev->host.slot, vdev->host.function);
 }
@@ -837,19 +1037,10 @@ retry:
         }
 
         vector->msg = msi_get_message(&vdev->pdev, i);
+        vector->virq = -1;
 
-        /*
-         * Attempt to enable route through KVM irqchip,
-         * default to userspace handling if unavailable.
-         */
-        vector->virq = VFIO_ALLOW_KVM_MSI ?
-                       kvm_irqchip_add_msi_route(kvm_state, vector->msg) : -1;
-        if (vector->virq < 0 ||
-            kvm_irqchip_add_irqfd_notifier(kvm_state, &vector->interrupt,
-                                           NULL, vector->virq) < 0) {
-            qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                                vfio_msi_interrupt, NULL, vector);
-        }
+        vfio_add_kvm_msi_virq(vector, &vector->msg, false,
+                              vfio_msi_interrupt);
     }
 
     ret = vfio_enable_vectors(vdev, false);
@@ -863,15 +1054,8 @@ retry:
 
         for (i = 0; i < vdev->nr_vectors; i++) {
             VFIOMSIVector *vector = &vdev->msi_vectors[i];
-            if (vector->virq >= 0) {
-                kvm_irqchip_remove_irqfd_notifier(kvm_state, &vector->interrupt,
-                                                  vector->virq);
-                kvm_irqchip_release_virq(kvm_state, vector->virq);
-                vector->virq = -1;
-            } else {
-                qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                                    NULL, NULL, NULL);
-            }
+
+            vfio_remove_kvm_msi_virq(vector);
             event_notifier_cleanup(&vector->interrupt);
         }
 
@@ -908,14 +1092,15 @@ static void vfio_disable_msix(VFIODevice *vdev)
     int i;
 
     msix_unset_vector_notifiers(&vdev->pdev);
+    kvm_irqchip_remove_routes_notifier(&vdev->kvm_routes_notifier);
 
     /*
-     * MSI-X will only release vectors if MSI-X is still enabled on the
-     * device, check through the rest and release it ourselves if necessary.
+     * Vectors stay attached to the device across mask and unmask, free
+     * everything still in use.
      */
     for (i = 0; i < vdev->nr_vectors; i++) {
         if (vdev->msi_vectors[i].use) {
-            vfio_msix_vector_release(&vdev->pdev, i);
+            vfio_msix_vector_teardown(vdev, i);
         }
     }
 
@@ -942,16 +1127,7 @@ static void vfio_disable_msi(VFIODevice *vdev)
             continue;
         }
 
-        if (vector->virq >= 0) {
-            kvm_irqchip_remove_irqfd_notifier(kvm_state,
-                                              &vector->interrupt, vector->virq);
-            kvm_irqchip_release_virq(kvm_state, vector->virq);
-            vector->virq = -1;
-        } else {
-            qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                                NULL, NULL, NULL);
-        }
-
+        vfio_remove_kvm_msi_virq(vector);
         event_notifier_cleanup(&vector->interrupt);
     }
 
@@ -969,22 +1145,23 @@ static void vfio_update_msi(VFIODevice *vdev)
         VFIOMSIVector *vector = &vdev->msi_vectors[i];
         MSIMessage msg;
 
-        if (!vector->use || vector->virq < 0) {
+        if (!vector->use) {
             continue;
         }
 
         msg = msi_get_message(&vdev->pdev, i);
 
-        if (msg.address != vector->msg.address ||
-            msg.data != vector->msg.data) {
+        if (vector->virq >= 0 && msg.address == vector->msg.address &&
+            msg.data == vector->msg.data) {
+            continue;
+        }
 
-            DPRINTF("%s(%04x:%02x:%02x.%x) MSI vector %d changed\n",
-                    __func__, vdev->host.domain, vdev->host.bus,
-                    vdev->host.slot, vdev->host.function, i);
+        DPRINTF("%s(%04x:%02x:%02x.%x) MSI vector %d changed\n",
+                __func__, vdev->host.domain, vdev->host.bus,
+                vdev->host.slot, vdev->host.function, i);
 
-            kvm_irqchip_update_msi_route(kvm_state, vector->virq, msg);
-            vector->msg = msg;
-        }
+        /* Also retries the bypass for vectors left to QEMU so far */
+        vfio_add_kvm_msi_virq(vector, &msg, false, vfio_msi_interrupt);
     }
 }
 
@@ -995,12 +1172,14 @@ static void vfio_bar_write(void *opaque, hwaddr addr,
                            uint64_t data, unsigned size)
 {
     VFIOBAR *bar = opaque;
+    VFIODevice *vdev = container_of(bar, VFIODevice, bars[bar->nr]);
     union {
         uint8_t byte;
         uint16_t word;
         uint32_t dword;
         uint64_t qword;
     } buf;
+    int64_t start;
 
     switch (size) {
     case 1:
@@ -1017,21 +1196,20 @@ static void vfio_bar_write(void *opaque, hwaddr addr,
         break;
     }
 
+    /* Sub-page BARs may be exposed larger than the device region */
+    if (addr + size > bar->size) {
+        return;
+    }
+
+    start = get_clock();
     if (pwrite(bar->fd, &buf, size, bar->fd_offset + addr) != size) {
         error_report("%s(,0x%"HWADDR_PRIx", 0x%"PRIx64", %d) failed: %m",
                      __func__, addr, data, size);
     }
+    bar->write_ns += get_clock() - start;
+    bar->writes++;
 
-#ifdef DEBUG_VFIO
-    {
-        VFIODevice *vdev = container_of(bar, VFIODevice, bars[bar->nr]);
-
-        DPRINTF("%s(%04x:%02x:%02x.%x:BAR%d+0x%"HWADDR_PRIx", 0x%"PRIx64
-                ", %d)\n", __func__, vdev->host.domain, vdev->host.bus,
-                vdev->host.slot, vdev->host.function, bar->nr, addr,
-                data, size);
-    }
-#endif
+    trace_vfio_bar_write(vdev->name, bar->nr, addr, data, size);
 
     /*
      * A read or write to a BAR always signals an INTx EOI.  This will
@@ -1039,15 +1217,19 @@ static void vfio_bar_write(void *opaque, hwaddr addr,
      * that a BAR access is in response to an interrupt and that BAR
      * accesses will service the interrupt.  Unfortunately, we don't know
      * which access will service the interrupt, so we're potentially
-     * getting quite a few host interrupts per guest interrupt.
+     * getting quite a few host interrupts per guest interrupt.  With the
+     * KVM bypass the unmask is done in-kernel by the resample irqfd.
      */
-    vfio_eoi(container_of(bar, VFIODevice, bars[bar->nr]));
+    if (!vdev->intx.kvm_accel) {
+        vfio_eoi(vdev);
+    }
 }
 
 static uint64_t vfio_bar_read(void *opaque,
                               hwaddr addr, unsigned size)
 {
     VFIOBAR *bar = opaque;
+    VFIODevice *vdev = container_of(bar, VFIODevice, bars[bar->nr]);
     union {
         uint8_t byte;
         uint16_t word;
@@ -1055,12 +1237,20 @@ static uint64_t vfio_bar_read(void *opaque,
         uint64_t qword;
     } buf;
     uint64_t data = 0;
+    int64_t start;
+
+    if (addr + size > bar->size) {
+        return (uint64_t)-1;
+    }
 
+    start = get_clock();
     if (pread(bar->fd, &buf, size, bar->fd_offset + addr) != size) {
         error_report("%s(,0x%"HWADDR_PRIx", %d) failed: %m",
                      __func__, addr, size);
         return (uint64_t)-1;
     }
+    bar->read_ns += get_clock() - start;
+    bar->reads++;
 
     switch (size) {
     case 1:
@@ -1077,19 +1267,12 @@ static uint64_t vfio_bar_read(void *opaque,
         break;
     }
 
-#ifdef DEBUG_VFIO
-    {
-        VFIODevice *vdev = container_of(bar, VFIODevice, bars[bar->nr]);
-
-        DPRINTF("%s(%04x:%02x:%02x.%x:BAR%d+0x%"HWADDR_PRIx
-                ", %d) = 0x%"PRIx64"\n", __func__, vdev->host.domain,
-                vdev->host.bus, vdev->host.slot, vdev->host.function,
-                bar->nr, addr, size, data);
-    }
-#endif
+    trace_vfio_bar_read(vdev->name, bar->nr, addr, size, data);
 
     /* Same as write above */
-    vfio_eoi(container_of(bar, VFIODevice, bars[bar->nr]));
+    if (!vdev->intx.kvm_accel) {
+        vfio_eoi(vdev);
+    }
 
     return data;
 }
@@ -1179,6 +1362,103 @@ static const MemoryRegionOps vfio_rom_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
+/*
+ * Write a ROM image to the cache under a temporary name and move it into
+ * place, so that VMs starting concurrently never see a partial file.
+ */
+static int vfio_rom_cache_store(const char *path, const void *buf,
+                                uint32_t size)
+{
+    char *tmp = g_strdup_printf("%s.XXXXXX", path);
+    int fd;
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        error_report("vfio: Failed to create ROM cache file %s: %m", tmp);
+        g_free(tmp);
+        return -1;
+    }
+
+    if (fchmod(fd, 0644) || qemu_write_full(fd, buf, size) != size ||
+        rename(tmp, path)) {
+        error_report("vfio: Failed to write ROM cache file %s: %m", path);
+        close(fd);
+        unlink(tmp);
+        g_free(tmp);
+        return -1;
+    }
+
+    g_free(tmp);
+    return fd;
+}
+
+/*
+ * Look up the device ROM in the x-rom-cache directory, adding it if not
+ * yet present, and map it.  Files are named by vendor/device, subsystem
+ * vendor/device, ROM BAR size and a CRC of the image padded to the BAR
+ * size, so a firmware update never matches a stale entry.  The mapping
+ * is private, every VM using the same image shares the page cache pages.
+ */
+static void *vfio_rom_cache_map(VFIODevice *vdev, uint32_t size)
+{
+    uint8_t *config = vdev->pdev.config;
+    uint8_t *buf;
+    char *path;
+    struct stat st;
+    void *ptr = NULL;
+    int fd;
+
+    vfio_pci_load_rom(vdev);
+    if (!vdev->rom) {
+        return NULL;
+    }
+
+    buf = g_malloc(size);
+    memset(buf, 0xff, size);
+    memcpy(buf, vdev->rom, MIN(vdev->rom_size, size));
+
+    path = g_strdup_printf("%s/%04x:%04x-%04x:%04x-%x-%08lx.rom",
+                           vdev->rom_cache_dir,
+                           pci_get_word(config + PCI_VENDOR_ID),
+                           pci_get_word(config + PCI_DEVICE_ID),
+                           pci_get_word(config + PCI_SUBSYSTEM_VENDOR_ID),
+                           pci_get_word(config + PCI_SUBSYSTEM_ID), size,
+                           (unsigned long)crc32(0, buf, size));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fd = vfio_rom_cache_store(path, buf, size);
+        if (fd < 0) {
+            goto out;
+        }
+    }
+
+    if (fstat(fd, &st) || st.st_size != size) {
+        error_report("vfio: ROM cache file %s has unexpected size", path);
+        close(fd);
+        goto out;
+    }
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        error_report("vfio: Failed to map ROM cache file %s: %m", path);
+        ptr = NULL;
+        goto out;
+    }
+
+    DPRINTF("%04x:%02x:%02x.%x ROM mapped from %s\n", vdev->host.domain,
+            vdev->host.bus, vdev->host.slot, vdev->host.function, path);
+
+    g_free(vdev->rom);
+    vdev->rom = NULL;
+
+out:
+    g_free(path);
+    g_free(buf);
+    return ptr;
+}
+
 static void vfio_pci_size_rom(VFIODevice *vdev)
 {
     uint32_t orig, size = cpu_to_le32((uint32_t)PCI_ROM_ADDRESS_MASK);
@@ -1216,8 +1496,24 @@ static void vfio_pci_size_rom(VFIODevice *vdev)
              vdev->host.domain, vdev->host.bus, vdev->host.slot,
              vdev->host.function);
 
-    memory_region_init_io(&vdev->pdev.rom, OBJECT(vdev),
-                          &vfio_rom_ops, vdev, name, size);
+    if (vdev->rom_cache_dir) {
+        vdev->rom_cache = vfio_rom_cache_map(vdev, size);
+    }
+
+    /*
+     * A cached ROM is plain guest RAM, read-only so writes are discarded.
+     * Otherwise every firmware read traps into vfio_rom_read().
+     */
+    if (vdev->rom_cache) {
+        vdev->rom_cache_size = size;
+        memory_region_init_ram_ptr(&vdev->pdev.rom, OBJECT(vdev), name, size,
+                                   vdev->rom_cache);
+        memory_region_set_readonly(&vdev->pdev.rom, true);
+        vmstate_register_ram(&vdev->pdev.rom, &vdev->pdev.qdev);
+    } else {
+        memory_region_init_io(&vdev->pdev.rom, OBJECT(vdev),
+                              &vfio_rom_ops, vdev, name, size);
+    }
 
     pci_register_bar(&vdev->pdev, PCI_ROM_SLOT,
                      PCI_BASE_ADDRESS_SPACE_MEMORY, &vdev->pdev.rom);
@@ -2001,7 +2297,10 @@ static void vfio_bar_quirk_teardown(VFIODevice *vdev, int nr)
 static uint32_t vfio_pci_read_config(PCIDevice *pdev, uint32_t addr, int len)
 {
     VFIODevice *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
-    uint32_t emu_bits = 0, emu_val = 0, phys_val = 0, val;
+    uint32_t emu_bits = 0, emu_val = 0, phys_val = 0, shadow_bits = 0, val;
+    uint32_t phys_bits;
+
+    vfio_pci_reset_wait(vdev);
 
     memcpy(&emu_bits, vdev->emulated_config_bits + addr, len);
     emu_bits = le32_to_cpu(emu_bits);
@@ -2010,7 +2309,17 @@ static uint32_t vfio_pci_read_config(PCIDevice *pdev, uint32_t addr, int len)
         emu_val = pci_default_read_config(pdev, addr, len);
     }
 
-    if (~emu_bits & (0xffffffffU >> (32 - len * 8))) {
+    phys_bits = ~emu_bits & (0xffffffffU >> (32 - len * 8));
+
+    if (phys_bits && vdev->shadow_config_bits) {
+        memcpy(&shadow_bits, vdev->shadow_config_bits + addr, len);
+        shadow_bits = le32_to_cpu(shadow_bits);
+    }
+
+    if (phys_bits && !(phys_bits & ~shadow_bits)) {
+        memcpy(&phys_val, vdev->config_shadow + addr, len);
+        phys_val = le32_to_cpu(phys_val);
+    } else if (phys_bits) {
         ssize_t ret;
 
         ret = pread(vdev->fd, &phys_val, len, vdev->config_offset + addr);
@@ -2042,6 +2351,8 @@ static void vfio_pci_write_config(PCIDevice *pdev, uint32_t addr,
             vdev->host.domain, vdev->host.bus, vdev->host.slot,
             vdev->host.function, addr, val, len);
 
+    vfio_pci_reset_wait(vdev);
+
     /* Write everything to VFIO, let it filter out what we can't write */
     if (pwrite(vdev->fd, &val_le, len, vdev->config_offset + addr) != len) {
         error_report("%s(%04x:%02x:%02x.%x, 0x%x, 0x%x, 0x%x) failed: %m",
@@ -2049,6 +2360,17 @@ static void vfio_pci_write_config(PCIDevice *pdev, uint32_t addr,
                      vdev->host.slot, vdev->host.function, addr, val, len);
     }
 
+    /* Read-only should mean read-only, but don't trust a shadowed copy */
+    if (vdev->shadow_config_bits) {
+        uint32_t shadow_bits = 0;
+
+        memcpy(&shadow_bits, vdev->shadow_config_bits + addr, len);
+        if (shadow_bits && pread(vdev->fd, vdev->config_shadow + addr, len,
+                                 vdev->config_offset + addr) != len) {
+            memset(vdev->shadow_config_bits + addr, 0, len);
+        }
+    }
+
     /* MSI/MSI-X Enabling/Disabling */
     if (pdev->cap_present & QEMU_PCI_CAP_MSI &&
         ranges_overlap(addr, len, pdev->msi_cap, vdev->msi_cap_size)) {
@@ -2089,7 +2411,8 @@ static void vfio_pci_write_config(PCIDevice *pdev, uint32_t addr,
 }
 
 /*
- * DMA - Mapping and unmapping for the "type1" IOMMU interface used on x86
+ * DMA - Mapping and unmapping for the "type1" IOMMU interface used on x86,
+ * which the sPAPR TCE interface shares
  */
 static int vfio_dma_unmap(VFIOContainer *container,
                           hwaddr iova, ram_addr_t size)
@@ -2100,48 +2423,796 @@ static int vfio_dma_unmap(VFIOContainer *container,
         .iova = iova,
         .size = size,
     };
+    int ret = 0;
 
     if (ioctl(container->fd, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
-        DPRINTF("VFIO_UNMAP_DMA: %d\n", -errno);
-        return -errno;
+        ret = -errno;
+    }
+
+    atomic_inc(&container->unmap_calls);
+    trace_vfio_dma_unmap(container, iova, size, ret);
+
+    return ret;
+}
+
+static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
+                        ram_addr_t size, void *vaddr, bool readonly)
+{
+    struct vfio_iommu_type1_dma_map map = {
+        .argsz = sizeof(map),
+        .flags = VFIO_DMA_MAP_FLAG_READ,
+        .vaddr = (__u64)(uintptr_t)vaddr,
+        .iova = iova,
+        .size = size,
+    };
+    int64_t start, ns;
+    int ret = 0;
+
+    if (!readonly) {
+        map.flags |= VFIO_DMA_MAP_FLAG_WRITE;
+    }
+
+    /*
+     * Stale overlapping mappings are removed by the caller based on the
+     * container's mapping record, so EBUSY here is a genuine error.
+     */
+    start = get_clock();
+    if (ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map)) {
+        ret = -errno;
+    }
+    ns = get_clock() - start;
+
+    atomic_inc(&container->map_calls);
+    atomic_add(&container->map_ns, ns);
+    trace_vfio_dma_map(container, iova, size, vaddr, ret, ns);
+
+    return ret;
+}
+
+/*
+ * Mapping record
+ *
+ * Each container tracks the IOVA ranges it has mapped in a sorted array.
+ * This lets us skip maps which are already in place, tear down stale
+ * overlapping translations before replacing them and only unmap what
+ * was really mapped, independent of the section geometry the memory
+ * listener reports.
+ */
+static VFIODMAMapping *vfio_mapping_get(VFIOContainer *container, guint i)
+{
+    return &g_array_index(container->mappings, VFIODMAMapping, i);
+}
+
+/* Index of the first mapping ending above @iova */
+static guint vfio_mapping_find(VFIOContainer *container, hwaddr iova)
+{
+    guint lo = 0, hi = container->mappings->len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        VFIODMAMapping *m = vfio_mapping_get(container, mid);
+
+        if (m->iova + m->size <= iova) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Return the lowest mapping overlapping [iova, iova + size), if any */
+static VFIODMAMapping *vfio_mapping_first_overlap(VFIOContainer *container,
+                                                  hwaddr iova,
+                                                  ram_addr_t size)
+{
+    guint i = vfio_mapping_find(container, iova);
+    VFIODMAMapping *m;
+
+    if (i == container->mappings->len) {
+        return NULL;
+    }
+
+    m = vfio_mapping_get(container, i);
+    return m->iova < iova + size ? m : NULL;
+}
+
+static void vfio_mapping_account(VFIOContainer *container,
+                                 VFIODMAMapping *m, int64_t size)
+{
+    container->mapped_bytes += size;
+    if (m->pinned) {
+        container->pinned_bytes += size;
+    }
+    if (m->superpage) {
+        container->superpage_bytes += size;
+    }
+}
+
+/* Record a new mapping, the range must not overlap an existing one */
+static void vfio_mapping_insert(VFIOContainer *container, hwaddr iova,
+                                ram_addr_t size, void *vaddr,
+                                bool readonly, bool pinned, bool superpage)
+{
+    VFIODMAMapping m = {
+        .iova = iova,
+        .size = size,
+        .vaddr = vaddr,
+        .readonly = readonly,
+        .pinned = pinned,
+        .superpage = superpage,
+    };
+
+    g_array_insert_val(container->mappings,
+                       vfio_mapping_find(container, iova), m);
+    vfio_mapping_account(container, &m, size);
+}
+
+/*
+ * Drop [iova, iova + size) from the record, trimming or splitting the
+ * mappings which straddle either end of the range.
+ */
+static void vfio_mapping_remove(VFIOContainer *container, hwaddr iova,
+                                ram_addr_t size)
+{
+    hwaddr end = iova + size;
+    guint i = vfio_mapping_find(container, iova);
+
+    while (i < container->mappings->len) {
+        VFIODMAMapping *m = vfio_mapping_get(container, i);
+        hwaddr m_end = m->iova + m->size;
+
+        if (m->iova >= end) {
+            break;
+        }
+
+        if (m->iova < iova && m_end > end) {
+            VFIODMAMapping tail = *m;
+
+            tail.iova = end;
+            tail.vaddr += end - m->iova;
+            tail.size = m_end - end;
+            m->size = iova - m->iova;
+            vfio_mapping_account(container, m, -(int64_t)size);
+            g_array_insert_val(container->mappings, i + 1, tail);
+            break;
+        } else if (m->iova < iova) {
+            vfio_mapping_account(container, m, -(int64_t)(m_end - iova));
+            m->size = iova - m->iova;
+            i++;
+        } else if (m_end > end) {
+            vfio_mapping_account(container, m, -(int64_t)(end - m->iova));
+            m->vaddr += end - m->iova;
+            m->size = m_end - end;
+            m->iova = end;
+            break;
+        } else {
+            vfio_mapping_account(container, m, -(int64_t)m->size);
+            g_array_remove_index(container->mappings, i);
+        }
+    }
+}
+
+static bool vfio_listener_skipped_section(MemoryRegionSection *section)
+{
+    return !memory_region_is_ram(section->mr) &&
+           !memory_region_is_iommu(section->mr);
+}
+
+static void vfio_dma_queue(VFIOContainer *container, hwaddr iova,
+                           ram_addr_t size, void *vaddr, bool readonly,
+                           MemoryRegion *mr)
+{
+    VFIODMARange *range = g_new0(VFIODMARange, 1);
+
+    range->iova = iova;
+    range->size = size;
+    range->vaddr = vaddr;
+    range->readonly = readonly;
+    range->mr = mr;
+
+    if (vaddr) {
+        QSIMPLEQ_INSERT_TAIL(&container->pending_map, range, next);
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&container->pending_unmap, range, next);
+    }
+}
+
+/*
+ * Walk a pending queue and return the number of bytes covered by the
+ * run of entries starting at @range which can be handed to the IOMMU in
+ * a single ioctl.  Sections are delivered in address order, so adjacent
+ * entries are contiguous in IOVA space whenever they are merge candidates.
+ * Maps additionally require contiguous virtual addresses and matching
+ * permissions.  The type1 IOMMU backend allows unmapping a sub-range of
+ * a previous mapping, so a merged map can later be torn down section by
+ * section.
+ */
+static ram_addr_t vfio_dma_run_size(VFIODMARange *range, VFIODMARange **end)
+{
+    VFIODMARange *next = QSIMPLEQ_NEXT(range, next);
+    ram_addr_t size = range->size;
+
+    while (next && next->iova == range->iova + size &&
+           (!range->vaddr || (next->vaddr == range->vaddr + size &&
+                              next->readonly == range->readonly))) {
+        size += next->size;
+        next = QSIMPLEQ_NEXT(next, next);
+    }
+
+    *end = next;
+    return size;
+}
+
+/*
+ * Unmap whatever the record says is mapped within [iova, iova + size).
+ * Nothing is issued to the kernel if the range holds no mapping, e.g.
+ * because the corresponding map failed.
+ */
+static int vfio_dma_unmap_recorded(VFIOContainer *container, hwaddr iova,
+                                   ram_addr_t size)
+{
+    VFIODMAMapping *first, *last;
+    hwaddr start, end;
+    guint i;
+    int ret;
+
+    first = vfio_mapping_first_overlap(container, iova, size);
+    if (!first) {
+        return 0;
+    }
+
+    i = vfio_mapping_find(container, iova + size);
+    if (i == container->mappings->len ||
+        vfio_mapping_get(container, i)->iova >= iova + size) {
+        i--;
+    }
+    last = vfio_mapping_get(container, i);
+
+    start = MAX(iova, first->iova);
+    end = MIN(iova + size, last->iova + last->size);
+
+    ret = vfio_dma_unmap(container, start, end - start);
+    if (!ret) {
+        vfio_mapping_remove(container, start, end - start);
+    }
+
+    return ret;
+}
+
+static void vfio_dma_flush_unmap(VFIOContainer *container)
+{
+    VFIODMARange *range, *end;
+    ram_addr_t size;
+    int ret;
+
+    while ((range = QSIMPLEQ_FIRST(&container->pending_unmap))) {
+        size = vfio_dma_run_size(range, &end);
+
+        trace_vfio_listener_region_del(range->iova, range->iova + size - 1);
+
+        ret = vfio_dma_unmap_recorded(container, range->iova, size);
+        if (ret) {
+            error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx") = %d (%m)",
+                         container, range->iova, (hwaddr)size, ret);
+        }
+
+        while ((range = QSIMPLEQ_FIRST(&container->pending_unmap)) != end) {
+            QSIMPLEQ_REMOVE_HEAD(&container->pending_unmap, next);
+            memory_region_unref(range->mr);
+            g_free(range);
+        }
+    }
+}
+
+/*
+ * Mapping large amounts of guest RAM is dominated by the kernel faulting
+ * in and pinning pages, which it does serially under the container lock.
+ * When enabled with x-dma-map-threads, large batches are split into
+ * chunks that worker threads populate in parallel before issuing the map
+ * ioctl, so pinning finds the pages already present.
+ */
+#define VFIO_DMA_MAP_CHUNK (1ULL << 30)
+
+typedef struct VFIODMAChunk {
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+    bool pinned;
+    bool superpage;
+    int ret;
+} VFIODMAChunk;
+
+typedef struct VFIODMAMapWork {
+    VFIOContainer *container;
+    GArray *chunks;
+    int next; /* next chunk to claim, updated atomically */
+} VFIODMAMapWork;
+
+static void vfio_dma_prefault(void *vaddr, ram_addr_t size)
+{
+    size_t pagesize = getpagesize();
+    uint8_t *p;
+
+    /*
+     * Write fault each host page without changing its content, the guest
+     * may already be running if the device is hotplugged.
+     */
+    for (p = vaddr; p < (uint8_t *)vaddr + size; p += pagesize) {
+        atomic_or(p, 0);
+    }
+}
+
+static void *vfio_dma_map_thread(void *opaque)
+{
+    VFIODMAMapWork *work = opaque;
+    VFIODMAChunk *chunk;
+    int i;
+
+    while ((i = atomic_fetch_inc(&work->next)) < work->chunks->len) {
+        chunk = &g_array_index(work->chunks, VFIODMAChunk, i);
+        if (chunk->pinned && !chunk->readonly) {
+            vfio_dma_prefault(chunk->vaddr, chunk->size);
+        }
+        chunk->ret = vfio_dma_map(work->container, chunk->iova, chunk->size,
+                                  chunk->vaddr, chunk->readonly);
+    }
+
+    return NULL;
+}
+
+static void vfio_dma_map_parallel(VFIODMAMapWork *work, unsigned int nr)
+{
+    QemuThread *threads = g_new(QemuThread, nr);
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        qemu_thread_create(&threads[i], vfio_dma_map_thread, work,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 0; i < nr; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    g_free(threads);
+}
+
+static void vfio_dma_map_work_add_chunks(VFIODMAMapWork *work, hwaddr iova,
+                                         ram_addr_t size, void *vaddr,
+                                         bool readonly, bool pinned,
+                                         bool superpage)
+{
+    ram_addr_t chunk_size = work->container->map_threads > 1 ?
+                            VFIO_DMA_MAP_CHUNK : size;
+    VFIODMAChunk chunk = {
+        .readonly = readonly,
+        .pinned = pinned,
+        .superpage = superpage,
+    };
+
+    while (size) {
+        chunk.iova = iova;
+        chunk.vaddr = vaddr;
+        chunk.size = MIN(size, chunk_size);
+        g_array_append_val(work->chunks, chunk);
+
+        iova += chunk.size;
+        vaddr += chunk.size;
+        size -= chunk.size;
+    }
+}
+
+/*
+ * The IOMMU can only use a superpage where IOVA and host address are both
+ * aligned to it.  When the backing memory uses pages larger than the host
+ * page size and the two addresses agree modulo that size, map the aligned
+ * core separately from the unaligned head and tail so that neither they
+ * nor the worker chunk boundaries break up the core.  VFIO_DMA_MAP_CHUNK
+ * is a multiple of every hugepage size we care about.
+ */
+static void vfio_dma_map_work_add(VFIODMAMapWork *work, hwaddr iova,
+                                  ram_addr_t size, void *vaddr,
+                                  bool readonly, bool pinned,
+                                  ram_addr_t pagesize)
+{
+    hwaddr start, end;
+
+    if (pagesize <= getpagesize() ||
+        ((iova ^ (uintptr_t)vaddr) & (pagesize - 1))) {
+        vfio_dma_map_work_add_chunks(work, iova, size, vaddr,
+                                     readonly, pinned, false);
+        return;
+    }
+
+    start = ROUND_UP(iova, pagesize);
+    end = (iova + size) & ~(hwaddr)(pagesize - 1);
+
+    if (start >= end) {
+        vfio_dma_map_work_add_chunks(work, iova, size, vaddr,
+                                     readonly, pinned, false);
+        return;
+    }
+
+    if (start > iova) {
+        vfio_dma_map_work_add_chunks(work, iova, start - iova, vaddr,
+                                     readonly, pinned, false);
+    }
+
+    vfio_dma_map_work_add_chunks(work, start, end - start,
+                                 vaddr + (start - iova), readonly, pinned,
+                                 true);
+
+    if (iova + size > end) {
+        vfio_dma_map_work_add_chunks(work, end, iova + size - end,
+                                     vaddr + (end - iova), readonly, pinned,
+                                     false);
+    }
+}
+
+/*
+ * Queue the parts of [iova, iova + size) which are not already mapped
+ * with the same translation.  Overlapping mappings with a different
+ * translation or permissions are torn down first so the new map cannot
+ * fail with EBUSY.
+ */
+static void vfio_dma_map_prepare(VFIODMAMapWork *work, hwaddr iova,
+                                 ram_addr_t size, void *vaddr,
+                                 bool readonly, bool pinned,
+                                 ram_addr_t pagesize)
+{
+    VFIOContainer *container = work->container;
+    hwaddr cur = iova, end = iova + size;
+    VFIODMAMapping *m;
+    hwaddr m_end;
+
+    while (cur < end) {
+        m = vfio_mapping_first_overlap(container, cur, end - cur);
+        if (!m) {
+            vfio_dma_map_work_add(work, cur, end - cur, vaddr + (cur - iova),
+                                  readonly, pinned, pagesize);
+            break;
+        }
+
+        if (m->iova > cur) {
+            vfio_dma_map_work_add(work, cur, m->iova - cur,
+                                  vaddr + (cur - iova), readonly, pinned,
+                                  pagesize);
+            cur = m->iova;
+        }
+
+        m_end = MIN(m->iova + m->size, end);
+
+        if (m->vaddr + (cur - m->iova) != vaddr + (cur - iova) ||
+            m->readonly != readonly) {
+            if (vfio_dma_unmap(container, cur, m_end - cur)) {
+                error_report("vfio: failed to unmap stale range 0x%"
+                             HWADDR_PRIx" - 0x%"HWADDR_PRIx": %m",
+                             cur, m_end - 1);
+            } else {
+                vfio_mapping_remove(container, cur, m_end - cur);
+            }
+            vfio_dma_map_work_add(work, cur, m_end - cur,
+                                  vaddr + (cur - iova), readonly, pinned,
+                                  pagesize);
+        }
+
+        cur = m_end;
+    }
+}
+
+static void vfio_dma_flush_map(VFIOContainer *container)
+{
+    VFIODMAMapWork work = { .container = container };
+    VFIODMARange *range, *end, *tmp;
+    VFIODMAChunk *chunk;
+    ram_addr_t size, pagesize;
+    bool pinned;
+    int i;
+
+    if (QSIMPLEQ_EMPTY(&container->pending_map)) {
+        return;
+    }
+
+    work.chunks = g_array_new(FALSE, FALSE, sizeof(VFIODMAChunk));
+
+    while ((range = QSIMPLEQ_FIRST(&container->pending_map))) {
+        size = vfio_dma_run_size(range, &end);
+
+        trace_vfio_listener_region_add(range->iova, range->iova + size - 1);
+
+        pinned = true;
+        pagesize = RAM_ADDR_MAX;
+        for (tmp = range; tmp != end; tmp = QSIMPLEQ_NEXT(tmp, next)) {
+            ram_addr_t ram_addr = memory_region_get_ram_addr(tmp->mr);
+
+            if (qemu_ram_is_prealloc(ram_addr)) {
+                pinned = false;
+            }
+            pagesize = MIN(pagesize, qemu_ram_pagesize(ram_addr));
+        }
+
+        vfio_dma_map_prepare(&work, range->iova, size, range->vaddr,
+                             range->readonly, pinned, pagesize);
+
+        /* The memory region reference is kept until region_del */
+        while ((range = QSIMPLEQ_FIRST(&container->pending_map)) != end) {
+            QSIMPLEQ_REMOVE_HEAD(&container->pending_map, next);
+            g_free(range);
+        }
+    }
+
+    if (container->map_threads > 1 && work.chunks->len > 1) {
+        vfio_dma_map_parallel(&work, MIN(container->map_threads,
+                                         work.chunks->len));
+    } else {
+        for (i = 0; i < work.chunks->len; i++) {
+            chunk = &g_array_index(work.chunks, VFIODMAChunk, i);
+            chunk->ret = vfio_dma_map(container, chunk->iova, chunk->size,
+                                      chunk->vaddr, chunk->readonly);
+        }
+    }
+
+    for (i = 0; i < work.chunks->len; i++) {
+        chunk = &g_array_index(work.chunks, VFIODMAChunk, i);
+        if (!chunk->ret) {
+            vfio_mapping_insert(container, chunk->iova, chunk->size,
+                                chunk->vaddr, chunk->readonly, chunk->pinned,
+                                chunk->superpage);
+        } else {
+            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx", %p) = %d (%s)",
+                         container, chunk->iova, (hwaddr)chunk->size,
+                         chunk->vaddr, chunk->ret, strerror(-chunk->ret));
+        }
+    }
+
+    g_array_free(work.chunks, TRUE);
+}
+
+/*
+ * Memory.c delivers all region_del callbacks of a topology update ahead
+ * of the region_add callbacks, so retiring the unmaps first preserves the
+ * ordering the IOMMU would have seen without batching.
+ */
+static void vfio_dma_flush(VFIOContainer *container)
+{
+    vfio_dma_flush_unmap(container);
+    vfio_dma_flush_map(container);
+}
+
+static void vfio_listener_begin(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer,
+                                            iommu_data.listener);
+
+    container->in_transaction = true;
+}
+
+static void vfio_listener_commit(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer,
+                                            iommu_data.listener);
+
+    container->in_transaction = false;
+    vfio_dma_flush(container);
+}
+
+/*
+ * Guest IOMMU
+ *
+ * Behind a guest visible IOMMU the container maps what the guest maps
+ * through it rather than all of guest RAM.  Translation updates arrive
+ * one entry at a time through the IOMMU notifier and are queued like the
+ * sections of the memory listener, so that while the IOMMU batches them
+ * (e.g. for the multi-TCE hypercalls) runs of consecutive entries reach
+ * the kernel as a single map or unmap ioctl.
+ */
+static bool vfio_dma_queue_ordered(VFIOContainer *container, hwaddr iova,
+                                   bool map)
+{
+    VFIODMARange *last;
+
+    /*
+     * Unmaps are flushed ahead of maps, so an unmap may not be queued
+     * behind a map.  Within each queue the entries must be increasing
+     * and disjoint for vfio_dma_run_size() and the mapping record.
+     */
+    if (!map && !QSIMPLEQ_EMPTY(&container->pending_map)) {
+        return false;
+    }
+    last = map ? QSIMPLEQ_LAST(&container->pending_map, VFIODMARange, next) :
+                 QSIMPLEQ_LAST(&container->pending_unmap, VFIODMARange, next);
+
+    return !last || last->iova + last->size <= iova;
+}
+
+static void vfio_iommu_map_notify(Notifier *n, void *data)
+{
+    VFIOGuestIOMMU *giommu = container_of(n, VFIOGuestIOMMU, n);
+    VFIOContainer *container = giommu->container;
+    IOMMUTLBEntry *iotlb = data;
+    MemoryRegion *mr = NULL;
+    hwaddr iova, size, xlat, len;
+    void *vaddr = NULL;
+    bool map;
+
+    if (!iotlb) {
+        /* the IOMMU finished a batch of updates */
+        if (!container->in_transaction) {
+            vfio_dma_flush(container);
+        }
+        return;
+    }
+
+    size = iotlb->addr_mask + 1;
+    if (iotlb->iova < giommu->start || size == 0 ||
+        iotlb->iova + size > giommu->end) {
+        /* outside of the section, or a bypass translation */
+        return;
+    }
+    iova = giommu->iova_offset + iotlb->iova;
+    map = iotlb->perm != IOMMU_NONE;
+
+    trace_vfio_iommu_map_notify(iova, iova + iotlb->addr_mask, map);
+
+    if (map) {
+        if (iotlb->target_as != &address_space_memory) {
+            error_report("vfio: IOMMU translation 0x%"HWADDR_PRIx" does not "
+                         "target system memory", iova);
+            return;
+        }
+
+        len = size;
+        mr = address_space_translate(&address_space_memory,
+                                     iotlb->translated_addr, &xlat, &len,
+                                     iotlb->perm & IOMMU_WO);
+        if (!memory_region_is_ram(mr) || len < size) {
+            error_report("vfio: IOMMU translation 0x%"HWADDR_PRIx" -> 0x%"
+                         HWADDR_PRIx" is not backed by RAM", iova,
+                         iotlb->translated_addr);
+            return;
+        }
+        vaddr = memory_region_get_ram_ptr(mr) + xlat;
+    }
+
+    if (!vfio_dma_queue_ordered(container, iova, map)) {
+        vfio_dma_flush(container);
+    }
+
+    /*
+     * No reference is taken on guest RAM, the mapping record takes care
+     * of replacing the translation when the guest reprograms the entry.
+     * A write-only translation is mapped read-write, the type1 interface
+     * has no way to express it.
+     */
+    vfio_dma_queue(container, iova, size, vaddr,
+                   map && !(iotlb->perm & IOMMU_WO), mr);
+
+    if (!container->in_transaction &&
+        !memory_region_iommu_in_batch(giommu->iommu)) {
+        vfio_dma_flush(container);
+    }
+}
+
+/*
+ * When KVM keeps the guest's translation table in the kernel, it also
+ * updates the host IOMMU for the groups attached to the table, so that
+ * guest map and unmap requests do not exit to QEMU.
+ */
+static void vfio_kvm_device_attach_spapr_tce(VFIOGroup *group,
+                                             VFIOGuestIOMMU *giommu)
+{
+#ifdef CONFIG_KVM
+    struct kvm_vfio_spapr_tce param = {
+        .groupfd = group->fd,
+        .tablefd = memory_region_iommu_get_kvm_fd(giommu->iommu),
+    };
+    struct kvm_device_attr attr = {
+        .group = KVM_DEV_VFIO_GROUP,
+        .attr = KVM_DEV_VFIO_GROUP_SET_SPAPR_TCE,
+        .addr = (uint64_t)(unsigned long)&param,
+    };
+
+    if (vfio_kvm_device_fd < 0 || param.tablefd < 0) {
+        return;
+    }
+
+    if (ioctl(vfio_kvm_device_fd, KVM_SET_DEVICE_ATTR, &attr)) {
+        error_report("vfio: failed to attach group %d to the in-kernel "
+                     "TCE table: %m", group->groupid);
     }
+#endif
+}
 
-    return 0;
+/* Map what the guest already has mapped through a newly seen IOMMU */
+static void vfio_iommu_replay(VFIOGuestIOMMU *giommu)
+{
+    const MemoryRegionIOMMUOps *ops = giommu->iommu->iommu_ops;
+    IOMMUTLBEntry iotlb;
+    hwaddr addr = giommu->start;
+
+    while (addr < giommu->end) {
+        iotlb = ops->translate(giommu->iommu, addr);
+        if (iotlb.addr_mask >= giommu->end - giommu->start) {
+            /* past the DMA window, or in bypass mode */
+            break;
+        }
+        if (iotlb.perm != IOMMU_NONE) {
+            vfio_iommu_map_notify(&giommu->n, &iotlb);
+        }
+        addr = (addr | iotlb.addr_mask) + 1;
+    }
 }
 
-static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
-                        ram_addr_t size, void *vaddr, bool readonly)
+static void vfio_listener_add_iommu(VFIOContainer *container,
+                                    MemoryRegionSection *section)
 {
-    struct vfio_iommu_type1_dma_map map = {
-        .argsz = sizeof(map),
-        .flags = VFIO_DMA_MAP_FLAG_READ,
-        .vaddr = (__u64)(uintptr_t)vaddr,
-        .iova = iova,
-        .size = size,
-    };
+    VFIOGuestIOMMU *giommu = g_new0(VFIOGuestIOMMU, 1);
+    VFIOGroup *group;
+    Int128 end = int128_add(int128_make64(section->offset_within_region),
+                            section->size);
 
-    if (!readonly) {
-        map.flags |= VFIO_DMA_MAP_FLAG_WRITE;
-    }
+    giommu->container = container;
+    giommu->iommu = section->mr;
+    giommu->iova_offset = section->offset_within_address_space -
+                          section->offset_within_region;
+    giommu->start = section->offset_within_region;
+    giommu->end = int128_get64(int128_min(end, int128_make64(UINT64_MAX)));
+    giommu->n.notify = vfio_iommu_map_notify;
 
-    /*
-     * Try the mapping, if it fails with EBUSY, unmap the region and try
-     * again.  This shouldn't be necessary, but we sometimes see it in
-     * the the VGA ROM space.
-     */
-    if (ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map) == 0 ||
-        (errno == EBUSY && vfio_dma_unmap(container, iova, size) == 0 &&
-         ioctl(container->fd, VFIO_IOMMU_MAP_DMA, &map) == 0)) {
-        return 0;
+    trace_vfio_listener_region_add_iommu(giommu->iova_offset + giommu->start,
+            giommu->iova_offset + giommu->end - 1);
+
+    memory_region_ref(section->mr);
+    memory_region_register_iommu_notifier(section->mr, &giommu->n);
+    QLIST_INSERT_HEAD(&container->giommu_list, giommu, next);
+
+    QLIST_FOREACH(group, &container->group_list, container_next) {
+        vfio_kvm_device_attach_spapr_tce(group, giommu);
     }
+    vfio_iommu_replay(giommu);
+}
 
-    DPRINTF("VFIO_MAP_DMA: %d\n", -errno);
-    return -errno;
+static void vfio_giommu_free(VFIOGuestIOMMU *giommu)
+{
+    memory_region_unregister_iommu_notifier(giommu->iommu, &giommu->n);
+    memory_region_unref(giommu->iommu);
+    QLIST_REMOVE(giommu, next);
+    g_free(giommu);
 }
 
-static bool vfio_listener_skipped_section(MemoryRegionSection *section)
+static void vfio_listener_del_iommu(VFIOContainer *container,
+                                    MemoryRegionSection *section)
 {
-    return !memory_region_is_ram(section->mr);
+    VFIOGuestIOMMU *giommu;
+    int ret;
+
+    QLIST_FOREACH(giommu, &container->giommu_list, next) {
+        if (giommu->iommu == section->mr &&
+            giommu->start == section->offset_within_region) {
+            break;
+        }
+    }
+    if (!giommu) {
+        return;
+    }
+
+    /* Queued translations of this IOMMU must not be applied afterwards */
+    vfio_dma_flush(container);
+    ret = vfio_dma_unmap_recorded(container,
+                                  giommu->iova_offset + giommu->start,
+                                  giommu->end - giommu->start);
+    if (ret) {
+        error_report("vfio: failed to unmap IOMMU window 0x%"HWADDR_PRIx
+                     " - 0x%"HWADDR_PRIx": %d",
+                     giommu->iova_offset + giommu->start,
+                     giommu->iova_offset + giommu->end - 1, ret);
+    }
+    vfio_giommu_free(giommu);
 }
 
 static void vfio_listener_region_add(MemoryListener *listener,
@@ -2151,12 +3222,14 @@ static void vfio_listener_region_add(MemoryListener *listener,
                                             iommu_data.listener);
     hwaddr iova, end;
     void *vaddr;
-    int ret;
 
-    assert(!memory_region_is_iommu(section->mr));
+    if (memory_region_is_iommu(section->mr)) {
+        vfio_listener_add_iommu(container, section);
+        return;
+    }
 
     if (vfio_listener_skipped_section(section)) {
-        DPRINTF("SKIPPING region_add %"HWADDR_PRIx" - %"PRIx64"\n",
+        trace_vfio_listener_region_skip("add",
                 section->offset_within_address_space,
                 section->offset_within_address_space +
                 int128_get64(int128_sub(section->size, int128_one())));
@@ -2181,15 +3254,12 @@ static void vfio_listener_region_add(MemoryListener *listener,
             section->offset_within_region +
             (iova - section->offset_within_address_space);
 
-    DPRINTF("region_add %"HWADDR_PRIx" - %"HWADDR_PRIx" [%p]\n",
-            iova, end - 1, vaddr);
-
     memory_region_ref(section->mr);
-    ret = vfio_dma_map(container, iova, end - iova, vaddr, section->readonly);
-    if (ret) {
-        error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx", %p) = %d (%m)",
-                     container, iova, end - iova, vaddr, ret);
+    vfio_dma_queue(container, iova, end - iova, vaddr, section->readonly,
+                   section->mr);
+
+    if (!container->in_transaction) {
+        vfio_dma_flush(container);
     }
 }
 
@@ -2199,10 +3269,14 @@ static void vfio_listener_region_del(MemoryListener *listener,
     VFIOContainer *container = container_of(listener, VFIOContainer,
                                             iommu_data.listener);
     hwaddr iova, end;
-    int ret;
+
+    if (memory_region_is_iommu(section->mr)) {
+        vfio_listener_del_iommu(container, section);
+        return;
+    }
 
     if (vfio_listener_skipped_section(section)) {
-        DPRINTF("SKIPPING region_del %"HWADDR_PRIx" - %"PRIx64"\n",
+        trace_vfio_listener_region_skip("del",
                 section->offset_within_address_space,
                 section->offset_within_address_space +
                 int128_get64(int128_sub(section->size, int128_one())));
@@ -2223,26 +3297,74 @@ static void vfio_listener_region_del(MemoryListener *listener,
         return;
     }
 
-    DPRINTF("region_del %"HWADDR_PRIx" - %"HWADDR_PRIx"\n",
-            iova, end - 1);
+    /* Drop the reference taken in region_add once the unmap is flushed */
+    vfio_dma_queue(container, iova, end - iova, NULL, false, section->mr);
 
-    ret = vfio_dma_unmap(container, iova, end - iova);
-    memory_region_unref(section->mr);
-    if (ret) {
-        error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx") = %d (%m)",
-                     container, iova, end - iova, ret);
+    if (!container->in_transaction) {
+        vfio_dma_flush(container);
+    }
+}
+
+/*
+ * Neither the type1 IOMMU nor the device can tell us which pages were
+ * written by DMA.  Once the VM is stopped for the final stage of migration,
+ * with bus mastering disabled on the devices, report every page mapped
+ * writable through the container as dirty so it is sent again.
+ */
+static void vfio_listener_log_sync(MemoryListener *listener,
+                                   MemoryRegionSection *section)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer,
+                                            iommu_data.listener);
+    hwaddr start, end;
+    guint i;
+
+    /* Mappings behind a guest IOMMU are not indexed by guest address */
+    if (!runstate_check(RUN_STATE_FINISH_MIGRATE) ||
+        vfio_listener_skipped_section(section) ||
+        memory_region_is_iommu(section->mr)) {
+        return;
+    }
+
+    start = section->offset_within_address_space;
+    end = start + int128_get64(section->size);
+
+    for (i = vfio_mapping_find(container, start);
+         i < container->mappings->len; i++) {
+        VFIODMAMapping *m = vfio_mapping_get(container, i);
+        hwaddr lo, hi;
+
+        if (m->iova >= end) {
+            break;
+        }
+
+        if (m->readonly) {
+            continue;
+        }
+
+        lo = MAX(m->iova, start);
+        hi = MIN(m->iova + m->size, end);
+        memory_region_set_dirty(section->mr,
+                                section->offset_within_region + (lo - start),
+                                hi - lo);
     }
 }
 
 static MemoryListener vfio_memory_listener = {
+    .begin = vfio_listener_begin,
+    .commit = vfio_listener_commit,
     .region_add = vfio_listener_region_add,
     .region_del = vfio_listener_region_del,
+    .log_sync = vfio_listener_log_sync,
 };
 
 static void vfio_listener_release(VFIOContainer *container)
 {
     memory_listener_unregister(&container->iommu_data.listener);
+
+    while (!QLIST_EMPTY(&container->giommu_list)) {
+        vfio_giommu_free(QLIST_FIRST(&container->giommu_list));
+    }
 }
 
 /*
@@ -2491,11 +3613,50 @@ static void vfio_map_bar(VFIODevice *vdev, int nr)
     type = pci_bar & (bar->ioport ? ~PCI_BASE_ADDRESS_IO_MASK :
                                     ~PCI_BASE_ADDRESS_MEM_MASK);
 
+    /*
+     * Sub-page MMIO BARs can't be mmapped into the guest unless the guest
+     * places them on a page boundary.  When enabled, expose such BARs as a
+     * full page so the guest allocates them page-aligned, QEMU handles the
+     * BAR registers so the guest sizes the enlarged BAR.  The part of the
+     * page beyond the real BAR is only reachable through the mmap, it is
+     * part of the same exclusive host page.
+     */
+    if ((vdev->features & VFIO_FEATURE_ENABLE_SUBPAGE) && !bar->ioport &&
+        size < TARGET_PAGE_SIZE && bar->flags & VFIO_REGION_INFO_FLAG_MMAP) {
+        size = TARGET_PAGE_SIZE;
+        memset(vdev->emulated_config_bits + PCI_BASE_ADDRESS_0 + (4 * nr),
+               0xff, bar->mem64 ? 8 : 4);
+        DPRINTF("%s expanded to 0x%x bytes\n", name, size);
+    }
+
     /* A "slow" read/write mapping underlies all BARs */
     memory_region_init_io(&bar->mem, OBJECT(vdev), &vfio_bar_ops,
                           bar, name, size);
     pci_register_bar(&vdev->pdev, nr, type, &bar->mem);
 
+    strncat(name, " mmap", sizeof(name) - strlen(name) - 1);
+
+    /*
+     * Kernels which allow mapping the MSI-X table let us mmap the entire
+     * BAR, the MSI-X table and PBA regions registered later by msix_init()
+     * then overlay the exact ranges they emulate.  Otherwise fall back to
+     * mapping around the page(s) holding the table.
+     */
+    if (vdev->msix && vdev->msix->table_bar == nr &&
+        vdev->features & VFIO_FEATURE_ENABLE_MSIX_MMAP) {
+        if (!vfio_mmap_bar(vdev, bar, &bar->mem, &bar->mmap_mem,
+                           &bar->mmap, size, 0, name)) {
+            /* Keep the teardown path symmetric with the split layout */
+            memory_region_init(&vdev->msix->mmap_mem, OBJECT(vdev),
+                               name, 0);
+            memory_region_add_subregion(&bar->mem, 0, &vdev->msix->mmap_mem);
+            goto done;
+        }
+        memory_region_del_subregion(&bar->mem, &bar->mmap_mem);
+        memory_region_destroy(&bar->mmap_mem);
+        DPRINTF("%s of MSI-X table refused, splitting BAR\n", name);
+    }
+
     /*
      * We can't mmap areas overlapping the MSIX vector table, so we
      * potentially insert a direct-mapped subregion before and after it.
@@ -2504,7 +3665,6 @@ static void vfio_map_bar(VFIODevice *vdev, int nr)
         size = vdev->msix->table_offset & TARGET_PAGE_MASK;
     }
 
-    strncat(name, " mmap", sizeof(name) - strlen(name) - 1);
     if (vfio_mmap_bar(vdev, bar, &bar->mem,
                       &bar->mmap_mem, &bar->mmap, size, 0, name)) {
         error_report("%s unsupported. Performance may be slow", name);
@@ -2525,6 +3685,7 @@ static void vfio_map_bar(VFIODevice *vdev, int nr)
         }
     }
 
+done:
     vfio_bar_quirk_setup(vdev, nr);
 }
 
@@ -2577,6 +3738,172 @@ static void vfio_unmap_bars(VFIODevice *vdev)
     }
 }
 
+/*
+ * Doorbells
+ */
+static void *vfio_doorbell_thread(void *opaque)
+{
+    VFIODevice *vdev = opaque;
+    struct pollfd *fds = g_new0(struct pollfd, vdev->nr_doorbells + 1);
+    VFIODoorbell *db;
+    int i;
+
+    fds[0].fd = event_notifier_get_fd(&vdev->doorbell_stop);
+    fds[0].events = POLLIN;
+    i = 1;
+    QLIST_FOREACH(db, &vdev->doorbells, next) {
+        fds[i].fd = event_notifier_get_fd(&db->e);
+        fds[i].events = POLLIN;
+        i++;
+    }
+
+    for (;;) {
+        if (poll(fds, vdev->nr_doorbells + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        i = 1;
+        QLIST_FOREACH(db, &vdev->doorbells, next) {
+            if (fds[i++].revents && event_notifier_test_and_clear(&db->e)) {
+                uint64_t data = cpu_to_le64(db->data);
+
+                if (pwrite(db->bar->fd, &data, db->size,
+                           db->bar->fd_offset + db->offset) != db->size) {
+                    error_report("vfio: doorbell write to BAR%d+0x%"
+                                 HWADDR_PRIx" failed: %m", db->bar->nr,
+                                 db->offset);
+                }
+            }
+        }
+    }
+
+    g_free(fds);
+    return NULL;
+}
+
+static int vfio_add_doorbell(VFIODevice *vdev, const char *str)
+{
+    unsigned long long nr, offset, size, data;
+    VFIODoorbell *db;
+    VFIOBAR *bar;
+
+    if (sscanf(str, "%lli:%lli:%lli:%lli", &nr, &offset, &size, &data) != 4) {
+        error_report("vfio: invalid doorbell \"%s\", "
+                     "expected BAR:OFFSET:SIZE:DATA", str);
+        return -EINVAL;
+    }
+
+    if (nr >= PCI_ROM_SLOT || !vdev->bars[nr].size) {
+        error_report("vfio: doorbell \"%s\": invalid BAR", str);
+        return -EINVAL;
+    }
+    bar = &vdev->bars[nr];
+
+    if ((size != 1 && size != 2 && size != 4) || offset % size ||
+        offset + size > bar->size) {
+        error_report("vfio: doorbell \"%s\": invalid offset or size", str);
+        return -EINVAL;
+    }
+
+    db = g_new0(VFIODoorbell, 1);
+    db->bar = bar;
+    db->offset = offset;
+    db->size = size;
+    db->data = data;
+
+    if (event_notifier_init(&db->e, 0)) {
+        error_report("vfio: Error: event_notifier_init failed");
+        g_free(db);
+        return -ENOMEM;
+    }
+
+    /* Writes of any other value keep going through vfio_bar_write() */
+    memory_region_add_eventfd(&bar->mem, offset, size, true, data, &db->e);
+
+    QLIST_INSERT_HEAD(&vdev->doorbells, db, next);
+    vdev->nr_doorbells++;
+
+    return 0;
+}
+
+static void vfio_free_doorbells(VFIODevice *vdev)
+{
+    VFIODoorbell *db;
+
+    while ((db = QLIST_FIRST(&vdev->doorbells))) {
+        QLIST_REMOVE(db, next);
+        memory_region_del_eventfd(&db->bar->mem, db->offset, db->size,
+                                  true, db->data, &db->e);
+        event_notifier_cleanup(&db->e);
+        g_free(db);
+    }
+    vdev->nr_doorbells = 0;
+}
+
+static void vfio_teardown_doorbells(VFIODevice *vdev)
+{
+    if (!vdev->nr_doorbells) {
+        return;
+    }
+
+    event_notifier_set(&vdev->doorbell_stop);
+    qemu_thread_join(&vdev->doorbell_thread);
+    event_notifier_cleanup(&vdev->doorbell_stop);
+
+    vfio_free_doorbells(vdev);
+}
+
+/*
+ * x-doorbells takes a ';' separated list of BAR:OFFSET:SIZE:DATA entries.
+ * Forwarding is asynchronous, so it is only suitable for registers where
+ * the device tolerates the write being reordered against other accesses.
+ */
+static int vfio_setup_doorbells(VFIODevice *vdev)
+{
+    char **entries;
+    int i, ret = 0;
+
+    QLIST_INIT(&vdev->doorbells);
+
+    if (!vdev->doorbells_str) {
+        return 0;
+    }
+
+    if (!kvm_enabled()) {
+        error_report("vfio: doorbells require KVM ioeventfds, ignored");
+        return 0;
+    }
+
+    entries = g_strsplit(vdev->doorbells_str, ";", 0);
+    for (i = 0; entries[i] && !ret; i++) {
+        ret = vfio_add_doorbell(vdev, entries[i]);
+    }
+    g_strfreev(entries);
+
+    if (!ret && vdev->nr_doorbells) {
+        ret = event_notifier_init(&vdev->doorbell_stop, 0);
+    }
+
+    if (ret) {
+        vfio_free_doorbells(vdev);
+        return ret;
+    }
+
+    if (vdev->nr_doorbells) {
+        qemu_thread_create(&vdev->doorbell_thread, vfio_doorbell_thread,
+                           vdev, QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
 /*
  * General setup
  */
@@ -2835,11 +4162,104 @@ static int vfio_add_capabilities(VFIODevice *vdev)
     return vfio_add_std_cap(vdev, pdev->config[PCI_CAPABILITY_LIST]);
 }
 
+/*
+ * Config space shadow
+ *
+ * Guests, especially monitoring agents and PCI rescans, poll identifying
+ * and capability registers which can never change.  Keep a copy of those
+ * read-only fields from init time and serve them without a pread() on the
+ * device.  Anything with volatile or writable bits (command, status, cache
+ * line size, BIST, PM control, PCIe control/status, AER, capability bodies
+ * we don't know) always goes to the device.
+ */
+static void vfio_shadow_config_range(VFIODevice *vdev, int pos, int len)
+{
+    if (pos + len <= vdev->config_size) {
+        memset(vdev->shadow_config_bits + pos, 0xff, len);
+    }
+}
+
+static void vfio_shadow_std_cap(VFIODevice *vdev, uint8_t pos)
+{
+    uint8_t *config = vdev->config_shadow;
+    uint16_t flags;
+
+    vfio_shadow_config_range(vdev, pos, 2); /* ID and next pointer */
+
+    switch (config[pos]) {
+    case PCI_CAP_ID_PM:
+        vfio_shadow_config_range(vdev, pos + PCI_PM_PMC, 2);
+        break;
+    case PCI_CAP_ID_EXP:
+        flags = pci_get_word(config + pos + PCI_EXP_FLAGS);
+        vfio_shadow_config_range(vdev, pos + PCI_EXP_FLAGS, 2);
+        vfio_shadow_config_range(vdev, pos + PCI_EXP_DEVCAP, 4);
+        vfio_shadow_config_range(vdev, pos + PCI_EXP_LNKCAP, 4);
+        if (flags & PCI_EXP_FLAGS_SLOT) {
+            vfio_shadow_config_range(vdev, pos + PCI_EXP_SLTCAP, 4);
+        }
+        if ((flags & PCI_EXP_FLAGS_VERS) > 1) {
+            vfio_shadow_config_range(vdev, pos + PCI_EXP_DEVCAP2, 4);
+        }
+        break;
+    }
+}
+
+static void vfio_setup_config_shadow(VFIODevice *vdev)
+{
+    uint8_t *config;
+    uint32_t header;
+    uint8_t pos;
+    uint16_t epos;
+    int loops;
+
+    config = g_malloc0(vdev->config_size);
+    if (pread(vdev->fd, config, vdev->config_size,
+              vdev->config_offset) != vdev->config_size) {
+        g_free(config);
+        return;
+    }
+
+    vdev->config_shadow = config;
+    vdev->shadow_config_bits = g_malloc0(vdev->config_size);
+
+    vfio_shadow_config_range(vdev, PCI_VENDOR_ID, 4);
+    vfio_shadow_config_range(vdev, PCI_CLASS_REVISION, 4);
+    vfio_shadow_config_range(vdev, PCI_HEADER_TYPE, 1);
+    vfio_shadow_config_range(vdev, PCI_CARDBUS_CIS, 8);
+    vfio_shadow_config_range(vdev, PCI_CAPABILITY_LIST, 1);
+    vfio_shadow_config_range(vdev, PCI_INTERRUPT_PIN, 1);
+    vfio_shadow_config_range(vdev, PCI_MIN_GNT, 2);
+
+    if (pci_get_word(config + PCI_STATUS) & PCI_STATUS_CAP_LIST) {
+        pos = config[PCI_CAPABILITY_LIST];
+        for (loops = 0; pos >= PCI_CONFIG_HEADER_SIZE && loops < 48; loops++) {
+            vfio_shadow_std_cap(vdev, pos);
+            pos = config[pos + PCI_CAP_LIST_NEXT];
+        }
+    }
+
+    if (vdev->config_size <= PCI_CONFIG_SPACE_SIZE) {
+        return;
+    }
+
+    epos = PCI_CONFIG_SPACE_SIZE;
+    for (loops = 0; epos >= PCI_CONFIG_SPACE_SIZE && loops < 480; loops++) {
+        header = pci_get_long(config + epos);
+        if (!header || header == 0xffffffff) {
+            break;
+        }
+        vfio_shadow_config_range(vdev, epos, 4);
+        epos = PCI_EXT_CAP_NEXT(header);
+    }
+}
+
 static void vfio_pci_pre_reset(VFIODevice *vdev)
 {
     PCIDevice *pdev = &vdev->pdev;
     uint16_t cmd;
 
+    vfio_pci_reset_wait(vdev);
     vfio_disable_interrupts(vdev);
 
     /* Make sure the device is in D0 */
@@ -2872,24 +4292,124 @@ static void vfio_pci_pre_reset(VFIODevice *vdev)
     vfio_pci_write_config(pdev, PCI_COMMAND, cmd, 2);
 }
 
-static void vfio_pci_post_reset(VFIODevice *vdev)
+static void vfio_pci_post_reset(VFIODevice *vdev)
+{
+    vfio_enable_intx(vdev);
+}
+
+static bool vfio_pci_host_match(PCIHostDeviceAddress *host1,
+                                PCIHostDeviceAddress *host2)
+{
+    return (host1->domain == host2->domain && host1->bus == host2->bus &&
+            host1->slot == host2->slot && host1->function == host2->function);
+}
+
+/*
+ * Call @fn on each in-use device, other than @vdev itself, that is affected
+ * by a hot reset of @vdev.  Stops at the first dependent group we don't own.
+ */
+static void vfio_pci_hot_reset_foreach(VFIODevice *vdev,
+                                       struct vfio_pci_hot_reset_info *info,
+                                       void (*fn)(VFIODevice *))
+{
+    struct vfio_pci_dependent_device *devices = &info->devices[0];
+    VFIOGroup *group;
+    int i;
+
+    for (i = 0; i < info->count; i++) {
+        PCIHostDeviceAddress host;
+        VFIODevice *tmp;
+
+        host.domain = devices[i].segment;
+        host.bus = devices[i].bus;
+        host.slot = PCI_SLOT(devices[i].devfn);
+        host.function = PCI_FUNC(devices[i].devfn);
+
+        if (vfio_pci_host_match(&host, &vdev->host)) {
+            continue;
+        }
+
+        QLIST_FOREACH(group, &group_list, next) {
+            if (group->groupid == devices[i].group_id) {
+                break;
+            }
+        }
+
+        if (!group) {
+            break;
+        }
+
+        QLIST_FOREACH(tmp, &group->device_list, next) {
+            if (vfio_pci_host_match(&host, &tmp->host)) {
+                fn(tmp);
+                break;
+            }
+        }
+    }
+}
+
+static void vfio_pci_reset_begin(VFIODevice *vdev)
+{
+    vdev->reset_pending = true;
+}
+
+static void vfio_pci_reset_end(VFIODevice *vdev)
 {
-    vfio_enable_intx(vdev);
+    vdev->reset_pending = false;
+    vfio_pci_post_reset(vdev);
 }
 
-static bool vfio_pci_host_match(PCIHostDeviceAddress *host1,
-                                PCIHostDeviceAddress *host2)
+typedef struct VFIOHotReset {
+    VFIODevice *vdev;
+    struct vfio_pci_hot_reset_info *info;
+    struct vfio_pci_hot_reset *reset;
+} VFIOHotReset;
+
+/* Runs in a thread pool worker, without the global mutex */
+static int vfio_pci_hot_reset_worker(void *opaque)
 {
-    return (host1->domain == host2->domain && host1->bus == host2->bus &&
-            host1->slot == host2->slot && host1->function == host2->function);
+    VFIOHotReset *hr = opaque;
+
+    if (ioctl(hr->vdev->fd, VFIO_DEVICE_PCI_HOT_RESET, hr->reset)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void vfio_pci_hot_reset_complete(void *opaque, int ret)
+{
+    VFIOHotReset *hr = opaque;
+    VFIODevice *vdev = hr->vdev;
+
+    DPRINTF("%04x:%02x:%02x.%x hot reset: %s\n", vdev->host.domain,
+            vdev->host.bus, vdev->host.slot, vdev->host.function,
+            ret ? strerror(-ret) : "Success");
+
+    vfio_pci_hot_reset_foreach(vdev, hr->info, vfio_pci_reset_end);
+    vfio_pci_reset_end(vdev);
+
+    g_free(hr->reset);
+    g_free(hr->info);
+    g_free(hr);
 }
 
+/*
+ * A bus reset can take hundreds of milliseconds on some devices.  The
+ * multi-device case is only used from the system reset handler, where
+ * nothing depends on the result, so there we issue the ioctl from the
+ * thread pool and let the main loop run meanwhile.  The affected devices
+ * have I/O, memory and bus master disabled by vfio_pci_pre_reset(), so
+ * the guest can only reach them through config space, which waits for
+ * the reset to finish.
+ */
 static int vfio_pci_hot_reset(VFIODevice *vdev, bool single)
 {
     VFIOGroup *group;
     struct vfio_pci_hot_reset_info *info;
     struct vfio_pci_dependent_device *devices;
     struct vfio_pci_hot_reset *reset;
+    VFIOHotReset *hr;
     int32_t *fds;
     int ret, i, count;
     bool multi = false;
@@ -3014,46 +4534,29 @@ static int vfio_pci_hot_reset(VFIODevice *vdev, bool single)
         }
     }
 
+    hr = g_new0(VFIOHotReset, 1);
+    hr->vdev = vdev;
+    hr->info = info;
+    hr->reset = reset;
+
     /* Bus reset! */
-    ret = ioctl(vdev->fd, VFIO_DEVICE_PCI_HOT_RESET, reset);
-    g_free(reset);
+    if (!single) {
+        vfio_pci_hot_reset_foreach(vdev, info, vfio_pci_reset_begin);
+        vfio_pci_reset_begin(vdev);
+        thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                               vfio_pci_hot_reset_worker, hr,
+                               vfio_pci_hot_reset_complete, hr);
+        return 0;
+    }
 
-    DPRINTF("%04x:%02x:%02x.%x hot reset: %s\n", vdev->host.domain,
-            vdev->host.bus, vdev->host.slot, vdev->host.function,
-            ret ? "%m" : "Success");
+    ret = vfio_pci_hot_reset_worker(hr);
+    vfio_pci_hot_reset_complete(hr, ret);
+
+    return ret;
 
 out:
     /* Re-enable INTx on affected devices */
-    for (i = 0; i < info->count; i++) {
-        PCIHostDeviceAddress host;
-        VFIODevice *tmp;
-
-        host.domain = devices[i].segment;
-        host.bus = devices[i].bus;
-        host.slot = PCI_SLOT(devices[i].devfn);
-        host.function = PCI_FUNC(devices[i].devfn);
-
-        if (vfio_pci_host_match(&host, &vdev->host)) {
-            continue;
-        }
-
-        QLIST_FOREACH(group, &group_list, next) {
-            if (group->groupid == devices[i].group_id) {
-                break;
-            }
-        }
-
-        if (!group) {
-            break;
-        }
-
-        QLIST_FOREACH(tmp, &group->device_list, next) {
-            if (vfio_pci_host_match(&host, &tmp->host)) {
-                vfio_pci_post_reset(tmp);
-                break;
-            }
-        }
-    }
+    vfio_pci_hot_reset_foreach(vdev, info, vfio_pci_post_reset);
 out_single:
     vfio_pci_post_reset(vdev);
     g_free(info);
@@ -3116,6 +4619,7 @@ static void vfio_kvm_device_add_group(VFIOGroup *group)
         .attr = KVM_DEV_VFIO_GROUP_ADD,
         .addr = (uint64_t)(unsigned long)&group->fd,
     };
+    VFIOGuestIOMMU *giommu;
 
     if (!kvm_enabled()) {
         return;
@@ -3137,6 +4641,11 @@ static void vfio_kvm_device_add_group(VFIOGroup *group)
     if (ioctl(vfio_kvm_device_fd, KVM_SET_DEVICE_ATTR, &attr)) {
         error_report("Failed to add group %d to KVM VFIO device: %m",
                      group->groupid);
+        return;
+    }
+
+    QLIST_FOREACH(giommu, &group->container->giommu_list, next) {
+        vfio_kvm_device_attach_spapr_tce(group, giommu);
     }
 #endif
 }
@@ -3161,27 +4670,66 @@ static void vfio_kvm_device_del_group(VFIOGroup *group)
 #endif
 }
 
-static int vfio_connect_container(VFIOGroup *group)
+/*
+ * A management application may hand us a container it already opened,
+ * possibly with the group attached and the IOMMU model set, which saves
+ * repeating that setup for each short-lived VM.
+ */
+static bool vfio_group_has_container(VFIOGroup *group)
+{
+    struct vfio_group_status status = { .argsz = sizeof(status) };
+
+    return !ioctl(group->fd, VFIO_GROUP_GET_STATUS, &status) &&
+           (status.flags & VFIO_GROUP_FLAGS_CONTAINER_SET);
+}
+
+static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
+                                  uint32_t map_threads, int fd)
 {
     VFIOContainer *container;
-    int ret, fd;
+    bool attached = false;
+    int iommu_type, ret;
 
     if (group->container) {
         return 0;
     }
 
+    if (fd >= 0) {
+        attached = vfio_group_has_container(group);
+    }
+
     QLIST_FOREACH(container, &container_list, next) {
-        if (!ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &container->fd)) {
+        if (fd >= 0 && container->fd != fd) {
+            continue;
+        }
+        /* A container only provides a single DMA address space */
+        if (container->space != as) {
+            if (fd >= 0) {
+                error_report("vfio: container is used by devices in a "
+                             "different address space");
+                return -EINVAL;
+            }
+            continue;
+        }
+        if (attached ||
+            !ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &container->fd)) {
+            container->map_threads = MAX(container->map_threads, map_threads);
             group->container = container;
             QLIST_INSERT_HEAD(&container->group_list, group, container_next);
             return 0;
         }
+        if (fd >= 0) {
+            error_report("vfio: failed to set group container: %m");
+            return -errno;
+        }
     }
 
-    fd = qemu_open("/dev/vfio/vfio", O_RDWR);
     if (fd < 0) {
-        error_report("vfio: failed to open /dev/vfio/vfio: %m");
-        return -errno;
+        fd = qemu_open("/dev/vfio/vfio", O_RDWR);
+        if (fd < 0) {
+            error_report("vfio: failed to open /dev/vfio/vfio: %m");
+            return -errno;
+        }
     }
 
     ret = ioctl(fd, VFIO_GET_API_VERSION);
@@ -3194,28 +4742,18 @@ static int vfio_connect_container(VFIOGroup *group)
 
     container = g_malloc0(sizeof(*container));
     container->fd = fd;
+    container->space = as;
+    container->map_threads = map_threads;
 
+    /*
+     * The sPAPR TCE model takes the same map and unmap requests as type1,
+     * restricted to the DMA window, which a guest visible IOMMU covering
+     * that window provides.
+     */
     if (ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
-        ret = ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &fd);
-        if (ret) {
-            error_report("vfio: failed to set group container: %m");
-            g_free(container);
-            close(fd);
-            return -errno;
-        }
-
-        ret = ioctl(fd, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU);
-        if (ret) {
-            error_report("vfio: failed to set iommu for container: %m");
-            g_free(container);
-            close(fd);
-            return -errno;
-        }
-
-        container->iommu_data.listener = vfio_memory_listener;
-        container->iommu_data.release = vfio_listener_release;
-
-        memory_listener_register(&container->iommu_data.listener, &address_space_memory);
+        iommu_type = VFIO_TYPE1_IOMMU;
+    } else if (ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_SPAPR_TCE_IOMMU)) {
+        iommu_type = VFIO_SPAPR_TCE_IOMMU;
     } else {
         error_report("vfio: No available IOMMU models");
         g_free(container);
@@ -3223,6 +4761,47 @@ static int vfio_connect_container(VFIOGroup *group)
         return -EINVAL;
     }
 
+    ret = attached ? 0 : ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &fd);
+    if (ret) {
+        error_report("vfio: failed to set group container: %m");
+        g_free(container);
+        close(fd);
+        return -errno;
+    }
+
+    /* A pre-registered container may already have its IOMMU set */
+    ret = ioctl(fd, VFIO_SET_IOMMU, iommu_type);
+    if (ret && !(attached && errno == EBUSY)) {
+        error_report("vfio: failed to set iommu for container: %m");
+        g_free(container);
+        close(fd);
+        return -errno;
+    }
+
+    if (iommu_type == VFIO_SPAPR_TCE_IOMMU &&
+        ioctl(fd, VFIO_IOMMU_ENABLE) && !(attached && errno == EBUSY)) {
+        error_report("vfio: failed to enable container: %m");
+        g_free(container);
+        close(fd);
+        return -errno;
+    }
+
+    container->iommu_data.listener = vfio_memory_listener;
+    container->iommu_data.release = vfio_listener_release;
+    QSIMPLEQ_INIT(&container->pending_unmap);
+    QSIMPLEQ_INIT(&container->pending_map);
+    QLIST_INIT(&container->giommu_list);
+    container->mappings = g_array_new(FALSE, FALSE, sizeof(VFIODMAMapping));
+
+    /*
+     * Registration replays the current memory map through region_add
+     * outside of any memory transaction, bracket it ourselves so the
+     * initial guest RAM mapping is coalesced as well.
+     */
+    vfio_listener_begin(&container->iommu_data.listener);
+    memory_listener_register(&container->iommu_data.listener, as);
+    vfio_listener_commit(&container->iommu_data.listener);
+
     QLIST_INIT(&container->group_list);
     QLIST_INSERT_HEAD(&container_list, container, next);
 
@@ -3251,11 +4830,129 @@ static void vfio_disconnect_container(VFIOGroup *group)
         QLIST_REMOVE(container, next);
         DPRINTF("vfio_disconnect_container: close container->fd\n");
         close(container->fd);
+        if (container->mappings) {
+            g_array_free(container->mappings, TRUE);
+        }
         g_free(container);
     }
 }
 
-static VFIOGroup *vfio_get_group(int groupid)
+VfioContainerInfoList *qmp_query_vfio_containers(Error **errp)
+{
+    VfioContainerInfoList *head = NULL, **tail = &head;
+    VFIOContainer *container;
+    VFIOGroup *group;
+    int id = 0;
+
+    QLIST_FOREACH(container, &container_list, next) {
+        VfioContainerInfoList *entry = g_new0(VfioContainerInfoList, 1);
+        VfioContainerInfo *info = g_new0(VfioContainerInfo, 1);
+        intList **groups = &info->groups;
+
+        info->id = id++;
+        QLIST_FOREACH(group, &container->group_list, container_next) {
+            *groups = g_new0(intList, 1);
+            (*groups)->value = group->groupid;
+            groups = &(*groups)->next;
+        }
+        info->mappings = container->mappings ? container->mappings->len : 0;
+        info->mapped_bytes = container->mapped_bytes;
+        info->pinned_bytes = container->pinned_bytes;
+        info->superpage_bytes = container->superpage_bytes;
+        info->map_calls = atomic_read(&container->map_calls);
+        info->unmap_calls = atomic_read(&container->unmap_calls);
+        info->map_ns = atomic_read(&container->map_ns);
+
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+static VfioDeviceInfo *vfio_query_device(VFIODevice *vdev)
+{
+    static const VfioInterruptMode modes[] = {
+        [VFIO_INT_NONE] = VFIO_INTERRUPT_MODE_NONE,
+        [VFIO_INT_INTx] = VFIO_INTERRUPT_MODE_INTX,
+        [VFIO_INT_MSI] = VFIO_INTERRUPT_MODE_MSI,
+        [VFIO_INT_MSIX] = VFIO_INTERRUPT_MODE_MSIX,
+    };
+    VfioDeviceInfo *info = g_new0(VfioDeviceInfo, 1);
+    VfioBarInfoList **bars = &info->bars;
+    int i;
+
+    if (vdev->pdev.qdev.id) {
+        info->has_id = true;
+        info->id = g_strdup(vdev->pdev.qdev.id);
+    }
+    info->host = g_strdup_printf("%04x:%02x:%02x.%x", vdev->host.domain,
+                                 vdev->host.bus, vdev->host.slot,
+                                 vdev->host.function);
+    info->interrupt = modes[vdev->interrupt];
+
+    info->intx = g_new0(VfioIntxInfo, 1);
+    info->intx->kvm_accel = vdev->intx.kvm_accel;
+    info->intx->user_interrupts = vdev->intx.user_interrupts;
+    info->intx->user_eois = vdev->intx.user_eois;
+
+    info->msi = g_new0(VfioMsiInfo, 1);
+    info->msi->vectors = vdev->nr_vectors;
+    info->msi->user_interrupts = vdev->msi_user_interrupts;
+    for (i = 0; i < vdev->nr_vectors; i++) {
+        if (vdev->msi_vectors[i].use && vdev->msi_vectors[i].irqfd) {
+            info->msi->kvm_vectors++;
+        }
+    }
+
+    for (i = 0; i < PCI_ROM_SLOT; i++) {
+        VFIOBAR *bar = &vdev->bars[i];
+
+        if (!bar->size) {
+            continue;
+        }
+
+        *bars = g_new0(VfioBarInfoList, 1);
+        (*bars)->value = g_new0(VfioBarInfo, 1);
+        (*bars)->value->bar = i;
+        (*bars)->value->mmap = bar->mmap != NULL;
+        (*bars)->value->reads = bar->reads;
+        (*bars)->value->writes = bar->writes;
+        (*bars)->value->read_ns = bar->read_ns;
+        (*bars)->value->write_ns = bar->write_ns;
+        bars = &(*bars)->next;
+    }
+
+    return info;
+}
+
+VfioDeviceInfoList *qmp_query_vfio(Error **errp)
+{
+    VfioDeviceInfoList *head = NULL, **tail = &head;
+    VFIOGroup *group;
+    VFIODevice *vdev;
+
+    QLIST_FOREACH(group, &group_list, next) {
+        QLIST_FOREACH(vdev, &group->device_list, next) {
+            VfioDeviceInfoList *entry = g_new0(VfioDeviceInfoList, 1);
+
+            entry->value = vfio_query_device(vdev);
+            *tail = entry;
+            tail = &entry->next;
+        }
+    }
+
+    return head;
+}
+
+/*
+ * Passed @groupfd and @containerfd, if not -1, are owned by the group from
+ * here on.  They are redundant if another device already set up the group.
+ */
+static VFIOGroup *vfio_get_group(int groupid, AddressSpace *as,
+                                 uint32_t map_threads,
+                                 int groupfd, int containerfd)
 {
     VFIOGroup *group;
     char path[32];
@@ -3263,6 +4960,24 @@ static VFIOGroup *vfio_get_group(int groupid)
 
     QLIST_FOREACH(group, &group_list, next) {
         if (group->groupid == groupid) {
+            /* Only one IOMMU context exists for the devices of a group */
+            if (group->container->space != as) {
+                error_report("vfio: group %d used in multiple address spaces",
+                             groupid);
+                if (groupfd >= 0 && groupfd != group->fd) {
+                    close(groupfd);
+                }
+                if (containerfd >= 0 && containerfd != group->container->fd) {
+                    close(containerfd);
+                }
+                return NULL;
+            }
+            if (groupfd >= 0 && groupfd != group->fd) {
+                close(groupfd);
+            }
+            if (containerfd >= 0 && containerfd != group->container->fd) {
+                close(containerfd);
+            }
             return group;
         }
     }
@@ -3270,33 +4985,32 @@ static VFIOGroup *vfio_get_group(int groupid)
     group = g_malloc0(sizeof(*group));
 
     snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
-    group->fd = qemu_open(path, O_RDWR);
+    group->fd = groupfd >= 0 ? groupfd : qemu_open(path, O_RDWR);
     if (group->fd < 0) {
         error_report("vfio: error opening %s: %m", path);
         g_free(group);
+        if (containerfd >= 0) {
+            close(containerfd);
+        }
         return NULL;
     }
 
     if (ioctl(group->fd, VFIO_GROUP_GET_STATUS, &status)) {
         error_report("vfio: error getting group status: %m");
-        close(group->fd);
-        g_free(group);
-        return NULL;
+        goto close_fds;
     }
 
     if (!(status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
         error_report("vfio: error, group %d is not viable, please ensure "
                      "all devices within the iommu_group are bound to their "
                      "vfio bus driver.", groupid);
-        close(group->fd);
-        g_free(group);
-        return NULL;
+        goto close_fds;
     }
 
     group->groupid = groupid;
     QLIST_INIT(&group->device_list);
 
-    if (vfio_connect_container(group)) {
+    if (vfio_connect_container(group, as, map_threads, containerfd)) {
         error_report("vfio: failed to setup container for group %d", groupid);
         close(group->fd);
         g_free(group);
@@ -3312,6 +5026,14 @@ static VFIOGroup *vfio_get_group(int groupid)
     vfio_kvm_device_add_group(group);
 
     return group;
+
+close_fds:
+    if (containerfd >= 0) {
+        close(containerfd);
+    }
+    close(group->fd);
+    g_free(group);
+    return NULL;
 }
 
 static void vfio_put_group(VFIOGroup *group)
@@ -3603,6 +5325,38 @@ static void vfio_unregister_err_notifier(VFIODevice *vdev)
     event_notifier_cleanup(&vdev->err_notifier);
 }
 
+/*
+ * Fetch pre-opened container and group fds, passed by name with getfd or
+ * by number, e.g. inherited and registered with -add-fd.
+ */
+static int vfio_get_passed_fds(VFIODevice *vdev, int *groupfd,
+                               int *containerfd)
+{
+    *groupfd = *containerfd = -1;
+
+    if (vdev->vfiofd_name && !vdev->vfiogroupfd_name) {
+        error_report("vfio: vfiofd requires vfiogroupfd");
+        return -1;
+    }
+
+    if (vdev->vfiogroupfd_name) {
+        *groupfd = monitor_handle_fd_param(cur_mon, vdev->vfiogroupfd_name);
+        if (*groupfd < 0) {
+            return -1;
+        }
+    }
+
+    if (vdev->vfiofd_name) {
+        *containerfd = monitor_handle_fd_param(cur_mon, vdev->vfiofd_name);
+        if (*containerfd < 0) {
+            close(*groupfd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int vfio_initfn(PCIDevice *pdev)
 {
     VFIODevice *pvdev, *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
@@ -3610,9 +5364,13 @@ static int vfio_initfn(PCIDevice *pdev)
     char path[PATH_MAX], iommu_group_path[PATH_MAX], *group_name;
     ssize_t len;
     struct stat st;
-    int groupid;
+    int groupid, groupfd, containerfd;
     int ret;
 
+    snprintf(vdev->name, sizeof(vdev->name), "%04x:%02x:%02x.%01x",
+             vdev->host.domain, vdev->host.bus, vdev->host.slot,
+             vdev->host.function);
+
     /* Check that the host device exists */
     snprintf(path, sizeof(path),
              "/sys/bus/pci/devices/%04x:%02x:%02x.%01x/",
@@ -3642,7 +5400,12 @@ static int vfio_initfn(PCIDevice *pdev)
     DPRINTF("%s(%04x:%02x:%02x.%x) group %d\n", __func__, vdev->host.domain,
             vdev->host.bus, vdev->host.slot, vdev->host.function, groupid);
 
-    group = vfio_get_group(groupid);
+    if (vfio_get_passed_fds(vdev, &groupfd, &containerfd)) {
+        return -EINVAL;
+    }
+
+    group = vfio_get_group(groupid, pci_device_iommu_address_space(pdev),
+                           vdev->dma_map_threads, groupfd, containerfd);
     if (!group) {
         error_report("vfio: failed to get group %d", groupid);
         return -ENOENT;
@@ -3720,6 +5483,11 @@ static int vfio_initfn(PCIDevice *pdev)
         goto out_teardown;
     }
 
+    ret = vfio_setup_doorbells(vdev);
+    if (ret) {
+        goto out_teardown;
+    }
+
     /* QEMU emulates all of MSI & MSIX */
     if (pdev->cap_present & QEMU_PCI_CAP_MSIX) {
         memset(vdev->emulated_config_bits + pdev->msix_cap, 0xff,
@@ -3743,11 +5511,23 @@ static int vfio_initfn(PCIDevice *pdev)
 
     add_boot_device_path(vdev->bootindex, &pdev->qdev, NULL);
     vfio_register_err_notifier(vdev);
+    vfio_setup_config_shadow(vdev);
+
+    if (vdev->features & VFIO_FEATURE_ENABLE_MIGRATION) {
+        vdev->vm_state = qemu_add_vm_change_state_handler(vfio_vm_change_state,
+                                                          vdev);
+    } else {
+        error_set(&vdev->migration_blocker,
+                  QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+                  "assignment without x-migration", "vfio-pci");
+        migrate_add_blocker(vdev->migration_blocker);
+    }
 
     return 0;
 
 out_teardown:
     pci_device_set_intx_routing_notifier(&vdev->pdev, NULL);
+    vfio_teardown_doorbells(vdev);
     vfio_teardown_msi(vdev);
     vfio_unmap_bars(vdev);
 out_put:
@@ -3762,16 +5542,30 @@ static void vfio_exitfn(PCIDevice *pdev)
     VFIODevice *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
     VFIOGroup *group = vdev->group;
 
+    vfio_pci_reset_wait(vdev);
+    if (vdev->vm_state) {
+        qemu_del_vm_change_state_handler(vdev->vm_state);
+    }
+    if (vdev->migration_blocker) {
+        migrate_del_blocker(vdev->migration_blocker);
+        error_free(vdev->migration_blocker);
+    }
     vfio_unregister_err_notifier(vdev);
     pci_device_set_intx_routing_notifier(&vdev->pdev, NULL);
     vfio_disable_interrupts(vdev);
     if (vdev->intx.mmap_timer) {
         timer_free(vdev->intx.mmap_timer);
     }
+    vfio_teardown_doorbells(vdev);
     vfio_teardown_msi(vdev);
     vfio_unmap_bars(vdev);
     g_free(vdev->emulated_config_bits);
+    g_free(vdev->config_shadow);
+    g_free(vdev->shadow_config_bits);
     g_free(vdev->rom);
+    if (vdev->rom_cache) {
+        munmap(vdev->rom_cache, vdev->rom_cache_size);
+    }
     vfio_put_device(vdev);
     vfio_put_group(group);
 }
@@ -3816,18 +5610,103 @@ static Property vfio_pci_dev_properties[] = {
                        intx.mmap_timeout, 1100),
     DEFINE_PROP_BIT("x-vga", VFIODevice, features,
                     VFIO_FEATURE_ENABLE_VGA_BIT, false),
+    DEFINE_PROP_BIT("x-msix-mmap", VFIODevice, features,
+                    VFIO_FEATURE_ENABLE_MSIX_MMAP_BIT, false),
+    DEFINE_PROP_BIT("x-subpage-bars", VFIODevice, features,
+                    VFIO_FEATURE_ENABLE_SUBPAGE_BIT, false),
+    DEFINE_PROP_BIT("x-migration", VFIODevice, features,
+                    VFIO_FEATURE_ENABLE_MIGRATION_BIT, false),
     DEFINE_PROP_INT32("bootindex", VFIODevice, bootindex, -1),
-    /*
-     * TODO - support passed fds... is this necessary?
-     * DEFINE_PROP_STRING("vfiofd", VFIODevice, vfiofd_name),
-     * DEFINE_PROP_STRING("vfiogroupfd, VFIODevice, vfiogroupfd_name),
-     */
+    DEFINE_PROP_UINT32("x-dma-map-threads", VFIODevice, dma_map_threads, 0),
+    DEFINE_PROP_STRING("x-rom-cache", VFIODevice, rom_cache_dir),
+    DEFINE_PROP_STRING("x-doorbells", VFIODevice, doorbells_str),
+    DEFINE_PROP_STRING("vfiofd", VFIODevice, vfiofd_name),
+    DEFINE_PROP_STRING("vfiogroupfd", VFIODevice, vfiogroupfd_name),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+/*
+ * Migration
+ *
+ * The host kernel has no interface to extract internal device state, so
+ * only what QEMU emulates is transferred: config space and the MSI-X
+ * table.  This is only useful for devices whose state is fully described
+ * by that or whose guest driver recovers from it, hence x-migration is
+ * opt-in and devices without it block migration.
+ */
+static int vfio_set_bus_master(VFIODevice *vdev, bool enable)
+{
+    uint16_t cmd;
+
+    if (pread(vdev->fd, &cmd, 2, vdev->config_offset + PCI_COMMAND) != 2) {
+        return -errno;
+    }
+
+    cmd = le16_to_cpu(cmd);
+    cmd = enable ? cmd | PCI_COMMAND_MASTER : cmd & ~PCI_COMMAND_MASTER;
+    cmd = cpu_to_le16(cmd);
+
+    if (pwrite(vdev->fd, &cmd, 2, vdev->config_offset + PCI_COMMAND) != 2) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop device DMA while the final dirty pages are collected and sent,
+ * without touching the command register state the guest sees and we
+ * migrate.  Restore it if the VM keeps running here.
+ */
+static void vfio_vm_change_state(void *opaque, int running, RunState state)
+{
+    VFIODevice *vdev = opaque;
+
+    if (!running && state == RUN_STATE_FINISH_MIGRATE) {
+        if (pci_get_word(vdev->pdev.config + PCI_COMMAND) &
+            PCI_COMMAND_MASTER) {
+            vdev->dma_stopped = !vfio_set_bus_master(vdev, false);
+        }
+    } else if (running && vdev->dma_stopped) {
+        vfio_set_bus_master(vdev, true);
+        vdev->dma_stopped = false;
+    }
+}
+
+static int vfio_pci_post_load(void *opaque, int version_id)
+{
+    VFIODevice *vdev = opaque;
+    PCIDevice *pdev = &vdev->pdev;
+    uint16_t cmd = cpu_to_le16(pci_get_word(pdev->config + PCI_COMMAND));
+
+    if (pwrite(vdev->fd, &cmd, 2, vdev->config_offset + PCI_COMMAND) != 2) {
+        error_report("vfio: %04x:%02x:%02x.%x failed to restore command "
+                     "register: %m", vdev->host.domain, vdev->host.bus,
+                     vdev->host.slot, vdev->host.function);
+        return -errno;
+    }
+
+    if (msix_enabled(pdev)) {
+        vfio_enable_msix(vdev);
+    } else if (msi_enabled(pdev)) {
+        vfio_enable_msi(vdev);
+    } else {
+        vfio_enable_intx(vdev);
+    }
+
+    return 0;
+}
+
 static const VMStateDescription vfio_pci_vmstate = {
     .name = "vfio-pci",
-    .unmigratable = 1,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = vfio_pci_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(pdev, VFIODevice),
+        VMSTATE_MSIX(pdev, VFIODevice),
+        VMSTATE_END_OF_LIST()
+    }
 };
 
 static void vfio_pci_dev_class_init(ObjectClass *klass, void *data)
@@ -0,0 +1,472 @@
+/*
+ * Dedicated threads for virtio-net queue processing
+ *
+ * Each queue pair is serviced by its own thread that moves packets between
+ * the vrings and the tap file descriptor without going through the net
+ * layer or the main loop.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/virtio-bus.h"
+#include "block/aio.h"
+#include "net/tap.h"
+#include "virtio-net.h"
+
+enum {
+    VRING_IOV_MAX = VIRTQUEUE_MAX_SIZE, /* maximum iovecs per packet */
+    RX_BURST = 256,                 /* packets per tap read handler call */
+};
+
+typedef struct {
+    VirtIONetDataPlane *s;
+    unsigned int index;             /* queue pair index */
+    QemuThread thread;
+    AioContext *ctx;
+
+    NetClientState *peer;           /* tap backend of this queue pair */
+    int tap_fd;
+
+    Vring rx_vring;
+    Vring tx_vring;
+    EventNotifier *rx_guest_notifier; /* irq */
+    EventNotifier *tx_guest_notifier; /* irq */
+
+    /* Note that these EventNotifiers are assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on them
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    EventNotifier rx_host_notifier; /* guest added rx buffers */
+    EventNotifier tx_host_notifier; /* guest queued packets */
+
+    bool rx_polling;                /* reading from tap, rx buffers left */
+    bool tx_blocked;                /* tap queue full, waiting for POLLOUT */
+
+    /* Packet popped from the tx vring but not yet accepted by the tap */
+    int tx_head;
+    unsigned int tx_iov_cnt;
+    struct iovec tx_iov[VRING_IOV_MAX];
+} VirtIONetDataPlaneQueue;
+
+struct VirtIONetDataPlane {
+    bool started;
+    bool stopping;
+    QEMUBH *start_bh;
+
+    VirtIODevice *vdev;
+    NICState *nic;
+    int32_t tx_burst;
+    unsigned int max_queues;        /* queue pairs allocated */
+    unsigned int num_queues;        /* queue pairs in use while started */
+    VirtIONetDataPlaneQueue *queues;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIONetDataPlaneQueue *q, Vring *vring,
+                         EventNotifier *notifier)
+{
+    if (!vring_should_notify(q->s->vdev, vring)) {
+        return;
+    }
+
+    event_notifier_set(notifier);
+}
+
+static void handle_rx(void *opaque);
+static void handle_tx_writable(void *opaque);
+
+static void update_fd_handler(VirtIONetDataPlaneQueue *q)
+{
+    aio_set_fd_handler(q->ctx, q->tap_fd,
+                       q->rx_polling ? handle_rx : NULL,
+                       q->tx_blocked ? handle_tx_writable : NULL,
+                       q);
+}
+
+static void rx_set_polling(VirtIONetDataPlaneQueue *q, bool enable)
+{
+    if (q->rx_polling == enable) {
+        return;
+    }
+    q->rx_polling = enable;
+    update_fd_handler(q);
+}
+
+/* Tap has packets to read */
+static void handle_rx(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+    VirtIODevice *vdev = q->s->vdev;
+    struct iovec iov[VRING_IOV_MAX];
+    unsigned int out_num, in_num;
+    unsigned int npackets = 0;
+    ssize_t len;
+    int head;
+
+    while (npackets < RX_BURST) {
+        head = vring_pop(vdev, &q->rx_vring, iov, &iov[VRING_IOV_MAX],
+                         &out_num, &in_num);
+        if (head == -EAGAIN) {
+            /* Out of rx buffers.  Stop reading from the tap until the guest
+             * adds more, unless it snuck some in meanwhile.
+             */
+            if (vring_enable_notification(vdev, &q->rx_vring)) {
+                rx_set_polling(q, false);
+                break;
+            }
+            vring_disable_notification(vdev, &q->rx_vring);
+            continue;
+        }
+        if (head < 0) {
+            error_report("virtio-net rx vring error %d", head);
+            vring_set_broken(&q->rx_vring);
+            rx_set_polling(q, false);
+            break;
+        }
+
+        /* The tap delivers one packet per read, header included, in the
+         * layout the guest expects since mergeable rx buffers are off.
+         */
+        do {
+            len = readv(q->tap_fd, &iov[out_num], in_num);
+        } while (len < 0 && errno == EINTR);
+        if (len <= 0) {
+            vring_unpop(&q->rx_vring);
+            break;
+        }
+
+        trace_virtio_net_data_plane_rx(q->s, q->index, head, len);
+        vring_push(&q->rx_vring, head, len);
+        npackets++;
+    }
+
+    if (npackets) {
+        notify_guest(q, &q->rx_vring, q->rx_guest_notifier);
+    }
+}
+
+/* Guest added rx buffers */
+static void handle_rx_kick(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              rx_host_notifier);
+
+    event_notifier_test_and_clear(&q->rx_host_notifier);
+
+    /* Further kicks are only needed once the buffers run out again */
+    vring_disable_notification(q->s->vdev, &q->rx_vring);
+    rx_set_polling(q, true);
+}
+
+static void flush_tx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIODevice *vdev = q->s->vdev;
+    unsigned int out_num, in_num;
+    int32_t npackets = 0;
+    ssize_t len;
+    int head;
+
+    if (q->tx_blocked) {
+        return;
+    }
+
+    vring_disable_notification(vdev, &q->tx_vring);
+    while (npackets < q->s->tx_burst) {
+        if (q->tx_head < 0) {
+            head = vring_pop(vdev, &q->tx_vring, q->tx_iov,
+                             &q->tx_iov[VRING_IOV_MAX], &out_num, &in_num);
+            if (head == -EAGAIN) {
+                /* Re-enable guest->host notifies and stop processing the
+                 * vring, unless the guest has snuck in more packets.
+                 */
+                if (vring_enable_notification(vdev, &q->tx_vring)) {
+                    break;
+                }
+                vring_disable_notification(vdev, &q->tx_vring);
+                continue;
+            }
+            if (head < 0) {
+                error_report("virtio-net tx vring error %d", head);
+                vring_set_broken(&q->tx_vring);
+                break;
+            }
+            q->tx_head = head;
+            q->tx_iov_cnt = out_num;
+        }
+
+        /* The virtio_net_hdr goes to the tap as is, vnet_hdr is enabled */
+        do {
+            len = writev(q->tap_fd, q->tx_iov, q->tx_iov_cnt);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0 && errno == EAGAIN) {
+            /* Keep the packet and retry once the tap queue drains */
+            q->tx_blocked = true;
+            update_fd_handler(q);
+            break;
+        }
+
+        /* Other errors drop the packet, like the tap backend does */
+        trace_virtio_net_data_plane_tx(q->s, q->index, q->tx_head, len);
+        vring_push(&q->tx_vring, q->tx_head, 0);
+        q->tx_head = -1;
+        npackets++;
+    }
+
+    if (npackets) {
+        notify_guest(q, &q->tx_vring, q->tx_guest_notifier);
+    }
+
+    /* Give rx a chance before processing the rest of the burst */
+    if (npackets >= q->s->tx_burst) {
+        event_notifier_set(&q->tx_host_notifier);
+    }
+}
+
+/* Guest queued packets */
+static void handle_tx_kick(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              tx_host_notifier);
+
+    event_notifier_test_and_clear(&q->tx_host_notifier);
+    flush_tx(q);
+}
+
+/* Tap queue has room again */
+static void handle_tx_writable(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+
+    q->tx_blocked = false;
+    update_fd_handler(q);
+    flush_tx(q);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+
+    while (!q->s->stopping) {
+        aio_poll(q->ctx, true);
+    }
+    return NULL;
+}
+
+static void start_data_plane_bh(void *opaque)
+{
+    VirtIONetDataPlane *s = opaque;
+    unsigned int i;
+
+    qemu_bh_delete(s->start_bh);
+    s->start_bh = NULL;
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_thread_create(&s->queues[i].thread, data_plane_thread,
+                           &s->queues[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+bool virtio_net_data_plane_create(VirtIODevice *vdev, NICState *nic,
+                                  unsigned int queues,
+                                  VirtIONetDataPlane **dataplane)
+{
+    VirtIONetDataPlane *s;
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(nic, i)->peer;
+
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            error_report("x-data-plane requires a tap backend");
+            return false;
+        }
+        if (!tap_has_vnet_hdr(peer)) {
+            error_report("x-data-plane requires a tap backend "
+                         "with vnet_hdr=on");
+            return false;
+        }
+        if (tap_get_vhost_net(peer)) {
+            error_report("x-data-plane is incompatible with vhost=on");
+            return false;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->vdev = vdev;
+    s->nic = nic;
+    s->tx_burst = VIRTIO_NET(vdev)->tx_burst;
+    s->max_queues = queues;
+    s->queues = g_new0(VirtIONetDataPlaneQueue, queues);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    g_free(s->queues);
+    g_free(s);
+}
+
+bool virtio_net_data_plane_start(VirtIONetDataPlane *s, unsigned int queues)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned int nvqs = queues * 2;
+    VirtIONetDataPlaneQueue *q;
+    VirtQueue *rx_vq, *tx_vq;
+    unsigned int i;
+
+    if (s->started) {
+        return true;
+    }
+
+    assert(queues <= s->max_queues);
+    s->num_queues = queues;
+
+    /* Queue pair i is rx virtqueue 2 * i and tx virtqueue 2 * i + 1 */
+    for (i = 0; i < nvqs; i++) {
+        q = &s->queues[i / 2];
+        if (!vring_setup(i % 2 ? &q->tx_vring : &q->rx_vring, s->vdev, i)) {
+            while (i-- > 0) {
+                q = &s->queues[i / 2];
+                vring_teardown(i % 2 ? &q->tx_vring : &q->rx_vring,
+                               s->vdev, i);
+            }
+            return false;
+        }
+    }
+
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, nvqs, true) != 0) {
+        fprintf(stderr, "virtio-net failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        rx_vq = virtio_get_queue(s->vdev, 2 * i);
+        tx_vq = virtio_get_queue(s->vdev, 2 * i + 1);
+
+        q->s = s;
+        q->index = i;
+        q->ctx = aio_context_new();
+        q->peer = qemu_get_subqueue(s->nic, i)->peer;
+        q->tap_fd = tap_get_fd(q->peer);
+        q->rx_polling = false;
+        q->tx_blocked = false;
+        q->tx_head = -1;
+        q->rx_guest_notifier = virtio_queue_get_guest_notifier(rx_vq);
+        q->tx_guest_notifier = virtio_queue_get_guest_notifier(tx_vq);
+
+        /* The tap is ours now, keep the main loop away from it */
+        q->peer->info->poll(q->peer, false);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, 2 * i, true) != 0 ||
+            k->set_host_notifier(qbus->parent, 2 * i + 1, true) != 0) {
+            fprintf(stderr, "virtio-net failed to set host notifier\n");
+            exit(1);
+        }
+        q->rx_host_notifier = *virtio_queue_get_host_notifier(rx_vq);
+        q->tx_host_notifier = *virtio_queue_get_host_notifier(tx_vq);
+        aio_set_event_notifier(q->ctx, &q->rx_host_notifier, handle_rx_kick);
+        aio_set_event_notifier(q->ctx, &q->tx_host_notifier, handle_tx_kick);
+
+        vring_disable_notification(s->vdev, &q->rx_vring);
+        rx_set_polling(q, true);
+    }
+
+    s->started = true;
+    trace_virtio_net_data_plane_start(s);
+
+    /* Kick right away to send packets already in the tx vrings */
+    for (i = 0; i < s->num_queues; i++) {
+        tx_vq = virtio_get_queue(s->vdev, 2 * i + 1);
+        event_notifier_set(virtio_queue_get_host_notifier(tx_vq));
+    }
+
+    /* Spawn threads in BH so they inherit iothread cpusets */
+    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
+    qemu_bh_schedule(s->start_bh);
+    return true;
+}
+
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONetDataPlaneQueue *q;
+    unsigned int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_net_data_plane_stop(s);
+
+    /* Stop threads or cancel pending thread creation BH */
+    if (s->start_bh) {
+        qemu_bh_delete(s->start_bh);
+        s->start_bh = NULL;
+    } else {
+        for (i = 0; i < s->num_queues; i++) {
+            aio_notify(s->queues[i].ctx);
+        }
+        for (i = 0; i < s->num_queues; i++) {
+            qemu_thread_join(&s->queues[i].thread);
+        }
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+
+        /* Drop a packet the tap never accepted so the guest gets the
+         * descriptor back.
+         */
+        if (q->tx_head >= 0) {
+            vring_push(&q->tx_vring, q->tx_head, 0);
+            q->tx_head = -1;
+        }
+
+        q->rx_polling = false;
+        q->tx_blocked = false;
+        aio_set_fd_handler(q->ctx, q->tap_fd, NULL, NULL, NULL);
+
+        aio_set_event_notifier(q->ctx, &q->rx_host_notifier, NULL);
+        aio_set_event_notifier(q->ctx, &q->tx_host_notifier, NULL);
+        k->set_host_notifier(qbus->parent, 2 * i, false);
+        k->set_host_notifier(qbus->parent, 2 * i + 1, false);
+
+        aio_context_unref(q->ctx);
+
+        q->peer->info->poll(q->peer, true);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues * 2, false);
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        vring_teardown(&q->rx_vring, s->vdev, 2 * i);
+        vring_teardown(&q->tx_vring, s->vdev, 2 * i + 1);
+    }
+    s->started = false;
+    s->stopping = false;
+}
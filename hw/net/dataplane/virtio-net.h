@@ -0,0 +1,24 @@
+/*
+ * Dedicated threads for virtio-net queue processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio.h"
+#include "net/net.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+bool virtio_net_data_plane_create(VirtIODevice *vdev, NICState *nic,
+                                  unsigned int queues,
+                                  VirtIONetDataPlane **dataplane);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+bool virtio_net_data_plane_start(VirtIONetDataPlane *s, unsigned int queues);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
@@ -143,6 +143,13 @@ typedef struct E1000State_st {
     bool mit_irq_level;        /* Tracks interrupt pin level. */
     uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
 
+    /* Delayed RXT0 (RDTR/RADV) and TXDW/TXQE (TIDV/TADV) causes. */
+    struct e1000_delay {
+        QEMUTimer *timer;
+        uint32_t cause;        /* pending causes, 0 if idle */
+        int64_t abs_deadline;  /* absolute timer expiry, in ns */
+    } rx_delay, tx_delay;
+
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
 #define E1000_FLAG_MIT_BIT 1
@@ -169,7 +176,7 @@ enum {
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
     defreg(VET),        defreg(RDTR),   defreg(RADV),   defreg(TADV),
-    defreg(ITR),
+    defreg(ITR),        defreg(TIDV),
 };
 
 static void
@@ -294,28 +301,16 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
          * Here we detect a potential raising edge. We postpone raising the
          * interrupt line if we are inside the mitigation delay window
          * (s->mit_timer_on == 1).
-         * We provide a partial implementation of interrupt mitigation,
-         * emulating only RADV, TADV and ITR (lower 16 bits, 1024ns units for
-         * RADV and TADV, 256ns units for ITR). RDTR is only used to enable
-         * RADV; relative timers based on TIDV and RDTR are not implemented.
+         * ITR (lower 16 bits, 256ns units) is the minimum interval between
+         * two interrupts.  The RDTR/RADV and TIDV/TADV timers have already
+         * delayed the causes themselves, see e1000_delay_cause().
          */
         if (s->mit_timer_on) {
             return;
         }
         if (s->compat_flags & E1000_FLAG_MIT) {
-            /* Compute the next mitigation delay according to pending
-             * interrupts and the current values of RADV (provided
-             * RDTR!=0), TADV and ITR.
-             * Then rearm the timer.
-             */
+            /* Rearm the timer for the next ITR window. */
             mit_delay = 0;
-            if (s->mit_ide &&
-                    (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
-                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
-            }
-            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
-                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
-            }
             mit_update_delay(&mit_delay, s->mac_reg[ITR]);
 
             if (mit_delay) {
@@ -323,7 +318,6 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
                 timer_mod(s->mit_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
                           mit_delay * 256);
             }
-            s->mit_ide = 0;
         }
     }
 
@@ -349,6 +343,53 @@ set_ics(E1000State *s, int index, uint32_t val)
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+/*
+ * Postpone @cause the way the RX and TX delay timers of the hardware do:
+ * the packet timer (@pkt_delay) restarts with every packet, the absolute
+ * timer (@abs_delay, if nonzero) runs from the first packet of the burst.
+ * The cause is posted when either expires.  Both are in 1.024us units.
+ */
+static void
+e1000_delay_cause(struct e1000_delay *dt, uint32_t cause,
+                  uint32_t pkt_delay, uint32_t abs_delay)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (!dt->cause) {
+        dt->abs_deadline = abs_delay ? now + abs_delay * 1024 : INT64_MAX;
+    }
+    dt->cause |= cause;
+    timer_mod(dt->timer, MIN(now + pkt_delay * 1024, dt->abs_deadline));
+}
+
+static void
+e1000_delay_flush(E1000State *s, struct e1000_delay *dt)
+{
+    uint32_t cause = dt->cause;
+
+    if (cause) {
+        dt->cause = 0;
+        timer_del(dt->timer);
+        set_ics(s, 0, cause);
+    }
+}
+
+static void
+e1000_rx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    e1000_delay_flush(s, &s->rx_delay);
+}
+
+static void
+e1000_tx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    e1000_delay_flush(s, &s->tx_delay);
+}
+
 static int
 rxbufsize(uint32_t v)
 {
@@ -383,6 +424,10 @@ static void e1000_reset(void *opaque)
     d->mit_timer_on = 0;
     d->mit_irq_level = 0;
     d->mit_ide = 0;
+    timer_del(d->rx_delay.timer);
+    d->rx_delay.cause = 0;
+    timer_del(d->tx_delay.timer);
+    d->tx_delay.cause = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -791,7 +836,16 @@ start_xmit(E1000State *s)
             break;
         }
     }
-    set_ics(s, 0, cause);
+
+    /* Descriptors with IDE set delay TXDW by TIDV, capped by TADV. */
+    if ((s->compat_flags & E1000_FLAG_MIT) && s->mit_ide &&
+        s->mac_reg[TIDV]) {
+        e1000_delay_cause(&s->tx_delay, cause, s->mac_reg[TIDV],
+                          s->mac_reg[TADV]);
+    } else {
+        set_ics(s, 0, cause);
+    }
+    s->mit_ide = 0;
 }
 
 static int
@@ -1048,7 +1102,15 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    /* RXT0 is delayed by RDTR, capped by RADV; RXDMT0 is not. */
+    if ((s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[RDTR]) {
+        e1000_delay_cause(&s->rx_delay, E1000_ICS_RXT0, s->mac_reg[RDTR],
+                          s->mac_reg[RADV]);
+        n &= ~E1000_ICS_RXT0;
+    }
+    if (n) {
+        set_ics(s, 0, n);
+    }
 
     return size;
 }
@@ -1128,6 +1190,18 @@ set_16bit(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xffff;
 }
 
+/* RDTR and TIDV: writing the FPD bit posts the delayed interrupt now. */
+static void
+set_delay_timer(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & 0xffff;
+    if (index == RDTR && (val & E1000_RDTR_FPD)) {
+        e1000_delay_flush(s, &s->rx_delay);
+    } else if (index == TIDV && (val & E1000_TIDV_FPD)) {
+        e1000_delay_flush(s, &s->tx_delay);
+    }
+}
+
 static void
 set_dlen(E1000State *s, int index, uint32_t val)
 {
@@ -1172,7 +1246,7 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
     getreg(TDLEN),      getreg(RDLEN),  getreg(RDTR),   getreg(RADV),
-    getreg(TADV),       getreg(ITR),
+    getreg(TADV),       getreg(ITR),    getreg(TIDV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1194,8 +1268,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
-    [RDTR] = set_16bit, [RADV] = set_16bit,     [TADV] = set_16bit,
-    [ITR] = set_16bit,
+    [RDTR] = set_delay_timer, [RADV] = set_16bit, [TADV] = set_16bit,
+    [ITR] = set_16bit,  [TIDV] = set_delay_timer,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1234,6 +1308,21 @@ e1000_mmio_read(void *opaque, hwaddr addr, unsigned size)
     return 0;
 }
 
+/* Everything between the registers that have immediate side effects */
+#define E1000_POSTED_BETWEEN(a, b)  { (a) + 4, (b) - (a) - 4 }
+
+static const MemoryRegionPostedRange e1000_posted_writes[] = {
+    { 0, E1000_MDIC },
+    E1000_POSTED_BETWEEN(E1000_MDIC, E1000_ICR),
+    E1000_POSTED_BETWEEN(E1000_ICR, E1000_ICS),
+    E1000_POSTED_BETWEEN(E1000_ICS, E1000_IMS),
+    E1000_POSTED_BETWEEN(E1000_IMS, E1000_IMC),
+    E1000_POSTED_BETWEEN(E1000_IMC, E1000_TCTL),
+    E1000_POSTED_BETWEEN(E1000_TCTL, E1000_TDT),
+    E1000_POSTED_BETWEEN(E1000_TDT, PNPMMIO_SIZE),
+    { /* end of list */ }
+};
+
 static const MemoryRegionOps e1000_mmio_ops = {
     .read = e1000_mmio_read,
     .write = e1000_mmio_write,
@@ -1242,6 +1331,7 @@ static const MemoryRegionOps e1000_mmio_ops = {
         .min_access_size = 4,
         .max_access_size = 4,
     },
+    .posted_writes = e1000_posted_writes,
 };
 
 static uint64_t e1000_io_read(void *opaque, hwaddr addr,
@@ -1277,7 +1367,10 @@ static void e1000_pre_save(void *opaque)
     E1000State *s = opaque;
     NetClientState *nc = qemu_get_queue(s->nic);
 
-    /* If the mitigation timer is active, emulate a timeout now. */
+    /* Post the delayed causes, then emulate a timeout of the mitigation
+     * timer if it is active. */
+    e1000_delay_flush(s, &s->rx_delay);
+    e1000_delay_flush(s, &s->tx_delay);
     if (s->mit_timer_on) {
         e1000_mit_timer(s);
     }
@@ -1305,7 +1398,7 @@ static int e1000_post_load(void *opaque, int version_id)
 
     if (!(s->compat_flags & E1000_FLAG_MIT)) {
         s->mac_reg[ITR] = s->mac_reg[RDTR] = s->mac_reg[RADV] =
-            s->mac_reg[TADV] = 0;
+            s->mac_reg[TADV] = s->mac_reg[TIDV] = 0;
         s->mit_irq_level = false;
     }
     s->mit_ide = 0;
@@ -1352,6 +1445,24 @@ static const VMStateDescription vmstate_e1000_mit_state = {
     }
 };
 
+static bool e1000_tidv_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return (s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[TIDV];
+}
+
+static const VMStateDescription vmstate_e1000_tidv = {
+    .name = "e1000/tidv",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields    = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1434,6 +1545,9 @@ static const VMStateDescription vmstate_e1000 = {
         {
             .vmsd = &vmstate_e1000_mit_state,
             .needed = e1000_mit_state_needed,
+        }, {
+            .vmsd = &vmstate_e1000_tidv,
+            .needed = e1000_tidv_needed,
         }, {
             /* empty */
         }
@@ -1456,18 +1570,8 @@ static const uint16_t e1000_eeprom_template[64] = {
 static void
 e1000_mmio_setup(E1000State *d)
 {
-    int i;
-    const uint32_t excluded_regs[] = {
-        E1000_MDIC, E1000_ICR, E1000_ICS, E1000_IMS,
-        E1000_IMC, E1000_TCTL, E1000_TDT, PNPMMIO_SIZE
-    };
-
     memory_region_init_io(&d->mmio, OBJECT(d), &e1000_mmio_ops, d,
                           "e1000-mmio", PNPMMIO_SIZE);
-    memory_region_add_coalescing(&d->mmio, 0, excluded_regs[0]);
-    for (i = 0; excluded_regs[i] != PNPMMIO_SIZE; i++)
-        memory_region_add_coalescing(&d->mmio, excluded_regs[i] + 4,
-                                     excluded_regs[i+1] - excluded_regs[i] - 4);
     memory_region_init_io(&d->io, OBJECT(d), &e1000_io_ops, d, "e1000-io", IOPORT_SIZE);
 }
 
@@ -1488,6 +1592,10 @@ pci_e1000_uninit(PCIDevice *dev)
     timer_free(d->autoneg_timer);
     timer_del(d->mit_timer);
     timer_free(d->mit_timer);
+    timer_del(d->rx_delay.timer);
+    timer_free(d->rx_delay.timer);
+    timer_del(d->tx_delay.timer);
+    timer_free(d->tx_delay.timer);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_nic(d->nic);
@@ -1545,6 +1653,10 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
     d->mit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_mit_timer, d);
+    d->rx_delay.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_rx_delay_timer, d);
+    d->tx_delay.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_tx_delay_timer, d);
 
     return 0;
 }
@@ -12,9 +12,11 @@
  */
 
 #include "qemu/iov.h"
+#include "qemu/host-utils.h"
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -23,6 +25,10 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
 #include "monitor/monitor.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+# include "dataplane/virtio-net.h"
+# include "migration/migration.h"
+#endif
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -108,11 +114,8 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     if (!nc->peer) {
         return;
     }
-    if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
 
-    if (!tap_get_vhost_net(nc->peer)) {
+    if (!get_vhost_net(nc->peer)) {
         return;
     }
 
@@ -122,7 +125,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(nc->peer), vdev)) {
+        if (!vhost_net_query(get_vhost_net(nc->peer), vdev)) {
             return;
         }
         n->vhost_started = 1;
@@ -138,6 +141,34 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_net_data_plane_status(VirtIONet *n, uint8_t status)
+{
+    NetClientState *nc = qemu_get_queue(n->nic);
+    int queues = n->multiqueue ? n->max_queues : 1;
+
+    if (!n->dataplane) {
+        return;
+    }
+
+    if (!!n->dataplane_started ==
+        (virtio_net_started(n, status) && !nc->peer->link_down)) {
+        return;
+    }
+    if (!n->dataplane_started) {
+        if (!virtio_net_data_plane_start(n->dataplane, queues)) {
+            error_report("unable to start virtio-net dataplane: "
+                         "falling back on userspace virtio");
+            return;
+        }
+        n->dataplane_started = 1;
+    } else {
+        virtio_net_data_plane_stop(n->dataplane);
+        n->dataplane_started = 0;
+    }
+}
+#endif
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -146,6 +177,9 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_net_data_plane_status(n, status);
+#endif
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -160,7 +194,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             continue;
         }
 
-        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+        if (virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !n->dataplane_started) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
@@ -293,6 +328,73 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+/* Longest hash input: two IPv6 addresses and two ports */
+#define VIRTIO_NET_RSS_MAX_INPUT 36
+
+/* The key most hardware and drivers default to */
+static const uint8_t virtio_net_rss_default_key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static bool virtio_net_rss_active(VirtIONet *n)
+{
+    return n->net_conf.rss && n->curr_queues > 1;
+}
+
+/* The 32 bits of the key that start at bit 'bit' */
+static uint32_t virtio_net_rss_key_window(const uint8_t *key, unsigned int bit)
+{
+    uint64_t v = ((uint64_t)ldl_be_p(key + bit / 8) << 8) | key[bit / 8 + 4];
+
+    return v >> (8 - bit % 8);
+}
+
+/* Toeplitz hashing XORs the key window of every set bit of the input.
+ * Precompute the XOR for each value of each input byte, so that hashing
+ * takes one lookup per byte.
+ */
+static void virtio_net_rss_update_lut(VirtIONet *n)
+{
+    uint32_t window[8];
+    unsigned int i, b, v;
+
+    for (i = 0; i < VIRTIO_NET_RSS_MAX_INPUT; i++) {
+        for (b = 0; b < 8; b++) {
+            window[b] = virtio_net_rss_key_window(n->rss.key, i * 8 + b);
+        }
+        n->rss.lut[i][0] = 0;
+        for (v = 1; v < 256; v++) {
+            n->rss.lut[i][v] = n->rss.lut[i][v & (v - 1)] ^
+                               window[7 - ctz32(v)];
+        }
+    }
+}
+
+/* Spread the queue pairs in use evenly over the indirection table */
+static void virtio_net_rss_default_table(VirtIONet *n)
+{
+    int i;
+
+    n->rss.table_mask = VIRTIO_NET_RSS_MAX_TABLE_LEN - 1;
+    for (i = 0; i < VIRTIO_NET_RSS_MAX_TABLE_LEN; i++) {
+        n->rss.table[i] = i % n->curr_queues;
+    }
+}
+
+static void virtio_net_rss_reset(VirtIONet *n)
+{
+    n->rss.configured = false;
+    n->rss.hash_types = VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    n->rss.unclassified_queue = 0;
+    memcpy(n->rss.key, virtio_net_rss_default_key, sizeof(n->rss.key));
+    virtio_net_rss_default_table(n);
+    virtio_net_rss_update_lut(n);
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -316,6 +418,10 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    if (n->net_conf.rss) {
+        virtio_net_rss_reset(n);
+    }
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -353,6 +459,9 @@ static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs)
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].rx_direct_off = false;
+    }
 
     n->guest_hdr_len = n->mergeable_rx_bufs ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
@@ -437,13 +546,20 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+    /* The dataplane reads each packet from the tap straight into one rx
+     * buffer, so it cannot spread packets over mergeable buffers.
+     */
+    if (n->net_conf.data_plane) {
+        features &= ~(0x1 << VIRTIO_NET_F_MRG_RXBUF);
+    }
+
+    if (!nc->peer) {
         return features;
     }
-    if (!tap_get_vhost_net(nc->peer)) {
+    if (!get_vhost_net(nc->peer)) {
         return features;
     }
-    return vhost_net_get_features(tap_get_vhost_net(nc->peer), features);
+    return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -507,13 +623,13 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
-        if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+        if (!nc->peer) {
             continue;
         }
-        if (!tap_get_vhost_net(nc->peer)) {
+        if (!get_vhost_net(nc->peer)) {
             continue;
         }
-        vhost_net_ack_features(tap_get_vhost_net(nc->peer), features);
+        vhost_net_ack_features(get_vhost_net(nc->peer), features);
     }
 }
 
@@ -705,6 +821,74 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_rss(VirtIONet *n,
+                                 struct iovec *iov, unsigned int iov_cnt)
+{
+    struct {
+        uint32_t hash_types;
+        uint16_t table_mask;
+        uint16_t unclassified_queue;
+    } QEMU_PACKED cfg;
+    uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint8_t key_len;
+    uint16_t unclassified_queue;
+    unsigned int i, entries;
+    IOVCursor cur;
+    size_t len;
+
+    if (!n->net_conf.rss || !n->multiqueue) {
+        return VIRTIO_NET_ERR;
+    }
+
+    iov_cursor_init(&cur, iov, iov_cnt);
+    if (iov_cursor_to_buf(&cur, &cfg, sizeof(cfg)) != sizeof(cfg)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    entries = lduw_p(&cfg.table_mask) + 1;
+    if (entries > VIRTIO_NET_RSS_MAX_TABLE_LEN || (entries & (entries - 1))) {
+        return VIRTIO_NET_ERR;
+    }
+    len = entries * sizeof(table[0]);
+    if (iov_cursor_to_buf(&cur, table, len) != len) {
+        return VIRTIO_NET_ERR;
+    }
+    /* skip max_tx_vq too, the queue pairs are set with VQ_PAIRS_SET */
+    iov_cursor_skip(&cur, sizeof(uint16_t));
+
+    if (iov_cursor_to_buf(&cur, &key_len, 1) != 1 ||
+        key_len > sizeof(key)) {
+        return VIRTIO_NET_ERR;
+    }
+    if (iov_cursor_to_buf(&cur, key, key_len) != key_len) {
+        return VIRTIO_NET_ERR;
+    }
+    memset(key + key_len, 0, sizeof(key) - key_len);
+
+    for (i = 0; i < entries; i++) {
+        table[i] = lduw_p(&table[i]);
+        if (table[i] >= n->max_queues) {
+            return VIRTIO_NET_ERR;
+        }
+    }
+    unclassified_queue = lduw_p(&cfg.unclassified_queue);
+    if (unclassified_queue >= n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->rss.configured = true;
+    n->rss.hash_types = ldl_p(&cfg.hash_types) &
+                        VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    n->rss.table_mask = entries - 1;
+    n->rss.unclassified_queue = unclassified_queue;
+    memcpy(n->rss.table, table, len);
+    memcpy(n->rss.key, key, sizeof(key));
+    virtio_net_rss_update_lut(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -713,6 +897,10 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        return virtio_net_handle_rss(n, iov, iov_cnt);
+    }
+
     s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
     if (s != sizeof(mq)) {
         return VIRTIO_NET_ERR;
@@ -732,6 +920,9 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     }
 
     n->curr_queues = queues;
+    if (n->net_conf.rss && !n->rss.configured) {
+        virtio_net_rss_default_table(n);
+    }
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
     virtio_net_set_status(vdev, vdev->status);
@@ -744,20 +935,20 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     size_t s;
     struct iovec *iov;
     unsigned int iov_cnt;
 
-    while (virtqueue_pop(vq, &elem)) {
-        if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
-            iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        iov = elem.out_sg;
-        iov_cnt = elem.out_num;
+        iov = elem->out_sg;
+        iov_cnt = elem->out_num;
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
         if (s != sizeof(ctrl)) {
@@ -774,11 +965,12 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
 
-        s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
+        s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
+        g_free(elem);
     }
 }
 
@@ -788,6 +980,15 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
+
+    if (virtio_net_rss_active(n)) {
+        /* packets waiting for this queue may sit on any of them */
+        for (i = 0; i < n->curr_queues; i++) {
+            qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        return;
+    }
 
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
@@ -802,6 +1003,11 @@ static int virtio_net_can_receive(NetClientState *nc)
         return 0;
     }
 
+    /* The dataplane threads own the rx vrings */
+    if (n->dataplane_started) {
+        return 0;
+    }
+
     if (nc->queue_index >= n->curr_queues) {
         return 0;
     }
@@ -851,20 +1057,26 @@ static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
-static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
-                                        uint8_t *buf, size_t size)
+static bool is_broken_dhclient_packet(const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
         (size > 27 && size < 1500) && /* normal sized MTU */
         (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
         (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+        (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
+static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
+                                        uint8_t *buf, size_t size)
+{
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
 }
 
-static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+static void receive_header(VirtIONet *n, IOVCursor *cur,
                            const void *buf, size_t size)
 {
     if (n->has_vnet_hdr) {
@@ -872,13 +1084,13 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
         void *wbuf = (void *)buf;
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
                                     size - n->host_hdr_len);
-        iov_from_buf(iov, iov_cnt, 0, buf, sizeof(struct virtio_net_hdr));
+        iov_cursor_from_buf(cur, buf, sizeof(struct virtio_net_hdr));
     } else {
         struct virtio_net_hdr hdr = {
             .flags = 0,
             .gso_type = VIRTIO_NET_HDR_GSO_NONE
         };
-        iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof hdr);
+        iov_cursor_from_buf(cur, &hdr, sizeof hdr);
     }
 }
 
@@ -933,15 +1145,124 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+/* Toeplitz hash of the addresses, and the ports if the hash types ask
+ * for them, of an IPv4 or IPv6 packet.  Returns false for packets whose
+ * type is not hashed.
+ */
+static bool virtio_net_rss_hash(VirtIONet *n, const uint8_t *buf,
+                                size_t size, uint32_t *hash)
+{
+    uint8_t input[VIRTIO_NET_RSS_MAX_INPUT];
+    uint32_t types = n->rss.hash_types;
+    uint32_t l3_type, tcp_type, udp_type;
+    size_t l3 = sizeof(struct eth_header), l4, len, i;
+    uint16_t eth_type;
+    uint8_t proto;
+    uint32_t h = 0;
+
+    if (size < l3) {
+        return false;
+    }
+    eth_type = lduw_be_p(&PKT_GET_ETH_HDR(buf)->h_proto);
+    if (eth_type == ETH_P_VLAN) {
+        if (size < l3 + sizeof(struct vlan_header)) {
+            return false;
+        }
+        eth_type = lduw_be_p(&PKT_GET_VLAN_HDR(buf)->h_proto);
+        l3 += sizeof(struct vlan_header);
+    }
+    buf += l3;
+    size -= l3;
+
+    if (eth_type == ETH_P_IP) {
+        const struct ip_header *ip = (const struct ip_header *)buf;
+
+        if (size < sizeof(*ip)) {
+            return false;
+        }
+        l4 = IP_HDR_GET_LEN(buf);
+        if (l4 < sizeof(*ip)) {
+            return false;
+        }
+        memcpy(input, &ip->ip_src, 2 * sizeof(ip->ip_src));
+        len = 2 * sizeof(ip->ip_src);
+        /* only the first fragment has the ports, so that all fragments
+         * land on the same queue hash them by address */
+        proto = (lduw_be_p(&ip->ip_off) & (IP_MF | IP_OFFMASK)) ? 0 : ip->ip_p;
+        l3_type = VIRTIO_NET_RSS_HASH_TYPE_IPv4;
+        tcp_type = VIRTIO_NET_RSS_HASH_TYPE_TCPv4;
+        udp_type = VIRTIO_NET_RSS_HASH_TYPE_UDPv4;
+    } else if (eth_type == ETH_P_IPV6) {
+        const struct ip6_header *ip6 = (const struct ip6_header *)buf;
+
+        if (size < sizeof(*ip6)) {
+            return false;
+        }
+        l4 = sizeof(*ip6);
+        memcpy(input, &ip6->ip6_src, 2 * sizeof(ip6->ip6_src));
+        len = 2 * sizeof(ip6->ip6_src);
+        /* extension headers are not walked */
+        proto = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+        l3_type = VIRTIO_NET_RSS_HASH_TYPE_IPv6;
+        tcp_type = VIRTIO_NET_RSS_HASH_TYPE_TCPv6;
+        udp_type = VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+    } else {
+        return false;
+    }
+
+    if (((proto == IP_PROTO_TCP && (types & tcp_type)) ||
+         (proto == IP_PROTO_UDP && (types & udp_type))) &&
+        size >= l4 + 2 * sizeof(uint16_t)) {
+        memcpy(input + len, buf + l4, 2 * sizeof(uint16_t));
+        len += 2 * sizeof(uint16_t);
+    } else if (!(types & l3_type)) {
+        return false;
+    }
+
+    /* one table lookup per input byte instead of a key shift per bit */
+    for (i = 0; i < len; i++) {
+        h ^= n->rss.lut[i][input[i]];
+    }
+    *hash = h;
+    return true;
+}
+
+/* Subqueue that a packet which arrived on nc is delivered to */
+static NetClientState *virtio_net_rss_steer(VirtIONet *n, NetClientState *nc,
+                                            const uint8_t *buf, size_t size)
+{
+    unsigned int index;
+    uint32_t hash;
+
+    if (!virtio_net_rss_active(n) || size < n->host_hdr_len) {
+        return nc;
+    }
+
+    if (virtio_net_rss_hash(n, buf + n->host_hdr_len, size - n->host_hdr_len,
+                            &hash)) {
+        index = n->rss.table[hash & n->rss.table_mask];
+    } else {
+        index = n->rss.unclassified_queue;
+    }
+
+    if (index >= n->curr_queues) {
+        return nc;
+    }
+    return qemu_get_subqueue(n->nic, index);
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetQueue *q;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
-    size_t offset, i, guest_offset;
+    size_t offset, i;
+
+    nc = virtio_net_rss_steer(n, nc, buf, size);
+    q = virtio_net_get_subqueue(nc);
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
@@ -958,13 +1279,15 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
+        IOVCursor cur;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -975,31 +1298,30 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
+        sg = elem->in_sg;
+        iov_cursor_init(&cur, sg, elem->in_num);
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, &cur, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
-            guest_offset = n->guest_hdr_len;
-        } else {
-            guest_offset = 0;
+            iov_cursor_seek(&cur, n->guest_hdr_len);
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
-                           buf + offset, size - offset);
+        len = iov_cursor_from_buf(&cur, buf + offset, size - offset);
         total += len;
         offset += len;
         /* If buffers can't be merged, at this point we
@@ -1013,11 +1335,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, n->guest_hdr_len, n->host_hdr_len);
 #endif
+            virtqueue_discard(q->rx_vq, elem, total);
+            g_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        g_free(elem);
     }
 
     if (mhdr_cnt) {
@@ -1033,6 +1358,134 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+/* Most buffers a packet can be spread over on the zero-copy path */
+#define VIRTIO_NET_RX_DIRECT_MAX_BUFS 64
+
+static void virtio_net_rx_discard(VirtIONetQueue *q, unsigned int first,
+                                  unsigned int count)
+{
+    while (count-- > first) {
+        virtqueue_discard(q->rx_vq, q->rx_elems[count], 0);
+        g_free(q->rx_elems[count]);
+    }
+}
+
+/* Zero-copy receive: pop enough guest buffers for the largest packet
+ * the peer may send and let it read into them.  This is only done when
+ * the header of the peer is the one the guest expects, so that nothing
+ * needs to be moved around after the read.  Filtered packets are read
+ * again into the same buffers; the dhclient workaround, which needs to
+ * rewrite the packet, goes through a bounce buffer.
+ */
+static ssize_t virtio_net_receive_direct(NetClientState *nc,
+                                         NetReadIOV *read_iov, void *opaque,
+                                         size_t max_size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    uint8_t peek[64];
+    unsigned int max_bufs, nelems, sg_cnt, i;
+    size_t capacity, offset;
+    ssize_t size;
+
+    /* the queue must be known before reading the packet */
+    if (virtio_net_rss_active(n)) {
+        return -1;
+    }
+
+    if (q->rx_direct_off || !n->has_vnet_hdr ||
+        n->host_hdr_len != n->guest_hdr_len ||
+        !virtio_net_can_receive(nc) || !virtio_net_has_buffers(q, max_size)) {
+        return -1;
+    }
+
+    if (!q->rx_elems) {
+        q->rx_elems = g_new(VirtQueueElement *, VIRTIO_NET_RX_DIRECT_MAX_BUFS);
+    }
+    max_bufs = n->mergeable_rx_bufs ? VIRTIO_NET_RX_DIRECT_MAX_BUFS : 1;
+    nelems = sg_cnt = 0;
+    capacity = 0;
+    while (capacity < max_size && nelems < max_bufs) {
+        VirtQueueElement *elem = virtqueue_pop(q->rx_vq,
+                                               sizeof(VirtQueueElement));
+
+        if (!elem) {
+            break;
+        }
+        q->rx_elems[nelems++] = elem;
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            exit(1);
+        }
+        if (sg_cnt + elem->in_num > ARRAY_SIZE(sg)) {
+            break;
+        }
+        memcpy(&sg[sg_cnt], elem->in_sg, elem->in_num * sizeof(sg[0]));
+        sg_cnt += elem->in_num;
+        capacity += iov_size(elem->in_sg, elem->in_num);
+    }
+    if (capacity < max_size) {
+        /* Guests without mergeable buffers post buffers of the same
+         * size, so do not try again until the features change.
+         */
+        if (!n->mergeable_rx_bufs) {
+            q->rx_direct_off = true;
+        }
+        virtio_net_rx_discard(q, 0, nelems);
+        return -1;
+    }
+
+    do {
+        size = read_iov(opaque, sg, sg_cnt);
+        if (size <= 0) {
+            virtio_net_rx_discard(q, 0, nelems);
+            return 0;
+        }
+        memset(peek, 0, sizeof(peek));
+        iov_to_buf(sg, sg_cnt, 0, peek, MIN(size, sizeof(peek)));
+    } while (!receive_filter(n, peek, size));
+
+    if (is_broken_dhclient_packet((struct virtio_net_hdr *)peek,
+                                  peek + n->host_hdr_len,
+                                  size - n->host_hdr_len)) {
+        uint8_t *buf = g_malloc(size);
+
+        iov_to_buf(sg, sg_cnt, 0, buf, size);
+        work_around_broken_dhclient((struct virtio_net_hdr *)buf,
+                                    buf + n->host_hdr_len,
+                                    size - n->host_hdr_len);
+        iov_from_buf(sg, sg_cnt, 0, buf, size);
+        g_free(buf);
+    }
+
+    offset = 0;
+    for (i = 0; i < nelems && offset < size; i++) {
+        VirtQueueElement *elem = q->rx_elems[i];
+        size_t len = MIN(size - offset, iov_size(elem->in_sg, elem->in_num));
+
+        virtqueue_fill(q->rx_vq, elem, len, i);
+        g_free(elem);
+        offset += len;
+    }
+    virtio_net_rx_discard(q, i, nelems);
+
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        stw_p(&num_buffers, i);
+        iov_from_buf(sg, sg_cnt,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    virtqueue_flush(q->rx_vq, i);
+    virtio_notify(vdev, q->rx_vq);
+
+    return size;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1041,21 +1494,33 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    g_free(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
 /* TX */
+/* Publish the used entries of a burst at once, with a single interrupt */
+static void virtio_net_tx_complete_burst(VirtIONetQueue *q,
+                                         int32_t num_packets)
+{
+    if (num_packets) {
+        virtqueue_flush(q->tx_vq, num_packets);
+        virtio_notify(VIRTIO_DEVICE(q->n), q->tx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1064,15 +1529,15 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
     assert(vdev->vm_running);
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.elem) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    while ((elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement)))) {
         ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num = elem->out_num;
+        struct iovec *out_sg = &elem->out_sg[0];
         struct iovec sg[VIRTQUEUE_MAX_SIZE];
 
         if (out_num < 1) {
@@ -1105,21 +1570,41 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
+            virtio_net_tx_complete_burst(q, num_packets);
             return -EBUSY;
         }
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtqueue_fill(q->tx_vq, elem, 0, num_packets);
+        g_free(elem);
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_complete_burst(q, num_packets);
     return num_packets;
 }
 
+/* Follow the rate at which the guest queues packets.  A burst that was
+ * filled means more are probably waiting, so allow a larger one next
+ * time, up to x-txburst.  A burst much shorter than allowed means the
+ * guest slowed down; shrink it so that the bottom half gives the main
+ * loop back sooner.
+ */
+static void virtio_net_tx_adapt_burst(VirtIONetQueue *q, int32_t num_packets)
+{
+    VirtIONet *n = q->n;
+
+    if (num_packets >= q->tx_burst) {
+        q->tx_burst = MIN(q->tx_burst * 2, n->tx_burst);
+    } else if (num_packets < q->tx_burst / 4) {
+        q->tx_burst = MAX(q->tx_burst / 2, MIN(VIRTIO_NET_TX_BURST_MIN,
+                                               n->tx_burst));
+    }
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1184,7 +1669,7 @@ static void virtio_net_tx_bh(void *opaque)
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    int32_t ret;
+    int32_t ret, burst;
 
     assert(vdev->vm_running);
 
@@ -1195,14 +1680,16 @@ static void virtio_net_tx_bh(void *opaque)
         return;
     }
 
+    burst = q->tx_burst;
     ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
+    virtio_net_tx_adapt_burst(q, ret);
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= burst) {
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
@@ -1245,6 +1732,7 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
         }
 
         n->vqs[i].tx_waiting = 0;
+        n->vqs[i].tx_burst = n->tx_burst;
         n->vqs[i].n = n;
     }
 
@@ -1296,6 +1784,17 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     if ((1 << VIRTIO_NET_F_CTRL_GUEST_OFFLOADS) & vdev->guest_features) {
         qemu_put_be64(f, n->curr_guest_offloads);
     }
+
+    if (n->net_conf.rss) {
+        qemu_put_byte(f, n->rss.configured);
+        qemu_put_be32(f, n->rss.hash_types);
+        qemu_put_be16(f, n->rss.table_mask);
+        qemu_put_be16(f, n->rss.unclassified_queue);
+        for (i = 0; i <= n->rss.table_mask; i++) {
+            qemu_put_be16(f, n->rss.table[i]);
+        }
+        qemu_put_buffer(f, n->rss.key, sizeof(n->rss.key));
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -1396,6 +1895,26 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         virtio_net_apply_guest_offloads(n);
     }
 
+    if (n->net_conf.rss) {
+        n->rss.configured = qemu_get_byte(f);
+        n->rss.hash_types = qemu_get_be32(f);
+        n->rss.table_mask = qemu_get_be16(f);
+        n->rss.unclassified_queue = qemu_get_be16(f);
+        if (n->rss.table_mask >= VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            (n->rss.table_mask & (n->rss.table_mask + 1))) {
+            error_report("virtio-net: invalid RSS indirection table size");
+            return -1;
+        }
+        for (i = 0; i <= n->rss.table_mask; i++) {
+            n->rss.table[i] = qemu_get_be16(f);
+        }
+        qemu_get_buffer(f, n->rss.key, sizeof(n->rss.key));
+        if (!n->rss.configured) {
+            virtio_net_rss_default_table(n);
+        }
+        virtio_net_rss_update_lut(n);
+    }
+
     virtio_net_set_queues(n);
 
     /* Find the first multicast entry in the saved MAC filter */
@@ -1428,6 +1947,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_direct = virtio_net_receive_direct,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
@@ -1438,7 +1958,7 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    return vhost_net_virtqueue_pending(tap_get_vhost_net(nc->peer), idx);
+    return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
 
 static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
@@ -1447,7 +1967,7 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    vhost_net_virtqueue_mask(tap_get_vhost_net(nc->peer),
+    vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
 }
 
@@ -1486,6 +2006,38 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+/* Disable dataplane threads during live migration since they do not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet,
+                                migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        if (!n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_status(n, 0);
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_create(vdev, n->nic, n->max_queues,
+                                     &n->dataplane);
+    } else {
+        return;
+    }
+    virtio_net_set_status(vdev, vdev->status);
+}
+#endif /* CONFIG_VIRTIO_BLK_DATA_PLANE */
+
 static int virtio_net_device_init(VirtIODevice *vdev)
 {
     int i;
@@ -1504,6 +2056,11 @@ static int virtio_net_device_init(VirtIODevice *vdev)
     n->vqs[0].n = n;
     n->tx_timeout = n->net_conf.txtimer;
 
+    if (n->net_conf.rss) {
+        n->rss.lut = g_malloc(sizeof(*n->rss.lut) * VIRTIO_NET_RSS_MAX_INPUT);
+        virtio_net_rss_reset(n);
+    }
+
     if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
                        && strcmp(n->net_conf.tx, "bh")) {
         error_report("virtio-net: "
@@ -1552,6 +2109,7 @@ static int virtio_net_device_init(VirtIODevice *vdev)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
+    n->vqs[0].tx_burst = n->tx_burst;
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
@@ -1562,6 +2120,28 @@ static int virtio_net_device_init(VirtIODevice *vdev)
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (n->net_conf.data_plane) {
+        if (!virtio_net_data_plane_create(vdev, n->nic, n->max_queues,
+                                          &n->dataplane)) {
+            if (n->vqs[0].tx_timer) {
+                timer_free(n->vqs[0].tx_timer);
+            } else {
+                qemu_bh_delete(n->vqs[0].tx_bh);
+            }
+            g_free(n->mac_table.macs);
+            g_free(n->vlans);
+            qemu_del_nic(n->nic);
+            g_free(n->vqs);
+            virtio_cleanup(vdev);
+            return -1;
+        }
+        n->migration_state_notifier.notify =
+            virtio_net_migration_state_changed;
+        add_migration_state_change_notifier(&n->migration_state_notifier);
+    }
+#endif
+
     n->qdev = qdev;
     register_savevm(qdev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
@@ -1579,6 +2159,14 @@ static int virtio_net_device_exit(DeviceState *qdev)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (n->net_conf.data_plane) {
+        remove_migration_state_change_notifier(&n->migration_state_notifier);
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    }
+#endif
+
     unregister_savevm(qdev, "virtio-net", n);
 
     if (n->netclient_name) {
@@ -1592,6 +2180,7 @@ static int virtio_net_device_exit(DeviceState *qdev)
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
+    g_free(n->rss.lut);
 
     for (i = 0; i < n->max_queues; i++) {
         VirtIONetQueue *q = &n->vqs[i];
@@ -1605,6 +2194,7 @@ static int virtio_net_device_exit(DeviceState *qdev)
         } else if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
+        g_free(q->rx_elems);
     }
 
     g_free(n->vqs);
@@ -1631,6 +2221,7 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BIT("rss", VirtIONet, net_conf.rss, 0, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
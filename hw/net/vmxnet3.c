@@ -603,6 +603,26 @@ vmxnet3_on_tx_done_update_stats(VMXNET3State *s, int qidx,
     }
 }
 
+/*
+ * A frame the host coalesced comes with a GSO type in its virtio header;
+ * without one, anything longer than the MTU cannot have been received as
+ * a single frame either.
+ */
+static bool
+vmxnet3_rx_pkt_is_lro(VMXNET3State *s, size_t tot_len)
+{
+    if (vmxnet_rx_pkt_has_virt_hdr(s->rx_pkt)) {
+        struct virtio_net_hdr *vhdr = vmxnet_rx_pkt_get_vhdr(s->rx_pkt);
+
+        if ((vhdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) !=
+            VIRTIO_NET_HDR_GSO_NONE) {
+            return true;
+        }
+    }
+
+    return tot_len > s->mtu;
+}
+
 static void
 vmxnet3_on_rx_done_update_stats(VMXNET3State *s,
                                 int qidx,
@@ -637,7 +657,7 @@ vmxnet3_on_rx_done_update_stats(VMXNET3State *s,
             g_assert_not_reached();
         }
 
-        if (tot_len > s->mtu) {
+        if (vmxnet3_rx_pkt_is_lro(s, tot_len)) {
             stats->LROPktsRxOK++;
             stats->LROBytesRxOK += tot_len;
         }
@@ -1290,11 +1310,18 @@ static void vmxnet3_update_features(VMXNET3State *s)
               s->lro_supported, rxcso_supported,
               s->rx_vlan_stripping);
     if (s->peer_has_vhdr) {
+        /*
+         * Let the host hand over coalesced TCP frames, ECN-marked ones
+         * included, so that they reach the guest in one piece instead of
+         * being segmented first.  The tap device only enables TSO together
+         * with checksum offload, and frames it coalesced carry a checksum
+         * the host already verified.
+         */
         tap_set_offload(qemu_get_queue(s->nic)->peer,
-                        rxcso_supported,
+                        rxcso_supported || s->lro_supported,
+                        s->lro_supported,
                         s->lro_supported,
                         s->lro_supported,
-                        0,
                         0);
     }
 }
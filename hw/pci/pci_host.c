@@ -48,6 +48,26 @@ static inline PCIDevice *pci_dev_find_by_addr(PCIBus *bus, uint32_t addr)
     return pci_find_device(bus, bus_num, devfn);
 }
 
+/*
+ * Like pci_find_device() on the root bus of @s, but guests usually access
+ * the registers of one device in a row, so the last device found is
+ * checked first.  Its bus number is read again because the guest can
+ * renumber the buses behind bridges at any time.
+ */
+PCIDevice *pci_host_find_device(PCIHostState *s, uint8_t bus_num,
+                                 uint8_t devfn)
+{
+    PCIDevice *pci_dev = s->config_dev;
+
+    if (pci_dev && pci_dev->devfn == devfn &&
+        pci_bus_num(pci_dev->bus) == bus_num) {
+        return pci_dev;
+    }
+    pci_dev = pci_find_device(s->bus, bus_num, devfn);
+    s->config_dev = pci_dev;
+    return pci_dev;
+}
+
 void pci_host_config_write_common(PCIDevice *pci_dev, uint32_t addr,
                                   uint32_t limit, uint32_t val, uint32_t len)
 {
@@ -70,9 +90,9 @@ uint32_t pci_host_config_read_common(PCIDevice *pci_dev, uint32_t addr,
     return ret;
 }
 
-void pci_data_write(PCIBus *s, uint32_t addr, uint32_t val, int len)
+static void pci_dev_data_write(PCIDevice *pci_dev, uint32_t addr,
+                               uint32_t val, int len)
 {
-    PCIDevice *pci_dev = pci_dev_find_by_addr(s, addr);
     uint32_t config_addr = addr & (PCI_CONFIG_SPACE_SIZE - 1);
 
     if (!pci_dev) {
@@ -85,9 +105,8 @@ void pci_data_write(PCIBus *s, uint32_t addr, uint32_t val, int len)
                                  val, len);
 }
 
-uint32_t pci_data_read(PCIBus *s, uint32_t addr, int len)
+static uint32_t pci_dev_data_read(PCIDevice *pci_dev, uint32_t addr, int len)
 {
-    PCIDevice *pci_dev = pci_dev_find_by_addr(s, addr);
     uint32_t config_addr = addr & (PCI_CONFIG_SPACE_SIZE - 1);
     uint32_t val;
 
@@ -103,6 +122,16 @@ uint32_t pci_data_read(PCIBus *s, uint32_t addr, int len)
     return val;
 }
 
+void pci_data_write(PCIBus *s, uint32_t addr, uint32_t val, int len)
+{
+    pci_dev_data_write(pci_dev_find_by_addr(s, addr), addr, val, len);
+}
+
+uint32_t pci_data_read(PCIBus *s, uint32_t addr, int len)
+{
+    return pci_dev_data_read(pci_dev_find_by_addr(s, addr), addr, len);
+}
+
 static void pci_host_config_write(void *opaque, hwaddr addr,
                                   uint64_t val, unsigned len)
 {
@@ -133,8 +162,11 @@ static void pci_host_data_write(void *opaque, hwaddr addr,
     PCIHostState *s = opaque;
     PCI_DPRINTF("write addr " TARGET_FMT_plx " len %d val %x\n",
                 addr, len, (unsigned)val);
-    if (s->config_reg & (1u << 31))
-        pci_data_write(s->bus, s->config_reg | (addr & 3), val, len);
+    if (s->config_reg & (1u << 31)) {
+        pci_dev_data_write(pci_host_find_device(s, s->config_reg >> 16,
+                                                s->config_reg >> 8),
+                           s->config_reg | (addr & 3), val, len);
+    }
 }
 
 static uint64_t pci_host_data_read(void *opaque,
@@ -144,7 +176,9 @@ static uint64_t pci_host_data_read(void *opaque,
     uint32_t val;
     if (!(s->config_reg & (1 << 31)))
         return 0xffffffff;
-    val = pci_data_read(s->bus, s->config_reg | (addr & 3), len);
+    val = pci_dev_data_read(pci_host_find_device(s, s->config_reg >> 16,
+                                                 s->config_reg >> 8),
+                            s->config_reg | (addr & 3), len);
     PCI_DPRINTF("read addr " TARGET_FMT_plx " len %d val %x\n",
                 addr, len, val);
     return val;
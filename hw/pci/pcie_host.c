@@ -25,19 +25,18 @@
 #include "exec/address-spaces.h"
 
 /* a helper function to get a PCIDevice for a given mmconfig address */
-static inline PCIDevice *pcie_dev_find_by_mmcfg_addr(PCIBus *s,
+static inline PCIDevice *pcie_dev_find_by_mmcfg_addr(PCIExpressHost *e,
                                                      uint32_t mmcfg_addr)
 {
-    return pci_find_device(s, PCIE_MMCFG_BUS(mmcfg_addr),
-                           PCIE_MMCFG_DEVFN(mmcfg_addr));
+    return pci_host_find_device(&e->pci, PCIE_MMCFG_BUS(mmcfg_addr),
+                                PCIE_MMCFG_DEVFN(mmcfg_addr));
 }
 
 static void pcie_mmcfg_data_write(void *opaque, hwaddr mmcfg_addr,
                                   uint64_t val, unsigned len)
 {
     PCIExpressHost *e = opaque;
-    PCIBus *s = e->pci.bus;
-    PCIDevice *pci_dev = pcie_dev_find_by_mmcfg_addr(s, mmcfg_addr);
+    PCIDevice *pci_dev = pcie_dev_find_by_mmcfg_addr(e, mmcfg_addr);
     uint32_t addr;
     uint32_t limit;
 
@@ -59,8 +58,7 @@ static uint64_t pcie_mmcfg_data_read(void *opaque,
                                      unsigned len)
 {
     PCIExpressHost *e = opaque;
-    PCIBus *s = e->pci.bus;
-    PCIDevice *pci_dev = pcie_dev_find_by_mmcfg_addr(s, mmcfg_addr);
+    PCIDevice *pci_dev = pcie_dev_find_by_mmcfg_addr(e, mmcfg_addr);
     uint32_t addr;
     uint32_t limit;
 
@@ -18,6 +18,8 @@
  */
 #include "hw/hw.h"
 #include "sysemu/kvm.h"
+#include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
 #include "hw/qdev.h"
 #include "kvm_ppc.h"
 #include "sysemu/dma.h"
@@ -112,14 +114,71 @@ static const VMStateDescription vmstate_spapr_tce_table = {
     },
 };
 
+/*
+ * Updates of a table owned by KVM are handled in the kernel and never
+ * reach the IOMMU notifiers.  While someone relies on the notifiers, e.g.
+ * VFIO to update the host IOMMU, the table is moved to QEMU, unless the
+ * kernel can update the host IOMMU for the VFIO groups attached to the
+ * table itself.  It moves back into the kernel once the last one is gone.
+ */
+static void spapr_tce_notify_changed(MemoryRegion *iommu, bool notified)
+{
+    sPAPRTCETable *tcet = container_of(iommu, sPAPRTCETable, iommu);
+    size_t table_size = tcet->nb_table * sizeof(uint64_t);
+    bool running = runstate_is_running();
+    uint64_t *table;
+    int fd = -1;
+
+    if (notified) {
+        if (tcet->fd < 0 || kvmppc_has_cap_spapr_vfio()) {
+            return;
+        }
+        table = g_malloc(table_size);
+    } else {
+        if (tcet->fd >= 0 || !kvm_enabled()) {
+            return;
+        }
+        table = kvmppc_create_spapr_tce(tcet->liobn, tcet->window_size, &fd);
+        if (!table) {
+            return;
+        }
+    }
+
+    /* vCPUs in the kernel would keep updating the old table */
+    if (running) {
+        pause_all_vcpus();
+    }
+    memcpy(table, tcet->table, table_size);
+    if (kvmppc_remove_spapr_tce(tcet->table, tcet->fd,
+                                tcet->window_size) != 0) {
+        g_free(tcet->table);
+    }
+    tcet->table = table;
+    tcet->fd = fd;
+    if (running) {
+        resume_all_vcpus();
+    }
+    trace_spapr_iommu_move_table(tcet->liobn, tcet->table, tcet->fd);
+}
+
+static int spapr_tce_get_kvm_fd(MemoryRegion *iommu)
+{
+    sPAPRTCETable *tcet = container_of(iommu, sPAPRTCETable, iommu);
+
+    return tcet->fd;
+}
+
 static MemoryRegionIOMMUOps spapr_iommu_ops = {
     .translate = spapr_tce_translate_iommu,
+    .notify_changed = spapr_tce_notify_changed,
+    .get_kvm_fd = spapr_tce_get_kvm_fd,
 };
 
 static int spapr_tce_table_realize(DeviceState *dev)
 {
     sPAPRTCETable *tcet = SPAPR_TCE_TABLE(dev);
 
+    tcet->fd = -1;
     if (kvm_enabled()) {
         tcet->table = kvmppc_create_spapr_tce(tcet->liobn,
                                               tcet->window_size,
@@ -196,6 +255,22 @@ static void spapr_tce_reset(DeviceState *dev)
     sPAPRTCETable *tcet = SPAPR_TCE_TABLE(dev);
     size_t table_size = (tcet->window_size >> SPAPR_TCE_PAGE_SHIFT)
         * sizeof(uint64_t);
+    IOMMUTLBEntry entry = {
+        .target_as = &address_space_memory,
+        .addr_mask = SPAPR_TCE_PAGE_MASK,
+        .perm = IOMMU_NONE,
+    };
+    uint32_t i;
+
+    /* Let the users of the translations drop the ones that go away */
+    memory_region_iommu_batch_begin(&tcet->iommu);
+    for (i = 0; i < tcet->nb_table; i++) {
+        if (tcet->table[i] & SPAPR_TCE_RW) {
+            entry.iova = (hwaddr)i << SPAPR_TCE_PAGE_SHIFT;
+            memory_region_notify_iommu(&tcet->iommu, entry);
+        }
+    }
+    memory_region_iommu_batch_end(&tcet->iommu);
 
     tcet->bypass = false;
     memset(tcet->table, 0, table_size);
@@ -243,6 +318,73 @@ static target_ulong h_put_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
     return ret;
 }
 
+/*
+ * The multi-TCE hypercalls update up to 512 consecutive entries in one go,
+ * the notifications are batched so that the users of the translations can
+ * apply them as a whole.
+ */
+static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
+                                       sPAPREnvironment *spapr,
+                                       target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    target_ulong tce_list = args[2];
+    target_ulong npages = args[3];
+    target_ulong ret = H_PARAMETER;
+    sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
+    target_ulong i;
+
+    ioba &= ~(SPAPR_TCE_PAGE_SIZE - 1);
+
+    if (!tcet || npages > 512 || (tce_list & SPAPR_TCE_PAGE_MASK)) {
+        return H_PARAMETER;
+    }
+
+    memory_region_iommu_batch_begin(&tcet->iommu);
+    for (i = 0; i < npages; i++, ioba += SPAPR_TCE_PAGE_SIZE) {
+        ret = put_tce_emu(tcet, ioba,
+                          ldq_phys(tce_list + i * sizeof(uint64_t)));
+        if (ret) {
+            break;
+        }
+    }
+    memory_region_iommu_batch_end(&tcet->iommu);
+    trace_spapr_iommu_indirect(liobn, args[1], tce_list, i, ret);
+
+    return ret;
+}
+
+static target_ulong h_stuff_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                                target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    target_ulong tce = args[2];
+    target_ulong npages = args[3];
+    target_ulong ret = H_PARAMETER;
+    sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
+    target_ulong i;
+
+    ioba &= ~(SPAPR_TCE_PAGE_SIZE - 1);
+
+    if (!tcet) {
+        return H_PARAMETER;
+    }
+
+    memory_region_iommu_batch_begin(&tcet->iommu);
+    for (i = 0; i < npages; i++, ioba += SPAPR_TCE_PAGE_SIZE) {
+        ret = put_tce_emu(tcet, ioba, tce);
+        if (ret) {
+            break;
+        }
+    }
+    memory_region_iommu_batch_end(&tcet->iommu);
+    trace_spapr_iommu_stuff(liobn, args[1], tce, i, ret);
+
+    return ret;
+}
+
 int spapr_dma_dt(void *fdt, int node_off, const char *propname,
                  uint32_t liobn, uint64_t window, uint32_t size)
 {
@@ -295,6 +437,10 @@ static void spapr_tce_table_class_init(ObjectClass *klass, void *data)
 
     /* hcall-tce */
     spapr_register_hypercall(H_PUT_TCE, h_put_tce);
+
+    /* hcall-multi-tce */
+    spapr_register_hypercall(H_PUT_TCE_INDIRECT, h_put_tce_indirect);
+    spapr_register_hypercall(H_STUFF_TCE, h_stuff_tce);
 }
 
 static TypeInfo spapr_tce_table_info = {
@@ -115,6 +115,18 @@ void css_conditional_io_interrupt(SubchDev *sch)
     }
 }
 
+/*
+ * Adapter interrupts are not tied to a subchannel and carry no status, the
+ * guest finds out what happened from the indicators it registered.
+ */
+void css_adapter_interrupt(uint8_t isc)
+{
+    S390CPU *cpu = s390_cpu_addr2state(0);
+
+    trace_css_adapter_interrupt(isc);
+    s390_io_interrupt(cpu, 0, 0, 0, (isc << 27) | IO_INT_WORD_AI);
+}
+
 static void sch_handle_clear_func(SubchDev *sch)
 {
     PMCW *p = &sch->curr_status.pmcw;
@@ -20,6 +20,8 @@
 #include "hw/virtio/virtio-net.h"
 #include "hw/sysbus.h"
 #include "qemu/bitops.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
 #include "hw/virtio/virtio-bus.h"
 
 #include "ioinst.h"
@@ -220,6 +222,18 @@ static int virtio_ccw_set_vqs(SubchDev *sch, uint64_t addr, uint32_t align,
     return 0;
 }
 
+/*
+ * Setup for adapter (thin) interrupts.  The device indicators are a bit
+ * string starting at bit ind_bit of device_indicator, in big endian bit
+ * order; the summary indicator is a byte shared with other devices.
+ */
+typedef struct VirtioThinintInfo {
+    hwaddr summary_indicator;
+    hwaddr device_indicator;
+    uint64_t ind_bit;
+    uint8_t isc;
+} QEMU_PACKED VirtioThinintInfo;
+
 static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
 {
     int ret;
@@ -229,6 +243,7 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
     void *config;
     hwaddr indicators;
     VqConfigBlock vq_config;
+    VirtioThinintInfo thinint;
     VirtioCcwDevice *dev = sch->driver_data;
     bool check_len;
     int len;
@@ -421,6 +436,9 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
         }
         if (!ccw.cda) {
             ret = -EFAULT;
+        } else if (dev->thinint_active) {
+            /* Trigger a command reject. */
+            ret = -ENOSYS;
         } else {
             indicators = ldq_phys(ccw.cda);
             dev->indicators = indicators;
@@ -470,6 +488,47 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
             ret = 0;
         }
         break;
+    case CCW_CMD_SET_IND_ADAPTER:
+        if (check_len) {
+            if (ccw.count != sizeof(thinint)) {
+                ret = -EINVAL;
+                break;
+            }
+        } else if (ccw.count < sizeof(thinint)) {
+            /* Can't execute command. */
+            ret = -EINVAL;
+            break;
+        }
+        if (!ccw.cda) {
+            ret = -EFAULT;
+        } else if (dev->indicators && !dev->thinint_active) {
+            /* Classic indicators are already in use, reject the command. */
+            ret = -ENOSYS;
+        } else {
+            thinint.summary_indicator = ldq_phys(ccw.cda);
+            thinint.device_indicator =
+                ldq_phys(ccw.cda + sizeof(thinint.summary_indicator));
+            thinint.ind_bit =
+                ldq_phys(ccw.cda + sizeof(thinint.summary_indicator)
+                         + sizeof(thinint.device_indicator));
+            thinint.isc =
+                ldub_phys(ccw.cda + sizeof(thinint.summary_indicator)
+                          + sizeof(thinint.device_indicator)
+                          + sizeof(thinint.ind_bit));
+            if (thinint.isc > 7 || !thinint.summary_indicator ||
+                !thinint.device_indicator) {
+                ret = -EINVAL;
+                break;
+            }
+            dev->summary_indicator = thinint.summary_indicator;
+            dev->indicators = thinint.device_indicator;
+            dev->ind_bit = thinint.ind_bit;
+            dev->thinint_isc = thinint.isc;
+            dev->thinint_active = true;
+            sch->curr_status.scsw.count = ccw.count - sizeof(thinint);
+            ret = 0;
+        }
+        break;
     default:
         ret = -ENOSYS;
         break;
@@ -722,6 +781,7 @@ static int virtio_ccw_balloon_init(VirtioCcwDevice *ccw_dev)
     VirtIOBalloonCcw *dev = VIRTIO_BALLOON_CCW(ccw_dev);
     DeviceState *vdev = DEVICE(&dev->vdev);
 
+    virtio_balloon_set_host_features(&dev->vdev, ccw_dev->host_features[0]);
     qdev_set_parent_bus(vdev, BUS(&ccw_dev->bus));
     if (qdev_init(vdev) < 0) {
         return -1;
@@ -850,16 +910,55 @@ static inline VirtioCcwDevice *to_virtio_ccw_dev_fast(DeviceState *d)
     return container_of(d, VirtioCcwDevice, parent_obj);
 }
 
+/*
+ * Set bits in an indicator byte that the guest may be clearing at the
+ * same time, and return its previous value.
+ */
+static uint8_t virtio_ccw_set_ind_atomic(VirtioCcwDevice *dev, hwaddr addr,
+                                         uint8_t bits)
+{
+    hwaddr len = 1;
+    uint8_t *ind;
+    uint8_t old;
+
+    ind = cpu_physical_memory_map(addr, &len, 1);
+    if (!ind) {
+        error_report("%s(%x.%x.%04x): unable to access indicator", __func__,
+                     dev->sch->cssid, dev->sch->ssid, dev->sch->schid);
+        return bits;
+    }
+    old = atomic_fetch_or(ind, bits);
+    cpu_physical_memory_unmap(ind, len, 1, len);
+
+    return old;
+}
+
 static void virtio_ccw_notify(DeviceState *d, uint16_t vector)
 {
     VirtioCcwDevice *dev = to_virtio_ccw_dev_fast(d);
     SubchDev *sch = dev->sch;
     uint64_t indicators;
+    uint64_t bit;
 
     if (vector >= 128) {
         return;
     }
 
+    if (vector < VIRTIO_PCI_QUEUE_MAX && dev->thinint_active) {
+        bit = dev->ind_bit + vector;
+        virtio_ccw_set_ind_atomic(dev, dev->indicators + bit / 8,
+                                  0x80 >> (bit % 8));
+        /*
+         * The guest scans all devices behind a summary indicator once it
+         * gets the interrupt, so there is nothing to inject while it has
+         * not yet cleared the summary indicator.
+         */
+        if (!virtio_ccw_set_ind_atomic(dev, dev->summary_indicator, 0x01)) {
+            css_adapter_interrupt(dev->thinint_isc);
+        }
+        return;
+    }
+
     if (vector < VIRTIO_PCI_QUEUE_MAX) {
         if (!dev->indicators) {
             return;
@@ -898,6 +997,10 @@ static void virtio_ccw_reset(DeviceState *d)
     css_reset_sch(dev->sch);
     dev->indicators = 0;
     dev->indicators2 = 0;
+    dev->thinint_active = false;
+    dev->summary_indicator = 0;
+    dev->ind_bit = 0;
+    dev->thinint_isc = 0;
 }
 
 static void virtio_ccw_vmstate_change(DeviceState *d, bool running)
@@ -1002,6 +1105,10 @@ static Property virtio_ccw_net_properties[] = {
     DEFINE_VIRTIO_NET_FEATURES(VirtioCcwDevice, host_features[0]),
     DEFINE_VIRTIO_NET_PROPERTIES(VirtIONetCcw, vdev.net_conf),
     DEFINE_NIC_PROPERTIES(VirtIONetCcw, vdev.nic_conf),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONetCcw, vdev.net_conf.data_plane,
+                    0, false),
+#endif
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
@@ -1034,6 +1141,8 @@ static Property virtio_ccw_blk_properties[] = {
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlkCcw, blk.data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-us", VirtIOBlkCcw, blk.poll_us, 0),
+    DEFINE_PROP_UINT32("x-merge-iov", VirtIOBlkCcw, blk.merge_iov, 0),
 #endif
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1087,7 +1196,7 @@ static const TypeInfo virtio_ccw_serial = {
 
 static Property virtio_ccw_balloon_properties[] = {
     DEFINE_PROP_STRING("devno", VirtioCcwDevice, bus_id),
-    DEFINE_VIRTIO_COMMON_FEATURES(VirtioCcwDevice, host_features[0]),
+    DEFINE_VIRTIO_BALLOON_FEATURES(VirtioCcwDevice, host_features[0]),
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
@@ -1116,6 +1225,10 @@ static Property virtio_ccw_scsi_properties[] = {
     DEFINE_PROP_STRING("devno", VirtioCcwDevice, bus_id),
     DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOSCSICcw, vdev.parent_obj.conf),
     DEFINE_VIRTIO_SCSI_FEATURES(VirtioCcwDevice, host_features[0]),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOSCSICcw,
+                    vdev.parent_obj.conf.data_plane, 0, false),
+#endif
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
@@ -0,0 +1,529 @@
+/*
+ * Dedicated threads for virtio-scsi request queues
+ *
+ * Each request virtqueue is serviced by its own thread that pops requests
+ * from the vring, pushes completed requests back and raises the guest
+ * interrupt, so that the vCPUs and the main loop never touch the rings of
+ * a busy queue.
+ *
+ * The SCSI layer and the block layer behind it still run in the main loop
+ * under the global mutex.  Popped requests are handed to virtio-scsi there
+ * through a per-queue BH; completions are queued back under a per-queue
+ * lock and an EventNotifier wakes the owning thread.
+ *
+ * A device that is assigned to an IOThread runs all of its queues in the
+ * AioContext of that IOThread instead of creating threads.
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-bus.h"
+#include "block/block.h"
+#include "block/aio.h"
+#include "virtio-scsi.h"
+
+enum {
+    VRING_IOV_MAX = VIRTQUEUE_MAX_SIZE, /* maximum iovecs per request */
+};
+
+typedef struct {
+    VirtQueueElement *elem;
+    unsigned int len;
+} VirtIOSCSIDataPlaneDone;
+
+typedef struct {
+    VirtIOSCSIDataPlane *s;
+    unsigned int index;             /* virtqueue index */
+    QemuThread thread;
+    AioContext *ctx;
+    bool exited;                    /* thread has left its loop */
+
+    Vring vring;
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Note that this EventNotifier is assigned by value.  This is fine as
+     * long as you do not call event_notifier_cleanup on it (because you
+     * don't own the file descriptor or handle; you just use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+
+    unsigned int num_reqs;          /* popped and not pushed back yet */
+
+    /* Both rings are protected by lock.  There can be no more requests
+     * in flight than descriptors in the vring, so each ring has room for
+     * vring_get_num() entries.
+     */
+    QemuMutex lock;
+    unsigned int ring_size;
+    VirtQueueElement **submitted;   /* for the main loop */
+    unsigned int submit_head;
+    unsigned int submit_count;
+    VirtIOSCSIDataPlaneDone *completed; /* for the queue thread */
+    unsigned int complete_head;
+    unsigned int complete_count;
+    QEMUBH *submit_bh;
+    EventNotifier complete_notifier;
+} VirtIOSCSIDataPlaneQueue;
+
+struct VirtIOSCSIDataPlane {
+    bool started;
+    bool stopping;
+    QEMUBH *start_bh;
+
+    VirtIODevice *vdev;
+    size_t req_size;                /* allocation size of an element */
+    unsigned int first_vq;          /* virtqueue index of the first queue */
+    unsigned int num_queues;
+    VirtIOSCSIDataPlaneQueue *queues;
+    IOThread *iothread;             /* runs all queues, or NULL */
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOSCSIDataPlaneQueue *q)
+{
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
+        return;
+    }
+
+    event_notifier_set(q->guest_notifier);
+}
+
+static void submit_request(VirtIOSCSIDataPlaneQueue *q, unsigned int head,
+                           struct iovec *iov, hwaddr *addr,
+                           unsigned int out_num, unsigned int in_num)
+{
+    VirtQueueElement *elem;
+    unsigned int i;
+
+    elem = virtqueue_alloc_element(q->s->req_size, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_sg[i] = iov[i];
+        elem->out_addr[i] = addr[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_sg[i] = iov[out_num + i];
+        elem->in_addr[i] = addr[out_num + i];
+    }
+
+    qemu_mutex_lock(&q->lock);
+    assert(q->submit_count < q->ring_size);
+    q->submitted[(q->submit_head + q->submit_count++) % q->ring_size] = elem;
+    qemu_mutex_unlock(&q->lock);
+
+    q->num_reqs++;
+}
+
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(e, VirtIOSCSIDataPlaneQueue,
+                                               host_notifier);
+    VirtIODevice *vdev = q->s->vdev;
+    struct iovec iov[VRING_IOV_MAX];
+    hwaddr addr[VRING_IOV_MAX];
+    unsigned int out_num, in_num;
+    unsigned int num_popped = 0;
+    int head;
+
+    event_notifier_test_and_clear(&q->host_notifier);
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &q->vring);
+
+        for (;;) {
+            head = vring_pop_addr(vdev, &q->vring, iov, &iov[VRING_IOV_MAX],
+                                  addr, &out_num, &in_num);
+            if (head < 0) {
+                break; /* no more requests */
+            }
+
+            trace_virtio_scsi_data_plane_process_request(q->s, q->index,
+                                                         out_num, in_num,
+                                                         head);
+            submit_request(q, head, iov, addr, out_num, in_num);
+            num_popped++;
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(vdev, &q->vring)) {
+                break;
+            }
+        } else {
+            if (head == -ENOBUFS) {
+                error_report("virtio-scsi request has too many descriptors");
+                vring_set_broken(&q->vring);
+            }
+            break;
+        }
+    }
+
+    if (num_popped) {
+        qemu_bh_schedule(q->submit_bh);
+    }
+}
+
+/* Runs in the main loop with the global mutex held */
+static void submit_bh(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+
+    /* virtio-scsi fetches the requests with virtio_scsi_data_plane_pop() */
+    virtio_queue_notify(q->s->vdev, q->index);
+}
+
+static void handle_complete(EventNotifier *e)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(e, VirtIOSCSIDataPlaneQueue,
+                                               complete_notifier);
+    VirtIOSCSIDataPlaneDone done;
+    unsigned int num_pushed = 0;
+
+    event_notifier_test_and_clear(&q->complete_notifier);
+    for (;;) {
+        qemu_mutex_lock(&q->lock);
+        if (!q->complete_count) {
+            qemu_mutex_unlock(&q->lock);
+            break;
+        }
+        done = q->completed[q->complete_head];
+        q->complete_head = (q->complete_head + 1) % q->ring_size;
+        q->complete_count--;
+        qemu_mutex_unlock(&q->lock);
+
+        trace_virtio_scsi_data_plane_complete_request(q->s, q->index,
+                                                      done.elem->index,
+                                                      done.len);
+
+        /* The response header was written through the host mapping */
+        hostmem_set_dirty_iov(&q->vring.hostmem, done.elem->in_sg,
+                              done.elem->in_num);
+        vring_push(&q->vring, done.elem->index, done.len);
+        g_free(done.elem);
+        q->num_reqs--;
+        num_pushed++;
+    }
+
+    if (num_pushed) {
+        notify_guest(q);
+    }
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+
+    while (!q->s->stopping || q->num_reqs > 0) {
+        aio_poll(q->ctx, true);
+    }
+
+    /* virtio_scsi_data_plane_stop() may be waiting in the main loop */
+    atomic_mb_set(&q->exited, true);
+    aio_notify(qemu_get_aio_context());
+    return NULL;
+}
+
+/* Stop the queues of a device that runs in an IOThread.  The caller holds
+ * the AioContext, so the IOThread cannot run handlers meanwhile.  Requests
+ * that the guest adds from now on stay in the vrings for virtio-scsi, those
+ * already in flight are completed here.
+ */
+static void iothread_drain(VirtIOSCSIDataPlane *s)
+{
+    AioContext *ctx = iothread_get_aio_context(s->iothread);
+    unsigned int n, num_reqs;
+
+    for (n = 0; n < s->num_queues; n++) {
+        aio_set_event_notifier(ctx, &s->queues[n].host_notifier, NULL);
+    }
+
+    for (;;) {
+        num_reqs = 0;
+        for (n = 0; n < s->num_queues; n++) {
+            num_reqs += s->queues[n].num_reqs;
+        }
+        if (!num_reqs) {
+            break;
+        }
+        /* Completions may be deferred to bottom halves of the main loop,
+         * which bdrv_drain_all() runs, so do not block here.
+         */
+        bdrv_drain_all();
+        aio_poll(ctx, false);
+    }
+}
+
+static void start_data_plane_bh(void *opaque)
+{
+    VirtIOSCSIDataPlane *s = opaque;
+    unsigned int i;
+
+    qemu_bh_delete(s->start_bh);
+    s->start_bh = NULL;
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_thread_create(&s->queues[i].thread, data_plane_thread,
+                           &s->queues[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Runs in the main loop.  Returns the next request popped by the thread of
+ * virtqueue @n, or NULL.  The request is a buffer of the size passed to
+ * virtio_scsi_data_plane_create(), starting with its VirtQueueElement.
+ */
+void *virtio_scsi_data_plane_pop(VirtIOSCSIDataPlane *s, unsigned int n)
+{
+    VirtIOSCSIDataPlaneQueue *q = &s->queues[n - s->first_vq];
+    VirtQueueElement *elem = NULL;
+
+    qemu_mutex_lock(&q->lock);
+    if (q->submit_count) {
+        elem = q->submitted[q->submit_head];
+        q->submit_head = (q->submit_head + 1) % q->ring_size;
+        q->submit_count--;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return elem;
+}
+
+/* Runs in the main loop.  Hands a request returned by
+ * virtio_scsi_data_plane_pop() back to its queue thread, which adds it to
+ * the used ring and frees it.
+ */
+void virtio_scsi_data_plane_push(VirtIOSCSIDataPlane *s, unsigned int n,
+                                 VirtQueueElement *elem, unsigned int len)
+{
+    VirtIOSCSIDataPlaneQueue *q = &s->queues[n - s->first_vq];
+    VirtIOSCSIDataPlaneDone *done;
+
+    qemu_mutex_lock(&q->lock);
+    assert(q->complete_count < q->ring_size);
+    done = &q->completed[(q->complete_head + q->complete_count++) %
+                         q->ring_size];
+    done->elem = elem;
+    done->len = len;
+    qemu_mutex_unlock(&q->lock);
+
+    event_notifier_set(&q->complete_notifier);
+}
+
+bool virtio_scsi_data_plane_create(VirtIODevice *vdev, unsigned int first_vq,
+                                   unsigned int num_queues, size_t req_size,
+                                   IOThread *iothread,
+                                   VirtIOSCSIDataPlane **dataplane)
+{
+    VirtIOSCSIDataPlane *s;
+
+    *dataplane = NULL;
+
+    s = g_new0(VirtIOSCSIDataPlane, 1);
+    s->vdev = vdev;
+    s->req_size = req_size;
+    s->first_vq = first_vq;
+    s->num_queues = num_queues;
+    s->queues = g_new0(VirtIOSCSIDataPlaneQueue, num_queues);
+    s->iothread = iothread;
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_scsi_data_plane_stop(s);
+    g_free(s->queues);
+    g_free(s);
+}
+
+bool virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOSCSIDataPlaneQueue *q;
+    VirtQueue *vq;
+    unsigned int n;
+
+    if (s->started) {
+        return true;
+    }
+
+    for (n = 0; n < s->num_queues; n++) {
+        if (!vring_setup(&s->queues[n].vring, s->vdev, s->first_vq + n)) {
+            goto fail_vring;
+        }
+    }
+
+    /* Set up guest notifiers (irq).  The control and event queues stay in
+     * the main loop, but they come first, so they get notifiers too.
+     */
+    if (k->set_guest_notifiers(qbus->parent, s->first_vq + s->num_queues,
+                               true) != 0) {
+        error_report("virtio-scsi failed to set guest notifier, "
+                     "ensure -enable-kvm is set");
+        goto fail_vring;
+    }
+
+    if (s->iothread) {
+        /* The IOThread is running, keep it out while handlers are added */
+        aio_context_acquire(iothread_get_aio_context(s->iothread));
+    }
+
+    for (n = 0; n < s->num_queues; n++) {
+        q = &s->queues[n];
+        vq = virtio_get_queue(s->vdev, s->first_vq + n);
+        q->s = s;
+        q->index = s->first_vq + n;
+        q->num_reqs = 0;
+        q->exited = false;
+        if (s->iothread) {
+            q->ctx = iothread_get_aio_context(s->iothread);
+            aio_context_ref(q->ctx);
+        } else {
+            q->ctx = aio_context_new();
+        }
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+        /* Set up the request and completion rings */
+        qemu_mutex_init(&q->lock);
+        q->ring_size = vring_get_num(&q->vring);
+        q->submitted = g_new(VirtQueueElement *, q->ring_size);
+        q->submit_head = q->submit_count = 0;
+        q->completed = g_new(VirtIOSCSIDataPlaneDone, q->ring_size);
+        q->complete_head = q->complete_count = 0;
+        q->submit_bh = qemu_bh_new(submit_bh, q);
+        if (event_notifier_init(&q->complete_notifier, 0) != 0) {
+            fprintf(stderr, "virtio-scsi failed to create notifier\n");
+            exit(1);
+        }
+        aio_set_event_notifier(q->ctx, &q->complete_notifier,
+                               handle_complete);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, q->index, true) != 0) {
+            fprintf(stderr, "virtio-scsi failed to set host notifier\n");
+            exit(1);
+        }
+        q->host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify);
+    }
+
+    if (s->iothread) {
+        aio_context_release(iothread_get_aio_context(s->iothread));
+    }
+
+    s->started = true;
+    trace_virtio_scsi_data_plane_start(s);
+
+    /* Kick right away to begin processing requests already in vrings */
+    for (n = 0; n < s->num_queues; n++) {
+        vq = virtio_get_queue(s->vdev, s->first_vq + n);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+
+    if (s->iothread) {
+        return true;
+    }
+
+    /* Spawn threads in BH so they inherit iothread cpusets */
+    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
+    qemu_bh_schedule(s->start_bh);
+    return true;
+
+fail_vring:
+    while (n-- > 0) {
+        vring_teardown(&s->queues[n].vring, s->vdev, s->first_vq + n);
+    }
+    return false;
+}
+
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOSCSIDataPlaneQueue *q;
+    unsigned int n;
+    bool exited;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_scsi_data_plane_stop(s);
+
+    /* Stop threads or cancel pending thread creation BH */
+    if (s->iothread) {
+        aio_context_acquire(iothread_get_aio_context(s->iothread));
+        iothread_drain(s);
+    } else if (s->start_bh) {
+        qemu_bh_delete(s->start_bh);
+        s->start_bh = NULL;
+    } else {
+        for (n = 0; n < s->num_queues; n++) {
+            aio_notify(s->queues[n].ctx);
+        }
+
+        /* Threads only finish once their in-flight requests complete, which
+         * happens in the main loop.
+         */
+        for (;;) {
+            exited = true;
+            for (n = 0; n < s->num_queues; n++) {
+                exited &= atomic_mb_read(&s->queues[n].exited);
+            }
+            if (exited) {
+                break;
+            }
+            bdrv_drain_all();
+            aio_poll(qemu_get_aio_context(), true);
+        }
+
+        for (n = 0; n < s->num_queues; n++) {
+            qemu_thread_join(&s->queues[n].thread);
+        }
+    }
+
+    for (n = 0; n < s->num_queues; n++) {
+        q = &s->queues[n];
+
+        aio_set_event_notifier(q->ctx, &q->complete_notifier, NULL);
+        event_notifier_cleanup(&q->complete_notifier);
+        qemu_bh_delete(q->submit_bh);
+        q->submit_bh = NULL;
+        g_free(q->submitted);
+        g_free(q->completed);
+        qemu_mutex_destroy(&q->lock);
+
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL);
+        k->set_host_notifier(qbus->parent, q->index, false);
+
+        aio_context_unref(q->ctx);
+    }
+
+    if (s->iothread) {
+        aio_context_release(iothread_get_aio_context(s->iothread));
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->first_vq + s->num_queues, false);
+
+    for (n = 0; n < s->num_queues; n++) {
+        vring_teardown(&s->queues[n].vring, s->vdev, s->first_vq + n);
+    }
+    s->started = false;
+    s->stopping = false;
+}
@@ -0,0 +1,30 @@
+/*
+ * Dedicated threads for virtio-scsi request queues
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_SCSI_H
+#define HW_DATAPLANE_VIRTIO_SCSI_H
+
+#include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
+
+typedef struct VirtIOSCSIDataPlane VirtIOSCSIDataPlane;
+
+bool virtio_scsi_data_plane_create(VirtIODevice *vdev, unsigned int first_vq,
+                                   unsigned int num_queues, size_t req_size,
+                                   IOThread *iothread,
+                                   VirtIOSCSIDataPlane **dataplane);
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s);
+bool virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s);
+void *virtio_scsi_data_plane_pop(VirtIOSCSIDataPlane *s, unsigned int n);
+void virtio_scsi_data_plane_push(VirtIOSCSIDataPlane *s, unsigned int n,
+                                 VirtQueueElement *elem, unsigned int len);
+
+#endif /* HW_DATAPLANE_VIRTIO_SCSI_H */
@@ -105,6 +105,7 @@ typedef struct MegasasState {
     int reply_queue_tail;
     uint64_t consumer_pa;
     uint64_t producer_pa;
+    QEMUBH *complete_bh;
 
     MegasasCmd frames[MEGASAS_MAX_FRAMES];
 
@@ -499,9 +500,30 @@ static MegasasCmd *megasas_enqueue_frame(MegasasState *s,
     return cmd;
 }
 
-static void megasas_complete_frame(MegasasState *s, uint64_t context)
+/*
+ * Raise the completion interrupt once for all the frames that were put
+ * on the reply queue since the bottom half was scheduled, so that the
+ * guest finds a whole batch of replies when it runs its handler.
+ */
+static void megasas_complete_bh(void *opaque)
 {
+    MegasasState *s = opaque;
     PCIDevice *pci_dev = PCI_DEVICE(s);
+
+    if (!s->doorbell || !megasas_intr_enabled(s)) {
+        return;
+    }
+    if (msix_enabled(pci_dev)) {
+        trace_megasas_msix_raise(0);
+        msix_notify(pci_dev, 0);
+    } else {
+        trace_megasas_irq_raise();
+        pci_irq_assert(pci_dev);
+    }
+}
+
+static void megasas_complete_frame(MegasasState *s, uint64_t context)
+{
     int tail, queue_offset;
 
     /* Decrement busy count */
@@ -530,13 +552,7 @@ static void megasas_complete_frame(MegasasState *s, uint64_t context)
         /* Notify HBA */
         s->doorbell++;
         if (s->doorbell == 1) {
-            if (msix_enabled(pci_dev)) {
-                trace_megasas_msix_raise(0);
-                msix_notify(pci_dev, 0);
-            } else {
-                trace_megasas_irq_raise();
-                pci_irq_assert(pci_dev);
-            }
+            qemu_bh_schedule(s->complete_bh);
         }
     } else {
         trace_megasas_qf_complete_noirq(context);
@@ -2055,11 +2071,23 @@ static void megasas_scsi_reset(DeviceState *dev)
     megasas_soft_reset(s);
 }
 
+static int megasas_post_load(void *opaque, int version_id)
+{
+    MegasasState *s = opaque;
+
+    /* The interrupt may still have been pending in the bottom half */
+    if (s->doorbell) {
+        qemu_bh_schedule(s->complete_bh);
+    }
+    return 0;
+}
+
 static const VMStateDescription vmstate_megasas = {
     .name = "megasas",
     .version_id = 0,
     .minimum_version_id = 0,
     .minimum_version_id_old = 0,
+    .post_load = megasas_post_load,
     .fields      = (VMStateField[]) {
         VMSTATE_PCI_DEVICE(parent_obj, MegasasState),
 
@@ -2077,6 +2105,7 @@ static void megasas_scsi_uninit(PCIDevice *d)
 {
     MegasasState *s = MEGASAS(d);
 
+    qemu_bh_delete(s->complete_bh);
 #ifdef USE_MSIX
     msix_uninit(d, &s->mmio_io);
 #endif
@@ -2164,6 +2193,7 @@ static int megasas_scsi_init(PCIDevice *dev)
         MAX_SCSI_DEVS : MFI_MAX_LD;
     s->producer_pa = 0;
     s->consumer_pa = 0;
+    s->complete_bh = qemu_bh_new(megasas_complete_bh, s);
     for (i = 0; i < s->fw_cmds; i++) {
         s->frames[i].index = i;
         s->frames[i].context = -1;
@@ -1119,6 +1119,7 @@ static void scsi_cmd_xfer_mode(SCSICommand *cmd)
     case WRITE_SAME_10:
     case WRITE_SAME_16:
     case UNMAP:
+    case EXTENDED_COPY:
     case SEARCH_HIGH_12:
     case SEARCH_EQUAL_12:
     case SEARCH_LOW_12:
@@ -1472,6 +1473,7 @@ static const char *scsi_command_name(uint8_t cmd)
         [ PERSISTENT_RESERVE_OUT   ] = "PERSISTENT_RESERVE_OUT",
         [ WRITE_FILEMARKS_16       ] = "WRITE_FILEMARKS_16",
         [ EXTENDED_COPY            ] = "EXTENDED_COPY",
+        [ RECEIVE_COPY_RESULTS     ] = "RECEIVE_COPY_RESULTS",
         [ ATA_PASSTHROUGH_16       ] = "ATA_PASSTHROUGH_16",
         [ ACCESS_CONTROL_IN        ] = "ACCESS_CONTROL_IN",
         [ ACCESS_CONTROL_OUT       ] = "ACCESS_CONTROL_OUT",
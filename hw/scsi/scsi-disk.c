@@ -30,6 +30,7 @@ do { printf("scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "hw/scsi/scsi.h"
 #include "block/scsi.h"
 #include "sysemu/sysemu.h"
@@ -44,6 +45,18 @@ do { printf("scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 #define SCSI_DMA_BUF_SIZE           131072
 #define SCSI_MAX_INQUIRY_LEN        256
 #define SCSI_MAX_MODE_LEN           256
+#define SCSI_WRITE_SAME_MAX         524288
+#define SCSI_WRITE_ZEROES_MAX       (1 << 21)   /* in 512 byte sectors */
+
+#define SCSI_XCOPY_BUF_SIZE         1048576
+#define SCSI_XCOPY_MAX_TARGETS      32
+#define SCSI_XCOPY_MAX_SEGMENTS     256
+#define SCSI_XCOPY_HDR_LEN          16
+#define SCSI_XCOPY_CSCD_LEN         32
+#define SCSI_XCOPY_SEG_LEN          28
+#define SCSI_XCOPY_MAX_LIST_LEN \
+    (SCSI_XCOPY_HDR_LEN + SCSI_XCOPY_MAX_TARGETS * SCSI_XCOPY_CSCD_LEN + \
+     SCSI_XCOPY_MAX_SEGMENTS * SCSI_XCOPY_SEG_LEN)
 
 #define DEFAULT_DISCARD_GRANULARITY 4096
 
@@ -534,6 +547,38 @@ static uint8_t *scsi_get_buf(SCSIRequest *req)
     return (uint8_t *)r->iov.iov_base;
 }
 
+/* Fill in the designation descriptors of the device identification
+ * VPD page.  EXTENDED COPY uses them to recognize this logical unit.
+ */
+static int scsi_disk_emulate_designators(SCSIDiskState *s, uint8_t *outbuf)
+{
+    const char *str = s->serial ?: bdrv_get_device_name(s->qdev.conf.bs);
+    int max_len = s->serial ? 20 : 255 - 8;
+    int id_len = strlen(str);
+    int buflen = 0;
+
+    if (id_len > max_len) {
+        id_len = max_len;
+    }
+
+    outbuf[buflen++] = 0x2; // ASCII
+    outbuf[buflen++] = 0;   // not officially assigned
+    outbuf[buflen++] = 0;   // reserved
+    outbuf[buflen++] = id_len; // length of data following
+    memcpy(outbuf+buflen, str, id_len);
+    buflen += id_len;
+
+    if (s->wwn) {
+        outbuf[buflen++] = 0x1; // Binary
+        outbuf[buflen++] = 0x3; // NAA
+        outbuf[buflen++] = 0;   // reserved
+        outbuf[buflen++] = 8;
+        stq_be_p(&outbuf[buflen], s->wwn);
+        buflen += 8;
+    }
+    return buflen;
+}
+
 static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, req->dev);
@@ -589,31 +634,9 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
 
         case 0x83: /* Device identification page, mandatory */
         {
-            const char *str = s->serial ?: bdrv_get_device_name(s->qdev.conf.bs);
-            int max_len = s->serial ? 20 : 255 - 8;
-            int id_len = strlen(str);
-
-            if (id_len > max_len) {
-                id_len = max_len;
-            }
             DPRINTF("Inquiry EVPD[Device identification] "
                     "buffer size %zd\n", req->cmd.xfer);
-
-            outbuf[buflen++] = 0x2; // ASCII
-            outbuf[buflen++] = 0;   // not officially assigned
-            outbuf[buflen++] = 0;   // reserved
-            outbuf[buflen++] = id_len; // length of data following
-            memcpy(outbuf+buflen, str, id_len);
-            buflen += id_len;
-
-            if (s->wwn) {
-                outbuf[buflen++] = 0x1; // Binary
-                outbuf[buflen++] = 0x3; // NAA
-                outbuf[buflen++] = 0;   // reserved
-                outbuf[buflen++] = 8;
-                stq_be_p(&outbuf[buflen], s->wwn);
-                buflen += 8;
-            }
+            buflen += scsi_disk_emulate_designators(s, outbuf + buflen);
             break;
         }
         case 0xb0: /* block limits */
@@ -696,6 +719,9 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
      */
     outbuf[2] = 5;
     outbuf[3] = 2 | 0x10; /* Format 2, HiSup */
+    if (s->qdev.type == TYPE_DISK) {
+        outbuf[5] = 0x08; /* 3PC, EXTENDED COPY is supported */
+    }
 
     if (buflen > 36) {
         outbuf[4] = buflen - 5; /* Additional Length = (Len - 1) - 4 */
@@ -1574,6 +1600,344 @@ invalid_param_len:
     scsi_check_condition(r, SENSE_CODE(INVALID_PARAM_LEN));
 }
 
+typedef struct WriteSameCBData {
+    SCSIDiskReq *r;
+    int64_t sector;
+    uint64_t nb_sectors;
+    int chunk;
+    bool zero;
+    BdrvRequestFlags flags;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} WriteSameCBData;
+
+static void scsi_write_same_complete(void *opaque, int ret);
+
+static void scsi_write_same_submit(WriteSameCBData *data)
+{
+    SCSIDiskReq *r = data->r;
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    BlockDriverState *bs = s->qdev.conf.bs;
+
+    if (data->zero) {
+        data->chunk = MIN(data->nb_sectors, SCSI_WRITE_ZEROES_MAX);
+        bdrv_acct_start(bs, &r->acct, data->chunk * BDRV_SECTOR_SIZE,
+                        BDRV_ACCT_WRITE);
+        r->req.aiocb = bdrv_aio_write_zeroes(bs, data->sector, data->chunk,
+                                             data->flags,
+                                             scsi_write_same_complete, data);
+        return;
+    }
+
+    /* The pattern buffer is written over and over, only the tail of the
+     * range may need a shorter request.
+     */
+    data->chunk = MIN(data->nb_sectors, data->iov.iov_len / BDRV_SECTOR_SIZE);
+    data->iov.iov_len = data->chunk * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&data->qiov, &data->iov, 1);
+    bdrv_acct_start(bs, &r->acct, data->iov.iov_len, BDRV_ACCT_WRITE);
+    r->req.aiocb = bdrv_aio_writev(bs, data->sector, &data->qiov, data->chunk,
+                                   scsi_write_same_complete, data);
+}
+
+static void scsi_write_same_complete(void *opaque, int ret)
+{
+    WriteSameCBData *data = opaque;
+    SCSIDiskReq *r = data->r;
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+
+    assert(r->req.aiocb != NULL);
+    r->req.aiocb = NULL;
+    bdrv_acct_done(s->qdev.conf.bs, &r->acct);
+    if (r->req.io_canceled) {
+        goto done;
+    }
+
+    if (ret < 0) {
+        if (scsi_handle_rw_error(r, -ret)) {
+            goto done;
+        }
+    }
+
+    data->sector += data->chunk;
+    data->nb_sectors -= data->chunk;
+    if (data->nb_sectors) {
+        scsi_write_same_submit(data);
+        return;
+    }
+
+    scsi_req_complete(&r->req, GOOD);
+
+done:
+    if (!r->req.io_canceled) {
+        scsi_req_unref(&r->req);
+    }
+    qemu_vfree(data->iov.iov_base);
+    g_free(data);
+}
+
+static void scsi_disk_emulate_write_same(SCSIDiskReq *r, uint8_t *inbuf)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    uint64_t nb_blocks = scsi_data_cdb_length(r->req.cmd.buf);
+    WriteSameCBData *data;
+    uint8_t *buf;
+    int i;
+
+    /* Zero blocks means up to the end of the medium */
+    if (nb_blocks == 0) {
+        nb_blocks = s->qdev.max_lba + 1 - r->req.cmd.lba;
+    }
+    if (nb_blocks == 0) {
+        scsi_req_complete(&r->req, GOOD);
+        return;
+    }
+
+    data = g_new0(WriteSameCBData, 1);
+    data->r = r;
+    data->sector = r->req.cmd.lba * (s->qdev.blocksize / 512);
+    data->nb_sectors = nb_blocks * (s->qdev.blocksize / 512);
+
+    if (buffer_is_zero(inbuf, s->qdev.blocksize)) {
+        /* With the unmap bit set, zeroing may deallocate the blocks */
+        data->zero = true;
+        data->flags = (r->req.cmd.buf[1] & 0x8) ? BDRV_REQ_MAY_UNMAP : 0;
+    } else {
+        data->iov.iov_len = MIN(data->nb_sectors * BDRV_SECTOR_SIZE,
+                                SCSI_WRITE_SAME_MAX);
+        buf = qemu_blockalign(s->qdev.conf.bs, data->iov.iov_len);
+        for (i = 0; i < data->iov.iov_len; i += s->qdev.blocksize) {
+            memcpy(&buf[i], inbuf, s->qdev.blocksize);
+        }
+        data->iov.iov_base = buf;
+    }
+
+    /* The matching unref is in scsi_write_same_complete, before data is
+     * freed.
+     */
+    scsi_req_ref(&r->req);
+    scsi_write_same_submit(data);
+}
+
+typedef struct XCopyCBData {
+    SCSIDiskReq *r;
+    uint8_t *seg;
+    int count;
+    /* The current segment, in 512 byte sectors.  A copy that goes
+     * backwards proceeds from the end of the segment.
+     */
+    uint64_t src;
+    uint64_t dst;
+    uint32_t nb_sectors;
+    uint32_t offset;
+    uint32_t chunk;
+    bool backwards;
+    bool reading;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} XCopyCBData;
+
+static void scsi_xcopy_load_segment(XCopyCBData *data)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, data->r->req.dev);
+    uint8_t *seg = data->seg;
+
+    data->src = ldq_be_p(&seg[12]) * (s->qdev.blocksize / 512);
+    data->dst = ldq_be_p(&seg[20]) * (s->qdev.blocksize / 512);
+    data->nb_sectors = lduw_be_p(&seg[10]) * (s->qdev.blocksize / 512);
+    data->offset = 0;
+
+    /* Do not overwrite the source before it is read */
+    data->backwards = data->dst > data->src &&
+                      data->dst < data->src + data->nb_sectors;
+
+    data->seg += SCSI_XCOPY_SEG_LEN;
+    data->count--;
+}
+
+static void scsi_xcopy_complete(void *opaque, int ret)
+{
+    XCopyCBData *data = opaque;
+    SCSIDiskReq *r = data->r;
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    BlockDriverState *bs = s->qdev.conf.bs;
+
+    r->req.aiocb = NULL;
+    if (r->req.io_canceled) {
+        goto done;
+    }
+
+    if (ret < 0) {
+        if (scsi_handle_rw_error(r, -ret)) {
+            goto done;
+        }
+    }
+
+    if (data->reading) {
+        data->reading = false;
+        r->req.aiocb = bdrv_aio_writev(bs, data->dst + data->offset,
+                                       &data->qiov, data->chunk,
+                                       scsi_xcopy_complete, data);
+        return;
+    }
+
+    data->nb_sectors -= data->chunk;
+    if (!data->backwards) {
+        data->offset += data->chunk;
+    }
+    while (data->nb_sectors == 0) {
+        if (data->count == 0) {
+            scsi_req_complete(&r->req, GOOD);
+            goto done;
+        }
+        scsi_xcopy_load_segment(data);
+    }
+
+    data->chunk = MIN(data->nb_sectors,
+                      SCSI_XCOPY_BUF_SIZE / BDRV_SECTOR_SIZE);
+    if (data->backwards) {
+        data->offset = data->nb_sectors - data->chunk;
+    }
+    data->iov.iov_len = data->chunk * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&data->qiov, &data->iov, 1);
+    data->reading = true;
+    r->req.aiocb = bdrv_aio_readv(bs, data->src + data->offset,
+                                  &data->qiov, data->chunk,
+                                  scsi_xcopy_complete, data);
+    return;
+
+done:
+    if (!r->req.io_canceled) {
+        scsi_req_unref(&r->req);
+    }
+    qemu_vfree(data->iov.iov_base);
+    g_free(data);
+}
+
+/* Look for the designation descriptor of a CSCD descriptor among the
+ * ones in the device identification page of this logical unit.
+ */
+static bool scsi_disk_xcopy_is_self(SCSIDiskState *s, const uint8_t *desc)
+{
+    uint8_t ids[SCSI_MAX_INQUIRY_LEN + 16];
+    int len = scsi_disk_emulate_designators(s, ids);
+    int i;
+
+    /* The descriptor has room for a 20 byte designator */
+    if (desc[3] > 20) {
+        return false;
+    }
+    for (i = 0; i < len; i += 4 + ids[i + 3]) {
+        if ((desc[0] & 0x0f) == ids[i] &&
+            (desc[1] & 0x3f) == ids[i + 1] &&
+            desc[3] == ids[i + 3] &&
+            !memcmp(&desc[4], &ids[i + 4], ids[i + 3])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Only the LID1 parameter list format with block to block segments is
+ * supported, and all CSCD descriptors must name this logical unit.  The
+ * whole list is checked before anything is copied.
+ */
+static void scsi_disk_emulate_extended_copy(SCSIDiskReq *r, uint8_t *inbuf)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    uint8_t *p = inbuf;
+    int len = r->req.cmd.xfer;
+    uint32_t cscd_len, seg_len, inline_len;
+    int ncscd, nseg, i;
+    uint8_t *cscd, *seg;
+    XCopyCBData *data;
+
+    if (len < SCSI_XCOPY_HDR_LEN) {
+        goto invalid_param_len;
+    }
+    cscd_len = lduw_be_p(&p[2]);
+    seg_len = ldl_be_p(&p[8]);
+    inline_len = ldl_be_p(&p[12]);
+    if ((uint64_t)SCSI_XCOPY_HDR_LEN + cscd_len + seg_len + inline_len >
+        len) {
+        goto invalid_param_len;
+    }
+    if (cscd_len % SCSI_XCOPY_CSCD_LEN || seg_len % SCSI_XCOPY_SEG_LEN) {
+        goto invalid_param;
+    }
+    ncscd = cscd_len / SCSI_XCOPY_CSCD_LEN;
+    nseg = seg_len / SCSI_XCOPY_SEG_LEN;
+    if (ncscd > SCSI_XCOPY_MAX_TARGETS || nseg > SCSI_XCOPY_MAX_SEGMENTS) {
+        goto invalid_param;
+    }
+
+    /* Identification descriptors of block devices */
+    cscd = &p[SCSI_XCOPY_HDR_LEN];
+    for (i = 0; i < ncscd; i++, cscd += SCSI_XCOPY_CSCD_LEN) {
+        if (cscd[0] != 0xe4 || (cscd[1] & 0x1f) != TYPE_DISK ||
+            (ldl_be_p(&cscd[28]) & 0xffffff) != s->qdev.blocksize ||
+            !scsi_disk_xcopy_is_self(s, &cscd[4])) {
+            goto invalid_param;
+        }
+    }
+
+    /* Block device to block device segments */
+    seg = cscd;
+    for (i = 0; i < nseg; i++, seg += SCSI_XCOPY_SEG_LEN) {
+        uint32_t nb_blocks = lduw_be_p(&seg[10]);
+
+        if (seg[0] != 0x02 ||
+            lduw_be_p(&seg[2]) != SCSI_XCOPY_SEG_LEN - 4 ||
+            lduw_be_p(&seg[4]) >= ncscd || lduw_be_p(&seg[6]) >= ncscd) {
+            goto invalid_param;
+        }
+        if (!check_lba_range(s, ldq_be_p(&seg[12]), nb_blocks) ||
+            !check_lba_range(s, ldq_be_p(&seg[20]), nb_blocks)) {
+            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
+            return;
+        }
+    }
+
+    data = g_new0(XCopyCBData, 1);
+    data->r = r;
+    data->seg = cscd;
+    data->count = nseg;
+    data->iov.iov_base = qemu_blockalign(s->qdev.conf.bs,
+                                         SCSI_XCOPY_BUF_SIZE);
+
+    /* The matching unref is in scsi_xcopy_complete, before data is freed.  */
+    scsi_req_ref(&r->req);
+    scsi_xcopy_complete(data, 0);
+    return;
+
+invalid_param_len:
+    scsi_check_condition(r, SENSE_CODE(INVALID_PARAM_LEN));
+    return;
+
+invalid_param:
+    scsi_check_condition(r, SENSE_CODE(INVALID_PARAM));
+}
+
+static int scsi_disk_emulate_copy_params(SCSIDiskState *s, uint8_t *outbuf)
+{
+    int buflen = 45;
+
+    stl_be_p(&outbuf[0], buflen - 4);
+    outbuf[4] = 1;      /* SNLID, list identifiers are not tracked */
+    stw_be_p(&outbuf[8], SCSI_XCOPY_MAX_TARGETS);
+    stw_be_p(&outbuf[10], SCSI_XCOPY_MAX_SEGMENTS);
+    stl_be_p(&outbuf[12], SCSI_XCOPY_MAX_LIST_LEN);
+    stl_be_p(&outbuf[16], 0xffff * s->qdev.blocksize);
+    stw_be_p(&outbuf[36], 1);   /* total concurrent copies */
+    outbuf[38] = 1;             /* maximum concurrent copies */
+    outbuf[39] = ctz32(s->qdev.blocksize);
+    outbuf[42] = 2;             /* implemented descriptor codes */
+    outbuf[43] = 0x02;          /* block device to block device */
+    outbuf[44] = 0xe4;          /* identification descriptor */
+    return buflen;
+}
+
 static void scsi_disk_emulate_write_data(SCSIRequest *req)
 {
     SCSIDiskReq *r = DO_UPCAST(SCSIDiskReq, req, req);
@@ -1597,6 +1961,15 @@ static void scsi_disk_emulate_write_data(SCSIRequest *req)
         scsi_disk_emulate_unmap(r, r->iov.iov_base);
         break;
 
+    case WRITE_SAME_10:
+    case WRITE_SAME_16:
+        scsi_disk_emulate_write_same(r, r->iov.iov_base);
+        break;
+
+    case EXTENDED_COPY:
+        scsi_disk_emulate_extended_copy(r, r->iov.iov_base);
+        break;
+
     default:
         abort();
     }
@@ -1849,19 +2222,33 @@ static int32_t scsi_disk_emulate_command(SCSIRequest *req, uint8_t *buf)
         }
 
         /*
-         * We only support WRITE SAME with the unmap bit set for now.
+         * ANCHOR, NDOB and the obsolete PBDATA and LBDATA bits are not
+         * supported.  The data is written in scsi_disk_emulate_write_same.
          */
-        if (!(req->cmd.buf[1] & 0x8)) {
+        if (req->cmd.buf[1] & 0x17) {
             goto illegal_request;
         }
-
-        /* The request is used as the AIO opaque value, so add a ref.  */
-        scsi_req_ref(&r->req);
-        r->req.aiocb = bdrv_aio_discard(s->qdev.conf.bs,
-                                        r->req.cmd.lba * (s->qdev.blocksize / 512),
-                                        nb_sectors * (s->qdev.blocksize / 512),
-                                        scsi_aio_complete, r);
-        return 0;
+        DPRINTF("Write same (len %lu)\n", (long)r->req.cmd.xfer);
+        break;
+    case EXTENDED_COPY:
+        DPRINTF("Extended copy (len %lu)\n", (long)r->req.cmd.xfer);
+        if (s->qdev.type != TYPE_DISK ||
+            (req->cmd.buf[1] & 0x1f) != XCOPY_LID1) {
+            goto illegal_request;
+        }
+        if (bdrv_is_read_only(s->qdev.conf.bs)) {
+            scsi_check_condition(r, SENSE_CODE(WRITE_PROTECTED));
+            return 0;
+        }
+        break;
+    case RECEIVE_COPY_RESULTS:
+        if (s->qdev.type != TYPE_DISK ||
+            (req->cmd.buf[1] & 0x1f) != RCR_OPERATING_PARAMETERS) {
+            goto illegal_request;
+        }
+        DPRINTF("Receive copy results[Operating parameters]\n");
+        buflen = scsi_disk_emulate_copy_params(s, outbuf);
+        break;
     default:
         DPRINTF("Unknown SCSI command (%2.2x)\n", buf[0]);
         scsi_check_condition(r, SENSE_CODE(INVALID_OPCODE));
@@ -2207,6 +2594,8 @@ static const SCSIReqOps *const scsi_disk_reqops_dispatch[256] = {
     [UNMAP]                           = &scsi_disk_emulate_reqops,
     [WRITE_SAME_10]                   = &scsi_disk_emulate_reqops,
     [WRITE_SAME_16]                   = &scsi_disk_emulate_reqops,
+    [EXTENDED_COPY]                   = &scsi_disk_emulate_reqops,
+    [RECEIVE_COPY_RESULTS]            = &scsi_disk_emulate_reqops,
 
     [READ_6]                          = &scsi_disk_dma_reqops,
     [READ_10]                         = &scsi_disk_dma_reqops,
@@ -116,6 +116,10 @@ err_notifiers:
     return ret;
 }
 
+/* Clearing the endpoint makes the kernel wait for the commands that are
+ * in flight, so that the used rings are complete and vhost_dev_stop reads
+ * back a last_avail_idx that accounts for every request the guest sees.
+ */
 static void vhost_scsi_stop(VHostSCSI *s)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
@@ -174,7 +178,7 @@ static void vhost_scsi_set_config(VirtIODevice *vdev,
 static void vhost_scsi_set_status(VirtIODevice *vdev, uint8_t val)
 {
     VHostSCSI *s = (VHostSCSI *)vdev;
-    bool start = (val & VIRTIO_CONFIG_S_DRIVER_OK);
+    bool start = (val & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running;
 
     if (s->dev.started == start) {
         return;
@@ -196,6 +200,26 @@ static void vhost_scsi_set_status(VirtIODevice *vdev, uint8_t val)
     }
 }
 
+/* The rings and their indices are all there is to save: the backend is
+ * stopped, and thus drained, before the device state is saved, and the
+ * requests the guest made available since are picked up by the kernel on
+ * the destination.  Guest memory written by the backend is tracked with
+ * the vhost dirty log.
+ */
+static void vhost_scsi_save(QEMUFile *f, void *opaque)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(opaque);
+
+    virtio_save(vdev, f);
+}
+
+static int vhost_scsi_load(QEMUFile *f, void *opaque, int version_id)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(opaque);
+
+    return virtio_load(vdev, f);
+}
+
 static int vhost_scsi_init(VirtIODevice *vdev)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(vdev);
@@ -233,9 +257,23 @@ static int vhost_scsi_init(VirtIODevice *vdev)
     }
     s->dev.backend_features = 0;
 
-    error_setg(&s->migration_blocker,
-            "vhost-scsi does not support migration");
-    migrate_add_blocker(s->migration_blocker);
+    /* Dirty logging covers the rings, but only the target knows whether
+     * it logs the data it writes to guest buffers, so let the user opt in.
+     */
+    if (!vs->conf.migratable) {
+        error_setg(&s->migration_blocker,
+                   "vhost-scsi does not support migration without "
+                   "migratable=on");
+    } else if (!(s->dev.features & (1ULL << VHOST_F_LOG_ALL))) {
+        error_setg(&s->migration_blocker,
+                   "vhost-scsi backend does not support dirty logging");
+    }
+    if (s->migration_blocker) {
+        migrate_add_blocker(s->migration_blocker);
+    }
+
+    register_savevm(DEVICE(vdev), "vhost-scsi", -1, 1,
+                    vhost_scsi_save, vhost_scsi_load, s);
 
     return 0;
 }
@@ -246,8 +284,11 @@ static int vhost_scsi_exit(DeviceState *qdev)
     VHostSCSI *s = VHOST_SCSI(qdev);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(qdev);
 
-    migrate_del_blocker(s->migration_blocker);
-    error_free(s->migration_blocker);
+    if (s->migration_blocker) {
+        migrate_del_blocker(s->migration_blocker);
+        error_free(s->migration_blocker);
+    }
+    unregister_savevm(qdev, "vhost-scsi", s);
 
     /* This will stop vhost backend. */
     vhost_scsi_set_status(vdev, 0);
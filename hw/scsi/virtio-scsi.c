@@ -18,11 +18,15 @@
 #include <hw/scsi/scsi.h>
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+# include "dataplane/virtio-scsi.h"
+#endif
 
 typedef struct VirtIOSCSIReq {
+    VirtQueueElement elem;
     VirtIOSCSI *dev;
     VirtQueue *vq;
-    VirtQueueElement elem;
+    bool dataplane;     /* popped by a dataplane thread */
     QEMUSGList qsgl;
     SCSIRequest *sreq;
     union {
@@ -56,19 +60,75 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
+static inline bool virtio_scsi_is_cmd_vq(VirtIOSCSI *s, VirtQueue *vq)
+{
+    VirtIOSCSICommon *vs = &s->parent_obj;
+
+    return vq != vs->ctrl_vq && vq != vs->event_vq;
+}
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_scsi_data_plane_status(VirtIOSCSI *s, uint8_t status)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    bool start = (status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running;
+
+    if (!s->dataplane || s->dataplane_started == start) {
+        return;
+    }
+    if (start) {
+        /* Requests taken from the command queues here, or loaded by
+         * migration, have to be pushed back before the threads own the
+         * rings.  The last completion tries again.
+         */
+        if (s->cmd_inflight) {
+            return;
+        }
+        if (!virtio_scsi_data_plane_start(s->dataplane)) {
+            error_report("unable to start virtio-scsi dataplane: "
+                         "falling back on userspace virtio");
+            return;
+        }
+        s->dataplane_started = true;
+    } else {
+        virtio_scsi_data_plane_stop(s->dataplane);
+        s->dataplane_started = false;
+    }
+}
+#endif
+
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
+    unsigned int len = req->qsgl.size + req->elem.in_sg[0].iov_len;
+
     qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (req->dataplane) {
+        /* The queue thread pushes the request and frees it */
+        virtio_scsi_data_plane_push(s->dataplane, virtio_queue_get_id(vq),
+                                    &req->elem, len);
+        return;
+    }
+#endif
+    virtqueue_push(vq, &req->elem, len);
     g_free(req);
     virtio_notify(vdev, vq);
+
+    if (virtio_scsi_is_cmd_vq(s, vq)) {
+        s->cmd_inflight--;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+        if (!s->cmd_inflight) {
+            virtio_scsi_data_plane_status(s, vdev->status);
+        }
+#endif
+    }
 }
 
 static void virtio_scsi_bad_req(void)
@@ -94,6 +154,7 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
     assert(req->elem.in_num);
     req->vq = vq;
     req->dev = s;
+    req->dataplane = false;
     req->sreq = NULL;
     if (req->elem.out_num) {
         req->req.buf = req->elem.out_sg[0].iov_base;
@@ -113,14 +174,31 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
 
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
+    bool cmd = virtio_scsi_is_cmd_vq(s, vq);
     VirtIOSCSIReq *req;
-    req = g_malloc(sizeof(*req));
-    if (!virtqueue_pop(vq, &req->elem)) {
-        g_free(req);
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (cmd && s->dataplane_started) {
+        req = virtio_scsi_data_plane_pop(s->dataplane,
+                                         virtio_queue_get_id(vq));
+        if (!req) {
+            return NULL;
+        }
+        virtio_scsi_parse_req(s, vq, req);
+        req->dataplane = true;
+        return req;
+    }
+#endif
+
+    req = virtqueue_pop(vq, sizeof(VirtIOSCSIReq));
+    if (!req) {
         return NULL;
     }
 
     virtio_scsi_parse_req(s, vq, req);
+    if (cmd) {
+        s->cmd_inflight++;
+    }
     return req;
 }
 
@@ -132,7 +210,7 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < vs->conf.num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    qemu_put_virtqueue_element(f, &req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -143,11 +221,11 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
     VirtIOSCSIReq *req;
     uint32_t n;
 
-    req = g_malloc(sizeof(*req));
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
-    qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    req = qemu_get_virtqueue_element(f, sizeof(VirtIOSCSIReq));
     virtio_scsi_parse_req(s, vs->cmd_vqs[n], req);
+    s->cmd_inflight++;
 
     scsi_req_ref(sreq);
     req->sreq = sreq;
@@ -347,6 +425,29 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
+/*
+ * Plugs the backend of @d unless it already is, so that the requests of one
+ * notification are submitted to the host together.
+ */
+static void virtio_scsi_io_plug(SCSIDevice *d, BlockDriverState **plugged,
+                                int *nplugged)
+{
+    int i;
+
+    if (!d->conf.bs) {
+        return;
+    }
+    for (i = 0; i < *nplugged; i++) {
+        if (plugged[i] == d->conf.bs) {
+            return;
+        }
+    }
+    if (*nplugged < VIRTIO_SCSI_VQ_SIZE) {
+        bdrv_io_plug(d->conf.bs);
+        plugged[(*nplugged)++] = d->conf.bs;
+    }
+}
+
 static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     /* use non-QOM casts in the data path */
@@ -354,7 +455,8 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOSCSICommon *vs = &s->parent_obj;
 
     VirtIOSCSIReq *req;
-    int n;
+    BlockDriverState *plugged[VIRTIO_SCSI_VQ_SIZE];
+    int n, i, nplugged = 0;
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
         SCSIDevice *d;
@@ -397,11 +499,16 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
             }
         }
 
+        virtio_scsi_io_plug(d, plugged, &nplugged);
         n = scsi_req_enqueue(req->sreq);
         if (n) {
             scsi_req_continue(req->sreq);
         }
     }
+
+    for (i = 0; i < nplugged; i++) {
+        bdrv_io_unplug(plugged[i]);
+    }
 }
 
 static void virtio_scsi_get_config(VirtIODevice *vdev,
@@ -438,6 +545,13 @@ static void virtio_scsi_set_config(VirtIODevice *vdev,
     vs->cdb_size = ldl_raw(&scsiconf->cdb_size);
 }
 
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_scsi_data_plane_status(VIRTIO_SCSI(vdev), status);
+#endif
+}
+
 static uint32_t virtio_scsi_get_features(VirtIODevice *vdev,
                                          uint32_t requested_features)
 {
@@ -630,6 +744,16 @@ static int virtio_scsi_device_init(VirtIODevice *vdev)
     scsi_bus_new(&s->bus, sizeof(s->bus), qdev,
                  &virtio_scsi_scsi_info, vdev->bus_name);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (vs->conf.data_plane) {
+        virtio_scsi_data_plane_create(vdev,
+                                      virtio_queue_get_id(vs->cmd_vqs[0]),
+                                      vs->conf.num_queues,
+                                      sizeof(VirtIOSCSIReq), vs->conf.iothread,
+                                      &s->dataplane);
+    }
+#endif
+
     if (!qdev->hotplugged) {
         scsi_bus_legacy_handle_cmdline(&s->bus, &err);
         if (err != NULL) {
@@ -658,6 +782,10 @@ static int virtio_scsi_device_exit(DeviceState *qdev)
     VirtIOSCSI *s = VIRTIO_SCSI(qdev);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(qdev);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_scsi_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(qdev, "virtio-scsi", s);
     return virtio_scsi_common_exit(vs);
 }
@@ -686,6 +814,7 @@ static void virtio_scsi_class_init(ObjectClass *klass, void *data)
     vdc->init = virtio_scsi_device_init;
     vdc->set_config = virtio_scsi_set_config;
     vdc->get_features = virtio_scsi_get_features;
+    vdc->set_status = virtio_scsi_set_status;
     vdc->reset = virtio_scsi_reset;
 }
 
@@ -42,6 +42,9 @@
 #define PVSCSI_MAX_CMD_DATA_WORDS \
     (sizeof(PVSCSICmdDescSetupRings)/sizeof(uint32_t))
 
+/* Completion descriptors written to guest memory with a single access */
+#define PVSCSI_CMP_BATCH                  (16)
+
 #define RS_GET_FIELD(rs_pa, field) \
     (ldl_le_phys(rs_pa + offsetof(struct PVSCSIRingsState, field)))
 #define RS_SET_FIELD(rs_pa, field, val) \
@@ -78,6 +81,7 @@ typedef struct {
     QEMUBH *completion_worker;
     PVSCSIRequestList pending_queue;
     PVSCSIRequestList completion_queue;
+    PVSCSIRequestList free_queue;        /* Requests kept for reuse         */
 
     uint64_t reg_interrupt_status;        /* Interrupt status register value */
     uint64_t reg_interrupt_enabled;       /* Interrupt mask register value   */
@@ -356,14 +360,12 @@ pvscsi_raise_message_interrupt(PVSCSIState *s)
 }
 
 static void
-pvscsi_cmp_ring_put(PVSCSIState *s, struct PVSCSIRingCmpDesc *cmp_desc)
+pvscsi_cmp_ring_write(hwaddr cmp_descr_pa, struct PVSCSIRingCmpDesc *cmp_desc,
+                      int count)
 {
-    hwaddr cmp_descr_pa;
-
-    cmp_descr_pa = pvscsi_ring_pop_cmp_descr(&s->rings);
     trace_pvscsi_cmp_ring_put(cmp_descr_pa);
     cpu_physical_memory_write(cmp_descr_pa, (void *)cmp_desc,
-                              sizeof(*cmp_desc));
+                              count * sizeof(*cmp_desc));
 }
 
 static void
@@ -377,22 +379,62 @@ pvscsi_msg_ring_put(PVSCSIState *s, struct PVSCSIRingMsgDesc *msg_desc)
                               sizeof(*msg_desc));
 }
 
+static PVSCSIRequest *
+pvscsi_alloc_request(PVSCSIState *s)
+{
+    PVSCSIRequest *pvscsi_req = QTAILQ_FIRST(&s->free_queue);
+
+    if (pvscsi_req) {
+        QTAILQ_REMOVE(&s->free_queue, pvscsi_req, next);
+        memset(pvscsi_req, 0, sizeof(*pvscsi_req));
+    } else {
+        pvscsi_req = g_malloc0(sizeof(*pvscsi_req));
+    }
+    return pvscsi_req;
+}
+
+static void
+pvscsi_free_request(PVSCSIState *s, PVSCSIRequest *pvscsi_req)
+{
+    QTAILQ_INSERT_HEAD(&s->free_queue, pvscsi_req, next);
+}
+
+/*
+ * Put all the completed requests on the ring, then publish the new
+ * producer index and raise a single interrupt.  Descriptors that are
+ * adjacent in guest memory are written together.
+ */
 static void
 pvscsi_process_completion_queue(void *opaque)
 {
     PVSCSIState *s = opaque;
     PVSCSIRequest *pvscsi_req;
+    struct PVSCSIRingCmpDesc batch[PVSCSI_CMP_BATCH];
+    hwaddr batch_pa = 0, cmp_descr_pa;
+    int batch_len = 0;
     bool has_completed = false;
 
     while (!QTAILQ_EMPTY(&s->completion_queue)) {
         pvscsi_req = QTAILQ_FIRST(&s->completion_queue);
         QTAILQ_REMOVE(&s->completion_queue, pvscsi_req, next);
-        pvscsi_cmp_ring_put(s, &pvscsi_req->cmp);
-        g_free(pvscsi_req);
+
+        cmp_descr_pa = pvscsi_ring_pop_cmp_descr(&s->rings);
+        if (batch_len == PVSCSI_CMP_BATCH || (batch_len &&
+            cmp_descr_pa != batch_pa + batch_len * sizeof(batch[0]))) {
+            pvscsi_cmp_ring_write(batch_pa, batch, batch_len);
+            batch_len = 0;
+        }
+        if (!batch_len) {
+            batch_pa = cmp_descr_pa;
+        }
+        batch[batch_len++] = pvscsi_req->cmp;
+
+        pvscsi_free_request(s, pvscsi_req);
         has_completed = true;
     }
 
     if (has_completed) {
+        pvscsi_cmp_ring_write(batch_pa, batch, batch_len);
         pvscsi_ring_flush_cmp(&s->rings);
         pvscsi_raise_completion_interrupt(s);
     }
@@ -574,7 +616,7 @@ pvscsi_queue_pending_descriptor(PVSCSIState *s, SCSIDevice **d,
     PVSCSIRequest *pvscsi_req;
     uint8_t lun;
 
-    pvscsi_req = g_malloc0(sizeof(*pvscsi_req));
+    pvscsi_req = pvscsi_alloc_request(s);
     pvscsi_req->dev = s;
     pvscsi_req->req = *descr;
     pvscsi_req->cmp.context = pvscsi_req->req.context;
@@ -1090,6 +1132,7 @@ pvscsi_init(PCIDevice *pci_dev)
 
     scsi_bus_new(&s->bus, sizeof(s->bus), DEVICE(pci_dev),
                  &pvscsi_scsi_info, NULL);
+    QTAILQ_INIT(&s->free_queue);
     pvscsi_reset_state(s);
 
     return 0;
@@ -1099,10 +1142,16 @@ static void
 pvscsi_uninit(PCIDevice *pci_dev)
 {
     PVSCSIState *s = PVSCSI(pci_dev);
+    PVSCSIRequest *pvscsi_req;
 
     trace_pvscsi_state("uninit");
     qemu_bh_delete(s->completion_worker);
 
+    while ((pvscsi_req = QTAILQ_FIRST(&s->free_queue)) != NULL) {
+        QTAILQ_REMOVE(&s->free_queue, pvscsi_req, next);
+        g_free(pvscsi_req);
+    }
+
     pvscsi_cleanup_msi(s);
 
     memory_region_destroy(&s->io_space);
@@ -32,6 +32,7 @@
 #include "hw/sysbus.h"
 #include "hw/timer/mc146818rtc.h"
 #include "hw/timer/i8254.h"
+#include "trace.h"
 
 //#define HPET_DEBUG
 #ifdef HPET_DEBUG
@@ -133,6 +134,24 @@ static uint64_t ns_to_ticks(uint64_t value)
     return (muldiv64(value, FS_PER_NS, HPET_CLK_PERIOD));
 }
 
+/* Arm the timer to fire in diff ticks.  Guests often rewrite the
+ * registers without moving the comparator; the expiry then only differs
+ * by the rounding of the tick to ns conversion, so leave the timer alone.
+ */
+static void hpet_timer_mod(HPETTimer *t, uint64_t diff)
+{
+    int64_t expire = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                     (int64_t)ticks_to_ns(diff);
+    int64_t old = timer_expire_time_ns(t->qemu_timer);
+
+    if (old != -1 && llabs(expire - old) < ticks_to_ns(1)) {
+        trace_hpet_timer_mod_skip(t->tn, old);
+        return;
+    }
+    trace_hpet_timer_mod(t->tn, expire);
+    timer_mod(t->qemu_timer, expire);
+}
+
 static uint64_t hpet_fixup_reg(uint64_t new, uint64_t old, uint64_t mask)
 {
     new &= mask;
@@ -332,13 +351,11 @@ static void hpet_timer(void *opaque)
             }
         }
         diff = hpet_calculate_diff(t, cur_tick);
-        timer_mod(t->qemu_timer,
-                       qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + (int64_t)ticks_to_ns(diff));
+        hpet_timer_mod(t, diff);
     } else if (t->config & HPET_TN_32BIT && !timer_is_periodic(t)) {
         if (t->wrap_flag) {
             diff = hpet_calculate_diff(t, cur_tick);
-            timer_mod(t->qemu_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
-                           (int64_t)ticks_to_ns(diff));
+            hpet_timer_mod(t, diff);
             t->wrap_flag = 0;
         }
     }
@@ -365,8 +382,7 @@ static void hpet_set_timer(HPETTimer *t)
             t->wrap_flag = 1;
         }
     }
-    timer_mod(t->qemu_timer,
-                   qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + (int64_t)ticks_to_ns(diff));
+    hpet_timer_mod(t, diff);
 }
 
 static void hpet_del_timer(HPETTimer *t)
@@ -135,6 +135,8 @@
 #define IMAN_IP         (1<<0)
 #define IMAN_IE         (1<<1)
 
+#define IMOD_IMODI_MASK 0xffff
+
 #define ERDP_EHB        (1<<3)
 
 #define TRB_SIZE 16
@@ -439,6 +441,12 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation */
+    QEMUTimer *imod_timer;
+    int64_t imod_next;
+    struct XHCIState *xhci;
+    int v;
+
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -765,14 +773,10 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
-static void xhci_intr_raise(XHCIState *xhci, int v)
+static void xhci_intr_deliver(XHCIState *xhci, int v)
 {
     PCIDevice *pci_dev = PCI_DEVICE(xhci);
 
-    xhci->intr[v].erdp_low |= ERDP_EHB;
-    xhci->intr[v].iman |= IMAN_IP;
-    xhci->usbsts |= USBSTS_EINT;
-
     if (!(xhci->intr[v].iman & IMAN_IE)) {
         return;
     }
@@ -799,6 +803,68 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_intr_raise(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    bool pending = intr->erdp_low & ERDP_EHB;
+    uint32_t imodi = intr->imod & IMOD_IMODI_MASK;
+
+    intr->erdp_low |= ERDP_EHB;
+    intr->iman |= IMAN_IP;
+    xhci->usbsts |= USBSTS_EINT;
+
+    /* The driver has not finished with the events of the previous
+     * interrupt yet; it will see these ones too.  Once it clears EHB,
+     * xhci_runtime_write checks for events it did not consume.
+     */
+    if (pending) {
+        return;
+    }
+
+    /* Interrupt moderation: at most one interrupt per IMODI * 250ns,
+     * the events written in between are reported together.
+     */
+    if (imodi) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+        if (now < intr->imod_next) {
+            timer_mod(intr->imod_timer, intr->imod_next);
+            return;
+        }
+        intr->imod_next = now + imodi * 250;
+    }
+
+    xhci_intr_deliver(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    XHCIState *xhci = intr->xhci;
+
+    if (!(intr->erdp_low & ERDP_EHB)) {
+        /* the driver picked the events up without an interrupt */
+        return;
+    }
+    intr->imod_next = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                      (intr->imod & IMOD_IMODI_MASK) * 250;
+    xhci_intr_deliver(xhci, intr->v);
+}
+
+/* Are there events between ERDP and the enqueue pointer? */
+static bool xhci_er_pending(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    dma_addr_t erdp = xhci_addr64(intr->erdp_low & ~ERDP_EHB,
+                                  intr->erdp_high);
+
+    if (!intr->er_size || erdp < intr->er_start ||
+        erdp >= (intr->er_start + TRB_SIZE*intr->er_size)) {
+        return false;
+    }
+    return (erdp - intr->er_start) / TRB_SIZE != intr->er_ep_idx;
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -2784,6 +2850,8 @@ static void xhci_reset(DeviceState *dev)
     for (i = 0; i < xhci->numintrs; i++) {
         xhci->intr[i].iman = 0;
         xhci->intr[i].imod = 0;
+        xhci->intr[i].imod_next = 0;
+        timer_del(xhci->intr[i].imod_timer);
         xhci->intr[i].erstsz = 0;
         xhci->intr[i].erstba_low = 0;
         xhci->intr[i].erstba_high = 0;
@@ -3159,6 +3227,9 @@ static void xhci_runtime_write(void *ptr, hwaddr reg,
     case 0x1c: /* ERDP high */
         intr->erdp_high = val;
         xhci_events_update(xhci, v);
+        if (!(intr->erdp_low & ERDP_EHB) && xhci_er_pending(xhci, v)) {
+            xhci_intr_raise(xhci, v);
+        }
         break;
     default:
         trace_usb_xhci_unimplemented("oper write", reg);
@@ -3433,6 +3504,13 @@ static int usb_xhci_initfn(struct PCIDevice *dev)
     }
 
     xhci->mfwrap_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_mfwrap_timer, xhci);
+    for (i = 0; i < xhci->numintrs; i++) {
+        xhci->intr[i].xhci = xhci;
+        xhci->intr[i].v = i;
+        xhci->intr[i].imod_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                xhci_imod_timer,
+                                                &xhci->intr[i]);
+    }
 
     memory_region_init(&xhci->mem, OBJECT(xhci), "xhci", LEN_REGS);
     memory_region_init_io(&xhci->mem_cap, OBJECT(xhci), &xhci_cap_ops, xhci,
@@ -3580,6 +3658,25 @@ static bool xhci_er_full(void *opaque, int version_id)
     return intr->er_full;
 }
 
+static bool xhci_imod_pending(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+
+    return timer_pending(intr->imod_timer);
+}
+
+/* an interrupt held back by moderation */
+static const VMStateDescription vmstate_xhci_intr_imod = {
+    .name = "xhci-intr/imod",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER(imod_timer,     XHCIInterrupter),
+        VMSTATE_INT64(imod_next,      XHCIInterrupter),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_xhci_intr = {
     .name = "xhci-intr",
     .version_id = 1,
@@ -3609,7 +3706,15 @@ static const VMStateDescription vmstate_xhci_intr = {
                                   vmstate_xhci_event, XHCIEvent),
 
         VMSTATE_END_OF_LIST()
-    }
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_xhci_intr_imod,
+            .needed = xhci_imod_pending,
+        }, {
+            /* empty */
+        }
+    },
 };
 
 static const VMStateDescription vmstate_xhci = {
@@ -12,6 +12,9 @@
  */
 
 #include "exec/address-spaces.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
 #include "hw/virtio/dataplane/hostmem.h"
 
 static int hostmem_lookup_cmp(const void *phys_, const void *region_)
@@ -33,18 +36,32 @@ static int hostmem_lookup_cmp(const void *phys_, const void *region_)
  */
 void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write)
 {
-    HostMemRegion *region;
+    HostMemTable *table;
+    HostMemRegion *region = NULL;
     void *host_addr = NULL;
     hwaddr offset_within_region;
+    size_t hint;
 
-    qemu_mutex_lock(&hostmem->current_regions_lock);
-    region = bsearch(&phys, hostmem->current_regions,
-                     hostmem->num_current_regions,
-                     sizeof(hostmem->current_regions[0]),
-                     hostmem_lookup_cmp);
-    if (!region) {
+    /* Pairs with the atomic_xchg() in hostmem_listener_commit() */
+    atomic_inc(&hostmem->readers);
+    table = atomic_read(&hostmem->current);
+    if (!table) {
         goto out;
     }
+
+    /* Descriptors of a request almost always land in the same region */
+    hint = atomic_read(&hostmem->last_hit);
+    if (hint < table->num_regions &&
+        hostmem_lookup_cmp(&phys, &table->regions[hint]) == 0) {
+        region = &table->regions[hint];
+    } else {
+        region = bsearch(&phys, table->regions, table->num_regions,
+                         sizeof(table->regions[0]), hostmem_lookup_cmp);
+        if (!region) {
+            goto out;
+        }
+        atomic_set(&hostmem->last_hit, region - table->regions);
+    }
     if (is_write && region->readonly) {
         goto out;
     }
@@ -53,27 +70,131 @@ void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write)
         host_addr = region->host_addr + offset_within_region;
     }
 out:
-    qemu_mutex_unlock(&hostmem->current_regions_lock);
+    atomic_dec(&hostmem->readers);
 
     return host_addr;
 }
 
+/**
+ * Mark guest memory dirty after writing to it
+ */
+void hostmem_set_dirty(HostMem *hostmem, void *host_addr, size_t len)
+{
+    HostMemTable *table;
+    size_t i;
+
+    if (likely(!atomic_read(&hostmem->logging)) || len == 0) {
+        return;
+    }
+
+    /* Pairs with the atomic_xchg() in hostmem_listener_commit() */
+    atomic_inc(&hostmem->readers);
+    table = atomic_read(&hostmem->current);
+    for (i = 0; table && i < table->num_regions; i++) {
+        HostMemRegion *region = &table->regions[i];
+        uint64_t offset, first, last, page;
+
+        if (host_addr < region->host_addr ||
+            host_addr >= region->host_addr + region->size) {
+            continue;
+        }
+        if (!region->dirty) {
+            break;
+        }
+
+        offset = host_addr - region->host_addr;
+        first = offset >> HOSTMEM_DIRTY_PAGE_BITS;
+        last = (MIN(offset + len, region->size) - 1) >> HOSTMEM_DIRTY_PAGE_BITS;
+        for (page = first; page <= last; page++) {
+            atomic_or(&region->dirty[BIT_WORD(page)], BIT_MASK(page));
+        }
+        break;
+    }
+    atomic_dec(&hostmem->readers);
+}
+
+void hostmem_set_dirty_iov(HostMem *hostmem, const struct iovec *iov,
+                           unsigned int iov_cnt)
+{
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        hostmem_set_dirty(hostmem, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+static size_t hostmem_region_dirty_longs(HostMemRegion *region)
+{
+    return BITS_TO_LONGS(DIV_ROUND_UP(region->size, HOSTMEM_DIRTY_PAGE_SIZE));
+}
+
+/**
+ * Transfer a region's dirty bits to the memory API, main loop only
+ */
+static void hostmem_region_sync_dirty(HostMemRegion *region)
+{
+    size_t i;
+
+    if (!region->dirty) {
+        return;
+    }
+    for (i = 0; i < hostmem_region_dirty_longs(region); i++) {
+        unsigned long bits;
+
+        if (!atomic_read(&region->dirty[i])) {
+            continue;
+        }
+        bits = atomic_xchg(&region->dirty[i], 0);
+        while (bits) {
+            uint64_t page = i * BITS_PER_LONG + ctzl(bits);
+            uint64_t offset = page << HOSTMEM_DIRTY_PAGE_BITS;
+
+            memory_region_set_dirty(region->mr,
+                                    region->offset_within_region + offset,
+                                    MIN(HOSTMEM_DIRTY_PAGE_SIZE,
+                                        region->size - offset));
+            bits &= bits - 1;
+        }
+    }
+}
+
+static void hostmem_table_free(HostMemTable *table)
+{
+    size_t i;
+
+    if (!table) {
+        return;
+    }
+    for (i = 0; i < table->num_regions; i++) {
+        /* Writes recorded in a retired table must not be lost */
+        hostmem_region_sync_dirty(&table->regions[i]);
+        g_free(table->regions[i].dirty);
+        memory_region_unref(table->regions[i].mr);
+    }
+    g_free(table->regions);
+    g_free(table);
+}
+
 /**
  * Install new regions list
  */
 static void hostmem_listener_commit(MemoryListener *listener)
 {
     HostMem *hostmem = container_of(listener, HostMem, listener);
-    int i;
+    HostMemTable *table = g_new(HostMemTable, 1);
+    HostMemTable *old;
 
-    qemu_mutex_lock(&hostmem->current_regions_lock);
-    for (i = 0; i < hostmem->num_current_regions; i++) {
-        memory_region_unref(hostmem->current_regions[i].mr);
+    table->regions = hostmem->new_regions;
+    table->num_regions = hostmem->num_new_regions;
+    old = atomic_xchg(&hostmem->current, table);
+
+    /* Lookups are a handful of instructions, so waiting for the ones that
+     * started before the swap is cheaper than deferring the free.
+     */
+    while (atomic_mb_read(&hostmem->readers)) {
+        /* do nothing */
     }
-    g_free(hostmem->current_regions);
-    hostmem->current_regions = hostmem->new_regions;
-    hostmem->num_current_regions = hostmem->num_new_regions;
-    qemu_mutex_unlock(&hostmem->current_regions_lock);
+    hostmem_table_free(old);
 
     /* Reset new regions list */
     hostmem->new_regions = NULL;
@@ -95,9 +216,15 @@ static void hostmem_append_new_region(HostMem *hostmem,
         .host_addr = ram_ptr + section->offset_within_region,
         .guest_addr = section->offset_within_address_space,
         .size = int128_get64(section->size),
+        .offset_within_region = section->offset_within_region,
         .readonly = section->readonly,
         .mr = section->mr,
     };
+    if (hostmem->logging) {
+        hostmem->new_regions[num].dirty =
+            g_new0(unsigned long,
+                   hostmem_region_dirty_longs(&hostmem->new_regions[num]));
+    }
     hostmem->num_new_regions++;
 
     memory_region_ref(section->mr);
@@ -113,7 +240,9 @@ static void hostmem_listener_append_region(MemoryListener *listener,
         return;
     }
 
-    /* Ignore regions with dirty logging, we cannot mark them dirty */
+    /* Ignore regions with per-region dirty logging like framebuffers, only
+     * global dirty logging for migration is tracked here.
+     */
     if (memory_region_is_logging(section->mr)) {
         return;
     }
@@ -121,6 +250,64 @@ static void hostmem_listener_append_region(MemoryListener *listener,
     hostmem_append_new_region(hostmem, section);
 }
 
+/**
+ * Reinstall the current regions with dirty bitmaps added or dropped
+ */
+static void hostmem_set_logging(HostMem *hostmem, bool logging)
+{
+    HostMemTable *table = hostmem->current;
+    size_t i;
+
+    atomic_mb_set(&hostmem->logging, logging);
+    if (!table) {
+        return;
+    }
+
+    /* Copy the regions, the listener has no other way to enumerate them */
+    for (i = 0; i < table->num_regions; i++) {
+        HostMemRegion *region = &table->regions[i];
+        MemoryRegionSection section = {
+            .mr = region->mr,
+            .offset_within_region = region->offset_within_region,
+            .offset_within_address_space = region->guest_addr,
+            .size = int128_make64(region->size),
+            .readonly = region->readonly,
+        };
+
+        hostmem_append_new_region(hostmem, &section);
+    }
+    hostmem_listener_commit(&hostmem->listener);
+}
+
+static void hostmem_listener_log_global_start(MemoryListener *listener)
+{
+    HostMem *hostmem = container_of(listener, HostMem, listener);
+
+    hostmem_set_logging(hostmem, true);
+}
+
+static void hostmem_listener_log_global_stop(MemoryListener *listener)
+{
+    HostMem *hostmem = container_of(listener, HostMem, listener);
+
+    hostmem_set_logging(hostmem, false);
+}
+
+static void hostmem_listener_log_sync(MemoryListener *listener,
+                                      MemoryRegionSection *section)
+{
+    HostMem *hostmem = container_of(listener, HostMem, listener);
+    HostMemTable *table = hostmem->current;
+    size_t i;
+
+    /* The table is only replaced from the main loop so no need for readers */
+    for (i = 0; table && i < table->num_regions; i++) {
+        if (table->regions[i].mr == section->mr) {
+            hostmem_region_sync_dirty(&table->regions[i]);
+        }
+    }
+}
+
 /* We don't implement most MemoryListener callbacks, use these nop stubs */
 static void hostmem_listener_dummy(MemoryListener *listener)
 {
@@ -148,8 +335,6 @@ void hostmem_init(HostMem *hostmem)
 {
     memset(hostmem, 0, sizeof(*hostmem));
 
-    qemu_mutex_init(&hostmem->current_regions_lock);
-
     hostmem->listener = (MemoryListener){
         .begin = hostmem_listener_dummy,
         .commit = hostmem_listener_commit,
@@ -158,9 +343,9 @@ void hostmem_init(HostMem *hostmem)
         .region_nop = hostmem_listener_append_region,
         .log_start = hostmem_listener_section_dummy,
         .log_stop = hostmem_listener_section_dummy,
-        .log_sync = hostmem_listener_section_dummy,
-        .log_global_start = hostmem_listener_dummy,
-        .log_global_stop = hostmem_listener_dummy,
+        .log_sync = hostmem_listener_log_sync,
+        .log_global_start = hostmem_listener_log_global_start,
+        .log_global_stop = hostmem_listener_log_global_stop,
         .eventfd_add = hostmem_listener_eventfd_dummy,
         .eventfd_del = hostmem_listener_eventfd_dummy,
         .coalesced_mmio_add = hostmem_listener_coalesced_mmio_dummy,
@@ -178,6 +363,6 @@ void hostmem_finalize(HostMem *hostmem)
 {
     memory_listener_unregister(&hostmem->listener);
     g_free(hostmem->new_regions);
-    g_free(hostmem->current_regions);
-    qemu_mutex_destroy(&hostmem->current_regions_lock);
+    hostmem_table_free(hostmem->current);
+    hostmem->current = NULL;
 }
@@ -57,11 +57,19 @@ void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
     hostmem_finalize(&vring->hostmem);
 }
 
+/* Report a write to the used ring to the migration dirty bitmap */
+static void vring_used_set_dirty(Vring *vring, void *ptr, size_t len)
+{
+    hostmem_set_dirty(&vring->hostmem, ptr, len);
+}
+
 /* Disable guest->host notifies */
 void vring_disable_notification(VirtIODevice *vdev, Vring *vring)
 {
     if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
         vring->vr.used->flags |= VRING_USED_F_NO_NOTIFY;
+        vring_used_set_dirty(vring, &vring->vr.used->flags,
+                             sizeof(vring->vr.used->flags));
     }
 }
 
@@ -73,8 +81,12 @@ bool vring_enable_notification(VirtIODevice *vdev, Vring *vring)
 {
     if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(&vring->vr) = vring->vr.avail->idx;
+        vring_used_set_dirty(vring, &vring_avail_event(&vring->vr),
+                             sizeof(uint16_t));
     } else {
         vring->vr.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+        vring_used_set_dirty(vring, &vring->vr.used->flags,
+                             sizeof(vring->vr.used->flags));
     }
     smp_mb(); /* ensure update is seen before reading avail_idx */
     return !vring_more_avail(vring);
@@ -113,6 +125,7 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
 /* This is stolen from linux/drivers/vhost/vhost.c. */
 static int get_indirect(Vring *vring,
                         struct iovec iov[], struct iovec *iov_end,
+                        hwaddr addr[],
                         unsigned int *out_num, unsigned int *in_num,
                         struct vring_desc *indirect)
 {
@@ -186,6 +199,9 @@ static int get_indirect(Vring *vring,
         }
         iov->iov_len = desc.len;
         iov++;
+        if (addr) {
+            *addr++ = desc.addr;
+        }
 
         /* If this is an input descriptor, increment that count. */
         if (desc.flags & VRING_DESC_F_WRITE) {
@@ -220,6 +236,17 @@ static int get_indirect(Vring *vring,
 int vring_pop(VirtIODevice *vdev, Vring *vring,
               struct iovec iov[], struct iovec *iov_end,
               unsigned int *out_num, unsigned int *in_num)
+{
+    return vring_pop_addr(vdev, vring, iov, iov_end, NULL, out_num, in_num);
+}
+
+/* Like vring_pop(), but also stores the guest physical address of each
+ * descriptor in @addr, which has as many entries as @iov.  Devices that
+ * hand the buffers to DMA helpers need these addresses.
+ */
+int vring_pop_addr(VirtIODevice *vdev, Vring *vring,
+                   struct iovec iov[], struct iovec *iov_end, hwaddr addr[],
+                   unsigned int *out_num, unsigned int *in_num)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
@@ -263,6 +290,8 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
 
     if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(&vring->vr) = vring->vr.avail->idx;
+        vring_used_set_dirty(vring, &vring_avail_event(&vring->vr),
+                             sizeof(uint16_t));
     }
 
     /* When we start there are none of either input nor output. */
@@ -287,7 +316,8 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            int ret = get_indirect(vring, iov, iov_end, out_num, in_num, &desc);
+            int ret = get_indirect(vring, iov, iov_end, addr,
+                                   out_num, in_num, &desc);
             if (ret < 0) {
                 return ret;
             }
@@ -313,6 +343,9 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         }
         iov->iov_len  = desc.len;
         iov++;
+        if (addr) {
+            *addr++ = desc.addr;
+        }
 
         if (desc.flags & VRING_DESC_F_WRITE) {
             /* If this is an input descriptor,
@@ -360,7 +393,19 @@ void vring_push(Vring *vring, unsigned int head, int len)
     smp_wmb();
 
     new = vring->vr.used->idx = ++vring->last_used_idx;
+    vring_used_set_dirty(vring, used, sizeof(*used));
+    vring_used_set_dirty(vring, &vring->vr.used->idx,
+                         sizeof(vring->vr.used->idx));
     if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
         vring->signalled_used_valid = false;
     }
 }
+
+/* Give back the descriptor chain returned by the last vring_pop() call so
+ * that the next vring_pop() returns it again.  Used when the buffer turned
+ * out not to be needed, e.g. no packet was waiting after all.
+ */
+void vring_unpop(Vring *vring)
+{
+    vring->last_avail_idx--;
+}
@@ -13,14 +13,17 @@
  * GNU GPL, version 2 or (at your option) any later version.
  */
 
-#include <sys/ioctl.h>
 #include "hw/virtio/vhost.h"
 #include "hw/hw.h"
 #include "qemu/atomic.h"
 #include "qemu/range.h"
+#include "qemu/host-utils.h"
+#include "qemu/stats.h"
+#include "qemu/timer.h"
 #include <linux/vhost.h>
 #include "exec/address-spaces.h"
 #include "hw/virtio/virtio-bus.h"
+#include "trace.h"
 
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
@@ -40,28 +43,55 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
     for (;from < to; ++from) {
-        vhost_log_chunk_t log;
-        int bit;
+        vhost_log_chunk_t log, mask = ~(vhost_log_chunk_t)0;
+        uint64_t first_bit = 0, last_bit = VHOST_LOG_BITS - 1;
+
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
         if (!*from) {
             addr += VHOST_LOG_CHUNK;
             continue;
         }
+
+        /* The first and last words may be shared with pages outside
+         * [start, end]; leave those bits for whoever syncs them. */
+        if (start > addr) {
+            first_bit = (start - addr) / VHOST_LOG_PAGE;
+        }
+        if (end < addr + VHOST_LOG_CHUNK - 1) {
+            last_bit = (end - addr) / VHOST_LOG_PAGE;
+        }
+        mask <<= first_bit;
+        mask &= ~(vhost_log_chunk_t)0 >> (VHOST_LOG_BITS - 1 - last_bit);
+
         /* Data must be read atomically. We don't really need barrier semantics
          * but it's easier to use atomic_* than roll our own. */
-        log = atomic_xchg(from, 0);
-        while ((bit = sizeof(log) > sizeof(int) ?
-                ffsll(log) : ffs(log))) {
-            hwaddr page_addr;
-            hwaddr section_offset;
+        if (mask == ~(vhost_log_chunk_t)0) {
+            log = atomic_xchg(from, 0);
+        } else {
+            log = atomic_fetch_and(from, ~mask) & mask;
+        }
+
+        /* Mark each run of dirty pages with a single call; a fully dirty
+         * word is one run. */
+        while (log) {
+            uint64_t run_start, run_last;
             hwaddr mr_offset;
-            bit -= 1;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+            int bit = ctz64(log);
+            int len = cto64((uint64_t)log >> bit);
+
+            if (bit + len >= VHOST_LOG_BITS) {
+                log = 0;
+            } else {
+                log &= ~((((vhost_log_chunk_t)1 << len) - 1) << bit);
+            }
+
+            run_start = MAX(addr + bit * VHOST_LOG_PAGE, start);
+            run_last = MIN(addr + (bit + len) * VHOST_LOG_PAGE - 1, end);
+            mr_offset = run_start - section->offset_within_address_space +
+                        section->offset_within_region;
+            memory_region_set_dirty(section->mr, mr_offset,
+                                    run_last - run_start + 1);
         }
         addr += VHOST_LOG_CHUNK;
     }
@@ -104,7 +134,10 @@ static void vhost_log_sync(MemoryListener *listener,
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
                                          memory_listener);
+    int64_t start = get_clock();
+
     vhost_sync_dirty_bitmap(dev, section, 0x0, ~0x0ULL);
+    stats_histogram_record(dev->log_sync_ns, get_clock() - start);
 }
 
 static void vhost_log_sync_range(struct vhost_dev *dev,
@@ -283,6 +316,15 @@ static uint64_t vhost_get_log_size(struct vhost_dev *dev)
     return log_size;
 }
 
+/* Size the log with room to spare, so that memory map changes during
+ * migration rarely need to swap in a bigger log.  g_malloc0 of a large
+ * block gets fresh anonymous memory, so the pages of the log that are
+ * never dirtied are never allocated.  */
+static uint64_t vhost_log_size_round(uint64_t size)
+{
+    return size ? pow2ceil(size) : 0;
+}
+
 static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
 {
     vhost_log_chunk_t *log;
@@ -291,7 +333,7 @@ static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
 
     log = g_malloc0(size * sizeof *log);
     log_base = (uint64_t)(unsigned long)log;
-    r = ioctl(dev->control, VHOST_SET_LOG_BASE, &log_base);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_LOG_BASE, &log_base);
     assert(r >= 0);
     /* Sync only the range covered by the old log */
     if (dev->log_size) {
@@ -384,8 +426,6 @@ static void vhost_set_memory(MemoryListener *listener,
         (dev->mem->nregions + 1) * sizeof dev->mem->regions[0];
     void *ram;
 
-    dev->mem = g_realloc(dev->mem, s);
-
     if (log_dirty) {
         add = false;
     }
@@ -406,6 +446,9 @@ static void vhost_set_memory(MemoryListener *listener,
         }
     }
 
+    /* Splitting a region adds at most one */
+    dev->mem = g_realloc(dev->mem, s);
+
     vhost_dev_unassign_memory(dev, start_addr, size);
     if (add) {
         /* Add given mapping, merging adjacent regions if any */
@@ -432,6 +475,52 @@ static void vhost_begin(MemoryListener *listener)
     dev->mem_changed_start_addr = -1;
 }
 
+static size_t vhost_mem_table_size(const struct vhost_memory *mem)
+{
+    return offsetof(struct vhost_memory, regions) +
+        mem->nregions * sizeof mem->regions[0];
+}
+
+/* Regions may be reordered by assign/unassign, so compare them as sets.
+ * Adjacent regions are always merged, so the same memory map gives the
+ * same set of regions.  */
+static bool vhost_mem_table_equal(const struct vhost_memory *a,
+                                  const struct vhost_memory *b)
+{
+    int i, j;
+
+    if (!a || !b || a->nregions != b->nregions) {
+        return false;
+    }
+    for (i = 0; i < a->nregions; ++i) {
+        for (j = 0; j < b->nregions; ++j) {
+            if (!memcmp(&a->regions[i], &b->regions[j],
+                        sizeof a->regions[i])) {
+                break;
+            }
+        }
+        if (j == b->nregions) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int vhost_dev_set_mem_table(struct vhost_dev *dev)
+{
+    size_t s = vhost_mem_table_size(dev->mem);
+    int r;
+
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
+    if (r < 0) {
+        return r;
+    }
+    dev->pushed_mem = g_realloc(dev->pushed_mem, s);
+    memcpy(dev->pushed_mem, dev->mem, s);
+    stats_counter_inc(dev->mem_table_updates);
+    return 0;
+}
+
 static void vhost_commit(MemoryListener *listener)
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
@@ -451,6 +540,20 @@ static void vhost_commit(MemoryListener *listener)
         return;
     }
 
+    /* A region removed and added back in the same transaction, e.g. when
+     * a BAR is mapped over RAM and moved away, leaves the table as the
+     * backend has it: nothing moved, so neither the rings nor the table
+     * need to be looked at again.  */
+    if (vhost_mem_table_equal(dev->mem, dev->pushed_mem)) {
+        stats_counter_inc(dev->mem_table_skipped);
+        trace_vhost_commit(dev, false, dev->mem_table_updates->value,
+                           dev->mem_table_skipped->value);
+        dev->memory_changed = false;
+        return;
+    }
+    trace_vhost_commit(dev, true, dev->mem_table_updates->value + 1,
+                       dev->mem_table_skipped->value);
+
     if (dev->started) {
         start_addr = dev->mem_changed_start_addr;
         size = dev->mem_changed_end_addr - dev->mem_changed_start_addr + 1;
@@ -460,25 +563,20 @@ static void vhost_commit(MemoryListener *listener)
     }
 
     if (!dev->log_enabled) {
-        r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+        r = vhost_dev_set_mem_table(dev);
         assert(r >= 0);
         dev->memory_changed = false;
         return;
     }
     log_size = vhost_get_log_size(dev);
-    /* We allocate an extra 4K bytes to log,
-     * to reduce the * number of reallocations. */
-#define VHOST_LOG_BUFFER (0x1000 / sizeof *dev->log)
-    /* To log more, must increase log size before table update. */
+    /* To log more, must increase log size before table update.  The log
+     * is never shrunk while logging: a smaller map leaves it oversized,
+     * which costs nothing since the unused part is never touched.  */
     if (dev->log_size < log_size) {
-        vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
+        vhost_dev_log_resize(dev, vhost_log_size_round(log_size));
     }
-    r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+    r = vhost_dev_set_mem_table(dev);
     assert(r >= 0);
-    /* To log less, can only decrease log size after table update. */
-    if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
-        vhost_dev_log_resize(dev, log_size);
-    }
     dev->memory_changed = false;
 }
 
@@ -541,7 +639,7 @@ static int vhost_virtqueue_set_addr(struct vhost_dev *dev,
         .log_guest_addr = vq->used_phys,
         .flags = enable_log ? (1 << VHOST_VRING_F_LOG) : 0,
     };
-    int r = ioctl(dev->control, VHOST_SET_VRING_ADDR, &addr);
+    int r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_ADDR, &addr);
     if (r < 0) {
         return -errno;
     }
@@ -555,7 +653,7 @@ static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
     if (enable_log) {
         features |= 0x1 << VHOST_F_LOG_ALL;
     }
-    r = ioctl(dev->control, VHOST_SET_FEATURES, &features);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_FEATURES, &features);
     return r < 0 ? -errno : 0;
 }
 
@@ -609,7 +707,9 @@ static int vhost_migration_log(MemoryListener *listener, int enable)
         dev->log = NULL;
         dev->log_size = 0;
     } else {
-        vhost_dev_log_resize(dev, vhost_get_log_size(dev));
+        uint64_t log_size = vhost_get_log_size(dev);
+
+        vhost_dev_log_resize(dev, vhost_log_size_round(log_size));
         r = vhost_dev_set_log(dev, true);
         if (r < 0) {
             return r;
@@ -670,13 +770,13 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
 
     vq->num = state.num = virtio_queue_get_num(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_NUM, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_NUM, &state);
     if (r) {
         return -errno;
     }
 
     state.num = virtio_queue_get_last_avail_idx(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_BASE, &state);
     if (r) {
         return -errno;
     }
@@ -718,7 +818,7 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
     }
 
     file.fd = event_notifier_get_fd(virtio_queue_get_host_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_KICK, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_KICK, &file);
     if (r) {
         r = -errno;
         goto fail_kick;
@@ -756,7 +856,7 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     };
     int r;
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
-    r = ioctl(dev->control, VHOST_GET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
@@ -798,7 +898,7 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
     }
 
     file.fd = event_notifier_get_fd(&vq->masked_notifier);
-    r = ioctl(dev->control, VHOST_SET_VRING_CALL, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_CALL, &file);
     if (r) {
         r = -errno;
         goto fail_call;
@@ -814,25 +914,27 @@ static void vhost_virtqueue_cleanup(struct vhost_virtqueue *vq)
     event_notifier_cleanup(&vq->masked_notifier);
 }
 
-int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
-                   bool force)
+int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
+                   VhostBackendType backend_type, bool force)
 {
+    static int vhost_dev_count;
     uint64_t features;
     int i, r;
-    if (devfd >= 0) {
-        hdev->control = devfd;
-    } else {
-        hdev->control = open(devpath, O_RDWR);
-        if (hdev->control < 0) {
-            return -errno;
-        }
+
+    if (vhost_set_backend_type(hdev, backend_type) < 0) {
+        return -1;
+    }
+
+    if (hdev->vhost_ops->vhost_backend_init(hdev, opaque) < 0) {
+        return -errno;
     }
-    r = ioctl(hdev->control, VHOST_SET_OWNER, NULL);
+
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
     if (r < 0) {
         goto fail;
     }
 
-    r = ioctl(hdev->control, VHOST_GET_FEATURES, &features);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_GET_FEATURES, &features);
     if (r < 0) {
         goto fail;
     }
@@ -868,6 +970,13 @@ int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
     hdev->log_enabled = false;
     hdev->started = false;
     hdev->memory_changed = false;
+    hdev->pushed_mem = NULL;
+    hdev->stats = stats_new("vhost/%d", vhost_dev_count++);
+    hdev->mem_table_updates = stats_add_counter(hdev->stats,
+                                                "mem-table-updates");
+    hdev->mem_table_skipped = stats_add_counter(hdev->stats,
+                                                "mem-table-skipped");
+    hdev->log_sync_ns = stats_add_histogram(hdev->stats, "log-sync-ns");
     memory_listener_register(&hdev->memory_listener, &address_space_memory);
     hdev->force = force;
     return 0;
@@ -877,7 +986,7 @@ fail_vq:
     }
 fail:
     r = -errno;
-    close(hdev->control);
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
     return r;
 }
 
@@ -890,7 +999,9 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
     memory_listener_unregister(&hdev->memory_listener);
     g_free(hdev->mem);
     g_free(hdev->mem_sections);
-    close(hdev->control);
+    g_free(hdev->pushed_mem);
+    stats_free(hdev->stats);
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
 }
 
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev)
@@ -992,13 +1103,14 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
     } else {
         file.fd = event_notifier_get_fd(virtio_queue_get_guest_notifier(vvq));
     }
-    r = ioctl(hdev->control, VHOST_SET_VRING_CALL, &file);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_VRING_CALL, &file);
     assert(r >= 0);
 }
 
 /* Host notifiers must be enabled at this point. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
+    uint64_t log_base;
     int i, r;
 
     hdev->started = true;
@@ -1007,7 +1119,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = ioctl(hdev->control, VHOST_SET_MEM_TABLE, hdev->mem);
+    r = vhost_dev_set_mem_table(hdev);
     if (r < 0) {
         r = -errno;
         goto fail_mem;
@@ -1023,11 +1135,11 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     if (hdev->log_enabled) {
-        hdev->log_size = vhost_get_log_size(hdev);
+        hdev->log_size = vhost_log_size_round(vhost_get_log_size(hdev));
         hdev->log = hdev->log_size ?
             g_malloc0(hdev->log_size * sizeof *hdev->log) : NULL;
-        r = ioctl(hdev->control, VHOST_SET_LOG_BASE,
-                  (uint64_t)(unsigned long)hdev->log);
+        log_base = (uint64_t)(unsigned long)hdev->log;
+        r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_LOG_BASE, &log_base);
         if (r < 0) {
             r = -errno;
             goto fail_log;
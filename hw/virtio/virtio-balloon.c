@@ -22,7 +22,9 @@
 #include "sysemu/balloon.h"
 #include "hw/virtio/virtio-balloon.h"
 #include "sysemu/kvm.h"
+#include "sysemu/sysemu.h"
 #include "exec/address-spaces.h"
+#include "migration/migration.h"
 #include "qapi/visitor.h"
 
 #if defined(__linux__)
@@ -31,15 +33,77 @@
 
 #include "hw/virtio/virtio-bus.h"
 
-static void balloon_page(void *addr, int deflate)
+#define BALLOON_PAGE_SIZE (1 << VIRTIO_BALLOON_PFN_SHIFT)
+
+static void balloon_range(void *addr, ram_addr_t size, bool deflate)
 {
 #if defined(__linux__)
     if (!kvm_enabled() || kvm_has_sync_mmu())
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
+        qemu_madvise(addr, size,
                 deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
 #endif
 }
 
+/*
+ * Pass the pending run of pages to balloon_range().  Only whole host
+ * pages can be discarded, which matters with hugepage-backed RAM.  If
+ * @keep_tail, a partly inflated host page at the end of the run stays
+ * pending, so that the next request can complete it.
+ */
+static void balloon_flush_run(VirtIOBalloon *s, bool keep_tail)
+{
+    BalloonRun *run = &s->run;
+    uint8_t *host;
+    ram_addr_t pagesize, start, end;
+
+    if (!run->mr) {
+        return;
+    }
+
+    host = memory_region_get_ram_ptr(run->mr);
+    pagesize = qemu_ram_pagesize(memory_region_get_ram_addr(run->mr));
+    if (run->deflate) {
+        start = run->offset & ~(pagesize - 1);
+        end = ROUND_UP(run->offset + run->size, pagesize);
+    } else {
+        start = ROUND_UP(run->offset, pagesize);
+        end = (run->offset + run->size) & ~(pagesize - 1);
+    }
+    if (end > start) {
+        balloon_range(host + start, end - start, run->deflate);
+    }
+
+    if (keep_tail && !run->deflate && end < run->offset + run->size) {
+        if (end > run->offset) {
+            run->size -= end - run->offset;
+            run->offset = end;
+        }
+        return;
+    }
+
+    memory_region_unref(run->mr);
+    run->mr = NULL;
+}
+
+static void balloon_add_page(VirtIOBalloon *s, MemoryRegion *mr,
+                             ram_addr_t offset, bool deflate)
+{
+    BalloonRun *run = &s->run;
+
+    if (run->mr == mr && run->deflate == deflate &&
+        run->offset + run->size == offset) {
+        run->size += BALLOON_PAGE_SIZE;
+        return;
+    }
+
+    balloon_flush_run(s, false);
+    memory_region_ref(mr);
+    run->mr = mr;
+    run->offset = offset;
+    run->size = BALLOON_PAGE_SIZE;
+    run->deflate = deflate;
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -95,14 +159,16 @@ static void balloon_stats_poll_cb(void *opaque)
     VirtIOBalloon *s = opaque;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
-    if (!balloon_stats_supported(s)) {
+    if (!s->stats_vq_elem || !balloon_stats_supported(s)) {
         /* re-schedule */
         balloon_stats_change_timer(s, s->stats_poll_interval);
         return;
     }
 
-    virtqueue_push(s->svq, &s->stats_vq_elem, s->stats_vq_offset);
+    virtqueue_push(s->svq, s->stats_vq_elem, s->stats_vq_offset);
     virtio_notify(vdev, s->svq);
+    g_free(s->stats_vq_elem);
+    s->stats_vq_elem = NULL;
 }
 
 static void balloon_stats_get_all(Object *obj, struct Visitor *v,
@@ -181,14 +247,14 @@ static void balloon_stats_set_poll_interval(Object *obj, struct Visitor *v,
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     MemoryRegionSection section;
 
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         size_t offset = 0;
         uint32_t pfn;
 
-        while (iov_to_buf(elem.out_sg, elem.out_num, offset, &pfn, 4) == 4) {
+        while (iov_to_buf(elem->out_sg, elem->out_num, offset, &pfn, 4) == 4) {
             ram_addr_t pa;
             ram_addr_t addr;
 
@@ -200,31 +266,137 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             if (!int128_nz(section.size) || !memory_region_is_ram(section.mr))
                 continue;
 
-            /* Using memory_region_get_ram_ptr is bending the rules a bit, but
-               should be OK because we only want a single page.  */
+            /* Contiguous pages are handled together, which is bending the
+               rules a bit because memory_region_find only looked at one
+               page.  Runs never cross a RAM region, though.  */
             addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+            balloon_add_page(s, section.mr, addr, vq == s->dvq);
             memory_region_unref(section.mr);
         }
 
-        virtqueue_push(vq, &elem, offset);
+        virtqueue_push(vq, elem, offset);
+        virtio_notify(vdev, vq);
+        g_free(elem);
+    }
+
+    balloon_flush_run(s, true);
+}
+
+static bool free_page_hint_supported(const VirtIOBalloon *s)
+{
+    return s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    uint32_t id;
+    int i;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if (elem->out_num) {
+            /* the guest starts or ends a round of reports */
+            if (iov_to_buf(elem->out_sg, elem->out_num, 0, &id,
+                           sizeof(id)) == sizeof(id)) {
+                id = ldl_p(&id);
+                if (id == s->free_page_hint_cmd_id &&
+                    s->free_page_hint_status == FREE_PAGE_HINT_S_REQUESTED) {
+                    s->free_page_hint_status = FREE_PAGE_HINT_S_START;
+                } else if (id == VIRTIO_BALLOON_CMD_ID_STOP) {
+                    s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+                }
+            }
+        }
+
+        /* each in buffer is a block of free guest pages */
+        if (s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
+        }
+
+        virtqueue_push(vq, elem, 0);
         virtio_notify(vdev, vq);
+        g_free(elem);
+    }
+}
+
+static void virtio_balloon_free_page_set_cmd(VirtIOBalloon *s, uint32_t id,
+                                             uint32_t status)
+{
+    s->free_page_hint_cmd_id = id;
+    s->free_page_hint_status = status;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+/*
+ * Free page hints are only valid between two syncs of the migration
+ * bitmap: hinting stops before each sync and a new round is requested
+ * after it, as long as the guest is running.  Once the migration ends the
+ * guest may reuse the pages it reported.
+ */
+static void virtio_balloon_ram_save_notify(Notifier *notifier, void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    ram_save_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    RamSaveEvent *event = data;
+    uint32_t id;
+
+    if (!(vdev->guest_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT))) {
+        return;
+    }
+
+    switch (*event) {
+    case RAM_SAVE_BEFORE_BITMAP_SYNC:
+        if (s->free_page_hint_status != FREE_PAGE_HINT_S_STOP) {
+            virtio_balloon_free_page_set_cmd(s, VIRTIO_BALLOON_CMD_ID_STOP,
+                                             FREE_PAGE_HINT_S_STOP);
+        }
+        break;
+    case RAM_SAVE_AFTER_BITMAP_SYNC:
+        if (runstate_is_running()) {
+            id = s->free_page_hint_cmd_id_last + 1;
+            if (id < VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN) {
+                id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
+            }
+            s->free_page_hint_cmd_id_last = id;
+            virtio_balloon_free_page_set_cmd(s, id,
+                                             FREE_PAGE_HINT_S_REQUESTED);
+        }
+        break;
+    case RAM_SAVE_END:
+        virtio_balloon_free_page_set_cmd(s, VIRTIO_BALLOON_CMD_ID_DONE,
+                                         FREE_PAGE_HINT_S_STOP);
+        break;
     }
 }
 
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
-    VirtQueueElement *elem = &s->stats_vq_elem;
+    VirtQueueElement *elem;
     VirtIOBalloonStat stat;
     size_t offset = 0;
     qemu_timeval tv;
 
-    if (!virtqueue_pop(vq, elem)) {
+    elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+    if (!elem) {
         goto out;
     }
 
+    if (s->stats_vq_elem) {
+        /* The driver should not post another buffer before getting the
+         * previous one back; return it empty.  */
+        virtqueue_push(vq, s->stats_vq_elem, 0);
+        virtio_notify(vdev, vq);
+        g_free(s->stats_vq_elem);
+    }
+    s->stats_vq_elem = elem;
+
     /* Initialize the stats to get rid of any stale values.  This is only
      * needed to handle the case where a guest supports fewer stats than it
      * used to (ie. it has booted into an old kernel).
@@ -262,8 +434,9 @@ static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
+    config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hint_cmd_id);
 
-    memcpy(config_data, &config, 8);
+    memcpy(config_data, &config, vdev->config_len);
 }
 
 static void virtio_balloon_set_config(VirtIODevice *vdev,
@@ -282,10 +455,24 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
 
 static uint32_t virtio_balloon_get_features(VirtIODevice *vdev, uint32_t f)
 {
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+
     f |= (1 << VIRTIO_BALLOON_F_STATS_VQ);
+    if (!free_page_hint_supported(s)) {
+        f &= ~(1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+    }
     return f;
 }
 
+static void virtio_balloon_reset(VirtIODevice *vdev)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+
+    balloon_flush_run(s, false);
+    s->free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_STOP;
+    s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+}
+
 static void virtio_balloon_stat(void *opaque, BalloonInfo *info)
 {
     VirtIOBalloon *dev = opaque;
@@ -343,7 +530,9 @@ static int virtio_balloon_device_init(VirtIODevice *vdev)
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
     int ret;
 
-    virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON, 8);
+    virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
+                free_page_hint_supported(s) ?
+                sizeof(struct virtio_balloon_config) : 8);
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -356,6 +545,12 @@ static int virtio_balloon_device_init(VirtIODevice *vdev)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (free_page_hint_supported(s)) {
+        s->fvq = virtio_add_queue(vdev, 128,
+                                  virtio_balloon_handle_free_page_vq);
+        s->ram_save_notifier.notify = virtio_balloon_ram_save_notify;
+        ram_save_add_notifier(&s->ram_save_notifier);
+    }
 
     register_savevm(qdev, "virtio-balloon", -1, 1,
                     virtio_balloon_save, virtio_balloon_load, s);
@@ -376,12 +571,23 @@ static int virtio_balloon_device_exit(DeviceState *qdev)
     VirtIODevice *vdev = VIRTIO_DEVICE(qdev);
 
     balloon_stats_destroy_timer(s);
+    balloon_flush_run(s, false);
+    if (free_page_hint_supported(s)) {
+        ram_save_remove_notifier(&s->ram_save_notifier);
+    }
+    g_free(s->stats_vq_elem);
     qemu_remove_balloon_handler(s);
     unregister_savevm(qdev, "virtio-balloon", s);
     virtio_cleanup(vdev);
     return 0;
 }
 
+void virtio_balloon_set_host_features(VirtIOBalloon *s,
+                                      uint32_t host_features)
+{
+    s->host_features = host_features;
+}
+
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -397,6 +603,7 @@ static void virtio_balloon_class_init(ObjectClass *klass, void *data)
     vdc->get_config = virtio_balloon_get_config;
     vdc->set_config = virtio_balloon_set_config;
     vdc->get_features = virtio_balloon_get_features;
+    vdc->reset = virtio_balloon_reset;
 }
 
 static const TypeInfo virtio_balloon_info = {
@@ -487,6 +487,7 @@ static int kvm_virtio_pci_vq_vector_use(VirtIOPCIProxy *proxy,
             return ret;
         }
         irqfd->virq = ret;
+        irqfd->msg = msg;
     }
     irqfd->users++;
     return 0;
@@ -601,24 +602,49 @@ static void kvm_virtio_pci_vector_release(VirtIOPCIProxy *proxy, int nvqs)
     }
 }
 
+static void virtio_pci_vq_unmask_notifier(VirtIOPCIProxy *proxy,
+                                          unsigned int queue_no)
+{
+    VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(proxy->vdev);
+    VirtQueue *vq = virtio_get_queue(proxy->vdev, queue_no);
+    EventNotifier *n = virtio_queue_get_guest_notifier(vq);
+
+    k->guest_notifier_mask(proxy->vdev, queue_no, false);
+    /* Test after unmasking to avoid losing events. */
+    if (k->guest_notifier_pending &&
+        k->guest_notifier_pending(proxy->vdev, queue_no)) {
+        event_notifier_set(n);
+    }
+}
+
 static int virtio_pci_vq_vector_unmask(VirtIOPCIProxy *proxy,
                                        unsigned int queue_no,
                                        unsigned int vector,
                                        MSIMessage msg)
 {
     VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(proxy->vdev);
-    VirtQueue *vq = virtio_get_queue(proxy->vdev, queue_no);
-    EventNotifier *n = virtio_queue_get_guest_notifier(vq);
     VirtIOIRQFD *irqfd;
     int ret = 0;
 
     if (proxy->vector_irqfd) {
         irqfd = &proxy->vector_irqfd[vector];
-        if (irqfd->msg.data != msg.data || irqfd->msg.address != msg.address) {
+        if (k->guest_notifier_mask) {
+            /* The irqfd stays masked until the routing table is committed,
+             * events meanwhile are caught by the pending test on unmask.
+             */
+            ret = kvm_irqchip_update_msi_route_deferred(kvm_state,
+                                                        irqfd->virq, msg);
+        } else if (irqfd->msg.data != msg.data ||
+                   irqfd->msg.address != msg.address) {
             ret = kvm_irqchip_update_msi_route(kvm_state, irqfd->virq, msg);
-            if (ret < 0) {
-                return ret;
-            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        irqfd->msg = msg;
+        if (ret > 0) {
+            set_bit(queue_no, proxy->vq_unmask_pending);
+            return 0;
         }
     }
 
@@ -626,12 +652,7 @@ static int virtio_pci_vq_vector_unmask(VirtIOPCIProxy *proxy,
      * Otherwise, set it up now.
      */
     if (k->guest_notifier_mask) {
-        k->guest_notifier_mask(proxy->vdev, queue_no, false);
-        /* Test after unmasking to avoid losing events. */
-        if (k->guest_notifier_pending &&
-            k->guest_notifier_pending(proxy->vdev, queue_no)) {
-            event_notifier_set(n);
-        }
+        virtio_pci_vq_unmask_notifier(proxy, queue_no);
     } else {
         ret = kvm_virtio_pci_irqfd_use(proxy, queue_no, vector);
     }
@@ -644,6 +665,8 @@ static void virtio_pci_vq_vector_mask(VirtIOPCIProxy *proxy,
 {
     VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(proxy->vdev);
 
+    clear_bit(queue_no, proxy->vq_unmask_pending);
+
     /* If guest supports masking, keep irqfd but mask it.
      * Otherwise, clean it up now.
      */ 
@@ -702,6 +725,22 @@ static void virtio_pci_vector_mask(PCIDevice *dev, unsigned vector)
     }
 }
 
+static void virtio_pci_kvm_routes_committed(Notifier *notifier, void *data)
+{
+    VirtIOPCIProxy *proxy = container_of(notifier, VirtIOPCIProxy,
+                                         kvm_routes_notifier);
+    int queue_no;
+
+    for (queue_no = find_first_bit(proxy->vq_unmask_pending,
+                                   VIRTIO_PCI_QUEUE_MAX);
+         queue_no < VIRTIO_PCI_QUEUE_MAX;
+         queue_no = find_next_bit(proxy->vq_unmask_pending,
+                                  VIRTIO_PCI_QUEUE_MAX, queue_no + 1)) {
+        clear_bit(queue_no, proxy->vq_unmask_pending);
+        virtio_pci_vq_unmask_notifier(proxy, queue_no);
+    }
+}
+
 static void virtio_pci_vector_poll(PCIDevice *dev,
                                    unsigned int vector_start,
                                    unsigned int vector_end)
@@ -789,6 +828,8 @@ static int virtio_pci_set_guest_notifiers(DeviceState *d, int nvqs, bool assign)
     if ((proxy->vector_irqfd || k->guest_notifier_mask) && !assign) {
         msix_unset_vector_notifiers(&proxy->pci_dev);
         if (proxy->vector_irqfd) {
+            kvm_irqchip_remove_routes_notifier(&proxy->kvm_routes_notifier);
+            bitmap_zero(proxy->vq_unmask_pending, VIRTIO_PCI_QUEUE_MAX);
             kvm_virtio_pci_vector_release(proxy, nvqs);
             g_free(proxy->vector_irqfd);
             proxy->vector_irqfd = NULL;
@@ -816,6 +857,9 @@ static int virtio_pci_set_guest_notifiers(DeviceState *d, int nvqs, bool assign)
             if (r < 0) {
                 goto assign_error;
             }
+            proxy->kvm_routes_notifier.notify =
+                virtio_pci_kvm_routes_committed;
+            kvm_irqchip_add_routes_notifier(&proxy->kvm_routes_notifier);
         }
         r = msix_set_vector_notifiers(&proxy->pci_dev,
                                       virtio_pci_vector_unmask,
@@ -831,6 +875,7 @@ static int virtio_pci_set_guest_notifiers(DeviceState *d, int nvqs, bool assign)
 notifiers_error:
     if (with_irqfd) {
         assert(assign);
+        kvm_irqchip_remove_routes_notifier(&proxy->kvm_routes_notifier);
         kvm_virtio_pci_vector_release(proxy, nvqs);
     }
 
@@ -1039,9 +1084,12 @@ static Property virtio_blk_pci_properties[] = {
     DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                     VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
-    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                       DEV_NVECTORS_UNSPECIFIED),
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlkPCI, blk.data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-us", VirtIOBlkPCI, blk.poll_us, 0),
+    DEFINE_PROP_UINT32("x-merge-iov", VirtIOBlkPCI, blk.merge_iov, 0),
 #endif
     DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_VIRTIO_BLK_PROPERTIES(VirtIOBlkPCI, blk),
@@ -1052,6 +1100,11 @@ static int virtio_blk_pci_init(VirtIOPCIProxy *vpci_dev)
 {
     VirtIOBlkPCI *dev = VIRTIO_BLK_PCI(vpci_dev);
     DeviceState *vdev = DEVICE(&dev->vdev);
+
+    /* One vector per request queue plus one for config changes */
+    if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        vpci_dev->nvectors = dev->blk.num_queues + 1;
+    }
     virtio_blk_set_conf(vdev, &(dev->blk));
     qdev_set_parent_bus(vdev, BUS(&vpci_dev->bus));
     if (qdev_init(vdev) < 0) {
@@ -1080,6 +1133,10 @@ static void virtio_blk_pci_instance_init(Object *obj)
     VirtIOBlkPCI *dev = VIRTIO_BLK_PCI(obj);
     object_initialize(&dev->vdev, sizeof(dev->vdev), TYPE_VIRTIO_BLK);
     object_property_add_child(obj, "virtio-backend", OBJECT(&dev->vdev), NULL);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&dev->blk.iothread, NULL);
+#endif
 }
 
 static const TypeInfo virtio_blk_pci_info = {
@@ -1099,6 +1156,10 @@ static Property virtio_scsi_pci_properties[] = {
                        DEV_NVECTORS_UNSPECIFIED),
     DEFINE_VIRTIO_SCSI_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOSCSIPCI, vdev.parent_obj.conf),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOSCSIPCI,
+                    vdev.parent_obj.conf.data_plane, 0, false),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1150,6 +1211,11 @@ static void virtio_scsi_pci_instance_init(Object *obj)
     VirtIOSCSIPCI *dev = VIRTIO_SCSI_PCI(obj);
     object_initialize(&dev->vdev, sizeof(dev->vdev), TYPE_VIRTIO_SCSI);
     object_property_add_child(obj, "virtio-backend", OBJECT(&dev->vdev), NULL);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&dev->vdev.parent_obj.conf.iothread,
+                             NULL);
+#endif
 }
 
 static const TypeInfo virtio_scsi_pci_info = {
@@ -1247,7 +1313,7 @@ static void balloon_pci_stats_set_poll_interval(Object *obj, struct Visitor *v,
 }
 
 static Property virtio_balloon_pci_properties[] = {
-    DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+    DEFINE_VIRTIO_BALLOON_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1262,6 +1328,7 @@ static int virtio_balloon_pci_init(VirtIOPCIProxy *vpci_dev)
         vpci_dev->class_code = PCI_CLASS_OTHERS;
     }
 
+    virtio_balloon_set_host_features(&dev->vdev, vpci_dev->host_features);
     qdev_set_parent_bus(vdev, BUS(&vpci_dev->bus));
     if (qdev_init(vdev) < 0) {
         return -1;
@@ -1393,6 +1460,10 @@ static Property virtio_net_properties[] = {
     DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_NIC_PROPERTIES(VirtIONetPCI, vdev.nic_conf),
     DEFINE_VIRTIO_NET_PROPERTIES(VirtIONetPCI, vdev.net_conf),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONetPCI, vdev.net_conf.data_plane,
+                    0, false),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
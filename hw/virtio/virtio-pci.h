@@ -16,6 +16,7 @@
 #define QEMU_VIRTIO_PCI_H
 
 #include "hw/pci/msi.h"
+#include "qemu/bitmap.h"
 #include "hw/virtio/virtio-blk.h"
 #include "hw/virtio/virtio-net.h"
 #include "hw/virtio/virtio-rng.h"
@@ -92,6 +93,9 @@ struct VirtIOPCIProxy {
     bool ioeventfd_started;
     VirtIOIRQFD *vector_irqfd;
     int nvqs_with_notifiers;
+    /* irqfds that are unmasked once their new MSI route is committed */
+    DECLARE_BITMAP(vq_unmask_pending, VIRTIO_PCI_QUEUE_MAX);
+    Notifier kvm_routes_notifier;
     VirtioBusState bus;
 };
 
@@ -17,7 +17,11 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "qemu/stats.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/xen/xen.h"
+#include "exec/address-spaces.h"
+#include "cpu.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -63,10 +67,22 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+typedef struct VRingCache
+{
+    MemoryRegion *mr;
+    uint8_t *ptr;
+    hwaddr offset;
+    hwaddr len;
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
     hwaddr pa;
+    VRingCache desc_cache;
+    VRingCache avail_cache;
+    VRingCache used_cache;
+    unsigned int cache_gen;
     uint16_t last_avail_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
@@ -98,55 +114,213 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  vq->vring.align);
+    vq->cache_gen = 0;
+}
+
+/*
+ * The rings are read and written on every request, and going through
+ * ld*_phys/st*_phys means an address space lookup for each field.  Each
+ * VirtQueue keeps host pointers to its rings instead, which are looked
+ * up again whenever the memory map changes (vring_cache_gen) or the
+ * queue is reprogrammed.  Rings that are not plain RAM, e.g. when they
+ * straddle two regions, keep using the slow path.
+ */
+static unsigned int vring_cache_gen = 1;
+
+static void vring_cache_commit(MemoryListener *listener)
+{
+    if (++vring_cache_gen == 0) {
+        vring_cache_gen = 1;
+    }
+}
+
+static MemoryListener vring_cache_listener = {
+    .commit = vring_cache_commit,
+};
+
+static void vring_cache_unmap(VRingCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void vring_cache_map(VRingCache *cache, hwaddr pa, hwaddr len)
+{
+    MemoryRegionSection section;
+
+    vring_cache_unmap(cache);
+    if (!pa || !len || xen_enabled()) {
+        return;
+    }
+
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (!section.mr) {
+        return;
+    }
+    if (!memory_region_is_ram(section.mr) || section.readonly ||
+        int128_get64(section.size) < len) {
+        memory_region_unref(section.mr);
+        return;
+    }
+
+    cache->mr = section.mr;
+    cache->offset = section.offset_within_region;
+    cache->ptr = (uint8_t *)memory_region_get_ram_ptr(section.mr) +
+                 cache->offset;
+    cache->len = len;
+}
+
+static void virtqueue_cache_update(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    vring_cache_map(&vq->desc_cache, vq->vring.desc,
+                    num * sizeof(VRingDesc));
+    vring_cache_map(&vq->avail_cache, vq->vring.avail,
+                    offsetof(VRingAvail, ring[num]) + sizeof(uint16_t));
+    vring_cache_map(&vq->used_cache, vq->vring.used,
+                    offsetof(VRingUsed, ring[num]) + sizeof(uint16_t));
+    vq->cache_gen = vring_cache_gen;
+}
+
+static void virtqueue_cache_release(VirtQueue *vq)
+{
+    vring_cache_unmap(&vq->desc_cache);
+    vring_cache_unmap(&vq->avail_cache);
+    vring_cache_unmap(&vq->used_cache);
+    vq->cache_gen = 0;
+}
+
+/* Host pointer to @len bytes at @off in the ring, or NULL.  */
+static inline uint8_t *vring_cache_get(VirtQueue *vq, VRingCache *cache,
+                                       hwaddr off, hwaddr len)
+{
+    if (unlikely(vq->cache_gen != vring_cache_gen)) {
+        virtqueue_cache_update(vq);
+    }
+    if (likely(cache->ptr && off + len <= cache->len)) {
+        return cache->ptr + off;
+    }
+    return NULL;
+}
+
+/* The rings never hold guest code, so only the dirty log needs updating.  */
+static inline void vring_cache_set_dirty(VRingCache *cache, hwaddr off,
+                                         hwaddr len)
+{
+    memory_region_set_dirty(cache->mr, cache->offset + off, len);
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+/* Indirect tables are not cached, only the descriptor table of the ring.  */
+static inline uint8_t *vring_desc_ptr(VirtQueue *vq, hwaddr desc_pa, int i,
+                                      hwaddr field, hwaddr len)
+{
+    if (desc_pa != vq->vring.desc) {
+        return NULL;
+    }
+    return vring_cache_get(vq, &vq->desc_cache,
+                           sizeof(VRingDesc) * i + field, len);
+}
+
+static inline uint64_t vring_desc_addr(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
+    uint8_t *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, addr), 8);
+    if (p) {
+        return ldq_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
     return ldq_phys(pa);
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static inline uint32_t vring_desc_len(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
+    uint8_t *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, len), 4);
+    if (p) {
+        return ldl_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
     return ldl_phys(pa);
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_flags(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
+    uint8_t *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, flags), 2);
+    if (p) {
+        return lduw_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
     return lduw_phys(pa);
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_next(VirtQueue *vq, hwaddr desc_pa, int i)
 {
     hwaddr pa;
+    uint8_t *p = vring_desc_ptr(vq, desc_pa, i, offsetof(VRingDesc, next), 2);
+    if (p) {
+        return lduw_p(p);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
     return lduw_phys(pa);
 }
 
+static inline uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr off)
+{
+    uint8_t *p = vring_cache_get(vq, &vq->avail_cache, off, 2);
+    if (p) {
+        return lduw_p(p);
+    }
+    return lduw_phys(vq->vring.avail + off);
+}
+
+static inline uint16_t vring_used_lduw(VirtQueue *vq, hwaddr off)
+{
+    uint8_t *p = vring_cache_get(vq, &vq->used_cache, off, 2);
+    if (p) {
+        return lduw_p(p);
+    }
+    return lduw_phys(vq->vring.used + off);
+}
+
+static inline void vring_used_stw(VirtQueue *vq, hwaddr off, uint16_t val)
+{
+    uint8_t *p = vring_cache_get(vq, &vq->used_cache, off, 2);
+    if (p) {
+        stw_p(p, val);
+        vring_cache_set_dirty(&vq->used_cache, off, 2);
+        return;
+    }
+    stw_phys(vq->vring.used + off, val);
+}
+
+static inline void vring_used_stl(VirtQueue *vq, hwaddr off, uint32_t val)
+{
+    uint8_t *p = vring_cache_get(vq, &vq->used_cache, off, 4);
+    if (p) {
+        stl_p(p, val);
+        vring_cache_set_dirty(&vq->used_cache, off, 4);
+        return;
+    }
+    stl_phys(vq->vring.used + off, val);
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -156,54 +330,42 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+    vring_used_stw(vq, off, vring_used_lduw(vq, off) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+    vring_used_stw(vq, off, vring_used_lduw(vq, off) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    stw_phys(pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -232,14 +394,11 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(const VirtQueueElement *elem, unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -255,6 +414,27 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/* Give back the last element returned by virtqueue_pop, of which LEN
+   bytes were written, without using it.  Several elements must be
+   discarded in the reverse order in which they were popped.  */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len)
+{
+    trace_virtqueue_discard(vq, elem, len);
+
+    vq->last_avail_idx--;
+    vq->inuse--;
+    virtqueue_unmap_sg(elem, len);
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(elem, len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
@@ -320,17 +500,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
+static unsigned virtqueue_next_desc(VirtQueue *vq, hwaddr desc_pa,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(vq, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -362,8 +542,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -376,8 +556,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(desc_pa, i);
+            max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+            desc_pa = vring_desc_addr(vq, desc_pa, i);
             num_bufs = i = 0;
         }
 
@@ -388,15 +568,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
+                in_total += vring_desc_len(vq, desc_pa, i);
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += vring_desc_len(vq, desc_pa, i);
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -437,16 +617,42 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = g_malloc(out_sg_end);
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
-    unsigned int i, head, max;
+    unsigned int i, head, max, out_num, in_num;
     hwaddr desc_pa = vq->vring.desc;
+    VirtQueueElement *elem;
+    /* the chain is collected here first, to learn its length */
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
 
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return NULL;
+    }
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    out_num = in_num = 0;
 
     max = vq->vring.num;
 
@@ -455,57 +661,154 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(vq, desc_pa, i);
         i = 0;
     }
 
-    /* Collect all the descriptors */
+    /* Collect all the descriptors.  Read descriptors fill the arrays
+     * from the start, write descriptors from the end. */
     do {
-        struct iovec *sg;
+        unsigned int n;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (in_num + out_num >= VIRTQUEUE_MAX_SIZE) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+            n = VIRTQUEUE_MAX_SIZE - 1 - in_num++;
         } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
+            if (in_num + out_num >= VIRTQUEUE_MAX_SIZE) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            n = out_num++;
         }
-
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        addr[n] = vring_desc_addr(vq, desc_pa, i);
+        iov[n].iov_len = vring_desc_len(vq, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((in_num + out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
-    /* Now map what we have collected */
+    /* Now copy what we have collected and map it */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[VIRTQUEUE_MAX_SIZE - 1 - i];
+        elem->in_sg[i] = iov[VIRTQUEUE_MAX_SIZE - 1 - i];
+    }
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
     virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
 
-    elem->index = head;
-
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/* Reading and writing a structure directly to QEMUFile is *awful*, but
+ * it is what QEMU has always done by mistake.  We can change it sooner
+ * or later by bumping the version number of the affected vm states.
+ * In the meanwhile, since the in-memory layout of VirtQueueElement
+ * has changed, we need to marshal to and from the layout that was
+ * used before the change.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElement *elem;
+    VirtQueueElementOld *data = g_new(VirtQueueElementOld, 1);
+    int i;
+
+    qemu_get_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    if (data->in_num > VIRTQUEUE_MAX_SIZE ||
+        data->out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element in migration stream");
+        exit(1);
+    }
+
+    elem = virtqueue_alloc_element(sz, data->out_num, data->in_num);
+    elem->index = data->index;
+
+    for (i = 0; i < elem->in_num; i++) {
+        elem->in_addr[i] = data->in_addr[i];
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        elem->out_addr[i] = data->out_addr[i];
+    }
+
+    for (i = 0; i < elem->in_num; i++) {
+        /* Base is overwritten by virtqueue_map_sg.  */
+        elem->in_sg[i].iov_base = 0;
+        elem->in_sg[i].iov_len = data->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        /* Base is overwritten by virtqueue_map_sg.  */
+        elem->out_sg[i].iov_base = 0;
+        elem->out_sg[i].iov_len = data->out_sg[i].iov_len;
+    }
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    g_free(data);
+    return elem;
+}
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *data = g_new0(VirtQueueElementOld, 1);
+    int i;
+
+    data->index = elem->index;
+    data->in_num = elem->in_num;
+    data->out_num = elem->out_num;
+
+    for (i = 0; i < elem->in_num; i++) {
+        data->in_addr[i] = elem->in_addr[i];
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        data->out_addr[i] = elem->out_addr[i];
+    }
+
+    for (i = 0; i < elem->in_num; i++) {
+        /* Base is overwritten by virtqueue_map_sg when loading.  Do not
+         * save it, as it would leak the QEMU address space layout.  */
+        data->in_sg[i].iov_len = elem->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        /* Do not save iov_base as above.  */
+        data->out_sg[i].iov_len = elem->out_sg[i].iov_len;
+    }
+    qemu_put_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    g_free(data);
 }
 
 /* virtio device */
@@ -560,6 +863,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pa = 0;
+        virtqueue_cache_release(&vdev->vq[i]);
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -717,6 +1021,7 @@ void virtio_queue_notify_vq(VirtQueue *vq)
     if (vq->vring.desc) {
         VirtIODevice *vdev = vq->vdev;
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        stats_counter_inc(vdev->stat_kicks);
         vq->handle_output(vdev, vq);
     }
 }
@@ -765,6 +1070,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_cache_release(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -813,10 +1119,12 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (!vring_notify(vdev, vq)) {
+        stats_counter_inc(vdev->stat_interrupts_suppressed);
         return;
     }
 
     trace_virtio_notify(vdev, vq);
+    stats_counter_inc(vdev->stat_interrupts);
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -958,9 +1266,15 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_cache_release(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
+    stats_free(vdev->stats);
 }
 
 static void virtio_vmstate_change(void *opaque, int running, RunState state)
@@ -987,7 +1301,14 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
+    static bool vring_cache_registered;
+    char *path;
     int i;
+
+    if (!vring_cache_registered) {
+        memory_listener_register(&vring_cache_listener, &address_space_memory);
+        vring_cache_registered = true;
+    }
     vdev->device_id = device_id;
     vdev->status = 0;
     vdev->isr = 0;
@@ -1010,6 +1331,15 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     }
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change,
                                                      vdev);
+
+    /* realize has put the device in the composition tree already */
+    path = object_get_canonical_path(OBJECT(vdev));
+    vdev->stats = stats_new("virtio%s", path);
+    g_free(path);
+    vdev->stat_kicks = stats_add_counter(vdev->stats, "kicks");
+    vdev->stat_interrupts = stats_add_counter(vdev->stats, "interrupts");
+    vdev->stat_interrupts_suppressed =
+        stats_add_counter(vdev->stats, "interrupts-suppressed");
 }
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
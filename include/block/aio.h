@@ -19,6 +19,7 @@
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
+#include "qemu/rfifolock.h"
 #include "qemu/timer.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
@@ -47,6 +48,9 @@ typedef void IOHandler(void *opaque);
 struct AioContext {
     GSource source;
 
+    /* Protects all fields from multi-threaded access */
+    RFifoLock lock;
+
     /* The list of registered AIO handlers */
     QLIST_HEAD(, AioHandler) aio_handlers;
 
@@ -66,17 +70,50 @@ struct AioContext {
      */
     int walking_bh;
 
+    /* Bottom halves that were scheduled since the last aio_bh_poll, most
+     * recent first.  Any thread can push to it with atomic operations, only
+     * aio_bh_poll takes the whole list away.
+     */
+    struct QEMUBH *scheduled_bh;
+
+    /* Bottom halves taken from scheduled_bh that still have to run.  Only
+     * used by aio_bh_poll, but nested calls share it.
+     */
+    struct QEMUBH *running_bh;
+
+    /* Set by qemu_bh_delete, so that aio_bh_poll knows when to look for
+     * bottom halves to free.
+     */
+    bool deleted_bh;
+
     /* Used for aio_notify.  */
     EventNotifier notifier;
 
+    /* Whether notifier was set and the event loop has not seen it yet.  A
+     * further aio_notify does not have to write to it again.
+     */
+    bool notified;
+
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
 
+#ifdef CONFIG_EPOLL_CREATE1
+    /* epoll(7) state used when there are many handlers */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
+
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Statistics, updated by the thread that runs the event loop */
+    struct Stats *stats;
+    struct StatsCounter *stat_polls;
+    struct StatsCounter *stat_bh_runs;
 };
 
 /**
@@ -104,6 +141,20 @@ void aio_context_ref(AioContext *ctx);
  */
 void aio_context_unref(AioContext *ctx);
 
+/* Take ownership of the AioContext.  If the AioContext will be shared between
+ * threads, a thread must have ownership when calling aio_poll().
+ *
+ * Note that multiple threads calling aio_poll() means timers, BHs, and
+ * callbacks may be invoked from a different thread than they were registered
+ * from.  Therefore, code must use AioContext acquire/release or use
+ * fine-grained synchronization to protect shared state if other threads will
+ * be accessing it simultaneously.
+ */
+void aio_context_acquire(AioContext *ctx);
+
+/* Relinquish ownership of the AioContext. */
+void aio_context_release(AioContext *ctx);
+
 /**
  * aio_bh_new: Allocate a new bottom half structure.
  *
@@ -143,9 +194,9 @@ int aio_bh_poll(AioContext *ctx);
  * Scheduling a bottom half interrupts the main loop and causes the
  * execution of the callback that was passed to qemu_bh_new.
  *
- * Bottom halves that are scheduled from a bottom half handler are instantly
- * invoked.  This can create an infinite loop if a bottom half handler
- * schedules itself.
+ * Bottom halves that are scheduled from a bottom half handler are invoked
+ * by the next aio_bh_poll.  This can create an infinite loop if a bottom
+ * half handler schedules itself.
  *
  * @bh: The bottom half to be scheduled.
  */
@@ -225,6 +276,12 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Set up and tear down the polling backend of a new AioContext.  These are
+ * only called by aio_context_new() and the context's finalizer.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -36,10 +36,12 @@
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
+#include "qemu/interval-tree.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -52,14 +54,38 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 
+struct BdrvDirtyBitmap {
+    char *name;
+    HBitmap *bitmap;        /* one item per sector */
+    int64_t size;           /* in sectors */
+    bool persistent;        /* saved in the image file on close */
+    bool in_use;            /* owned by a running block job */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+/*
+ * Latency histogram of one I/O type.  Bin i counts the requests with
+ * boundaries[i - 1] <= latency < boundaries[i], the first bin starting at
+ * zero and the last one being unbounded.  Each BlockLatencySource has its
+ * own row of bins, so bins[src * nbins + i] is bin i of source src.
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;                  /* 0 if the histogram is disabled */
+    uint64_t *boundaries;      /* nbins - 1 values in nanoseconds */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BdrvTrackedRequest {
     BlockDriverState *bs;
     int64_t sector_num;
     int nb_sectors;
     bool is_write;
-    QLIST_ENTRY(BdrvTrackedRequest) list;
+    QEMUIOVector *qiov; /* data of a write, NULL when writing zeroes */
+    int ret; /* result of a write, for the after_write notifiers */
+    IntervalTreeNode node; /* in bs->tracked_requests */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 } BdrvTrackedRequest;
@@ -163,6 +189,12 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Coroutine version of bdrv_write_compressed.  Drivers implementing it
+     * may have several compressed writes in flight at the same time.
+     */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -178,6 +210,12 @@ struct BlockDriver {
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockCacheStatsList *(*bdrv_get_cache_stats)(const BlockDriverState *bs);
+
+    /* Returns a host file descriptor that holds the guest data at the
+     * same offsets, for transfers that bypass the block layer.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -227,6 +265,16 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Returns true if persistent dirty bitmaps of @bs can be saved in the
+     * image file when it is closed.
+     */
+    bool (*bdrv_can_store_dirty_bitmaps)(BlockDriverState *bs);
+
+    /* queue requests between bdrv_io_plug() and bdrv_io_unplug() */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -269,11 +317,18 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after write request is processed */
+    NotifierWithReturnList after_write_notifiers;
+
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* I/O throttling */
-    ThrottleState throttle_state;
+    /* number of in-flight read-modify-write requests */
+    unsigned int serialising_in_flight;
+
+    /* I/O throttling, see block/throttle-groups.c */
+    struct ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) round_robin;
     CoQueue      throttled_reqs[2];
     bool         io_limits_enabled;
 
@@ -282,6 +337,7 @@ struct BlockDriverState {
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    BlockLatencyHistogram latency_histogram[BDRV_MAX_IOTYPE];
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -292,9 +348,17 @@ struct BlockDriverState {
     /* the memory alignment required for the buffers handled by this driver */
     int buffer_alignment;
 
+    /* alignment of request offsets and lengths, and of buffers, that the
+     * driver needs; smaller requests are padded by the block layer */
+    int request_alignment;
+    int mem_alignment;
+
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
+    /* convert all-zero writes into write zeroes (and possibly discards) */
+    BlockdevDetectZeroesOptions detect_zeroes;
+
     /* NOTE: the following infos are only hints for real hardware
        drivers. They are not used by the block driver */
     BlockdevOnError on_read_error, on_write_error;
@@ -302,11 +366,12 @@ struct BlockDriverState {
     BlockDeviceIoStatus iostatus;
     char device_name[32];
     HBitmap *dirty_bitmap;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int refcnt;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
-    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTree tracked_requests;
 
     /* long-running background operation */
     BlockJob *job;
@@ -329,6 +394,16 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_add_after_write_notifier:
+ *
+ * Register a callback that is invoked when a write request has completed,
+ * after the dirty bitmaps were updated but before the request stops
+ * blocking overlapping requests.  The request's @ret field holds its result.
+ */
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier);
+
 /**
  * bdrv_get_aio_context:
  *
@@ -389,8 +464,9 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @granularity: The chosen granularity for the dirty bitmap.
- * @buf_size: The amount of data that can be in flight at one time.
+ * @buf_size: The most data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
+ * @copy_mode: Whether guest writes wait until they are on @target too.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -404,7 +480,8 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
@@ -415,6 +492,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
+ * @sync_bitmap: The dirty bitmap to use if @sync_mode is
+ *               %MIRROR_SYNC_MODE_INCREMENTAL, %NULL otherwise.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -425,6 +504,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
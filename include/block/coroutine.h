@@ -96,6 +96,15 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Change the number of free coroutines kept for reuse
+ *
+ * Users that keep many coroutines in flight, such as block devices, reserve
+ * room in the pool when they are created and give it back with a negative
+ * @n when they go away, so that the pool follows the expected concurrency.
+ */
+void qemu_coroutine_adjust_pool_size(int n);
+
 
 
 /**
@@ -61,6 +61,14 @@ enum {
 /* Maximum size of a single READ/WRITE data buffer */
 #define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
 
+/* Requests in flight on one connection.  The protocol has no way to agree
+ * on a queue depth, and it does not need one: a server that has enough
+ * requests stops reading from the socket, so TCP flow control holds the
+ * client back.  Each side only bounds the requests it has to track.
+ */
+#define NBD_DEFAULT_MAX_REQUESTS 64
+#define NBD_MAX_REQUESTS 1024
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_incoming(const char *address, uint16_t port);
 int tcp_socket_incoming_spec(const char *address_and_port);
@@ -90,6 +98,7 @@ BlockDriverState *nbd_export_get_blockdev(NBDExport *exp);
 
 NBDExport *nbd_export_find(const char *name);
 void nbd_export_set_name(NBDExport *exp, const char *name);
+void nbd_export_set_zero_copy(NBDExport *exp, bool enable);
 void nbd_export_close_all(void);
 
 NBDClient *nbd_client_new(NBDExport *exp, int csock,
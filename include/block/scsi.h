@@ -102,6 +102,7 @@
 #define READ_REVERSE_16       0x81
 #define ALLOW_OVERWRITE       0x82
 #define EXTENDED_COPY         0x83
+#define RECEIVE_COPY_RESULTS  0x84
 #define ATA_PASSTHROUGH_16    0x85
 #define ACCESS_CONTROL_IN     0x86
 #define ACCESS_CONTROL_OUT    0x87
@@ -148,6 +149,12 @@
  */
 #define SAI_READ_CAPACITY_16  0x10
 
+/*
+ * EXTENDED COPY and RECEIVE COPY RESULTS service action codes
+ */
+#define XCOPY_LID1                  0x00
+#define RCR_OPERATING_PARAMETERS    0x03
+
 /*
  * READ POSITION service action codes
  */
@@ -31,6 +31,12 @@ typedef struct ThreadPool ThreadPool;
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
+/* Keep at least @min_threads workers alive even when idle, never run more
+ * than @max_threads.  The defaults are 0 and 64.
+ */
+void thread_pool_set_limits(ThreadPool *pool, int min_threads,
+                            int max_threads);
+
 BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockDriverCompletionFunc *cb, void *opaque);
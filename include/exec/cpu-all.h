@@ -355,6 +355,8 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+target_ulong page_find_range_empty(target_ulong min, target_ulong end,
+                                   target_ulong size, target_ulong align);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
@@ -454,6 +456,7 @@ typedef struct RAMBlock {
      */
     QTAILQ_ENTRY(RAMBlock) next;
     int fd;
+    ram_addr_t page_size; /* page size of the backing memory */
 } RAMBlock;
 
 typedef struct RAMList {
@@ -480,7 +483,25 @@ extern int mem_prealloc;
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
 
+/* Number of entries in the softmmu TLB of MMU mode @mmu_idx.  */
+static inline uintptr_t tlb_n_entries(CPUArchState *env, int mmu_idx)
+{
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+    return (env->tlb_mask[mmu_idx] >> CPU_TLB_ENTRY_BITS) + 1;
+#else
+    return CPU_TLB_SIZE;
+#endif
+}
+
+/* Index of the softmmu TLB entry of MMU mode @mmu_idx for @addr.  */
+static inline uintptr_t tlb_index(CPUArchState *env, int mmu_idx,
+                                  target_ulong addr)
+{
+    return (addr >> TARGET_PAGE_BITS) & (tlb_n_entries(env, mmu_idx) - 1);
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int count);
 ram_addr_t last_ram_offset(void);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
@@ -72,9 +72,19 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+#include "tcg-target.h"
+
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The TCG backend loads the index mask from env, so each MMU mode's TLB
+   is resized at flush time between these bounds (see tlb_mmu_resize in
+   cputlb.c).  */
+#define CPU_TLB_DYN_MIN_BITS CPU_TLB_BITS
+#define CPU_TLB_DYN_MAX_BITS 16
+#endif
+
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
 #else
@@ -103,16 +113,52 @@ typedef struct CPUTLBEntry {
 
 QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 
+/* Entries evicted from tlb_table by tlb_set_page are kept in a small
+   fully associative victim TLB, which the softmmu slow path searches
+   before walking the guest page tables.  */
+#define CPU_VTLB_SIZE 8
+
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+typedef struct CPUTLBDesc {
+    /* Start of the current usage window (QEMU_CLOCK_REALTIME, in ns).  */
+    int64_t window_begin_ns;
+    /* Largest number of valid entries seen in the current window.  */
+    size_t window_max_entries;
+    /* Number of valid entries in the table right now.  */
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+#define CPU_COMMON_TLB_STATIC
+
+/* These are allocated by tlb_init and must survive CPU reset.  tlb_mask
+   is (number of entries - 1) << CPU_TLB_ENTRY_BITS, i.e. the mask that
+   turns a shifted virtual address into a byte offset in tlb_table.  */
+#define CPU_COMMON_TLB_DYN                                              \
+    CPUTLBDesc tlb_desc[NB_MMU_MODES];                                  \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    hwaddr *iotlb[NB_MMU_MODES];
+#else
+#define CPU_COMMON_TLB_STATIC                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+
+#define CPU_COMMON_TLB_DYN
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPU_COMMON_TLB_STATIC                                               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    unsigned int vtlb_index;
 
 #else
 
 #define CPU_COMMON_TLB
+#define CPU_COMMON_TLB_DYN
 
 #endif
 
@@ -172,6 +218,8 @@ typedef struct CPUWatchpoint {
     QTAILQ_HEAD(watchpoints_head, CPUWatchpoint) watchpoints;            \
     CPUWatchpoint *watchpoint_hit;                                      \
                                                                         \
+    CPU_COMMON_TLB_DYN                                                  \
+                                                                        \
     /* Core interrupt code */                                           \
     sigjmp_buf jmp_env;                                                 \
     int exception_index;                                                \
@@ -87,6 +87,10 @@ void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb);
+/* see "tb-profile" in the monitor */
+extern bool tb_profile_enabled;
+void tb_profile_set(CPUArchState *env, bool enable);
 void cpu_exec_init(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUArchState *env1);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
@@ -96,6 +100,7 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
                               int is_cpu_write_access);
 #if !defined(CONFIG_USER_ONLY)
 /* cputlb.c */
+void tlb_init(CPUArchState *env);
 void tlb_flush_page(CPUArchState *env, target_ulong addr);
 void tlb_flush(CPUArchState *env, int flush_global);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
@@ -139,9 +144,11 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_TRACE       0x10000 /* Retranslated as a superblock.  */
+#define CF_INVALID     0x20000 /* Removed by tb_phys_invalidate.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -166,10 +173,38 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* number of times cpu_exec dispatched to this TB */
+    uint32_t exec_count;
+    /* profiling data, only updated while tb_profile_enabled is set */
+    uint32_t tlb_miss_count;
+    uint32_t helper_calls;      /* calls emitted in the TB, not executed */
+    int64_t gen_time;           /* translation time in ns */
 };
 
+/* Targets that define TARGET_HAS_TB_TRACE follow direct jumps when
+   translating with CF_TRACE.  A TB is retranslated that way once
+   cpu_exec has dispatched to it this many times.  */
+#define TB_TRACE_THRESHOLD 256
+
 #include "exec/spinlock.h"
 
+/* The code buffer and tbs[] are split into regions.  They are filled
+   in turn, and when the last one is full the oldest region is emptied
+   and reused, instead of flushing all the translations.  */
+#define TB_MAX_REGIONS 8
+
+typedef struct TBRegion {
+    uint8_t *code_start;
+    /* no TB starts past code_limit, so that a TB always fits */
+    uint8_t *code_limit;
+    /* end of the generated code, except for the current region where
+       it is tcg_ctx.code_gen_ptr */
+    uint8_t *code_ptr;
+    TranslationBlock *tbs;
+    int nb_tbs;
+    int max_tbs;
+} TBRegion;
+
 typedef struct TBContext TBContext;
 
 struct TBContext {
@@ -177,12 +212,18 @@ struct TBContext {
     TranslationBlock *tbs;
     TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
     int nb_tbs;
+    TBRegion regions[TB_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
     /* any access to the tbs or the page table must use this lock */
     spinlock_t tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_region_retire_count;
     int tb_phys_invalidate_count;
+    int tb_trace_count;
+    int smc_hot_page_count;
 
     int tb_invalidated_flag;
 };
@@ -333,6 +374,12 @@ bool io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
 
+/* softmmu slow path statistics, see "info jit" */
+extern int tlb_victim_hit_count;
+extern int tlb_fill_count;
+extern int tlb_resize_count;
+void tb_profile_tlb_miss(uintptr_t retaddr);
+
 uint8_t helper_ldb_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint16_t helper_ldw_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint32_t helper_ldl_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
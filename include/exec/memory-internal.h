@@ -97,10 +97,16 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length);
     start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_set_dirty_flags(addr, dirty_flags);
+    if ((dirty_flags & 0xff) == 0xff) {
+        /* Common case of marking pages dirty for every client.  */
+        memset(&ram_list.phys_dirty[start >> TARGET_PAGE_BITS], 0xff,
+               (end - start) >> TARGET_PAGE_BITS);
+    } else {
+        for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
+            cpu_physical_memory_set_dirty_flags(addr, dirty_flags);
+        }
     }
-    xen_modified_memory(addr, length);
+    xen_modified_memory(start, length);
 }
 
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
@@ -118,6 +124,15 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+uint64_t cpu_physical_memory_sync_dirty_bitmap(ram_addr_t start,
+                                               ram_addr_t length,
+                                               int dirty_flag,
+                                               unsigned long *bitmap);
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty(
+    ram_addr_t start, ram_addr_t length, int dirty_flag);
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length);
 
 #endif
 
@@ -31,6 +31,7 @@
 #define MAX_PHYS_ADDR            (((hwaddr)1 << MAX_PHYS_ADDR_SPACE_BITS) - 1)
 
 typedef struct MemoryRegionOps MemoryRegionOps;
+typedef struct MemoryRegionPostedRange MemoryRegionPostedRange;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
 /* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
@@ -63,6 +64,12 @@ struct IOMMUTLBEntry {
     IOMMUAccessFlags perm;
 };
 
+/* A range of registers, relative to the start of a region */
+struct MemoryRegionPostedRange {
+    hwaddr offset;
+    uint64_t size;
+};
+
 /*
  * Memory region callbacks
  */
@@ -115,6 +122,16 @@ struct MemoryRegionOps {
          bool unaligned;
     } impl;
 
+    /* Registers whose writes may be posted: nothing observes them until
+     * the guest accesses another register of the region.  The array ends
+     * with an entry of size 0.  memory_region_init_io() makes the ranges
+     * coalesced, so with KVM the writes are queued in the coalesced MMIO
+     * ring and only replayed before the next access that exits to QEMU.
+     * Doorbells that start work the guest then waits for, without any
+     * further register access, must not be listed.
+     */
+    const MemoryRegionPostedRange *posted_writes;
+
     /* If .read and .write are not present, old_mmio may be used for
      * backwards compatibility with old mmio registration
      */
@@ -126,6 +143,16 @@ typedef struct MemoryRegionIOMMUOps MemoryRegionIOMMUOps;
 struct MemoryRegionIOMMUOps {
     /* Return a TLB entry that contains a given address. */
     IOMMUTLBEntry (*translate)(MemoryRegion *iommu, hwaddr addr);
+    /*
+     * Called when the first notifier is registered and when the last one
+     * is removed.  Optional.
+     */
+    void (*notify_changed)(MemoryRegion *iommu, bool notified);
+    /*
+     * Return the file descriptor of the translation table if the KVM
+     * kernel module updates it on its own, or -1.  Optional.
+     */
+    int (*get_kvm_fd)(MemoryRegion *iommu);
 };
 
 typedef struct CoalescedMemoryRange CoalescedMemoryRange;
@@ -151,6 +178,7 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool thread_safe;
     MemoryRegion *alias;
     hwaddr alias_offset;
     int priority;
@@ -163,6 +191,7 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     NotifierList iommu_notify;
+    unsigned iommu_batch_depth;
 };
 
 typedef struct MemoryListener MemoryListener;
@@ -211,6 +240,8 @@ struct AddressSpace {
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
     MemoryListener dispatch_listener;
+    struct BounceBuffer *bounce;
+    int bounce_in_use;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
@@ -477,7 +508,8 @@ void memory_region_notify_iommu(MemoryRegion *mr,
  * @mr: the memory region to observe
  * @n: the notifier to be added; the notifier receives a pointer to an
  *     #IOMMUTLBEntry as the opaque value; the pointer ceases to be
- *     valid on exit from the notifier.
+ *     valid on exit from the notifier.  At the end of a batch of updates
+ *     the notifier is called with %NULL instead.
  */
 void memory_region_register_iommu_notifier(MemoryRegion *mr, Notifier *n);
 
@@ -485,9 +517,50 @@ void memory_region_register_iommu_notifier(MemoryRegion *mr, Notifier *n);
  * memory_region_unregister_iommu_notifier: unregister a notifier for
  * changes to IOMMU translation entries.
  *
+ * @mr: the memory region which was observed
  * @n: the notifier to be removed.
  */
-void memory_region_unregister_iommu_notifier(Notifier *n);
+void memory_region_unregister_iommu_notifier(MemoryRegion *mr, Notifier *n);
+
+/**
+ * memory_region_iommu_get_kvm_fd: get the KVM handle of a translation table
+ *
+ * Returns the file descriptor of the table if guest updates to it are
+ * handled by the KVM kernel module without notifying QEMU, or -1.
+ *
+ * @mr: the IOMMU memory region being queried
+ */
+int memory_region_iommu_get_kvm_fd(MemoryRegion *mr);
+
+/**
+ * memory_region_iommu_batch_begin: start a batch of IOMMU translation updates
+ *
+ * Until the matching memory_region_iommu_batch_end(), notifiers may defer
+ * acting on the entries they receive, so that updates of consecutive
+ * translations can be applied together.  Batches can nest.
+ *
+ * @mr: the IOMMU memory region being updated
+ */
+void memory_region_iommu_batch_begin(MemoryRegion *mr);
+
+/**
+ * memory_region_iommu_batch_end: end a batch of IOMMU translation updates
+ *
+ * Ending the outermost batch calls the notifiers with a %NULL entry.
+ *
+ * @mr: the IOMMU memory region being updated
+ */
+void memory_region_iommu_batch_end(MemoryRegion *mr);
+
+/**
+ * memory_region_iommu_in_batch: check whether updates to an IOMMU are batched
+ *
+ * Returns %true between memory_region_iommu_batch_begin() and the matching
+ * memory_region_iommu_batch_end().
+ *
+ * @mr: the IOMMU memory region being queried
+ */
+bool memory_region_iommu_in_batch(MemoryRegion *mr);
 
 /**
  * memory_region_name: get a memory region's name
@@ -586,6 +659,63 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+
+/**
+ * memory_region_sync_dirty_to_bitmap: Move the dirty state of a range of
+ *                                     pages into a bitmap.
+ *
+ * Clears the dirty flags of @client for the range and sets the matching
+ * bits in @bitmap, examining the flags of a long word's worth of pages at a
+ * time.  Cheaper than calling memory_region_test_and_clear_dirty() for
+ * every page.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region); page aligned.
+ * @size: the size of the range; page aligned.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ * @bitmap: bitmap indexed by ram_addr_t page number.
+ *
+ * Returns the number of bits that were newly set in @bitmap.
+ */
+uint64_t memory_region_sync_dirty_to_bitmap(MemoryRegion *mr, hwaddr addr,
+                                            hwaddr size, unsigned client,
+                                            unsigned long *bitmap);
+typedef struct DirtyBitmapSnapshot DirtyBitmapSnapshot;
+
+/**
+ * memory_region_snapshot_and_clear_dirty: Get a snapshot of the dirty state
+ *                                         of a range and clear it.
+ *
+ * Synchronizes the dirty log for the range only (see
+ * memory_region_sync_dirty_range()), then moves the dirty flags of @client
+ * into a bitmap covering just that range.  Query the snapshot with
+ * memory_region_snapshot_get_dirty() and free it with g_free().
+ *
+ * @mr: the memory region being queried.
+ * @addr: the start of the range, relative to the start of the region.
+ * @size: the size of the range.
+ * @client: the user of the logging information; typically %DIRTY_MEMORY_VGA.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client);
+
+/**
+ * memory_region_snapshot_get_dirty: Check whether a range of bytes was dirty
+ *                                   in a snapshot.
+ *
+ * @mr: the memory region the snapshot was taken of.
+ * @snap: the snapshot from memory_region_snapshot_and_clear_dirty().
+ * @addr: the start of the range, relative to the start of the region; must
+ *        be within the range of the snapshot.
+ * @size: the size of the range.
+ */
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -597,6 +727,22 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_sync_dirty_range: Synchronize the dirty bitmap for part of
+ *                                 a region with any external TLBs (e.g. kvm)
+ *
+ * Like memory_region_sync_dirty_bitmap(), but only the given range is
+ * guaranteed to be up to date afterwards.  This is cheaper for large
+ * regions of which only a small part is of interest, such as the visible
+ * part of a framebuffer.
+ *
+ * @mr: the region being flushed.
+ * @addr: the start of the range, relative to the start of the region.
+ * @size: the size of the range.
+ */
+void memory_region_sync_dirty_range(MemoryRegion *mr, hwaddr addr,
+                                    hwaddr size);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -699,6 +845,28 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_set_thread_safe: Declare that the region's callbacks do not
+ *                                need the global mutex.
+ *
+ * Accesses from KVM vCPU exits to a thread-safe region are dispatched without
+ * taking the iothread mutex.  The region's callbacks must then provide their
+ * own locking and must not take the iothread mutex themselves.  Regions that
+ * flush coalesced MMIO are always accessed with the mutex held.
+ *
+ * @mr: the memory region to be updated.
+ * @thread_safe: whether the region can be accessed without the global mutex.
+ */
+void memory_region_set_thread_safe(MemoryRegion *mr, bool thread_safe);
+
+/**
+ * memory_region_is_thread_safe: check whether a memory region can be
+ *                               accessed without the global mutex
+ *
+ * @mr: the memory region being queried
+ */
+bool memory_region_is_thread_safe(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -955,6 +1123,24 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name);
  */
 void address_space_destroy(AddressSpace *as);
 
+/**
+ * address_space_rw_unlocked: access a thread-safe region of an address space
+ *                            without holding the global mutex.
+ *
+ * Performs the access and returns true only if the whole of it maps to a
+ * single thread-safe I/O region (see memory_region_set_thread_safe()).
+ * Otherwise nothing is accessed and false is returned; the caller must then
+ * take the global mutex and use address_space_rw().
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @buf: buffer with the data transferred
+ * @len: the number of bytes to transfer
+ * @is_write: indicates the transfer direction
+ */
+bool address_space_rw_unlocked(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write);
+
 /**
  * address_space_rw: read from or write to an address space.
  *
@@ -997,6 +1183,9 @@ bool address_space_read(AddressSpace *as, hwaddr addr, uint8_t *buf, int len);
 /* address_space_translate: translate an address range into an address space
  * into a MemoryRegion and an address range into that section
  *
+ * Must be called with the iothread mutex held or within an RCU critical
+ * section; the returned region is only valid until either is released.
+ *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
  * @xlat: pointer to address within the returned memory region section's
@@ -46,6 +46,7 @@ struct PCIHostState {
     MemoryRegion mmcfg;
     uint32_t config_reg;
     PCIBus *bus;
+    PCIDevice *config_dev;      /* last device addressed, or NULL */
 
     QLIST_ENTRY(PCIHostState) next;
 };
@@ -62,6 +63,9 @@ void pci_host_config_write_common(PCIDevice *pci_dev, uint32_t addr,
 uint32_t pci_host_config_read_common(PCIDevice *pci_dev, uint32_t addr,
                                      uint32_t limit, uint32_t len);
 
+PCIDevice *pci_host_find_device(PCIHostState *s, uint8_t bus_num,
+                                 uint8_t devfn);
+
 void pci_data_write(PCIBus *s, uint32_t addr, uint32_t val, int len);
 uint32_t pci_data_read(PCIBus *s, uint32_t addr, int len);
 
@@ -17,14 +17,30 @@
 #include "exec/memory.h"
 #include "qemu/thread.h"
 
+/* Granularity of the dirty bitmaps kept while migrating */
+#define HOSTMEM_DIRTY_PAGE_BITS 12
+#define HOSTMEM_DIRTY_PAGE_SIZE (1ULL << HOSTMEM_DIRTY_PAGE_BITS)
+
 typedef struct {
     MemoryRegion *mr;
     void *host_addr;
     hwaddr guest_addr;
+    hwaddr offset_within_region;
     uint64_t size;
     bool readonly;
+
+    /* Pages written through hostmem_set_dirty(), NULL unless dirty logging is
+     * enabled.  Bits are set by any thread and collected by the main loop.
+     */
+    unsigned long *dirty;
 } HostMemRegion;
 
+/* Sorted array of regions, immutable once installed */
+typedef struct {
+    HostMemRegion *regions;
+    size_t num_regions;
+} HostMemTable;
+
 typedef struct {
     /* The listener is invoked when regions change and a new list of regions is
      * built up completely before they are installed.
@@ -33,13 +49,20 @@ typedef struct {
     HostMemRegion *new_regions;
     size_t num_new_regions;
 
-    /* Current regions are accessed from multiple threads either to lookup
-     * addresses or to install a new list of regions.  The lock protects the
-     * pointer and the regions.
+    /* Current regions are looked up without locking.  A new table is
+     * published by swapping the pointer; the old one is freed once no lookup
+     * that may have seen it is still in progress.
+     */
+    HostMemTable *current;
+    int readers;                    /* lookups in progress */
+
+    /* Index of the region that satisfied the last lookup.  It is only a hint
+     * and is validated against the current table before use.
      */
-    QemuMutex current_regions_lock;
-    HostMemRegion *current_regions;
-    size_t num_current_regions;
+    size_t last_hit;
+
+    /* Global dirty logging is active, written by the main loop */
+    bool logging;
 } HostMem;
 
 void hostmem_init(HostMem *hostmem);
@@ -55,4 +78,15 @@ void hostmem_finalize(HostMem *hostmem);
  */
 void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write);
 
+/**
+ * Record that guest memory was written
+ *
+ * Must be called after the data has been written to memory returned by
+ * hostmem_lookup().  The pages are reported to the migration dirty bitmap the
+ * next time it is synced.  This is a nop unless dirty logging is enabled.
+ */
+void hostmem_set_dirty(HostMem *hostmem, void *host_addr, size_t len);
+void hostmem_set_dirty_iov(HostMem *hostmem, const struct iovec *iov,
+                           unsigned int iov_cnt);
+
 #endif /* HOSTMEM_H */
@@ -57,6 +57,10 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
 int vring_pop(VirtIODevice *vdev, Vring *vring,
               struct iovec iov[], struct iovec *iov_end,
               unsigned int *out_num, unsigned int *in_num);
+int vring_pop_addr(VirtIODevice *vdev, Vring *vring,
+                   struct iovec iov[], struct iovec *iov_end, hwaddr addr[],
+                   unsigned int *out_num, unsigned int *in_num);
 void vring_push(Vring *vring, unsigned int head, int len);
+void vring_unpop(Vring *vring);
 
 #endif /* VRING_H */
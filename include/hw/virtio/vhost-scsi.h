@@ -67,7 +67,8 @@ typedef struct VHostSCSI {
     DEFINE_PROP_STRING("wwpn", _state, _conf_field.wwpn), \
     DEFINE_PROP_UINT32("num_queues", _state, _conf_field.num_queues, 1), \
     DEFINE_PROP_UINT32("max_sectors", _state, _conf_field.max_sectors, 0xFFFF), \
-    DEFINE_PROP_UINT32("cmd_per_lun", _state, _conf_field.cmd_per_lun, 128)
+    DEFINE_PROP_UINT32("cmd_per_lun", _state, _conf_field.cmd_per_lun, 128), \
+    DEFINE_PROP_BOOL("migratable", _state, _conf_field.migratable, false)
 
 
 #endif
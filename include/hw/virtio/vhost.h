@@ -4,6 +4,7 @@
 #include "hw/hw.h"
 #include "hw/virtio/virtio.h"
 #include "exec/memory.h"
+#include "hw/virtio/vhost-backend.h"
 
 /* Generic structures common for any vhost based device. */
 struct vhost_virtqueue {
@@ -29,7 +30,8 @@ typedef unsigned long vhost_log_chunk_t;
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
-    int control;
+    void *opaque;
+    const VhostOps *vhost_ops;
     struct vhost_memory *mem;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
@@ -48,10 +50,16 @@ struct vhost_dev {
     bool memory_changed;
     hwaddr mem_changed_start_addr;
     hwaddr mem_changed_end_addr;
+    /* the table last sent with VHOST_SET_MEM_TABLE */
+    struct vhost_memory *pushed_mem;
+    struct Stats *stats;
+    struct StatsCounter *mem_table_updates;
+    struct StatsCounter *mem_table_skipped;
+    struct StatsHistogram *log_sync_ns;
 };
 
-int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
-                   bool force);
+int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
+                   VhostBackendType backend_type, bool force);
 void vhost_dev_cleanup(struct vhost_dev *hdev);
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev);
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev);
@@ -17,6 +17,7 @@
 
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
+#include "qemu/notify.h"
 
 #define TYPE_VIRTIO_BALLOON "virtio-balloon-device"
 #define VIRTIO_BALLOON(obj) \
@@ -30,6 +31,7 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST 0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ 1       /* Memory stats virtqueue */
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT 3 /* VQ to report free pages */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -40,8 +42,15 @@ struct virtio_balloon_config
     uint32_t num_pages;
     /* Number of pages we've actually got in balloon. */
     uint32_t actual;
+    /* Free page hinting command id, readonly by guest */
+    uint32_t free_page_hint_cmd_id;
 };
 
+/* Free page hinting command ids */
+#define VIRTIO_BALLOON_CMD_ID_STOP 0      /* stop reporting free pages */
+#define VIRTIO_BALLOON_CMD_ID_DONE 1      /* reported pages can be reused */
+#define VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN 0x80000000
+
 /* Memory Statistics */
 #define VIRTIO_BALLOON_S_SWAP_IN  0   /* Amount of memory swapped in */
 #define VIRTIO_BALLOON_S_SWAP_OUT 1   /* Amount of memory swapped out */
@@ -56,17 +65,45 @@ typedef struct VirtIOBalloonStat {
     uint64_t val;
 } QEMU_PACKED VirtIOBalloonStat;
 
+enum virtio_balloon_free_page_hint_status {
+    FREE_PAGE_HINT_S_STOP = 0,
+    FREE_PAGE_HINT_S_REQUESTED = 1,
+    FREE_PAGE_HINT_S_START = 2,
+};
+
+/* Contiguous pages of a RAM region that are being inflated or deflated */
+typedef struct BalloonRun {
+    MemoryRegion *mr;
+    ram_addr_t offset;
+    ram_addr_t size;
+    bool deflate;
+} BalloonRun;
+
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *fvq;
+    uint32_t host_features;
     uint32_t num_pages;
     uint32_t actual;
+    uint32_t free_page_hint_cmd_id;
+    uint32_t free_page_hint_cmd_id_last;
+    uint32_t free_page_hint_status;
+    Notifier ram_save_notifier;
+    BalloonRun run;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
-    VirtQueueElement stats_vq_elem;
+    VirtQueueElement *stats_vq_elem;
     size_t stats_vq_offset;
     QEMUTimer *stats_timer;
     int64_t stats_last_update;
     int64_t stats_poll_interval;
 } VirtIOBalloon;
 
+#define DEFINE_VIRTIO_BALLOON_FEATURES(_state, _field) \
+        DEFINE_VIRTIO_COMMON_FEATURES(_state, _field), \
+        DEFINE_PROP_BIT("free-page-hint", _state, _field, \
+                        VIRTIO_BALLOON_F_FREE_PAGE_HINT, false)
+
+void virtio_balloon_set_host_features(VirtIOBalloon *s,
+                                      uint32_t host_features);
+
 #endif
@@ -65,16 +65,26 @@
  * and latency. */
 #define TX_BURST 256
 
+/* In bh mode the burst adapts to the guest's packet rate, between this
+ * and TX_BURST (or x-txburst). */
+#define VIRTIO_NET_TX_BURST_MIN 16
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t data_plane;
+    uint32_t rss;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+/* Largest receive side scaling key and indirection table */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE 40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN 128
+
 struct virtio_net_config
 {
     /* The config defining mac address ($ETH_ALEN bytes) */
@@ -147,10 +157,14 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    int32_t tx_burst;           /* current burst limit */
     struct {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         ssize_t len;
     } async_tx;
+    /* rx buffers lent to the peer by virtio_net_receive_direct */
+    VirtQueueElement **rx_elems;
+    bool rx_direct_off;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -175,6 +189,7 @@ typedef struct VirtIONet {
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    uint8_t dataplane_started;
     struct {
         int in_use;
         int first_multi;
@@ -193,6 +208,20 @@ typedef struct VirtIONet {
     char *netclient_name;
     char *netclient_type;
     uint64_t curr_guest_offloads;
+    struct {
+        bool configured;
+        uint32_t hash_types;
+        uint16_t table_mask;
+        uint16_t unclassified_queue;
+        uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+        uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+        /* per input byte, XOR of the key windows for each byte value */
+        uint32_t (*lut)[256];
+    } rss;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    Notifier migration_state_notifier;
+    struct VirtIONetDataPlane *dataplane;
+#endif
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -229,9 +258,37 @@ struct virtio_net_ctrl_mq {
 
 #define VIRTIO_NET_CTRL_MQ   4
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET        0
+ #define VIRTIO_NET_CTRL_MQ_RSS_CONFIG          1
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN        1
  #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX        0x8000
 
+/*
+ * Receive side scaling
+ *
+ * With rss=on and more than one queue pair in use, received packets are
+ * steered with a Toeplitz hash of their addresses and ports, looked up in
+ * an indirection table of rx queue pair indices.  By default the table
+ * spreads over all queue pairs in use.  VIRTIO_NET_CTRL_MQ_RSS_CONFIG sets
+ * the hash types, the table and the key; its out entry is laid out as
+ *
+ *   le32 hash_types;
+ *   le16 indirection_table_mask;
+ *   le16 unclassified_queue;
+ *   le16 indirection_table[indirection_table_mask + 1];
+ *   le16 max_tx_vq;                 (ignored, use VQ_PAIRS_SET)
+ *   u8   hash_key_length;
+ *   u8   hash_key_data[hash_key_length];
+ *
+ * Packets of a type that is not hashed go to unclassified_queue.
+ */
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4          (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4         (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4         (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6          (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6         (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6         (1 << 5)
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES        0x3f
+
 /*
  * Control network offloads
  *
@@ -268,7 +325,8 @@ struct virtio_net_ctrl_mq {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                               \
+    DEFINE_PROP_BIT("rss", _state, _field.rss, 0, false)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
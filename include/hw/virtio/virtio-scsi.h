@@ -17,6 +17,7 @@
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
 #include "hw/scsi/scsi.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_SCSI_COMMON "virtio-scsi-common"
 #define VIRTIO_SCSI_COMMON(obj) \
@@ -153,6 +154,9 @@ struct VirtIOSCSIConf {
     uint32_t cmd_per_lun;
     char *vhostfd;
     char *wwpn;
+    uint32_t data_plane;
+    IOThread *iothread;
+    bool migratable;
 };
 
 typedef struct VirtIOSCSICommon {
@@ -172,6 +176,11 @@ typedef struct {
     SCSIBus bus;
     int resetting;
     bool events_dropped;
+
+    /* requests popped from the command queues in the main loop */
+    unsigned int cmd_inflight;
+    struct VirtIOSCSIDataPlane *dataplane;
+    bool dataplane_started;
 } VirtIOSCSI;
 
 #define DEFINE_VIRTIO_SCSI_PROPERTIES(_state, _conf_field)                     \
@@ -105,6 +105,14 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          ssize_t len);
+
+    /*
+     * Optional: like have_data, but hands over the data of several
+     * elements at once.  Returning less than the total enables
+     * throttling as well.
+     */
+    ssize_t (*have_datav)(VirtIOSerialPort *port, const struct iovec *iov,
+                          int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -149,7 +157,7 @@ struct VirtIOSerialPort {
      * element popped and continue consuming it once the backend
      * becomes writable again.
      */
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
     /*
      * The index and the offset into the iov buffer that was popped in
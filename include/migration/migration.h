@@ -47,8 +47,20 @@ struct MigrationState
     int64_t expected_downtime;
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
+    /* smoothed throughput in bytes per ms */
+    double bandwidth;
+    bool converging;
+    uint64_t min_pending_size;
+    int64_t min_pending_time;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_threads;
+    int decompress_threads;
+    int channels;
+    char *channel_host_port;
+    int postcopy_rounds;
+    int block_granularity;
     int64_t setup_time;
 };
 
@@ -70,6 +82,12 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+QEMUFile *tcp_open_outgoing_channel(MigrationState *s, Error **errp);
+
+QEMUFile *tcp_accept_incoming_channel(Error **errp);
+
+void tcp_close_incoming_listener(void);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -91,6 +109,7 @@ int migrate_fd_close(MigrationState *s);
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
+bool migration_is_active(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
 MigrationState *migrate_get_current(void);
@@ -99,9 +118,22 @@ uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 
+/* Events of a RAM migration, passed to the ram_save notifiers */
+typedef enum RamSaveEvent {
+    RAM_SAVE_BEFORE_BITMAP_SYNC,
+    RAM_SAVE_AFTER_BITMAP_SYNC,
+    RAM_SAVE_END,
+} RamSaveEvent;
+
+void ram_save_add_notifier(Notifier *notify);
+void ram_save_remove_notifier(Notifier *notify);
+void qemu_guest_free_page_hint(void *addr, size_t len);
+
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
-extern SaveVMHandlers savevm_ram_handlers;
+void ram_mig_init(void);
+
+int64_t migration_throttle_percentage(void);
 
 uint64_t dup_mig_bytes_transferred(void);
 uint64_t dup_mig_pages_transferred(void);
@@ -113,6 +145,10 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_busy(void);
+double compress_mig_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -139,11 +175,41 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
+/*
+ * Switches xbzrle_encode_buffer() to the next slower implementation
+ * supported by the host.  Returns false and switches back to the fastest
+ * implementation if the generic one was in use.  Only meant for tests and
+ * benchmarks.
+ */
+bool test_xbzrle_next_accel(void);
+
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+void migrate_decompress_threads_join(void);
+
+bool migrate_use_multichannel(void);
+int migrate_multichannel_channels(void);
+
+void migrate_recv_channels_join(void);
+
+bool migrate_postcopy_ram(void);
+int migrate_postcopy_rounds(void);
+
+int migrate_block_granularity(void);
+
+bool ram_postcopy_ready(void);
+void ram_postcopy_begin(void);
+int ram_postcopy_push(void);
+uint64_t ram_postcopy_requests(void);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags);
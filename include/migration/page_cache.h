@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +18,13 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Lookup and replacement counters, kept for each set of the cache */
+typedef struct PageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} PageCacheStats;
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -58,7 +65,9 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will copy the data on insert. the previous value will be overwritten;
+ * when the set of @addr is full, the CLOCK replacement evicts a page that
+ * was not looked up since the hand last passed it
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -77,4 +86,29 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_get_num_sets: Get the number of sets of the cache
+ *
+ * @cache pointer to the PageCache struct
+ */
+int64_t cache_get_num_sets(const PageCache *cache);
+
+/**
+ * cache_get_set_stats: Get the lookup statistics of one set
+ *
+ * @cache pointer to the PageCache struct
+ * @set: set index, below cache_get_num_sets()
+ * @stats: filled with the counters of @set
+ */
+void cache_get_set_stats(const PageCache *cache, int64_t set,
+                         PageCacheStats *stats);
+
+/**
+ * cache_get_stats: Get the lookup statistics summed over all sets
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: filled with the counters of the whole cache
+ */
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats);
+
 #endif
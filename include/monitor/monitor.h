@@ -18,6 +18,7 @@ extern Monitor *default_mon;
 
 /* flags for monitor commands */
 #define MONITOR_CMD_ASYNC       0x0001
+#define MONITOR_CMD_COROUTINE   0x0002
 
 /* QMP events */
 typedef enum MonitorEvent {
@@ -64,6 +65,11 @@ void monitor_init(CharDriverState *chr, int flags);
 int monitor_suspend(Monitor *mon);
 void monitor_resume(Monitor *mon);
 
+/* Let the main loop run once, then continue the QMP command that runs in
+ * the current coroutine (see MONITOR_CMD_COROUTINE).
+ */
+void coroutine_fn monitor_co_yield(void);
+
 int monitor_read_bdrv_key_start(Monitor *mon, BlockDriverState *bs,
                                 BlockDriverCompletionFunc *completion_cb,
                                 void *opaque);
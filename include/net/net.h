@@ -50,6 +50,9 @@ typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
 typedef RxFilterInfo *(QueryRxFilter)(NetClientState *);
+typedef ssize_t (NetReadIOV)(void *opaque, const struct iovec *, int);
+typedef ssize_t (NetReceiveDirect)(NetClientState *, NetReadIOV *,
+                                   void *opaque, size_t max_size);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -62,6 +65,11 @@ typedef struct NetClientInfo {
     LinkStatusChanged *link_status_changed;
     QueryRxFilter *query_rx_filter;
     NetPoll *poll;
+    /* Zero-copy receive: the NIC passes at least max_size bytes of its
+       own buffers to the read function, for a single packet.  Returns
+       the size of the packet, 0 if nothing was read, or -1 if the
+       sender must read into its own buffer and send a copy.  */
+    NetReceiveDirect *receive_direct;
 } NetClientInfo;
 
 struct NetClientState {
@@ -117,6 +125,8 @@ void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+ssize_t qemu_receive_direct(NetClientState *nc, NetReadIOV *read_iov,
+                            void *opaque, size_t max_size);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
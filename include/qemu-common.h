@@ -346,6 +346,7 @@ size_t qemu_iovec_from_buf(QEMUIOVector *qiov, size_t offset,
                            const void *buf, size_t bytes);
 size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
+bool qemu_iovec_is_zero(QEMUIOVector *qiov);
 
 bool buffer_is_zero(const void *buf, size_t len);
 
@@ -417,6 +418,9 @@ static inline bool is_power_of_2(uint64_t value)
 /* round down to the nearest power of 2*/
 int64_t pow2floor(int64_t value);
 
+/* round up to the nearest power of 2 (0 if overflow) */
+uint64_t pow2ceil(uint64_t value);
+
 #include "qemu/module.h"
 
 /*
@@ -473,6 +477,22 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 
+/*
+ * Switches buffer_find_nonzero_offset() and buffer_is_zero() to the next
+ * slower implementation supported by the host.  Returns false and switches
+ * back to the fastest implementation if the generic one was in use.  Only
+ * meant for tests and benchmarks.
+ */
+bool test_buffer_is_zero_next_accel(void);
+
+void buffer_copy_changed_chunks(void *dst, const void *src, size_t chunk,
+                                size_t nchunks, unsigned long *bitmap);
+
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+/* Returns true if the host CPU and OS support AVX2 */
+bool cpu_has_avx2(void);
+#endif
+
 /*
  * helper to parse debug environment variables
  */
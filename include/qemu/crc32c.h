@@ -32,4 +32,7 @@
 
 uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
 
+/* Switch to the next implementation for testing, false when wrapping */
+bool test_crc32c_next_accel(void);
+
 #endif
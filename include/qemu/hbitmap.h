@@ -88,6 +88,19 @@ int hbitmap_granularity(const HBitmap *hb);
  */
 uint64_t hbitmap_count(const HBitmap *hb);
 
+/**
+ * hbitmap_count_range:
+ * @hb: HBitmap to operate on.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ *
+ * Return the number of bits set in the range, with the same rounding to
+ * the granularity as hbitmap_count.  Only the nonzero words in the range
+ * are visited.
+ */
+uint64_t hbitmap_count_range(const HBitmap *hb,
+                             uint64_t start, uint64_t count);
+
 /**
  * hbitmap_set:
  * @hb: HBitmap to operate on.
@@ -117,6 +130,79 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bits that a serialized chunk must be aligned to.
+ * The ranges passed to hbitmap_serialize_part and hbitmap_deserialize_part
+ * must start at a multiple of it, and end at a multiple of it or at the
+ * end of the bitmap.
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ *
+ * Return the number of bytes that hbitmap_serialize_part needs for the
+ * range.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size bytes.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ *
+ * Store the range in @buf as a sequence of little-endian 64-bit words,
+ * one bit per group of 2^granularity bits.  The format does not depend
+ * on the host.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer filled by hbitmap_serialize_part.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ * @finish: Whether to call hbitmap_deserialize_finish.
+ *
+ * Replace the range with the contents of @buf.  The bitmap must not be
+ * used until hbitmap_deserialize_finish is called; this way, a bitmap
+ * can be loaded a chunk at a time for the cost of a single update.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish);
+
+/**
+ * hbitmap_deserialize_zeroes:
+ * @hb: HBitmap to operate on.
+ * @start: First bit of the range (0-based).
+ * @count: Number of bits in the range.
+ * @finish: Whether to call hbitmap_deserialize_finish.
+ *
+ * Like hbitmap_deserialize_part, for a range whose bits are all clear.
+ */
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Bring the bitmap back to a consistent state after deserialization.
+ * The cost is linear in the size of the bitmap.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -176,6 +262,18 @@ static inline int64_t hbitmap_iter_next(HBitmapIter *hbi)
     return item << hbi->granularity;
 }
 
+/**
+ * hbitmap_iter_next_run:
+ * @hbi: HBitmapIter to operate on.
+ * @count: Location where to store the length of the run.
+ *
+ * Return the first bit of the next run of consecutive set bits in @hbi's
+ * associated HBitmap, and store its length in *@count; both are multiples
+ * of the granularity.  The next call resumes after the end of the run.
+ * Return -1, and set *@count to zero, if all remaining bits are zero.
+ */
+int64_t hbitmap_iter_next_run(HBitmapIter *hbi, uint64_t *count);
+
 /**
  * hbitmap_iter_next_word:
  * @hbi: HBitmapIter to operate on.
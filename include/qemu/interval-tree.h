@@ -0,0 +1,83 @@
+/*
+ * Interval tree
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* An interval tree holds half-open ranges [start, end) and finds one that
+ * overlaps a given range in O(log n).  It is a balanced (AVL) binary tree
+ * ordered by start, where every node also knows the largest end in its
+ * subtree.
+ *
+ * Nodes are embedded in the caller's structures, in the style of the
+ * qemu/queue.h lists, so that no memory is allocated.  Several nodes may
+ * contain the same range.  The tree does no locking.
+ */
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    int64_t start;
+    int64_t end;
+    int64_t max_end;            /* largest end in this subtree */
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    int height;
+};
+
+typedef struct IntervalTree {
+    IntervalTreeNode *root;
+} IntervalTree;
+
+#define interval_tree_entry(node, type, field) \
+    container_of(node, type, field)
+
+static inline void interval_tree_init(IntervalTree *tree)
+{
+    tree->root = NULL;
+}
+
+static inline bool interval_tree_empty(IntervalTree *tree)
+{
+    return tree->root == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ * @tree: the tree
+ * @node: a node that is not in any tree
+ * @start: first element of the range
+ * @end: first element after the range
+ */
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node,
+                          int64_t start, int64_t end);
+
+/**
+ * interval_tree_remove:
+ * @tree: the tree
+ * @node: a node of @tree
+ */
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node);
+
+/**
+ * interval_tree_find:
+ * @tree: the tree
+ * @start: first element of the range
+ * @end: first element after the range
+ *
+ * Returns a node whose range overlaps [@start, @end), or NULL if there is
+ * none.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTree *tree,
+                                     int64_t start, int64_t end);
+
+#endif
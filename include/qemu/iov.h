@@ -39,10 +39,39 @@ size_t iov_size(const struct iovec *iov, const unsigned int iov_cnt);
  * such "large" value is -1 (sinice size_t is unsigned),
  * so specifying `-1' as `bytes' means 'up to the end of iovec'.
  */
-size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
-                    size_t offset, const void *buf, size_t bytes);
-size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
-                  size_t offset, void *buf, size_t bytes);
+size_t iov_from_buf_full(const struct iovec *iov, unsigned int iov_cnt,
+                         size_t offset, const void *buf, size_t bytes);
+size_t iov_to_buf_full(const struct iovec *iov, const unsigned int iov_cnt,
+                       size_t offset, void *buf, size_t bytes);
+
+/* Copies that fit in the first element are inlined, so that the memcpy
+ * of small headers with a constant size is expanded by the compiler.
+ */
+static inline size_t
+iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
+             size_t offset, const void *buf, size_t bytes)
+{
+    if (__builtin_constant_p(bytes) && iov_cnt &&
+        offset <= iov[0].iov_len && bytes <= iov[0].iov_len - offset) {
+        memcpy(iov[0].iov_base + offset, buf, bytes);
+        return bytes;
+    } else {
+        return iov_from_buf_full(iov, iov_cnt, offset, buf, bytes);
+    }
+}
+
+static inline size_t
+iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
+           size_t offset, void *buf, size_t bytes)
+{
+    if (__builtin_constant_p(bytes) && iov_cnt &&
+        offset <= iov[0].iov_len && bytes <= iov[0].iov_len - offset) {
+        memcpy(buf, iov[0].iov_base + offset, bytes);
+        return bytes;
+    } else {
+        return iov_to_buf_full(iov, iov_cnt, offset, buf, bytes);
+    }
+}
 
 /**
  * Set data bytes pointed out by iovec `iov' of size `iov_cnt' elements,
@@ -57,6 +86,36 @@ size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes);
 
+/*
+ * A position in an iovec that is kept across calls, for code that walks
+ * a vector piece by piece.  iov_from_buf() and friends look for the
+ * offset from the first element every time, which adds up on long
+ * chains.  All the functions below advance the cursor by the number of
+ * bytes they return, which is less than requested only at the end of
+ * the iovec.
+ */
+typedef struct IOVCursor {
+    const struct iovec *iov;
+    unsigned int iov_cnt;
+    unsigned int idx;           /* element containing the position */
+    size_t offset;              /* position within iov[idx] */
+    size_t pos;                 /* position from the start of the iovec */
+} IOVCursor;
+
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt);
+size_t iov_cursor_from_buf(IOVCursor *cur, const void *buf, size_t bytes);
+size_t iov_cursor_to_buf(IOVCursor *cur, void *buf, size_t bytes);
+size_t iov_cursor_memset(IOVCursor *cur, int fillc, size_t bytes);
+size_t iov_cursor_skip(IOVCursor *cur, size_t bytes);
+
+/*
+ * Move the cursor to byte `pos' of the iovec, or to its end if it is
+ * shorter.  Seeking backwards starts over from the first element.
+ * Returns the new position.
+ */
+size_t iov_cursor_seek(IOVCursor *cur, size_t pos);
+
 /*
  * Send/recv data from/to iovec buffers directly
  *
@@ -149,6 +149,13 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 
 int qemu_madvise(void *addr, size_t len, int advice);
 
+/*
+ * Touch every page of [area, area + memory) so that the host allocates it,
+ * splitting the work across up to @nthreads threads.  Exits if the host
+ * runs out of pages.
+ */
+void os_mem_prealloc(char *area, size_t memory, size_t pagesize, int nthreads);
+
 int qemu_open(const char *name, int flags, ...);
 int qemu_close(int fd);
 
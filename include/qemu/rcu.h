@@ -0,0 +1,137 @@
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+/*
+ * Read-copy-update mechanism for mutual exclusion
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The design follows the memory-barrier flavor of liburcu: readers only
+ * touch a per-thread counter, writers wait for every registered thread to
+ * pass through a quiescent state (see docs/rcu.txt for the details).
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#include "qemu/compiler.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Important !
+ *
+ * Each thread containing read-side critical sections must be registered
+ * with rcu_register_thread() before calling rcu_read_lock().
+ * rcu_unregister_thread() should be called before the thread exits.
+ * The main thread is registered automatically.
+ */
+
+/*
+ * Global grace period counter.  Bit 0 is always set in rcu_gp_ctr, so
+ * that a zero ctr in rcu_reader_data means "not in a critical section".
+ */
+#define RCU_GP_LOCKED           (1UL << 0)
+#define RCU_GP_CTR              (1UL << 1)
+
+extern unsigned long rcu_gp_ctr;
+
+extern QemuEvent rcu_gp_event;
+
+struct rcu_reader_data {
+    /* Data used by both reader and synchronize_rcu() */
+    unsigned long ctr;
+    bool waiting;
+
+    /* Data used by reader only */
+    unsigned depth;
+
+    /* Data used for registry, protected by rcu_gp_lock */
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+extern __thread struct rcu_reader_data rcu_reader;
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    if (p_rcu_reader->depth++ > 0) {
+        return;
+    }
+
+    /* The exchange is a full barrier: the counter is visible to
+     * synchronize_rcu() before any RCU-protected pointer is loaded.
+     */
+    atomic_xchg(&p_rcu_reader->ctr, atomic_read(&rcu_gp_ctr));
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    assert(p_rcu_reader->depth != 0);
+    if (--p_rcu_reader->depth > 0) {
+        return;
+    }
+
+    atomic_xchg(&p_rcu_reader->ctr, 0);
+    if (atomic_read(&p_rcu_reader->waiting)) {
+        atomic_set(&p_rcu_reader->waiting, false);
+        qemu_event_set(&rcu_gp_event);
+    }
+}
+
+/*
+ * Wait until every read-side critical section that was running when
+ * synchronize_rcu() was called has completed.
+ */
+void synchronize_rcu(void);
+
+/*
+ * Reader thread registration.
+ */
+void rcu_register_thread(void);
+void rcu_unregister_thread(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+/*
+ * Run @func(@head) after a grace period has elapsed.  Callbacks are
+ * invoked from a separate thread, with the iothread mutex taken.
+ */
+void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+
+/* The operands of the minus operator must have the same type,
+ * which must be the one that we specify in the cast.
+ */
+#define call_rcu(head, func, field)                                      \
+    call_rcu1(({                                                         \
+         char __attribute__((unused))                                    \
+            offset_must_be_zero[-offsetof(typeof(*(head)), field)],      \
+            func_type_invalid = (func) - (void (*)(typeof(head)))(func); \
+         &(head)->field;                                                 \
+      }),                                                                \
+      (RCUCBFunc *)(func))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QEMU_RCU_H */
@@ -0,0 +1,101 @@
+/*
+ * Statistics registry
+ *
+ * Copyright (C) 2014
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_STATS_H
+#define QEMU_STATS_H
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/queue.h"
+
+/* Statistics registry
+ *
+ * A subsystem creates a Stats object for each instance it wants to
+ * expose, for example one per AioContext or per virtio device, and adds
+ * named counters and histograms to it.  query-stats returns the current
+ * values of all the registered objects.
+ *
+ * Updates are plain loads and stores rather than atomic operations, so
+ * that they cost next to nothing on hot paths.  The counters of an object
+ * should therefore only be updated by one thread at a time, usually the
+ * one that owns the instance or holds its lock.  Readers do not
+ * synchronize with the writer and may see values that are slightly
+ * behind.
+ */
+
+/* Bucket 0 counts zero values, bucket n values in [2^(n-1), 2^n) */
+#define STATS_HISTOGRAM_BUCKETS 65
+
+typedef struct StatsCounter {
+    const char *name;
+    uint64_t value;
+    QSIMPLEQ_ENTRY(StatsCounter) next;
+} StatsCounter;
+
+typedef struct StatsHistogram {
+    const char *name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+    QSIMPLEQ_ENTRY(StatsHistogram) next;
+} StatsHistogram;
+
+typedef struct Stats Stats;
+
+/**
+ * stats_new: Register a new statistics object.
+ * @fmt: printf-style format of the name of the object.
+ *
+ * Names are made of components separated by slashes, starting with
+ * the subsystem, e.g. "main-loop" or "aio-context/1".
+ */
+Stats *stats_new(const char *fmt, ...) GCC_FMT_ATTR(1, 2);
+
+/**
+ * stats_free: Unregister a statistics object and free its counters
+ * and histograms.
+ */
+void stats_free(Stats *stats);
+
+/**
+ * stats_add_counter: Add a counter to a statistics object.
+ * @name: name of the counter.  It is not copied, so it must remain valid
+ * for the lifetime of @stats; usually it is a string literal.
+ */
+StatsCounter *stats_add_counter(Stats *stats, const char *name);
+
+/**
+ * stats_add_histogram: Add a histogram to a statistics object.
+ * @name: name of the histogram, with the same lifetime rules as the
+ * name of a counter.
+ */
+StatsHistogram *stats_add_histogram(Stats *stats, const char *name);
+
+static inline void stats_counter_add(StatsCounter *c, uint64_t n)
+{
+    atomic_set(&c->value, c->value + n);
+}
+
+static inline void stats_counter_inc(StatsCounter *c)
+{
+    stats_counter_add(c, 1);
+}
+
+static inline void stats_histogram_record(StatsHistogram *h, uint64_t value)
+{
+    int bucket = value ? 64 - clz64(value) : 0;
+
+    atomic_set(&h->buckets[bucket], h->buckets[bucket] + 1);
+    atomic_set(&h->sum, h->sum + value);
+    atomic_set(&h->count, h->count + 1);
+}
+
+#endif
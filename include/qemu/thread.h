@@ -60,4 +60,10 @@ void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 
+struct Notifier;
+/* Run @notifier when the calling thread exits.  It is not run for the main
+ * thread, which exits with the process.
+ */
+void qemu_thread_atexit_add(struct Notifier *notifier);
+
 #endif
@@ -44,12 +44,19 @@ typedef enum {
  * allow the guest to do bursts.
  * The max value is a pool of I/O that the guest can use without being throttled
  * at all. Throttling is triggered once this pool is empty.
+ *
+ * With a burst_length of more than one second, max is instead a rate: the
+ * guest can do up to max units per second for burst_length seconds, so the
+ * pool holds max * burst_length units.  A second bucket, burst_level, makes
+ * sure the rate stays below max while the pool is being used.
  */
 
 typedef struct LeakyBucket {
     double  avg;              /* average goal in units per second */
     double  max;              /* leaky bucket max burst in units */
     double  level;            /* bucket level in units */
+    double  burst_level;      /* level of the burst rate bucket in units */
+    unsigned burst_length;    /* max length of the burst period in seconds */
 } LeakyBucket;
 
 /* The following structure is used to configure a ThrottleState
@@ -102,6 +109,8 @@ void throttle_config(ThrottleState *ts, ThrottleConfig *cfg);
 
 void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
 
+void throttle_get_levels(ThrottleState *ts, ThrottleConfig *cfg);
+
 /* usage */
 bool throttle_schedule_timer(ThrottleState *ts, bool is_write);
 
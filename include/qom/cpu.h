@@ -144,8 +144,12 @@ struct kvm_run;
  * @created: Indicates whether the CPU thread has been successfully created.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
+ * @queued_work: Work items queued by run_on_cpu(), most recent first.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
+ * @throttle_scheduled: Indicates a migration throttling sleep is queued.
+ * @halt_poll_success: Number of halt polls that ended with pending work.
+ * @halt_poll_fail: Number of halt polls that timed out.
  * @tcg_exit_req: Set to force TCG to stop executing linked TBs for this
  *           CPU and return to its top level loop.
  * @singlestep_enabled: Flags for single-stepping.
@@ -176,11 +180,14 @@ struct CPUState {
     uint32_t host_tid;
     bool running;
     struct QemuCond *halt_cond;
-    struct qemu_work_item *queued_work_first, *queued_work_last;
+    struct qemu_work_item *queued_work;
     bool thread_kicked;
     bool created;
     bool stop;
     bool stopped;
+    bool throttle_scheduled;
+    uint64_t halt_poll_success;
+    uint64_t halt_poll_fail;
     volatile sig_atomic_t exit_request;
     volatile sig_atomic_t tcg_exit_req;
     uint32_t interrupt_request;
@@ -388,10 +395,20 @@ bool cpu_is_stopped(CPUState *cpu);
  * @func: The function to be executed.
  * @data: Data to pass to the function.
  *
- * Schedules the function @func for execution on the vCPU @cpu.
+ * Schedules the function @func for execution on the vCPU @cpu, and waits
+ * for it to complete.  Must be called with the iothread mutex held.
  */
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * run_on_all_cpus:
+ * @func: The function to be executed.  It receives the #CPUState as @data.
+ *
+ * Like run_on_cpu(), but for all vCPUs.  The function is queued on every
+ * vCPU before waiting, so that they execute it in parallel.
+ */
+void run_on_all_cpus(void (*func)(void *data));
+
 /**
  * async_run_on_cpu:
  * @cpu: The vCPU to run on.
@@ -399,6 +416,8 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  * @data: Data to pass to the function.
  *
  * Schedules the function @func for execution on the vCPU @cpu asynchronously.
+ * Queueing itself is lock-free, but the iothread mutex must be held so that
+ * the kick cannot race with the vCPU going to sleep.
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
@@ -346,6 +346,9 @@ typedef void (ObjectFree)(void *obj);
 
 #define OBJECT_CLASS_CAST_CACHE 4
 
+/* Objects with more properties than this also index them in a hash table */
+#define OBJECT_PROPERTY_TABLE_MIN 16
+
 /**
  * ObjectClass:
  *
@@ -358,7 +361,12 @@ struct ObjectClass
     Type type;
     GSList *interfaces;
 
-    const char *cast_cache[OBJECT_CLASS_CAST_CACHE];
+    /* type names that instances, respectively the class itself, were
+     * successfully cast to; kept apart because a cast of the class to an
+     * interface returns the interface class, not the class itself
+     */
+    const char *object_cast_cache[OBJECT_CLASS_CAST_CACHE];
+    const char *class_cast_cache[OBJECT_CLASS_CAST_CACHE];
 
     ObjectUnparent *unparent;
 };
@@ -384,6 +392,8 @@ struct Object
     ObjectClass *class;
     ObjectFree *free;
     QTAILQ_HEAD(, ObjectProperty) properties;
+    unsigned int nr_properties;
+    GHashTable *property_table;
     uint32_t ref;
     Object *parent;
 };
@@ -970,6 +980,14 @@ const char *object_property_get_type(Object *obj, const char *name,
  */
 Object *object_get_root(void);
 
+/**
+ * object_get_canonical_path_component:
+ *
+ * Returns: The final component in the object's canonical path.  The canonical
+ * path is the path within the composition tree starting from the root.
+ */
+gchar *object_get_canonical_path_component(Object *obj);
+
 /**
  * object_get_canonical_path:
  *
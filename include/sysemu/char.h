@@ -56,6 +56,8 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
@@ -163,6 +165,23 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Write data from a scatter/gather list to a character backend from the
+ * front end.  Backends that support it send the whole list with a single
+ * system call; for the others this is equivalent to calling
+ * @qemu_chr_fe_write for each element until one is only partially
+ * consumed.
+ *
+ * @iov the data
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed, or -1 if none could be sent
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
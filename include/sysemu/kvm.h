@@ -17,6 +17,8 @@
 #include <errno.h>
 #include "config-host.h"
 #include "qemu/queue.h"
+#include "qemu/notify.h"
+#include "qapi-types.h"
 #include "qom/cpu.h"
 
 #ifdef CONFIG_KVM
@@ -165,6 +167,11 @@ int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
 int kvm_has_intx_set_mask(void);
 
+/* Statistics of the MSI routes that kvm_irqchip_send_msi creates, or NULL
+ * if it injects MSIs directly.
+ */
+KvmMSIRouteCacheInfo *kvm_msi_route_cache_info(void);
+
 int kvm_init_vcpu(CPUState *cpu);
 int kvm_cpu_exec(CPUState *cpu);
 
@@ -283,8 +290,11 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram_addr,
 #endif /* NEED_CPU_H */
 
 void kvm_cpu_synchronize_state(CPUState *cpu);
+void kvm_cpu_synchronize_all_states(void);
 void kvm_cpu_synchronize_post_reset(CPUState *cpu);
 void kvm_cpu_synchronize_post_init(CPUState *cpu);
+void kvm_cpu_synchronize_all_post_reset(void);
+void kvm_cpu_synchronize_all_post_init(void);
 
 /* generic hooks - to be moved/refactored once there are more users */
 
@@ -311,6 +321,16 @@ static inline void cpu_synchronize_post_init(CPUState *cpu)
 
 int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg);
 int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg);
+/*
+ * Like kvm_irqchip_update_msi_route, but leave the commit of the routing
+ * table to a bottom half, so that a burst of updates costs a single
+ * KVM_SET_GSI_ROUTING.  Returns 1 while the routing table has changes that
+ * are not committed yet; the routes notifiers run once they are.
+ */
+int kvm_irqchip_update_msi_route_deferred(KVMState *s, int virq,
+                                          MSIMessage msg);
+void kvm_irqchip_add_routes_notifier(Notifier *n);
+void kvm_irqchip_remove_routes_notifier(Notifier *n);
 void kvm_irqchip_release_virq(KVMState *s, int virq);
 
 int kvm_irqchip_add_irqfd_notifier(KVMState *s, EventNotifier *n,
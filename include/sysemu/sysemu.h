@@ -83,6 +83,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 void qemu_savevm_state_complete(QEMUFile *f);
+uint64_t qemu_savevm_device_state_size(void);
 void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
 int qemu_loadvm_state(QEMUFile *f);
@@ -137,6 +138,19 @@ extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
 
+/* Host memory policy of a guest NUMA node.  The values match MPOL_*.  */
+enum {
+    NUMA_POLICY_DEFAULT = 0,
+    NUMA_POLICY_PREFERRED = 1,
+    NUMA_POLICY_BIND = 2,
+    NUMA_POLICY_INTERLEAVE = 3,
+};
+extern unsigned long *node_host_nodes[MAX_NODES];
+extern int node_host_policy[MAX_NODES];
+extern bool node_pin_vcpus[MAX_NODES];
+
+void numa_bind_ram(void *host, uint64_t size);
+
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
     const char *name;
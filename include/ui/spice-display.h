@@ -83,6 +83,7 @@ struct SimpleSpiceDisplay {
     int32_t num_surfaces;
 
     QXLRect dirty;
+    QXLRect stale;          /* mirror not updated, resend unconditionally */
     int notify;
 
     /*
@@ -92,6 +93,7 @@ struct SimpleSpiceDisplay {
      */
     QemuMutex lock;
     QTAILQ_HEAD(, SimpleSpiceUpdate) updates;
+    QTAILQ_HEAD(, SimpleSpiceUpdate) shared_updates;
     QEMUCursor *cursor;
     int mouse_x, mouse_y;
 };
@@ -102,6 +104,9 @@ struct SimpleSpiceUpdate {
     QXLCommandExt ext;
     uint8_t *bitmap;
     QTAILQ_ENTRY(SimpleSpiceUpdate) next;
+    /* bitmap points into the mirror, which must not change under it */
+    bool shared;
+    QTAILQ_ENTRY(SimpleSpiceUpdate) shared_next;
 };
 
 int qemu_spice_rect_is_empty(const QXLRect* r);
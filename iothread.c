@@ -0,0 +1,228 @@
+/*
+ * Event loop thread
+ *
+ * An IOThread runs an AioContext of its own in a dedicated thread.  It is
+ * created with -object iothread,id=<id> and devices that support it are
+ * assigned to it with their iothread=<id> property.  query-iothreads reports
+ * the host thread ID of each IOThread so that it can be pinned.  The
+ * thread-pool-min and thread-pool-max properties bound the number of worker
+ * threads of its thread pool; set thread-pool-max first when raising both.
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qom/object.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qapi/visitor.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+#include "sysemu/iothread.h"
+#include "qmp-commands.h"
+
+#define IOTHREADS_PATH "/objects"
+
+typedef ObjectClass IOThreadClass;
+struct IOThread {
+    Object parent;
+    QemuThread thread;
+    AioContext *ctx;
+    QemuMutex init_done_lock;
+    QemuCond init_done_cond;    /* is thread initialization done? */
+    bool stopping;
+    int thread_id;
+
+    /* limits for the thread pool of ctx */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+};
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_mutex_lock(&iothread->init_done_lock);
+    iothread->thread_id = qemu_get_thread_id();
+    qemu_cond_signal(&iothread->init_done_cond);
+    qemu_mutex_unlock(&iothread->init_done_lock);
+
+    while (!iothread->stopping) {
+        aio_context_acquire(iothread->ctx);
+        while (!iothread->stopping && aio_poll(iothread->ctx, true)) {
+            /* Progress was made, keep going */
+        }
+        aio_context_release(iothread->ctx);
+    }
+    return NULL;
+}
+
+static void iothread_get_thread_pool_prop(Object *obj, Visitor *v,
+                                          void *opaque, const char *name,
+                                          Error **errp)
+{
+    int64_t *field = opaque;
+
+    visit_type_int(v, field, name, errp);
+}
+
+static void iothread_set_thread_pool_prop(Object *obj, Visitor *v,
+                                          void *opaque, const char *name,
+                                          Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int64_t *field = opaque;
+    int64_t min, max;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    min = field == &iothread->thread_pool_min ? value
+                                              : iothread->thread_pool_min;
+    max = field == &iothread->thread_pool_max ? value
+                                              : iothread->thread_pool_max;
+    if (min < 0 || max < 1 || max > INT_MAX) {
+        error_setg(errp, "%s is out of range", name);
+        return;
+    }
+    if (min > max) {
+        error_setg(errp, "thread-pool-min (%" PRId64 ") must not exceed "
+                   "thread-pool-max (%" PRId64 ")", min, max);
+        return;
+    }
+    *field = value;
+
+    aio_context_acquire(iothread->ctx);
+    thread_pool_set_limits(aio_get_thread_pool(iothread->ctx), min, max);
+    aio_context_release(iothread->ctx);
+}
+
+/* The thread is started as soon as the object exists.  The only properties
+ * are the thread pool limits, which can be changed while it runs, and
+ * threads that are started here inherit the CPU affinity of the main thread.
+ */
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->stopping = false;
+    iothread->ctx = aio_context_new();
+    iothread->thread_id = -1;
+    iothread->thread_pool_min = 0;
+    iothread->thread_pool_max = 64;
+
+    object_property_add(obj, "thread-pool-min", "int",
+                        iothread_get_thread_pool_prop,
+                        iothread_set_thread_pool_prop,
+                        NULL, &iothread->thread_pool_min, NULL);
+    object_property_add(obj, "thread-pool-max", "int",
+                        iothread_get_thread_pool_prop,
+                        iothread_set_thread_pool_prop,
+                        NULL, &iothread->thread_pool_max, NULL);
+
+    qemu_mutex_init(&iothread->init_done_lock);
+    qemu_cond_init(&iothread->init_done_cond);
+
+    qemu_thread_create(&iothread->thread, iothread_run,
+                       iothread, QEMU_THREAD_JOINABLE);
+
+    /* Wait for initialization to complete */
+    qemu_mutex_lock(&iothread->init_done_lock);
+    while (iothread->thread_id == -1) {
+        qemu_cond_wait(&iothread->init_done_cond,
+                       &iothread->init_done_lock);
+    }
+    qemu_mutex_unlock(&iothread->init_done_lock);
+}
+
+static void iothread_instance_finalize(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->stopping = true;
+    aio_notify(iothread->ctx);
+    qemu_thread_join(&iothread->thread);
+    qemu_cond_destroy(&iothread->init_done_cond);
+    qemu_mutex_destroy(&iothread->init_done_lock);
+    aio_context_unref(iothread->ctx);
+}
+
+static const TypeInfo iothread_info = {
+    .name = TYPE_IOTHREAD,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
+    .instance_finalize = iothread_instance_finalize,
+};
+
+static void iothread_register_types(void)
+{
+    type_register_static(&iothread_info);
+}
+
+type_init(iothread_register_types)
+
+IOThread *iothread_find(const char *id)
+{
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+    Object *child;
+
+    child = object_property_get_link(container, id, NULL);
+    if (!child) {
+        return NULL;
+    }
+    return (IOThread *)object_dynamic_cast(child, TYPE_IOTHREAD);
+}
+
+char *iothread_get_id(IOThread *iothread)
+{
+    return object_get_canonical_path_component(OBJECT(iothread));
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+static int query_one_iothread(Object *object, void *opaque)
+{
+    IOThreadInfoList ***prev = opaque;
+    IOThreadInfoList *elem;
+    IOThreadInfo *info;
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    info = g_new0(IOThreadInfo, 1);
+    info->id = iothread_get_id(iothread);
+    info->thread_id = iothread->thread_id;
+
+    elem = g_new0(IOThreadInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+IOThreadInfoList *qmp_query_iothreads(Error **errp)
+{
+    IOThreadInfoList *head = NULL;
+    IOThreadInfoList **prev = &head;
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+
+    object_child_foreach(container, query_one_iothread, &prev);
+    return head;
+}
@@ -30,6 +30,8 @@
 #include "exec/gdbstub.h"
 #include "sysemu/kvm.h"
 #include "qemu/bswap.h"
+#include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
@@ -58,6 +60,7 @@
 #endif
 
 #define KVM_MSI_HASHTAB_SIZE    256
+#define KVM_MAX_SLOTS           32
 
 typedef struct KVMSlot
 {
@@ -66,13 +69,32 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* Buffer for KVM_GET_DIRTY_LOG, kept across syncs.  */
+    unsigned long *dirty_harvest;
+    /* Pages harvested from KVM but not yet reported to the memory core,
+     * because they were outside the range that was synced.
+     */
+    unsigned long *dirty_bmap;
+    bool dirty_pending;
+    /* The kernel knows about the slot.  */
+    bool registered;
 } KVMSlot;
 
 typedef struct kvm_dirty_log KVMDirtyLog;
 
 struct KVMState
 {
-    KVMSlot slots[32];
+    KVMSlot slots[KVM_MAX_SLOTS];
+    /* Slots in use, sorted by guest physical address.  */
+    KVMSlot *sorted_slots[KVM_MAX_SLOTS];
+    int nr_sorted_slots;
+    DECLARE_BITMAP(free_slots, KVM_MAX_SLOTS);
+    /* Slot changes are only sent to the kernel at the end of a memory
+     * transaction; slots freed in the meantime are not reused until then.
+     */
+    bool slots_batch;
+    DECLARE_BITMAP(dirty_slots, KVM_MAX_SLOTS);
+    DECLARE_BITMAP(released_slots, KVM_MAX_SLOTS);
     int fd;
     int vmfd;
     int coalesced_mmio;
@@ -100,7 +122,16 @@ struct KVMState
     uint32_t *used_gsi_bitmap;
     unsigned int gsi_count;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
+    /* dynamic MSI routes, least recently used first */
+    QTAILQ_HEAD(msi_lru, KVMMSIRoute) msi_lru;
+    int msi_routes;
+    uint64_t msi_route_hits;
+    uint64_t msi_route_misses;
+    uint64_t msi_route_evictions;
     bool direct_msi;
+    /* route changes waiting for irq_routes_bh to commit them */
+    bool irq_routes_dirty;
+    QEMUBH *irq_routes_bh;
 #endif
 };
 
@@ -115,6 +146,9 @@ bool kvm_gsi_direct_mapping;
 bool kvm_allowed;
 bool kvm_readonly_mem_allowed;
 
+static NotifierList kvm_irq_routes_notifiers =
+    NOTIFIER_LIST_INITIALIZER(kvm_irq_routes_notifiers);
+
 static const KVMCapabilityInfo kvm_required_capabilites[] = {
     KVM_CAP_INFO(USER_MEMORY),
     KVM_CAP_INFO(DESTROY_MEMORY_REGION_WORKS),
@@ -123,31 +157,75 @@ static const KVMCapabilityInfo kvm_required_capabilites[] = {
 
 static KVMSlot *kvm_alloc_slot(KVMState *s)
 {
-    int i;
+    unsigned long i = find_first_bit(s->free_slots, KVM_MAX_SLOTS);
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        if (s->slots[i].memory_size == 0) {
-            return &s->slots[i];
-        }
+    if (i < KVM_MAX_SLOTS) {
+        clear_bit(i, s->free_slots);
+        return &s->slots[i];
     }
 
     fprintf(stderr, "%s: no free slot available\n", __func__);
     abort();
 }
 
+/*
+ * Return the position in s->sorted_slots of the first slot that ends
+ * after @addr.  Slots never overlap, so they are sorted by end address
+ * as well.
+ */
+static int kvm_slot_index(KVMState *s, hwaddr addr)
+{
+    int lo = 0, hi = s->nr_sorted_slots;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        KVMSlot *mem = s->sorted_slots[mid];
+
+        if (mem->start_addr + mem->memory_size <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void kvm_slot_insert(KVMState *s, KVMSlot *mem)
+{
+    int i = kvm_slot_index(s, mem->start_addr);
+
+    assert(s->nr_sorted_slots < KVM_MAX_SLOTS);
+    memmove(&s->sorted_slots[i + 1], &s->sorted_slots[i],
+            (s->nr_sorted_slots - i) * sizeof(s->sorted_slots[0]));
+    s->sorted_slots[i] = mem;
+    s->nr_sorted_slots++;
+}
+
+static void kvm_slot_remove(KVMState *s, KVMSlot *mem)
+{
+    int i = kvm_slot_index(s, mem->start_addr);
+
+    assert(i < s->nr_sorted_slots && s->sorted_slots[i] == mem);
+    s->nr_sorted_slots--;
+    memmove(&s->sorted_slots[i], &s->sorted_slots[i + 1],
+            (s->nr_sorted_slots - i) * sizeof(s->sorted_slots[0]));
+}
+
 static KVMSlot *kvm_lookup_matching_slot(KVMState *s,
                                          hwaddr start_addr,
                                          hwaddr end_addr)
 {
-    int i;
+    int i = kvm_slot_index(s, start_addr);
+    KVMSlot *mem;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        KVMSlot *mem = &s->slots[i];
+    if (i == s->nr_sorted_slots) {
+        return NULL;
+    }
 
-        if (start_addr == mem->start_addr &&
-            end_addr == mem->start_addr + mem->memory_size) {
-            return mem;
-        }
+    mem = s->sorted_slots[i];
+    if (start_addr == mem->start_addr &&
+        end_addr == mem->start_addr + mem->memory_size) {
+        return mem;
     }
 
     return NULL;
@@ -160,24 +238,14 @@ static KVMSlot *kvm_lookup_overlapping_slot(KVMState *s,
                                             hwaddr start_addr,
                                             hwaddr end_addr)
 {
-    KVMSlot *found = NULL;
-    int i;
-
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        KVMSlot *mem = &s->slots[i];
-
-        if (mem->memory_size == 0 ||
-            (found && found->start_addr < mem->start_addr)) {
-            continue;
-        }
+    int i = kvm_slot_index(s, start_addr);
 
-        if (end_addr > mem->start_addr &&
-            start_addr < mem->start_addr + mem->memory_size) {
-            found = mem;
-        }
+    if (i < s->nr_sorted_slots &&
+        end_addr > s->sorted_slots[i]->start_addr) {
+        return s->sorted_slots[i];
     }
 
-    return found;
+    return NULL;
 }
 
 int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
@@ -185,8 +253,8 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
 {
     int i;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        KVMSlot *mem = &s->slots[i];
+    for (i = 0; i < s->nr_sorted_slots; i++) {
+        KVMSlot *mem = s->sorted_slots[i];
 
         if (ram >= mem->ram && ram < mem->ram + mem->memory_size) {
             *phys_addr = mem->start_addr + (ram - mem->ram);
@@ -200,6 +268,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
 static int kvm_set_user_memory_region(KVMState *s, KVMSlot *slot)
 {
     struct kvm_userspace_memory_region mem;
+    int ret;
 
     mem.slot = slot->slot;
     mem.guest_phys_addr = slot->start_addr;
@@ -216,7 +285,25 @@ static int kvm_set_user_memory_region(KVMState *s, KVMSlot *slot)
         kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
     }
     mem.memory_size = slot->memory_size;
-    return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
+    ret = kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
+    if (ret == 0) {
+        slot->registered = slot->memory_size != 0;
+    }
+    return ret;
+}
+
+/*
+ * Slot updates.  Outside a memory transaction they are sent to the kernel
+ * immediately; inside one, they are collected and sent by kvm_slots_commit,
+ * so that each slot is touched at most once per topology change.
+ */
+static int kvm_slot_update(KVMState *s, KVMSlot *mem)
+{
+    if (s->slots_batch) {
+        set_bit(mem->slot, s->dirty_slots);
+        return 0;
+    }
+    return kvm_set_user_memory_region(s, mem);
 }
 
 static void kvm_reset_vcpu(void *opaque)
@@ -307,7 +394,7 @@ static int kvm_slot_dirty_pages_log_change(KVMSlot *mem, bool log_dirty)
         return 0;
     }
 
-    return kvm_set_user_memory_region(s, mem);
+    return kvm_slot_update(s, mem);
 }
 
 static int kvm_dirty_pages_log_change(hwaddr phys_addr,
@@ -357,12 +444,9 @@ static int kvm_set_migration_log(int enable)
 
     s->migration_log = enable;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        mem = &s->slots[i];
+    for (i = 0; i < s->nr_sorted_slots; i++) {
+        mem = s->sorted_slots[i];
 
-        if (!mem->memory_size) {
-            continue;
-        }
         if (!!(mem->flags & KVM_MEM_LOG_DIRTY_PAGES) == enable) {
             continue;
         }
@@ -374,39 +458,243 @@ static int kvm_set_migration_log(int enable)
     return 0;
 }
 
-/* get kvm's dirty pages bitmap and update qemu's */
-static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
-                                         unsigned long *bitmap)
-{
-    unsigned int i, j;
-    unsigned long page_number, c;
-    hwaddr addr, addr1;
-    unsigned int pages = int128_get64(section->size) / getpagesize();
-    unsigned int len = (pages + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
-    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+#define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
-    /*
-     * bitmap-traveling is faster than memory-traveling (for addr...)
-     * especially when most of the memory is not dirty.
+static unsigned long kvm_slot_dirty_bitmap_size(KVMSlot *mem)
+{
+    /* XXX bad kernel interface alert
+     * For dirty bitmap, kernel allocates array of size aligned to
+     * bits-per-long.  But for case when the kernel is 64bits and
+     * the userspace is 32bits, userspace can't align to the same
+     * bits-per-long, since sizeof(long) is different between kernel
+     * and user space.  This way, userspace will provide buffer which
+     * may be 4 bytes less than the kernel will use, resulting in
+     * userspace memory corruption (which is not detectable by valgrind
+     * too, in most cases).
+     * So for now, let's align to 64 instead of HOST_LONG_BITS here, in
+     * a hope that sizeof(long) wont become >8 any time soon.
      */
-    for (i = 0; i < len; i++) {
-        if (bitmap[i] != 0) {
-            c = leul_to_cpu(bitmap[i]);
-            do {
-                j = ffsl(c) - 1;
-                c &= ~(1ul << j);
-                page_number = (i * HOST_LONG_BITS + j) * hpratio;
-                addr1 = page_number * TARGET_PAGE_SIZE;
-                addr = section->offset_within_region + addr1;
-                memory_region_set_dirty(section->mr, addr,
-                                        TARGET_PAGE_SIZE * hpratio);
-            } while (c != 0);
+    return ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
+                 /*HOST_LONG_BITS*/ 64) / 8;
+}
+
+static bool kvm_slot_is_logging(KVMState *s, KVMSlot *mem)
+{
+    return (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) || s->migration_log;
+}
+
+/*
+ * Report the host pages in [first, last) that are set in the KVM format
+ * (little-endian) @bitmap as dirty, and clear them.  Runs of dirty pages
+ * are merged across words, so that a fully dirty slot results in a single
+ * memory_region_set_dirty() call.
+ */
+static void kvm_slot_report_dirty(KVMSlot *mem, unsigned long *bitmap,
+                                  unsigned long first, unsigned long last)
+{
+    unsigned long hpsize = getpagesize();
+    unsigned long run_start = 0, run_end = 0;
+    unsigned long i, base, mask, c;
+    ram_addr_t offset;
+    MemoryRegion *mr;
+    int j, n;
+
+    mr = qemu_ram_addr_from_host(mem->ram, &offset);
+    assert(mr);
+    offset -= memory_region_get_ram_addr(mr);
+
+    for (i = first / HOST_LONG_BITS; i * HOST_LONG_BITS < last; i++) {
+        if (!bitmap[i]) {
+            continue;
+        }
+
+        base = i * HOST_LONG_BITS;
+        mask = ~0UL;
+        if (base < first) {
+            mask &= ~0UL << (first - base);
+        }
+        if (last - base < HOST_LONG_BITS) {
+            mask &= ~(~0UL << (last - base));
+        }
+        c = leul_to_cpu(bitmap[i]) & mask;
+        if (!c) {
+            continue;
+        }
+        bitmap[i] &= ~leul_to_cpu(c);
+
+        while (c) {
+            j = ctzl(c);
+            n = ctol(c >> j);
+            if (base + j != run_end) {
+                if (run_end > run_start) {
+                    memory_region_set_dirty(mr, offset + run_start * hpsize,
+                                            (run_end - run_start) * hpsize);
+                }
+                run_start = base + j;
+            }
+            run_end = base + j + n;
+            if (j + n == HOST_LONG_BITS) {
+                break;
+            }
+            c &= ~0UL << (j + n);
+        }
+    }
+
+    if (run_end > run_start) {
+        memory_region_set_dirty(mr, offset + run_start * hpsize,
+                                (run_end - run_start) * hpsize);
+    }
+}
+
+/**
+ * kvm_slot_sync_dirty_log - Grab dirty bitmap of a slot from kernel space
+ *
+ * KVM always hands out (and clears) the log for the whole slot.  Pages
+ * in the range [@start, @end) of the slot are reported to the memory core
+ * right away, the others are kept in the slot until they are synced.
+ *
+ * @start: start offset of the range within the slot.
+ * @end: end offset of the range within the slot.
+ */
+static int kvm_slot_sync_dirty_log(KVMState *s, KVMSlot *mem,
+                                   hwaddr start, hwaddr end)
+{
+    unsigned long size = kvm_slot_dirty_bitmap_size(mem);
+    unsigned long nbits = size * BITS_PER_BYTE;
+    unsigned long hpsize = getpagesize();
+    unsigned long first = start / hpsize;
+    unsigned long last = MIN(DIV_ROUND_UP(end, hpsize), nbits);
+    bool whole_slot = first == 0 && end >= mem->memory_size;
+    KVMDirtyLog d;
+
+    if (mem->registered && kvm_slot_is_logging(s, mem)) {
+        if (!mem->dirty_harvest) {
+            mem->dirty_harvest = g_malloc0(size);
+        }
+
+        d.dirty_bitmap = mem->dirty_harvest;
+        d.slot = mem->slot;
+        if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
+            DPRINTF("ioctl failed %d\n", errno);
+            return -1;
+        }
+
+        if (whole_slot && !mem->dirty_pending) {
+            kvm_slot_report_dirty(mem, mem->dirty_harvest, 0, nbits);
+            return 0;
+        }
+
+        if (!mem->dirty_bmap) {
+            mem->dirty_bmap = g_malloc0(size);
+        }
+        bitmap_or(mem->dirty_bmap, mem->dirty_bmap, mem->dirty_harvest,
+                  nbits);
+        mem->dirty_pending = true;
+    }
+
+    if (mem->dirty_pending) {
+        kvm_slot_report_dirty(mem, mem->dirty_bmap, first, last);
+        if (whole_slot) {
+            mem->dirty_pending = false;
         }
     }
     return 0;
 }
 
-#define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
+static void kvm_slot_free_dirty_log(KVMSlot *mem)
+{
+    g_free(mem->dirty_harvest);
+    g_free(mem->dirty_bmap);
+    mem->dirty_harvest = NULL;
+    mem->dirty_bmap = NULL;
+    mem->dirty_pending = false;
+}
+
+static int kvm_slot_delete(KVMState *s, KVMSlot *mem)
+{
+    mem->memory_size = 0;
+    if (!mem->registered) {
+        return 0;
+    }
+    return kvm_set_user_memory_region(s, mem);
+}
+
+static int kvm_slot_register(KVMState *s, KVMSlot *mem)
+{
+    kvm_slot_insert(s, mem);
+    return kvm_slot_update(s, mem);
+}
+
+static int kvm_slot_unregister(KVMState *s, KVMSlot *mem)
+{
+    int err;
+
+    kvm_slot_remove(s, mem);
+
+    /* Flush the log of the slot, including pages that were harvested
+     * earlier but not reported yet.
+     */
+    kvm_slot_sync_dirty_log(s, mem, 0, mem->memory_size);
+    kvm_slot_free_dirty_log(mem);
+
+    if (s->slots_batch) {
+        set_bit(mem->slot, s->released_slots);
+        return 0;
+    }
+
+    err = kvm_slot_delete(s, mem);
+    set_bit(mem->slot, s->free_slots);
+    return err;
+}
+
+static void kvm_slots_begin(KVMState *s)
+{
+    s->slots_batch = true;
+}
+
+static void kvm_slots_commit(KVMState *s)
+{
+    unsigned long i;
+    int err;
+
+    s->slots_batch = false;
+
+    /* Removals go first, so that new slots never overlap in the kernel.  */
+    for (i = find_first_bit(s->released_slots, KVM_MAX_SLOTS);
+         i < KVM_MAX_SLOTS;
+         i = find_next_bit(s->released_slots, KVM_MAX_SLOTS, i + 1)) {
+        err = kvm_slot_delete(s, &s->slots[i]);
+        if (err) {
+            fprintf(stderr, "%s: error unregistering slot: %s\n",
+                    __func__, strerror(-err));
+            abort();
+        }
+        clear_bit(i, s->released_slots);
+        set_bit(i, s->free_slots);
+    }
+
+    for (i = find_first_bit(s->dirty_slots, KVM_MAX_SLOTS);
+         i < KVM_MAX_SLOTS;
+         i = find_next_bit(s->dirty_slots, KVM_MAX_SLOTS, i + 1)) {
+        KVMSlot *mem = &s->slots[i];
+
+        clear_bit(i, s->dirty_slots);
+        if (!mem->memory_size) {
+            continue;
+        }
+        err = kvm_set_user_memory_region(s, mem);
+        if (err) {
+            fprintf(stderr, "%s: error registering slot: %s\n",
+                    __func__, strerror(-err));
+#ifdef TARGET_PPC
+            fprintf(stderr, "%s: This is probably because your kernel's " \
+                            "PAGE_SIZE is too big. Please try to use 4k " \
+                            "PAGE_SIZE!\n", __func__);
+#endif
+            abort();
+        }
+    }
+}
 
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
@@ -414,62 +702,33 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
- * @start_add: start of logged region.
- * @end_addr: end of logged region.
+ * Only the slots overlapping @section are synced, and only the part of
+ * them covered by @section is reported.
  */
 static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
-    KVMDirtyLog d;
     KVMSlot *mem;
-    int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
+    hwaddr start, end;
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
         if (mem == NULL) {
             break;
         }
 
-        /* XXX bad kernel interface alert
-         * For dirty bitmap, kernel allocates array of size aligned to
-         * bits-per-long.  But for case when the kernel is 64bits and
-         * the userspace is 32bits, userspace can't align to the same
-         * bits-per-long, since sizeof(long) is different between kernel
-         * and user space.  This way, userspace will provide buffer which
-         * may be 4 bytes less than the kernel will use, resulting in
-         * userspace memory corruption (which is not detectable by valgrind
-         * too, in most cases).
-         * So for now, let's align to 64 instead of HOST_LONG_BITS here, in
-         * a hope that sizeof(long) wont become >8 any time soon.
-         */
-        size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
-                     /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
-        }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
-
-        d.slot = mem->slot;
-
-        if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
-            DPRINTF("ioctl failed %d\n", errno);
-            ret = -1;
-            break;
+        start = MAX(start_addr, mem->start_addr) - mem->start_addr;
+        end = MIN(end_addr, mem->start_addr + mem->memory_size) -
+              mem->start_addr;
+        if (kvm_slot_sync_dirty_log(s, mem, start, end) < 0) {
+            return -1;
         }
-
-        kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
 
-    return ret;
+    return 0;
 }
 
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
@@ -683,13 +942,8 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
 
         old = *mem;
 
-        if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(section);
-        }
-
         /* unregister the overlapping slot */
-        mem->memory_size = 0;
-        err = kvm_set_user_memory_region(s, mem);
+        err = kvm_slot_unregister(s, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
                     __func__, strerror(-err));
@@ -712,7 +966,7 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
             mem->ram = old.ram;
             mem->flags = kvm_mem_flags(s, log_dirty, readonly_flag);
 
-            err = kvm_set_user_memory_region(s, mem);
+            err = kvm_slot_register(s, mem);
             if (err) {
                 fprintf(stderr, "%s: error updating slot: %s\n", __func__,
                         strerror(-err));
@@ -733,7 +987,7 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
             mem->ram = old.ram;
             mem->flags =  kvm_mem_flags(s, log_dirty, readonly_flag);
 
-            err = kvm_set_user_memory_region(s, mem);
+            err = kvm_slot_register(s, mem);
             if (err) {
                 fprintf(stderr, "%s: error registering prefix slot: %s\n",
                         __func__, strerror(-err));
@@ -757,7 +1011,7 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
             mem->ram = old.ram + size_delta;
             mem->flags = kvm_mem_flags(s, log_dirty, readonly_flag);
 
-            err = kvm_set_user_memory_region(s, mem);
+            err = kvm_slot_register(s, mem);
             if (err) {
                 fprintf(stderr, "%s: error registering suffix slot: %s\n",
                         __func__, strerror(-err));
@@ -779,7 +1033,7 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
     mem->ram = ram;
     mem->flags = kvm_mem_flags(s, log_dirty, readonly_flag);
 
-    err = kvm_set_user_memory_region(s, mem);
+    err = kvm_slot_register(s, mem);
     if (err) {
         fprintf(stderr, "%s: error registering slot: %s\n", __func__,
                 strerror(-err));
@@ -787,6 +1041,16 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
     }
 }
 
+static void kvm_begin(MemoryListener *listener)
+{
+    kvm_slots_begin(kvm_state);
+}
+
+static void kvm_commit(MemoryListener *listener)
+{
+    kvm_slots_commit(kvm_state);
+}
+
 static void kvm_region_add(MemoryListener *listener,
                            MemoryRegionSection *section)
 {
@@ -898,6 +1162,8 @@ static void kvm_io_ioeventfd_del(MemoryListener *listener,
 }
 
 static MemoryListener kvm_memory_listener = {
+    .begin = kvm_begin,
+    .commit = kvm_commit,
     .region_add = kvm_region_add,
     .region_del = kvm_region_del,
     .log_start = kvm_log_start,
@@ -949,6 +1215,7 @@ int kvm_set_irq(KVMState *s, int irq, int level)
 typedef struct KVMMSIRoute {
     struct kvm_irq_routing_entry kroute;
     QTAILQ_ENTRY(KVMMSIRoute) entry;
+    QTAILQ_ENTRY(KVMMSIRoute) lru;
 } KVMMSIRoute;
 
 static void set_gsi(KVMState *s, unsigned int gsi)
@@ -987,6 +1254,7 @@ void kvm_init_irq_routing(KVMState *s)
         for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
             QTAILQ_INIT(&s->msi_hashtab[i]);
         }
+        QTAILQ_INIT(&s->msi_lru);
     }
 
     kvm_arch_init_irq_routing(s);
@@ -996,6 +1264,7 @@ void kvm_irqchip_commit_routes(KVMState *s)
 {
     int ret;
 
+    s->irq_routes_dirty = false;
     s->irq_routes->flags = 0;
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
@@ -1025,6 +1294,7 @@ static void kvm_add_routing_entry(KVMState *s,
     set_gsi(s, entry->gsi);
 }
 
+/* Returns 1 if the entry changed and the routes need a commit.  */
 static int kvm_update_routing_entry(KVMState *s,
                                     struct kvm_irq_routing_entry *new_entry)
 {
@@ -1042,10 +1312,7 @@ static int kvm_update_routing_entry(KVMState *s,
         }
 
         *entry = *new_entry;
-
-        kvm_irqchip_commit_routes(s);
-
-        return 0;
+        return 1;
     }
 
     return -ESRCH;
@@ -1084,25 +1351,38 @@ void kvm_irqchip_release_virq(KVMState *s, int virq)
     clear_gsi(s, virq);
 }
 
-static unsigned int kvm_hash_msi(uint32_t data)
+static unsigned int kvm_hash_msi(MSIMessage msg)
 {
-    /* This is optimized for IA32 MSI layout. However, no other arch shall
-     * repeat the mistake of not providing a direct MSI injection API. */
-    return data & 0xff;
+    /* This is optimized for IA32 MSI layout, vector and destination ID.
+     * However, no other arch shall repeat the mistake of not providing a
+     * direct MSI injection API. */
+    return (msg.data ^ (msg.address >> 12)) & (KVM_MSI_HASHTAB_SIZE - 1);
 }
 
-static void kvm_flush_dynamic_msi_routes(KVMState *s)
+/* Drop the least recently used dynamic MSI route to make room for a new
+ * one.  Returns false if there is none.
+ */
+static bool kvm_evict_dynamic_msi_route(KVMState *s)
 {
-    KVMMSIRoute *route, *next;
-    unsigned int hash;
+    KVMMSIRoute *route = QTAILQ_FIRST(&s->msi_lru);
+    MSIMessage msg;
 
-    for (hash = 0; hash < KVM_MSI_HASHTAB_SIZE; hash++) {
-        QTAILQ_FOREACH_SAFE(route, &s->msi_hashtab[hash], entry, next) {
-            kvm_irqchip_release_virq(s, route->kroute.gsi);
-            QTAILQ_REMOVE(&s->msi_hashtab[hash], route, entry);
-            g_free(route);
-        }
+    if (!route) {
+        return false;
     }
+
+    msg.address = ((uint64_t)route->kroute.u.msi.address_hi << 32) |
+                  route->kroute.u.msi.address_lo;
+    msg.data = cpu_to_le32(route->kroute.u.msi.data);
+    trace_kvm_msi_route_evict(route->kroute.gsi, msg.address, msg.data);
+
+    kvm_irqchip_release_virq(s, route->kroute.gsi);
+    QTAILQ_REMOVE(&s->msi_hashtab[kvm_hash_msi(msg)], route, entry);
+    QTAILQ_REMOVE(&s->msi_lru, route, lru);
+    g_free(route);
+    s->msi_routes--;
+    s->msi_route_evictions++;
+    return true;
 }
 
 static int kvm_irqchip_get_virq(KVMState *s)
@@ -1110,7 +1390,6 @@ static int kvm_irqchip_get_virq(KVMState *s)
     uint32_t *word = s->used_gsi_bitmap;
     int max_words = ALIGN(s->gsi_count, 32) / 32;
     int i, bit;
-    bool retry = true;
 
 again:
     /* Return the lowest unused GSI in the bitmap */
@@ -1122,9 +1401,7 @@ again:
 
         return bit - 1 + i * 32;
     }
-    if (!s->direct_msi && retry) {
-        retry = false;
-        kvm_flush_dynamic_msi_routes(s);
+    if (!s->direct_msi && kvm_evict_dynamic_msi_route(s)) {
         goto again;
     }
     return -ENOSPC;
@@ -1133,7 +1410,7 @@ again:
 
 static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
 {
-    unsigned int hash = kvm_hash_msi(msg.data);
+    unsigned int hash = kvm_hash_msi(msg);
     KVMMSIRoute *route;
 
     QTAILQ_FOREACH(route, &s->msi_hashtab[hash], entry) {
@@ -1146,6 +1423,23 @@ static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
     return NULL;
 }
 
+KvmMSIRouteCacheInfo *kvm_msi_route_cache_info(void)
+{
+    KVMState *s = kvm_state;
+    KvmMSIRouteCacheInfo *info;
+
+    if (!s || !kvm_gsi_routing_enabled() || s->direct_msi) {
+        return NULL;
+    }
+
+    info = g_malloc0(sizeof(*info));
+    info->routes = s->msi_routes;
+    info->hits = s->msi_route_hits;
+    info->misses = s->msi_route_misses;
+    info->evictions = s->msi_route_evictions;
+    return info;
+}
+
 int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
 {
     struct kvm_msi msi;
@@ -1162,9 +1456,14 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
     }
 
     route = kvm_lookup_msi_route(s, msg);
-    if (!route) {
+    if (route) {
+        s->msi_route_hits++;
+        QTAILQ_REMOVE(&s->msi_lru, route, lru);
+        QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
+    } else {
         int virq;
 
+        s->msi_route_misses++;
         virq = kvm_irqchip_get_virq(s);
         if (virq < 0) {
             return virq;
@@ -1181,8 +1480,10 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
         kvm_add_routing_entry(s, &route->kroute);
         kvm_irqchip_commit_routes(s);
 
-        QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
-                           entry);
+        QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg)], route, entry);
+        QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
+        s->msi_routes++;
+        trace_kvm_msi_route_add(virq, msg.address, msg.data);
     }
 
     assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
@@ -1221,10 +1522,24 @@ int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
     return virq;
 }
 
-int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
+static int kvm_irqchip_set_msi_route(KVMState *s, int virq, MSIMessage msg)
 {
     struct kvm_irq_routing_entry kroute = {};
 
+    kroute.gsi = virq;
+    kroute.type = KVM_IRQ_ROUTING_MSI;
+    kroute.flags = 0;
+    kroute.u.msi.address_lo = (uint32_t)msg.address;
+    kroute.u.msi.address_hi = msg.address >> 32;
+    kroute.u.msi.data = le32_to_cpu(msg.data);
+
+    return kvm_update_routing_entry(s, &kroute);
+}
+
+int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
+{
+    int ret;
+
     if (kvm_gsi_direct_mapping()) {
         return 0;
     }
@@ -1233,14 +1548,48 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
         return -ENOSYS;
     }
 
-    kroute.gsi = virq;
-    kroute.type = KVM_IRQ_ROUTING_MSI;
-    kroute.flags = 0;
-    kroute.u.msi.address_lo = (uint32_t)msg.address;
-    kroute.u.msi.address_hi = msg.address >> 32;
-    kroute.u.msi.data = le32_to_cpu(msg.data);
+    ret = kvm_irqchip_set_msi_route(s, virq, msg);
+    if (ret > 0 || (ret == 0 && s->irq_routes_dirty)) {
+        kvm_irqchip_commit_routes(s);
+    }
+    return ret < 0 ? ret : 0;
+}
 
-    return kvm_update_routing_entry(s, &kroute);
+static void kvm_irqchip_routes_bh(void *opaque)
+{
+    KVMState *s = opaque;
+
+    if (s->irq_routes_dirty) {
+        kvm_irqchip_commit_routes(s);
+    }
+    notifier_list_notify(&kvm_irq_routes_notifiers, s);
+}
+
+int kvm_irqchip_update_msi_route_deferred(KVMState *s, int virq,
+                                          MSIMessage msg)
+{
+    int ret;
+
+    if (kvm_gsi_direct_mapping()) {
+        return 0;
+    }
+
+    if (!kvm_irqchip_in_kernel()) {
+        return -ENOSYS;
+    }
+
+    ret = kvm_irqchip_set_msi_route(s, virq, msg);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret > 0 && !s->irq_routes_dirty) {
+        if (!s->irq_routes_bh) {
+            s->irq_routes_bh = qemu_bh_new(kvm_irqchip_routes_bh, s);
+        }
+        s->irq_routes_dirty = true;
+        qemu_bh_schedule(s->irq_routes_bh);
+    }
+    return s->irq_routes_dirty;
 }
 
 static int kvm_irqchip_assign_irqfd(KVMState *s, int fd, int rfd, int virq,
@@ -1293,8 +1642,29 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
 {
     return -ENOSYS;
 }
+
+int kvm_irqchip_update_msi_route_deferred(KVMState *s, int virq,
+                                          MSIMessage msg)
+{
+    return -ENOSYS;
+}
+
+KvmMSIRouteCacheInfo *kvm_msi_route_cache_info(void)
+{
+    return NULL;
+}
 #endif /* !KVM_CAP_IRQ_ROUTING */
 
+void kvm_irqchip_add_routes_notifier(Notifier *n)
+{
+    notifier_list_add(&kvm_irq_routes_notifiers, n);
+}
+
+void kvm_irqchip_remove_routes_notifier(Notifier *n)
+{
+    notifier_remove(n);
+}
+
 int kvm_irqchip_add_irqfd_notifier(KVMState *s, EventNotifier *n,
                                    EventNotifier *rn, int virq)
 {
@@ -1386,6 +1756,7 @@ int kvm_init(void)
     for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
         s->slots[i].slot = i;
     }
+    bitmap_fill(s->free_slots, KVM_MAX_SLOTS);
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1545,6 +1916,52 @@ static void kvm_handle_io(uint16_t port, void *data, int direction, int size,
     }
 }
 
+/*
+ * Try to complete an MMIO or PIO exit without the iothread mutex.  This
+ * only succeeds for accesses to regions that declared themselves thread-safe;
+ * anything else is left to the regular exit handling.
+ */
+static bool kvm_handle_exit_unlocked(CPUState *cpu, struct kvm_run *run)
+{
+    uint8_t *ptr;
+    int i;
+
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        ptr = (uint8_t *)run + run->io.data_offset;
+        for (i = 0; i < run->io.count; i++) {
+            if (!address_space_rw_unlocked(&address_space_io, run->io.port,
+                                           ptr, run->io.size,
+                                           run->io.direction ==
+                                           KVM_EXIT_IO_OUT)) {
+                if (i == 0) {
+                    return false;
+                }
+                /* the port was remapped under our feet, finish locked */
+                qemu_mutex_lock_iothread();
+                kvm_handle_io(run->io.port, ptr, run->io.direction,
+                              run->io.size, run->io.count - i);
+                qemu_mutex_unlock_iothread();
+                break;
+            }
+            ptr += run->io.size;
+        }
+        break;
+    case KVM_EXIT_MMIO:
+        if (!address_space_rw_unlocked(&address_space_memory,
+                                       run->mmio.phys_addr, run->mmio.data,
+                                       run->mmio.len, run->mmio.is_write)) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    trace_kvm_run_exit_unlocked(cpu->cpu_index, run->exit_reason);
+    return true;
+}
+
 static int kvm_handle_internal_error(CPUState *cpu, struct kvm_run *run)
 {
     fprintf(stderr, "KVM internal error.");
@@ -1615,6 +2032,11 @@ void kvm_cpu_synchronize_state(CPUState *cpu)
     }
 }
 
+void kvm_cpu_synchronize_all_states(void)
+{
+    run_on_all_cpus(do_kvm_cpu_synchronize_state);
+}
+
 void kvm_cpu_synchronize_post_reset(CPUState *cpu)
 {
     kvm_arch_put_registers(cpu, KVM_PUT_RESET_STATE);
@@ -1627,6 +2049,26 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
     cpu->kvm_vcpu_dirty = false;
 }
 
+static void do_kvm_cpu_synchronize_post_reset(void *arg)
+{
+    kvm_cpu_synchronize_post_reset(arg);
+}
+
+static void do_kvm_cpu_synchronize_post_init(void *arg)
+{
+    kvm_cpu_synchronize_post_init(arg);
+}
+
+void kvm_cpu_synchronize_all_post_reset(void)
+{
+    run_on_all_cpus(do_kvm_cpu_synchronize_post_reset);
+}
+
+void kvm_cpu_synchronize_all_post_init(void)
+{
+    run_on_all_cpus(do_kvm_cpu_synchronize_post_init);
+}
+
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
@@ -1657,7 +2099,16 @@ int kvm_cpu_exec(CPUState *cpu)
         }
         qemu_mutex_unlock_iothread();
 
-        run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        /*
+         * Exits to thread-safe regions are completed right here and the
+         * guest re-entered without the iothread mutex.  Anything that needs
+         * pre_run to run again kicks the vCPU, which makes KVM_RUN fail
+         * with -EINTR.
+         */
+        do {
+            run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        } while (run_ret >= 0 && !cpu->exit_request &&
+                 kvm_handle_exit_unlocked(cpu, run));
 
         qemu_mutex_lock_iothread();
         kvm_arch_post_run(cpu, run);
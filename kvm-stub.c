@@ -47,6 +47,10 @@ void kvm_cpu_synchronize_state(CPUState *cpu)
 {
 }
 
+void kvm_cpu_synchronize_all_states(void)
+{
+}
+
 void kvm_cpu_synchronize_post_reset(CPUState *cpu)
 {
 }
@@ -55,6 +59,14 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
 {
 }
 
+void kvm_cpu_synchronize_all_post_reset(void)
+{
+}
+
+void kvm_cpu_synchronize_all_post_init(void)
+{
+}
+
 int kvm_cpu_exec(CPUState *cpu)
 {
     abort();
@@ -136,6 +148,25 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
     return -ENOSYS;
 }
 
+int kvm_irqchip_update_msi_route_deferred(KVMState *s, int virq,
+                                          MSIMessage msg)
+{
+    return -ENOSYS;
+}
+
+void kvm_irqchip_add_routes_notifier(Notifier *n)
+{
+}
+
+KvmMSIRouteCacheInfo *kvm_msi_route_cache_info(void)
+{
+    return NULL;
+}
+
+void kvm_irqchip_remove_routes_notifier(Notifier *n)
+{
+}
+
 int kvm_irqchip_add_irqfd_notifier(KVMState *s, EventNotifier *n,
                                    EventNotifier *rn, int virq)
 {
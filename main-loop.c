@@ -28,6 +28,7 @@
 #include "slirp/libslirp.h"
 #include "qemu/main-loop.h"
 #include "block/aio.h"
+#include "qemu/stats.h"
 
 #ifndef _WIN32
 
@@ -125,6 +126,11 @@ void qemu_notify_event(void)
 
 static GArray *gpollfds;
 
+static Stats *main_loop_stats;
+static StatsCounter *main_loop_iterations;
+static StatsHistogram *main_loop_iteration_ns;
+static StatsHistogram *main_loop_wait_ns;
+
 int qemu_init_main_loop(void)
 {
     int ret;
@@ -138,6 +144,11 @@ int qemu_init_main_loop(void)
     }
 
     gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    main_loop_stats = stats_new("main-loop");
+    main_loop_iterations = stats_add_counter(main_loop_stats, "iterations");
+    main_loop_iteration_ns = stats_add_histogram(main_loop_stats,
+                                                 "iteration-ns");
+    main_loop_wait_ns = stats_add_histogram(main_loop_stats, "wait-ns");
     qemu_aio_context = aio_context_new();
     src = aio_get_g_source(qemu_aio_context);
     g_source_attach(src, NULL);
@@ -196,6 +207,7 @@ static int os_host_main_loop_wait(int64_t timeout)
 {
     int ret;
     static int spin_counter;
+    int64_t wait_start;
 
     glib_pollfds_fill(&timeout);
 
@@ -218,6 +230,7 @@ static int os_host_main_loop_wait(int64_t timeout)
         timeout = SCALE_MS;
     }
 
+    wait_start = get_clock();
     if (timeout) {
         spin_counter = 0;
         qemu_mutex_unlock_iothread();
@@ -230,6 +243,7 @@ static int os_host_main_loop_wait(int64_t timeout)
     if (timeout) {
         qemu_mutex_lock_iothread();
     }
+    stats_histogram_record(main_loop_wait_ns, get_clock() - wait_start);
 
     glib_pollfds_poll();
     return ret;
@@ -383,7 +397,7 @@ static int os_host_main_loop_wait(int64_t timeout)
     PollingEntry *pe;
     WaitObjects *w = &wait_objects;
     gint poll_timeout;
-    int64_t poll_timeout_ns;
+    int64_t poll_timeout_ns, wait_start;
     static struct timeval tv0;
     fd_set rfds, wfds, xfds;
     int nfds;
@@ -429,10 +443,12 @@ static int os_host_main_loop_wait(int64_t timeout)
 
     poll_timeout_ns = qemu_soonest_timeout(poll_timeout_ns, timeout);
 
+    wait_start = get_clock();
     qemu_mutex_unlock_iothread();
     g_poll_ret = qemu_poll_ns(poll_fds, n_poll_fds + w->num, poll_timeout_ns);
 
     qemu_mutex_lock_iothread();
+    stats_histogram_record(main_loop_wait_ns, get_clock() - wait_start);
     if (g_poll_ret > 0) {
         for (i = 0; i < w->num; i++) {
             w->revents[i] = poll_fds[n_poll_fds + i].revents;
@@ -457,6 +473,7 @@ int main_loop_wait(int nonblocking)
     int ret;
     uint32_t timeout = UINT32_MAX;
     int64_t timeout_ns;
+    int64_t start = get_clock();
 
     if (nonblocking) {
         timeout = 0;
@@ -488,6 +505,8 @@ int main_loop_wait(int nonblocking)
 
     qemu_clock_run_all_timers();
 
+    stats_counter_inc(main_loop_iterations);
+    stats_histogram_record(main_loop_iteration_ns, get_clock() - start);
     return ret;
 }
 
@@ -17,6 +17,7 @@
 #include "exec/address-spaces.h"
 #include "exec/ioport.h"
 #include "qemu/bitops.h"
+#include "qemu/rcu.h"
 #include "qom/object.h"
 #include "trace.h"
 #include <assert.h>
@@ -29,26 +30,12 @@ static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool global_dirty_log = false;
 
-/* flat_view_mutex is taken around reading as->current_map; the critical
- * section is extremely short, so I'm using a single mutex for every AS.
- * We could also RCU for the read-side.
- *
- * The BQL is taken around transaction commits, hence both locks are taken
- * while writing to as->current_map (with the BQL taken outside).
- */
-static QemuMutex flat_view_mutex;
-
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
 static QTAILQ_HEAD(, AddressSpace) address_spaces
     = QTAILQ_HEAD_INITIALIZER(address_spaces);
 
-static void memory_init(void)
-{
-    qemu_mutex_init(&flat_view_mutex);
-}
-
 typedef struct AddrRange AddrRange;
 
 /*
@@ -236,9 +223,12 @@ struct FlatRange {
 };
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
- * order.
+ * order.  Readers take a reference to as->current_map within an RCU critical
+ * section; the transaction commit (with the BQL taken) publishes the new view
+ * and drops the reference of the old one after a grace period.
  */
 struct FlatView {
+    struct rcu_head rcu;
     unsigned ref;
     FlatRange *ranges;
     unsigned nr;
@@ -651,10 +641,10 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
 {
     FlatView *view;
 
-    qemu_mutex_lock(&flat_view_mutex);
-    view = as->current_map;
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
     flatview_ref(view);
-    qemu_mutex_unlock(&flat_view_mutex);
+    rcu_read_unlock();
     return view;
 }
 
@@ -763,10 +753,9 @@ static void address_space_update_topology(AddressSpace *as)
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
-    qemu_mutex_lock(&flat_view_mutex);
-    flatview_unref(as->current_map);
-    as->current_map = new_view;
-    qemu_mutex_unlock(&flat_view_mutex);
+    /* Writes are protected by the BQL.  */
+    atomic_rcu_set(&as->current_map, new_view);
+    call_rcu(old_view, flatview_unref, rcu);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -861,6 +850,7 @@ void memory_region_init(MemoryRegion *mr,
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
     mr->flush_coalesced_mmio = false;
+    mr->thread_safe = false;
 }
 
 static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
@@ -999,11 +989,17 @@ void memory_region_init_io(MemoryRegion *mr,
                            const char *name,
                            uint64_t size)
 {
+    const MemoryRegionPostedRange *posted;
+
     memory_region_init(mr, owner, name, size);
     mr->ops = ops;
     mr->opaque = opaque;
     mr->terminates = true;
     mr->ram_addr = ~(ram_addr_t)0;
+
+    for (posted = ops->posted_writes; posted && posted->size; posted++) {
+        memory_region_add_coalescing(mr, posted->offset, posted->size);
+    }
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -1071,6 +1067,7 @@ void memory_region_init_iommu(MemoryRegion *mr,
     mr->iommu_ops = ops,
     mr->terminates = true;  /* then re-forwards */
     notifier_list_init(&mr->iommu_notify);
+    mr->iommu_batch_depth = 0;
 }
 
 void memory_region_init_reservation(MemoryRegion *mr,
@@ -1145,12 +1142,27 @@ bool memory_region_is_iommu(MemoryRegion *mr)
 
 void memory_region_register_iommu_notifier(MemoryRegion *mr, Notifier *n)
 {
+    bool first = QLIST_EMPTY(&mr->iommu_notify.notifiers);
+
     notifier_list_add(&mr->iommu_notify, n);
+    if (first && mr->iommu_ops->notify_changed) {
+        mr->iommu_ops->notify_changed(mr, true);
+    }
 }
 
-void memory_region_unregister_iommu_notifier(Notifier *n)
+void memory_region_unregister_iommu_notifier(MemoryRegion *mr, Notifier *n)
 {
     notifier_remove(n);
+    if (QLIST_EMPTY(&mr->iommu_notify.notifiers) &&
+        mr->iommu_ops->notify_changed) {
+        mr->iommu_ops->notify_changed(mr, false);
+    }
+}
+
+int memory_region_iommu_get_kvm_fd(MemoryRegion *mr)
+{
+    assert(memory_region_is_iommu(mr));
+    return mr->iommu_ops->get_kvm_fd ? mr->iommu_ops->get_kvm_fd(mr) : -1;
 }
 
 void memory_region_notify_iommu(MemoryRegion *mr,
@@ -1160,6 +1172,25 @@ void memory_region_notify_iommu(MemoryRegion *mr,
     notifier_list_notify(&mr->iommu_notify, &entry);
 }
 
+void memory_region_iommu_batch_begin(MemoryRegion *mr)
+{
+    assert(memory_region_is_iommu(mr));
+    mr->iommu_batch_depth++;
+}
+
+void memory_region_iommu_batch_end(MemoryRegion *mr)
+{
+    assert(mr->iommu_batch_depth);
+    if (!--mr->iommu_batch_depth) {
+        notifier_list_notify(&mr->iommu_notify, NULL);
+    }
+}
+
+bool memory_region_iommu_in_batch(MemoryRegion *mr)
+{
+    return mr->iommu_batch_depth;
+}
+
 void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 {
     uint8_t mask = 1 << client;
@@ -1200,6 +1231,34 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
     return ret;
 }
 
+uint64_t memory_region_sync_dirty_to_bitmap(MemoryRegion *mr, hwaddr addr,
+                                            hwaddr size, unsigned client,
+                                            unsigned long *bitmap)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_sync_dirty_bitmap(mr->ram_addr + addr, size,
+                                                 1 << client, bitmap);
+}
+
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client)
+{
+    assert(mr->terminates);
+    memory_region_sync_dirty_range(mr, addr, size);
+    return cpu_physical_memory_snapshot_and_clear_dirty(mr->ram_addr + addr,
+                                                        size, 1 << client);
+}
+
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_snapshot_get_dirty(snap, mr->ram_addr + addr,
+                                                  size);
+}
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -1217,6 +1276,47 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_sync_dirty_range(MemoryRegion *mr, hwaddr addr,
+                                    hwaddr size)
+{
+    AddressSpace *as;
+    FlatRange *fr;
+    AddrRange range = addrrange_make(int128_make64(addr),
+                                     int128_make64(size));
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        FlatView *view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            AddrRange mrange, clip;
+            Int128 offset;
+
+            if (fr->mr != mr) {
+                continue;
+            }
+
+            /* Translate the flat range to region offsets and clip it.  */
+            mrange = addrrange_make(int128_make64(fr->offset_in_region),
+                                    fr->addr.size);
+            if (!addrrange_intersects(mrange, range)) {
+                continue;
+            }
+            clip = addrrange_intersection(mrange, range);
+            offset = int128_sub(clip.start, mrange.start);
+
+            MEMORY_LISTENER_CALL(log_sync, Forward, (&(MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = int128_get64(clip.start),
+                .size = clip.size,
+                .offset_within_address_space =
+                    int128_get64(int128_add(fr->addr.start, offset)),
+                .readonly = fr->readonly,
+            }));
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1349,6 +1449,16 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_set_thread_safe(MemoryRegion *mr, bool thread_safe)
+{
+    mr->thread_safe = thread_safe;
+}
+
+bool memory_region_is_thread_safe(MemoryRegion *mr)
+{
+    return mr->thread_safe;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -1707,10 +1817,6 @@ void memory_listener_unregister(MemoryListener *listener)
 
 void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 {
-    if (QTAILQ_EMPTY(&address_spaces)) {
-        memory_init();
-    }
-
     memory_region_transaction_begin();
     as->root = root;
     as->current_map = g_new(FlatView, 1);
@@ -1732,7 +1838,7 @@ void address_space_destroy(AddressSpace *as)
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
     address_space_destroy_dispatch(as);
-    flatview_unref(as->current_map);
+    call_rcu(as->current_map, flatview_unref, rcu);
     g_free(as->name);
     g_free(as->ioeventfds);
 }
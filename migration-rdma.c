@@ -72,6 +72,20 @@
 #define RDMA_MERGE_MAX (2 * 1024 * 1024)
 #define RDMA_SIGNALED_SEND_MAX (RDMA_MERGE_MAX / 4096)
 
+/*
+ * Only every RDMA_SIGNAL_BATCH'th RDMA write asks the hardware for a
+ * completion.  Reliable connections complete work requests in order,
+ * so a signaled completion also retires every unsignaled write that
+ * was posted before it.
+ */
+#define RDMA_SIGNAL_BATCH 64
+
+/*
+ * Maximum number of unregistered chunks following the one being written
+ * that are registered on the destination in the same control message.
+ */
+#define RDMA_REG_BATCH_MAX 16
+
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
 /*
@@ -93,12 +107,14 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+#define RDMA_CAPABILITY_REG_BATCH 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_REG_BATCH;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -312,6 +328,14 @@ typedef struct RDMALocalBlocks {
     RDMALocalBlock *block;
 } RDMALocalBlocks;
 
+/*
+ * An RDMA write whose completion has not been seen yet.
+ */
+typedef struct RDMAInflightWrite {
+    int index;
+    uint64_t chunk;
+} RDMAInflightWrite;
+
 /*
  * Main data structure for RDMA state.
  * While there is only one copy of this structure being allocated right now,
@@ -336,6 +360,19 @@ typedef struct RDMAContext {
     /* number of outstanding writes */
     int nb_sent;
 
+    /*
+     * Writes posted to the hardware that have not been retired by a
+     * signaled completion yet, oldest first.
+     */
+    RDMAInflightWrite inflight[RDMA_SIGNALED_SEND_MAX];
+    int inflight_head;
+    int inflight_count;
+    /* writes posted since the last signaled one */
+    int nb_unsignaled;
+    /* target of the last posted write, reused to signal the queue */
+    uint64_t last_remote_addr;
+    uint32_t last_rkey;
+
     /* store info about current buffer so that we can
        merge it with future sends */
     uint64_t current_addr;
@@ -346,6 +383,8 @@ typedef struct RDMAContext {
     int current_chunk;
 
     bool pin_all;
+    /* destination returns one result per request in a batch */
+    bool reg_batch;
 
     /*
      * infiniband-specific variables for opening the device
@@ -1360,6 +1399,64 @@ static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
     }
 }
 
+/*
+ * Remember a posted RDMA write until a signaled completion covers it.
+ */
+static void qemu_rdma_track_write(RDMAContext *rdma, int index,
+                                  uint64_t chunk, bool signaled)
+{
+    int tail = (rdma->inflight_head + rdma->inflight_count) %
+               RDMA_SIGNALED_SEND_MAX;
+
+    assert(rdma->inflight_count < RDMA_SIGNALED_SEND_MAX);
+    rdma->inflight[tail].index = index;
+    rdma->inflight[tail].chunk = chunk;
+    rdma->inflight_count++;
+    rdma->nb_unsignaled = signaled ? 0 : rdma->nb_unsignaled + 1;
+}
+
+/*
+ * A signaled write for (index, chunk) completed.  Since completions on
+ * a reliable connection are delivered in order, every write posted up
+ * to and including that one has been delivered as well.
+ */
+static void qemu_rdma_retire_writes(RDMAContext *rdma, uint64_t index,
+                                    uint64_t chunk)
+{
+    while (rdma->inflight_count) {
+        RDMAInflightWrite *w = &rdma->inflight[rdma->inflight_head];
+        RDMALocalBlock *block = &(rdma->local_ram_blocks.block[w->index]);
+        bool last = w->index == index && w->chunk == chunk;
+
+        clear_bit(w->chunk, block->transit_bitmap);
+
+        if (rdma->nb_sent > 0) {
+            rdma->nb_sent--;
+        }
+
+        if (!rdma->pin_all) {
+            /*
+             * FYI: If one wanted to signal a specific chunk to be unregistered
+             * using LRU or workload-specific information, this is the function
+             * you would call to do so. That chunk would then get asynchronously
+             * unregistered later.
+             */
+#ifdef RDMA_UNREGISTRATION_EXAMPLE
+            qemu_rdma_signal_unregister(rdma, w->index, w->chunk,
+                                        RDMA_WRID_RDMA_WRITE);
+#endif
+        }
+
+        rdma->inflight_head = (rdma->inflight_head + 1) %
+                              RDMA_SIGNALED_SEND_MAX;
+        rdma->inflight_count--;
+
+        if (last) {
+            break;
+        }
+    }
+}
+
 /*
  * Consult the connection manager to see a work request
  * (of any kind) has completed.
@@ -1414,23 +1511,7 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
                  print_wrid(wr_id), wr_id, rdma->nb_sent, index, chunk,
                  block->local_host_addr, (void *)block->remote_host_addr);
 
-        clear_bit(chunk, block->transit_bitmap);
-
-        if (rdma->nb_sent > 0) {
-            rdma->nb_sent--;
-        }
-
-        if (!rdma->pin_all) {
-            /*
-             * FYI: If one wanted to signal a specific chunk to be unregistered
-             * using LRU or workload-specific information, this is the function
-             * you would call to do so. That chunk would then get asynchronously
-             * unregistered later.
-             */
-#ifdef RDMA_UNREGISTRATION_EXAMPLE
-            qemu_rdma_signal_unregister(rdma, index, chunk, wc.wr_id);
-#endif
-        }
+        qemu_rdma_retire_writes(rdma, index, chunk);
     } else {
         DDDPRINTF("other completion %s (%" PRId64 ") received left %d\n",
             print_wrid(wr_id), wr_id, rdma->nb_sent);
@@ -1547,6 +1628,51 @@ err_block_for_wrid:
     return ret;
 }
 
+/*
+ * Make sure a signaled completion will eventually retire every write
+ * posted so far, so that callers can block waiting for them.  If the
+ * last write went out unsignaled, a zero-length signaled write to the
+ * same target is posted behind it.
+ */
+static int qemu_rdma_signal_writes(RDMAContext *rdma)
+{
+    struct ibv_send_wr send_wr = { 0 };
+    struct ibv_send_wr *bad_wr;
+    RDMAInflightWrite *w;
+    int ret;
+
+    if (!rdma->nb_unsignaled || !rdma->inflight_count) {
+        return 0;
+    }
+
+    w = &rdma->inflight[(rdma->inflight_head + rdma->inflight_count - 1) %
+                        RDMA_SIGNALED_SEND_MAX];
+
+    send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
+                                        w->index, w->chunk);
+    send_wr.opcode = IBV_WR_RDMA_WRITE;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.num_sge = 0;
+    send_wr.wr.rdma.rkey = rdma->last_rkey;
+    send_wr.wr.rdma.remote_addr = rdma->last_remote_addr;
+
+    while ((ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr)) == ENOMEM) {
+        DDPRINTF("send queue is full, waiting before signaling....\n");
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (ret > 0) {
+        perror("rdma migration: post rdma signal write failed");
+        return -ret;
+    }
+
+    rdma->nb_unsignaled = 0;
+    return 0;
+}
+
 /*
  * Post a SEND message work request for the control channel
  * containing some data and block until the post completes.
@@ -1836,6 +1962,44 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Collect registration requests for the unregistered chunks following
+ * the one that is about to be written, so that a sequential pass over
+ * guest memory costs one round trip per batch instead of one per chunk.
+ * All-zero chunks are skipped: they are sent as compress commands and
+ * never need to be registered.
+ */
+static int qemu_rdma_batch_registrations(RDMALocalBlock *block,
+                                         int current_index, uint64_t chunk,
+                                         RDMARegister *reg, uint64_t *chunks)
+{
+    uint64_t last = MIN(chunk + RDMA_REG_BATCH_MAX, block->nb_chunks);
+    int nb = 0;
+
+    for (; chunk < last; chunk++) {
+        uint8_t *start = ram_chunk_start(block, chunk);
+        size_t len = ram_chunk_end(block, chunk) - start;
+
+        if (block->remote_keys[chunk]) {
+            break;
+        }
+
+        if (can_use_buffer_find_nonzero_offset(start, len) &&
+            buffer_find_nonzero_offset(start, len) == len) {
+            continue;
+        }
+
+        reg[nb].current_index = current_index;
+        reg[nb].key.current_addr = block->offset +
+                                   (start - block->local_host_addr);
+        reg[nb].chunks = 0;
+        chunks[nb] = chunk;
+        nb++;
+    }
+
+    return nb;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -1849,12 +2013,14 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_sge sge;
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
-    int reg_result_idx, ret, count = 0;
+    int reg_result_idx, ret, count = 0, nb_reg, i;
     uint64_t chunk, chunks;
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
-    RDMARegister reg;
+    RDMARegister reg[RDMA_REG_BATCH_MAX + 1];
+    uint64_t reg_chunks[RDMA_REG_BATCH_MAX + 1];
     RDMARegisterResult *reg_result;
+    bool signaled;
     RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
     RDMAControlHeader head = { .len = sizeof(RDMARegister),
                                .type = RDMA_CONTROL_REGISTER_REQUEST,
@@ -1901,6 +2067,11 @@ retry:
                 count++, current_index, chunk,
                 sge.addr, length, rdma->nb_sent, block->nb_chunks);
 
+        ret = qemu_rdma_signal_writes(rdma);
+        if (ret < 0) {
+            return ret;
+        }
+
         ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
 
         if (ret < 0) {
@@ -1954,25 +2125,45 @@ retry:
             /*
              * Otherwise, tell other side to register.
              */
-            reg.current_index = current_index;
+            reg[0].current_index = current_index;
             if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
+                reg[0].key.current_addr = current_addr;
             } else {
-                reg.key.chunk = chunk;
+                reg[0].key.chunk = chunk;
+            }
+            reg[0].chunks = chunks;
+            reg_chunks[0] = chunk;
+            nb_reg = 1;
+
+            if (rdma->reg_batch && block->is_ram_block) {
+                nb_reg += qemu_rdma_batch_registrations(block, current_index,
+                                                        chunk + chunks + 1,
+                                                        &reg[1],
+                                                        &reg_chunks[1]);
             }
-            reg.chunks = chunks;
 
             DDPRINTF("Sending registration request chunk %" PRIu64 " for %d "
-                    "bytes, index: %d, offset: %" PRId64 "...\n",
-                    chunk, sge.length, current_index, current_addr);
+                    "bytes, index: %d, offset: %" PRId64 " (%d total)...\n",
+                    chunk, sge.length, current_index, current_addr, nb_reg);
 
-            register_to_network(&reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+            for (i = 0; i < nb_reg; i++) {
+                register_to_network(&reg[i]);
+            }
+            head.len = nb_reg * sizeof(RDMARegister);
+            head.repeat = nb_reg;
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) reg,
                                     &resp, &reg_result_idx, NULL);
             if (ret < 0) {
                 return ret;
             }
 
+            if (resp.repeat != nb_reg ||
+                resp.len != nb_reg * sizeof(RDMARegisterResult)) {
+                fprintf(stderr, "rdma migration: expected %d registration "
+                        "results, got %d!\n", nb_reg, resp.repeat);
+                return -EIO;
+            }
+
             /* try to overlap this single registration with the one we sent. */
             if (qemu_rdma_register_and_get_keys(rdma, block,
                                                 (uint8_t *) sge.addr,
@@ -1985,14 +2176,17 @@ retry:
             reg_result = (RDMARegisterResult *)
                     rdma->wr_data[reg_result_idx].control_curr;
 
-            network_to_result(reg_result);
+            for (i = 0; i < nb_reg; i++) {
+                network_to_result(&reg_result[i]);
 
-            DDPRINTF("Received registration result:"
-                    " my key: %x their key %x, chunk %" PRIu64 "\n",
-                    block->remote_keys[chunk], reg_result->rkey, chunk);
+                DDPRINTF("Received registration result:"
+                        " my key: %x their key %x, chunk %" PRIu64 "\n",
+                        block->remote_keys[reg_chunks[i]], reg_result[i].rkey,
+                        reg_chunks[i]);
 
-            block->remote_keys[chunk] = reg_result->rkey;
-            block->remote_host_addr = reg_result->host_addr;
+                block->remote_keys[reg_chunks[i]] = reg_result[i].rkey;
+                block->remote_host_addr = reg_result[i].host_addr;
+            }
         } else {
             /* already registered before */
             if (qemu_rdma_register_and_get_keys(rdma, block,
@@ -2025,8 +2219,26 @@ retry:
     send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
                                         current_index, chunk);
 
+    /*
+     * Devices may round the send queue size up, so do not let more writes
+     * be outstanding than we can keep track of.
+     */
+    while (rdma->inflight_count == RDMA_SIGNALED_SEND_MAX) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /*
+     * Only ask for a completion once per batch, or when the send queue
+     * is about to fill up so that waiting for room is always possible.
+     */
+    signaled = rdma->nb_unsignaled + 1 >= RDMA_SIGNAL_BATCH ||
+               rdma->inflight_count + 1 >= RDMA_SIGNALED_SEND_MAX;
+
     send_wr.opcode = IBV_WR_RDMA_WRITE;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
     send_wr.sg_list = &sge;
     send_wr.num_sge = 1;
     send_wr.wr.rdma.remote_addr = block->remote_host_addr +
@@ -2060,6 +2272,9 @@ retry:
     }
 
     set_bit(chunk, block->transit_bitmap);
+    qemu_rdma_track_write(rdma, current_index, chunk, signaled);
+    rdma->last_rkey = send_wr.wr.rdma.rkey;
+    rdma->last_remote_addr = send_wr.wr.rdma.remote_addr;
     acct_update_position(f, sge.length, false);
     rdma->total_writes++;
 
@@ -2346,6 +2561,8 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
 
+    cap.flags |= RDMA_CAPABILITY_REG_BATCH;
+
     caps_to_network(&cap);
 
     ret = rdma_connect(rdma->cm_id, &conn_param);
@@ -2390,7 +2607,12 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         rdma->pin_all = false;
     }
 
+    rdma->reg_batch = !rdma->pin_all &&
+                      (cap.flags & RDMA_CAPABILITY_REG_BATCH);
+
     DPRINTF("Pin all memory: %s\n", rdma->pin_all ? "enabled" : "disabled");
+    DPRINTF("Batched registration: %s\n",
+            rdma->reg_batch ? "enabled" : "disabled");
 
     rdma_ack_cm_event(cm_event);
 
@@ -2402,6 +2624,9 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     rdma->control_ready_expected = 1;
     rdma->nb_sent = 0;
+    rdma->inflight_head = 0;
+    rdma->inflight_count = 0;
+    rdma->nb_unsignaled = 0;
     return 0;
 
 err_rdma_source_connect:
@@ -2639,6 +2864,12 @@ static int qemu_rdma_drain_cq(QEMUFile *f, RDMAContext *rdma)
         return -EIO;
     }
 
+    ret = qemu_rdma_signal_writes(rdma);
+    if (ret < 0) {
+        fprintf(stderr, "rdma migration: failed to signal writes!\n");
+        return -EIO;
+    }
+
     while (rdma->nb_sent) {
         ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
         if (ret < 0) {
@@ -3052,6 +3283,7 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque,
             DDPRINTF("There are %d registration requests\n", head.repeat);
 
             reg_resp.repeat = head.repeat;
+            reg_resp.len = head.repeat * sizeof(RDMARegisterResult);
             registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
 
             for (count = 0; count < head.repeat; count++) {
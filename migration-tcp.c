@@ -47,9 +47,35 @@ static void tcp_wait_for_connect(int fd, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(s->channel_host_port);
+    s->channel_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* Opens an additional RAM channel to the destination of @s.  Blocks until
+ * the connection is established, so it must not be called from the main
+ * loop.  */
+QEMUFile *tcp_open_outgoing_channel(MigrationState *s, Error **errp)
+{
+    int fd;
+
+    if (!s->channel_host_port) {
+        error_setg(errp, "multichannel migration requires a tcp: URI");
+        return NULL;
+    }
+
+    fd = inet_connect(s->channel_host_port, errp);
+    if (fd < 0) {
+        return NULL;
+    }
+    DPRINTF("connected migration channel\n");
+    return qemu_fopen_socket(fd, "wb");
+}
+
+/* Listening socket of the incoming migration, kept open so that the
+ * source can connect additional RAM channels.  */
+static int incoming_listen_fd = -1;
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -62,7 +88,6 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
@@ -81,9 +106,54 @@ static void tcp_accept_incoming_migration(void *opaque)
     return;
 
 out:
+    tcp_close_incoming_listener();
     closesocket(c);
 }
 
+/* Accepts an additional RAM channel announced by the source on the main
+ * channel.  The source connects it before the announcement, so this only
+ * blocks if the stream is bogus.  */
+QEMUFile *tcp_accept_incoming_channel(Error **errp)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    QEMUFile *f;
+    int c;
+
+    if (incoming_listen_fd < 0) {
+        error_setg(errp, "multichannel migration requires a tcp: URI");
+        return NULL;
+    }
+
+    qemu_set_block(incoming_listen_fd);
+    do {
+        c = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                        &addrlen);
+    } while (c == -1 && socket_error() == EINTR);
+
+    if (c == -1) {
+        error_setg_errno(errp, socket_error(),
+                         "could not accept migration channel");
+        return NULL;
+    }
+    DPRINTF("accepted migration channel\n");
+
+    f = qemu_fopen_socket(c, "rb");
+    if (f == NULL) {
+        error_setg(errp, "could not qemu_fopen migration channel");
+        closesocket(c);
+    }
+    return f;
+}
+
+void tcp_close_incoming_listener(void)
+{
+    if (incoming_listen_fd >= 0) {
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
+}
+
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
 {
     int s;
@@ -93,6 +163,7 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp)
         return;
     }
 
+    incoming_listen_fd = s;
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
                          (void *)(intptr_t)s);
 }
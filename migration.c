@@ -43,6 +43,7 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -52,9 +53,37 @@ enum {
 #define BUFFER_DELAY     100
 #define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
 
+/* Weight of the newest BUFFER_DELAY window in the throughput estimate */
+#define BANDWIDTH_WEIGHT 0.25
+
+/* Time the remaining data may fail to shrink, while the guest dirties
+ * memory at least as fast as it is sent, before the migration is reported
+ * as not converging */
+#define CONVERGE_TIMEOUT 5000
+
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+/* Number of additional RAM channels of a multichannel migration */
+#define DEFAULT_MIGRATE_CHANNELS 2
+#define MAX_MIGRATE_CHANNELS 16
+
+/* Number of pre-copy rounds before switching to post-copy */
+#define DEFAULT_MIGRATE_POSTCOPY_ROUNDS 2
+#define MAX_MIGRATE_POSTCOPY_ROUNDS 255
+
+/* Dirty tracking granularity of block migration; the default keeps the
+ * stream readable by destinations that only know 1 MB blocks.
+ */
+#define DEFAULT_MIGRATE_BLOCK_GRANULARITY (1 << 20)
+#define MIN_MIGRATE_BLOCK_GRANULARITY 4096
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -68,6 +97,12 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_NONE,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        .channels = DEFAULT_MIGRATE_CHANNELS,
+        .postcopy_rounds = DEFAULT_MIGRATE_POSTCOPY_ROUNDS,
+        .block_granularity = DEFAULT_MIGRATE_BLOCK_GRANULARITY,
         .mbps = -1,
     };
 
@@ -103,7 +138,10 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
+    migrate_recv_channels_join();
+    tcp_close_incoming_listener();
     qemu_fclose(f);
+    migrate_decompress_threads_join();
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(EXIT_FAILURE);
@@ -181,6 +219,18 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->busy = compress_mig_busy();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_rate();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -203,6 +253,12 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             - s->total_time;
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
+        info->has_converging = true;
+        info->converging = s->converging;
+        if (migrate_auto_converge()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = migration_throttle_percentage();
+        }
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
 
@@ -227,9 +283,35 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        break;
+    case MIG_STATE_POSTCOPY_ACTIVE:
+        info->has_status = true;
+        info->status = g_strdup("postcopy-active");
+        info->has_total_time = true;
+        info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+            - s->total_time;
+        info->has_downtime = true;
+        info->downtime = s->downtime;
+        info->has_setup_time = true;
+        info->setup_time = s->setup_time;
+
+        info->has_ram = true;
+        info->ram = g_malloc0(sizeof(*info->ram));
+        info->ram->transferred = ram_bytes_transferred();
+        info->ram->remaining = ram_bytes_remaining();
+        info->ram->total = ram_bytes_total();
+        info->ram->duplicate = dup_mig_pages_transferred();
+        info->ram->skipped = skipped_mig_pages_transferred();
+        info->ram->normal = norm_mig_pages_transferred();
+        info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->mbps = s->mbps;
+        info->ram->has_postcopy_requests = true;
+        info->ram->postcopy_requests = ram_postcopy_requests();
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -250,6 +332,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal = norm_mig_pages_transferred();
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
+        if (migrate_postcopy_ram()) {
+            info->ram->has_postcopy_requests = true;
+            info->ram->postcopy_requests = ram_postcopy_requests();
+        }
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -270,7 +356,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -299,7 +386,8 @@ static void migrate_fd_cleanup(void *opaque)
         s->file = NULL;
     }
 
-    assert(s->state != MIG_STATE_ACTIVE);
+    assert(s->state != MIG_STATE_ACTIVE &&
+           s->state != MIG_STATE_POSTCOPY_ACTIVE);
 
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -328,6 +416,12 @@ static void migrate_fd_cancel(MigrationState *s)
 {
     DPRINTF("cancelling migration\n");
 
+    /* The guest already runs on the destination and needs the rest of
+     * its RAM from here; there is nothing to go back to.  */
+    if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+        return;
+    }
+
     migrate_set_state(s, s->state, MIG_STATE_CANCELLED);
 }
 
@@ -346,6 +440,13 @@ bool migration_in_setup(MigrationState *s)
     return s->state == MIG_STATE_SETUP;
 }
 
+bool migration_is_active(MigrationState *s)
+{
+    return (s->state == MIG_STATE_SETUP ||
+            s->state == MIG_STATE_ACTIVE ||
+            s->state == MIG_STATE_POSTCOPY_ACTIVE);
+}
+
 bool migration_has_finished(MigrationState *s)
 {
     return s->state == MIG_STATE_COMPLETED;
@@ -363,15 +464,28 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_threads = s->compress_threads;
+    int decompress_threads = s->decompress_threads;
+    int channels = s->channels;
+    int postcopy_rounds = s->postcopy_rounds;
+    int block_granularity = s->block_granularity;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
 
+    g_free(s->channel_host_port);
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_threads = compress_threads;
+    s->decompress_threads = decompress_threads;
+    s->channels = channels;
+    s->postcopy_rounds = postcopy_rounds;
+    s->block_granularity = block_granularity;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -405,7 +519,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = has_blk && blk;
     params.shared = has_inc && inc;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -419,6 +534,16 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multichannel() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "multichannel migration requires a tcp: URI");
+        return;
+    }
+
+    if (migrate_postcopy_ram() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "post-copy migration requires a tcp: URI");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -471,6 +596,96 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_channels, int64_t channels,
+                                bool has_postcopy_rounds,
+                                int64_t postcopy_rounds,
+                                bool has_block_granularity,
+                                int64_t block_granularity,
+                                Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 1 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "an integer in the range of 1 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_channels && (channels < 1 || channels > MAX_MIGRATE_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "channels",
+                  "an integer in the range of 1 to 16");
+        return;
+    }
+    if (has_postcopy_rounds &&
+        (postcopy_rounds < 1 ||
+         postcopy_rounds > MAX_MIGRATE_POSTCOPY_ROUNDS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "postcopy-rounds",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_block_granularity &&
+        (block_granularity < MIN_MIGRATE_BLOCK_GRANULARITY ||
+         block_granularity > DEFAULT_MIGRATE_BLOCK_GRANULARITY ||
+         (block_granularity & (block_granularity - 1)))) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "block-granularity",
+                  "a power of 2 between 4096 and 1048576");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_threads = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_threads = decompress_threads;
+    }
+    if (has_channels) {
+        s->channels = channels;
+    }
+    if (has_postcopy_rounds) {
+        s->postcopy_rounds = postcopy_rounds;
+    }
+    if (has_block_granularity) {
+        s->block_granularity = block_granularity;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_threads;
+    params->decompress_threads = s->decompress_threads;
+    params->channels = s->channels;
+    params->postcopy_rounds = s->postcopy_rounds;
+    params->block_granularity = s->block_granularity;
+
+    return params;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -541,8 +756,130 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_threads;
+}
+
+bool migrate_use_multichannel(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTICHANNEL];
+}
+
+int migrate_multichannel_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->channels;
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
+int migrate_postcopy_rounds(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->postcopy_rounds;
+}
+
+int migrate_block_granularity(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->block_granularity;
+}
+
 /* migration thread support */
 
+/* Downtime in ms to expect when stopping the guest now: the pending data
+ * and the device state, sent at the measured throughput */
+static int64_t migration_predict_downtime(MigrationState *s,
+                                          uint64_t pending_size)
+{
+    if (!s->bandwidth) {
+        return -1;
+    }
+    return (pending_size + qemu_savevm_device_state_size()) / s->bandwidth;
+}
+
+static bool migration_downtime_fits(MigrationState *s, uint64_t pending_size)
+{
+    int64_t downtime = migration_predict_downtime(s, pending_size);
+
+    return downtime >= 0 && downtime <= migrate_max_downtime() / 1000000;
+}
+
+/* Tracks whether the remaining data still shrinks.  It does not when the
+ * guest dirties memory at least as fast as it is sent and no iteration
+ * got below the smallest backlog seen for CONVERGE_TIMEOUT ms.  */
+static void migration_update_convergence(MigrationState *s,
+                                         uint64_t pending_size,
+                                         int64_t current_time)
+{
+    if (pending_size < s->min_pending_size) {
+        s->min_pending_size = pending_size;
+        s->min_pending_time = current_time;
+        s->converging = true;
+        return;
+    }
+
+    if (s->converging && s->bandwidth &&
+        current_time - s->min_pending_time > CONVERGE_TIMEOUT &&
+        s->dirty_bytes_rate >= s->bandwidth * 1000) {
+        trace_migration_not_converging(pending_size, s->dirty_bytes_rate,
+                                       (int64_t)(s->bandwidth * 1000));
+        s->converging = false;
+    }
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -551,7 +888,15 @@ static void *migration_thread(void *opaque)
     int64_t initial_bytes = 0;
     int64_t max_size = 0;
     int64_t start_time = initial_time;
+    int64_t switch_time = 0;
     bool old_vm_running = false;
+    bool postcopy = false;
+    uint64_t pending_size = 0;
+
+    s->bandwidth = 0;
+    s->converging = true;
+    s->min_pending_size = UINT64_MAX;
+    s->min_pending_time = initial_time;
 
     DPRINTF("beginning savevm\n");
     qemu_savevm_state_begin(s->file, &s->params);
@@ -563,19 +908,26 @@ static void *migration_thread(void *opaque)
 
     while (s->state == MIG_STATE_ACTIVE) {
         int64_t current_time;
-        uint64_t pending_size;
 
         if (!qemu_file_rate_limit(s->file)) {
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %" PRIu64 " max %" PRIu64 "\n",
                     pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (s->bandwidth) {
+                s->expected_downtime = migration_predict_downtime(s,
+                                                                  pending_size);
+            }
+            if (pending_size && !migration_downtime_fits(s, pending_size) &&
+                !ram_postcopy_ready()) {
                 qemu_savevm_state_iterate(s->file);
             } else {
                 int ret;
 
                 DPRINTF("done iterating\n");
+                /* Not converged: leave the remaining pages to post-copy */
+                postcopy = pending_size &&
+                           !migration_downtime_fits(s, pending_size);
                 qemu_mutex_lock_iothread();
                 start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
                 qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
@@ -584,6 +936,9 @@ static void *migration_thread(void *opaque)
                 ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
                 if (ret >= 0) {
                     qemu_file_set_rate_limit(s->file, INT_MAX);
+                    if (postcopy) {
+                        ram_postcopy_begin();
+                    }
                     qemu_savevm_state_complete(s->file);
                 }
                 qemu_mutex_unlock_iothread();
@@ -593,6 +948,24 @@ static void *migration_thread(void *opaque)
                     break;
                 }
 
+                if (!qemu_file_get_error(s->file) && postcopy) {
+                    /* The guest now runs on the destination */
+                    old_vm_running = false;
+                    switch_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                    s->downtime = switch_time - start_time;
+                    migrate_set_state(s, MIG_STATE_ACTIVE,
+                                      MIG_STATE_POSTCOPY_ACTIVE);
+                    qemu_fflush(s->file);
+                    if (ram_postcopy_push() < 0) {
+                        migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                          MIG_STATE_ERROR);
+                    } else {
+                        migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                          MIG_STATE_COMPLETED);
+                    }
+                    break;
+                }
+
                 if (!qemu_file_get_error(s->file)) {
                     migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_COMPLETED);
                     break;
@@ -608,20 +981,27 @@ static void *migration_thread(void *opaque)
         if (current_time >= initial_time + BUFFER_DELAY) {
             uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
             uint64_t time_spent = current_time - initial_time;
-            double bandwidth = transferred_bytes / time_spent;
-            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            double bandwidth = (double)transferred_bytes / time_spent;
+
+            /* Smooth out the noise of single windows; if we haven't sent
+               anything, we don't want to recalculate, 10000 is a small
+               enough number for our purposes */
+            if (transferred_bytes > 10000) {
+                s->bandwidth = s->bandwidth ?
+                    s->bandwidth * (1 - BANDWIDTH_WEIGHT) +
+                    bandwidth * BANDWIDTH_WEIGHT : bandwidth;
+            }
+            max_size = s->bandwidth * migrate_max_downtime() / 1000000;
+            max_size = MAX(0, max_size -
+                              (int64_t)qemu_savevm_device_state_size());
 
             s->mbps = time_spent ? (((double) transferred_bytes * 8.0) /
                     ((double) time_spent / 1000.0)) / 1000.0 / 1000.0 : -1;
 
             DPRINTF("transferred %" PRIu64 " time_spent %" PRIu64
                     " bandwidth %g max_size %" PRId64 "\n",
-                    transferred_bytes, time_spent, bandwidth, max_size);
-            /* if we haven't sent anything, we don't want to recalculate
-               10000 is a small enough number for our purposes */
-            if (s->dirty_bytes_rate && transferred_bytes > 10000) {
-                s->expected_downtime = s->dirty_bytes_rate / bandwidth;
-            }
+                    transferred_bytes, time_spent, s->bandwidth, max_size);
+            migration_update_convergence(s, pending_size, current_time);
 
             qemu_file_reset_rate_limit(s->file);
             initial_time = current_time;
@@ -637,7 +1017,7 @@ static void *migration_thread(void *opaque)
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        s->downtime = (postcopy ? switch_time : end_time) - start_time;
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
         if (old_vm_running) {
@@ -34,6 +34,7 @@
 #include "net/net.h"
 #include "net/slirp.h"
 #include "sysemu/char.h"
+#include "sysemu/dump.h"
 #include "ui/qemu-spice.h"
 #include "sysemu/sysemu.h"
 #include "monitor/monitor.h"
@@ -128,6 +129,8 @@ typedef struct mon_cmd_t {
         int  (*cmd_new)(Monitor *mon, const QDict *params, QObject **ret_data);
         int  (*cmd_async)(Monitor *mon, const QDict *params,
                           MonitorCompletion *cb, void *opaque);
+        int  (*cmd_co)(Monitor *mon, const QDict *params, QObject **ret_data,
+                       Error **errp);
     } mhandler;
     int flags;
     /* @sub_table is a list of 2nd level of commands. If it do not exist,
@@ -167,6 +170,13 @@ typedef struct MonitorControl {
     QObject *id;
     JSONMessageParser parser;
     int command_mode;
+
+    /* A MONITOR_CMD_COROUTINE command has yielded; the commands received
+     * meanwhile wait in @pending so that the responses stay in order.
+     */
+    bool co_cmd_running;
+    GQueue *pending;
+    QEMUBH *pending_bh;
 } MonitorControl;
 
 /*
@@ -399,6 +409,11 @@ static inline bool handler_is_async(const mon_cmd_t *cmd)
     return cmd->flags & MONITOR_CMD_ASYNC;
 }
 
+static inline bool handler_is_coroutine(const mon_cmd_t *cmd)
+{
+    return cmd->flags & MONITOR_CMD_COROUTINE;
+}
+
 static inline int monitor_has_error(const Monitor *mon)
 {
     return mon->error != NULL;
@@ -1119,6 +1134,12 @@ static void do_info_jit(Monitor *mon, const QDict *qdict)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    dump_tb_profile((FILE *)mon, monitor_fprintf,
+                    qdict_get_try_int(qdict, "count", 20));
+}
+
 static void do_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -1219,6 +1240,23 @@ static void do_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void do_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+
+    if (!tcg_enabled()) {
+        monitor_printf(mon, "TB profiling is only available with TCG\n");
+        return;
+    }
+    if (!option || !strcmp(option, "on")) {
+        tb_profile_set(mon_get_cpu(), true);
+    } else if (!strcmp(option, "off")) {
+        tb_profile_set(mon_get_cpu(), false);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
 static void do_gdbserver(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_try_str(qdict, "device");
@@ -2763,6 +2801,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "tb-profile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = do_info_tb_profile,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2900,6 +2945,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.cmd = hmp_info_migrate_parameters,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -2907,6 +2959,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show balloon information",
         .mhandler.cmd = hmp_info_balloon,
     },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show dump-guest-memory status",
+        .mhandler.cmd = hmp_info_dump,
+    },
     {
         .name       = "qtree",
         .args_type  = "",
@@ -2942,6 +3001,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the TPM device",
         .mhandler.cmd = hmp_info_tpm,
     },
+    {
+        .name       = "iothreads",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show iothreads",
+        .mhandler.cmd = hmp_info_iothreads,
+    },
     {
         .name       = NULL,
     },
@@ -4645,18 +4711,96 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+typedef struct QmpCoCommand {
+    Monitor *mon;
+    const mon_cmd_t *cmd;
+    QDict *args;
+    QObject *id;
+} QmpCoCommand;
+
+static void coroutine_fn qmp_co_cmd_entry(void *opaque)
+{
+    QmpCoCommand *co_cmd = opaque;
+    Monitor *mon = co_cmd->mon;
+    Monitor *old_mon;
+    QObject *data = NULL;
+    Error *local_err = NULL;
+    int ret;
+
+    ret = co_cmd->cmd->mhandler.cmd_co(mon, co_cmd->args, &data, &local_err);
+
+    /* the command may have been resumed on behalf of any monitor */
+    old_mon = cur_mon;
+    cur_mon = mon;
+    if (local_err) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+    }
+    handler_audit(mon, co_cmd->cmd, ret);
+    mon->mc->id = co_cmd->id;
+    monitor_protocol_emitter(mon, data);
+    cur_mon = old_mon;
+
+    qobject_decref(data);
+    QDECREF(co_cmd->args);
+    g_free(co_cmd);
+
+    mon->mc->co_cmd_running = false;
+    if (!g_queue_is_empty(mon->mc->pending)) {
+        qemu_bh_schedule(mon->mc->pending_bh);
+    }
+    monitor_resume(mon);
+}
+
+/*
+ * Run a command in a coroutine.  When it yields, the main loop goes on
+ * servicing devices and other monitors; this monitor stops reading input
+ * until the response has been sent.
+ */
+static void qmp_co_cmd_start(Monitor *mon, const mon_cmd_t *cmd,
+                             QDict *args)
+{
+    QmpCoCommand *co_cmd = g_new0(QmpCoCommand, 1);
+    Coroutine *co;
+
+    co_cmd->mon = mon;
+    co_cmd->cmd = cmd;
+    co_cmd->args = args;
+    QINCREF(args);
+    co_cmd->id = mon->mc->id;
+    mon->mc->id = NULL;
+
+    mon->mc->co_cmd_running = true;
+    monitor_suspend(mon);
+    co = qemu_coroutine_create(qmp_co_cmd_entry);
+    qemu_coroutine_enter(co, co_cmd);
+}
+
+static void bh_co_enter(void *opaque)
+{
+    qemu_coroutine_enter(opaque, NULL);
+}
+
+void coroutine_fn monitor_co_yield(void)
+{
+    Monitor *mon = cur_mon;
+    QEMUBH *bh = qemu_bh_new(bh_co_enter, qemu_coroutine_self());
+
+    qemu_bh_schedule(bh);
+    qemu_coroutine_yield();
+    qemu_bh_delete(bh);
+    cur_mon = mon;
+}
+
+static void qmp_dispatch_obj(Monitor *mon, QObject *obj)
 {
     int err;
-    QObject *obj;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
 
     args = input = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
     if (!obj) {
         // FIXME: should be triggered in json_parser_parse()
         qerror_report(QERR_JSON_PARSING);
@@ -4704,6 +4848,8 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
             /* emit the error response */
             goto err_out;
         }
+    } else if (handler_is_coroutine(cmd)) {
+        qmp_co_cmd_start(mon, cmd, args);
     } else {
         qmp_call_cmd(mon, cmd, args);
     }
@@ -4717,6 +4863,38 @@ out:
     QDECREF(args);
 }
 
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
+{
+    Monitor *mon = cur_mon;
+    QObject *obj;
+
+    obj = json_parser_parse(tokens, NULL);
+    if (mon->mc->co_cmd_running || !g_queue_is_empty(mon->mc->pending)) {
+        g_queue_push_tail(mon->mc->pending, obj);
+        return;
+    }
+    qmp_dispatch_obj(mon, obj);
+}
+
+static void qmp_pending_bh(void *opaque)
+{
+    Monitor *mon = opaque;
+    Monitor *old_mon = cur_mon;
+
+    cur_mon = mon;
+    while (!mon->mc->co_cmd_running && !g_queue_is_empty(mon->mc->pending)) {
+        qmp_dispatch_obj(mon, g_queue_pop_head(mon->mc->pending));
+    }
+    cur_mon = old_mon;
+}
+
+static void qmp_drop_pending(Monitor *mon)
+{
+    while (!g_queue_is_empty(mon->mc->pending)) {
+        qobject_decref(g_queue_pop_head(mon->mc->pending));
+    }
+}
+
 /**
  * monitor_control_read(): Read and handle QMP input
  */
@@ -4801,6 +4979,7 @@ static void monitor_control_event(void *opaque, int event)
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->mc->parser);
         json_message_parser_init(&mon->mc->parser, handle_qmp_command);
+        qmp_drop_pending(mon);
         mon_refcount--;
         monitor_fdsets_cleanup();
         break;
@@ -4904,6 +5083,8 @@ void monitor_init(CharDriverState *chr, int flags)
 
     if (monitor_ctrl_mode(mon)) {
         mon->mc = g_malloc0(sizeof(MonitorControl));
+        mon->mc->pending = g_queue_new();
+        mon->mc->pending_bh = qemu_bh_new(qmp_pending_bh, mon);
         /* Control mode requires special handlers */
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_control_read,
                               monitor_control_event, mon);
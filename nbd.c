@@ -34,11 +34,14 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/sendfile.h>
+#include <poll.h>
 #endif
 
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "qemu/main-loop.h"
+#include "block/thread-pool.h"
 
 //#define DEBUG_NBD
 
@@ -98,6 +101,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    bool zero_copy;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 };
@@ -797,8 +801,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -846,7 +848,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= NBD_DEFAULT_MAX_REQUESTS - 1);
     client->nb_requests++;
 
     req = g_slice_new0(NBDRequest);
@@ -864,7 +866,7 @@ static void nbd_request_put(NBDRequest *req)
     }
     g_slice_free(NBDRequest, req);
 
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
+    if (client->nb_requests-- == NBD_DEFAULT_MAX_REQUESTS) {
         qemu_notify_event();
     }
     nbd_client_put(client);
@@ -898,6 +900,15 @@ NBDExport *nbd_export_find(const char *name)
     return NULL;
 }
 
+/* Let READ replies be sent straight from the host file of the image when
+ * possible, see bdrv_get_host_fd().  Only for exports that own their
+ * BlockDriverState.
+ */
+void nbd_export_set_zero_copy(NBDExport *exp, bool enable)
+{
+    exp->zero_copy = enable;
+}
+
 void nbd_export_set_name(NBDExport *exp, const char *name)
 {
     if (exp->name == name) {
@@ -1009,6 +1020,122 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+#ifdef __linux__
+typedef struct NBDSendfile {
+    int sock;
+    int fd;
+    off_t offset;
+    size_t len;
+} NBDSendfile;
+
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfile *sf = opaque;
+    ssize_t ret;
+
+    while (sf->len > 0) {
+        ret = sendfile(sf->sock, sf->fd, &sf->offset, sf->len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                /* The socket is non-blocking.  Nobody else writes to it
+                 * until the reply is complete, so just wait here.
+                 */
+                struct pollfd pfd = { .fd = sf->sock, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* the file is shorter than the export */
+            return -EIO;
+        }
+        sf->len -= ret;
+    }
+    return 0;
+}
+
+/* Send a reply with @len bytes of @fd from @offset.  The kernel moves the
+ * data from the page cache to the socket, in a worker thread because the
+ * file may have to be read from disk.
+ */
+static ssize_t nbd_co_sendfile_reply(NBDRequest *req, struct nbd_reply *reply,
+                                     int fd, off_t offset, int len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_aio_context());
+    NBDSendfile sf = {
+        .sock = csock,
+        .fd = fd,
+        .offset = offset,
+        .len = len,
+    };
+    ssize_t rc, ret;
+
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+
+    socket_set_cork(csock, 1);
+    rc = nbd_send_reply(csock, reply);
+
+    /* nbd_restart_write must not enter us while the worker runs */
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+
+    if (rc >= 0) {
+        ret = thread_pool_submit_co(pool, nbd_sendfile_worker, &sf);
+        if (ret < 0) {
+            rc = ret;
+        }
+    }
+    socket_set_cork(csock, 0);
+
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+#endif
+
+/* Read the data of a READ request into req->data.  Ranges that the image
+ * knows to read as zeroes are cleared instead of being read.
+ */
+static int nbd_co_read(NBDRequest *req, struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint8_t *buf = req->data;
+    int64_t status;
+    int ret, n;
+
+    while (nb_sectors > 0) {
+        status = bdrv_get_block_status(exp->bs, sector_num, nb_sectors, &n);
+        if (status < 0 || n <= 0) {
+            status = 0;
+            n = nb_sectors;
+        }
+
+        if (status & BDRV_BLOCK_ZERO) {
+            memset(buf, 0, n * 512);
+        } else {
+            ret = bdrv_read(exp->bs, sector_num, buf, n);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * 512;
+    }
+    return 0;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1042,10 +1169,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     TRACE("Decoding type");
 
     command = request->type & NBD_CMD_MASK_COMMAND;
-    if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
-        req->data = qemu_blockalign(client->exp->bs, request->len);
-    }
     if (command == NBD_CMD_WRITE) {
+        req->data = qemu_blockalign(client->exp->bs, request->len);
+
         TRACE("Reading %u byte(s)", request->len);
 
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
@@ -1114,8 +1240,21 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+#ifdef __linux__
+        ret = exp->zero_copy ? bdrv_get_host_fd(exp->bs) : -ENOTSUP;
+        if (ret >= 0) {
+            TRACE("Sending %u byte(s) from the host file", request.len);
+            if (nbd_co_sendfile_reply(req, &reply, ret,
+                                      request.from + exp->dev_offset,
+                                      request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+#endif
+
+        req->data = qemu_blockalign(exp->bs, request.len);
+        ret = nbd_co_read(req, &request);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1212,7 +1351,8 @@ static int nbd_can_read(void *opaque)
 {
     NBDClient *client = opaque;
 
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
+    return client->recv_coroutine ||
+           client->nb_requests < NBD_DEFAULT_MAX_REQUESTS;
 }
 
 static void nbd_read(void *opaque)
@@ -0,0 +1,337 @@
+/*
+ * AF_PACKET network backend with memory-mapped rings
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The kernel places received frames in an rx ring shared with QEMU, so
+ * that a single wakeup delivers every packet that arrived since the last
+ * one, without a syscall per packet.  Transmitted packets are queued in
+ * a tx ring and the kernel is kicked once per burst, from a bottom half,
+ * instead of once per packet.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+
+#define AF_PACKET_FRAME_SIZE    2048
+#define AF_PACKET_BLOCK_SIZE    (64 * 1024)
+#define AF_PACKET_DEFAULT_FRAMES 256
+
+#define AF_PACKET_FRAMES_PER_BLOCK (AF_PACKET_BLOCK_SIZE / AF_PACKET_FRAME_SIZE)
+
+#ifndef TP_STATUS_VLAN_VALID
+#define TP_STATUS_VLAN_VALID (1 << 4)
+#endif
+
+/* offset of the packet data in a tx frame */
+#define AF_PACKET_TX_DATA (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+typedef struct AfPacketState {
+    NetClientState nc;
+    int fd;
+    uint8_t *ring;              /* rx ring followed by tx ring */
+    size_t ring_size;
+    unsigned int frame_nr;
+    unsigned int rx_frame;
+    unsigned int tx_frame;
+    unsigned int tx_pending;
+    QEMUBH *tx_bh;
+    bool read_poll;
+    bool write_poll;
+} AfPacketState;
+
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static struct tpacket2_hdr *af_packet_frame(AfPacketState *s, bool tx,
+                                            unsigned int i)
+{
+    return (struct tpacket2_hdr *)(s->ring + (tx ? s->ring_size : 0) +
+                                   i * AF_PACKET_FRAME_SIZE);
+}
+
+static void af_packet_update_fd_handler(AfPacketState *s)
+{
+    qemu_set_fd_handler(s->fd,
+                        s->read_poll ? af_packet_send : NULL,
+                        s->write_poll ? af_packet_writable : NULL,
+                        s);
+}
+
+static void af_packet_read_poll(AfPacketState *s, bool enable)
+{
+    s->read_poll = enable;
+    af_packet_update_fd_handler(s);
+}
+
+static void af_packet_write_poll(AfPacketState *s, bool enable)
+{
+    s->write_poll = enable;
+    af_packet_update_fd_handler(s);
+}
+
+static void af_packet_kick(AfPacketState *s)
+{
+    if (s->tx_pending) {
+        s->tx_pending = 0;
+        send(s->fd, NULL, 0, MSG_DONTWAIT);
+    }
+}
+
+static void af_packet_tx_bh(void *opaque)
+{
+    af_packet_kick(opaque);
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_packet_receive(NetClientState *nc, const uint8_t *buf,
+                                 size_t size)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+    struct tpacket2_hdr *hdr = af_packet_frame(s, true, s->tx_frame);
+
+    if (size > AF_PACKET_FRAME_SIZE - AF_PACKET_TX_DATA) {
+        /* does not fit in a frame, drop it */
+        return size;
+    }
+
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+        /* the ring is full; wait until the kernel frees a frame */
+        af_packet_kick(s);
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+
+    memcpy((uint8_t *)hdr + AF_PACKET_TX_DATA, buf, size);
+    hdr->tp_len = size;
+    smp_wmb();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    s->tx_frame = (s->tx_frame + 1) % s->frame_nr;
+
+    if (++s->tx_pending >= s->frame_nr / 2) {
+        af_packet_kick(s);
+    } else {
+        qemu_bh_schedule(s->tx_bh);
+    }
+    return size;
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+static void af_packet_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+    uint8_t vlan_buf[NET_BUFSIZE];
+
+    for (;;) {
+        struct tpacket2_hdr *hdr = af_packet_frame(s, false, s->rx_frame);
+        struct sockaddr_ll *sll;
+        uint8_t *data;
+        ssize_t size;
+
+        if (!(hdr->tp_status & TP_STATUS_USER)) {
+            break;
+        }
+        smp_rmb();
+
+        sll = (struct sockaddr_ll *)((uint8_t *)hdr +
+                                     TPACKET_ALIGN(sizeof(*hdr)));
+        data = (uint8_t *)hdr + hdr->tp_mac;
+        size = hdr->tp_snaplen;
+
+        if (sll->sll_pkttype == PACKET_OUTGOING ||
+            hdr->tp_snaplen != hdr->tp_len || size < 2 * ETH_ALEN) {
+            /* our own packets, or truncated ones */
+        } else {
+            if ((hdr->tp_status & TP_STATUS_VLAN_VALID) &&
+                size + 4 <= sizeof(vlan_buf)) {
+                /* the kernel stripped the 802.1Q tag, put it back */
+                memcpy(vlan_buf, data, 2 * ETH_ALEN);
+                stw_be_p(vlan_buf + 2 * ETH_ALEN, ETH_P_8021Q);
+                stw_be_p(vlan_buf + 2 * ETH_ALEN + 2, hdr->tp_vlan_tci);
+                memcpy(vlan_buf + 2 * ETH_ALEN + 4, data + 2 * ETH_ALEN,
+                       size - 2 * ETH_ALEN);
+                data = vlan_buf;
+                size += 4;
+            }
+            /* a queued packet is copied, so the frame can be released */
+            size = qemu_send_packet_async(&s->nc, data, size,
+                                          af_packet_send_completed);
+        }
+
+        smp_mb();
+        hdr->tp_status = TP_STATUS_KERNEL;
+        s->rx_frame = (s->rx_frame + 1) % s->frame_nr;
+
+        if (size == 0) {
+            af_packet_read_poll(s, false);
+            break;
+        }
+    }
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+    af_packet_read_poll(s, false);
+    af_packet_write_poll(s, false);
+    qemu_bh_delete(s->tx_bh);
+    munmap(s->ring, 2 * s->ring_size);
+    close(s->fd);
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_PACKET,
+    .size = sizeof(AfPacketState),
+    .receive = af_packet_receive,
+    .cleanup = af_packet_cleanup,
+};
+
+static int af_packet_open(const char *ifname, unsigned int frames,
+                          uint8_t **ring, size_t *ring_size)
+{
+    struct tpacket_req req;
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    int fd, ver = TPACKET_V2;
+    int ifindex;
+    void *map;
+
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        error_report("af-packet: unknown interface '%s'", ifname);
+        return -1;
+    }
+
+    fd = qemu_socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        error_report("af-packet: could not create socket: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = AF_PACKET_BLOCK_SIZE;
+    req.tp_frame_size = AF_PACKET_FRAME_SIZE;
+    req.tp_block_nr = frames / AF_PACKET_FRAMES_PER_BLOCK;
+    req.tp_frame_nr = frames;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        error_report("af-packet: could not set up the rings: %s",
+                     strerror(errno));
+        goto fail;
+    }
+
+    *ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    map = mmap(NULL, 2 * *ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    if (map == MAP_FAILED) {
+        error_report("af-packet: could not map the rings: %s",
+                     strerror(errno));
+        goto fail;
+    }
+    *ring = map;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_report("af-packet: could not bind to '%s': %s", ifname,
+                     strerror(errno));
+        goto fail_unmap;
+    }
+
+    /* the guest has its own MAC address */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_report("af-packet: could not make '%s' promiscuous: %s", ifname,
+                     strerror(errno));
+        goto fail_unmap;
+    }
+
+    qemu_set_nonblock(fd);
+    return fd;
+
+fail_unmap:
+    munmap(*ring, 2 * *ring_size);
+fail:
+    close(fd);
+    return -1;
+}
+
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer)
+{
+    const NetdevAfPacketOptions *af_packet;
+    NetClientState *nc;
+    AfPacketState *s;
+    unsigned int frames;
+    uint8_t *ring;
+    size_t ring_size;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_AF_PACKET);
+    af_packet = opts->af_packet;
+
+    frames = af_packet->has_frames ? af_packet->frames
+                                   : AF_PACKET_DEFAULT_FRAMES;
+    /* whole blocks, at least two frames so that tx batching works */
+    frames = ROUND_UP(MAX(frames, 2), AF_PACKET_FRAMES_PER_BLOCK);
+
+    fd = af_packet_open(af_packet->ifname, frames, &ring, &ring_size);
+    if (fd < 0) {
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+
+    snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s,frames=%u",
+             af_packet->ifname, frames);
+
+    s = DO_UPCAST(AfPacketState, nc, nc);
+    s->fd = fd;
+    s->ring = ring;
+    s->ring_size = ring_size;
+    s->frame_nr = frames;
+    s->tx_bh = qemu_bh_new(af_packet_tx_bh, s);
+    af_packet_read_poll(s, true);
+
+    return 0;
+}
@@ -38,6 +38,9 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
 int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer);
 
+int net_init_null(const NetClientOptions *opts, const char *name,
+                  NetClientState *peer);
+
 int net_init_socket(const NetClientOptions *opts, const char *name,
                     NetClientState *peer);
 
@@ -52,4 +55,12 @@ int net_init_vde(const NetClientOptions *opts, const char *name,
                  NetClientState *peer);
 #endif
 
+#ifdef CONFIG_LINUX
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer);
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer);
+#endif
+
 #endif /* QEMU_NET_CLIENTS_H */
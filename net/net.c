@@ -481,6 +481,22 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Let the peer of NC read a packet directly into its buffers, see
+   NetClientInfo.receive_direct.  Only possible when NC is connected
+   straight to a NIC, not to a hub, and nothing is queued for it.  */
+ssize_t qemu_receive_direct(NetClientState *nc, NetReadIOV *read_iov,
+                            void *opaque, size_t max_size)
+{
+    NetClientState *peer = nc->peer;
+
+    if (nc->link_down || !peer || !peer->info->receive_direct ||
+        peer->link_down || peer->receive_disabled) {
+        return -1;
+    }
+
+    return peer->info->receive_direct(peer, read_iov, opaque, max_size);
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -725,12 +741,17 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_SOCKET]    = net_init_socket,
 #ifdef CONFIG_VDE
         [NET_CLIENT_OPTIONS_KIND_VDE]       = net_init_vde,
+#endif
+#ifdef CONFIG_LINUX
+        [NET_CLIENT_OPTIONS_KIND_AF_PACKET] = net_init_af_packet,
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+        [NET_CLIENT_OPTIONS_KIND_NULL]      = net_init_null,
 };
 
 
@@ -757,10 +778,15 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
 #ifdef CONFIG_VDE
         case NET_CLIENT_OPTIONS_KIND_VDE:
 #endif
+#ifdef CONFIG_LINUX
+        case NET_CLIENT_OPTIONS_KIND_AF_PACKET:
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
 #ifdef CONFIG_NET_BRIDGE
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+        case NET_CLIENT_OPTIONS_KIND_NULL:
             break;
 
         default:
@@ -0,0 +1,128 @@
+/*
+ * Null network backend
+ *
+ * Packets from the guest are dropped, and optionally a stream of
+ * generated packets is sent to the guest at a fixed rate.  This is useful
+ * to measure the overhead of the emulated network devices without any
+ * host networking in the way.
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+
+#define NULL_DEFAULT_LEN    64
+#define NULL_MIN_LEN        60          /* an Ethernet frame without FCS */
+
+/* do not try to catch up with more than this after the guest stalled */
+#define NULL_MAX_BACKLOG_NS (100 * SCALE_MS)
+
+typedef struct NullState {
+    NetClientState nc;
+    QEMUTimer *timer;
+    int64_t interval_ns;
+    int64_t next_ns;
+    uint8_t *packet;
+    size_t len;
+} NullState;
+
+static ssize_t null_receive(NetClientState *nc, const uint8_t *buf,
+                            size_t size)
+{
+    return size;
+}
+
+static void null_send_completed(NetClientState *nc, ssize_t len)
+{
+    NullState *s = DO_UPCAST(NullState, nc, nc);
+
+    /* the peer can take packets again; continue from the timer */
+    timer_mod_ns(s->timer, s->next_ns);
+}
+
+static void null_generate(void *opaque)
+{
+    NullState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (now - s->next_ns > NULL_MAX_BACKLOG_NS) {
+        s->next_ns = now - NULL_MAX_BACKLOG_NS;
+    }
+
+    while (s->next_ns <= now) {
+        s->next_ns += s->interval_ns;
+        if (qemu_send_packet_async(&s->nc, s->packet, s->len,
+                                   null_send_completed) == 0) {
+            /* queued in the peer, null_send_completed resumes */
+            return;
+        }
+    }
+    timer_mod_ns(s->timer, s->next_ns);
+}
+
+static void null_cleanup(NetClientState *nc)
+{
+    NullState *s = DO_UPCAST(NullState, nc, nc);
+
+    if (s->timer) {
+        timer_del(s->timer);
+        timer_free(s->timer);
+    }
+    g_free(s->packet);
+}
+
+static NetClientInfo net_null_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NULL,
+    .size = sizeof(NullState),
+    .receive = null_receive,
+    .cleanup = null_cleanup,
+};
+
+int net_init_null(const NetClientOptions *opts, const char *name,
+                  NetClientState *peer)
+{
+    const NetdevNullOptions *null;
+    NetClientState *nc;
+    NullState *s;
+    uint32_t rate;
+    uint64_t len;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_NULL);
+    null = opts->null;
+
+    rate = null->has_rate ? null->rate : 0;
+    len = null->has_len ? null->len : NULL_DEFAULT_LEN;
+    if (len < NULL_MIN_LEN || len > NET_BUFSIZE) {
+        error_report("null: packet length must be between %d and %d bytes",
+                     NULL_MIN_LEN, NET_BUFSIZE);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_null_info, peer, "null", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "rate=%" PRIu32
+             ",len=%" PRIu64, rate, len);
+
+    s = DO_UPCAST(NullState, nc, nc);
+    if (rate) {
+        /* broadcast frames with an ethertype for local experiments */
+        s->len = len;
+        s->packet = g_malloc0(len);
+        memset(s->packet, 0xff, 6);
+        s->packet[6] = 0x02;
+        s->packet[12] = 0x88;
+        s->packet[13] = 0xb5;
+
+        s->interval_ns = MAX(get_ticks_per_sec() / rate, 1);
+        s->next_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, null_generate, s);
+        timer_mod_ns(s->timer, s->next_ns);
+    }
+    return 0;
+}
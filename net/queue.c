@@ -22,7 +22,8 @@
  */
 
 #include "net/queue.h"
-#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -37,23 +38,38 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Packets are kept in a fixed ring of slots.  Each slot keeps its data
+ * buffer once allocated, so queueing a packet does not allocate memory
+ * in the steady state.  If the ring is full, the packet is dropped and
+ * send() returns its size, so that a sender with a callback does not
+ * wait for one that will never come.
+ *
+ * The ring is single-producer, single-consumer: one thread may append
+ * packets (send() and send_iov()) while another one flushes and purges
+ * them, without a lock.
  */
 
+#define NET_QUEUE_SLOTS     1024    /* must be a power of two */
+#define NET_QUEUE_SLOT_MIN  2048
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
-    NetClientState *sender;
+    NetClientState *sender;     /* NULL if purged */
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    size_t capacity;
+    uint8_t *data;
 };
 
 struct NetQueue {
     void *opaque;
-    uint32_t nq_maxlen;
-    uint32_t nq_count;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    /* free-running indices; head is written by the producer only, tail
+     * by the consumer only */
+    unsigned head;
+    unsigned tail;
+    NetPacket packets[NET_QUEUE_SLOTS];
 
     unsigned delivering : 1;
 };
@@ -65,10 +81,8 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue = g_malloc0(sizeof(NetQueue));
 
     queue->opaque = opaque;
-    queue->nq_maxlen = 10000;
-    queue->nq_count = 0;
-
-    QTAILQ_INIT(&queue->packets);
+    queue->head = 0;
+    queue->tail = 0;
 
     queue->delivering = 0;
 
@@ -77,17 +91,47 @@ NetQueue *qemu_new_net_queue(void *opaque)
 
 void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    int i;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    for (i = 0; i < NET_QUEUE_SLOTS; i++) {
+        g_free(queue->packets[i].data);
     }
 
     g_free(queue);
 }
 
-static void qemu_net_queue_append(NetQueue *queue,
+/* Reserve the slot at the head of the ring for a packet of @size bytes,
+ * or return NULL if the ring is full.  */
+static NetPacket *qemu_net_queue_get_slot(NetQueue *queue, size_t size)
+{
+    unsigned head = queue->head;
+    NetPacket *packet;
+
+    if (head - atomic_read(&queue->tail) >= NET_QUEUE_SLOTS) {
+        return NULL;
+    }
+
+    /* pairs with the smp_mb() in qemu_net_queue_flush(): the consumer
+     * is done with the slot before we overwrite it */
+    smp_mb();
+
+    packet = &queue->packets[head & (NET_QUEUE_SLOTS - 1)];
+    if (packet->capacity < size) {
+        g_free(packet->data);
+        packet->capacity = MAX(pow2ceil(size), NET_QUEUE_SLOT_MIN);
+        packet->data = g_malloc(packet->capacity);
+    }
+    return packet;
+}
+
+static void qemu_net_queue_commit_slot(NetQueue *queue)
+{
+    /* publish the packet contents before the new head */
+    smp_wmb();
+    atomic_set(&queue->head, queue->head + 1);
+}
+
+static bool qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
                                   const uint8_t *buf,
@@ -96,21 +140,21 @@ static void qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
+    packet = qemu_net_queue_get_slot(queue, size);
+    if (!packet) {
+        return false; /* drop if queue full */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_commit_slot(queue);
+    return true;
 }
 
-static void qemu_net_queue_append_iov(NetQueue *queue,
+static bool qemu_net_queue_append_iov(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
                                       const struct iovec *iov,
@@ -121,14 +165,14 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     size_t max_len = 0;
     int i;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
-    }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_get_slot(queue, max_len);
+    if (!packet) {
+        return false; /* drop if queue full */
+    }
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -141,8 +185,8 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_commit_slot(queue);
+    return true;
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -185,14 +229,14 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
     ssize_t ret;
 
     if (queue->delivering || !qemu_can_send_packet(sender)) {
-        qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
-        return 0;
+        return qemu_net_queue_append(queue, sender, flags, data, size,
+                                     sent_cb) ? 0 : size;
     }
 
     ret = qemu_net_queue_deliver(queue, sender, flags, data, size);
     if (ret == 0) {
-        qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
-        return 0;
+        return qemu_net_queue_append(queue, sender, flags, data, size,
+                                     sent_cb) ? 0 : size;
     }
 
     qemu_net_queue_flush(queue);
@@ -210,14 +254,14 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     ssize_t ret;
 
     if (queue->delivering || !qemu_can_send_packet(sender)) {
-        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
-        return 0;
+        return qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt,
+                                         sent_cb) ? 0 : iov_size(iov, iovcnt);
     }
 
     ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
     if (ret == 0) {
-        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
-        return 0;
+        return qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt,
+                                         sent_cb) ? 0 : iov_size(iov, iovcnt);
     }
 
     qemu_net_queue_flush(queue);
@@ -227,43 +271,52 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
+    unsigned head = atomic_read(&queue->head);
+    unsigned i;
+
+    smp_rmb();
+    for (i = queue->tail; i != head; i++) {
+        NetPacket *packet = &queue->packets[i & (NET_QUEUE_SLOTS - 1)];
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            g_free(packet);
+            packet->sender = NULL;
         }
     }
 }
 
 bool qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
+    for (;;) {
+        unsigned tail = queue->tail;
         NetPacket *packet;
         int ret;
 
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+        if (tail == atomic_read(&queue->head)) {
+            break;
         }
-
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        /* read the packet contents after the head */
+        smp_rmb();
+
+        packet = &queue->packets[tail & (NET_QUEUE_SLOTS - 1)];
+        if (packet->sender) {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+            if (ret == 0) {
+                /* leave it at the head of the queue */
+                return false;
+            }
+
+            if (packet->sent_cb) {
+                packet->sent_cb(packet->sender, ret);
+            }
         }
 
-        g_free(packet);
+        /* done with the slot before handing it back to the producer */
+        smp_mb();
+        atomic_set(&queue->tail, tail + 1);
     }
     return true;
 }
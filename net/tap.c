@@ -185,6 +185,18 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+static ssize_t tap_read_iov(void *opaque, const struct iovec *iov, int iovcnt)
+{
+    TAPState *s = opaque;
+    ssize_t len;
+
+    do {
+        len = readv(s->fd, iov, iovcnt);
+    } while (len == -1 && errno == EINTR);
+
+    return len;
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
@@ -193,6 +205,19 @@ static void tap_send(void *opaque)
     do {
         uint8_t *buf = s->buf;
 
+        /* read straight into guest memory when the peer allows it and
+           the vnet header needn't be stripped */
+        if (!s->host_vnet_hdr_len || s->using_vnet_hdr) {
+            size = qemu_receive_direct(&s->nc, tap_read_iov, s,
+                                       sizeof(s->buf));
+            if (size == 0) {
+                break;
+            }
+            if (size > 0) {
+                continue;
+            }
+        }
+
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
@@ -621,19 +646,29 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 
     if (tap->has_vhost ? tap->vhost :
         vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
+        VhostNetOptions options;
         int vhostfd;
 
+        options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
+        options.net_backend = &s->nc;
+        options.force = tap->has_vhostforce && tap->vhostforce;
+
         if (tap->has_vhostfd || tap->has_vhostfds) {
             vhostfd = monitor_handle_fd_param(cur_mon, vhostfdname);
             if (vhostfd == -1) {
                 return -1;
             }
         } else {
-            vhostfd = -1;
+            vhostfd = open("/dev/vhost-net", O_RDWR);
+            if (vhostfd < 0) {
+                error_report("tap: open vhost char device failed: %s",
+                             strerror(errno));
+                return -1;
+            }
         }
+        options.opaque = (void *)(uintptr_t)vhostfd;
 
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
-                                      tap->has_vhostforce && tap->vhostforce);
+        s->vhost_net = vhost_net_init(&options);
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
             return -1;
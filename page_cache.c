@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,20 +33,35 @@
     do { } while (0)
 #endif
 
+/* Number of pages per set; a page may be cached in any way of its set */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* allocated on first use of the way, then reused on replacement */
     uint8_t *it_data;
+    /* CLOCK reference bit, set whenever the page is found in the cache */
+    bool it_referenced;
 };
 
+typedef struct CacheSet {
+    /* next way inspected by the CLOCK replacement */
+    unsigned int hand;
+    PageCacheStats stats;
+} CacheSet;
+
 struct PageCache {
     CacheItem *page_cache;
+    CacheSet *sets;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int num_ways;
+    int64_t num_sets;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,16 +86,21 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%" PRId64 " sets of %u)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
+    cache->sets = g_malloc0(cache->num_sets * sizeof(*cache->sets));
 
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_referenced = false;
     }
 
     return cache;
@@ -99,45 +119,84 @@ void cache_fini(PageCache *cache)
 
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    g_free(cache->sets);
+    cache->sets = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static int64_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
+}
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+static CacheItem *cache_set_first(const PageCache *cache, int64_t set)
+{
+    return &cache->page_cache[set * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it;
+    unsigned int way;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    it = cache_set_first(cache, cache_get_set(cache, addr));
+    for (way = 0; way < cache->num_ways; way++) {
+        if (it[way].it_addr == addr) {
+            return &it[way];
+        }
+    }
 
-    return (cache->page_cache[pos].it_addr == addr);
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+    CacheSet *set = &cache->sets[cache_get_set(cache, addr)];
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
-
-    pos = cache_get_cache_pos(cache, addr);
+    if (!it) {
+        set->stats.misses++;
+        return false;
+    }
 
-    return &cache->page_cache[pos];
+    it->it_referenced = true;
+    set->stats.hits++;
+    return true;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
+}
+
+/* Picks the way of @set that receives a new page: a free way if there is
+ * one, otherwise the first way the CLOCK hand finds unreferenced. */
+static CacheItem *cache_get_victim(PageCache *cache, int64_t set)
+{
+    CacheItem *it = cache_set_first(cache, set);
+    CacheSet *cs = &cache->sets[set];
+    unsigned int way;
+
+    for (way = 0; way < cache->num_ways; way++) {
+        if (it[way].it_addr == -1) {
+            return &it[way];
+        }
+    }
+
+    while (it[cs->hand].it_referenced) {
+        it[cs->hand].it_referenced = false;
+        cs->hand = (cs->hand + 1) % cache->num_ways;
+    }
+    way = cs->hand;
+    cs->hand = (cs->hand + 1) % cache->num_ways;
+    cs->stats.evictions++;
+
+    return &it[way];
 }
 
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
@@ -150,17 +209,21 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    /* free old cached data if any */
-    g_free(it->it_data);
+    if (!it) {
+        it = cache_get_victim(cache, cache_get_set(cache, addr));
+    }
 
     if (!it->it_data) {
+        it->it_data = g_malloc(cache->page_size);
+    }
+    if (it->it_addr == -1) {
         cache->num_items++;
     }
 
-    it->it_data = g_memdup(pdata, cache->page_size);
+    memcpy(it->it_data, pdata, cache->page_size);
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
+    it->it_referenced = false;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
@@ -190,31 +253,76 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
+        CacheItem *set_it;
+        unsigned int way;
+
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+        if (old_it->it_addr == -1) {
+            g_free(old_it->it_data);
+            continue;
+        }
+
+        /* use a free way, or else replace the LRU page of the set if it
+         * is older than this one */
+        set_it = cache_set_first(new_cache,
+                                 cache_get_set(new_cache, old_it->it_addr));
+        new_it = &set_it[0];
+        for (way = 0; way < new_cache->num_ways; way++) {
+            if (set_it[way].it_addr == -1) {
+                new_it = &set_it[way];
+                break;
+            }
+            if (set_it[way].it_age < new_it->it_age) {
+                new_it = &set_it[way];
+            }
+        }
+
+        if (new_it->it_addr != -1 && new_it->it_age >= old_it->it_age) {
+            /* keep the MRU page */
+            g_free(old_it->it_data);
+        } else {
+            if (new_it->it_addr == -1) {
+                new_cache->num_items++;
             }
+            g_free(new_it->it_data);
+            *new_it = *old_it;
         }
     }
 
     g_free(cache->page_cache);
+    g_free(cache->sets);
     cache->page_cache = new_cache->page_cache;
+    cache->sets = new_cache->sets;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_ways = new_cache->num_ways;
+    cache->num_sets = new_cache->num_sets;
 
     g_free(new_cache);
 
     return cache->max_num_items;
 }
+
+int64_t cache_get_num_sets(const PageCache *cache)
+{
+    return cache->num_sets;
+}
+
+void cache_get_set_stats(const PageCache *cache, int64_t set,
+                         PageCacheStats *stats)
+{
+    g_assert(set >= 0 && set < cache->num_sets);
+    *stats = cache->sets[set].stats;
+}
+
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats)
+{
+    int64_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < cache->num_sets; i++) {
+        stats->hits += cache->sets[i].stats.hits;
+        stats->misses += cache->sets[i].stats.misses;
+        stats->evictions += cache->sets[i].stats.evictions;
+    }
+}
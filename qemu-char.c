@@ -26,6 +26,7 @@
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
 #include "qemu/timer.h"
+#include "qemu/iov.h"
 #include "sysemu/char.h"
 #include "hw/usb.h"
 #include "qmp-commands.h"
@@ -118,6 +119,28 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt)
+{
+    int i, ret, total = 0;
+
+    if (s->chr_writev) {
+        return s->chr_writev(s, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return total ? total : ret;
+        }
+        total += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
 {
     int offset = 0;
@@ -805,6 +828,18 @@ static int io_channel_send(GIOChannel *fd, const void *buf, size_t len)
 }
 
 #ifndef _WIN32
+/* Unlike io_channel_send, this returns after a short write */
+static int io_channel_sendv(GIOChannel *fd, const struct iovec *iov,
+                            int iovcnt)
+{
+    ssize_t ret;
+
+    do {
+        ret = writev(g_io_channel_unix_get_fd(fd), iov, MIN(iovcnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
 
 typedef struct FDCharDriver {
     CharDriverState *chr;
@@ -820,6 +855,14 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->fd_out, buf, len);
 }
 
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+
+    return io_channel_sendv(s->fd_out, iov, iovcnt);
+}
+
 static gboolean fd_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -908,6 +951,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     chr->opaque = s;
     chr->chr_add_watch = fd_chr_add_watch;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -2312,6 +2356,19 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+#ifndef _WIN32
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    if (s->connected) {
+        return io_channel_sendv(s->chan, iov, iovcnt);
+    } else {
+        return iov_size(iov, iovcnt);
+    }
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2661,6 +2718,9 @@ static CharDriverState *qemu_chr_open_socket_fd(int fd, bool do_nodelay,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+#endif
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
     chr->chr_add_client = tcp_chr_add_client;
@@ -15,31 +15,114 @@
 #include "trace.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/notify.h"
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    /* Coroutines moved between a thread's pool and the shared pool at once */
+    POOL_BATCH_SIZE = 32,
+
+    /* Maximum size of the per-thread pools */
+    LOCAL_POOL_MAX_SIZE = 2 * POOL_BATCH_SIZE,
+
+    /* Size of the shared pool until devices reserve more */
+    POOL_DEFAULT_SIZE = 64,
 };
 
-/** Free list to speed up creation */
+/** Free lists to speed up creation
+ *
+ * Each thread allocates from and frees to a pool of its own, without
+ * locking.  The shared pool balances threads that mostly create coroutines
+ * against threads that mostly terminate them and takes the excess of
+ * bursts.  It is only locked once per POOL_BATCH_SIZE coroutines.  Its size
+ * follows the reservations made with qemu_coroutine_adjust_pool_size().
+ */
 static QemuMutex pool_lock;
 static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int pool_size;
+static unsigned int pool_max_size = POOL_DEFAULT_SIZE;
+
+static __thread QSLIST_HEAD(, Coroutine) local_pool;
+static __thread unsigned int local_pool_size;
+static __thread Notifier local_pool_cleanup_notifier;
+
+static void local_pool_cleanup(Notifier *n, void *value)
+{
+    Coroutine *co;
+    Coroutine *tmp;
+
+    QSLIST_FOREACH_SAFE(co, &local_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&local_pool, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    local_pool_size = 0;
+}
+
+/* Refill the pool of this thread from the shared pool */
+static void local_pool_refill(void)
+{
+    Coroutine *co;
+
+    /* Slow path; a good place to register the destructor, too */
+    if (!local_pool_cleanup_notifier.notify) {
+        local_pool_cleanup_notifier.notify = local_pool_cleanup;
+        qemu_thread_atexit_add(&local_pool_cleanup_notifier);
+    }
+
+    qemu_mutex_lock(&pool_lock);
+    while (local_pool_size < POOL_BATCH_SIZE &&
+           (co = QSLIST_FIRST(&pool)) != NULL) {
+        QSLIST_REMOVE_HEAD(&pool, pool_next);
+        pool_size--;
+        QSLIST_INSERT_HEAD(&local_pool, co, pool_next);
+        local_pool_size++;
+    }
+    qemu_mutex_unlock(&pool_lock);
+}
+
+/* Move a batch from the pool of this thread to the shared pool, and free
+ * what does not fit there.
+ */
+static void local_pool_flush(void)
+{
+    QSLIST_HEAD(, Coroutine) excess = QSLIST_HEAD_INITIALIZER(excess);
+    Coroutine *co;
+    unsigned int n;
+
+    qemu_mutex_lock(&pool_lock);
+    for (n = 0; n < POOL_BATCH_SIZE; n++) {
+        co = QSLIST_FIRST(&local_pool);
+        QSLIST_REMOVE_HEAD(&local_pool, pool_next);
+        local_pool_size--;
+        if (pool_size < pool_max_size) {
+            QSLIST_INSERT_HEAD(&pool, co, pool_next);
+            pool_size++;
+        } else {
+            QSLIST_INSERT_HEAD(&excess, co, pool_next);
+        }
+    }
+    qemu_mutex_unlock(&pool_lock);
+
+    while ((co = QSLIST_FIRST(&excess)) != NULL) {
+        QSLIST_REMOVE_HEAD(&excess, pool_next);
+        qemu_coroutine_delete(co);
+    }
+}
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
     Coroutine *co = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        co = QSLIST_FIRST(&pool);
+        if (QSLIST_EMPTY(&local_pool)) {
+            local_pool_refill();
+        }
+        co = QSLIST_FIRST(&local_pool);
         if (co) {
-            QSLIST_REMOVE_HEAD(&pool, pool_next);
-            pool_size--;
+            QSLIST_REMOVE_HEAD(&local_pool, pool_next);
+            local_pool_size--;
         }
-        qemu_mutex_unlock(&pool_lock);
     }
 
     if (!co) {
@@ -54,20 +137,40 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 static void coroutine_delete(Coroutine *co)
 {
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        if (pool_size < POOL_MAX_SIZE) {
-            QSLIST_INSERT_HEAD(&pool, co, pool_next);
-            co->caller = NULL;
-            pool_size++;
-            qemu_mutex_unlock(&pool_lock);
-            return;
+        if (local_pool_size == LOCAL_POOL_MAX_SIZE) {
+            local_pool_flush();
         }
-        qemu_mutex_unlock(&pool_lock);
+        QSLIST_INSERT_HEAD(&local_pool, co, pool_next);
+        co->caller = NULL;
+        local_pool_size++;
+        return;
     }
 
     qemu_coroutine_delete(co);
 }
 
+void qemu_coroutine_adjust_pool_size(int n)
+{
+    Coroutine *co;
+
+    qemu_mutex_lock(&pool_lock);
+
+    /* Callers should never take away more than they added */
+    assert(n >= 0 || pool_max_size >= POOL_DEFAULT_SIZE - n);
+
+    pool_max_size += n;
+
+    /* Trim the shared pool down if necessary */
+    while (pool_size > pool_max_size) {
+        co = QSLIST_FIRST(&pool);
+        QSLIST_REMOVE_HEAD(&pool, pool_next);
+        pool_size--;
+        qemu_coroutine_delete(co);
+    }
+
+    qemu_mutex_unlock(&pool_lock);
+}
+
 static void __attribute__((constructor)) coroutine_pool_init(void)
 {
     qemu_mutex_init(&pool_lock);
@@ -78,6 +181,8 @@ static void __attribute__((destructor)) coroutine_pool_cleanup(void)
     Coroutine *co;
     Coroutine *tmp;
 
+    local_pool_cleanup(NULL, NULL);
+
     QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
         QSLIST_REMOVE_HEAD(&pool, pool_next);
         qemu_coroutine_delete(co);
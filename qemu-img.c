@@ -105,6 +105,9 @@ static void help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for convert and rebase (1 to 16,\n"
+           "       default 8)\n"
+           "  '-W' allow out-of-order writes to the target during convert\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -803,6 +806,103 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+typedef struct MapEntry {
+    int flags;
+    int depth;
+    int64_t start;
+    int64_t length;
+    int64_t offset;
+    BlockDriverState *bs;
+} MapEntry;
+
+typedef struct UnallocatedRange {
+    int64_t start;
+    int64_t end;
+} UnallocatedRange;
+
+/*
+ * Remembers, for each image of a backing chain, the last range that was
+ * found to be unallocated in it.  Walking down the chain for the next
+ * sectors then goes straight to the image that has them instead of asking
+ * every image above it again.
+ */
+typedef struct BlockStatusCache {
+    int nb_layers;
+    UnallocatedRange *unallocated;
+} BlockStatusCache;
+
+static void block_status_cache_init(BlockStatusCache *cache,
+                                    BlockDriverState *bs)
+{
+    cache->nb_layers = 0;
+    for (; bs; bs = bs->backing_hd) {
+        cache->nb_layers++;
+    }
+    cache->unallocated = g_new0(UnallocatedRange, cache->nb_layers);
+}
+
+static void block_status_cache_destroy(BlockStatusCache *cache)
+{
+    g_free(cache->unallocated);
+    cache->unallocated = NULL;
+}
+
+static int get_block_status(BlockDriverState *bs, BlockStatusCache *cache,
+                            int64_t sector_num, int nb_sectors, MapEntry *e)
+{
+    UnallocatedRange *range;
+    int64_t ret;
+    int depth;
+
+    depth = 0;
+    for (;;) {
+        assert(depth < cache->nb_layers);
+        range = &cache->unallocated[depth];
+        if (sector_num >= range->start && sector_num < range->end) {
+            nb_sectors = MIN(nb_sectors, range->end - sector_num);
+        } else {
+            ret = bdrv_get_block_status(bs, sector_num, nb_sectors,
+                                        &nb_sectors);
+            if (ret < 0) {
+                return ret;
+            }
+            assert(nb_sectors);
+            if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
+                break;
+            }
+            range->start = sector_num;
+            range->end = sector_num + nb_sectors;
+        }
+        bs = bs->backing_hd;
+        if (bs == NULL) {
+            ret = 0;
+            break;
+        }
+
+        depth++;
+    }
+
+    e->start = sector_num * BDRV_SECTOR_SIZE;
+    e->length = nb_sectors * BDRV_SECTOR_SIZE;
+    e->flags = ret & ~BDRV_BLOCK_OFFSET_MASK;
+    e->offset = ret & BDRV_BLOCK_OFFSET_MASK;
+    e->depth = depth;
+    e->bs = bs;
+    return 0;
+}
+
+/* Whether bdrv_is_allocated_above() would count the extent as allocated */
+static bool map_entry_is_allocated(const MapEntry *e)
+{
+    return (e->flags & BDRV_BLOCK_DATA) ||
+           ((e->flags & BDRV_BLOCK_ZERO) && !bdrv_has_zero_init(e->bs));
+}
+
+static bool map_entry_reads_zero(const MapEntry *e)
+{
+    return !(e->flags & BDRV_BLOCK_DATA) || (e->flags & BDRV_BLOCK_ZERO);
+}
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first sector of both
  * buffers matches, non-zero otherwise.
@@ -820,6 +920,12 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
         return 0;
     }
 
+    /* memcmp is vectorized, so check the common case in a single pass */
+    if (!memcmp(buf1, buf2, n * 512)) {
+        *pnum = n;
+        return 0;
+    }
+
     res = !!memcmp(buf1, buf2, 512);
     for(i = 1; i < n; i++) {
         buf1 += 512;
@@ -846,6 +952,12 @@ static int64_t sectors_to_process(int64_t total, int64_t from)
     return MIN(total - from, IO_BUF_SIZE >> BDRV_SECTOR_BITS);
 }
 
+/* Block status is queried for up to 1 GiB at a time */
+static int64_t sectors_to_query(int64_t total, int64_t from)
+{
+    return MIN(total - from, 1 << (30 - BDRV_SECTOR_BITS));
+}
+
 /*
  * Check if passed sectors are empty (not allocated or contain only 0 bytes)
  *
@@ -870,6 +982,9 @@ static int check_empty_sectors(BlockDriverState *bs, int64_t sect_num,
                      sectors_to_bytes(sect_num), filename, strerror(-ret));
         return ret;
     }
+    if (buffer_is_zero(buffer, sectors_to_bytes(sect_count))) {
+        return 0;
+    }
     ret = is_allocated_sectors(buffer, sect_count, &pnum);
     if (ret || pnum != sect_count) {
         qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
@@ -880,6 +995,53 @@ static int check_empty_sectors(BlockDriverState *bs, int64_t sect_num,
     return 0;
 }
 
+typedef struct CompareRead {
+    BlockDriverState *bs;
+    const char *filename;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+} CompareRead;
+
+static void compare_read_cb(void *opaque, int ret)
+{
+    CompareRead *req = opaque;
+
+    req->ret = ret;
+}
+
+/*
+ * Reads the same sectors from both images, with the two requests in flight
+ * at the same time.  Returns 0 on success, or the error of the first read
+ * that failed after reporting it.
+ */
+static int compare_read_both(CompareRead *reqs, int64_t sector_num,
+                             int nb_sectors)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        reqs[i].iov.iov_len = sectors_to_bytes(nb_sectors);
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+        reqs[i].ret = -EINPROGRESS;
+        bdrv_aio_readv(reqs[i].bs, sector_num, &reqs[i].qiov, nb_sectors,
+                       compare_read_cb, &reqs[i]);
+    }
+    while (reqs[0].ret == -EINPROGRESS || reqs[1].ret == -EINPROGRESS) {
+        qemu_aio_wait();
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (reqs[i].ret < 0) {
+            error_report("Error while reading offset %" PRId64 " of %s: %s",
+                         sectors_to_bytes(sector_num), reqs[i].filename,
+                         strerror(-reqs[i].ret));
+            return reqs[i].ret;
+        }
+    }
+    return 0;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -893,8 +1055,11 @@ static int img_compare(int argc, char **argv)
     BlockDriverState *bs1, *bs2;
     int64_t total_sectors1, total_sectors2;
     uint8_t *buf1 = NULL, *buf2 = NULL;
-    int pnum1, pnum2;
-    int allocated1, allocated2;
+    BlockStatusCache cache1 = { 0 }, cache2 = { 0 };
+    CompareRead reqs[2];
+    MapEntry e1, e2;
+    bool allocated1, allocated2;
+    bool zero1, zero2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int64_t total_sectors;
@@ -963,6 +1128,14 @@ static int img_compare(int argc, char **argv)
 
     buf1 = qemu_blockalign(bs1, IO_BUF_SIZE);
     buf2 = qemu_blockalign(bs2, IO_BUF_SIZE);
+    block_status_cache_init(&cache1, bs1);
+    block_status_cache_init(&cache2, bs2);
+    reqs[0] = (CompareRead) {
+        .bs = bs1, .filename = filename1, .iov.iov_base = buf1,
+    };
+    reqs[1] = (CompareRead) {
+        .bs = bs2, .filename = filename2, .iov.iov_base = buf2,
+    };
     bdrv_get_geometry(bs1, &bs_sectors);
     total_sectors1 = bs_sectors;
     bdrv_get_geometry(bs2, &bs_sectors);
@@ -979,64 +1152,59 @@ static int img_compare(int argc, char **argv)
     }
 
     for (;;) {
-        nb_sectors = sectors_to_process(total_sectors, sector_num);
+        nb_sectors = sectors_to_query(total_sectors, sector_num);
         if (nb_sectors <= 0) {
             break;
         }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
+        ret = get_block_status(bs1, &cache1, sector_num, nb_sectors, &e1);
+        if (ret < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename1);
             goto out;
         }
 
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
+        ret = get_block_status(bs2, &cache2, sector_num, nb_sectors, &e2);
+        if (ret < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename2);
             goto out;
         }
-        nb_sectors = MIN(pnum1, pnum2);
+        nb_sectors = MIN(e1.length, e2.length) >> BDRV_SECTOR_BITS;
+        allocated1 = map_entry_is_allocated(&e1);
+        allocated2 = map_entry_is_allocated(&e2);
+        zero1 = map_entry_reads_zero(&e1);
+        zero2 = map_entry_reads_zero(&e2);
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    ret = 1;
-                    goto out;
-                }
+        if (strict && allocated1 != allocated2) {
+            ret = 1;
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " allocation mismatch!\n",
+                    sectors_to_bytes(sector_num));
+            goto out;
+        }
+
+        if (zero1 && zero2) {
+            /* both sides are known to read as zeroes, nothing to compare */
+        } else if (!zero1 && !zero2) {
+            nb_sectors = sectors_to_process(sector_num + nb_sectors,
+                                            sector_num);
+            ret = compare_read_both(reqs, sector_num, nb_sectors);
+            if (ret < 0) {
+                ret = 4;
+                goto out;
             }
-        } else {
-            if (strict) {
+            ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                        sectors_to_bytes(
+                            ret ? sector_num : sector_num + pnum));
                 ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
                 goto out;
             }
-
-            if (allocated1) {
+        } else {
+            nb_sectors = sectors_to_process(sector_num + nb_sectors,
+                                            sector_num);
+            if (!zero1) {
                 ret = check_empty_sectors(bs1, sector_num, nb_sectors,
                                           filename1, buf1, quiet);
             } else {
@@ -1058,6 +1226,7 @@ static int img_compare(int argc, char **argv)
 
     if (total_sectors1 != total_sectors2) {
         BlockDriverState *bs_over;
+        BlockStatusCache *cache_over;
         int64_t total_sectors_over;
         const char *filename_over;
 
@@ -1065,20 +1234,22 @@ static int img_compare(int argc, char **argv)
         if (total_sectors1 > total_sectors2) {
             total_sectors_over = total_sectors1;
             bs_over = bs1;
+            cache_over = &cache1;
             filename_over = filename1;
         } else {
             total_sectors_over = total_sectors2;
             bs_over = bs2;
+            cache_over = &cache2;
             filename_over = filename2;
         }
 
         for (;;) {
-            nb_sectors = sectors_to_process(total_sectors_over, sector_num);
+            nb_sectors = sectors_to_query(total_sectors_over, sector_num);
             if (nb_sectors <= 0) {
                 break;
             }
-            ret = bdrv_is_allocated_above(bs_over, NULL, sector_num,
-                                          nb_sectors, &pnum);
+            ret = get_block_status(bs_over, cache_over, sector_num,
+                                   nb_sectors, &e1);
             if (ret < 0) {
                 ret = 3;
                 error_report("Sector allocation test failed for %s",
@@ -1086,8 +1257,10 @@ static int img_compare(int argc, char **argv)
                 goto out;
 
             }
-            nb_sectors = pnum;
-            if (ret) {
+            nb_sectors = e1.length >> BDRV_SECTOR_BITS;
+            if (!map_entry_reads_zero(&e1)) {
+                nb_sectors = sectors_to_process(sector_num + nb_sectors,
+                                                sector_num);
                 ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
                                           filename_over, buf1, quiet);
                 if (ret) {
@@ -1109,6 +1282,8 @@ static int img_compare(int argc, char **argv)
     ret = 0;
 
 out:
+    block_status_cache_destroy(&cache1);
+    block_status_cache_destroy(&cache2);
     bdrv_unref(bs2);
     qemu_vfree(buf1);
     qemu_vfree(buf2);
@@ -1119,27 +1294,340 @@ out3:
     return ret;
 }
 
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    int64_t sector_num;     /* start of the next chunk to be copied */
+    int64_t wr_offs;        /* in-order mode: end of the written area */
+    int ret;
+} ImgConvertState;
+
+/*
+ * Find the source image containing @sector_num.  Returns its index and stores
+ * the corresponding sector offset into the source in @src_sector.
+ */
+static int convert_find_src(ImgConvertState *s, int64_t sector_num,
+                            int64_t *src_sector)
+{
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        if (sector_num < s->src_sectors[i]) {
+            break;
+        }
+        sector_num -= s->src_sectors[i];
+    }
+    assert(i < s->src_num);
+
+    *src_sector = sector_num;
+    return i;
+}
+
+/* Reads @nb_sectors into @buf, possibly spanning several source images */
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_sector;
+    int src_cur, n, ret;
+
+    while (nb_sectors > 0) {
+        src_cur = convert_find_src(s, sector_num, &src_sector);
+        n = MIN(nb_sectors, s->src_sectors[src_cur] - src_sector);
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], src_sector, n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         src_sector, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    if (s->compressed) {
+        if (buffer_is_zero(buf, nb_sectors << BDRV_SECTOR_BITS)) {
+            return 0;
+        }
+        ret = bdrv_co_write_compressed(s->target, sector_num, buf, nb_sectors);
+        if (ret < 0) {
+            error_report("error while compressing sector %" PRId64 ": %s",
+                         sector_num, strerror(-ret));
+        }
+        return ret;
+    }
+
+    /* NOTE: at the same time we convert, we do not write zero
+       sectors to have a chance to compress the image. Ideally, we
+       should add a specific call to have the info to go faster */
+    while (nb_sectors > 0) {
+        n = nb_sectors;
+        if (!s->has_zero_init ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 if the sectors starting at @sector_num have to be copied and 0 if
+ * they can be skipped because the target's backing file provides them.  The
+ * number of sectors with the same status is stored in @pnum.
+ */
+static int coroutine_fn convert_co_classify(ImgConvertState *s,
+                                            int64_t sector_num, int nb_sectors,
+                                            int *pnum)
+{
+    int64_t src_sector;
+    int src_cur, ret;
+
+    /* If the output image is being created as a copy on write image,
+       assume that sectors which are unallocated in the input image
+       are present in both the output's and input's base images (no
+       need to copy them). */
+    if (!s->target_has_backing || s->compressed) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    src_cur = convert_find_src(s, sector_num, &src_sector);
+    nb_sectors = MIN(nb_sectors, s->src_sectors[src_cur] - src_sector);
+
+    ret = bdrv_is_allocated(s->src[src_cur], src_sector, nb_sectors, pnum);
+    if (ret < 0) {
+        error_report("error while reading metadata for sector %" PRId64
+                     ": %s", src_sector, strerror(-ret));
+        return ret;
+    }
+    assert(*pnum > 0);
+
+    return ret;
+}
+
+static void coroutine_fn convert_co_wait_in_order(ImgConvertState *s,
+                                                  int index,
+                                                  int64_t sector_num)
+{
+    while (s->wr_in_order && s->wr_offs != sector_num &&
+           s->ret == -EINPROGRESS) {
+        s->wait_sector_num[index] = sector_num;
+        qemu_coroutine_yield();
+    }
+    s->wait_sector_num[index] = -1;
+}
+
+/* Reenter the coroutine that waits for the area before @sector_num, if any */
+static void convert_wake_in_order(ImgConvertState *s, int64_t sector_num)
+{
+    int i;
+
+    if (!s->wr_in_order) {
+        return;
+    }
+
+    s->wr_offs = sector_num;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == sector_num) {
+            qemu_coroutine_enter(s->co[i], NULL);
+            break;
+        }
+    }
+}
+
+static void convert_wake_all(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+/*
+ * Each copy coroutine takes the next chunk of up to s->buf_sectors sectors,
+ * reads it and writes it to the target.  Reads from all coroutines overlap;
+ * unless out-of-order writes are allowed, the writes are issued in order of
+ * increasing sector number so that the target is filled sequentially.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret = 0, i, index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == -EINPROGRESS && s->sector_num < s->total_sectors) {
+        int64_t chunk_start, sector_num;
+        int chunk_sectors, n;
+        bool waited = false;
+
+        /* Claim the chunk before anything can yield */
+        chunk_start = sector_num = s->sector_num;
+        chunk_sectors = MIN(s->buf_sectors, s->total_sectors - chunk_start);
+        s->sector_num += chunk_sectors;
+
+        while (sector_num < chunk_start + chunk_sectors) {
+            ret = convert_co_classify(s, sector_num,
+                                      chunk_start + chunk_sectors - sector_num,
+                                      &n);
+            if (ret < 0) {
+                goto out;
+            } else if (ret == 0) {
+                /* Unallocated, present in the backing file */
+                sector_num += n;
+                continue;
+            }
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                goto out;
+            }
+
+            if (!waited) {
+                convert_co_wait_in_order(s, index, chunk_start);
+                waited = true;
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+            }
+
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                goto out;
+            }
+            sector_num += n;
+        }
+
+        if (!waited) {
+            convert_co_wait_in_order(s, index, chunk_start);
+        }
+        qemu_progress_print(100.0 * chunk_sectors / s->total_sectors, 100);
+        convert_wake_in_order(s, chunk_start + chunk_sectors);
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (ret < 0 && s->ret == -EINPROGRESS) {
+        s->ret = ret;
+        convert_wake_all(s);
+    }
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->ret = -EINPROGRESS;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size,
-        cluster_sectors, skip_create;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, skip_create;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t nb_sectors;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
     bool quiet = false;
     Error *local_err = NULL;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1148,7 +1636,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qn");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1208,6 +1696,22 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1240,6 +1744,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -1250,8 +1755,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &nb_sectors);
+        bs_sectors[bs_i] = nb_sectors;
+        total_sectors += nb_sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -1317,7 +1823,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -1364,11 +1870,6 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
     if (skip_create) {
         int64_t output_length = bdrv_getlength(out_bs);
         if (output_length < 0) {
@@ -1383,6 +1884,20 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = (bool) out_baseimg,
+        .wr_in_order        = wr_in_order,
+        .min_sparse         = min_sparse,
+        .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .num_coroutines     = num_coroutines,
+    };
+
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
@@ -1395,166 +1910,26 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
-        }
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
+        /* Compressed writes are always exactly one cluster */
+        state.buf_sectors = cluster_size >> BDRV_SECTOR_BITS;
 
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
+        /* Drivers without coroutine support can't compress in parallel */
+        if (!out_bs->drv->bdrv_co_write_compressed) {
+            state.num_coroutines = 1;
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            /* If the output image is being created as a copy on write image,
-               assume that sectors which are unallocated in the input image
-               are present in both the output's and input's base images (no
-               need to copy them). */
-            if (out_baseimg) {
-                ret = bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                        n, &n1);
-                if (ret < 0) {
-                    error_report("error while reading metadata for sector "
-                                 "%" PRId64 ": %s",
-                                 sector_num - bs_offset, strerror(-ret));
-                    goto out;
-                }
-                if (!ret) {
-                    sector_num += n1;
-                    continue;
-                }
-                /* The next 'n1' sectors are allocated in the input image. Copy
-                   only those as they may be followed by unallocated sectors. */
-                n = n1;
-            } else {
-                n1 = n;
-            }
+        state.has_zero_init = bdrv_has_zero_init(out_bs);
+    }
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (!has_zero_init ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+    ret = convert_do_copy(&state);
+    if (ret < 0) {
+        ret = -1;
     }
+
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
     if (out_bs) {
         bdrv_unref(out_bs);
     }
@@ -1566,6 +1941,7 @@ out:
         }
         g_free(bs);
     }
+    g_free(bs_sectors);
     if (ret) {
         return 1;
     }
@@ -1799,15 +2175,6 @@ static int img_info(int argc, char **argv)
 }
 
 
-typedef struct MapEntry {
-    int flags;
-    int depth;
-    int64_t start;
-    int64_t length;
-    int64_t offset;
-    BlockDriverState *bs;
-} MapEntry;
-
 static void dump_map_entry(OutputFormat output_format, MapEntry *e,
                            MapEntry *next)
 {
@@ -1850,45 +2217,6 @@ static void dump_map_entry(OutputFormat output_format, MapEntry *e,
     }
 }
 
-static int get_block_status(BlockDriverState *bs, int64_t sector_num,
-                            int nb_sectors, MapEntry *e)
-{
-    int64_t ret;
-    int depth;
-
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
-     */
-
-    depth = 0;
-    for (;;) {
-        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors);
-        if (ret < 0) {
-            return ret;
-        }
-        assert(nb_sectors);
-        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
-            break;
-        }
-        bs = bs->backing_hd;
-        if (bs == NULL) {
-            ret = 0;
-            break;
-        }
-
-        depth++;
-    }
-
-    e->start = sector_num * BDRV_SECTOR_SIZE;
-    e->length = nb_sectors * BDRV_SECTOR_SIZE;
-    e->flags = ret & ~BDRV_BLOCK_OFFSET_MASK;
-    e->offset = ret & BDRV_BLOCK_OFFSET_MASK;
-    e->depth = depth;
-    e->bs = bs;
-    return 0;
-}
-
 static int img_map(int argc, char **argv)
 {
     int c;
@@ -1897,6 +2225,7 @@ static int img_map(int argc, char **argv)
     const char *filename, *fmt, *output;
     int64_t length;
     MapEntry curr = { .length = 0 }, next;
+    BlockStatusCache cache;
     int ret = 0;
 
     fmt = NULL;
@@ -1950,6 +2279,7 @@ static int img_map(int argc, char **argv)
         printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
     }
 
+    block_status_cache_init(&cache, bs);
     length = bdrv_getlength(bs);
     while (curr.start + curr.length < length) {
         int64_t nsectors_left;
@@ -1961,7 +2291,7 @@ static int img_map(int argc, char **argv)
         /* Probe up to 1 GiB at a time.  */
         nsectors_left = DIV_ROUND_UP(length, BDRV_SECTOR_SIZE) - sector_num;
         n = MIN(1 << (30 - BDRV_SECTOR_BITS), nsectors_left);
-        ret = get_block_status(bs, sector_num, n, &next);
+        ret = get_block_status(bs, &cache, sector_num, n, &next);
 
         if (ret < 0) {
             error_report("Could not read file metadata: %s", strerror(-ret));
@@ -1985,6 +2315,7 @@ static int img_map(int argc, char **argv)
     dump_map_entry(output_format, &curr, NULL);
 
 out:
+    block_status_cache_destroy(&cache);
     bdrv_unref(bs);
     return ret < 0;
 }
@@ -2114,6 +2445,212 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+typedef struct ImgRebaseState {
+    BlockDriverState *bs;
+    BlockDriverState *old_backing;
+    BlockDriverState *new_backing;
+    int64_t total_sectors;
+    int64_t old_backing_sectors;
+    int64_t new_backing_sectors;
+    BlockStatusCache old_cache;
+    BlockStatusCache new_cache;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    int64_t sector_num;     /* start of the next chunk to be checked */
+    int ret;
+} ImgRebaseState;
+
+/*
+ * Reads the contents of a backing file for up to @nb_sectors sectors at
+ * @sector_num into @buf, or leaves @buf untouched if they are known to read
+ * as zeroes without looking at the data.  Returns 1 if @buf was filled, 0 if
+ * it was not, and stores the number of sectors in @pnum.
+ */
+static int coroutine_fn rebase_co_read_backing(BlockDriverState *bs,
+                                               BlockStatusCache *cache,
+                                               int64_t bs_sectors,
+                                               int64_t sector_num,
+                                               int nb_sectors, uint8_t *buf,
+                                               int *pnum)
+{
+    struct iovec iov;
+    QEMUIOVector qiov;
+    MapEntry e;
+    int ret;
+
+    /* The backing file may be smaller than the COW image */
+    if (!bs || sector_num >= bs_sectors) {
+        *pnum = nb_sectors;
+        return 0;
+    }
+
+    nb_sectors = MIN(nb_sectors, bs_sectors - sector_num);
+    ret = get_block_status(bs, cache, sector_num, nb_sectors, &e);
+    if (ret < 0) {
+        error_report("error while reading backing file metadata: %s",
+                     strerror(-ret));
+        return ret;
+    }
+    *pnum = e.length >> BDRV_SECTOR_BITS;
+    if (map_entry_reads_zero(&e)) {
+        return 0;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = *pnum << BDRV_SECTOR_BITS;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(bs, sector_num, *pnum, &qiov);
+    if (ret < 0) {
+        error_report("error while reading from backing file: %s",
+                     strerror(-ret));
+        return ret;
+    }
+    return 1;
+}
+
+/*
+ * Compares the old and new backing file for sectors that are unallocated in
+ * the COW image, and copies the ones that differ from the old backing file
+ * into the COW image.  Ranges that read as zeroes in both backing chains are
+ * skipped without reading them.  The number of sectors that were processed
+ * is stored in @pnum.
+ */
+static int coroutine_fn rebase_co_compare(ImgRebaseState *s,
+                                          int64_t sector_num, int nb_sectors,
+                                          uint8_t *buf_old, uint8_t *buf_new,
+                                          int *pnum)
+{
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret_old, ret_new, n, written, same, ret;
+
+    ret_old = rebase_co_read_backing(s->old_backing, &s->old_cache,
+                                     s->old_backing_sectors, sector_num,
+                                     nb_sectors, buf_old, &n);
+    if (ret_old < 0) {
+        return ret_old;
+    }
+    ret_new = rebase_co_read_backing(s->new_backing, &s->new_cache,
+                                     s->new_backing_sectors, sector_num, n,
+                                     buf_new, &n);
+    if (ret_new < 0) {
+        return ret_new;
+    }
+    *pnum = n;
+
+    if (!ret_old && !ret_new) {
+        /* both backing files read as zeroes */
+        return 0;
+    }
+    if (!ret_old) {
+        memset(buf_old, 0, n << BDRV_SECTOR_BITS);
+    }
+    if (!ret_new) {
+        memset(buf_new, 0, n << BDRV_SECTOR_BITS);
+    }
+
+    /* If they differ, we need to write to the COW file */
+    for (written = 0; written < n; written += same) {
+        if (compare_sectors(buf_old + written * BDRV_SECTOR_SIZE,
+                            buf_new + written * BDRV_SECTOR_SIZE,
+                            n - written, &same)) {
+            iov.iov_base = buf_old + written * BDRV_SECTOR_SIZE;
+            iov.iov_len = same << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->bs, sector_num + written, same, &qiov);
+            if (ret < 0) {
+                error_report("Error while writing to COW image: %s",
+                             strerror(-ret));
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Each coroutine takes the next chunk of up to s->buf_sectors sectors and
+ * handles its unallocated parts.  The chunks are independent, so the writes
+ * to the COW image can complete in any order.
+ */
+static void coroutine_fn rebase_co_do_chunks(void *opaque)
+{
+    ImgRebaseState *s = opaque;
+    uint8_t *buf_old, *buf_new;
+    int ret = 0;
+
+    s->running_coroutines++;
+    buf_old = qemu_blockalign(s->bs, s->buf_sectors * BDRV_SECTOR_SIZE);
+    buf_new = qemu_blockalign(s->bs, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == -EINPROGRESS && s->sector_num < s->total_sectors) {
+        int64_t chunk_start, sector_num;
+        int chunk_sectors, n;
+
+        /* Claim the chunk before anything can yield */
+        chunk_start = sector_num = s->sector_num;
+        chunk_sectors = MIN(s->buf_sectors, s->total_sectors - chunk_start);
+        s->sector_num += chunk_sectors;
+
+        while (sector_num < chunk_start + chunk_sectors) {
+            n = chunk_start + chunk_sectors - sector_num;
+
+            /* If the cluster is allocated, we don't need to take action */
+            ret = bdrv_is_allocated(s->bs, sector_num, n, &n);
+            if (ret < 0) {
+                error_report("error while reading image metadata: %s",
+                             strerror(-ret));
+                goto out;
+            }
+            if (!ret) {
+                ret = rebase_co_compare(s, sector_num, n, buf_old, buf_new,
+                                        &n);
+                if (ret < 0) {
+                    goto out;
+                }
+            }
+            sector_num += n;
+        }
+        qemu_progress_print(100.0 * chunk_sectors / s->total_sectors, 100);
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(buf_old);
+    qemu_vfree(buf_new);
+    s->running_coroutines--;
+    if (ret < 0 && s->ret == -EINPROGRESS) {
+        s->ret = ret;
+    }
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+static int rebase_do_compare(ImgRebaseState *s)
+{
+    Coroutine *co;
+    int i;
+
+    s->ret = -EINPROGRESS;
+    s->sector_num = 0;
+    block_status_cache_init(&s->old_cache, s->old_backing);
+    block_status_cache_init(&s->new_cache, s->new_backing);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        co = qemu_coroutine_create(rebase_co_do_chunks);
+        qemu_coroutine_enter(co, s);
+    }
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    block_status_cache_destroy(&s->old_cache);
+    block_status_cache_destroy(&s->new_cache);
+    return s->ret;
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockDriverState *bs, *bs_old_backing = NULL, *bs_new_backing = NULL;
@@ -2123,6 +2660,7 @@ static int img_rebase(int argc, char **argv)
     int c, flags, ret;
     int unsafe = 0;
     int progress = 0;
+    int num_coroutines = 8;
     bool quiet = false;
     Error *local_err = NULL;
 
@@ -2132,7 +2670,7 @@ static int img_rebase(int argc, char **argv)
     out_baseimg = NULL;
     out_basefmt = NULL;
     for(;;) {
-        c = getopt(argc, argv, "uhf:F:b:pt:q");
+        c = getopt(argc, argv, "uhf:F:b:pt:qm:");
         if (c == -1) {
             break;
         }
@@ -2162,6 +2700,19 @@ static int img_rebase(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
         }
     }
 
@@ -2258,106 +2809,28 @@ static int img_rebase(int argc, char **argv)
      * the image is the same as the original one at any time.
      */
     if (!unsafe) {
+        ImgRebaseState state = {
+            .bs             = bs,
+            .old_backing    = bs_old_backing,
+            .new_backing    = bs_new_backing,
+            .buf_sectors    = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .num_coroutines = num_coroutines,
+        };
         uint64_t num_sectors;
-        uint64_t old_backing_num_sectors;
-        uint64_t new_backing_num_sectors = 0;
-        uint64_t sector;
-        int n;
-        uint8_t * buf_old;
-        uint8_t * buf_new;
-        float local_progress = 0;
-
-        buf_old = qemu_blockalign(bs, IO_BUF_SIZE);
-        buf_new = qemu_blockalign(bs, IO_BUF_SIZE);
 
         bdrv_get_geometry(bs, &num_sectors);
-        bdrv_get_geometry(bs_old_backing, &old_backing_num_sectors);
+        state.total_sectors = num_sectors;
+        bdrv_get_geometry(bs_old_backing, &num_sectors);
+        state.old_backing_sectors = num_sectors;
         if (bs_new_backing) {
-            bdrv_get_geometry(bs_new_backing, &new_backing_num_sectors);
-        }
-
-        if (num_sectors != 0) {
-            local_progress = (float)100 /
-                (num_sectors / MIN(num_sectors, IO_BUF_SIZE / 512));
+            bdrv_get_geometry(bs_new_backing, &num_sectors);
+            state.new_backing_sectors = num_sectors;
         }
 
-        for (sector = 0; sector < num_sectors; sector += n) {
-
-            /* How many sectors can we handle with the next read? */
-            if (sector + (IO_BUF_SIZE / 512) <= num_sectors) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = num_sectors - sector;
-            }
-
-            /* If the cluster is allocated, we don't need to take action */
-            ret = bdrv_is_allocated(bs, sector, n, &n);
-            if (ret < 0) {
-                error_report("error while reading image metadata: %s",
-                             strerror(-ret));
-                goto out;
-            }
-            if (ret) {
-                continue;
-            }
-
-            /*
-             * Read old and new backing file and take into consideration that
-             * backing files may be smaller than the COW image.
-             */
-            if (sector >= old_backing_num_sectors) {
-                memset(buf_old, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > old_backing_num_sectors) {
-                    n = old_backing_num_sectors - sector;
-                }
-
-                ret = bdrv_read(bs_old_backing, sector, buf_old, n);
-                if (ret < 0) {
-                    error_report("error while reading from old backing file");
-                    goto out;
-                }
-            }
-
-            if (sector >= new_backing_num_sectors || !bs_new_backing) {
-                memset(buf_new, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > new_backing_num_sectors) {
-                    n = new_backing_num_sectors - sector;
-                }
-
-                ret = bdrv_read(bs_new_backing, sector, buf_new, n);
-                if (ret < 0) {
-                    error_report("error while reading from new backing file");
-                    goto out;
-                }
-            }
-
-            /* If they differ, we need to write to the COW file */
-            uint64_t written = 0;
-
-            while (written < n) {
-                int pnum;
-
-                if (compare_sectors(buf_old + written * 512,
-                    buf_new + written * 512, n - written, &pnum))
-                {
-                    ret = bdrv_write(bs, sector + written,
-                        buf_old + written * 512, pnum);
-                    if (ret < 0) {
-                        error_report("Error while writing to COW image: %s",
-                            strerror(-ret));
-                        goto out;
-                    }
-                }
-
-                written += pnum;
-            }
-            qemu_progress_print(local_progress, 100);
+        ret = rebase_do_compare(&state);
+        if (ret < 0) {
+            goto out;
         }
-
-        qemu_vfree(buf_old);
-        qemu_vfree(buf_new);
     }
 
     /*
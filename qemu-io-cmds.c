@@ -12,6 +12,8 @@
 #include "block/block_int.h"
 #include "block/qapi.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
 
 #define CMD_NOFILE_OK   0x01
 
@@ -442,7 +444,7 @@ static void coroutine_fn co_write_zeroes_entry(void *opaque)
     CoWriteZeroes *data = opaque;
 
     data->ret = bdrv_co_write_zeroes(data->bs, data->offset / BDRV_SECTOR_SIZE,
-                                     data->count / BDRV_SECTOR_SIZE);
+                                     data->count / BDRV_SECTOR_SIZE, 0);
     data->done = true;
     if (data->ret < 0) {
         *data->total = data->ret;
@@ -1944,6 +1946,339 @@ static const cmdinfo_t map_cmd = {
        .oneline        = "prints the allocated areas of a file",
 };
 
+/*
+ * Latency histogram for the bench command.  Values below BENCH_HIST_SUB
+ * nanoseconds get their own bucket, larger ones are split into
+ * BENCH_HIST_SUB buckets per power of two, which keeps the error of the
+ * percentiles below 1/BENCH_HIST_SUB without storing every sample.
+ */
+#define BENCH_HIST_SHIFT    4
+#define BENCH_HIST_SUB      (1 << BENCH_HIST_SHIFT)
+#define BENCH_HIST_BUCKETS  ((64 - BENCH_HIST_SHIFT + 1) * BENCH_HIST_SUB)
+
+static int bench_hist_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < BENCH_HIST_SUB) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return (msb - BENCH_HIST_SHIFT + 1) * BENCH_HIST_SUB +
+           ((ns >> (msb - BENCH_HIST_SHIFT)) & (BENCH_HIST_SUB - 1));
+}
+
+static uint64_t bench_hist_value(int bucket)
+{
+    int msb;
+
+    if (bucket < BENCH_HIST_SUB) {
+        return bucket;
+    }
+    msb = bucket / BENCH_HIST_SUB + BENCH_HIST_SHIFT - 1;
+    return (uint64_t)(BENCH_HIST_SUB | (bucket % BENCH_HIST_SUB))
+           << (msb - BENCH_HIST_SHIFT);
+}
+
+typedef struct BenchStats {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t hist[BENCH_HIST_BUCKETS];
+} BenchStats;
+
+typedef struct BenchState {
+    BlockDriverState *bs;
+    int64_t offset;
+    int64_t nb_blocks;
+    int bufsize;
+    bool random;
+    int write_pct;
+    int64_t next_block;
+    int64_t deadline;
+    int in_flight;
+    int ret;
+    BenchStats stats[2];        /* reads, writes */
+} BenchState;
+
+typedef struct BenchReq {
+    BenchState *b;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    void *buf;
+    bool is_write;
+    int64_t start;
+} BenchReq;
+
+static void bench_submit(BenchReq *req);
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchState *b = req->b;
+    BenchStats *st = &b->stats[req->is_write];
+    int64_t now = get_clock();
+    uint64_t ns = now - req->start;
+
+    b->in_flight--;
+    if (ret < 0) {
+        if (b->ret == 0) {
+            b->ret = ret;
+        }
+        return;
+    }
+
+    st->ops++;
+    st->bytes += req->qiov.size;
+    st->min_ns = MIN(st->min_ns, ns);
+    st->max_ns = MAX(st->max_ns, ns);
+    st->hist[bench_hist_bucket(ns)]++;
+
+    if (now < b->deadline && b->ret == 0) {
+        bench_submit(req);
+    }
+}
+
+static void bench_submit(BenchReq *req)
+{
+    BenchState *b = req->b;
+    int64_t block, sector_num;
+    int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+
+    if (b->random) {
+        block = (((uint64_t)random() << 31) | random()) % b->nb_blocks;
+    } else {
+        block = b->next_block;
+        b->next_block = (b->next_block + 1) % b->nb_blocks;
+    }
+    req->is_write = b->write_pct && (b->write_pct == 100 ||
+                                     random() % 100 < b->write_pct);
+    sector_num = (b->offset + block * b->bufsize) >> BDRV_SECTOR_BITS;
+
+    b->in_flight++;
+    req->start = get_clock();
+    if (req->is_write) {
+        bdrv_aio_writev(b->bs, sector_num, &req->qiov, nb_sectors,
+                        bench_cb, req);
+    } else {
+        bdrv_aio_readv(b->bs, sector_num, &req->qiov, nb_sectors,
+                       bench_cb, req);
+    }
+}
+
+static uint64_t bench_percentile(BenchStats *st, int p)
+{
+    uint64_t rank = (st->ops * p + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += st->hist[i];
+        if (seen >= rank) {
+            return MIN(MAX(bench_hist_value(i), st->min_ns), st->max_ns);
+        }
+    }
+    return st->max_ns;
+}
+
+static void bench_report(const char *op, BenchStats *st, struct timeval *t,
+                         int Cflag)
+{
+    char s1[64], s2[64], ts[64];
+
+    if (!st->ops) {
+        return;
+    }
+
+    timestr(t, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+    if (!Cflag) {
+        cvtstr((double)st->bytes, s1, sizeof(s1));
+        cvtstr(tdiv((double)st->bytes, *t), s2, sizeof(s2));
+        printf("%s %s, %" PRIu64 " ops; %s (%s/sec and %.4f ops/sec)\n",
+               op, s1, st->ops, ts, s2, tdiv((double)st->ops, *t));
+        printf("%s latency (us): min %.1f, p50 %.1f, p90 %.1f, "
+               "p99 %.1f, max %.1f\n", op, st->min_ns / 1000.0,
+               bench_percentile(st, 50) / 1000.0,
+               bench_percentile(st, 90) / 1000.0,
+               bench_percentile(st, 99) / 1000.0,
+               st->max_ns / 1000.0);
+    } else {
+        /* op,bytes,ops,time,bytes/sec,ops/sec,min,p50,p90,p99,max (ns) */
+        printf("%s,%" PRIu64 ",%" PRIu64 ",%s,%.3f,%.3f,%" PRIu64 ",%" PRIu64
+               ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               op, st->bytes, st->ops, ts,
+               tdiv((double)st->bytes, *t), tdiv((double)st->ops, *t),
+               st->min_ns, bench_percentile(st, 50),
+               bench_percentile(st, 90), bench_percentile(st, 99),
+               st->max_ns);
+    }
+}
+
+static void bench_help(void)
+{
+    printf(
+"\n"
+" keeps a number of asynchronous requests in flight for a given time and\n"
+" reports the throughput and the latency of the requests\n"
+"\n"
+" Example:\n"
+" 'bench -q 32 -b 4k -r -w 30 -t 10' - random 4k I/O, 70%% reads and 30%%\n"
+"                                      writes, 32 requests at a time, 10 s\n"
+"\n"
+" Requests are issued with bdrv_aio_readv/bdrv_aio_writev over the whole\n"
+" image, or over len bytes from offset off.  Writes overwrite the image\n"
+" contents with a pattern (0xcd)!\n"
+" -b, -- size of each request (default 4k)\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -q, -- number of requests in flight (default 1)\n"
+" -r, -- random offsets (default sequential)\n"
+" -t, -- runtime in seconds (default 10)\n"
+" -w, -- percentage of writes (default 0)\n"
+" -o, -- start of the region to use (default 0)\n"
+" -l, -- length of the region to use (default up to the end)\n"
+"\n");
+}
+
+static int bench_f(BlockDriverState *bs, int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+    .name       = "bench",
+    .cfunc      = bench_f,
+    .argmin     = 0,
+    .argmax     = -1,
+    .args       = "[-Cr] [-b bs] [-q depth] [-t secs] [-w pct] "
+                  "[-o off] [-l len]",
+    .oneline    = "measures throughput and latency of parallel aio",
+    .help       = bench_help,
+};
+
+static int bench_f(BlockDriverState *bs, int argc, char **argv)
+{
+    BenchState *b;
+    BenchReq *reqs;
+    struct timeval t1, t2;
+    int64_t bufsize = 4096, offset = 0, length = -1, size;
+    int depth = 1, runtime = 10, write_pct = 0;
+    int Cflag = 0, random_pattern = 0;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "b:Cl:o:q:rt:w:")) != EOF) {
+        switch (c) {
+        case 'b':
+            bufsize = cvtnum(optarg);
+            if (bufsize <= 0) {
+                printf("non-numeric block size argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'C':
+            Cflag = 1;
+            break;
+        case 'l':
+            length = cvtnum(optarg);
+            if (length < 0) {
+                printf("non-numeric length argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'o':
+            offset = cvtnum(optarg);
+            if (offset < 0) {
+                printf("non-numeric offset argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            random_pattern = 1;
+            break;
+        case 't':
+            runtime = atoi(optarg);
+            break;
+        case 'w':
+            write_pct = atoi(optarg);
+            break;
+        default:
+            return qemuio_command_usage(&bench_cmd);
+        }
+    }
+
+    if (optind != argc) {
+        return qemuio_command_usage(&bench_cmd);
+    }
+
+    if (depth <= 0 || runtime <= 0 || write_pct < 0 || write_pct > 100) {
+        printf("queue depth and runtime must be positive, "
+               "the write percentage between 0 and 100\n");
+        return 0;
+    }
+    if ((bufsize | offset) & 0x1ff || bufsize > INT_MAX) {
+        printf("block size and offset must be sector aligned\n");
+        return 0;
+    }
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        printf("getlength: %s\n", strerror(-size));
+        return 0;
+    }
+    if (length < 0) {
+        length = size > offset ? size - offset : 0;
+    }
+    if (offset + length > size || length < bufsize) {
+        printf("region of %" PRId64 " bytes at offset %" PRId64
+               " does not fit %" PRId64 " byte requests in the image\n",
+               length, offset, bufsize);
+        return 0;
+    }
+
+    b = g_new0(BenchState, 1);
+    b->bs = bs;
+    b->offset = offset;
+    b->bufsize = bufsize;
+    b->nb_blocks = length / bufsize;
+    b->random = random_pattern;
+    b->write_pct = write_pct;
+    b->stats[0].min_ns = b->stats[1].min_ns = UINT64_MAX;
+
+    reqs = g_new0(BenchReq, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].b = b;
+        reqs[i].buf = qemu_io_alloc(bs, bufsize, 0xcd);
+        reqs[i].iov.iov_base = reqs[i].buf;
+        reqs[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    gettimeofday(&t1, NULL);
+    b->deadline = get_clock() + runtime * get_ticks_per_sec();
+    for (i = 0; i < depth; i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (b->in_flight > 0) {
+        qemu_aio_wait();
+    }
+    gettimeofday(&t2, NULL);
+
+    if (b->ret < 0) {
+        printf("bench failed: %s\n", strerror(-b->ret));
+    } else {
+        t2 = tsub(t2, t1);
+        bench_report("read", &b->stats[0], &t2, Cflag);
+        bench_report("write", &b->stats[1], &t2, Cflag);
+    }
+
+    for (i = 0; i < depth; i++) {
+        qemu_io_free(reqs[i].buf);
+    }
+    g_free(reqs);
+    g_free(b);
+    return 0;
+}
+
 static int break_f(BlockDriverState *bs, int argc, char **argv)
 {
     int ret;
@@ -2125,6 +2460,7 @@ static void __attribute((constructor)) init_qemuio_commands(void)
     qemuio_add_command(&discard_cmd);
     qemuio_add_command(&alloc_cmd);
     qemuio_add_command(&map_cmd);
+    qemuio_add_command(&bench_cmd);
     qemuio_add_command(&break_cmd);
     qemuio_add_command(&resume_cmd);
     qemuio_add_command(&wait_break_cmd);
@@ -592,6 +592,8 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    /* nothing else uses bs, so reads may bypass the block layer */
+    nbd_export_set_zero_copy(exp, true);
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
@@ -34,6 +34,8 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm_halt_poll_ns=ns to poll before sleeping a halted vCPU (default: 0)\n"
+    "                xen_mapcache_bucket=size of the Xen map cache buckets\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n",
     QEMU_ARCH_ALL)
@@ -52,6 +54,15 @@ to initialize.
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm_halt_poll_ns=ns
+When the guest halts a vCPU and the halt is handled in QEMU (no in-kernel
+irqchip), poll for up to @var{ns} nanoseconds for an interrupt before
+putting the vCPU thread to sleep.  The default is 0, which disables polling.
+@item xen_mapcache_bucket=size
+Guest memory is mapped into QEMU in buckets of @var{size} bytes, which must
+be a power of two.  Larger buckets mean fewer mappings for guests with
+emulated devices that do DMA all over their memory.  The default is 1M on
+64-bit hosts and 64K on 32-bit hosts.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -95,12 +106,19 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "           [,host-nodes=node[-node]][,policy=default|preferred|bind|interleave]\n"
+    "           [,pin=on|off]\n", QEMU_ARCH_ALL)
 STEXI
 @item -numa @var{opts}
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
 are split equally.
+
+@option{host-nodes} places the guest RAM of the node on the given host
+NUMA nodes, according to @option{policy} (bind by default).  With
+@option{pin=on}, the threads of the node's vCPUs are also restricted to
+the host CPUs of those nodes.  Host binding is only supported on Linux.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -409,11 +427,16 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
-    "       [[,iops_size=is]]\n"
+    "       [[,bps_max_length=bl]|[[,bps_rd_max_length=rl]\n"
+    "        [,bps_wr_max_length=wl]]]\n"
+    "       [[,iops_max_length=il]|[[,iops_rd_max_length=irl]\n"
+    "        [,iops_wr_max_length=iwl]]]\n"
+    "       [[,iops_size=is]][,group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -448,8 +471,16 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+If it is not given and @option{cache.direct} is on, native Linux AIO is used for
+block devices and for fully allocated image files.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
+@item detect-zeroes=@var{detect-zeroes}
+@var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
+conversion of plain zero writes by the OS to driver specific optimized
+zero write commands. If "unmap" is chosen and @var{discard} is set to "unmap",
+it will also release the affected clusters where this is known to read back
+as zeroes.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -611,12 +642,13 @@ ETEXI
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,cache_ttl=ms]\n"
+    " [,socket=socket|sock_fd=sock_fd]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,cache_ttl=@var{ms}][,socket=@var{socket}|sock_fd=@var{sock_fd}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -650,6 +682,11 @@ reported as written by the storage subsystem.
 @item readonly
 Enables exporting 9p share as a readonly mount for guests. By default
 read-write access is given.
+@item cache_ttl=@var{ms}
+Caches the attributes of looked up paths for @var{ms} milliseconds.
+Changes made by the guest update the cache right away, but changes made
+directly on the host can take that long to be seen by the guest. By
+default nothing is cached.
 @item socket=@var{socket}
 Enables proxy filesystem driver to use passed socket file for communicating
 with virtfs-proxy-helper
@@ -673,12 +710,13 @@ ETEXI
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,cache_ttl=ms]\n"
+    "        [,socket=socket|sock_fd=sock_fd]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,cache_ttl=@var{ms}][,socket=@var{socket}|sock_fd=@var{sock_fd}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -713,6 +751,11 @@ reported as written by the storage subsystem.
 @item readonly
 Enables exporting 9p share as a readonly mount for guests. By default
 read-write access is given.
+@item cache_ttl=@var{ms}
+Caches the attributes of looked up paths for @var{ms} milliseconds.
+Changes made by the guest update the cache right away, but changes made
+directly on the host can take that long to be seen by the guest. By
+default nothing is cached.
 @item socket=@var{socket}
 Enables proxy filesystem driver to use passed socket file for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
@@ -1409,6 +1452,14 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
 #endif
+#ifdef CONFIG_LINUX
+    "-net af-packet[,vlan=n][,name=str],ifname=name[,frames=n]\n"
+    "                connect the vlan 'n' to host interface 'name' through an\n"
+    "                AF_PACKET socket with mmap()ed rings of 'n' frames\n"
+#endif
+    "-net null[,vlan=n][,name=str][,rate=n][,len=n]\n"
+    "                drop the packets on vlan 'n', and send it 'rate' generated\n"
+    "                packets of 'len' bytes per second\n"
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
@@ -1422,9 +1473,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "bridge|"
 #ifdef CONFIG_VDE
     "vde|"
+#endif
+#ifdef CONFIG_LINUX
+    "af-packet|vhost-user|"
 #endif
     "socket|"
-    "hubport],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
+    "hubport|null],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
 @item -net nic[,vlan=@var{n}][,macaddr=@var{mac}][,model=@var{type}] [,name=@var{name}][,addr=@var{addr}][,vectors=@var{v}]
 @findex -net
@@ -1746,6 +1800,51 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,frames=@var{n}]
+@item -net af-packet[,vlan=@var{n}][,name=@var{name}],ifname=@var{ifname}[,frames=@var{n}]
+Connect VLAN @var{n} to the host network interface @var{ifname} through an
+AF_PACKET socket.  The interface is put in promiscuous mode.  Received and
+transmitted packets go through rings of @var{n} frames (256 by default)
+shared with the kernel, so bursts of small packets need few system calls.
+Packets larger than about 2000 bytes are dropped.  This option is only
+available on Linux and requires the CAP_NET_RAW capability.
+
+Example:
+@example
+qemu-system-i386 linux.img -netdev af-packet,id=net0,ifname=eth1 \
+                 -device virtio-net-pci,netdev=net0
+@end example
+
+@item -netdev null,id=@var{id}[,rate=@var{n}][,len=@var{len}]
+@item -net null[,vlan=@var{n}][,name=@var{name}][,rate=@var{n}][,len=@var{len}]
+Drop every packet sent on VLAN @var{n}, without touching the host network.
+With @option{rate}, also send @var{n} broadcast packets of @var{len} bytes
+(64 by default) per second of virtual time.  This measures the cost of the
+emulated network device alone.
+
+Example:
+@example
+qemu-system-i386 linux.img -netdev null,id=net0,rate=100000 \
+                 -device virtio-net-pci,netdev=net0
+@end example
+
+@item -netdev vhost-user,id=@var{id},path=@var{path}[,vhostforce=on|off]
+Let another process service the virtqueues of the virtio-net device
+connected to this netdev.  QEMU connects to the UNIX domain socket at
+@var{path} and sends it the vhost requests (memory table, vring addresses,
+kick and call eventfds) as vhost-user messages instead of ioctls on
+@file{/dev/vhost-net}.  Guest memory is shared with the other process
+through file descriptors, so it must be allocated with @option{-mem-path}
+and @option{-mem-prealloc}.  @option{vhostforce} has the same meaning as
+for @option{-netdev tap}.  This option is only available on Linux.
+
+Example:
+@example
+qemu-system-x86_64 -m 1024 -mem-path /dev/hugepages -mem-prealloc \
+                   -netdev vhost-user,id=net0,path=/tmp/vhost-user.sock \
+                   -device virtio-net-pci,netdev=net0 linux.img
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -2063,6 +2162,12 @@ By default qemu will use the iSCSI initiator-name
 'iqn.2008-11.org.linux-kvm[:<name>]' but this can also be set from the command
 line or a configuration file.
 
+Requests to a disk LUN can be spread over several sessions to the
+target with the @option{sessions} drive option, for example
+@option{-drive file=iscsi://192.0.2.1/iqn.2001-04.com.example/1,sessions=4}.
+Each request goes to the session with the fewest requests in flight.
+SCSI passthrough devices always use a single session.
+
 
 Example (without authentication):
 @example
@@ -2117,6 +2222,15 @@ Example for Unix Domain Sockets
 qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket
 @end example
 
+Each connection keeps up to 64 requests in flight.  Over links with a high
+latency, the @option{max-requests} option raises this number (up to 1024),
+and the @option{connections} option spreads the requests over several
+connections (up to 16) to the same export.  qemu-nbd only accepts more than
+one connection if it was started with @option{--shared}.
+@example
+qemu-system-i386 -drive file.driver=nbd,file.host=192.0.2.1,file.port=30000,file.connections=4,file.max-requests=256
+@end example
+
 @item SSH
 QEMU supports SSH (Secure Shell) access to remote disks.
 
@@ -3032,13 +3146,13 @@ config files on @var{sysconfdir}, but won't make it skip the QEMU-provided confi
 files from @var{datadir}.
 ETEXI
 DEF("trace", HAS_ARG, QEMU_OPTION_trace,
-    "-trace [events=<file>][,file=<file>]\n"
+    "-trace [events=<file>][,file=<file>][,bufsize=<size>]\n"
     "                specify tracing options\n",
     QEMU_ARCH_ALL)
 STEXI
 HXCOMM This line is not accurate, as some sub-options are backend-specific but
 HXCOMM HX does not support conditional compilation of text.
-@item -trace [events=@var{file}][,file=@var{file}]
+@item -trace [events=@var{file}][,file=@var{file}][,bufsize=@var{size}]
 @findex -trace
 
 Specify tracing options.
@@ -3053,6 +3167,13 @@ either @var{simple} or @var{stderr} tracing backend.
 @item file=@var{file}
 Log output traces to @var{file}.
 
+This option is only available if QEMU has been compiled with
+the @var{simple} tracing backend.
+@item bufsize=@var{size}
+Size of the buffer that each thread records its trace events in, rounded
+up to a power of two.  The default is 256K.  Events that do not fit in the
+buffer before it is written out are dropped.
+
 This option is only available if QEMU has been compiled with
 the @var{simple} tracing backend.
 @end table
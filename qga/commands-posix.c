@@ -702,7 +702,8 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **err)
  * Walk list of mounted file systems in the guest, and freeze the ones which
  * are real local file systems.
  */
-int64_t qmp_guest_fsfreeze_freeze(Error **err)
+int64_t qmp_guest_fsfreeze_freeze(bool has_timeout, int64_t timeout,
+                                   Error **err)
 {
     int ret = 0, i = 0;
     FsMountList mounts;
@@ -710,6 +711,12 @@ int64_t qmp_guest_fsfreeze_freeze(Error **err)
     Error *local_err = NULL;
     int fd;
 
+    if (has_timeout && (timeout <= 0 || timeout > G_MAXUINT)) {
+        error_set(err, QERR_INVALID_PARAMETER_VALUE, "timeout",
+                  "a positive number of seconds");
+        return -1;
+    }
+
     slog("guest-fsfreeze called");
 
     execute_fsfreeze_hook(FSFREEZE_HOOK_FREEZE, &local_err);
@@ -725,6 +732,15 @@ int64_t qmp_guest_fsfreeze_freeze(Error **err)
         return -1;
     }
 
+    /*
+     * FIFREEZE writes back the dirty data of each filesystem before it
+     * returns, and the filesystems have to be frozen one after the other,
+     * children before the filesystems they are stacked on.  Start the
+     * writeback on all of them at once first, so that each freeze only
+     * has to wait for what was dirtied in the meantime.
+     */
+    sync();
+
     /* cannot risk guest agent blocking itself on a write in this state */
     ga_set_frozen(ga_state);
 
@@ -759,6 +775,9 @@ int64_t qmp_guest_fsfreeze_freeze(Error **err)
     }
 
     free_fs_mount_list(&mounts);
+    if (has_timeout) {
+        ga_set_thaw_timeout(ga_state, timeout);
+    }
     return i;
 
 error:
@@ -1445,7 +1464,8 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **err)
     return 0;
 }
 
-int64_t qmp_guest_fsfreeze_freeze(Error **err)
+int64_t qmp_guest_fsfreeze_freeze(bool has_timeout, int64_t timeout,
+                                   Error **err)
 {
     error_set(err, QERR_UNSUPPORTED);
 
@@ -173,7 +173,8 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **err)
  * Freeze local file systems using Volume Shadow-copy Service.
  * The frozen state is limited for up to 10 seconds by VSS.
  */
-int64_t qmp_guest_fsfreeze_freeze(Error **err)
+int64_t qmp_guest_fsfreeze_freeze(bool has_timeout, int64_t timeout,
+                                   Error **err)
 {
     int i;
     Error *local_err = NULL;
@@ -183,6 +184,12 @@ int64_t qmp_guest_fsfreeze_freeze(Error **err)
         return 0;
     }
 
+    if (has_timeout && (timeout <= 0 || timeout > G_MAXUINT)) {
+        error_set(err, QERR_INVALID_PARAMETER_VALUE, "timeout",
+                  "a positive number of seconds");
+        return 0;
+    }
+
     slog("guest-fsfreeze called");
 
     /* cannot risk guest agent blocking itself on a write in this state */
@@ -193,6 +200,9 @@ int64_t qmp_guest_fsfreeze_freeze(Error **err)
         goto error;
     }
 
+    if (has_timeout) {
+        ga_set_thaw_timeout(ga_state, timeout);
+    }
     return i;
 
 error:
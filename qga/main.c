@@ -31,6 +31,7 @@
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/dispatch.h"
 #include "qga/channel.h"
+#include "qga-qmp-commands.h"
 #include "qemu/bswap.h"
 #ifdef _WIN32
 #include "qga/service-win32.h"
@@ -80,6 +81,7 @@ struct GAState {
 #endif
     bool delimit_response;
     bool frozen;
+    guint thaw_timeout_id;      /* automatic thaw, see ga_set_thaw_timeout() */
     GList *blacklist;
     const char *state_filepath_isfrozen;
     struct {
@@ -427,6 +429,11 @@ void ga_unset_frozen(GAState *s)
         return;
     }
 
+    if (s->thaw_timeout_id) {
+        g_source_remove(s->thaw_timeout_id);
+        s->thaw_timeout_id = 0;
+    }
+
     /* if we delayed creation/opening of pid/log files due to being
      * in a frozen state at start up, do it now
      */
@@ -455,6 +462,31 @@ void ga_unset_frozen(GAState *s)
     }
 }
 
+static gboolean ga_thaw_timeout(gpointer opaque)
+{
+    GAState *s = opaque;
+    Error *err = NULL;
+
+    s->thaw_timeout_id = 0;
+    qmp_guest_fsfreeze_thaw(&err);
+    g_warning("filesystems were thawed after the freeze timed out");
+    if (err) {
+        g_warning("failed to thaw filesystems: %s", error_get_pretty(err));
+        error_free(err);
+    }
+    return FALSE;
+}
+
+/* thaw the filesystems after @seconds unless they are thawed before */
+void ga_set_thaw_timeout(GAState *s, int64_t seconds)
+{
+    g_assert(ga_is_frozen(s));
+    if (s->thaw_timeout_id) {
+        g_source_remove(s->thaw_timeout_id);
+    }
+    s->thaw_timeout_id = g_timeout_add_seconds(seconds, ga_thaw_timeout, s);
+}
+
 #ifdef CONFIG_FSFREEZE
 const char *ga_fsfreeze_hook(GAState *s)
 {
@@ -557,7 +589,7 @@ static void process_command(GAState *s, QDict *req)
 }
 
 /* handle requests/control events coming in over the channel */
-static void process_event(JSONMessageParser *parser, QList *tokens)
+static void process_event(JSONMessageParser *parser, GQueue *tokens)
 {
     GAState *s = container_of(parser, GAState, parser);
     QObject *obj;
@@ -791,11 +791,13 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
-        .params     = "-p protocol [begin] [length]",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,detach:b?,"
+                      "format:s?",
+        .params     = "-p protocol [begin] [length] [detach] [format]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
-        .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
+        .flags      = MONITOR_CMD_COROUTINE,
+        .mhandler.cmd_co = qmp_co_dump_guest_memory,
     },
 
 SQMP
@@ -813,6 +815,11 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "detach": run the dump in the background and return right away; use
+            query-dump to check its progress (json-bool)
+- "format": the format of the dump, "elf" (the default) or "kdump-zlib".
+            kdump-compressed dumps can't be combined with paging, begin
+            and length (json-string)
 
 Example:
 
@@ -822,6 +829,36 @@ Example:
 Notes:
 
 (1) All boolean arguments default to false
+(2) Without "detach", the rest of QEMU keeps running while the dump is
+    written, but the monitor handles no further commands until it is done
+
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Query the progress of the current or the last dump-guest-memory.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory written so far (json-int)
+- "total": total bytes of guest memory to be written (json-int)
+- "error": the reason of the failure, only present if the status is
+           "failed" (json-string, optional)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1073741824,
+                 "total": 4294967296 } }
 
 EQMP
 
@@ -900,6 +937,62 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that records all writes to a device from now on.
+It can be used by drive-backup with sync mode "incremental".
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+- "name": name of the new dirty bitmap (json-string)
+- "granularity": granularity of the bitmap in bytes, a power of 2 of at
+                 least 512 (json-int, optional, default 65536)
+- "persistent": save the bitmap in the image file (qcow2 with compat=1.1
+                only) (json-bool, optional, default false)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "drive0",
+                                                         "name": "nightly",
+                                                         "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Remove a named dirty bitmap.  The bitmap must not be in use by a block job.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+- "name": name of the dirty bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "drive0",
+                                                            "name": "nightly" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -917,7 +1010,7 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,bitmap:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -944,8 +1037,8 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for only the sectors marked in "bitmap" (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
@@ -957,6 +1050,9 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "bitmap": the dirty bitmap to use with sync mode "incremental".  It is
+            cleared when the job starts and gets back the sectors that were
+            not copied if the job fails (json-string, optional)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1171,7 +1267,7 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1197,7 +1293,7 @@ Arguments:
   (json-int)
 - "granularity": granularity of the dirty bitmap, in bytes (json-int, optional)
 - "buf_size": maximum amount of data in flight from source to target, in bytes
-  (json-int, default 10M)
+  (json-int, default 256M)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
   allocated in the topmost image, or "none" to only replicate new I/O
@@ -1206,12 +1302,18 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": "write-blocking" to complete guest writes only once they are
+  written to the target too (MirrorCopyMode, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
 does not define a cluster size, the default value of the granularity
 is 65536.
 
+The job starts with 16 requests and 10M of data in flight, and raises both
+as long as the latency of the target does not grow, up to 256 requests and
+buf_size.
+
 
 Example:
 
@@ -1477,7 +1579,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1503,6 +1605,16 @@ Arguments:
 - "iops_rd_max":  read I/O operations max (json-int)
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
+- "group": throttle group name (json-string, optional)
+- "bps_max_length":  total burst length in seconds (json-int, optional)
+- "bps_rd_max_length":  read burst length in seconds (json-int, optional)
+- "bps_wr_max_length":  write burst length in seconds (json-int, optional)
+- "iops_max_length":  total I/O operations burst length in seconds
+                      (json-int, optional)
+- "iops_rd_max_length":  read I/O operations burst length in seconds
+                         (json-int, optional)
+- "iops_wr_max_length":  write I/O operations burst length in seconds
+                         (json-int, optional)
 
 Example:
 
@@ -1522,6 +1634,40 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up or remove the latency histograms of a block device.  Setting a
+histogram clears its bins.  A histogram without boundaries is removed.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": bin boundaries of all histograms in nano-seconds,
+                positive and strictly ascending (json-array, optional)
+- "boundaries-read": bin boundaries of the read histogram (json-array,
+                     optional)
+- "boundaries-write": bin boundaries of the write histogram (json-array,
+                      optional)
+- "boundaries-flush": bin boundaries of the flush histogram (json-array,
+                      optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1867,6 +2013,13 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "group": throttle group of the device, only present if there are
+                    I/O limits (json-string)
+         - "bps_max_length", "bps_rd_max_length", "bps_wr_max_length",
+           "iops_max_length", "iops_rd_max_length", "iops_wr_max_length":
+           burst lengths in seconds, only present if above 1 (json-int)
+         - "detect_zeroes": detect and optimize zero writing, not present
+                            if detection is off (json-string)
          - "image": the detail of the image, it is a json-object containing
             the following:
              - "filename": image file name (json-string)
@@ -2023,6 +2176,27 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms, only present if set
+      up with block-latency-histogram-set (json-object, optional):
+        - "boundaries": bin boundaries in nano-seconds (json-array)
+        - "bins": requests per bin, counting the total latency
+                  (json-array)
+        - "throttle-bins": requests per bin, counting the time spent
+                           waiting for the I/O limits (json-array)
+        - "backend-bins": requests per bin, counting the time spent in
+                          the block driver (json-array)
+- "cache-stats": A json-array of the image format's metadata caches, each
+                 a json-object containing (json-array, optional):
+    - "name": cache name, e.g. "l2" or "refcount" (json-string)
+    - "size": number of tables the cache can hold (json-int)
+    - "hits": lookups satisfied from the cache (json-int)
+    - "misses": lookups that read the table from the image (json-int)
+- "throttle-levels": current fill levels of the I/O limits, only present
+                     if the device has I/O limits (json-object, optional):
+    - "group": throttle group (json-string)
+    - "bps", "bps_rd", "bps_wr": levels in bytes (json-number)
+    - "iops", "iops_rd", "iops_wr": levels in operations (json-number)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2130,6 +2304,10 @@ Return a json-array. Each CPU is represented by a json-object, which contains:
      "pc" and "npc": sparc (json-int)
      "PC": mips (json-int)
 - "thread_id": ID of the underlying host thread (json-int)
+- "halt-poll-success": number of successful halt polls, only present if
+                       halt polling is enabled (json-int, optional)
+- "halt-poll-fail": number of halt polls that timed out, only present if
+                    halt polling is enabled (json-int, optional)
 
 Example:
 
@@ -2388,6 +2566,12 @@ Return a json-object with the following information:
 
 - "enabled": true if KVM support is enabled, false otherwise (json-bool)
 - "present": true if QEMU has KVM support, false otherwise (json-bool)
+- "msi-route-cache": statistics of the routes that inject MSIs from
+  emulated devices, if KVM lacks KVM_SIGNAL_MSI (json-object, optional)
+  - "routes": number of cached routes (json-int)
+  - "hits": MSIs sent through a cached route (json-int)
+  - "misses": MSIs that needed a new route (json-int)
+  - "evictions": routes evicted to make room for new ones (json-int)
 
 Example:
 
@@ -2442,6 +2626,43 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_status,
     },
 
+SQMP
+query-startup-profile
+---------------------
+
+Show how long each phase of QEMU startup took.
+
+Each phase is represented by a json-object, the returned value is a json-array
+of all phases in the order they completed.
+
+The phase json-object contains the following:
+
+- "name": phase name: "drives", "machine", "roms", "device <id>" for each
+          -device option, and "startup" for everything up to the main loop
+          (json-string)
+- "start": start of the phase in nanoseconds since QEMU started (json-int)
+- "duration": duration of the phase in nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "query-startup-profile" }
+<- { "return": [
+         { "name": "drives", "start": 2374012, "duration": 10837122 },
+         { "name": "machine", "start": 13424801, "duration": 21307562 },
+         { "name": "device net0", "start": 34966022, "duration": 512034 },
+         { "name": "roms", "start": 41338140, "duration": 184317 },
+         { "name": "startup", "start": 0, "duration": 43101992 }
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-startup-profile",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_startup_profile,
+    },
+
 SQMP
 query-mice
 ----------
@@ -2733,7 +2954,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -2746,8 +2968,15 @@ The main json-object contains the following:
 - "downtime": only present when migration has finished correctly
               total amount in ms for downtime that happened (json-int)
 - "expected-downtime": only present while migration is active
-                total amount in ms for downtime that was calculated on
-                the last bitmap round (json-int)
+                total amount in ms for downtime that is expected if the
+                guest was stopped now (json-int)
+- "converging": only present while migration is active
+                false if the remaining data stopped shrinking because the
+                guest dirties memory at least as fast as it is sent
+                (json-bool)
+- "cpu-throttle-percentage": only present while migration is active with
+                the auto-converge capability, percentage of time the
+                vCPUs are kept from running (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -2763,6 +2992,8 @@ The main json-object contains the following:
             pages. This is just normal pages times size of one page,
             but this way upper levels don't need to care about page
             size (json-int)
+         - "postcopy-requests": number of pages the destination requested
+            during post-copy (json-int, optional)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -2778,6 +3009,15 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "compression": only present if the compress capability is active.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages (json-int)
+         - "busy": number of times the migration thread had to wait for
+           a compression thread (json-int)
+         - "compressed-size": number of bytes of compressed page data
+           (json-int)
+         - "compression-rate": uncompressed size of the compressed pages
+           divided by their compressed size (json-number)
 
 Examples:
 
@@ -2938,6 +3178,70 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+Arguments:
+
+- "compress-level": zlib compression level, 1-9 (json-int, optional)
+- "compress-threads": number of compression threads on the source, 1-255
+  (json-int, optional)
+- "decompress-threads": number of decompression threads on the
+  destination, 1-255 (json-int, optional)
+- "channels": number of additional RAM channels of a multichannel
+  migration, 1-16 (json-int, optional)
+- "postcopy-rounds": number of pre-copy rounds before switching to
+  post-copy, 1-255 (json-int, optional)
+- "block-granularity": chunk size of storage migration in bytes, a power
+  of 2 between 4096 and 1048576 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+     { "compress-level": 1, "compress-threads": 8 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,decompress-threads:i?,channels:i?,postcopy-rounds:i?,block-granularity:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "compress-level": zlib compression level (json-int)
+- "compress-threads": number of compression threads (json-int)
+- "decompress-threads": number of decompression threads (json-int)
+- "channels": number of additional RAM channels (json-int)
+- "postcopy-rounds": number of pre-copy rounds before post-copy (json-int)
+- "block-granularity": chunk size of storage migration (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-threads": 8,
+                 "decompress-threads": 2, "channels": 2,
+                 "postcopy-rounds": 2, "block-granularity": 1048576 } }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -3294,4 +3598,201 @@ Example (2):
 
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-vfio-containers",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_vfio_containers,
+    },
+
+SQMP
+query-vfio-containers
+---------------------
+
+Show the VFIO containers and the amount of guest memory they map.
+
+Each container is represented by a json-object, the returned value is a
+json-array of all containers.
+
+Each json-object contains the following:
+
+- "id": container index (json-int)
+- "groups": IOMMU groups attached to the container (json-array of json-int)
+- "mappings": number of mapped IOVA ranges (json-int)
+- "mapped-bytes": total size of the mapped ranges (json-int)
+- "pinned-bytes": bytes of guest RAM pinned by the host (json-int)
+- "superpage-bytes": bytes mapped in hugepage aligned chunks (json-int)
+- "map-calls": DMA map requests issued (json-int)
+- "unmap-calls": DMA unmap requests issued (json-int)
+- "map-ns": time spent in DMA map requests, in nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "query-vfio-containers" }
+<- { "return": [
+         { "id": 0, "groups": [ 12 ], "mappings": 3,
+           "mapped-bytes": 4294967296, "pinned-bytes": 4294836224,
+           "superpage-bytes": 4292870144, "map-calls": 3,
+           "unmap-calls": 0, "map-ns": 912345678 }
+       ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-vfio",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_vfio,
+    },
+
+SQMP
+query-vfio
+----------
+
+Show the assigned VFIO devices and their interrupt statistics.
+
+Each device is represented by a json-object, the returned value is a
+json-array of all devices.
+
+Each json-object contains the following:
+
+- "id": device ID (json-string, optional)
+- "host": host PCI address (json-string)
+- "interrupt": interrupt mode, one of "none", "intx", "msi" or "msix"
+               (json-string)
+- "intx": INTx statistics (json-object)
+  - "kvm-accel": true if the KVM irqfd bypass is active (json-bool)
+  - "user-interrupts": interrupts signaled through QEMU (json-int)
+  - "user-eois": unmasks performed by QEMU (json-int)
+- "msi": MSI and MSI-X statistics (json-object)
+  - "vectors": vectors enabled on the host device (json-int)
+  - "kvm-vectors": vectors injected directly by KVM (json-int)
+  - "user-interrupts": interrupts injected through QEMU (json-int)
+- "bars": trapped access statistics (json-array of json-object)
+  - "bar": BAR number (json-int)
+  - "mmap": true if the BAR is mapped into the guest (json-bool)
+  - "reads", "writes": trapped accesses (json-int)
+  - "read-ns", "write-ns": time spent in trapped accesses, in
+                           nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "query-vfio" }
+<- { "return": [
+         { "id": "hostdev0", "host": "0000:01:00.0", "interrupt": "intx",
+           "intx": { "kvm-accel": true, "user-interrupts": 0,
+                     "user-eois": 0 },
+           "msi": { "vectors": 0, "kvm-vectors": 0, "user-interrupts": 0 },
+           "bars": [ { "bar": 0, "mmap": true, "reads": 12, "writes": 4,
+                       "read-ns": 48211, "write-ns": 9120 } ] }
+       ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-iothreads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
+    },
+
+SQMP
+query-iothreads
+---------------
+
+Returns a list of information about each iothread.
+
+Note this list excludes the QEMU main loop thread, which is not declared
+using the -object iothread command-line option.  It is always the main thread
+of the process.
+
+Return a json-array.  Each iothread is represented by a json-object, which
+contains:
+
+- "id": name of iothread (json-str)
+- "thread-id": ID of the underlying host thread (json-int)
+
+Example:
+
+-> { "execute": "query-iothreads" }
+<- { "return": [
+         {
+            "id":"iothread0",
+            "thread-id":3134
+         },
+         {
+            "id":"iothread1",
+            "thread-id":3135
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-stats",
+        .args_type  = "prefix:s?",
+        .mhandler.cmd_new = qmp_marshal_input_query_stats,
+    },
+
+SQMP
+query-stats
+-----------
+
+Show the performance statistics registered by QEMU's subsystems.
+
+Arguments:
+
+- "prefix": only show the objects whose name starts with this string
+            (json-string, optional)
+
+Return a json-array.  Each object is represented by a json-object, which
+contains:
+
+- "name": name of the object (json-string)
+- "counters": counters of the object (json-array of json-object)
+  - "name": name of the counter (json-string)
+  - "value": value of the counter (json-int)
+- "histograms": histograms of the object (json-array of json-object)
+  - "name": name of the histogram (json-string)
+  - "count": number of values recorded (json-int)
+  - "sum": sum of the values recorded (json-int)
+  - "buckets": number of values in each power-of-two bucket; bucket 0
+               counts zeroes, bucket n the values from 2^(n-1) to
+               2^n - 1 (json-array of json-int)
+
+The following objects are registered:
+
+- "main-loop": "iterations", the "iteration-ns" histogram of the duration
+               of an iteration and the "wait-ns" histogram of the part
+               spent waiting for events and for the global mutex
+- "aio-context/N": "polls" and "bh-runs" of each AioContext, numbered in
+                   creation order; 0 is the one of the main loop
+- "virtio/PATH": "kicks" from the guest, "interrupts" sent to it and
+                 "interrupts-suppressed" by the guest, where PATH is the
+                 QOM path of the device without the leading slash
+- "vhost/N": "mem-table-updates", "mem-table-skipped" and the
+             "log-sync-ns" histogram
+- "tcg": "translations", "flushes", "invalidations" and the "code-bytes"
+         histogram of the size of the translated blocks
+
+Example:
+
+-> { "execute": "query-stats", "arguments": { "prefix": "main-loop" } }
+<- { "return": [
+         { "name": "main-loop",
+           "counters": [ { "name": "iterations", "value": 18204 } ],
+           "histograms": [
+               { "name": "iteration-ns", "count": 18204, "sum": 820325493,
+                 "buckets": [ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 740,
+                              2010, 3650, 4220, 3190, 2004, 1290, 630,
+                              300, 113, 36, 14, 7 ] },
+               { "name": "wait-ns", "count": 18204, "sum": 702118263,
+                 "buckets": [ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 12, 906,
+                              2210, 3813, 4170, 3012, 1884, 1203, 590,
+                              281, 84, 27, 9, 3 ] } ] }
+       ]
+   }
+
 EQMP
@@ -60,6 +60,10 @@ KvmInfo *qmp_query_kvm(Error **errp)
 
     info->enabled = kvm_enabled();
     info->present = kvm_available();
+    if (info->enabled) {
+        info->msi_route_cache = kvm_msi_route_cache_info();
+        info->has_msi_route_cache = info->msi_route_cache != NULL;
+    }
 
     return info;
 }
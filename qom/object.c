@@ -347,12 +347,38 @@ static inline bool object_property_is_link(ObjectProperty *prop)
     return strstart(prop->type, "link<", NULL);
 }
 
+static void object_property_link(Object *obj, ObjectProperty *prop)
+{
+    QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
+    obj->nr_properties++;
+
+    if (obj->property_table) {
+        g_hash_table_insert(obj->property_table, prop->name, prop);
+    } else if (obj->nr_properties > OBJECT_PROPERTY_TABLE_MIN) {
+        /* containers can have hundreds of children, stop walking the list */
+        obj->property_table = g_hash_table_new(g_str_hash, g_str_equal);
+        QTAILQ_FOREACH(prop, &obj->properties, node) {
+            g_hash_table_insert(obj->property_table, prop->name, prop);
+        }
+    }
+}
+
+static void object_property_unlink(Object *obj, ObjectProperty *prop)
+{
+    QTAILQ_REMOVE(&obj->properties, prop, node);
+    obj->nr_properties--;
+
+    if (obj->property_table) {
+        g_hash_table_remove(obj->property_table, prop->name);
+    }
+}
+
 static void object_property_del_all(Object *obj)
 {
     while (!QTAILQ_EMPTY(&obj->properties)) {
         ObjectProperty *prop = QTAILQ_FIRST(&obj->properties);
 
-        QTAILQ_REMOVE(&obj->properties, prop, node);
+        object_property_unlink(obj, prop);
 
         if (prop->release) {
             prop->release(obj, prop->name, prop->opaque);
@@ -362,6 +388,11 @@ static void object_property_del_all(Object *obj)
         g_free(prop->type);
         g_free(prop);
     }
+
+    if (obj->property_table) {
+        g_hash_table_destroy(obj->property_table);
+        obj->property_table = NULL;
+    }
 }
 
 static void object_property_del_child(Object *obj, Object *child, Error **errp)
@@ -458,7 +489,7 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename,
     Object *inst;
 
     for (i = 0; obj && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (obj->class->cast_cache[i] == typename) {
+        if (atomic_read(&obj->class->object_cast_cache[i]) == typename) {
             goto out;
         }
     }
@@ -475,9 +506,10 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename,
 
     if (obj && obj == inst) {
         for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            obj->class->cast_cache[i - 1] = obj->class->cast_cache[i];
+            atomic_set(&obj->class->object_cast_cache[i - 1],
+                       atomic_read(&obj->class->object_cast_cache[i]));
         }
-        obj->class->cast_cache[i - 1] = typename;
+        atomic_set(&obj->class->object_cast_cache[i - 1], typename);
     }
 
 out:
@@ -547,7 +579,7 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
     int i;
 
     for (i = 0; class && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (class->cast_cache[i] == typename) {
+        if (atomic_read(&class->class_cast_cache[i]) == typename) {
             ret = class;
             goto out;
         }
@@ -568,9 +600,10 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
 #ifdef CONFIG_QOM_CAST_DEBUG
     if (class && ret == class) {
         for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            class->cast_cache[i - 1] = class->cast_cache[i];
+            atomic_set(&class->class_cast_cache[i - 1],
+                       atomic_read(&class->class_cast_cache[i]));
         }
-        class->cast_cache[i - 1] = typename;
+        atomic_set(&class->class_cast_cache[i - 1], typename);
     }
 out:
 #endif
@@ -719,13 +752,11 @@ void object_property_add(Object *obj, const char *name, const char *type,
 {
     ObjectProperty *prop;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            error_setg(errp, "attempt to add duplicate property '%s'"
-                       " to object (type '%s')", name,
-                       object_get_typename(obj));
-            return;
-        }
+    if (object_property_find(obj, name, NULL)) {
+        error_setg(errp, "attempt to add duplicate property '%s'"
+                   " to object (type '%s')", name,
+                   object_get_typename(obj));
+        return;
     }
 
     prop = g_malloc0(sizeof(*prop));
@@ -738,7 +769,7 @@ void object_property_add(Object *obj, const char *name, const char *type,
     prop->release = release;
     prop->opaque = opaque;
 
-    QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
+    object_property_link(obj, prop);
 }
 
 ObjectProperty *object_property_find(Object *obj, const char *name,
@@ -746,10 +777,17 @@ ObjectProperty *object_property_find(Object *obj, const char *name,
 {
     ObjectProperty *prop;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
+    if (obj->property_table) {
+        prop = g_hash_table_lookup(obj->property_table, name);
+        if (prop) {
             return prop;
         }
+    } else {
+        QTAILQ_FOREACH(prop, &obj->properties, node) {
+            if (strcmp(prop->name, name) == 0) {
+                return prop;
+            }
+        }
     }
 
     error_set(errp, QERR_PROPERTY_NOT_FOUND, "", name);
@@ -767,7 +805,7 @@ void object_property_del(Object *obj, const char *name, Error **errp)
         prop->release(obj, name, prop->opaque);
     }
 
-    QTAILQ_REMOVE(&obj->properties, prop, node);
+    object_property_unlink(obj, prop);
 
     g_free(prop->name);
     g_free(prop->type);
@@ -1081,6 +1119,28 @@ void object_property_add_link(Object *obj, const char *name,
     g_free(full_type);
 }
 
+gchar *object_get_canonical_path_component(Object *obj)
+{
+    ObjectProperty *prop = NULL;
+
+    g_assert(obj);
+    g_assert(obj->parent != NULL);
+
+    QTAILQ_FOREACH(prop, &obj->parent->properties, node) {
+        if (!object_property_is_child(prop)) {
+            continue;
+        }
+
+        if (prop->opaque == obj) {
+            return g_strdup(prop->name);
+        }
+    }
+
+    /* obj had a parent but was not a child, should never happen */
+    g_assert_not_reached();
+    return NULL;
+}
+
 gchar *object_get_canonical_path(Object *obj)
 {
     Object *root = object_get_root();
@@ -116,7 +116,9 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* Each RAM page takes two iovec entries, its header in buf and the guest
+ * page itself, so this gathers up to 512 pages (2 MB) per writev */
+#define MAX_IOV_SIZE MIN(IOV_MAX, 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -578,7 +580,7 @@ int qemu_file_get_error(QEMUFile *f)
     return f->last_error;
 }
 
-static void qemu_file_set_error(QEMUFile *f, int ret)
+void qemu_file_set_error(QEMUFile *f, int ret)
 {
     if (f->last_error == 0) {
         f->last_error = ret;
@@ -937,6 +939,12 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* Charges @len bytes sent on another channel to the rate limit of @f */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -1937,9 +1945,18 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
+/* Size of the device state sent by the last qemu_savevm_state_complete() */
+static uint64_t device_state_size;
+
+uint64_t qemu_savevm_device_state_size(void)
+{
+    return device_state_size;
+}
+
 void qemu_savevm_state_complete(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t device_state_start;
     int ret;
 
     cpu_synchronize_all_states();
@@ -1966,6 +1983,7 @@ void qemu_savevm_state_complete(QEMUFile *f)
         }
     }
 
+    device_state_start = qemu_ftell(f);
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -1991,6 +2009,7 @@ void qemu_savevm_state_complete(QEMUFile *f)
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
+    device_state_size = qemu_ftell(f) - device_state_start;
 }
 
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
@@ -2355,17 +2374,248 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+static void savevm_create_snapshots(Monitor *mon, BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+static void savevm_fill_snapshot_time(QEMUSnapshotInfo *sn)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+/*
+ * Live snapshots
+ *
+ * RAM is written to the vmstate area from a thread while the guest keeps
+ * running, the same way as migration precopies it.  Once the remaining
+ * dirty memory can be written within the maximum migration downtime, or
+ * the guest dirties memory faster than it can be saved, the VM is stopped
+ * for the final pass and the disk snapshots are taken.
+ */
+#define LIVE_SNAPSHOT_MAX_PASSES 10
+#define LIVE_SNAPSHOT_BANDWIDTH_INTERVAL 100  /* ms */
+
+typedef struct LiveSnapshotState {
+    Monitor *mon;
+    BlockDriverState *bs;
+    QEMUFile *f;
+    QEMUSnapshotInfo sn;
+    QemuThread thread;
+    QEMUBH *bh;
+    Error *blocker;
+    /* set once the snapshot thread holds the iothread lock for good */
+    bool has_lock;
+    bool vm_was_running;
+    int ret;
+} LiveSnapshotState;
+
+static LiveSnapshotState *live_snapshot;
+
+/* The block layer must be called with the iothread lock held */
+static ssize_t live_block_writev_buffer(void *opaque, struct iovec *iov,
+                                        int iovcnt, int64_t pos)
+{
+    LiveSnapshotState *ls = opaque;
+    ssize_t ret;
+
+    if (!ls->has_lock) {
+        qemu_mutex_lock_iothread();
+    }
+    ret = block_writev_buffer(ls->bs, iov, iovcnt, pos);
+    if (!ls->has_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+}
+
+static int live_block_put_buffer(void *opaque, const uint8_t *buf,
+                                 int64_t pos, int size)
+{
+    LiveSnapshotState *ls = opaque;
+
+    if (!ls->has_lock) {
+        qemu_mutex_lock_iothread();
+    }
+    block_put_buffer(ls->bs, buf, pos, size);
+    if (!ls->has_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    return size;
+}
+
+static int live_bdrv_fclose(void *opaque)
+{
+    LiveSnapshotState *ls = opaque;
+
+    return bdrv_fclose(ls->bs);
+}
+
+static const QEMUFileOps bdrv_live_write_ops = {
+    .put_buffer     = live_block_put_buffer,
+    .writev_buffer  = live_block_writev_buffer,
+    .close          = live_bdrv_fclose
+};
+
+static void *live_snapshot_thread(void *opaque)
+{
+    LiveSnapshotState *ls = opaque;
+    QEMUFile *f = ls->f;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    int64_t initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t initial_bytes = 0;
+    uint64_t max_size = 0;
+    uint64_t pending, last_pending = UINT64_MAX;
+    int passes = 0;
+
+    qemu_savevm_state_begin(f, &params);
+
+    while (qemu_file_get_error(f) == 0) {
+        int64_t current_time;
+
+        pending = qemu_savevm_state_pending(f, max_size);
+        if (pending > last_pending) {
+            /* the dirty bitmap was synced, another pass starts */
+            passes++;
+        }
+        last_pending = pending;
+        if (pending <= max_size || passes >= LIVE_SNAPSHOT_MAX_PASSES) {
+            break;
+        }
+        qemu_savevm_state_iterate(f);
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (current_time >= initial_time + LIVE_SNAPSHOT_BANDWIDTH_INTERVAL) {
+            uint64_t transferred = qemu_ftell(f) - initial_bytes;
+            double bandwidth = (double)transferred /
+                               (current_time - initial_time);
+
+            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            initial_time = current_time;
+            initial_bytes = qemu_ftell(f);
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    ls->has_lock = true;
+    ls->vm_was_running = runstate_is_running();
+    ls->ret = vm_stop(RUN_STATE_SAVE_VM);
+    savevm_fill_snapshot_time(&ls->sn);
+    if (ls->ret == 0) {
+        ls->ret = qemu_file_get_error(f);
+    }
+    if (ls->ret == 0) {
+        qemu_savevm_state_complete(f);
+        ls->ret = qemu_file_get_error(f);
+    }
+    if (ls->ret != 0) {
+        qemu_savevm_state_cancel();
+    }
+    qemu_bh_schedule(ls->bh);
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+static void live_snapshot_complete(void *opaque)
+{
+    LiveSnapshotState *ls = opaque;
+    uint64_t vm_state_size;
+
+    qemu_thread_join(&ls->thread);
+    qemu_bh_delete(ls->bh);
+
+    vm_state_size = qemu_ftell(ls->f);
+    qemu_fclose(ls->f);
+    if (ls->ret < 0) {
+        if (ls->mon) {
+            monitor_printf(ls->mon, "Error %d while writing VM\n", ls->ret);
+        } else {
+            error_report("Error %d while writing VM", ls->ret);
+        }
+    } else {
+        savevm_create_snapshots(ls->mon, ls->bs, &ls->sn, vm_state_size);
+    }
+
+    if (ls->vm_was_running) {
+        vm_start();
+    }
+
+    migrate_del_blocker(ls->blocker);
+    error_free(ls->blocker);
+    if (ls->mon) {
+        monitor_resume(ls->mon);
+    }
+    g_free(ls);
+    live_snapshot = NULL;
+}
+
+static void live_snapshot_start(Monitor *mon, BlockDriverState *bs,
+                                QEMUSnapshotInfo *sn)
+{
+    LiveSnapshotState *ls = g_malloc0(sizeof(*ls));
+
+    ls->bs = bs;
+    ls->sn = *sn;
+    ls->f = qemu_fopen_ops(ls, &bdrv_live_write_ops);
+    ls->bh = qemu_bh_new(live_snapshot_complete, ls);
+
+    error_setg(&ls->blocker, "A live snapshot is in progress");
+    migrate_add_blocker(ls->blocker);
+
+    if (monitor_suspend(mon) < 0) {
+        monitor_printf(mon, "terminal does not allow synchronous "
+                       "snapshots, continuing detached\n");
+    } else {
+        ls->mon = mon;
+    }
+
+    live_snapshot = ls;
+    qemu_thread_create(&ls->thread, live_snapshot_thread, ls,
+                       QEMU_THREAD_JOINABLE);
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
-    BlockDriverState *bs, *bs1;
+    BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
     int ret;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
-    qemu_timeval tv;
+    time_t date;
     struct tm tm;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool live = qdict_get_try_bool(qdict, "live", 0);
+
+    if (live_snapshot) {
+        monitor_printf(mon, "A live snapshot is already in progress\n");
+        return;
+    }
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2388,16 +2638,26 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+    if (live) {
+        if (migration_is_active(migrate_get_current())) {
+            monitor_printf(mon, "Live snapshots cannot be taken during "
+                           "migration\n");
+            return;
+        }
+        if (qemu_savevm_state_blocked(NULL)) {
+            monitor_printf(mon, "A device does not support migration\n");
+            return;
+        }
+        saved_vm_running = false;
+    } else {
+        saved_vm_running = runstate_is_running();
+        vm_stop(RUN_STATE_SAVE_VM);
+    }
 
     memset(sn, 0, sizeof(*sn));
 
     /* fill auxiliary fields */
-    qemu_gettimeofday(&tv);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    savevm_fill_snapshot_time(sn);
 
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -2408,8 +2668,8 @@ void do_savevm(Monitor *mon, const QDict *qdict)
             pstrcpy(sn->name, sizeof(sn->name), name);
         }
     } else {
-        /* cast below needed for OpenBSD where tv_sec is still 'long' */
-        localtime_r((const time_t *)&tv.tv_sec, &tm);
+        date = sn->date_sec;
+        localtime_r(&date, &tm);
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
     }
 
@@ -2418,6 +2678,12 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
+    if (live) {
+        /* the times are filled in again when the VM is stopped */
+        live_snapshot_start(mon, bs, sn);
+        return;
+    }
+
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
@@ -2433,19 +2699,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(mon, bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2484,6 +2738,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (live_snapshot) {
+        error_report("A live snapshot is in progress");
+        return -EBUSY;
+    }
+
     bs_vm_state = find_vmstate_bs();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2549,6 +2808,7 @@ int load_vmstate(const char *name)
     ret = qemu_loadvm_state(f);
 
     qemu_fclose(f);
+    migrate_decompress_threads_join();
     if (ret < 0) {
         error_report("Error %d while loading VM state", ret);
         return ret;
@@ -17,7 +17,7 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
@@ -15,22 +15,49 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+static inline int
+somatch(struct socket *so, struct in_addr laddr, u_int lport,
+        const struct in_addr *faddr, u_int fport)
+{
+	return so->so_lport == lport &&
+	       so->so_laddr.s_addr == laddr.s_addr &&
+	       (!faddr || (so->so_faddr.s_addr == faddr->s_addr &&
+			   so->so_fport == fport));
+}
+
+/*
+ * Find the socket of a connection, or with faddr == NULL the socket
+ * bound to laddr:lport whatever the foreign end.
+ *
+ * cache is a table of SO_CACHE_SIZE recently found sockets, hashed on
+ * the guest side of the connection, which is checked before walking
+ * the whole list.  Its entries are only hints, because the addresses of
+ * a socket may change after it was found.
+ */
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
-         struct in_addr faddr, u_int fport)
+solookup(struct socket **cache, struct socket *head,
+         struct in_addr laddr, u_int lport,
+         const struct in_addr *faddr, u_int fport)
 {
+	struct socket **slot;
 	struct socket *so;
+	uint32_t h;
+
+	h = ntohl(laddr.s_addr) * 31 + ntohs(lport);
+	slot = &cache[(h ^ (h >> 8)) & (SO_CACHE_SIZE - 1)];
+	so = *slot;
+	if (so && somatch(so, laddr, lport, faddr, fport))
+		return so;
 
 	for (so = head->so_next; so != head; so = so->so_next) {
-		if (so->so_lport == lport &&
-		    so->so_laddr.s_addr == laddr.s_addr &&
-		    so->so_faddr.s_addr == faddr.s_addr &&
-		    so->so_fport == fport)
+		if (somatch(so, laddr, lport, faddr, fport))
 		   break;
 	}
 
 	if (so == head)
 	   return (struct socket *)NULL;
+	*slot = so;
+	so->so_cache_slot = slot;
 	return so;
 
 }
@@ -68,11 +95,10 @@ sofree(struct socket *so)
 	sofree(so->extra);
 	so->extra=NULL;
   }
-  if (so == slirp->tcp_last_so) {
-      slirp->tcp_last_so = &slirp->tcb;
-  } else if (so == slirp->udp_last_so) {
-      slirp->udp_last_so = &slirp->udb;
-  } else if (so == slirp->icmp_last_so) {
+  if (so->so_cache_slot && *so->so_cache_slot == so) {
+      *so->so_cache_slot = NULL;
+  }
+  if (so == slirp->icmp_last_so) {
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
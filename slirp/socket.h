@@ -17,6 +17,7 @@
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket **so_cache_slot;   /* Last solookup() cache entry */
 
   int s;                           /* The actual socket */
 
@@ -76,7 +77,11 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+/* Number of entries in the solookup() caches, a power of two */
+#define SO_CACHE_SIZE 256
+
+struct socket * solookup(struct socket **, struct socket *, struct in_addr,
+                         u_int, const struct in_addr *, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
 int soread(struct socket *);
@@ -36,6 +36,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* hot TBs are retranslated following direct jumps and calls */
+#define TARGET_HAS_TB_TRACE 1
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE     EM_X86_64
 #else
@@ -894,6 +897,7 @@ typedef struct CPUX86State {
     bool tsc_valid;
     int tsc_khz;
     void *kvm_xsave_buf;
+    struct X86KVMSyncedState *kvm_synced;
 
     /* in order to simplify APIC support, we leave this pointer to the
        user */
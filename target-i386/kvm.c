@@ -75,6 +75,30 @@ static int lm_capable_kernel;
 static bool has_msr_architectural_pmu;
 static uint32_t num_architectural_pmu_counters;
 
+/*
+ * Register groups whose KVM_SET_* ioctl is skipped when QEMU did not
+ * change them.  For each group we keep the buffer that the put function
+ * would pass to KVM, as of the last time the group was read from or
+ * written to KVM.  When the buffer built from CPUX86State is unchanged
+ * and the vCPU has not run since, KVM already holds that state.
+ */
+enum {
+    KVM_SYNCED_REGS,
+    KVM_SYNCED_SREGS,
+    KVM_SYNCED_XSAVE,
+    KVM_SYNCED_XCRS,
+    KVM_SYNCED_DEBUGREGS,
+};
+
+struct X86KVMSyncedState {
+    uint32_t valid;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_debugregs debugregs;
+};
+
 bool kvm_allows_irq0_override(void)
 {
     return !kvm_irqchip_in_kernel() || kvm_has_gsi_routing();
@@ -702,6 +726,7 @@ int kvm_arch_init_vcpu(CPUState *cs)
     if (kvm_has_xsave()) {
         env->kvm_xsave_buf = qemu_memalign(4096, sizeof(struct kvm_xsave));
     }
+    env->kvm_synced = g_new0(struct X86KVMSyncedState, 1);
 
     return 0;
 }
@@ -901,46 +926,83 @@ static void kvm_getput_reg(__u64 *kvm_reg, target_ulong *qemu_reg, int set)
     }
 }
 
-static int kvm_getput_regs(X86CPU *cpu, int set)
+static void kvm_synced_set(CPUX86State *env, int group, void *cache,
+                           const void *buf, size_t size)
+{
+    memcpy(cache, buf, size);
+    env->kvm_synced->valid |= 1 << group;
+}
+
+/* Issue the set @ioctl with @buf, unless KVM already has its contents */
+static int kvm_synced_put(X86CPU *cpu, int group, void *cache,
+                          int ioctl, void *buf, size_t size)
 {
     CPUX86State *env = &cpu->env;
-    struct kvm_regs regs;
-    int ret = 0;
+    int ret;
 
-    if (!set) {
-        ret = kvm_vcpu_ioctl(CPU(cpu), KVM_GET_REGS, &regs);
-        if (ret < 0) {
-            return ret;
-        }
+    if ((env->kvm_synced->valid & (1 << group)) &&
+        !memcmp(cache, buf, size)) {
+        return 0;
+    }
+    ret = kvm_vcpu_ioctl(CPU(cpu), ioctl, buf);
+    if (ret < 0) {
+        env->kvm_synced->valid &= ~(1 << group);
+    } else {
+        kvm_synced_set(env, group, cache, buf, size);
     }
+    return ret;
+}
 
-    kvm_getput_reg(&regs.rax, &env->regs[R_EAX], set);
-    kvm_getput_reg(&regs.rbx, &env->regs[R_EBX], set);
-    kvm_getput_reg(&regs.rcx, &env->regs[R_ECX], set);
-    kvm_getput_reg(&regs.rdx, &env->regs[R_EDX], set);
-    kvm_getput_reg(&regs.rsi, &env->regs[R_ESI], set);
-    kvm_getput_reg(&regs.rdi, &env->regs[R_EDI], set);
-    kvm_getput_reg(&regs.rsp, &env->regs[R_ESP], set);
-    kvm_getput_reg(&regs.rbp, &env->regs[R_EBP], set);
+static void kvm_getput_regs_buf(CPUX86State *env, struct kvm_regs *regs,
+                                int set)
+{
+    kvm_getput_reg(&regs->rax, &env->regs[R_EAX], set);
+    kvm_getput_reg(&regs->rbx, &env->regs[R_EBX], set);
+    kvm_getput_reg(&regs->rcx, &env->regs[R_ECX], set);
+    kvm_getput_reg(&regs->rdx, &env->regs[R_EDX], set);
+    kvm_getput_reg(&regs->rsi, &env->regs[R_ESI], set);
+    kvm_getput_reg(&regs->rdi, &env->regs[R_EDI], set);
+    kvm_getput_reg(&regs->rsp, &env->regs[R_ESP], set);
+    kvm_getput_reg(&regs->rbp, &env->regs[R_EBP], set);
 #ifdef TARGET_X86_64
-    kvm_getput_reg(&regs.r8, &env->regs[8], set);
-    kvm_getput_reg(&regs.r9, &env->regs[9], set);
-    kvm_getput_reg(&regs.r10, &env->regs[10], set);
-    kvm_getput_reg(&regs.r11, &env->regs[11], set);
-    kvm_getput_reg(&regs.r12, &env->regs[12], set);
-    kvm_getput_reg(&regs.r13, &env->regs[13], set);
-    kvm_getput_reg(&regs.r14, &env->regs[14], set);
-    kvm_getput_reg(&regs.r15, &env->regs[15], set);
+    kvm_getput_reg(&regs->r8, &env->regs[8], set);
+    kvm_getput_reg(&regs->r9, &env->regs[9], set);
+    kvm_getput_reg(&regs->r10, &env->regs[10], set);
+    kvm_getput_reg(&regs->r11, &env->regs[11], set);
+    kvm_getput_reg(&regs->r12, &env->regs[12], set);
+    kvm_getput_reg(&regs->r13, &env->regs[13], set);
+    kvm_getput_reg(&regs->r14, &env->regs[14], set);
+    kvm_getput_reg(&regs->r15, &env->regs[15], set);
 #endif
 
-    kvm_getput_reg(&regs.rflags, &env->eflags, set);
-    kvm_getput_reg(&regs.rip, &env->eip, set);
+    kvm_getput_reg(&regs->rflags, &env->eflags, set);
+    kvm_getput_reg(&regs->rip, &env->eip, set);
+}
 
+static int kvm_getput_regs(X86CPU *cpu, int set)
+{
+    CPUX86State *env = &cpu->env;
+    struct kvm_regs regs;
+    int ret;
+
+    memset(&regs, 0, sizeof(regs));
     if (set) {
-        ret = kvm_vcpu_ioctl(CPU(cpu), KVM_SET_REGS, &regs);
+        kvm_getput_regs_buf(env, &regs, 1);
+        return kvm_synced_put(cpu, KVM_SYNCED_REGS, &env->kvm_synced->regs,
+                              KVM_SET_REGS, &regs, sizeof(regs));
     }
 
-    return ret;
+    ret = kvm_vcpu_ioctl(CPU(cpu), KVM_GET_REGS, &regs);
+    if (ret < 0) {
+        return ret;
+    }
+    kvm_getput_regs_buf(env, &regs, 0);
+
+    memset(&regs, 0, sizeof(regs));
+    kvm_getput_regs_buf(env, &regs, 1);
+    kvm_synced_set(env, KVM_SYNCED_REGS, &env->kvm_synced->regs,
+                   &regs, sizeof(regs));
+    return 0;
 }
 
 static int kvm_put_fpu(X86CPU *cpu)
@@ -976,16 +1038,10 @@ static int kvm_put_fpu(X86CPU *cpu)
 #define XSAVE_XSTATE_BV   128
 #define XSAVE_YMMH_SPACE  144
 
-static int kvm_put_xsave(X86CPU *cpu)
+static void kvm_fill_xsave(CPUX86State *env, struct kvm_xsave *xsave)
 {
-    CPUX86State *env = &cpu->env;
-    struct kvm_xsave* xsave = env->kvm_xsave_buf;
     uint16_t cwd, swd, twd;
-    int i, r;
-
-    if (!kvm_has_xsave()) {
-        return kvm_put_fpu(cpu);
-    }
+    int i;
 
     memset(xsave, 0, sizeof(struct kvm_xsave));
     twd = 0;
@@ -1007,8 +1063,29 @@ static int kvm_put_xsave(X86CPU *cpu)
     *(uint64_t *)&xsave->region[XSAVE_XSTATE_BV] = env->xstate_bv;
     memcpy(&xsave->region[XSAVE_YMMH_SPACE], env->ymmh_regs,
             sizeof env->ymmh_regs);
-    r = kvm_vcpu_ioctl(CPU(cpu), KVM_SET_XSAVE, xsave);
-    return r;
+}
+
+static int kvm_put_xsave(X86CPU *cpu)
+{
+    CPUX86State *env = &cpu->env;
+    struct kvm_xsave* xsave = env->kvm_xsave_buf;
+
+    if (!kvm_has_xsave()) {
+        return kvm_put_fpu(cpu);
+    }
+
+    kvm_fill_xsave(env, xsave);
+    return kvm_synced_put(cpu, KVM_SYNCED_XSAVE, &env->kvm_synced->xsave,
+                          KVM_SET_XSAVE, xsave, sizeof(*xsave));
+}
+
+static void kvm_fill_xcrs(CPUX86State *env, struct kvm_xcrs *xcrs)
+{
+    memset(xcrs, 0, sizeof(*xcrs));
+    xcrs->nr_xcrs = 1;
+    xcrs->flags = 0;
+    xcrs->xcrs[0].xcr = 0;
+    xcrs->xcrs[0].value = env->xcr0;
 }
 
 static int kvm_put_xcrs(X86CPU *cpu)
@@ -1020,19 +1097,16 @@ static int kvm_put_xcrs(X86CPU *cpu)
         return 0;
     }
 
-    xcrs.nr_xcrs = 1;
-    xcrs.flags = 0;
-    xcrs.xcrs[0].xcr = 0;
-    xcrs.xcrs[0].value = env->xcr0;
-    return kvm_vcpu_ioctl(CPU(cpu), KVM_SET_XCRS, &xcrs);
+    kvm_fill_xcrs(env, &xcrs);
+    return kvm_synced_put(cpu, KVM_SYNCED_XCRS, &env->kvm_synced->xcrs,
+                          KVM_SET_XCRS, &xcrs, sizeof(xcrs));
 }
 
-static int kvm_put_sregs(X86CPU *cpu)
+static void kvm_fill_sregs(CPUX86State *env, struct kvm_sregs *p)
 {
-    CPUX86State *env = &cpu->env;
     struct kvm_sregs sregs;
 
-    memset(sregs.interrupt_bitmap, 0, sizeof(sregs.interrupt_bitmap));
+    memset(&sregs, 0, sizeof(sregs));
     if (env->interrupt_injected >= 0) {
         sregs.interrupt_bitmap[env->interrupt_injected / 64] |=
                 (uint64_t)1 << (env->interrupt_injected % 64);
@@ -1073,8 +1147,17 @@ static int kvm_put_sregs(X86CPU *cpu)
     sregs.apic_base = cpu_get_apic_base(env->apic_state);
 
     sregs.efer = env->efer;
+    *p = sregs;
+}
+
+static int kvm_put_sregs(X86CPU *cpu)
+{
+    CPUX86State *env = &cpu->env;
+    struct kvm_sregs sregs;
 
-    return kvm_vcpu_ioctl(CPU(cpu), KVM_SET_SREGS, &sregs);
+    kvm_fill_sregs(env, &sregs);
+    return kvm_synced_put(cpu, KVM_SYNCED_SREGS, &env->kvm_synced->sregs,
+                          KVM_SET_SREGS, &sregs, sizeof(sregs));
 }
 
 static void kvm_msr_entry_set(struct kvm_msr_entry *entry,
@@ -1289,6 +1372,10 @@ static int kvm_get_xsave(X86CPU *cpu)
     env->xstate_bv = *(uint64_t *)&xsave->region[XSAVE_XSTATE_BV];
     memcpy(env->ymmh_regs, &xsave->region[XSAVE_YMMH_SPACE],
             sizeof env->ymmh_regs);
+
+    kvm_fill_xsave(env, xsave);
+    kvm_synced_set(env, KVM_SYNCED_XSAVE, &env->kvm_synced->xsave,
+                   xsave, sizeof(*xsave));
     return 0;
 }
 
@@ -1314,6 +1401,10 @@ static int kvm_get_xcrs(X86CPU *cpu)
             break;
         }
     }
+
+    kvm_fill_xcrs(env, &xcrs);
+    kvm_synced_set(env, KVM_SYNCED_XCRS, &env->kvm_synced->xcrs,
+                   &xcrs, sizeof(xcrs));
     return 0;
 }
 
@@ -1399,6 +1490,9 @@ static int kvm_get_sregs(X86CPU *cpu)
     }
     env->hflags = (env->hflags & HFLAG_COPY_MASK) | hflags;
 
+    kvm_fill_sregs(env, &sregs);
+    kvm_synced_set(env, KVM_SYNCED_SREGS, &env->kvm_synced->sregs,
+                   &sregs, sizeof(sregs));
     return 0;
 }
 
@@ -1751,24 +1845,33 @@ static int kvm_guest_debug_workarounds(X86CPU *cpu)
     return ret;
 }
 
+static void kvm_fill_debugregs(CPUX86State *env,
+                               struct kvm_debugregs *dbgregs)
+{
+    int i;
+
+    memset(dbgregs, 0, sizeof(*dbgregs));
+    for (i = 0; i < 4; i++) {
+        dbgregs->db[i] = env->dr[i];
+    }
+    dbgregs->dr6 = env->dr[6];
+    dbgregs->dr7 = env->dr[7];
+    dbgregs->flags = 0;
+}
+
 static int kvm_put_debugregs(X86CPU *cpu)
 {
     CPUX86State *env = &cpu->env;
     struct kvm_debugregs dbgregs;
-    int i;
 
     if (!kvm_has_debugregs()) {
         return 0;
     }
 
-    for (i = 0; i < 4; i++) {
-        dbgregs.db[i] = env->dr[i];
-    }
-    dbgregs.dr6 = env->dr[6];
-    dbgregs.dr7 = env->dr[7];
-    dbgregs.flags = 0;
-
-    return kvm_vcpu_ioctl(CPU(cpu), KVM_SET_DEBUGREGS, &dbgregs);
+    kvm_fill_debugregs(env, &dbgregs);
+    return kvm_synced_put(cpu, KVM_SYNCED_DEBUGREGS,
+                          &env->kvm_synced->debugregs,
+                          KVM_SET_DEBUGREGS, &dbgregs, sizeof(dbgregs));
 }
 
 static int kvm_get_debugregs(X86CPU *cpu)
@@ -1791,6 +1894,9 @@ static int kvm_get_debugregs(X86CPU *cpu)
     env->dr[4] = env->dr[6] = dbgregs.dr6;
     env->dr[5] = env->dr[7] = dbgregs.dr7;
 
+    kvm_fill_debugregs(env, &dbgregs);
+    kvm_synced_set(env, KVM_SYNCED_DEBUGREGS, &env->kvm_synced->debugregs,
+                   &dbgregs, sizeof(dbgregs));
     return 0;
 }
 
@@ -1910,6 +2016,9 @@ void kvm_arch_pre_run(CPUState *cpu, struct kvm_run *run)
     CPUX86State *env = &x86_cpu->env;
     int ret;
 
+    /* the state in KVM changes once the vCPU runs */
+    env->kvm_synced->valid = 0;
+
     /* Inject NMI */
     if (cpu->interrupt_request & CPU_INTERRUPT_NMI) {
         cpu->interrupt_request &= ~CPU_INTERRUPT_NMI;
@@ -2846,6 +2846,25 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* When retranslating a hot TB as a superblock (CF_TRACE), a direct jump
+   forward is not translated: decoding continues at the target, so that
+   the optimizer sees both sides.  Skipped bytes stay inside tb->size, so
+   self-modifying code detection is not affected, and the target must be
+   close enough for the TB to still span at most two pages.  */
+static bool gen_trace_jmp(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = eip + s->cs_base;
+
+    if (!(s->tb->cflags & CF_TRACE) || !s->jmp_opt) {
+        return false;
+    }
+    if (pc < s->pc || pc - s->tb->pc >= TARGET_PAGE_SIZE - 32) {
+        return false;
+    }
+    s->pc = pc;
+    return true;
+}
+
 static inline void gen_ldq_env_A0(int idx, int offset)
 {
     int mem_index = (idx >> 2) - 1;
@@ -3236,6 +3255,78 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+static void gen_pandn_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, b, a);
+}
+
+/* Integer add/sub and logic operations on MMX and SSE registers are
+   expanded inline, 64 bits at a time, instead of calling the helpers
+   of ops_sse.h.  Return false if B is not one of them.  */
+static bool gen_sse_vec_op(int b, int op1_offset, int op2_offset, int oprsz)
+{
+    void (*fn)(TCGv_i64, TCGv_i64, TCGv_i64);
+    TCGv_i64 t0, t1;
+    int i;
+
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        fn = tcg_gen_and_i64;
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        fn = gen_pandn_i64;
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        fn = tcg_gen_or_i64;
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        fn = tcg_gen_xor_i64;
+        break;
+    case 0xfc: /* paddb */
+        fn = tcg_gen_vec_add8_i64;
+        break;
+    case 0xfd: /* paddw */
+        fn = tcg_gen_vec_add16_i64;
+        break;
+    case 0xfe: /* paddl */
+        fn = tcg_gen_vec_add32_i64;
+        break;
+    case 0xd4: /* paddq */
+        fn = tcg_gen_add_i64;
+        break;
+    case 0xf8: /* psubb */
+        fn = tcg_gen_vec_sub8_i64;
+        break;
+    case 0xf9: /* psubw */
+        fn = tcg_gen_vec_sub16_i64;
+        break;
+    case 0xfa: /* psubl */
+        fn = tcg_gen_vec_sub32_i64;
+        break;
+    case 0xfb: /* psubq */
+        fn = tcg_gen_sub_i64;
+        break;
+    default:
+        return false;
+    }
+
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, cpu_env, op1_offset + i);
+        tcg_gen_ld_i64(t1, cpu_env, op2_offset + i);
+        fn(t0, t0, t1);
+        tcg_gen_st_i64(t0, cpu_env, op1_offset + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4652,6 +4743,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_vec_op(b, op1_offset, op2_offset, is_xmm ? 16 : 8)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -6834,7 +6928,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            if (!gen_trace_jmp(s, tval)) {
+                gen_jmp(s, tval);
+            }
         }
         break;
     case 0x9a: /* lcall im */
@@ -6861,7 +6957,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        if (!gen_trace_jmp(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0xea: /* ljmp im */
         {
@@ -6882,7 +6980,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        if (!gen_trace_jmp(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, OT_BYTE);
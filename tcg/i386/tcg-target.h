@@ -137,6 +137,9 @@ typedef enum {
      ((ofs) == 0 && (len) == 16))
 #define TCG_TARGET_deposit_i64_valid    TCG_TARGET_deposit_i32_valid
 
+/* tcg_out_tlb_load reads the TLB size and address from env.  */
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
+
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
 #else
@@ -51,10 +51,90 @@ struct tcg_temp_info {
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* Known contents of CPU state fields, as written by st_i32/st_i64 or read
+   by ld_i32/ld_i64 relative to env within the current basic block.  An
+   entry says that the field at OFFSET holds the value of TEMP.  */
+struct tcg_mem_info {
+    tcg_target_long offset;
+    TCGArg temp;
+    int size;
+};
+
+#define TCG_MAX_MEM_INFO 16
+
+static struct tcg_mem_info mem_info[TCG_MAX_MEM_INFO];
+static int nb_mem_info;
+
+static void reset_all_mem_info(void)
+{
+    nb_mem_info = 0;
+}
+
+static void remove_mem_info(int i)
+{
+    mem_info[i] = mem_info[--nb_mem_info];
+}
+
+/* Forget the fields that overlap [OFFSET, OFFSET + SIZE).  */
+static void reset_mem_range(tcg_target_long offset, int size)
+{
+    int i = 0;
+
+    while (i < nb_mem_info) {
+        if (mem_info[i].offset < offset + size &&
+            offset < mem_info[i].offset + mem_info[i].size) {
+            remove_mem_info(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+static void record_mem_info(tcg_target_long offset, int size, TCGArg temp)
+{
+    reset_mem_range(offset, size);
+    if (nb_mem_info == TCG_MAX_MEM_INFO) {
+        remove_mem_info(0);
+    }
+    mem_info[nb_mem_info].offset = offset;
+    mem_info[nb_mem_info].size = size;
+    mem_info[nb_mem_info].temp = temp;
+    nb_mem_info++;
+}
+
+static struct tcg_mem_info *find_mem_info(tcg_target_long offset, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_mem_info; i++) {
+        if (mem_info[i].offset == offset && mem_info[i].size == size) {
+            return &mem_info[i];
+        }
+    }
+    return NULL;
+}
+
+static bool is_env(TCGContext *s, TCGArg temp)
+{
+    return s->temps[temp].fixed_reg && s->temps[temp].reg == TCG_AREG0;
+}
+
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
 static void reset_temp(TCGArg temp)
 {
+    int i = 0;
+
+    /* TEMP is about to get a new value; fields it was stored to do not
+       hold it anymore.  */
+    while (i < nb_mem_info) {
+        if (mem_info[i].temp == temp) {
+            remove_mem_info(i);
+        } else {
+            i++;
+        }
+    }
+
     if (temps[temp].state == TCG_TEMP_COPY) {
         if (temps[temp].prev_copy == temps[temp].next_copy) {
             temps[temps[temp].next_copy].state = TCG_TEMP_UNDEF;
@@ -71,6 +151,8 @@ static void reset_temp(TCGArg temp)
 static void reset_all_temps(int nb_temps)
 {
     int i;
+
+    reset_all_mem_info();
     for (i = 0; i < nb_temps; i++) {
         temps[i].state = TCG_TEMP_UNDEF;
         temps[i].mask = -1;
@@ -518,6 +600,7 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     const TCGOpDef *def;
     TCGArg *gen_args;
     TCGArg tmp;
+    struct tcg_mem_info *mi;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
@@ -1108,8 +1191,76 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             args += 6;
             break;
 
+        CASE_OP_32_64(ld):
+            /* A load from a CPU state field whose value is already in a
+               temp becomes a move.  */
+            if (!is_env(s, args[1])) {
+                goto do_default;
+            }
+            mi = find_mem_info(args[2], op_bits(op) / 8);
+            if (mi) {
+                tmp = mi->temp;
+                if (temps_are_copies(args[0], tmp)) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else if (temps[tmp].state == TCG_TEMP_CONST) {
+                    s->gen_opc_buf[op_index] = op_to_movi(op);
+                    tcg_opt_gen_movi(gen_args, args[0], temps[tmp].val);
+                    gen_args += 2;
+                } else {
+                    s->gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], tmp);
+                    gen_args += 2;
+                }
+                args += 3;
+                break;
+            }
+            reset_temp(args[0]);
+            record_mem_info(args[2], op_bits(op) / 8, args[0]);
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args[2] = args[2];
+            args += 3;
+            gen_args += 3;
+            break;
+
+        CASE_OP_32_64(st):
+            /* Drop stores of the value that the field already holds.  */
+            if (!is_env(s, args[1])) {
+                reset_all_mem_info();
+                goto do_default;
+            }
+            mi = find_mem_info(args[2], op_bits(op) / 8);
+            if (mi && (temps_are_copies(mi->temp, args[0])
+                       || (temps[mi->temp].state == TCG_TEMP_CONST
+                           && temps[args[0]].state == TCG_TEMP_CONST
+                           && temps[mi->temp].val == temps[args[0]].val))) {
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+                args += 3;
+                break;
+            }
+            record_mem_info(args[2], op_bits(op) / 8, args[0]);
+            goto do_default;
+
+        CASE_OP_32_64(st8):
+        CASE_OP_32_64(st16):
+        case INDEX_op_st32_i64:
+            if (!is_env(s, args[1])) {
+                reset_all_mem_info();
+            } else if (op == INDEX_op_st32_i64) {
+                reset_mem_range(args[2], 4);
+            } else if (op == INDEX_op_st8_i32 || op == INDEX_op_st8_i64) {
+                reset_mem_range(args[2], 1);
+            } else {
+                reset_mem_range(args[2], 2);
+            }
+            goto do_default;
+
         case INDEX_op_call:
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
+            /* Helpers can write to any field of the CPU state.  */
+            if (!(args[nb_call_args + 1] & TCG_CALL_NO_SIDE_EFFECTS)) {
+                reset_all_mem_info();
+            }
             if (!(args[nb_call_args + 1] & (TCG_CALL_NO_READ_GLOBALS |
                                             TCG_CALL_NO_WRITE_GLOBALS))) {
                 for (i = 0; i < nb_globals; i++) {
@@ -1138,6 +1289,11 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             if (def->flags & TCG_OPF_BB_END) {
                 reset_all_temps(nb_temps);
             } else {
+                /* Guest memory accesses can end up in tlb_fill, which may
+                   change the CPU state.  */
+                if (def->flags & TCG_OPF_SIDE_EFFECTS) {
+                    reset_all_mem_info();
+                }
                 for (i = 0; i < def->nb_oargs; i++) {
                     reset_temp(args[i]);
                 }
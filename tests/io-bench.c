@@ -0,0 +1,271 @@
+/*
+ * Device I/O microbenchmarks
+ *
+ * Drives emulated devices through qtest, keeping a fixed number of
+ * requests in flight against backends that do no actual I/O, and prints
+ * one JSON object per benchmark with the throughput and the latency
+ * percentiles.  The numbers include the qtest protocol overhead, so they
+ * are only meaningful in comparison with other runs on the same host.
+ *
+ * The environment variables QTEST_BENCH_QUEUE_DEPTH and QTEST_BENCH_OPS
+ * override the number of requests in flight and the number of requests.
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/virtio-pci.h"
+
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+
+#define BENCH_PCI_SLOT          4
+#define BENCH_QUEUE_DEPTH       32
+#define BENCH_OPS               10000
+#define BENCH_TIMEOUT_NS        (10 * 1000000000LL)
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_BLOCK_SIZE   4096
+
+#define VIRTIO_NET_HDR_SIZE     10
+#define VIRTIO_NET_FRAME_SIZE   1514
+#define VIRTIO_NET_TX_QUEUE     1
+
+#define BENCH_MAX_BUFS          3
+
+typedef struct BenchSlot {
+    QVirtioBuf bufs[BENCH_MAX_BUFS];
+    int nbufs;
+    int64_t start;
+} BenchSlot;
+
+typedef struct Bench {
+    const char *device;
+    const char *op;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    BenchSlot *slots;
+    int queue_depth;
+} Bench;
+
+static int64_t bench_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_param(const char *name, int def)
+{
+    const char *value = getenv(name);
+
+    return value ? atoi(value) : def;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const int64_t *sorted, int n, int p)
+{
+    return sorted[(int64_t)(n - 1) * p / 100];
+}
+
+static void bench_report(Bench *b, int64_t *latency, int n, int64_t elapsed)
+{
+    qsort(latency, n, sizeof(*latency), cmp_int64);
+    printf("{\"device\": \"%s\", \"op\": \"%s\", \"queue_depth\": %d, "
+           "\"ops\": %d, \"ops_per_sec\": %.1f, \"latency_ns\": "
+           "{\"min\": %" PRId64 ", \"p50\": %" PRId64 ", \"p90\": %" PRId64
+           ", \"p99\": %" PRId64 ", \"max\": %" PRId64 "}}\n",
+           b->device, b->op, b->queue_depth, n, n * 1e9 / elapsed,
+           latency[0], percentile(latency, n, 50),
+           percentile(latency, n, 90), percentile(latency, n, 99),
+           latency[n - 1]);
+    fflush(stdout);
+}
+
+/* Allocate the request slots, limited by the number of descriptors */
+static void bench_init_slots(Bench *b, int nbufs)
+{
+    b->queue_depth = bench_param("QTEST_BENCH_QUEUE_DEPTH",
+                                 BENCH_QUEUE_DEPTH);
+    b->queue_depth = MAX(1, MIN(b->queue_depth, b->vq->size / nbufs));
+    b->slots = g_new0(BenchSlot, b->queue_depth);
+}
+
+static void bench_run(Bench *b)
+{
+    int ops = bench_param("QTEST_BENCH_OPS", BENCH_OPS);
+    int *head_slot = g_new(int, b->vq->size);
+    int64_t *latency = g_new(int64_t, ops);
+    int64_t start, now, progress;
+    int submitted = 0, done = 0;
+    bool kick;
+    uint16_t head;
+    uint32_t len;
+    int i;
+
+    start = progress = bench_clock_ns();
+    for (i = 0; i < b->queue_depth && submitted < ops; i++, submitted++) {
+        b->slots[i].start = bench_clock_ns();
+        head = qvirtqueue_add(b->vq, b->slots[i].bufs, b->slots[i].nbufs);
+        head_slot[head] = i;
+    }
+    qvirtqueue_kick(b->dev, b->vq);
+
+    while (done < ops) {
+        kick = false;
+        while (qvirtqueue_get_used(b->vq, &head, &len)) {
+            i = head_slot[head];
+            progress = now = bench_clock_ns();
+            latency[done++] = now - b->slots[i].start;
+            if (submitted < ops) {
+                b->slots[i].start = now;
+                head = qvirtqueue_add(b->vq, b->slots[i].bufs,
+                                      b->slots[i].nbufs);
+                head_slot[head] = i;
+                submitted++;
+                kick = true;
+            }
+        }
+        if (kick) {
+            qvirtqueue_kick(b->dev, b->vq);
+        }
+        g_assert_cmpint(bench_clock_ns() - progress, <, BENCH_TIMEOUT_NS);
+    }
+
+    bench_report(b, latency, ops, bench_clock_ns() - start);
+    g_free(latency);
+    g_free(head_slot);
+}
+
+static QVirtioPCIDevice *bench_virtio_init(const char *args)
+{
+    QVirtioPCIDevice *d;
+
+    qtest_start(args);
+    d = qvirtio_pci_init(qpci_init_pc(), QPCI_DEVFN(BENCH_PCI_SLOT, 0));
+    qvirtio_pci_set_features(d, 0);
+    return d;
+}
+
+static void bench_virtio_blk(const char *op, uint32_t type)
+{
+    QGuestAllocator *alloc;
+    Bench b = { .device = "virtio-blk", .op = op };
+    uint8_t hdr[16];
+    uint64_t addr;
+    int i;
+
+    b.dev = bench_virtio_init("-drive if=none,id=drive0,file=null-co://,"
+                              "format=raw "
+                              "-device virtio-blk-pci,drive=drive0,addr=04.0");
+    alloc = pc_alloc_init();
+    b.vq = qvirtqueue_setup(b.dev, alloc, 0);
+    qvirtio_pci_set_status(b.dev, QVIRTIO_STATUS_ACKNOWLEDGE |
+                                  QVIRTIO_STATUS_DRIVER |
+                                  QVIRTIO_STATUS_DRIVER_OK);
+
+    bench_init_slots(&b, 3);
+    for (i = 0; i < b.queue_depth; i++) {
+        /* header and status in the first page, data in the second */
+        addr = guest_alloc(alloc, 2 * VIRTIO_BLK_BLOCK_SIZE);
+        stl_le_p(hdr, type);
+        stl_le_p(hdr + 4, 0);
+        stq_le_p(hdr + 8, (uint64_t)i * (VIRTIO_BLK_BLOCK_SIZE / 512));
+        memwrite(addr, hdr, sizeof(hdr));
+
+        b.slots[i].bufs[0] = (QVirtioBuf) { addr, sizeof(hdr), false };
+        b.slots[i].bufs[1] = (QVirtioBuf) {
+            addr + VIRTIO_BLK_BLOCK_SIZE, VIRTIO_BLK_BLOCK_SIZE,
+            type == VIRTIO_BLK_T_IN
+        };
+        b.slots[i].bufs[2] = (QVirtioBuf) { addr + sizeof(hdr), 1, true };
+        b.slots[i].nbufs = 3;
+    }
+
+    bench_run(&b);
+    qtest_end();
+}
+
+static void bench_virtio_blk_read(void)
+{
+    bench_virtio_blk("read", VIRTIO_BLK_T_IN);
+}
+
+static void bench_virtio_blk_write(void)
+{
+    bench_virtio_blk("write", VIRTIO_BLK_T_OUT);
+}
+
+static void bench_virtio_net_tx(void)
+{
+    QGuestAllocator *alloc;
+    Bench b = { .device = "virtio-net", .op = "tx" };
+    uint8_t frame[VIRTIO_NET_FRAME_SIZE];
+    uint64_t addr;
+    int i;
+
+    /* a hub port with no other port drops everything it is sent */
+    b.dev = bench_virtio_init("-netdev hubport,id=net0,hubid=0 "
+                              "-device virtio-net-pci,netdev=net0,addr=04.0");
+    alloc = pc_alloc_init();
+    b.vq = qvirtqueue_setup(b.dev, alloc, VIRTIO_NET_TX_QUEUE);
+    qvirtio_pci_set_status(b.dev, QVIRTIO_STATUS_ACKNOWLEDGE |
+                                  QVIRTIO_STATUS_DRIVER |
+                                  QVIRTIO_STATUS_DRIVER_OK);
+
+    /* broadcast frame; the virtio-net header is left zeroed */
+    memset(frame, 0, sizeof(frame));
+    memset(frame, 0xff, 6);
+    frame[12] = 0x08;
+
+    bench_init_slots(&b, 2);
+    for (i = 0; i < b.queue_depth; i++) {
+        addr = guest_alloc(alloc, VIRTIO_NET_HDR_SIZE + sizeof(frame));
+        memwrite(addr + VIRTIO_NET_HDR_SIZE, frame, sizeof(frame));
+
+        b.slots[i].bufs[0] = (QVirtioBuf) {
+            addr, VIRTIO_NET_HDR_SIZE, false
+        };
+        b.slots[i].bufs[1] = (QVirtioBuf) {
+            addr + VIRTIO_NET_HDR_SIZE, sizeof(frame), false
+        };
+        b.slots[i].nbufs = 2;
+    }
+
+    bench_run(&b);
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_func("/bench/virtio-blk/read", bench_virtio_blk_read);
+        qtest_add_func("/bench/virtio-blk/write", bench_virtio_blk_write);
+        qtest_add_func("/bench/virtio-net/tx", bench_virtio_net_tx);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,164 @@
+/*
+ * libqos driver for legacy virtio PCI devices
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "libqtest.h"
+#include "libqos/virtio-pci.h"
+
+#include "hw/pci/pci_regs.h"
+
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+
+QVirtioPCIDevice *qvirtio_pci_init(QPCIBus *bus, int devfn)
+{
+    QVirtioPCIDevice *d = g_new0(QVirtioPCIDevice, 1);
+
+    d->pdev = qpci_device_find(bus, devfn);
+    g_assert(d->pdev != NULL);
+    g_assert_cmphex(qpci_config_readw(d->pdev, PCI_VENDOR_ID), ==,
+                    QVIRTIO_PCI_VENDOR_ID);
+
+    d->addr = qpci_iomap(d->pdev, 0);
+    g_assert(d->addr != NULL);
+    qpci_device_enable(d->pdev);
+
+    qvirtio_pci_set_status(d, 0);
+    qvirtio_pci_set_status(d, QVIRTIO_STATUS_ACKNOWLEDGE |
+                              QVIRTIO_STATUS_DRIVER);
+    return d;
+}
+
+void qvirtio_pci_set_status(QVirtioPCIDevice *d, uint8_t status)
+{
+    qpci_io_writeb(d->pdev, d->addr + QVIRTIO_PCI_STATUS, status);
+}
+
+uint32_t qvirtio_pci_get_features(QVirtioPCIDevice *d)
+{
+    return qpci_io_readl(d->pdev, d->addr + QVIRTIO_PCI_HOST_FEATURES);
+}
+
+void qvirtio_pci_set_features(QVirtioPCIDevice *d, uint32_t features)
+{
+    qpci_io_writel(d->pdev, d->addr + QVIRTIO_PCI_GUEST_FEATURES, features);
+}
+
+void qvirtio_pci_free(QVirtioPCIDevice *d)
+{
+    qpci_iounmap(d->pdev, d->addr);
+    g_free(d->pdev);
+    g_free(d);
+}
+
+QVirtQueue *qvirtqueue_setup(QVirtioPCIDevice *d, QGuestAllocator *alloc,
+                             uint16_t index)
+{
+    QVirtQueue *vq = g_new0(QVirtQueue, 1);
+    uint64_t used_offset, size;
+    void *zero;
+    int i;
+
+    qpci_io_writew(d->pdev, d->addr + QVIRTIO_PCI_QUEUE_SEL, index);
+    vq->index = index;
+    vq->size = qpci_io_readw(d->pdev, d->addr + QVIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vq->size, >, 0);
+
+    /* descriptors, avail ring, then the used ring on the next page */
+    used_offset = ROUND_UP(16 * vq->size + 2 * (3 + vq->size),
+                           QVIRTIO_PCI_VRING_ALIGN);
+    size = used_offset + 2 * 3 + 8 * vq->size;
+    vq->desc = guest_alloc(alloc, size);
+    vq->avail = vq->desc + 16 * vq->size;
+    vq->used = vq->desc + used_offset;
+
+    zero = g_malloc0(size);
+    memwrite(vq->desc, zero, size);
+    g_free(zero);
+
+    vq->desc_next = g_new(uint16_t, vq->size);
+    vq->chain_num = g_new0(uint16_t, vq->size);
+    for (i = 0; i < vq->size; i++) {
+        vq->desc_next[i] = i + 1;
+    }
+    vq->num_free = vq->size;
+
+    qpci_io_writel(d->pdev, d->addr + QVIRTIO_PCI_QUEUE_PFN,
+                   vq->desc / QVIRTIO_PCI_VRING_ALIGN);
+    return vq;
+}
+
+/* Queue a request made of n buffers, and return its head descriptor.  The
+ * device does not see it until qvirtqueue_kick().
+ */
+int qvirtqueue_add(QVirtQueue *vq, const QVirtioBuf *bufs, int n)
+{
+    uint8_t desc[16];
+    uint16_t head, idx;
+    int i;
+
+    g_assert_cmpint(n, >, 0);
+    g_assert_cmpint(n, <=, vq->num_free);
+
+    head = idx = vq->free_head;
+    for (i = 0; i < n; i++) {
+        stq_le_p(desc, bufs[i].addr);
+        stl_le_p(desc + 8, bufs[i].len);
+        stw_le_p(desc + 12, (bufs[i].write ? QVRING_DESC_F_WRITE : 0) |
+                            (i + 1 < n ? QVRING_DESC_F_NEXT : 0));
+        stw_le_p(desc + 14, i + 1 < n ? vq->desc_next[idx] : 0);
+        memwrite(vq->desc + 16 * idx, desc, sizeof(desc));
+        idx = vq->desc_next[idx];
+    }
+    vq->free_head = idx;
+    vq->num_free -= n;
+    vq->chain_num[head] = n;
+
+    writew(vq->avail + 4 + 2 * (vq->avail_idx % vq->size), head);
+    vq->avail_idx++;
+    return head;
+}
+
+void qvirtqueue_kick(QVirtioPCIDevice *d, QVirtQueue *vq)
+{
+    writew(vq->avail + 2, vq->avail_idx);
+    qpci_io_writew(d->pdev, d->addr + QVIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+}
+
+/* Return the next request completed by the device, if any, and free its
+ * descriptors.
+ */
+bool qvirtqueue_get_used(QVirtQueue *vq, uint16_t *head, uint32_t *len)
+{
+    uint64_t elem;
+    uint16_t idx;
+    int i;
+
+    if (readw(vq->used + 2) == vq->last_used_idx) {
+        return false;
+    }
+
+    elem = vq->used + 4 + 8 * (vq->last_used_idx % vq->size);
+    *head = readl(elem);
+    *len = readl(elem + 4);
+    vq->last_used_idx++;
+
+    g_assert_cmpint(*head, <, vq->size);
+    g_assert_cmpint(vq->chain_num[*head], >, 0);
+    for (i = 1, idx = *head; i < vq->chain_num[*head]; i++) {
+        idx = vq->desc_next[idx];
+    }
+    vq->desc_next[idx] = vq->free_head;
+    vq->free_head = *head;
+    vq->num_free += vq->chain_num[*head];
+    vq->chain_num[*head] = 0;
+    return true;
+}
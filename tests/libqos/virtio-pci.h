@@ -0,0 +1,78 @@
+/*
+ * libqos driver for legacy virtio PCI devices
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_PCI_H
+#define LIBQOS_VIRTIO_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libqos/pci.h"
+#include "libqos/malloc.h"
+
+#define QVIRTIO_PCI_VENDOR_ID           0x1af4
+
+#define QVIRTIO_PCI_HOST_FEATURES       0
+#define QVIRTIO_PCI_GUEST_FEATURES      4
+#define QVIRTIO_PCI_QUEUE_PFN           8
+#define QVIRTIO_PCI_QUEUE_NUM           12
+#define QVIRTIO_PCI_QUEUE_SEL           14
+#define QVIRTIO_PCI_QUEUE_NOTIFY        16
+#define QVIRTIO_PCI_STATUS              18
+#define QVIRTIO_PCI_ISR                 19
+#define QVIRTIO_PCI_DEVICE_CONFIG       20  /* without MSI-X */
+
+#define QVIRTIO_STATUS_ACKNOWLEDGE      1
+#define QVIRTIO_STATUS_DRIVER           2
+#define QVIRTIO_STATUS_DRIVER_OK        4
+
+#define QVRING_DESC_F_NEXT              1
+#define QVRING_DESC_F_WRITE             2
+
+#define QVIRTIO_PCI_VRING_ALIGN         4096
+
+typedef struct QVirtioPCIDevice {
+    QPCIDevice *pdev;
+    void *addr;
+} QVirtioPCIDevice;
+
+typedef struct QVirtQueue {
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t index;
+    uint16_t size;
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+    uint16_t *desc_next;        /* free list and chains, by descriptor */
+    uint16_t *chain_num;        /* descriptors in the chain, by head */
+} QVirtQueue;
+
+/* A buffer of a request, in guest memory */
+typedef struct QVirtioBuf {
+    uint64_t addr;
+    uint32_t len;
+    bool write;                 /* written by the device */
+} QVirtioBuf;
+
+QVirtioPCIDevice *qvirtio_pci_init(QPCIBus *bus, int devfn);
+void qvirtio_pci_set_status(QVirtioPCIDevice *d, uint8_t status);
+uint32_t qvirtio_pci_get_features(QVirtioPCIDevice *d);
+void qvirtio_pci_set_features(QVirtioPCIDevice *d, uint32_t features);
+void qvirtio_pci_free(QVirtioPCIDevice *d);
+
+QVirtQueue *qvirtqueue_setup(QVirtioPCIDevice *d, QGuestAllocator *alloc,
+                             uint16_t index);
+int qvirtqueue_add(QVirtQueue *vq, const QVirtioBuf *bufs, int n);
+void qvirtqueue_kick(QVirtioPCIDevice *d, QVirtQueue *vq);
+bool qvirtqueue_get_used(QVirtQueue *vq, uint16_t *head, uint32_t *len);
+
+#endif
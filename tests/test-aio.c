@@ -14,6 +14,7 @@
 #include "block/aio.h"
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
 
 AioContext *ctx;
 
@@ -112,6 +113,63 @@ static void test_notify(void)
     g_assert(!aio_poll(ctx, false));
 }
 
+typedef struct {
+    QemuMutex start_lock;
+    bool thread_acquired;
+} AcquireTestData;
+
+static void *test_acquire_thread(void *opaque)
+{
+    AcquireTestData *data = opaque;
+
+    /* Wait for other thread to let us start */
+    qemu_mutex_lock(&data->start_lock);
+    qemu_mutex_unlock(&data->start_lock);
+
+    aio_context_acquire(ctx);
+    aio_context_release(ctx);
+
+    data->thread_acquired = true; /* success, we got here */
+
+    return NULL;
+}
+
+static void dummy_notifier_read(EventNotifier *unused)
+{
+    g_assert(false); /* should never be invoked */
+}
+
+static void test_acquire(void)
+{
+    QemuThread thread;
+    EventNotifier notifier;
+    AcquireTestData data;
+
+    /* Dummy event notifier ensures aio_poll() will block */
+    event_notifier_init(&notifier, false);
+    aio_set_event_notifier(ctx, &notifier, dummy_notifier_read);
+    g_assert(!aio_poll(ctx, false)); /* consume aio_notify() */
+
+    qemu_mutex_init(&data.start_lock);
+    qemu_mutex_lock(&data.start_lock);
+    data.thread_acquired = false;
+
+    qemu_thread_create(&thread, test_acquire_thread,
+                       &data, QEMU_THREAD_JOINABLE);
+
+    /* Block in aio_poll(), let other thread kick us and acquire context */
+    aio_context_acquire(ctx);
+    qemu_mutex_unlock(&data.start_lock); /* let the thread run */
+    g_assert(!aio_poll(ctx, true));
+    aio_context_release(ctx);
+
+    qemu_thread_join(&thread);
+    aio_set_event_notifier(ctx, &notifier, NULL);
+    event_notifier_cleanup(&notifier);
+
+    g_assert(data.thread_acquired);
+}
+
 static void test_bh_schedule(void)
 {
     BHTestData data = { .n = 0 };
@@ -253,6 +311,64 @@ static void test_bh_flush(void)
     qemu_bh_delete(data.bh);
 }
 
+typedef struct {
+    BHTestData *other;
+    int n;
+} NestedBHTestData;
+
+static void bh_nested_cb(void *opaque)
+{
+    NestedBHTestData *data = opaque;
+
+    /* the other bottom half was scheduled later, but still runs here */
+    g_assert_cmpint(data->other->n, ==, 0);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data->other->n, ==, 1);
+    data->n++;
+}
+
+static void test_bh_nested_poll(void)
+{
+    BHTestData data = { .n = 0 };
+    NestedBHTestData nested = { .other = &data };
+    QEMUBH *bh = aio_bh_new(ctx, bh_nested_cb, &nested);
+
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule(bh);
+    qemu_bh_schedule(data.bh);
+
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(nested.n, ==, 1);
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    qemu_bh_delete(bh);
+    qemu_bh_delete(data.bh);
+}
+
+static void test_bh_cancel_reschedule(void)
+{
+    BHTestData data = { .n = 0 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule(data.bh);
+    qemu_bh_cancel(data.bh);
+    qemu_bh_schedule(data.bh);
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    qemu_bh_schedule(data.bh);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+    qemu_bh_delete(data.bh);
+}
+
 static void test_set_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 0 };
@@ -366,6 +482,42 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static void test_wait_event_notifier_many(void)
+{
+    EventNotifierTestData data[100];
+    int i;
+
+    /* enough handlers for aio_poll() to switch to epoll, if available */
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+    g_assert(!aio_poll(ctx, false));
+
+    event_notifier_set(&data[57].e);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data[57].n, ==, 1);
+    g_assert_cmpint(data[56].n, ==, 0);
+    g_assert(!aio_poll(ctx, false));
+
+    /* removed handlers must not fire */
+    aio_set_event_notifier(ctx, &data[3].e, NULL);
+    event_notifier_set(&data[3].e);
+    event_notifier_set(&data[4].e);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data[3].n, ==, 0);
+    g_assert_cmpint(data[4].n, ==, 1);
+    g_assert(!aio_poll(ctx, false));
+
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -427,6 +579,80 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+#define ORDER_TIMERS 100
+
+typedef struct {
+    QEMUTimer timer;
+    int64_t expire_time;
+    int index;
+} OrderTimerData;
+
+static int order_fired[ORDER_TIMERS];
+static int order_n;
+
+static void order_timer_cb(void *opaque)
+{
+    OrderTimerData *data = opaque;
+
+    order_fired[order_n++] = data->index;
+}
+
+static void test_timer_order(void)
+{
+    OrderTimerData data[ORDER_TIMERS];
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int i;
+
+    /* Arm the timers in scrambled order, all of them already expired.  Pairs
+     * of timers share an expiry time, the first one armed must fire first.
+     */
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        int j = (i * 37) % ORDER_TIMERS;
+
+        data[j].index = j;
+        data[j].expire_time = now - SCALE_MS * (ORDER_TIMERS - j / 2);
+        aio_timer_init(ctx, &data[j].timer, QEMU_CLOCK_REALTIME,
+                       SCALE_NS, order_timer_cb, &data[j]);
+    }
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        timer_mod(&data[i].timer, data[i].expire_time + SCALE_MS * 1000);
+    }
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        int j = (i * 37) % ORDER_TIMERS;
+
+        timer_mod(&data[j].timer, data[j].expire_time);
+    }
+
+    /* Every tenth timer is removed again */
+    for (i = 0; i < ORDER_TIMERS; i += 10) {
+        timer_del(&data[i].timer);
+        g_assert(!timer_pending(&data[i].timer));
+    }
+
+    order_n = 0;
+    while (aio_poll(ctx, false)) {
+        /* Do nothing */
+    }
+
+    g_assert_cmpint(order_n, ==, ORDER_TIMERS - ORDER_TIMERS / 10);
+    for (i = 0; i < order_n; i++) {
+        int j = order_fired[i];
+
+        g_assert(j % 10 != 0);
+        g_assert(!timer_pending(&data[j].timer));
+        if (i > 0) {
+            int prev = order_fired[i - 1];
+
+            g_assert_cmpint(data[prev].expire_time, <=, data[j].expire_time);
+            if (data[prev].expire_time == data[j].expire_time) {
+                /* timer j was armed in position j * 73 mod 100 */
+                g_assert_cmpint((prev * 73) % ORDER_TIMERS, <,
+                                (j * 73) % ORDER_TIMERS);
+            }
+        }
+    }
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -776,18 +1002,23 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/aio/notify",                  test_notify);
+    g_test_add_func("/aio/acquire",                 test_acquire);
     g_test_add_func("/aio/bh/schedule",             test_bh_schedule);
     g_test_add_func("/aio/bh/schedule10",           test_bh_schedule10);
     g_test_add_func("/aio/bh/cancel",               test_bh_cancel);
     g_test_add_func("/aio/bh/delete",               test_bh_delete);
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
+    g_test_add_func("/aio/bh/nested-poll",          test_bh_nested_poll);
+    g_test_add_func("/aio/bh/cancel-reschedule",    test_bh_cancel_reschedule);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/wait/many",         test_wait_event_notifier_many);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -0,0 +1,115 @@
+/*
+ * QEMU buffer_is_zero test
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE (16 * 1024)
+#define PERF_BUF_SIZE (1024 * 1024)
+
+static uint8_t *alloc_buffer(size_t size)
+{
+    uint8_t *buf = qemu_memalign(64, size);
+
+    memset(buf, 0, size);
+    return buf;
+}
+
+static void check_all_implementations(void (*fn)(void))
+{
+    do {
+        fn();
+    } while (test_buffer_is_zero_next_accel());
+}
+
+static void do_test_zero(void)
+{
+    uint8_t *buf = alloc_buffer(BUF_SIZE);
+
+    g_assert(buffer_is_zero(buf, BUF_SIZE));
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, BUF_SIZE), ==, BUF_SIZE);
+
+    qemu_vfree(buf);
+}
+
+static void do_test_nonzero(void)
+{
+    const size_t unroll = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+                          sizeof(VECTYPE);
+    uint8_t *buf = alloc_buffer(BUF_SIZE);
+    size_t i, len, offs;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        buf[i] = 0x80;
+        g_assert(!buffer_is_zero(buf, BUF_SIZE));
+
+        /* The returned offset is rounded down by less than one unrolled
+         * iteration and never points behind the non-zero byte */
+        offs = buffer_find_nonzero_offset(buf, BUF_SIZE);
+        g_assert_cmpint(offs, <=, i);
+        g_assert_cmpint(i - offs, <, unroll);
+
+        /* Shorter buffers that don't include the byte are still zero */
+        len = QEMU_ALIGN_DOWN(i, unroll);
+        g_assert(buffer_is_zero(buf, len));
+
+        buf[i] = 0;
+    }
+
+    qemu_vfree(buf);
+}
+
+static void test_zero(void)
+{
+    check_all_implementations(do_test_zero);
+}
+
+static void test_nonzero(void)
+{
+    check_all_implementations(do_test_nonzero);
+}
+
+static void test_perf(void)
+{
+    uint8_t *buf = alloc_buffer(PERF_BUF_SIZE);
+    int variant = 0;
+
+    do {
+        double duration;
+        int i, n = 0;
+
+        g_test_timer_start();
+        do {
+            for (i = 0; i < 100; i++) {
+                g_assert(buffer_is_zero(buf, PERF_BUF_SIZE));
+            }
+            n += i;
+            duration = g_test_timer_elapsed();
+        } while (duration < 1.0);
+
+        g_test_message("variant %d: %.2f GB/s", variant,
+                       (double) n * PERF_BUF_SIZE / duration / 1e9);
+        variant++;
+    } while (test_buffer_is_zero_next_accel());
+
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/bufferiszero/zero", test_zero);
+    g_test_add_func("/cutils/bufferiszero/nonzero", test_nonzero);
+    if (g_test_perf()) {
+        g_test_add_func("/cutils/bufferiszero/perf", test_perf);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,162 @@
+/*
+ * QEMU crc32c test
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+
+#define BUF_SIZE (64 * 1024)
+#define PERF_BUF_SIZE (1024 * 1024)
+
+static uint8_t *alloc_buffer(size_t size)
+{
+    uint8_t *buf = qemu_memalign(64, size);
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = i * 7 + (i >> 9);
+    }
+    return buf;
+}
+
+static void check_all_implementations(void (*fn)(void))
+{
+    do {
+        fn();
+    } while (test_crc32c_next_accel());
+}
+
+/* Bytewise reference, as in RFC 3720 */
+static uint32_t crc32c_ref(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    int i;
+
+    while (len--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void do_test_vectors(void)
+{
+    static const uint8_t zeroes[32], ones[32] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    };
+
+    g_assert_cmphex(crc32c(0xffffffff, (const uint8_t *)"123456789", 9),
+                    ==, 0xe3069283);
+    g_assert_cmphex(crc32c(0xffffffff, zeroes, sizeof(zeroes)),
+                    ==, 0x8a9136aa);
+    g_assert_cmphex(crc32c(0xffffffff, ones, sizeof(ones)),
+                    ==, 0x62a8ab43);
+}
+
+static void do_test_lengths(void)
+{
+    uint8_t *buf = alloc_buffer(BUF_SIZE + 16);
+    size_t len, offs;
+
+    /* Cover the tails of the word loop and the stream rounds, and
+     * misaligned buffers */
+    for (offs = 0; offs < 16; offs += 3) {
+        for (len = 0; len < 256; len++) {
+            g_assert_cmphex(crc32c(0xffffffff, buf + offs, len),
+                            ==, crc32c_ref(buf + offs, len));
+        }
+        for (len = 256; len <= BUF_SIZE; len = len * 3 / 2 + 1) {
+            g_assert_cmphex(crc32c(0xffffffff, buf + offs, len),
+                            ==, crc32c_ref(buf + offs, len));
+        }
+    }
+
+    qemu_vfree(buf);
+}
+
+static void do_test_chained(void)
+{
+    uint8_t *buf = alloc_buffer(BUF_SIZE);
+    uint32_t crc;
+    size_t split;
+
+    /* Checksumming in pieces gives the same result as in one go */
+    for (split = 1; split < BUF_SIZE; split = split * 5 + 3) {
+        crc = crc32c(0xffffffff, buf, split);
+        crc = crc32c(crc ^ 0xffffffff, buf + split, BUF_SIZE - split);
+        g_assert_cmphex(crc, ==, crc32c_ref(buf, BUF_SIZE));
+    }
+
+    qemu_vfree(buf);
+}
+
+static void test_vectors(void)
+{
+    check_all_implementations(do_test_vectors);
+}
+
+static void test_lengths(void)
+{
+    check_all_implementations(do_test_lengths);
+}
+
+static void test_chained(void)
+{
+    check_all_implementations(do_test_chained);
+}
+
+static void test_perf(void)
+{
+    static const size_t sizes[] = { 512, 4096, PERF_BUF_SIZE };
+    uint8_t *buf = alloc_buffer(PERF_BUF_SIZE);
+    int variant = 0;
+    size_t i;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            double duration;
+            uint64_t bytes = 0;
+            int j;
+
+            g_test_timer_start();
+            do {
+                for (j = 0; j < 100; j++) {
+                    crc32c(0xffffffff, buf, sizes[i]);
+                }
+                bytes += 100 * sizes[i];
+                duration = g_test_timer_elapsed();
+            } while (duration < 1.0);
+
+            g_test_message("variant %d, %zd bytes: %.2f GB/s", variant,
+                           sizes[i], bytes / duration / 1e9);
+        }
+        variant++;
+    } while (test_crc32c_next_accel());
+
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/vectors", test_vectors);
+    g_test_add_func("/crc32c/lengths", test_lengths);
+    g_test_add_func("/crc32c/chained", test_chained);
+    if (g_test_perf()) {
+        g_test_add_func("/crc32c/perf", test_perf);
+    }
+    return g_test_run();
+}
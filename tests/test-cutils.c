@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include "qemu-common.h"
+#include "qemu/bitmap.h"
 
 
 static void test_parse_uint_null(void)
@@ -226,6 +227,43 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void do_test_copy_changed_chunks(size_t chunk)
+{
+    const size_t nchunks = 100;
+    uint8_t *dst = g_malloc0(chunk * nchunks);
+    uint8_t *src = g_malloc0(chunk * nchunks);
+    DECLARE_BITMAP(bitmap, 100);
+    size_t i;
+
+    /* Change every third chunk, but only look at the even ones */
+    for (i = 0; i < nchunks; i += 3) {
+        src[i * chunk + i % chunk] = 1;
+    }
+    bitmap_zero(bitmap, nchunks);
+    for (i = 0; i < nchunks; i += 2) {
+        set_bit(i, bitmap);
+    }
+
+    buffer_copy_changed_chunks(dst, src, chunk, nchunks, bitmap);
+
+    for (i = 0; i < nchunks; i++) {
+        bool changed = i % 3 == 0 && i % 2 == 0;
+
+        g_assert_cmpint(test_bit(i, bitmap), ==, changed);
+        g_assert_cmpint(dst[i * chunk + i % chunk], ==, changed);
+    }
+
+    g_free(dst);
+    g_free(src);
+}
+
+static void test_copy_changed_chunks(void)
+{
+    /* 64 bytes are the vectorized case, 12 bytes the generic one */
+    do_test_copy_changed_chunks(64);
+    do_test_copy_changed_chunks(12);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +284,8 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_copy_changed_chunks",
+                    test_copy_changed_chunks);
 
     return g_test_run();
 }
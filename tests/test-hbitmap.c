@@ -369,6 +369,140 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_iter_run(TestHBitmapData *data,
+                                  const void *unused)
+{
+    HBitmapIter hbi;
+    uint64_t count;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), <, 0);
+    g_assert_cmpint(count, ==, 0);
+
+    hbitmap_test_set(data, 1, 1);
+    hbitmap_test_set(data, L1 - 3, L2 + 6);
+    hbitmap_test_set(data, L2 + L1 + 4, 1);
+    hbitmap_test_set(data, L3 - L1, L1);
+
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), ==, 1);
+    g_assert_cmpint(count, ==, 1);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), ==, L1 - 3);
+    g_assert_cmpint(count, ==, L2 + 6);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), ==, L2 + L1 + 4);
+    g_assert_cmpint(count, ==, 1);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), ==, L3 - L1);
+    g_assert_cmpint(count, ==, L1);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), <, 0);
+
+    /* Starting in the middle of a run only returns its tail.  */
+    hbitmap_iter_init(&hbi, data->hb, L1);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), ==, L1);
+    g_assert_cmpint(count, ==, L2 + 3);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L2 + L1 + 4);
+}
+
+static void test_hbitmap_iter_run_granularity(TestHBitmapData *data,
+                                              const void *unused)
+{
+    HBitmapIter hbi;
+    uint64_t count;
+
+    hbitmap_test_init(data, L2 << 2, 2);
+    hbitmap_set(data->hb, 5, 10);
+    hbitmap_set(data->hb, (L2 << 2) - 1, 1);
+
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), ==, 4);
+    g_assert_cmpint(count, ==, 12);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), ==, (L2 << 2) - 4);
+    g_assert_cmpint(count, ==, 4);
+    g_assert_cmpint(hbitmap_iter_next_run(&hbi, &count), <, 0);
+}
+
+static void test_hbitmap_count_range(TestHBitmapData *data,
+                                     const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    g_assert_cmpint(hbitmap_count_range(data->hb, 0, L3), ==, 0);
+
+    hbitmap_test_set(data, L1 - 3, L2 + 6);
+    hbitmap_test_set(data, L3 - 1, 1);
+    g_assert_cmpint(hbitmap_count_range(data->hb, 0, L3), ==, L2 + 7);
+    g_assert_cmpint(hbitmap_count_range(data->hb, 0, L1), ==, 3);
+    g_assert_cmpint(hbitmap_count_range(data->hb, L1, L1), ==, L1);
+    g_assert_cmpint(hbitmap_count_range(data->hb, L1 - 1, L2), ==, L2);
+    g_assert_cmpint(hbitmap_count_range(data->hb, L2, L3), ==, L1 + 4);
+    g_assert_cmpint(hbitmap_count_range(data->hb, L3 - 1, 1), ==, 1);
+    g_assert_cmpint(hbitmap_count_range(data->hb, L3 - 1, 0), ==, 0);
+
+    hbitmap_free(data->hb);
+    data->hb = hbitmap_alloc(L2, 3);
+    hbitmap_set(data->hb, 9, 1);
+    g_assert_cmpint(hbitmap_count_range(data->hb, 0, L2), ==, 8);
+    g_assert_cmpint(hbitmap_count_range(data->hb, 15, 1), ==, 8);
+    g_assert_cmpint(hbitmap_count_range(data->hb, 16, L1), ==, 0);
+}
+
+static void hbitmap_test_serialize_range(TestHBitmapData *data,
+                                         uint64_t chunk)
+{
+    HBitmap *copy = data->hb;
+    uint64_t size = data->size;
+    uint64_t start, count, len;
+    uint8_t *buf;
+
+    buf = g_malloc(hbitmap_serialization_size(copy, 0, size));
+    data->hb = hbitmap_alloc(size, data->granularity);
+
+    /* Fill the new bitmap with garbage that must be overwritten.  */
+    hbitmap_set(data->hb, 0, size);
+    for (start = 0; start < size; start += chunk) {
+        count = MIN(chunk, size - start);
+        len = hbitmap_serialization_size(copy, start, count);
+        g_assert_cmpint(len % 8, ==, 0);
+        hbitmap_serialize_part(copy, buf, start, count);
+        hbitmap_deserialize_part(data->hb, buf, start, count,
+                                 start + count == size);
+    }
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(copy);
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    uint64_t gran;
+
+    hbitmap_test_init(data, L3 + 23, 0);
+    gran = hbitmap_serialization_granularity(data->hb);
+    g_assert_cmpint(gran, ==, 64);
+    g_assert_cmpint(hbitmap_serialization_size(data->hb, 0, 64), ==, 8);
+
+    hbitmap_test_serialize_range(data, L3 + 23);
+
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 3, L2 + 6);
+    hbitmap_test_set(data, L3 - 1, 20);
+    hbitmap_test_serialize_range(data, L3 + 23);
+    hbitmap_test_serialize_range(data, gran);
+    hbitmap_test_serialize_range(data, 5 * gran);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L2 + 27);
+}
+
+static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
+                                          const void *unused)
+{
+    hbitmap_test_init(data, L2, 0);
+    hbitmap_test_set(data, 0, L2);
+    hbitmap_deserialize_zeroes(data->hb, 64, L2 - 128, true);
+    hbitmap_test_reset(data, 64, L2 - 128);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 128);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +529,13 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/iter/run", test_hbitmap_iter_run);
+    hbitmap_test_add("/hbitmap/iter/run-granularity",
+                     test_hbitmap_iter_run_granularity);
+    hbitmap_test_add("/hbitmap/count-range", test_hbitmap_count_range);
+    hbitmap_test_add("/hbitmap/serialize/general", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/serialize/zeroes",
+                     test_hbitmap_serialize_zeroes);
     g_test_run();
 
     return 0;
@@ -0,0 +1,114 @@
+/*
+ * Interval tree unit-tests
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/interval-tree.h"
+
+static void test_empty(void)
+{
+    IntervalTree tree;
+
+    interval_tree_init(&tree);
+    g_assert(interval_tree_empty(&tree));
+    g_assert(interval_tree_find(&tree, 0, INT64_MAX) == NULL);
+}
+
+static void test_overlap(void)
+{
+    IntervalTree tree;
+    IntervalTreeNode a, b, c;
+
+    interval_tree_init(&tree);
+    interval_tree_insert(&tree, &a, 10, 20);
+    interval_tree_insert(&tree, &b, 30, 40);
+    interval_tree_insert(&tree, &c, 30, 40);
+    g_assert(!interval_tree_empty(&tree));
+
+    /* ranges are half-open */
+    g_assert(interval_tree_find(&tree, 0, 10) == NULL);
+    g_assert(interval_tree_find(&tree, 20, 30) == NULL);
+    g_assert(interval_tree_find(&tree, 40, 50) == NULL);
+    g_assert(interval_tree_find(&tree, 0, 11) == &a);
+    g_assert(interval_tree_find(&tree, 19, 20) == &a);
+    g_assert(interval_tree_find(&tree, 15, 35) == &a);
+
+    interval_tree_remove(&tree, &b);
+    g_assert(interval_tree_find(&tree, 35, 36) == &c);
+    interval_tree_remove(&tree, &c);
+    g_assert(interval_tree_find(&tree, 35, 36) == NULL);
+    interval_tree_remove(&tree, &a);
+    g_assert(interval_tree_empty(&tree));
+}
+
+#define RANDOM_NODES 256
+#define RANDOM_SPAN  1000
+
+static bool overlaps(IntervalTreeNode *n, int64_t start, int64_t end)
+{
+    return n->start < end && n->end > start;
+}
+
+static void test_random(void)
+{
+    IntervalTree tree;
+    IntervalTreeNode nodes[RANDOM_NODES];
+    bool in_tree[RANDOM_NODES] = { false };
+    int i, j;
+
+    interval_tree_init(&tree);
+    for (i = 0; i < 100000; i++) {
+        int64_t start, end;
+        IntervalTreeNode *found;
+        bool expected = false;
+
+        j = g_test_rand_int_range(0, RANDOM_NODES);
+        if (in_tree[j]) {
+            interval_tree_remove(&tree, &nodes[j]);
+            in_tree[j] = false;
+        } else {
+            start = g_test_rand_int_range(0, RANDOM_SPAN);
+            end = start + g_test_rand_int_range(1, 32);
+            interval_tree_insert(&tree, &nodes[j], start, end);
+            in_tree[j] = true;
+        }
+
+        /* compare with a linear scan */
+        start = g_test_rand_int_range(0, RANDOM_SPAN);
+        end = start + g_test_rand_int_range(1, 32);
+        for (j = 0; j < RANDOM_NODES; j++) {
+            if (in_tree[j] && overlaps(&nodes[j], start, end)) {
+                expected = true;
+            }
+        }
+        found = interval_tree_find(&tree, start, end);
+        g_assert(expected == (found != NULL));
+        if (found) {
+            j = found - nodes;
+            g_assert(in_tree[j]);
+            g_assert(overlaps(found, start, end));
+        }
+    }
+
+    for (j = 0; j < RANDOM_NODES; j++) {
+        if (in_tree[j]) {
+            interval_tree_remove(&tree, &nodes[j]);
+        }
+    }
+    g_assert(interval_tree_empty(&tree));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/overlap", test_overlap);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
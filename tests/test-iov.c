@@ -398,6 +398,62 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_cursor(void)
+{
+    struct iovec *iov;
+    unsigned int iov_cnt;
+    unsigned char *buf, *ref;
+    size_t sz, pos, len, n;
+    IOVCursor cur;
+    int i;
+
+    iov_random(&iov, &iov_cnt);
+    sz = iov_size(iov, iov_cnt);
+    buf = g_malloc(sz + 1);
+    ref = g_malloc(sz + 1);
+
+    /* Write the iovec in random pieces, checking with iov_to_buf */
+    for (i = 0; i < 100; i++) {
+        iov_memset(iov, iov_cnt, 0, 0xff, -1);
+        memset(ref, 0xff, sz);
+        iov_cursor_init(&cur, iov, iov_cnt);
+        pos = 0;
+        while (pos < sz) {
+            len = g_test_rand_int_range(0, 12);
+            if (g_test_rand_bit()) {
+                n = iov_cursor_skip(&cur, len);
+            } else {
+                memset(buf, pos & 255, len);
+                n = iov_cursor_from_buf(&cur, buf, len);
+                memcpy(ref + pos, buf, n);
+            }
+            g_assert_cmpint(n, ==, MIN(len, sz - pos));
+            pos += n;
+            g_assert_cmpint(cur.pos, ==, pos);
+        }
+        g_assert_cmpint(iov_cursor_skip(&cur, 1), ==, 0);
+
+        g_assert_cmpint(iov_to_buf(iov, iov_cnt, 0, buf, sz), ==, sz);
+        g_assert(memcmp(buf, ref, sz) == 0);
+    }
+
+    /* Reading at random positions, backwards too, matches iov_to_buf */
+    iov_cursor_init(&cur, iov, iov_cnt);
+    for (i = 0; i < 100; i++) {
+        pos = g_test_rand_int_range(0, sz + 1);
+        len = g_test_rand_int_range(0, sz + 1);
+        g_assert_cmpint(iov_cursor_seek(&cur, pos), ==, pos);
+        n = iov_to_buf(iov, iov_cnt, pos, ref, len);
+        g_assert_cmpint(iov_cursor_to_buf(&cur, buf, len), ==, n);
+        g_assert(memcmp(buf, ref, n) == 0);
+    }
+    g_assert_cmpint(iov_cursor_seek(&cur, sz + 10), ==, sz);
+
+    g_free(buf);
+    g_free(ref);
+    iov_free(iov, iov_cnt);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -406,5 +462,6 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/cursor", test_cursor);
     return g_test_run();
 }
@@ -0,0 +1,155 @@
+/*
+ * Page cache unit tests
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE], *data;
+    PageCacheStats stats;
+    uint64_t addr;
+
+    g_assert(cache);
+    g_assert_cmpint(cache_get_num_sets(cache), ==, 8);
+
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr));
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+
+    /* the cache holds exactly as many pages as were inserted */
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        data = get_cached_data(cache, addr);
+        fill_page(page, addr);
+        g_assert(memcmp(data, page, PAGE_SIZE) == 0);
+    }
+    g_assert(get_cached_data(cache, 64 * PAGE_SIZE) == NULL);
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, 64);
+    g_assert_cmpint(stats.misses, ==, 64);
+    g_assert_cmpint(stats.evictions, ==, 0);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_associativity(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    int64_t sets = cache_get_num_sets(cache);
+    uint8_t page[PAGE_SIZE];
+    PageCacheStats stats;
+    int i;
+
+    /* pages mapping to the same set no longer evict each other */
+    for (i = 0; i < 8; i++) {
+        uint64_t addr = i * sets * PAGE_SIZE;
+
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, i * sets * PAGE_SIZE));
+    }
+
+    cache_get_set_stats(cache, 0, &stats);
+    g_assert_cmpint(stats.hits, ==, 8);
+    g_assert_cmpint(stats.evictions, ==, 0);
+    cache_get_set_stats(cache, 1, &stats);
+    g_assert_cmpint(stats.hits, ==, 0);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_clock_replacement(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    int64_t sets = cache_get_num_sets(cache);
+    uint8_t page[PAGE_SIZE];
+    PageCacheStats stats;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        cache_insert(cache, i * sets * PAGE_SIZE, page);
+    }
+
+    /* reference every page but the fourth one, which must be replaced */
+    for (i = 0; i < 8; i++) {
+        if (i != 3) {
+            g_assert(cache_is_cached(cache, i * sets * PAGE_SIZE));
+        }
+    }
+    cache_insert(cache, 8 * sets * PAGE_SIZE, page);
+
+    for (i = 0; i <= 8; i++) {
+        g_assert(cache_is_cached(cache, i * sets * PAGE_SIZE) == (i != 3));
+    }
+
+    cache_get_set_stats(cache, 0, &stats);
+    g_assert_cmpint(stats.evictions, ==, 1);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+
+    g_assert_cmpint(cache_resize(cache, 256), ==, 256);
+    g_assert_cmpint(cache_get_num_sets(cache), ==, 32);
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        fill_page(page, addr);
+        g_assert(memcmp(get_cached_data(cache, addr), page, PAGE_SIZE) == 0);
+    }
+
+    /* shrinking keeps the most recently inserted pages */
+    g_assert_cmpint(cache_resize(cache, 8), ==, 8);
+    g_assert_cmpint(cache_get_num_sets(cache), ==, 1);
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr) == (addr >= 56 * PAGE_SIZE));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page-cache/associativity", test_associativity);
+    g_test_add_func("/page-cache/clock_replacement", test_clock_replacement);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
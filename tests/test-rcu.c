@@ -0,0 +1,154 @@
+/*
+ * RCU unit tests
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+
+typedef struct Item {
+    struct rcu_head rcu;
+    int value;
+} Item;
+
+static Item *current;
+static bool stop;
+static bool reader_in_cs;
+static unsigned long nr_reads;
+static int nr_freed;
+
+static Item *item_new(int value)
+{
+    Item *item = g_new0(Item, 1);
+
+    item->value = value;
+    return item;
+}
+
+static void item_free(Item *item)
+{
+    item->value = -1;
+    g_free(item);
+    atomic_inc(&nr_freed);
+}
+
+static void *reader_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    while (!atomic_read(&stop)) {
+        Item *item;
+
+        rcu_read_lock();
+        item = atomic_rcu_read(&current);
+        g_assert_cmpint(item->value, >=, 0);
+        rcu_read_unlock();
+        atomic_inc(&nr_reads);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* A reader holding the critical section delays synchronize_rcu().  */
+static void *blocking_reader_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    rcu_read_lock();
+    atomic_mb_set(&reader_in_cs, true);
+    g_usleep(100000);
+    atomic_mb_set(&reader_in_cs, false);
+    rcu_read_unlock();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_synchronize_waits(void)
+{
+    QemuThread thread;
+
+    qemu_thread_create(&thread, blocking_reader_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    while (!atomic_mb_read(&reader_in_cs)) {
+        g_usleep(1000);
+    }
+
+    synchronize_rcu();
+    g_assert(!atomic_mb_read(&reader_in_cs));
+
+    qemu_thread_join(&thread);
+}
+
+static void test_nested(void)
+{
+    rcu_read_lock();
+    rcu_read_lock();
+    rcu_read_unlock();
+    g_assert_cmpint(rcu_reader.depth, ==, 1);
+    g_assert(rcu_reader.ctr != 0);
+    rcu_read_unlock();
+    g_assert_cmpint(rcu_reader.depth, ==, 0);
+    g_assert(rcu_reader.ctr == 0);
+
+    /* no readers: must not block */
+    synchronize_rcu();
+}
+
+static void test_update(void)
+{
+    QemuThread threads[4];
+    int i;
+
+    atomic_set(&stop, false);
+    current = item_new(0);
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_create(&threads[i], reader_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 1; i <= 1000; i++) {
+        Item *old = current;
+
+        atomic_rcu_set(&current, item_new(i));
+        synchronize_rcu();
+        item_free(old);
+    }
+
+    /* same thing, but reclaimed asynchronously */
+    atomic_set(&nr_freed, 0);
+    for (i = 1; i <= 1000; i++) {
+        Item *old = current;
+
+        atomic_rcu_set(&current, item_new(i));
+        call_rcu(old, item_free, rcu);
+    }
+    while (atomic_read(&nr_freed) < 1000) {
+        g_usleep(1000);
+    }
+
+    atomic_set(&stop, true);
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_assert(nr_reads > 0);
+    g_free(current);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/nested", test_nested);
+    g_test_add_func("/rcu/synchronize_waits", test_synchronize_waits);
+    g_test_add_func("/rcu/update", test_update);
+
+    return g_test_run();
+}
@@ -0,0 +1,107 @@
+/*
+ * Statistics registry tests
+ *
+ * Copyright (C) 2014
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/stats.h"
+#include "qmp-commands.h"
+
+static void test_counter(void)
+{
+    Stats *stats = stats_new("test/counter");
+    StatsCounter *c = stats_add_counter(stats, "events");
+
+    g_assert_cmpuint(c->value, ==, 0);
+    stats_counter_inc(c);
+    stats_counter_add(c, 41);
+    g_assert_cmpuint(c->value, ==, 42);
+    stats_free(stats);
+}
+
+static void test_histogram(void)
+{
+    Stats *stats = stats_new("test/histogram");
+    StatsHistogram *h = stats_add_histogram(stats, "values");
+
+    stats_histogram_record(h, 0);
+    stats_histogram_record(h, 1);
+    stats_histogram_record(h, 2);
+    stats_histogram_record(h, 3);
+    stats_histogram_record(h, 4);
+    stats_histogram_record(h, UINT64_MAX);
+
+    g_assert_cmpuint(h->count, ==, 6);
+    g_assert_cmpuint(h->buckets[0], ==, 1);
+    g_assert_cmpuint(h->buckets[1], ==, 1);
+    g_assert_cmpuint(h->buckets[2], ==, 2);
+    g_assert_cmpuint(h->buckets[3], ==, 1);
+    g_assert_cmpuint(h->buckets[64], ==, 1);
+    stats_free(stats);
+}
+
+static void test_query(void)
+{
+    Stats *a = stats_new("test/query/a");
+    Stats *b = stats_new("test/query/b");
+    Stats *other = stats_new("test/other");
+    StatsHistogram *h;
+    StatsInfoList *list;
+    intList *bucket;
+    int n;
+
+    stats_counter_add(stats_add_counter(a, "first"), 1);
+    stats_counter_add(stats_add_counter(a, "second"), 2);
+    h = stats_add_histogram(b, "values");
+    stats_histogram_record(h, 5);
+    stats_histogram_record(h, 6);
+
+    list = qmp_query_stats(true, "test/query/", NULL);
+    g_assert(list && list->next && !list->next->next);
+
+    g_assert_cmpstr(list->value->name, ==, "test/query/a");
+    g_assert_cmpstr(list->value->counters->value->name, ==, "first");
+    g_assert_cmpint(list->value->counters->value->value, ==, 1);
+    g_assert_cmpstr(list->value->counters->next->value->name, ==, "second");
+    g_assert_cmpint(list->value->counters->next->value->value, ==, 2);
+    g_assert(!list->value->counters->next->next);
+    g_assert(!list->value->histograms);
+
+    g_assert_cmpstr(list->next->value->name, ==, "test/query/b");
+    g_assert(!list->next->value->counters);
+    g_assert_cmpint(list->next->value->histograms->value->count, ==, 2);
+    g_assert_cmpint(list->next->value->histograms->value->sum, ==, 11);
+
+    /* 5 and 6 are in bucket 3, the buckets after it are left out */
+    n = 0;
+    for (bucket = list->next->value->histograms->value->buckets; bucket;
+         bucket = bucket->next) {
+        g_assert_cmpint(bucket->value, ==, n == 3 ? 2 : 0);
+        n++;
+    }
+    g_assert_cmpint(n, ==, 4);
+    qapi_free_StatsInfoList(list);
+
+    stats_free(b);
+    list = qmp_query_stats(true, "test/query/", NULL);
+    g_assert(list && !list->next);
+    g_assert_cmpstr(list->value->name, ==, "test/query/a");
+    qapi_free_StatsInfoList(list);
+
+    stats_free(a);
+    stats_free(other);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/stats/counter", test_counter);
+    g_test_add_func("/stats/histogram", test_histogram);
+    g_test_add_func("/stats/query", test_query);
+    return g_test_run();
+}
@@ -132,6 +132,48 @@ static void test_submit_many(void)
     }
 }
 
+static int running;
+static int max_running;
+
+static int concurrency_cb(void *opaque)
+{
+    int n = atomic_fetch_inc(&running) + 1;
+    int old;
+
+    while ((old = atomic_read(&max_running)) < n) {
+        atomic_cmpxchg(&max_running, old, n);
+    }
+    g_usleep(10000);
+    atomic_dec(&running);
+    return 0;
+}
+
+static void test_limits(void)
+{
+    WorkerTestData data[20];
+    int i;
+
+    thread_pool_set_limits(pool, 1, 2);
+    max_running = 0;
+    for (i = 0; i < 20; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, concurrency_cb, &data[i],
+                               done_cb, &data[i]);
+    }
+
+    active = 20;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < 20; i++) {
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+    g_assert_cmpint(max_running, <=, 2);
+
+    thread_pool_set_limits(pool, 0, 64);
+}
+
 static void test_cancel(void)
 {
     WorkerTestData data[100];
@@ -216,6 +258,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/limits", test_limits);
     g_test_add_func("/thread-pool/cancel", test_cancel);
 
     ret = g_test_run();
@@ -13,6 +13,7 @@
 #include <glib.h>
 #include <math.h>
 #include "qemu/throttle.h"
+#include "block/throttle-groups.h"
 
 LeakyBucket    bkt;
 ThrottleConfig cfg;
@@ -87,6 +88,98 @@ static void test_compute_wait(void)
     g_assert(wait == result);
 }
 
+/* Let a greedy client use a bucket from @start_ms to @end_ms, doing one unit
+ * of I/O whenever the bucket allows it, and return how many units it did.
+ * The clock advances by @step_ms at a time.
+ */
+static double simulate_bucket(LeakyBucket *b, int start_ms, int end_ms,
+                              int step_ms)
+{
+    double units = 0;
+    int t;
+
+    for (t = start_ms; t < end_ms; t += step_ms) {
+        throttle_leak_bucket(b, (int64_t)step_ms * 1000000);
+        while (!throttle_compute_wait(b)) {
+            b->level += 1;
+            if (b->burst_length > 1) {
+                b->burst_level += 1;
+            }
+            units++;
+        }
+    }
+    return units;
+}
+
+static bool within(double value, double expected, double tolerance)
+{
+    return fabs(value - expected) <= expected * tolerance;
+}
+
+static void test_accuracy(void)
+{
+    LeakyBucket b = { .avg = 150, .max = 15 };
+    double units;
+
+    /* the pool can be used at once, then the rate is the average */
+    units = simulate_bucket(&b, 0, 1, 1);
+    g_assert(within(units, 15, 0.1));
+    units = simulate_bucket(&b, 1, 10000, 1);
+    g_assert(within(units, 1500, 0.01));
+}
+
+static void test_burst_length(void)
+{
+    /* 10 times the average for 30 seconds */
+    LeakyBucket b = { .avg = 10, .max = 100, .burst_length = 30 };
+    double units;
+
+    /* during the burst, the rate is max rather than unlimited */
+    units = simulate_bucket(&b, 0, 1, 1);
+    g_assert(within(units, 10, 0.1));
+    units = simulate_bucket(&b, 1, 10000, 1);
+    g_assert(within(units, 1000, 0.02));
+
+    /* the pool holds max * burst_length units and leaks at the average
+     * rate, so the burst, which started with 10 units at once, lasts until
+     * (3000 - 10) / (100 - 10) = 33.2 seconds
+     */
+    units = simulate_bucket(&b, 10000, 30000, 1);
+    g_assert(within(units, 2000, 0.02));
+    units = simulate_bucket(&b, 30000, 40000, 1);
+    g_assert(within(units, 100 * 3.2 + 10 * 6.8, 0.02));
+
+    /* afterwards the rate is back to the average */
+    units = simulate_bucket(&b, 40000, 100000, 10);
+    g_assert(within(units, 600, 0.02));
+
+    /* the burst can be resumed once the pool has leaked */
+    b.level = 0;
+    b.burst_level = 0;
+    units = simulate_bucket(&b, 0, 1000, 1);
+    g_assert(within(units, 100, 0.1));
+}
+
+static void test_burst_length_is_valid(void)
+{
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 10;
+    cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = 30;
+
+    /* a burst length needs a burst rate */
+    g_assert(!throttle_is_valid(&cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 5;
+    g_assert(!throttle_is_valid(&cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 100;
+    g_assert(throttle_is_valid(&cfg));
+
+    /* a burst length of one second is the classic pool of max units */
+    cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = 1;
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 5;
+    g_assert(throttle_is_valid(&cfg));
+    memset(&cfg, 0, sizeof(cfg));
+}
+
 /* functions to test ThrottleState initialization/destroy methods */
 static void read_timer_cb(void *opaque)
 {
@@ -459,6 +552,52 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_groups(void)
+{
+    ThrottleConfig cfg1, cfg2;
+    BlockDriverState *bdrv1, *bdrv2, *bdrv3;
+
+    bdrv1 = bdrv_new("bdrv1");
+    bdrv2 = bdrv_new("bdrv2");
+    bdrv3 = bdrv_new("bdrv3");
+
+    bdrv_io_limits_enable(bdrv1, "bar");
+    bdrv_io_limits_enable(bdrv2, "foo");
+    bdrv_io_limits_enable(bdrv3, NULL);
+
+    g_assert_cmpstr(throttle_group_get_name(bdrv1), ==, "bar");
+    g_assert_cmpstr(throttle_group_get_name(bdrv2), ==, "foo");
+    g_assert_cmpstr(throttle_group_get_name(bdrv3), ==, "bdrv3");
+
+    bdrv_io_limits_disable(bdrv2);
+    bdrv_io_limits_enable(bdrv2, "bar");
+    g_assert_cmpstr(throttle_group_get_name(bdrv2), ==, "bar");
+
+    /* members of a group share the limits */
+    memset(&cfg1, 0, sizeof(cfg1));
+    cfg1.buckets[THROTTLE_BPS_READ].avg  = 500000;
+    cfg1.buckets[THROTTLE_OPS_WRITE].avg = 30;
+    bdrv_set_io_limits(bdrv1, &cfg1);
+
+    throttle_group_get_config(bdrv2, &cfg2);
+    g_assert(cfg2.buckets[THROTTLE_BPS_READ].avg == 500000);
+    g_assert(cfg2.buckets[THROTTLE_OPS_WRITE].avg == 30);
+
+    throttle_group_get_config(bdrv3, &cfg2);
+    g_assert(!throttle_enabled(&cfg2));
+
+    bdrv_io_limits_disable(bdrv1);
+    throttle_group_get_config(bdrv2, &cfg2);
+    g_assert(cfg2.buckets[THROTTLE_BPS_READ].avg == 500000);
+
+    bdrv_io_limits_disable(bdrv2);
+    bdrv_io_limits_disable(bdrv3);
+
+    bdrv_unref(bdrv1);
+    bdrv_unref(bdrv2);
+    bdrv_unref(bdrv3);
+}
+
 int main(int argc, char **argv)
 {
     init_clocks();
@@ -468,6 +607,10 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/throttle/leak_bucket",        test_leak_bucket);
     g_test_add_func("/throttle/compute_wait",       test_compute_wait);
+    g_test_add_func("/throttle/accuracy",           test_accuracy);
+    g_test_add_func("/throttle/burst_length",       test_burst_length);
+    g_test_add_func("/throttle/burst_length/is_valid",
+                    test_burst_length_is_valid);
     g_test_add_func("/throttle/init",               test_init);
     g_test_add_func("/throttle/destroy",            test_destroy);
     g_test_add_func("/throttle/have_timer",         test_have_timer);
@@ -476,6 +619,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config/is_valid",    test_is_valid);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
 
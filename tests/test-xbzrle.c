@@ -22,6 +22,13 @@
 
 #define PAGE_SIZE 4096
 
+static void check_all_implementations(void (*fn)(void))
+{
+    do {
+        fn();
+    } while (test_xbzrle_next_accel());
+}
+
 static void test_uleb(void)
 {
     uint32_t i, val;
@@ -44,7 +51,7 @@ static void test_uleb(void)
     g_assert(val == 0);
 }
 
-static void test_encode_decode_zero(void)
+static void do_encode_decode_zero(void)
 {
     uint8_t *buffer = g_malloc0(PAGE_SIZE);
     uint8_t *compressed = g_malloc0(PAGE_SIZE);
@@ -68,7 +75,7 @@ static void test_encode_decode_zero(void)
     g_free(compressed);
 }
 
-static void test_encode_decode_unchanged(void)
+static void do_encode_decode_unchanged(void)
 {
     uint8_t *compressed = g_malloc0(PAGE_SIZE);
     uint8_t *test = g_malloc0(PAGE_SIZE);
@@ -92,7 +99,7 @@ static void test_encode_decode_unchanged(void)
     g_free(compressed);
 }
 
-static void test_encode_decode_1_byte(void)
+static void do_encode_decode_1_byte(void)
 {
     uint8_t *buffer = g_malloc0(PAGE_SIZE);
     uint8_t *test = g_malloc0(PAGE_SIZE);
@@ -115,7 +122,7 @@ static void test_encode_decode_1_byte(void)
     g_free(test);
 }
 
-static void test_encode_decode_overflow(void)
+static void do_encode_decode_overflow(void)
 {
     uint8_t *compressed = g_malloc0(PAGE_SIZE);
     uint8_t *test = g_malloc0(PAGE_SIZE);
@@ -170,7 +177,7 @@ static void encode_decode_range(void)
     g_free(test);
 }
 
-static void test_encode_decode(void)
+static void do_encode_decode(void)
 {
     int i;
 
@@ -179,6 +186,157 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_zero(void)
+{
+    check_all_implementations(do_encode_decode_zero);
+}
+
+static void test_encode_decode_unchanged(void)
+{
+    check_all_implementations(do_encode_decode_unchanged);
+}
+
+static void test_encode_decode_1_byte(void)
+{
+    check_all_implementations(do_encode_decode_1_byte);
+}
+
+static void test_encode_decode_overflow(void)
+{
+    check_all_implementations(do_encode_decode_overflow);
+}
+
+static void test_encode_decode(void)
+{
+    check_all_implementations(do_encode_decode);
+}
+
+/* Flips single bytes, like counters and flags being updated */
+static void dirty_sparse(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        page[g_test_rand_int_range(0, PAGE_SIZE)] ^= 0xff;
+    }
+}
+
+/* Rewrites a few short stretches, like a structure or a string */
+static void dirty_clustered(uint8_t *page)
+{
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+        int start = g_test_rand_int_range(0, PAGE_SIZE - 64);
+
+        for (j = 0; j < 64; j += 2) {
+            page[start + j] ^= 0x5a;
+        }
+    }
+}
+
+/* Changes one word in four, which mostly overflows into a normal page */
+static void dirty_dense(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i += 4 * sizeof(long)) {
+        page[i] ^= 0x01;
+    }
+}
+
+static void test_encode_implementations(void)
+{
+    uint8_t *old_page = g_malloc(PAGE_SIZE);
+    uint8_t *new_page = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    void (*patterns[])(uint8_t *) = {
+        dirty_sparse, dirty_clustered, dirty_dense
+    };
+    int i, j;
+
+    /* All implementations must produce the same stream */
+    for (i = 0; i < 1000; i++) {
+        int dlen = g_test_rand_int_range(1, PAGE_SIZE + 1);
+        int expected_len, len;
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old_page[j] = g_test_rand_int_range(0, 4) ? 0 : j;
+        }
+        memcpy(new_page, old_page, PAGE_SIZE);
+        patterns[i % ARRAY_SIZE(patterns)](new_page);
+
+        /* Compare the slower implementations against the fastest one */
+        expected_len = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                            expected, dlen);
+        while (test_xbzrle_next_accel()) {
+            len = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                       compressed, dlen);
+            g_assert_cmpint(len, ==, expected_len);
+            g_assert(memcmp(compressed, expected, MAX(len, 0)) == 0);
+        }
+    }
+
+    g_free(old_page);
+    g_free(new_page);
+    g_free(expected);
+    g_free(compressed);
+}
+
+static void test_perf(void)
+{
+    static const struct {
+        const char *name;
+        void (*dirty)(uint8_t *page);
+    } patterns[] = {
+        { "unchanged", NULL },
+        { "sparse", dirty_sparse },
+        { "clustered", dirty_clustered },
+        { "dense", dirty_dense },
+    };
+    uint8_t *old_page = g_malloc(PAGE_SIZE);
+    uint8_t *new_page = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, j;
+
+    for (j = 0; j < PAGE_SIZE; j++) {
+        old_page[j] = j * 7;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        int variant = 0;
+
+        memcpy(new_page, old_page, PAGE_SIZE);
+        if (patterns[i].dirty) {
+            patterns[i].dirty(new_page);
+        }
+
+        do {
+            double duration;
+            int n = 0;
+
+            g_test_timer_start();
+            do {
+                for (j = 0; j < 10000; j++) {
+                    xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                         compressed, PAGE_SIZE);
+                }
+                n += j;
+                duration = g_test_timer_elapsed();
+            } while (duration < 1.0);
+
+            g_test_message("%s, variant %d: %.2f MB/s", patterns[i].name,
+                           variant, (double) n * PAGE_SIZE / duration / 1e6);
+            variant++;
+        } while (test_xbzrle_next_accel());
+    }
+
+    g_free(old_page);
+    g_free(new_page);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +349,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_implementations",
+                    test_encode_implementations);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf", test_perf);
+    }
 
     return g_test_run();
 }
@@ -52,6 +52,9 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Access to the completed list is protected by lock.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -63,7 +66,6 @@ struct ThreadPool {
     QemuCond check_cancel;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
@@ -71,6 +73,9 @@ struct ThreadPool {
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
+    int min_threads;
+    int max_threads;
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
@@ -79,6 +84,18 @@ struct ThreadPool {
     bool stopping;
 };
 
+/* Runs with lock taken.  Completions are handed to the AioContext in
+ * batches: only the first one after event_notifier_ready() took the list
+ * sets the EventNotifier.
+ */
+static void queue_completion(ThreadPool *pool, ThreadPoolElement *req)
+{
+    if (QSIMPLEQ_EMPTY(&pool->completed)) {
+        event_notifier_set(&pool->notifier);
+    }
+    QSIMPLEQ_INSERT_TAIL(&pool->completed, req, done);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -87,20 +104,33 @@ static void *worker_thread(void *opaque)
     pool->pending_threads--;
     do_spawn_thread(pool);
 
-    while (!pool->stopping) {
+    while (!pool->stopping && pool->cur_threads <= pool->max_threads) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
+        /* Keep draining the queue without dropping the lock while requests
+         * are waiting, only go idle when it is empty.
+         */
+        ret = qemu_sem_timedwait(&pool->sem, 0);
+        while (ret == -1 && !pool->stopping) {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+            if (ret == -1 && QTAILQ_EMPTY(&pool->request_list) &&
+                pool->cur_threads > pool->min_threads) {
+                break;
+            }
+        }
         if (ret == -1 || pool->stopping) {
             break;
         }
+        if (pool->cur_threads > pool->max_threads) {
+            /* The limit was lowered, leave the request to another worker */
+            qemu_sem_post(&pool->sem);
+            break;
+        }
 
         req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
@@ -119,7 +149,7 @@ static void *worker_thread(void *opaque)
             qemu_cond_broadcast(&pool->check_cancel);
         }
 
-        event_notifier_set(&pool->notifier);
+        queue_completion(pool, req);
     }
 
     pool->cur_threads--;
@@ -171,30 +201,30 @@ static void spawn_thread(ThreadPool *pool)
 static void event_notifier_ready(EventNotifier *notifier)
 {
     ThreadPool *pool = container_of(notifier, ThreadPool, notifier);
-    ThreadPoolElement *elem, *next;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
+    ThreadPoolElement *elem;
 
     event_notifier_test_and_clear(notifier);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
-            continue;
-        }
+
+    /* Take the whole batch, the callbacks may submit or complete more */
+    QSIMPLEQ_INIT(&completed);
+    qemu_mutex_lock(&pool->lock);
+    QSIMPLEQ_CONCAT(&completed, &pool->completed);
+    qemu_mutex_unlock(&pool->lock);
+
+    while ((elem = QSIMPLEQ_FIRST(&completed)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&completed, done);
+        QLIST_REMOVE(elem, all);
         if (elem->state == THREAD_DONE) {
             trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                        elem->ret);
         }
         if (elem->state == THREAD_DONE && elem->common.cb) {
-            QLIST_REMOVE(elem, all);
             /* Read state before ret.  */
             smp_rmb();
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_release(elem);
-            goto restart;
-        } else {
-            /* remove the request */
-            QLIST_REMOVE(elem, all);
-            qemu_aio_release(elem);
         }
+        qemu_aio_release(elem);
     }
 }
 
@@ -215,7 +245,7 @@ static void thread_pool_cancel(BlockDriverAIOCB *acb)
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
         elem->state = THREAD_CANCELED;
-        event_notifier_set(&pool->notifier);
+        queue_completion(pool, elem);
     } else {
         pool->pending_cancellations++;
         while (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
@@ -298,11 +328,13 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_cond_init(&pool->check_cancel);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
+    pool->min_threads = 0;
     pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
     QTAILQ_INIT(&pool->request_list);
+    QSIMPLEQ_INIT(&pool->completed);
 
     aio_set_event_notifier(ctx, &pool->notifier, event_notifier_ready);
 }
@@ -314,6 +346,24 @@ ThreadPool *thread_pool_new(AioContext *ctx)
     return pool;
 }
 
+void thread_pool_set_limits(ThreadPool *pool, int min_threads,
+                            int max_threads)
+{
+    assert(min_threads >= 0 && min_threads <= max_threads && max_threads > 0);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+
+    /* Workers above the new maximum exit when they finish their current
+     * request or time out waiting for one.
+     */
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
 void thread_pool_free(ThreadPool *pool)
 {
     if (!pool) {
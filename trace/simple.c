@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #ifndef _WIN32
 #include <signal.h>
@@ -32,9 +33,6 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
@@ -56,14 +54,35 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
-    TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_BUF_LEN_DEFAULT = 4096 * 64,
+    TRACE_BUF_LEN_MIN = 4096 * 16,
+    TRACE_BUF_LEN_MAX = 1 << 30,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+/*
+ * Each thread that emits trace events has its own ring buffer, so that
+ * recording an event needs neither a lock nor an atomic operation shared
+ * with other threads.  The owning thread is the only one that advances
+ * @head and the writeout thread is the only one that advances @tail.  Both
+ * are free-running and are reduced modulo @size when indexing @buf.
+ */
+typedef struct TraceThreadBuf {
+    struct TraceThreadBuf *next;
+    uint8_t *buf;
+    unsigned int size;              /* power of two */
+    volatile unsigned int head;     /* written by the owning thread */
+    volatile unsigned int tail;     /* written by the writeout thread */
+    unsigned int writeout_head;     /* snapshot of @head for one writeout */
+    bool in_record;                 /* between start and finish */
+    volatile gint exited;           /* the owning thread is gone */
+} TraceThreadBuf;
+
+static TraceThreadBuf *volatile trace_bufs;
+static __thread TraceThreadBuf *trace_thread_buf;
+static unsigned int trace_buf_len = TRACE_BUF_LEN_DEFAULT;
+
 static volatile gint dropped_events;
+static volatile gint trace_events_dropped[TRACE_EVENT_COUNT];
 static FILE *trace_fp;
 static char *trace_file_name;
 
@@ -83,53 +102,157 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuf *tb, unsigned int idx,
+                             void *dataptr, size_t size)
+{
+    unsigned int off = idx & (tb->size - 1);
+    size_t len = MIN(size, tb->size - off);
+
+    memcpy(dataptr, tb->buf + off, len);
+    memcpy((uint8_t *)dataptr + len, tb->buf, size - len);
+}
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static unsigned int write_to_buffer(TraceThreadBuf *tb, unsigned int idx,
+                                    const void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
+    unsigned int off = idx & (tb->size - 1);
+    size_t len = MIN(size, tb->size - off);
+
+    memcpy(tb->buf + off, dataptr, len);
+    memcpy(tb->buf, (const uint8_t *)dataptr + len, size - len);
+    return idx + size; /* most callers wants to know where to write next */
+}
+
+static void trace_thread_exit(gpointer opaque)
+{
+    TraceThreadBuf *tb = opaque;
+
+    /* the writeout thread frees the buffer once it is drained; events
+     * from later thread-local destructors get a buffer of their own
+     */
+    trace_thread_buf = NULL;
+    g_atomic_int_set(&tb->exited, 1);
+}
+
+#if GLIB_CHECK_VERSION(2, 31, 0)
+static GPrivate the_trace_thread_key = G_PRIVATE_INIT(trace_thread_exit);
+static GPrivate *trace_thread_key = &the_trace_thread_key;
+#else
+static GPrivate *trace_thread_key;
+#endif
+
+/**
+ * Allocate the trace buffer of the calling thread
+ *
+ * Returns NULL if memory is short; the event is then dropped.
+ */
+static TraceThreadBuf *trace_thread_buf_new(void)
+{
+    TraceThreadBuf *tb;
+
+    /* dont use g_malloc, can deadlock when traced */
+    tb = calloc(1, sizeof(*tb));
+    if (!tb) {
+        return NULL;
     }
+    tb->size = trace_buf_len;
+    tb->buf = malloc(tb->size);
+    if (!tb->buf) {
+        free(tb);
+        return NULL;
+    }
+
+    do {
+        tb->next = trace_bufs;
+    } while (!g_atomic_pointer_compare_and_exchange(&trace_bufs,
+                                                    tb->next, tb));
+
+    g_private_set(trace_thread_key, tb);
+    trace_thread_buf = tb;
+    return tb;
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Free the buffers of exited threads that have been written out
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * Only called by the writeout thread.  Other threads only ever push new
+ * buffers at the head of the list, so entries past the head can be
+ * unlinked without atomic operations.
+ */
+static void trace_thread_bufs_reclaim(void)
+{
+    TraceThreadBuf **prev = (TraceThreadBuf **)&trace_bufs;
+    TraceThreadBuf *tb;
+
+    while ((tb = *prev) != NULL) {
+        if (!g_atomic_int_get(&tb->exited) || tb->tail != tb->head) {
+            prev = &tb->next;
+            continue;
+        }
+
+        if (prev == (TraceThreadBuf **)&trace_bufs &&
+            !g_atomic_pointer_compare_and_exchange(&trace_bufs,
+                                                   tb, tb->next)) {
+            /* a new buffer was pushed, @tb is no longer the head */
+            continue;
+        } else if (prev != (TraceThreadBuf **)&trace_bufs) {
+            *prev = tb->next;
+        }
+        free(tb->buf);
+        free(tb);
+    }
+}
+
+/**
+ * Write out the records that are complete at the time of the call
  *
- * Returns false if the record is not valid.
+ * The rings of all threads are merged by timestamp, so that the trace file
+ * stays in order across threads; ordering is only guaranteed for the
+ * records written out in the same pass.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static void writeout_records(void)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    TraceThreadBuf *tb, *next;
+    TraceRecord record, next_record;
+    size_t unused __attribute__ ((unused));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    for (tb = trace_bufs; tb; tb = tb->next) {
+        tb->writeout_head = tb->head;
     }
+    smp_rmb(); /* read memory barrier before accessing records */
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    for (;;) {
+        next = NULL;
+        for (tb = trace_bufs; tb; tb = tb->next) {
+            if (tb->tail == tb->writeout_head) {
+                continue;
+            }
+            read_from_buffer(tb, tb->tail, &record, sizeof(record));
+            if (!next || record.timestamp_ns < next_record.timestamp_ns) {
+                next = tb;
+                next_record = record;
+            }
+        }
+        if (!next) {
+            break;
+        }
+
+        tb = next;
+        if ((tb->tail & (tb->size - 1)) + next_record.length <= tb->size) {
+            unused = fwrite(tb->buf + (tb->tail & (tb->size - 1)),
+                            next_record.length, 1, trace_fp);
+        } else {
+            unsigned int len = tb->size - (tb->tail & (tb->size - 1));
+
+            unused = fwrite(tb->buf + (tb->tail & (tb->size - 1)),
+                            len, 1, trace_fp);
+            unused = fwrite(tb->buf, next_record.length - len, 1, trace_fp);
+        }
+        smp_mb(); /* finish reading before releasing the space */
+        tb->tail += next_record.length;
+    }
+
+    trace_thread_bufs_reclaim();
 }
 
 /**
@@ -164,12 +287,10 @@ static void wait_for_trace_records_available(void)
 
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
 
@@ -189,12 +310,7 @@ static gpointer writeout_thread(gpointer opaque)
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
-        }
+        writeout_records();
 
         fflush(trace_fp);
     }
@@ -203,83 +319,59 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+    TraceThreadBuf *tb = trace_thread_buf;
+    TraceRecord record = {
+        .event = event,
+        .timestamp_ns = get_clock(),
+        .length = sizeof(TraceRecord) + datasize,
+    };
+
+    if (!tb) {
+        tb = trace_thread_buf_new();
+    }
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    /* A signal handler that traces while a record is open drops its event,
+     * it would otherwise overwrite the open record.
+     */
+    if (!tb || tb->in_record ||
+        record.length > tb->size - (tb->head - tb->tail)) {
+        /* Trace Buffer Full, Event dropped ! */
+        g_atomic_int_inc(&dropped_events);
+        g_atomic_int_inc(&trace_events_dropped[event]);
+        return -ENOSPC;
+    }
+    tb->in_record = true;
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf = tb;
+    rec->tbuf_idx = tb->head;
+    rec->rec_off = write_to_buffer(tb, tb->head, &record, sizeof(record));
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+void trace_record_finish(TraceBufferRecord *rec)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
+    TraceThreadBuf *tb = rec->tbuf;
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
+    smp_wmb(); /* write barrier before publishing the record */
+    tb->head = rec->rec_off;
+    tb->in_record = false;
 
-void trace_record_finish(TraceBufferRecord *rec)
-{
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (tb->head - tb->tail > tb->size / 4) {
         flush_trace_file(false);
     }
 }
@@ -356,14 +448,34 @@ void st_flush_trace_buffer(void)
     flush_trace_file(true);
 }
 
+/**
+ * Set the size of the per-thread trace buffers
+ *
+ * @size        Size in bytes, rounded up to a power of two
+ *
+ * Only buffers of threads that start tracing afterwards are affected.
+ */
+void st_set_trace_buffer_size(size_t size)
+{
+    size = MAX(size, TRACE_BUF_LEN_MIN);
+    size = MIN(size, TRACE_BUF_LEN_MAX);
+    trace_buf_len = pow2ceil(size);
+}
+
 void trace_print_events(FILE *stream, fprintf_function stream_printf)
 {
     unsigned int i;
 
     for (i = 0; i < trace_event_count(); i++) {
         TraceEvent *ev = trace_event_id(i);
-        stream_printf(stream, "%s [Event ID %u] : state %u\n",
+        unsigned int dropped = g_atomic_int_get(&trace_events_dropped[i]);
+
+        stream_printf(stream, "%s [Event ID %u] : state %u",
                       trace_event_get_name(ev), i, trace_event_get_state_dynamic(ev));
+        if (dropped) {
+            stream_printf(stream, ", dropped %u", dropped);
+        }
+        stream_printf(stream, "\n");
     }
 }
 
@@ -416,6 +528,7 @@ bool trace_backend_init(const char *events, const char *file)
 #if !GLIB_CHECK_VERSION(2, 31, 0)
     trace_available_cond = g_cond_new();
     trace_empty_cond = g_cond_new();
+    trace_thread_key = g_private_new(trace_thread_exit);
 #endif
 
     thread = trace_thread_create(writeout_thread);
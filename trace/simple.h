@@ -22,8 +22,12 @@ void st_print_trace_file_status(FILE *stream, fprintf_function stream_printf);
 void st_set_trace_file_enabled(bool enable);
 bool st_set_trace_file(const char *file);
 void st_flush_trace_buffer(void);
+void st_set_trace_buffer_size(size_t size);
+
+struct TraceThreadBuf;
 
 typedef struct {
+    struct TraceThreadBuf *tbuf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
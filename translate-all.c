@@ -59,6 +59,7 @@
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#include "qemu/stats.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -71,6 +72,9 @@
 #endif
 
 #define SMC_BITMAP_USE_THRESHOLD 10
+/* Pages whose code was overwritten this many times get translated one
+   instruction per TB until the next tb_flush.  */
+#define SMC_HOT_PAGE_THRESHOLD 64
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -78,7 +82,11 @@ typedef struct PageDesc {
     /* in order to optimize self modifying code, we count the number
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
+    /* The bitmap may have stale bits for TBs that were invalidated
+       since it was built; it is rebuilt when a write hits one.  */
     uint8_t *code_bitmap;
+    /* number of writes that invalidated TBs on this page */
+    unsigned int code_inval_count;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -121,6 +129,13 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* exported through query-stats, unlike the tb_ctx counters */
+static Stats *tcg_stats;
+static StatsCounter *tcg_stat_translations;
+static StatsCounter *tcg_stat_flushes;
+static StatsCounter *tcg_stat_invalidations;
+static StatsHistogram *tcg_stat_code_bytes;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -136,6 +151,25 @@ void cpu_gen_init(void)
    '*gen_code_size_ptr' contains the size of the generated code (host
    code).
 */
+bool tb_profile_enabled;
+static int64_t tb_profile_start;
+static int64_t tb_profile_stop;
+static int64_t tb_profile_gen_time;
+static int64_t tb_profile_tlb_misses;
+
+static uint32_t tb_count_helper_calls(TCGContext *s)
+{
+    uint16_t *opc;
+    uint32_t n = 0;
+
+    for (opc = s->gen_opc_buf; opc < s->gen_opc_ptr; opc++) {
+        if (*opc == INDEX_op_call) {
+            n++;
+        }
+    }
+    return n;
+}
+
 int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 {
     TCGContext *s = &tcg_ctx;
@@ -153,6 +187,9 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     tcg_func_start(s);
 
     gen_intermediate_code(env, tb);
+    if (unlikely(tb_profile_enabled)) {
+        tb->helper_calls = tb_count_helper_calls(s);
+    }
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
@@ -555,6 +592,38 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+/* Split the code buffer into regions that are large enough to be
+   worth retiring one at a time.  The reserve for the last TB of a
+   region is lost in each of them.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t reserve = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    size_t region_size;
+    int i, n, max_tbs;
+
+    n = tcg_ctx.code_gen_buffer_size / (8 * reserve);
+    n = MAX(1, MIN(n, TB_MAX_REGIONS));
+    region_size = (tcg_ctx.code_gen_buffer_size / n) & ~(CODE_GEN_ALIGN - 1);
+    max_tbs = tcg_ctx.code_gen_max_blocks / n;
+
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+        uint8_t *end;
+
+        r->code_start = tcg_ctx.code_gen_buffer + i * region_size;
+        end = (i == n - 1 ? tcg_ctx.code_gen_buffer +
+               tcg_ctx.code_gen_buffer_size : r->code_start + region_size);
+        r->code_limit = end - reserve;
+        r->code_ptr = r->code_start;
+        r->tbs = ctx->tbs + i * max_tbs;
+        r->nb_tbs = 0;
+        r->max_tbs = max_tbs;
+    }
+    ctx->nb_regions = n;
+    ctx->cur_region = 0;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -582,6 +651,7 @@ static inline void code_gen_alloc(size_t tb_size)
             CODE_GEN_AVG_BLOCK_SIZE;
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    tb_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -594,6 +664,11 @@ void tcg_exec_init(unsigned long tb_size)
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
+    tcg_stats = stats_new("tcg");
+    tcg_stat_translations = stats_add_counter(tcg_stats, "translations");
+    tcg_stat_flushes = stats_add_counter(tcg_stats, "flushes");
+    tcg_stat_invalidations = stats_add_counter(tcg_stats, "invalidations");
+    tcg_stat_code_bytes = stats_add_histogram(tcg_stats, "code-bytes");
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -610,16 +685,21 @@ bool tcg_enabled(void)
    too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= r->max_tbs ||
+        tcg_ctx.code_gen_ptr >= r->code_limit) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
+    tb->tlb_miss_count = 0;
+    tb->helper_calls = 0;
+    tb->gen_time = 0;
     return tb;
 }
 
@@ -628,13 +708,31 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
 
+/* size of the generated code in all regions */
+static size_t tb_code_size(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        size += (i == ctx->cur_region ? tcg_ctx.code_gen_ptr : r->code_ptr) -
+                r->code_start;
+    }
+    return size;
+}
+
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
     if (p->code_bitmap) {
@@ -657,6 +755,7 @@ static void page_flush_tb_1(int level, void **lp)
 
         for (i = 0; i < L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
+            pd[i].code_inval_count = 0;
             invalidate_page_bitmap(pd + i);
         }
     } else {
@@ -682,6 +781,7 @@ static void page_flush_tb(void)
 void tb_flush(CPUArchState *env1)
 {
     CPUState *cpu;
+    int i;
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -695,6 +795,13 @@ void tb_flush(CPUArchState *env1)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        r->nb_tbs = 0;
+        r->code_ptr = r->code_start;
+    }
+    tcg_ctx.tb_ctx.cur_region = 0;
 
     CPU_FOREACH(cpu) {
         CPUArchState *env = cpu->env_ptr;
@@ -710,6 +817,40 @@ void tb_flush(CPUArchState *env1)
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    /* the gdbstub flushes even when TCG is not in use */
+    if (tcg_stats) {
+        stats_counter_inc(tcg_stat_flushes);
+    }
+}
+
+/* Make room for new translations when the current region is full:
+   move to the next region and invalidate the TBs it still holds.
+   Only these TBs are removed from the hash tables, page lists and
+   jump lists; with a single region, this is a tb_flush.  */
+static void tb_retire_region(CPUArchState *env)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    int i;
+
+    if (ctx->nb_regions == 1) {
+        tb_flush(env);
+        return;
+    }
+
+    ctx->regions[ctx->cur_region].code_ptr = tcg_ctx.code_gen_ptr;
+    ctx->cur_region = (ctx->cur_region + 1) % ctx->nb_regions;
+    r = &ctx->regions[ctx->cur_region];
+    for (i = 0; i < r->nb_tbs; i++) {
+        if (!(r->tbs[i].cflags & CF_INVALID)) {
+            tb_phys_invalidate(&r->tbs[i], -1);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->code_ptr = r->code_start;
+    tcg_ctx.code_gen_ptr = r->code_start;
+    ctx->tb_region_retire_count++;
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -838,12 +979,16 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        if (!p->first_tb) {
+            invalidate_page_bitmap(p);
+        }
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        if (!p->first_tb) {
+            invalidate_page_bitmap(p);
+        }
     }
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
@@ -877,7 +1022,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
+    tb->cflags |= CF_INVALID;
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
+    stats_counter_inc(tcg_stat_invalidations);
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -907,31 +1054,43 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
+/* mark the bytes of page N of TB in the code bitmap of P */
+static void tb_page_set_bits(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
-    p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    if (p->code_bitmap) {
+        memset(p->code_bitmap, 0, TARGET_PAGE_SIZE / 8);
+    } else {
+        p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    }
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+        tb_page_set_bits(p, tb, n);
         tb = tb->page_next[n];
     }
 }
@@ -945,12 +1104,23 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    PageDesc *p;
 
     phys_pc = get_page_addr_code(env, pc);
+    if (cflags == 0) {
+        /* Code on this page keeps being overwritten (e.g. by a JIT
+           compiler in the guest).  Translate single instructions, so
+           that each write throws away as little code as possible and
+           never needs to restart the TB that does it.  */
+        p = page_find(phys_pc >> TARGET_PAGE_BITS);
+        if (p && p->code_inval_count >= SMC_HOT_PAGE_THRESHOLD) {
+            cflags = 1;
+        }
+    }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* reuse the oldest region */
+        tb_retire_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -961,9 +1131,19 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    if (unlikely(tb_profile_enabled)) {
+        int64_t ti = get_clock();
+
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb->gen_time = get_clock() - ti;
+        tb_profile_gen_time += tb->gen_time;
+    } else {
+        cpu_gen_code(env, tb, &code_gen_size);
+    }
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    stats_counter_inc(tcg_stat_translations);
+    stats_histogram_record(tcg_stat_code_bytes, code_gen_size);
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -975,6 +1155,22 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     return tb;
 }
 
+/* Replace a hot TB with a superblock that the front end extends across
+   direct jumps.  The old TB is unlinked, so that nothing chains to it
+   anymore; the caller must not chain the previous TB to the result.  */
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    int flags = tb->flags;
+
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(env, pc, cs_base, flags, CF_TRACE);
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tcg_ctx.tb_ctx.tb_trace_count++;
+    return tb;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1009,7 +1205,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 #endif
     tb_page_addr_t tb_start, tb_end;
     PageDesc *p;
-    int n;
+    int n, nb_invalidated = 0;
 #ifdef TARGET_HAS_PRECISE_SMC
     int current_tb_not_found = is_cpu_write_access;
     TranslationBlock *current_tb = NULL;
@@ -1085,6 +1281,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                 cpu->current_tb = NULL;
             }
             tb_phys_invalidate(tb, -1);
+            nb_invalidated++;
             if (cpu != NULL) {
                 cpu->current_tb = saved_tb;
                 if (cpu->interrupt_request && cpu->current_tb) {
@@ -1094,6 +1291,14 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         }
         tb = tb_next;
     }
+    if (is_cpu_write_access && nb_invalidated) {
+        if (++p->code_inval_count == SMC_HOT_PAGE_THRESHOLD) {
+            tcg_ctx.tb_ctx.smc_hot_page_count++;
+        }
+    } else if (p->code_bitmap && p->first_tb) {
+        /* the write only hit stale bits of the bitmap */
+        build_page_bitmap(p);
+    }
 #if !defined(CONFIG_USER_ONLY)
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
@@ -1216,6 +1421,24 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
 }
 #endif
 
+#if defined(CONFIG_USER_ONLY)
+/* Number of pages that are writable for the guest, but were made
+   read-only because they contain translated code.  */
+static unsigned long pages_write_protected;
+
+static inline bool page_flags_protected(int flags)
+{
+    return (flags & PAGE_WRITE_ORG) && !(flags & PAGE_WRITE);
+}
+
+static void page_desc_set_flags(PageDesc *p, int flags)
+{
+    pages_write_protected += page_flags_protected(flags);
+    pages_write_protected -= page_flags_protected(p->flags);
+    p->flags = flags;
+}
+#endif
+
 /* add the tb in the target page and protect it if necessary */
 static inline void tb_alloc_page(TranslationBlock *tb,
                                  unsigned int n, tb_page_addr_t page_addr)
@@ -1232,7 +1455,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap) {
+        tb_page_set_bits(p, tb, n);
+    }
 
 #if defined(TARGET_HAS_SMC) || 1
 
@@ -1254,7 +1479,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
                 continue;
             }
             prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
+            page_desc_set_flags(p2, p2->flags & ~PAGE_WRITE);
           }
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
@@ -1322,23 +1547,34 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
-    uintptr_t v;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, i;
+    uintptr_t v, end;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    /* find the region, then the TB within it; the first TB of a
+       region starts at code_start */
+    for (i = ctx->nb_regions - 1; i > 0; i--) {
+        if (tc_ptr >= (uintptr_t)ctx->regions[i].code_start) {
+            break;
+        }
+    }
+    r = &ctx->regions[i];
+    end = (uintptr_t)(i == ctx->cur_region ? tcg_ctx.code_gen_ptr
+                                           : r->code_ptr);
+    if (r->nb_tbs <= 0) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    if (tc_ptr < (uintptr_t)r->code_start || tc_ptr >= end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1348,7 +1584,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1458,7 +1694,7 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
         cpu_abort(env, "TB too big during recompile");
     }
 
-    cflags = n | CF_LAST_IO;
+    cflags = n | CF_LAST_IO | (tb->cflags & CF_TRACE);
     pc = tb->pc;
     cs_base = tb->cs_base;
     flags = tb->flags;
@@ -1491,49 +1727,51 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size = tb_code_size();
     TranslationBlock *tb;
+    TBRegion *r;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (j = 0; j < tcg_ctx.tb_ctx.nb_regions; j++) {
+        r = &tcg_ctx.tb_ctx.regions[j];
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1546,12 +1784,118 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                         tcg_ctx.tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region retires   %d\n",
+            tcg_ctx.tb_ctx.tb_region_retire_count);
+    cpu_fprintf(f, "TB trace count      %d\n", tcg_ctx.tb_ctx.tb_trace_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "SMC hot pages       %d\n",
+            tcg_ctx.tb_ctx.smc_hot_page_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB fill count      %d\n", tlb_fill_count);
+    cpu_fprintf(f, "TLB resize count    %d\n", tlb_resize_count);
+    cpu_fprintf(f, "TLB victim hits     %d (%d%%)\n", tlb_victim_hit_count,
+                tlb_victim_hit_count + tlb_fill_count ?
+                (tlb_victim_hit_count * 100) /
+                (tlb_victim_hit_count + tlb_fill_count) : 0);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+/* Profiling flushes the translations, so that counts start from zero,
+   and disables chaining, so that cpu_exec sees every TB execution.  */
+void tb_profile_set(CPUArchState *env, bool enable)
+{
+    if (enable == tb_profile_enabled) {
+        return;
+    }
+    if (enable) {
+        tb_flush(env);
+        tb_profile_start = get_clock();
+        tb_profile_gen_time = 0;
+        tb_profile_tlb_misses = 0;
+    } else {
+        tb_profile_stop = get_clock();
+    }
+    tb_profile_enabled = enable;
+}
+
+/* called on softmmu misses in the direct-mapped TLB */
+void tb_profile_tlb_miss(uintptr_t retaddr)
+{
+    TranslationBlock *tb;
+
+    tb_profile_tlb_misses++;
+    if (retaddr) {
+        tb = tb_find_pc(retaddr);
+        if (tb) {
+            tb->tlb_miss_count++;
+        }
+    }
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TranslationBlock *ta = *(TranslationBlock * const *)a;
+    const TranslationBlock *tb = *(TranslationBlock * const *)b;
+
+    if (ta->exec_count != tb->exec_count) {
+        return ta->exec_count > tb->exec_count ? -1 : 1;
+    }
+    return 0;
+}
+
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int count)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock **tbs, *tb;
+    uint64_t total_exec = 0;
+    int64_t elapsed;
+    int i, j, n = 0;
+
+    if (!tb_profile_start) {
+        cpu_fprintf(f, "TB profiling is not enabled, use \"tb-profile on\"\n");
+        return;
+    }
+
+    tbs = g_new(TranslationBlock *, ctx->nb_tbs + 1);
+    for (j = 0; j < ctx->nb_regions; j++) {
+        for (i = 0; i < ctx->regions[j].nb_tbs; i++) {
+            tb = &ctx->regions[j].tbs[i];
+            if (!(tb->cflags & CF_INVALID)) {
+                tbs[n++] = tb;
+                total_exec += tb->exec_count;
+            }
+        }
+    }
+    qsort(tbs, n, sizeof(*tbs), tb_profile_cmp);
+
+    elapsed = (tb_profile_enabled ? get_clock() : tb_profile_stop) -
+              tb_profile_start;
+    cpu_fprintf(f, "profiling %s for %" PRId64 " ms\n",
+                tb_profile_enabled ? "enabled" : "stopped",
+                elapsed / 1000000);
+    cpu_fprintf(f, "translation time    %" PRId64 " ms (%d%%)\n",
+                tb_profile_gen_time / 1000000,
+                elapsed ? (int)(tb_profile_gen_time * 100 / elapsed) : 0);
+    cpu_fprintf(f, "TB executions       %" PRIu64 " in %d live TBs\n",
+                total_exec, n);
+    cpu_fprintf(f, "TLB misses          %" PRId64 "\n", tb_profile_tlb_misses);
+
+    cpu_fprintf(f, "\n%-18s %12s %5s %7s %10s %8s\n",
+                "guest PC", "executions", "size", "helpers", "TLB misses",
+                "gen us");
+    for (i = 0; i < n && i < count; i++) {
+        char pc[20];
+
+        tb = tbs[i];
+        snprintf(pc, sizeof(pc), "0x" TARGET_FMT_lx, tb->pc);
+        cpu_fprintf(f, "%-18s %12u %5u %7u %10u %8" PRId64 "\n",
+                    pc, tb->exec_count, tb->size, tb->helper_calls,
+                    tb->tlb_miss_count, tb->gen_time / 1000);
+    }
+    g_free(tbs);
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -1673,6 +2017,139 @@ void page_dump(FILE *f)
     walk_memory_regions(f, dump_region);
 }
 
+/* The ranges of guest addresses whose pages have non-zero flags, keyed by
+   their first address, with the flags last given to page_set_flags.
+   Ranges do not overlap, and touching ranges have different flags, so
+   searching for free address space or checking a buffer can skip whole
+   mappings instead of testing every page.  */
+typedef struct PageRange {
+    target_ulong start;
+    target_ulong last;
+    int flags;
+} PageRange;
+
+static GTree *page_ranges;
+
+static gint page_range_cmp(gconstpointer a, gconstpointer b)
+{
+    const PageRange *ra = a, *rb = b;
+
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+typedef struct PageRangeSearch {
+    target_ulong addr;
+    PageRange *below;
+} PageRangeSearch;
+
+static gint page_range_search(gconstpointer key, gconstpointer opaque)
+{
+    PageRange *r = (PageRange *)key;
+    PageRangeSearch *s = (PageRangeSearch *)opaque;
+
+    if (r->start > s->addr) {
+        return -1;
+    }
+    s->below = r;
+    return r->last >= s->addr ? 0 : 1;
+}
+
+/* Return the range with the highest start not above @addr */
+static PageRange *page_range_below(target_ulong addr)
+{
+    PageRangeSearch s = { .addr = addr };
+
+    if (page_ranges) {
+        g_tree_search(page_ranges, page_range_search, &s);
+    }
+    return s.below;
+}
+
+static void page_range_insert(target_ulong start, target_ulong last,
+                              int flags)
+{
+    PageRange *r = g_new(PageRange, 1);
+
+    if (!page_ranges) {
+        page_ranges = g_tree_new_full((GCompareDataFunc)page_range_cmp,
+                                      NULL, NULL, g_free);
+    }
+    r->start = start;
+    r->last = last;
+    r->flags = flags;
+    g_tree_insert(page_ranges, r, r);
+}
+
+/* [start, last] must not overlap any range */
+static void page_range_add(target_ulong start, target_ulong last, int flags)
+{
+    PageRange *r;
+
+    /* merge with the neighbours that have the same flags */
+    if (start > 0) {
+        r = page_range_below(start - 1);
+        if (r && r->last == start - 1 && r->flags == flags) {
+            start = r->start;
+            g_tree_remove(page_ranges, r);
+        }
+    }
+    if (last != (target_ulong)-1) {
+        r = page_range_below(last + 1);
+        if (r && r->start == last + 1 && r->flags == flags) {
+            last = r->last;
+            g_tree_remove(page_ranges, r);
+        }
+    }
+    page_range_insert(start, last, flags);
+}
+
+static void page_range_remove(target_ulong start, target_ulong last)
+{
+    PageRange *r, old;
+
+    for (;;) {
+        r = page_range_below(last);
+        if (!r || r->last < start) {
+            break;
+        }
+        old = *r;
+        g_tree_remove(page_ranges, r);
+        if (old.start < start) {
+            page_range_insert(old.start, start - 1, old.flags);
+        }
+        if (old.last > last) {
+            page_range_insert(last + 1, old.last, old.flags);
+        }
+    }
+}
+
+/* Find the highest range of @size bytes in [@min, @end) that only has
+   pages without flags, and starts at a multiple of @align (a power of
+   two).  Returns -1 if there is none.  The mmap_lock should already be
+   held.  */
+target_ulong page_find_range_empty(target_ulong min, target_ulong end,
+                                   target_ulong size, target_ulong align)
+{
+    target_ulong addr;
+    PageRange *r;
+
+    for (;;) {
+        if (size == 0 || end < size) {
+            return -1;
+        }
+        addr = (end - size) & ~(align - 1);
+        if (addr < min) {
+            return -1;
+        }
+        r = page_range_below(addr + size - 1);
+        if (!r || r->last < addr) {
+            return addr;
+        }
+        /* the candidate overlaps r, continue below it */
+        end = r->start;
+    }
+}
+
 int page_get_flags(target_ulong address)
 {
     PageDesc *p;
@@ -1718,13 +2195,19 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
             p->first_tb) {
             tb_invalidate_phys_page(addr, 0, NULL, false);
         }
-        p->flags = flags;
+        page_desc_set_flags(p, flags);
+    }
+
+    page_range_remove(start, end - 1);
+    if (flags) {
+        page_range_add(start, end - 1, flags);
     }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
     PageDesc *p;
+    PageRange *r;
     target_ulong end;
     target_ulong addr;
 
@@ -1747,24 +2230,28 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     end = TARGET_PAGE_ALIGN(start + len);
     start = start & TARGET_PAGE_MASK;
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
+    /* the range tree is changed by mmap in other threads */
+    mmap_lock();
+    for (addr = start; ; addr = r->last + 1) {
+        r = page_range_below(addr);
+        if (!r || r->last < addr ||
+            !(r->flags & PAGE_VALID) ||
+            ((flags & PAGE_READ) && !(r->flags & PAGE_READ)) ||
+            ((flags & PAGE_WRITE) && !(r->flags & PAGE_WRITE_ORG))) {
+            mmap_unlock();
             return -1;
         }
-        if (!(p->flags & PAGE_VALID)) {
-            return -1;
+        if (r->last >= end - 1) {
+            break;
         }
+    }
+    mmap_unlock();
 
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
-            return -1;
-        }
-        if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
-                return -1;
-            }
+    if ((flags & PAGE_WRITE) && pages_write_protected) {
+        for (addr = start, len = end - start;
+             len != 0;
+             len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
+            p = page_find(addr >> TARGET_PAGE_BITS);
             /* unprotect the page if it was put read-only because it
                contains translated code */
             if (!(p->flags & PAGE_WRITE)) {
@@ -1772,7 +2259,6 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
                     return -1;
                 }
             }
-            return 0;
         }
     }
     return 0;
@@ -1806,7 +2292,7 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
         prot = 0;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
             p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
+            page_desc_set_flags(p, p->flags | PAGE_WRITE);
             prot |= p->flags;
 
             /* and since the content will be modified, we must invalidate
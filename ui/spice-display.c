@@ -44,6 +44,12 @@ int qemu_spice_rect_is_empty(const QXLRect* r)
     return r->top == r->bottom || r->left == r->right;
 }
 
+static bool qemu_spice_rect_intersects(const QXLRect *a, const QXLRect *b)
+{
+    return a->left < b->right && b->left < a->right &&
+           a->top < b->bottom && b->top < a->bottom;
+}
+
 void qemu_spice_rect_union(QXLRect *dest, const QXLRect *r)
 {
     if (qemu_spice_rect_is_empty(r)) {
@@ -143,6 +149,23 @@ int qemu_spice_display_is_running(SimpleSpiceDisplay *ssd)
     return spice_display_is_running;
 }
 
+/*
+ * Whether spice-server may still be reading part of @rect from the mirror.
+ * Called with ssd->lock held.
+ */
+static bool qemu_spice_mirror_is_shared(SimpleSpiceDisplay *ssd,
+                                        const QXLRect *rect)
+{
+    SimpleSpiceUpdate *update;
+
+    QTAILQ_FOREACH(update, &ssd->shared_updates, shared_next) {
+        if (qemu_spice_rect_intersects(&update->drawable.bbox, rect)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
                                          QXLRect *rect)
 {
@@ -165,7 +188,6 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
 
     bw       = rect->right - rect->left;
     bh       = rect->bottom - rect->top;
-    update->bitmap = g_malloc(bw * bh * 4);
 
     drawable->bbox            = *rect;
     drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
@@ -188,22 +210,43 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ssd->unique++);
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags      = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
-    image->bitmap.stride     = bw * 4;
     image->descriptor.width  = image->bitmap.x = bw;
     image->descriptor.height = image->bitmap.y = bh;
-    image->bitmap.data = (uintptr_t)(update->bitmap);
     image->bitmap.palette = 0;
     image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
 
-    dest = pixman_image_create_bits(PIXMAN_x8r8g8b8, bw, bh,
-                                    (void *)update->bitmap, bw * 4);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
-                           rect->left, rect->top, 0, 0,
-                           rect->left, rect->top, bw, bh);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
-                           rect->left, rect->top, 0, 0,
-                           0, 0, bw, bh);
-    pixman_image_unref(dest);
+    if (pixman_image_get_format(ssd->mirror) == PIXMAN_x8r8g8b8 &&
+        !qemu_spice_mirror_is_shared(ssd, rect)) {
+        /* Hand the mirror to spice-server directly, without a copy */
+        int stride = pixman_image_get_stride(ssd->mirror);
+        uint8_t *data = (uint8_t *)pixman_image_get_data(ssd->mirror);
+
+        pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
+                               rect->left, rect->top, 0, 0,
+                               rect->left, rect->top, bw, bh);
+        image->bitmap.stride = stride;
+        image->bitmap.data = (uintptr_t)(data + rect->top * stride +
+                                         rect->left * 4);
+        update->shared = true;
+        QTAILQ_INSERT_TAIL(&ssd->shared_updates, update, shared_next);
+    } else {
+        /*
+         * Copy on write: spice-server is still reading this part of the
+         * mirror, or it has the wrong format.  Send a private copy and leave
+         * the mirror alone; the area is sent again from the mirror later.
+         */
+        update->bitmap = g_malloc(bw * bh * 4);
+        image->bitmap.stride = bw * 4;
+        image->bitmap.data = (uintptr_t)(update->bitmap);
+
+        dest = pixman_image_create_bits(PIXMAN_x8r8g8b8, bw, bh,
+                                        (void *)update->bitmap, bw * 4);
+        pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, dest,
+                               rect->left, rect->top, 0, 0,
+                               0, 0, bw, bh);
+        pixman_image_unref(dest);
+        qemu_spice_rect_union(&ssd->stale, rect);
+    }
 
     cmd->type = QXL_CMD_DRAW;
     cmd->data = (uintptr_t)drawable;
@@ -219,6 +262,12 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     int y, yoff, x, xoff, blk, bw;
     int bpp = surface_bytes_per_pixel(ssd->ds);
     uint8_t *guest, *mirror;
+    QXLRect stale = ssd->stale;
+
+    /* Areas sent from a private copy last time are sent again, from the
+     * mirror, even if the guest did not touch them */
+    qemu_spice_rect_union(&ssd->dirty, &stale);
+    memset(&ssd->stale, 0, sizeof(ssd->stale));
 
     if (qemu_spice_rect_is_empty(&ssd->dirty)) {
         return;
@@ -242,7 +291,9 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
             xoff = x * bpp;
             blk = x / blksize;
             bw = MIN(blksize, ssd->dirty.right - x);
-            if (memcmp(guest + yoff + xoff,
+            if (!(y >= stale.top && y < stale.bottom &&
+                  x < stale.right && x + bw > stale.left) &&
+                memcmp(guest + yoff + xoff,
                        mirror + yoff + xoff,
                        bw * bpp) == 0) {
                 if (dirty_top[blk] != -1) {
@@ -281,16 +332,29 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
 }
 
+/* Called with ssd->lock held */
+static void qemu_spice_free_update(SimpleSpiceDisplay *ssd,
+                                   SimpleSpiceUpdate *update)
+{
+    if (update->shared) {
+        QTAILQ_REMOVE(&ssd->shared_updates, update, shared_next);
+    }
+    g_free(update->bitmap);
+    g_free(update);
+}
+
 /*
  * Called from spice server thread context (via interface_release_resource)
  * We do *not* hold the global qemu mutex here, so extra care is needed
  * when calling qemu functions.  QEMU interfaces used:
  *    - g_free (underlying glibc free is re-entrant).
+ *    - qemu_mutex_lock/unlock, for the list of updates sharing the mirror.
  */
 void qemu_spice_destroy_update(SimpleSpiceDisplay *sdpy, SimpleSpiceUpdate *update)
 {
-    g_free(update->bitmap);
-    g_free(update);
+    qemu_mutex_lock(&sdpy->lock);
+    qemu_spice_free_update(sdpy, update);
+    qemu_mutex_unlock(&sdpy->lock);
 }
 
 void qemu_spice_create_host_memslot(SimpleSpiceDisplay *ssd)
@@ -338,6 +402,7 @@ void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd)
 {
     qemu_mutex_init(&ssd->lock);
     QTAILQ_INIT(&ssd->updates);
+    QTAILQ_INIT(&ssd->shared_updates);
     ssd->mouse_x = -1;
     ssd->mouse_y = -1;
     if (ssd->num_surfaces == 0) {
@@ -375,24 +440,29 @@ void qemu_spice_display_switch(SimpleSpiceDisplay *ssd,
     dprint(1, "%s/%d:\n", __func__, ssd->qxl.id);
 
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
-    if (ssd->surface) {
-        pixman_image_unref(ssd->surface);
-        ssd->surface = NULL;
-        pixman_image_unref(ssd->mirror);
-        ssd->mirror = NULL;
-    }
 
     qemu_mutex_lock(&ssd->lock);
     ssd->ds = surface;
     while ((update = QTAILQ_FIRST(&ssd->updates)) != NULL) {
         QTAILQ_REMOVE(&ssd->updates, update, next);
-        qemu_spice_destroy_update(ssd, update);
+        qemu_spice_free_update(ssd, update);
     }
     qemu_mutex_unlock(&ssd->lock);
     qemu_spice_destroy_host_primary(ssd);
+
+    /* Destroying the primary surface released all updates, nothing reads
+     * from the mirror anymore */
+    if (ssd->surface) {
+        pixman_image_unref(ssd->surface);
+        ssd->surface = NULL;
+        pixman_image_unref(ssd->mirror);
+        ssd->mirror = NULL;
+    }
+
     qemu_spice_create_host_primary(ssd);
 
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
+    memset(&ssd->stale, 0, sizeof(ssd->stale));
     ssd->notify++;
 }
 
@@ -2670,6 +2670,8 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     uint8_t *guest_row;
     uint8_t *server_row;
     int cmp_bytes;
+    int nchunks = width / 16;
+    DECLARE_BITMAP(changed, VNC_DIRTY_BITS);
     VncState *vs;
     int has_dirty = 0;
     pixman_image_t *tmpbuf = NULL;
@@ -2700,7 +2702,6 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
             int x;
             uint8_t *guest_ptr;
-            uint8_t *server_ptr;
 
             if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
                 qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2708,19 +2709,19 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             } else {
                 guest_ptr = guest_row;
             }
-            server_ptr = server_row;
 
-            for (x = 0; x + 15 < width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
+            /* Compare and copy whole runs of dirty chunks at once */
+            bitmap_copy(changed, vd->guest.dirty[y], nchunks);
+            bitmap_clear(vd->guest.dirty[y], 0, nchunks);
+            buffer_copy_changed_chunks(server_row, guest_ptr, cmp_bytes,
+                                       nchunks, changed);
+
+            for (x = find_next_bit(changed, nchunks, 0); x < nchunks;
+                 x = find_next_bit(changed, nchunks, x + 1)) {
                 if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
+                    vnc_rect_updated(vd, x * 16, y, &tv);
                 QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
+                    set_bit(x, vs->dirty[y]);
                 }
                 has_dirty++;
             }
@@ -153,6 +153,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;               /* encoder threads using the server surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -237,6 +238,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;               /* being encoded by a worker thread */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
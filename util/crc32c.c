@@ -105,11 +105,185 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t *data,
+                               unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
 }
 
+#if (defined(CONFIG_SSE42_OPT) && defined(CONFIG_CPUID_H)) || \
+    defined(CONFIG_ARM_CRC32_OPT)
+/*
+ * The CRC instructions have a latency of several cycles but can start one
+ * every cycle, so large buffers are split in three streams that are
+ * checksummed independently and combined at the end of each round.
+ * Combining needs the CRC of the first streams advanced over the length
+ * of a stream of zeroes.  That is linear in the CRC, and is done with one
+ * table lookup per byte.
+ */
+#define CRC32C_STREAM_LEN 1024
+
+static uint32_t crc32c_shift_table[4][256];
+
+static void crc32c_init_shift_table(void)
+{
+    uint32_t basis[32], crc;
+    int bit, i, j;
+
+    for (bit = 0; bit < 32; bit++) {
+        crc = 1U << bit;
+        for (i = 0; i < CRC32C_STREAM_LEN; i++) {
+            crc = crc32c_table[crc & 0xFF] ^ (crc >> 8);
+        }
+        basis[bit] = crc;
+    }
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 256; j++) {
+            crc = 0;
+            for (bit = 0; bit < 8; bit++) {
+                if (j & (1 << bit)) {
+                    crc ^= basis[i * 8 + bit];
+                }
+            }
+            crc32c_shift_table[i][j] = crc;
+        }
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+    return crc32c_shift_table[0][crc & 0xFF] ^
+           crc32c_shift_table[1][(crc >> 8) & 0xFF] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xFF] ^
+           crc32c_shift_table[3][crc >> 24];
+}
+
+/* Define an accelerated crc32c function from the instructions that
+ * process a byte and a word, running three streams for large buffers.
+ */
+#define CRC32C_ACCEL(name, attr, word_t, ld_word, crc_word, crc_byte)     \
+static uint32_t attr name(uint32_t crc, const uint8_t *data,               \
+                          unsigned int length)                             \
+{                                                                          \
+    const uint8_t *end;                                                    \
+    uint32_t crc1, crc2;                                                   \
+                                                                           \
+    while (length >= 3 * CRC32C_STREAM_LEN) {                              \
+        crc1 = crc2 = 0;                                                   \
+        end = data + CRC32C_STREAM_LEN;                                    \
+        for (; data < end; data += sizeof(word_t)) {                       \
+            crc = crc_word(crc, ld_word(data));                            \
+            crc1 = crc_word(crc1, ld_word(data + CRC32C_STREAM_LEN));      \
+            crc2 = crc_word(crc2, ld_word(data + 2 * CRC32C_STREAM_LEN));  \
+        }                                                                  \
+        crc = crc32c_shift(crc) ^ crc1;                                    \
+        crc = crc32c_shift(crc) ^ crc2;                                    \
+        data += 2 * CRC32C_STREAM_LEN;                                     \
+        length -= 3 * CRC32C_STREAM_LEN;                                   \
+    }                                                                      \
+                                                                           \
+    for (; length >= sizeof(word_t); length -= sizeof(word_t)) {           \
+        crc = crc_word(crc, ld_word(data));                                \
+        data += sizeof(word_t);                                            \
+    }                                                                      \
+    while (length--) {                                                     \
+        crc = crc_byte(crc, *data++);                                      \
+    }                                                                      \
+    return crc;                                                            \
+}
+#endif
+
+#if defined(CONFIG_SSE42_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <nmmintrin.h>
+
+#ifndef bit_SSE4_2
+#define bit_SSE4_2 (1 << 20)
+#endif
+
+#ifdef __x86_64__
+#define crc32c_sse42_word(crc, v) ((uint32_t)_mm_crc32_u64(crc, v))
+CRC32C_ACCEL(crc32c_sse42, __attribute__((target("sse4.2"))),
+             uint64_t, ldq_le_p, crc32c_sse42_word, _mm_crc32_u8)
+#else
+#define crc32c_sse42_word(crc, v) _mm_crc32_u32(crc, v)
+CRC32C_ACCEL(crc32c_sse42, __attribute__((target("sse4.2"))),
+             uint32_t, ldl_le_p, crc32c_sse42_word, _mm_crc32_u8)
+#endif
+
+static bool cpu_has_sse42(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 1) {
+        return false;
+    }
+    __cpuid(1, eax, ebx, ecx, edx);
+    return ecx & bit_SSE4_2;
+}
+#endif
+
+#ifdef CONFIG_ARM_CRC32_OPT
+#include <sys/auxv.h>
+#include <arm_acle.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+CRC32C_ACCEL(crc32c_armv8, __attribute__((target("+crc"))),
+             uint64_t, ldq_le_p, __crc32cd, __crc32cb)
+
+static bool cpu_has_crc32(void)
+{
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#endif
+
+static uint32_t (*crc32c_accel)(uint32_t crc, const uint8_t *data,
+                                unsigned int length) = crc32c_generic;
+
+static void init_accel(void)
+{
+    crc32c_accel = crc32c_generic;
+#if defined(CONFIG_SSE42_OPT) && defined(CONFIG_CPUID_H)
+    if (cpu_has_sse42()) {
+        crc32c_accel = crc32c_sse42;
+    }
+#endif
+#ifdef CONFIG_ARM_CRC32_OPT
+    if (cpu_has_crc32()) {
+        crc32c_accel = crc32c_armv8;
+    }
+#endif
+}
+
+static void __attribute__((constructor)) init_crc32c(void)
+{
+#if (defined(CONFIG_SSE42_OPT) && defined(CONFIG_CPUID_H)) || \
+    defined(CONFIG_ARM_CRC32_OPT)
+    crc32c_init_shift_table();
+#endif
+    init_accel();
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_accel(crc, data, length) ^ 0xffffffff;
+}
+
+bool test_crc32c_next_accel(void)
+{
+    if (crc32c_accel == crc32c_generic) {
+        /* Start over with the fastest implementation */
+        init_accel();
+        return false;
+    }
+
+    crc32c_accel = crc32c_generic;
+    return true;
+}
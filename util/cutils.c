@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
+#include "qemu/bitops.h"
 #include <math.h>
 
 #include "qemu/sockets.h"
@@ -178,19 +179,21 @@ int qemu_fdatasync(int fd)
  * down to a multiple of sizeof(VECTYPE) for the first
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
+ * afterwards.  Accelerated implementations may round down further, but
+ * never by more than BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+ * sizeof(VECTYPE).
  *
  * If the buffer is all zero the return value is equal to len.
+ *
+ * The implementation is picked at startup, depending on the host CPU.
  */
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+static size_t buffer_find_nonzero_offset_generic(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
     if (!len) {
         return 0;
     }
@@ -218,6 +221,228 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX     (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2    (1 << 5)
+#endif
+
+/* Four 32 byte vectors are exactly one unrolled SSE2 iteration, so the
+ * length restrictions of can_use_buffer_find_nonzero_offset() are enough. */
+QEMU_BUILD_BUG_ON(BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
+                  != 4 * sizeof(__m256i));
+
+static size_t __attribute__((target("avx2")))
+buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m256i); i += 4) {
+        __m256i tmp01 = _mm256_or_si256(_mm256_loadu_si256(p + i + 0),
+                                        _mm256_loadu_si256(p + i + 1));
+        __m256i tmp23 = _mm256_or_si256(_mm256_loadu_si256(p + i + 2),
+                                        _mm256_loadu_si256(p + i + 3));
+        __m256i tmp = _mm256_or_si256(tmp01, tmp23);
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m256i);
+}
+
+bool cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return false;
+    }
+
+    /* The OS must save the YMM registers on context switches */
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return ebx & bit_AVX2;
+}
+#endif
+
+static size_t (*buffer_find_nonzero_offset_accel)(const void *buf,
+                                                  size_t len) =
+    buffer_find_nonzero_offset_generic;
+
+static void init_accel(void)
+{
+    buffer_find_nonzero_offset_accel = buffer_find_nonzero_offset_generic;
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (cpu_has_avx2()) {
+        buffer_find_nonzero_offset_accel = buffer_find_nonzero_offset_avx2;
+    }
+#endif
+}
+
+static void __attribute__((constructor)) init_buffer_find_nonzero_offset(void)
+{
+    init_accel();
+}
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+    return buffer_find_nonzero_offset_accel(buf, len);
+}
+
+bool test_buffer_is_zero_next_accel(void)
+{
+    if (buffer_find_nonzero_offset_accel ==
+        buffer_find_nonzero_offset_generic) {
+        /* Start over with the fastest implementation */
+        init_accel();
+        return false;
+    }
+
+    buffer_find_nonzero_offset_accel = buffer_find_nonzero_offset_generic;
+    return true;
+}
+
+/*
+ * Compare-and-copy kernels for buffer_copy_changed_chunks().  They handle a
+ * run of @n chunks starting with chunk @first of @bitmap, and clear the bits
+ * of the chunks that are unchanged.
+ */
+static void copy_changed_chunks_generic(uint8_t *d, const uint8_t *s,
+                                        size_t chunk, size_t n,
+                                        unsigned long *bitmap, size_t first)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++, d += chunk, s += chunk) {
+        if (memcmp(d, s, chunk)) {
+            memcpy(d, s, chunk);
+        } else {
+            clear_bit(first + i, bitmap);
+        }
+    }
+}
+
+#ifdef __SSE2__
+static void copy_changed_chunks_sse2(uint8_t *d, const uint8_t *s,
+                                     size_t chunk, size_t n,
+                                     unsigned long *bitmap, size_t first)
+{
+    const size_t nvec = chunk / sizeof(__m128i);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i, j;
+
+    for (i = 0; i < n; i++, d += chunk, s += chunk) {
+        __m128i *dv = (__m128i *)d;
+        const __m128i *sv = (const __m128i *)s;
+        __m128i diff = zero;
+
+        for (j = 0; j < nvec; j++) {
+            diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(dv + j),
+                                                    _mm_loadu_si128(sv + j)));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) == 0xFFFF) {
+            clear_bit(first + i, bitmap);
+            continue;
+        }
+        for (j = 0; j < nvec; j++) {
+            _mm_storeu_si128(dv + j, _mm_loadu_si128(sv + j));
+        }
+    }
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+static void __attribute__((target("avx2")))
+copy_changed_chunks_avx2(uint8_t *d, const uint8_t *s,
+                         size_t chunk, size_t n,
+                         unsigned long *bitmap, size_t first)
+{
+    const size_t nvec = chunk / sizeof(__m256i);
+    size_t i, j;
+
+    for (i = 0; i < n; i++, d += chunk, s += chunk) {
+        __m256i *dv = (__m256i *)d;
+        const __m256i *sv = (const __m256i *)s;
+        __m256i diff = _mm256_setzero_si256();
+
+        for (j = 0; j < nvec; j++) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256(dv + j),
+                                         _mm256_loadu_si256(sv + j));
+            diff = _mm256_or_si256(diff, x);
+        }
+        if (_mm256_testz_si256(diff, diff)) {
+            clear_bit(first + i, bitmap);
+            continue;
+        }
+        for (j = 0; j < nvec; j++) {
+            _mm256_storeu_si256(dv + j, _mm256_loadu_si256(sv + j));
+        }
+    }
+}
+
+static bool copy_changed_chunks_use_avx2;
+
+static void __attribute__((constructor)) init_copy_changed_chunks(void)
+{
+    copy_changed_chunks_use_avx2 = cpu_has_avx2();
+}
+#endif
+
+/*
+ * Copies the chunks of @chunk bytes that differ between @src and @dst from
+ * @src to @dst.  On entry, @bitmap marks which of the first @nchunks chunks
+ * to look at; on return it only marks the chunks that changed.  Consecutive
+ * chunks are handled in one go by a vectorized kernel when the host has one.
+ */
+void buffer_copy_changed_chunks(void *dst, const void *src, size_t chunk,
+                                size_t nchunks, unsigned long *bitmap)
+{
+    void (*kernel)(uint8_t *d, const uint8_t *s, size_t chunk, size_t n,
+                   unsigned long *bitmap, size_t first);
+    size_t start, end;
+
+    kernel = copy_changed_chunks_generic;
+#ifdef __SSE2__
+    if (chunk % sizeof(__m128i) == 0) {
+        kernel = copy_changed_chunks_sse2;
+    }
+#endif
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (copy_changed_chunks_use_avx2 && chunk % sizeof(__m256i) == 0) {
+        kernel = copy_changed_chunks_avx2;
+    }
+#endif
+
+    for (start = find_next_bit(bitmap, nchunks, 0); start < nchunks;
+         start = find_next_bit(bitmap, nchunks, end)) {
+        end = find_next_zero_bit(bitmap, nchunks, start);
+        kernel((uint8_t *)dst + start * chunk,
+               (const uint8_t *)src + start * chunk,
+               chunk, end - start, bitmap, start);
+    }
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
@@ -475,6 +700,20 @@ int64_t pow2floor(int64_t value)
     return value;
 }
 
+/* round up to the nearest power of 2 (0 if overflow) */
+uint64_t pow2ceil(uint64_t value)
+{
+    int n = clz64(value - 1);
+
+    if (!n) {
+        /* @value - 1 has no leading zeroes, thus @value - 1 >= 2^63.
+         * Return 0 if it does not fit in 64 bits, and 1 for @value == 0.
+         */
+        return !value;
+    }
+    return 0x8000000000000000ULL >> (n - 1);
+}
+
 /*
  * Implementation of  ULEB128 (http://en.wikipedia.org/wiki/LEB128)
  * Input is limited to 14-bit numbers
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -168,6 +169,57 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+/* Leave hbi at the end of the bitmap, as if all words had been visited.  */
+static void hbitmap_iter_finish(HBitmapIter *hbi)
+{
+    unsigned i;
+
+    for (i = 1; i < HBITMAP_LEVELS; i++) {
+        hbi->cur[i] = 0;
+    }
+    hbi->cur[0] = 1UL << (BITS_PER_LONG - 1);
+}
+
+int64_t hbitmap_iter_next_run(HBitmapIter *hbi, uint64_t *count)
+{
+    const HBitmap *hb = hbi->hb;
+    const unsigned long *bits = hb->levels[HBITMAP_LEVELS - 1];
+    size_t words = (hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
+    uint64_t start, end;
+    size_t pos;
+
+    if (cur == 0) {
+        cur = hbitmap_iter_skip_words(hbi);
+        if (cur == 0) {
+            *count = 0;
+            return -1;
+        }
+    }
+    pos = hbi->pos;
+    start = ((uint64_t)pos << BITS_PER_LEVEL) + ctzl(cur);
+
+    /* The run ends at the first clear bit after start.  Look at the
+     * bitmap itself rather than at the iterator, whose words may have
+     * bits trimmed.  Bits past the end of the bitmap are always clear.
+     */
+    cur = ~bits[pos] & (~1UL << (start & (BITS_PER_LONG - 1)));
+    while (cur == 0 && ++pos < words) {
+        cur = ~bits[pos];
+    }
+    end = cur ? ((uint64_t)pos << BITS_PER_LEVEL) + ctzl(cur) : hb->size;
+    end = MIN(end, hb->size);
+
+    if (end < hb->size) {
+        hbitmap_iter_init(hbi, hb, end << hb->granularity);
+    } else {
+        hbitmap_iter_finish(hbi);
+    }
+
+    *count = (end - start) << hb->granularity;
+    return start << hb->granularity;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -186,7 +238,8 @@ uint64_t hbitmap_count(const HBitmap *hb)
 /* Count the number of set bits between start and end, not accounting for
  * the granularity.  Also an example of how to use hbitmap_iter_next_word.
  */
-static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
+static uint64_t hb_count_between(const HBitmap *hb, uint64_t start,
+                                 uint64_t last)
 {
     HBitmapIter hbi;
     uint64_t count = 0;
@@ -213,6 +266,21 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     return count;
 }
 
+uint64_t hbitmap_count_range(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    uint64_t last = start + count - 1;
+
+    if (count == 0) {
+        return 0;
+    }
+    start >>= hb->granularity;
+    last = MIN(last >> hb->granularity, hb->size - 1);
+    if (start > last) {
+        return 0;
+    }
+    return hb_count_between(hb, start, last) << hb->granularity;
+}
+
 /* Setting starts at the last layer and propagates up if an element
  * changes from zero to non-zero.
  */
@@ -367,6 +435,148 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Chunks are made of 64-bit words, so that the layout of the stream
+     * does not depend on the size of a long.
+     */
+    return UINT64_C(64) << hb->granularity;
+}
+
+/* Return the words of the last level that hold the items in
+ * [start, start + count), checking the alignment constraints.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, size_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last & (gran - 1)) != gran - 1) {
+        /* Only the chunk at the end of the bitmap may be partial.  */
+        assert((last >> hb->granularity) + 1 == hb->size);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    unsigned long *cur;
+    size_t el_count;
+
+    if (count == 0) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    return ROUND_UP(el_count * sizeof(unsigned long), 8);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    unsigned long *cur, el;
+    size_t el_count, i;
+
+    if (count == 0) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    for (i = 0; i < el_count; i++) {
+        el = BITS_PER_LONG == 32 ? cpu_to_le32(cur[i]) : cpu_to_le64(cur[i]);
+        memcpy(buf, &el, sizeof(el));
+        buf += sizeof(el);
+    }
+
+    /* On 32-bit hosts, pad the last 64-bit word.  */
+    if ((el_count * sizeof(unsigned long)) & 7) {
+        memset(buf, 0, 4);
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish)
+{
+    unsigned long *cur, el;
+    size_t el_count, i;
+
+    if (count != 0) {
+        serialization_chunk(hb, start, count, &cur, &el_count);
+        for (i = 0; i < el_count; i++) {
+            memcpy(&el, buf, sizeof(el));
+            buf += sizeof(el);
+            cur[i] = BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el);
+        }
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish)
+{
+    unsigned long *cur;
+    size_t el_count;
+
+    if (count != 0) {
+        serialization_chunk(hb, start, count, &cur, &el_count);
+        memset(cur, 0, el_count * sizeof(unsigned long));
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+/* Deserialization only writes the last level; rebuild the others from
+ * it, bottom up, and recompute the number of set bits.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    unsigned long *bits = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t size = hb->size;
+    uint64_t count = 0;
+    size_t words, i;
+    unsigned lev;
+
+    /* The stream may have bits set past the end of the bitmap.  */
+    if (size & (BITS_PER_LONG - 1)) {
+        unsigned long mask = (1UL << (size & (BITS_PER_LONG - 1))) - 1;
+        bits[size >> BITS_PER_LEVEL] &= mask;
+    }
+
+    for (lev = HBITMAP_LEVELS; lev-- > 0; ) {
+        words = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        if (lev == HBITMAP_LEVELS - 1) {
+            for (i = 0; i < words; i++) {
+                count += popcountl(hb->levels[lev][i]);
+            }
+        }
+        if (lev > 0) {
+            size_t up = MAX((words + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+
+            memset(hb->levels[lev - 1], 0, up * sizeof(unsigned long));
+            for (i = 0; i < words; i++) {
+                if (hb->levels[lev][i]) {
+                    hb->levels[lev - 1][i >> BITS_PER_LEVEL] |=
+                        1UL << (i & (BITS_PER_LONG - 1));
+                }
+            }
+        }
+        size = words;
+    }
+
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb->count = count;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -0,0 +1,175 @@
+/*
+ * Interval tree
+ *
+ * Copyright (C) 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(IntervalTreeNode *n)
+{
+    return n ? n->height : 0;
+}
+
+/* Recompute height and max_end of @n from its children */
+static void node_update(IntervalTreeNode *n)
+{
+    n->height = MAX(node_height(n->left), node_height(n->right)) + 1;
+    n->max_end = n->end;
+    if (n->left && n->left->max_end > n->max_end) {
+        n->max_end = n->left->max_end;
+    }
+    if (n->right && n->right->max_end > n->max_end) {
+        n->max_end = n->right->max_end;
+    }
+}
+
+/* Nodes are ordered by start; equal starts are ordered by address, so
+ * that every node has a unique position and can be found for removal.
+ */
+static bool node_before(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start;
+    }
+    return (uintptr_t)a < (uintptr_t)b;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+/* Update @n and restore the AVL property, returning the new subtree root */
+static IntervalTreeNode *rebalance(IntervalTreeNode *n)
+{
+    int balance = node_height(n->left) - node_height(n->right);
+
+    if (balance > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = rotate_left(n->left);
+        }
+        return rotate_right(n);
+    }
+    if (balance < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = rotate_right(n->right);
+        }
+        return rotate_left(n);
+    }
+    node_update(n);
+    return n;
+}
+
+static IntervalTreeNode *insert(IntervalTreeNode *root, IntervalTreeNode *n)
+{
+    if (!root) {
+        return n;
+    }
+    if (node_before(n, root)) {
+        root->left = insert(root->left, n);
+    } else {
+        root->right = insert(root->right, n);
+    }
+    return rebalance(root);
+}
+
+/* Unlink the leftmost node of @root and store it in *min */
+static IntervalTreeNode *remove_min(IntervalTreeNode *root,
+                                    IntervalTreeNode **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = remove_min(root->left, min);
+    return rebalance(root);
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *root,
+                                     IntervalTreeNode *n)
+{
+    IntervalTreeNode *min;
+
+    assert(root);
+    if (root != n) {
+        if (node_before(n, root)) {
+            root->left = remove_node(root->left, n);
+        } else {
+            root->right = remove_node(root->right, n);
+        }
+        return rebalance(root);
+    }
+
+    if (!n->left || !n->right) {
+        return n->left ? n->left : n->right;
+    }
+
+    /* Replace @n with the next node in order */
+    n->right = remove_min(n->right, &min);
+    min->left = n->left;
+    min->right = n->right;
+    return rebalance(min);
+}
+
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node,
+                          int64_t start, int64_t end)
+{
+    node->start = start;
+    node->end = end;
+    node->max_end = end;
+    node->left = node->right = NULL;
+    node->height = 1;
+    tree->root = insert(tree->root, node);
+}
+
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node)
+{
+    tree->root = remove_node(tree->root, node);
+    node->left = node->right = NULL;
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTree *tree,
+                                     int64_t start, int64_t end)
+{
+    IntervalTreeNode *n = tree->root;
+
+    while (n) {
+        /* If any range on the left ends after @start, either one of them
+         * overlaps or none does: everything further right starts at or
+         * after @end.
+         */
+        if (n->left && n->left->max_end > start) {
+            n = n->left;
+        } else if (n->start < end && n->end > start) {
+            return n;
+        } else if (n->start >= end) {
+            return NULL;
+        } else {
+            n = n->right;
+        }
+    }
+    return NULL;
+}
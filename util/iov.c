@@ -26,8 +26,8 @@
 # include <sys/socket.h>
 #endif
 
-size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
-                    size_t offset, const void *buf, size_t bytes)
+size_t iov_from_buf_full(const struct iovec *iov, unsigned int iov_cnt,
+                         size_t offset, const void *buf, size_t bytes)
 {
     size_t done;
     unsigned int i;
@@ -45,8 +45,8 @@ size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
     return done;
 }
 
-size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
-                  size_t offset, void *buf, size_t bytes)
+size_t iov_to_buf_full(const struct iovec *iov, const unsigned int iov_cnt,
+                       size_t offset, void *buf, size_t bytes)
 {
     size_t done;
     unsigned int i;
@@ -83,6 +83,83 @@ size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
     return done;
 }
 
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt)
+{
+    cur->iov = iov;
+    cur->iov_cnt = iov_cnt;
+    cur->idx = 0;
+    cur->offset = 0;
+    cur->pos = 0;
+}
+
+enum {
+    IOV_CURSOR_FROM_BUF,
+    IOV_CURSOR_TO_BUF,
+    IOV_CURSOR_MEMSET,
+    IOV_CURSOR_SKIP,
+};
+
+static inline size_t iov_cursor_walk(IOVCursor *cur, void *buf, int fillc,
+                                     size_t bytes, int op)
+{
+    size_t done = 0;
+
+    while (done < bytes && cur->idx < cur->iov_cnt) {
+        const struct iovec *iov = &cur->iov[cur->idx];
+        size_t len = MIN(iov->iov_len - cur->offset, bytes - done);
+
+        switch (op) {
+        case IOV_CURSOR_FROM_BUF:
+            memcpy(iov->iov_base + cur->offset, buf + done, len);
+            break;
+        case IOV_CURSOR_TO_BUF:
+            memcpy(buf + done, iov->iov_base + cur->offset, len);
+            break;
+        case IOV_CURSOR_MEMSET:
+            memset(iov->iov_base + cur->offset, fillc, len);
+            break;
+        }
+        done += len;
+        cur->offset += len;
+        if (cur->offset == iov->iov_len) {
+            cur->idx++;
+            cur->offset = 0;
+        }
+    }
+    cur->pos += done;
+    return done;
+}
+
+size_t iov_cursor_from_buf(IOVCursor *cur, const void *buf, size_t bytes)
+{
+    return iov_cursor_walk(cur, (void *)buf, 0, bytes, IOV_CURSOR_FROM_BUF);
+}
+
+size_t iov_cursor_to_buf(IOVCursor *cur, void *buf, size_t bytes)
+{
+    return iov_cursor_walk(cur, buf, 0, bytes, IOV_CURSOR_TO_BUF);
+}
+
+size_t iov_cursor_memset(IOVCursor *cur, int fillc, size_t bytes)
+{
+    return iov_cursor_walk(cur, NULL, fillc, bytes, IOV_CURSOR_MEMSET);
+}
+
+size_t iov_cursor_skip(IOVCursor *cur, size_t bytes)
+{
+    return iov_cursor_walk(cur, NULL, 0, bytes, IOV_CURSOR_SKIP);
+}
+
+size_t iov_cursor_seek(IOVCursor *cur, size_t pos)
+{
+    if (pos < cur->pos) {
+        iov_cursor_init(cur, cur->iov, cur->iov_cnt);
+    }
+    iov_cursor_skip(cur, pos - cur->pos);
+    return cur->pos;
+}
+
 size_t iov_size(const struct iovec *iov, const unsigned int iov_cnt)
 {
     size_t len;
@@ -378,6 +455,32 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
     return iov_memset(qiov->iov, qiov->niov, offset, fillc, bytes);
 }
 
+/*
+ * Checks if all bytes described by @qiov are zero.  The bulk of each element
+ * is scanned with buffer_is_zero(), only an unaligned tail is checked bytewise.
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        const uint8_t *ptr = qiov->iov[i].iov_base;
+        size_t len = qiov->iov[i].iov_len;
+        size_t offs = QEMU_ALIGN_DOWN(len, 4 * sizeof(long));
+
+        if (offs && !buffer_is_zero(ptr, offs)) {
+            return false;
+        }
+        for (; offs < len; offs++) {
+            if (ptr[offs]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 size_t iov_discard_front(struct iovec **iov, unsigned int *iov_cnt,
                          size_t bytes)
 {
@@ -53,7 +53,10 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include <sys/mman.h>
+#include <setjmp.h>
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -251,3 +254,94 @@ qemu_get_local_state_pathname(const char *relative_pathname)
     return g_strdup_printf("%s/%s", CONFIG_QEMU_LOCALSTATEDIR,
                            relative_pathname);
 }
+
+#define MAX_MEM_PREALLOC_THREADS 16
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t pagesize;
+    QemuThread thread;
+} MemsetThread;
+
+static __thread sigjmp_buf sigjump;
+static bool memset_failed;
+
+static void sigbus_handler(int signal)
+{
+    siglongjmp(sigjump, 1);
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *t = arg;
+    sigset_t set;
+    size_t i;
+
+    /* qemu_thread_create blocks all signals, but faults must be caught.  */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (sigsetjmp(sigjump, 1)) {
+        atomic_set(&memset_failed, true);
+        return NULL;
+    }
+
+    for (i = 0; i < t->numpages; i++) {
+        /* Read and write back the same value, so that the page is
+         * allocated without changing its contents.
+         */
+        *(volatile char *)t->addr = *t->addr;
+        t->addr += t->pagesize;
+    }
+    return NULL;
+}
+
+void os_mem_prealloc(char *area, size_t memory, size_t pagesize, int nthreads)
+{
+    struct sigaction act, oldact;
+    MemsetThread *threads;
+    size_t numpages = memory / pagesize;
+    size_t per_thread, left;
+    char *addr = area;
+    int i;
+
+    nthreads = MAX(1, MIN(nthreads, MAX_MEM_PREALLOC_THREADS));
+    nthreads = MIN(nthreads, MAX(1, numpages));
+    per_thread = numpages / nthreads;
+    left = numpages % nthreads;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = &sigbus_handler;
+    act.sa_flags = 0;
+    if (sigaction(SIGBUS, &act, &oldact)) {
+        perror("os_mem_prealloc: failed to install signal handler");
+        exit(1);
+    }
+
+    trace_os_mem_prealloc(area, memory, nthreads);
+    memset_failed = false;
+    threads = g_new0(MemsetThread, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        threads[i].addr = addr;
+        threads[i].numpages = per_thread + (i < left);
+        threads[i].pagesize = pagesize;
+        qemu_thread_create(&threads[i].thread, do_touch_pages, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += threads[i].numpages * pagesize;
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i].thread);
+        trace_os_mem_prealloc_done(area, i, threads[i].addr - area);
+    }
+    g_free(threads);
+
+    sigaction(SIGBUS, &oldact, NULL);
+
+    if (memset_failed) {
+        fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
+                "pages available to allocate guest RAM\n");
+        exit(1);
+    }
+}
@@ -189,3 +189,13 @@ qemu_get_local_state_pathname(const char *relative_pathname)
     return g_strdup_printf("%s" G_DIR_SEPARATOR_S "%s", base_path,
                            relative_pathname);
 }
+
+void os_mem_prealloc(char *area, size_t memory, size_t pagesize, int nthreads)
+{
+    size_t i;
+
+    trace_os_mem_prealloc(area, memory, 1);
+    for (i = 0; i < memory / pagesize; i++) {
+        memset(area + pagesize * i, 0, 1);
+    }
+}
@@ -12,6 +12,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/notify.h"
 #include <process.h>
 #include <assert.h>
 #include <limits.h>
@@ -267,6 +268,13 @@ struct QemuThreadData {
 
 static __thread QemuThreadData *qemu_thread_data;
 
+static __thread NotifierList thread_exit;
+
+void qemu_thread_atexit_add(Notifier *notifier)
+{
+    notifier_list_add(&thread_exit, notifier);
+}
+
 static unsigned __stdcall win32_start_routine(void *arg)
 {
     QemuThreadData *data = (QemuThreadData *) arg;
@@ -286,6 +294,7 @@ void qemu_thread_exit(void *arg)
 {
     QemuThreadData *data = qemu_thread_data;
 
+    notifier_list_notify(&thread_exit, NULL);
     if (data) {
         assert(data->mode != QEMU_THREAD_DETACHED);
         data->ret = arg;
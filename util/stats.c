@@ -0,0 +1,167 @@
+/*
+ * Statistics registry
+ *
+ * Copyright (C) 2014
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/stats.h"
+#include "qemu/thread.h"
+#include "qmp-commands.h"
+
+struct Stats {
+    char *name;
+    QSIMPLEQ_HEAD(, StatsCounter) counters;
+    QSIMPLEQ_HEAD(, StatsHistogram) histograms;
+    QTAILQ_ENTRY(Stats) next;
+};
+
+/* The lock protects the list of objects and their lists of counters, but
+ * not the values, which are updated without any synchronization.
+ */
+static QemuMutex stats_lock;
+static QTAILQ_HEAD(, Stats) stats_list =
+    QTAILQ_HEAD_INITIALIZER(stats_list);
+
+static void __attribute__((__constructor__)) stats_init(void)
+{
+    qemu_mutex_init(&stats_lock);
+}
+
+Stats *stats_new(const char *fmt, ...)
+{
+    Stats *stats = g_new0(Stats, 1);
+    va_list ap;
+
+    va_start(ap, fmt);
+    stats->name = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    QSIMPLEQ_INIT(&stats->counters);
+    QSIMPLEQ_INIT(&stats->histograms);
+
+    qemu_mutex_lock(&stats_lock);
+    QTAILQ_INSERT_TAIL(&stats_list, stats, next);
+    qemu_mutex_unlock(&stats_lock);
+    return stats;
+}
+
+void stats_free(Stats *stats)
+{
+    StatsCounter *c;
+    StatsHistogram *h;
+
+    if (!stats) {
+        return;
+    }
+
+    qemu_mutex_lock(&stats_lock);
+    QTAILQ_REMOVE(&stats_list, stats, next);
+    qemu_mutex_unlock(&stats_lock);
+
+    while ((c = QSIMPLEQ_FIRST(&stats->counters)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&stats->counters, next);
+        g_free(c);
+    }
+    while ((h = QSIMPLEQ_FIRST(&stats->histograms)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&stats->histograms, next);
+        g_free(h);
+    }
+    g_free(stats->name);
+    g_free(stats);
+}
+
+StatsCounter *stats_add_counter(Stats *stats, const char *name)
+{
+    StatsCounter *c = g_new0(StatsCounter, 1);
+
+    c->name = name;
+    qemu_mutex_lock(&stats_lock);
+    QSIMPLEQ_INSERT_TAIL(&stats->counters, c, next);
+    qemu_mutex_unlock(&stats_lock);
+    return c;
+}
+
+StatsHistogram *stats_add_histogram(Stats *stats, const char *name)
+{
+    StatsHistogram *h = g_new0(StatsHistogram, 1);
+
+    h->name = name;
+    qemu_mutex_lock(&stats_lock);
+    QSIMPLEQ_INSERT_TAIL(&stats->histograms, h, next);
+    qemu_mutex_unlock(&stats_lock);
+    return h;
+}
+
+static StatsHistogramInfo *stats_histogram_info(StatsHistogram *h)
+{
+    StatsHistogramInfo *info = g_new0(StatsHistogramInfo, 1);
+    intList *entry, **tail = &info->buckets;
+    int i, n;
+
+    info->name = g_strdup(h->name);
+    info->count = atomic_read(&h->count);
+    info->sum = atomic_read(&h->sum);
+
+    /* leave out the empty buckets above the largest value */
+    for (n = STATS_HISTOGRAM_BUCKETS; n > 0; n--) {
+        if (atomic_read(&h->buckets[n - 1])) {
+            break;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        entry = g_new0(intList, 1);
+        entry->value = atomic_read(&h->buckets[i]);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return info;
+}
+
+static StatsInfo *stats_info(Stats *stats)
+{
+    StatsInfo *info = g_new0(StatsInfo, 1);
+    StatsCounterInfoList *counter, **counter_tail = &info->counters;
+    StatsHistogramInfoList *histogram, **histogram_tail = &info->histograms;
+    StatsCounter *c;
+    StatsHistogram *h;
+
+    info->name = g_strdup(stats->name);
+    QSIMPLEQ_FOREACH(c, &stats->counters, next) {
+        counter = g_new0(StatsCounterInfoList, 1);
+        counter->value = g_new0(StatsCounterInfo, 1);
+        counter->value->name = g_strdup(c->name);
+        counter->value->value = atomic_read(&c->value);
+        *counter_tail = counter;
+        counter_tail = &counter->next;
+    }
+    QSIMPLEQ_FOREACH(h, &stats->histograms, next) {
+        histogram = g_new0(StatsHistogramInfoList, 1);
+        histogram->value = stats_histogram_info(h);
+        *histogram_tail = histogram;
+        histogram_tail = &histogram->next;
+    }
+    return info;
+}
+
+StatsInfoList *qmp_query_stats(bool has_prefix, const char *prefix,
+                               Error **errp)
+{
+    StatsInfoList *head = NULL, **tail = &head, *entry;
+    Stats *stats;
+
+    qemu_mutex_lock(&stats_lock);
+    QTAILQ_FOREACH(stats, &stats_list, next) {
+        if (has_prefix && !g_str_has_prefix(stats->name, prefix)) {
+            continue;
+        }
+        entry = g_new0(StatsInfoList, 1);
+        entry->value = stats_info(stats);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&stats_lock);
+    return head;
+}
@@ -37,6 +37,12 @@ void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
 
     /* make the bucket leak */
     bkt->level = MAX(bkt->level - leak, 0);
+
+    /* during a burst, the burst rate bucket leaks at the max rate */
+    if (bkt->burst_length > 1) {
+        leak = (bkt->max * (double) delta_ns) / NANOSECONDS_PER_SECOND;
+        bkt->burst_level = MAX(bkt->burst_level - leak, 0);
+    }
 }
 
 /* Calculate the time delta since last leak and make proportionals leaks
@@ -82,18 +88,33 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
 int64_t throttle_compute_wait(LeakyBucket *bkt)
 {
     double extra; /* the number of extra units blocking the io */
+    double bucket_size = bkt->max;
 
     if (!bkt->avg) {
         return 0;
     }
 
-    extra = bkt->level - bkt->max;
+    if (bkt->burst_length > 1) {
+        bucket_size = bkt->max * bkt->burst_length;
+    }
 
-    if (extra <= 0) {
-        return 0;
+    extra = bkt->level - bucket_size;
+
+    if (extra > 0) {
+        return throttle_do_compute_wait(bkt->avg, extra);
     }
 
-    return throttle_do_compute_wait(bkt->avg, extra);
+    /* within the burst allowance, but the burst rate is limited too; its
+     * bucket gets a tenth of a second worth of I/O like a plain bucket
+     */
+    if (bkt->burst_length > 1) {
+        extra = bkt->burst_level - bkt->max / 10;
+        if (extra > 0) {
+            return throttle_do_compute_wait(bkt->max, extra);
+        }
+    }
+
+    return 0;
 }
 
 /* This function compute the time that must be waited while this IO
@@ -269,6 +290,15 @@ bool throttle_is_valid(ThrottleConfig *cfg)
         }
     }
 
+    /* a burst period needs an explicit burst rate above the average */
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        LeakyBucket *bkt = &cfg->buckets[i];
+
+        if (bkt->burst_length > 1 && bkt->max < bkt->avg) {
+            invalid = true;
+        }
+    }
+
     return !invalid;
 }
 
@@ -279,6 +309,7 @@ static void throttle_fix_bucket(LeakyBucket *bkt)
 
     /* zero bucket level */
     bkt->level = 0;
+    bkt->burst_level = 0;
 
     /* The following is done to cope with the Linux CFQ block scheduler
      * which regroup reads and writes by block of 100ms in the guest.
@@ -334,6 +365,17 @@ void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
     *cfg = ts->cfg;
 }
 
+/* used to get the current bucket levels, after leaking them until now
+ *
+ * @ts:  the throttle state we are working on
+ * @cfg: the config and levels to write
+ */
+void throttle_get_levels(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    throttle_do_leak(ts, qemu_clock_get_ns(ts->clock_type));
+    *cfg = ts->cfg;
+}
+
 
 /* Schedule the read or write timer if needed
  *
@@ -373,6 +415,14 @@ bool throttle_schedule_timer(ThrottleState *ts, bool is_write)
  * @is_write: the type of operation (read/write)
  * @size:     the size of the operation
  */
+static void throttle_fill_bucket(LeakyBucket *bkt, double units)
+{
+    bkt->level += units;
+    if (bkt->burst_length > 1) {
+        bkt->burst_level += units;
+    }
+}
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
 {
     double units = 1.0;
@@ -382,15 +432,15 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
         units = (double) size / ts->cfg.op_size;
     }
 
-    ts->cfg.buckets[THROTTLE_BPS_TOTAL].level += size;
-    ts->cfg.buckets[THROTTLE_OPS_TOTAL].level += units;
+    throttle_fill_bucket(&ts->cfg.buckets[THROTTLE_BPS_TOTAL], size);
+    throttle_fill_bucket(&ts->cfg.buckets[THROTTLE_OPS_TOTAL], units);
 
     if (is_write) {
-        ts->cfg.buckets[THROTTLE_BPS_WRITE].level += size;
-        ts->cfg.buckets[THROTTLE_OPS_WRITE].level += units;
+        throttle_fill_bucket(&ts->cfg.buckets[THROTTLE_BPS_WRITE], size);
+        throttle_fill_bucket(&ts->cfg.buckets[THROTTLE_OPS_WRITE], units);
     } else {
-        ts->cfg.buckets[THROTTLE_BPS_READ].level += size;
-        ts->cfg.buckets[THROTTLE_OPS_READ].level += units;
+        throttle_fill_bucket(&ts->cfg.buckets[THROTTLE_BPS_READ], size);
+        throttle_fill_bucket(&ts->cfg.buckets[THROTTLE_OPS_READ], units);
     }
 }
 
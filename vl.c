@@ -252,6 +252,9 @@ static QTAILQ_HEAD(, FWBootEntry) fw_boot_order =
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+unsigned long *node_host_nodes[MAX_NODES];
+int node_host_policy[MAX_NODES];
+bool node_pin_vcpus[MAX_NODES];
 
 uint8_t qemu_uuid[16];
 bool qemu_uuid_set;
@@ -345,6 +348,9 @@ static QemuOptsList qemu_trace_opts = {
         },{
             .name = "file",
             .type = QEMU_OPT_STRING,
+        },{
+            .name = "bufsize",
+            .type = QEMU_OPT_SIZE,
         },
         { /* end of list */ }
     },
@@ -388,6 +394,14 @@ static QemuOptsList qemu_machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        }, {
+            .name = "kvm_halt_poll_ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "time a halted KVM vCPU polls for work before sleeping",
+        }, {
+            .name = "xen_mapcache_bucket",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the Xen map cache buckets",
         }, {
             .name = "kernel",
             .type = QEMU_OPT_STRING,
@@ -699,6 +713,50 @@ StatusInfo *qmp_query_status(Error **errp)
     return info;
 }
 
+/***********************************************************/
+/* startup profile */
+
+static int64_t startup_time;
+static StartupPhaseList *startup_profile;
+static StartupPhaseList **startup_profile_tail = &startup_profile;
+
+static int64_t startup_phase_begin(void)
+{
+    return get_clock_realtime();
+}
+
+static void startup_phase_end(const char *name, int64_t start)
+{
+    StartupPhaseList *entry = g_malloc0(sizeof(*entry));
+
+    entry->value = g_malloc0(sizeof(*entry->value));
+    entry->value->name = g_strdup(name);
+    entry->value->start = start - startup_time;
+    entry->value->duration = get_clock_realtime() - start;
+
+    *startup_profile_tail = entry;
+    startup_profile_tail = &entry->next;
+}
+
+StartupPhaseList *qmp_query_startup_profile(Error **errp)
+{
+    StartupPhaseList *head = NULL, **tail = &head, *phase;
+
+    for (phase = startup_profile; phase; phase = phase->next) {
+        StartupPhaseList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(phase->value->name);
+        entry->value->start = phase->value->start;
+        entry->value->duration = phase->value->duration;
+
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 /***********************************************************/
 /* real time host monotonic timer */
 
@@ -1260,6 +1318,36 @@ char *get_boot_devices_list(size_t *size)
     return list;
 }
 
+static void numa_node_parse_host_nodes(int nodenr, const char *nodes)
+{
+    unsigned long long value, endvalue;
+    char *endptr;
+
+    if (parse_uint(nodes, &value, &endptr, 10) < 0) {
+        goto error;
+    }
+    if (*endptr == '-') {
+        if (parse_uint_full(endptr + 1, &endvalue, 10) < 0) {
+            goto error;
+        }
+    } else if (*endptr == '\0') {
+        endvalue = value;
+    } else {
+        goto error;
+    }
+
+    if (endvalue < value || endvalue >= MAX_NODES) {
+        goto error;
+    }
+
+    bitmap_set(node_host_nodes[nodenr], value, endvalue - value + 1);
+    return;
+
+error:
+    fprintf(stderr, "qemu: Invalid NUMA host node range: %s\n", nodes);
+    exit(1);
+}
+
 static void numa_node_parse_cpus(int nodenr, const char *cpus)
 {
     char *endptr;
@@ -1349,6 +1437,44 @@ static void numa_add(const char *optarg)
         if (get_param_value(option, 128, "cpus", optarg) != 0) {
             numa_node_parse_cpus(nodenr, option);
         }
+        if (get_param_value(option, 128, "host-nodes", optarg) != 0) {
+            numa_node_parse_host_nodes(nodenr, option);
+            node_host_policy[nodenr] = NUMA_POLICY_BIND;
+        }
+        if (get_param_value(option, 128, "policy", optarg) != 0) {
+            if (!strcmp(option, "default")) {
+                node_host_policy[nodenr] = NUMA_POLICY_DEFAULT;
+            } else if (!strcmp(option, "preferred")) {
+                node_host_policy[nodenr] = NUMA_POLICY_PREFERRED;
+            } else if (!strcmp(option, "bind")) {
+                node_host_policy[nodenr] = NUMA_POLICY_BIND;
+            } else if (!strcmp(option, "interleave")) {
+                node_host_policy[nodenr] = NUMA_POLICY_INTERLEAVE;
+            } else {
+                fprintf(stderr, "qemu: invalid NUMA policy: %s\n", option);
+                exit(1);
+            }
+            if (node_host_policy[nodenr] != NUMA_POLICY_DEFAULT &&
+                bitmap_empty(node_host_nodes[nodenr], MAX_NODES)) {
+                fprintf(stderr, "qemu: NUMA policy %s requires host-nodes\n",
+                        option);
+                exit(1);
+            }
+        }
+        if (get_param_value(option, 128, "pin", optarg) != 0) {
+            if (!strcmp(option, "on")) {
+                node_pin_vcpus[nodenr] = true;
+            } else if (strcmp(option, "off")) {
+                fprintf(stderr, "qemu: invalid NUMA pin option: %s\n",
+                        option);
+                exit(1);
+            }
+            if (node_pin_vcpus[nodenr] &&
+                bitmap_empty(node_host_nodes[nodenr], MAX_NODES)) {
+                fprintf(stderr, "qemu: NUMA pin=on requires host-nodes\n");
+                exit(1);
+            }
+        }
         nb_numa_nodes++;
     } else {
         fprintf(stderr, "Invalid -numa option: %s\n", option);
@@ -2303,11 +2429,19 @@ static int device_help_func(QemuOpts *opts, void *opaque)
 static int device_init_func(QemuOpts *opts, void *opaque)
 {
     DeviceState *dev;
+    int64_t start = startup_phase_begin();
+    char *name;
 
     dev = qdev_device_add(opts);
     if (!dev)
         return -1;
     object_unref(OBJECT(dev));
+
+    name = g_strdup_printf("device %s",
+                           qemu_opts_id(opts) ? qemu_opts_id(opts) :
+                           qemu_opt_get(opts, "driver"));
+    startup_phase_end(name, start);
+    g_free(name);
     return 0;
 }
 
@@ -2850,7 +2984,9 @@ int main(int argc, char **argv, char **envp)
     };
     const char *trace_events = NULL;
     const char *trace_file = NULL;
+    int64_t phase_start;
 
+    startup_time = get_clock_realtime();
     atexit(qemu_run_exit_notifiers);
     error_set_progname(argv[0]);
 
@@ -2910,6 +3046,7 @@ int main(int argc, char **argv, char **envp)
     for (i = 0; i < MAX_NODES; i++) {
         node_mem[i] = 0;
         node_cpumask[i] = bitmap_new(MAX_CPUMASK_BITS);
+        node_host_nodes[i] = bitmap_new(MAX_NODES);
     }
 
     nb_numa_nodes = 0;
@@ -3326,7 +3463,7 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_virtfs: {
                 QemuOpts *fsdev;
                 QemuOpts *device;
-                const char *writeout, *sock_fd, *socket;
+                const char *writeout, *sock_fd, *socket, *cache_ttl;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -3374,6 +3511,10 @@ int main(int argc, char **argv, char **envp)
                 if (sock_fd) {
                     qemu_opt_set(fsdev, "sock_fd", sock_fd);
                 }
+                cache_ttl = qemu_opt_get(opts, "cache_ttl");
+                if (cache_ttl) {
+                    qemu_opt_set(fsdev, "cache_ttl", cache_ttl);
+                }
 
                 qemu_opt_set_bool(fsdev, "readonly",
                                 qemu_opt_get_bool(opts, "readonly", 0));
@@ -3711,6 +3852,16 @@ int main(int argc, char **argv, char **envp)
                 }
                 trace_events = qemu_opt_get(opts, "events");
                 trace_file = qemu_opt_get(opts, "file");
+                if (qemu_opt_get(opts, "bufsize")) {
+#ifdef CONFIG_TRACE_SIMPLE
+                    st_set_trace_buffer_size(
+                        qemu_opt_get_size(opts, "bufsize", 0));
+#else
+                    fprintf(stderr, "-trace bufsize is only supported by "
+                            "the simple trace backend\n");
+                    exit(1);
+#endif
+                }
                 break;
             }
             case QEMU_OPTION_readconfig:
@@ -4143,17 +4294,19 @@ int main(int argc, char **argv, char **envp)
     /* open the virtual block devices */
     if (snapshot)
         qemu_opts_foreach(qemu_find_opts("drive"), drive_enable_snapshot, NULL, 0);
+    phase_start = startup_phase_begin();
     if (qemu_opts_foreach(qemu_find_opts("drive"), drive_init_func,
                           &machine->block_default_type, 1) != 0) {
         exit(1);
     }
+    startup_phase_end("drives", phase_start);
 
     default_drive(default_cdrom, snapshot, machine->block_default_type, 2,
                   CDROM_OPTS);
     default_drive(default_floppy, snapshot, IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, IF_SD, 0, SD_OPTS);
 
-    register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
+    ram_mig_init();
 
     if (nb_numa_nodes > 0) {
         int i;
@@ -4243,7 +4396,9 @@ int main(int argc, char **argv, char **envp)
                                  .kernel_cmdline = kernel_cmdline,
                                  .initrd_filename = initrd_filename,
                                  .cpu_model = cpu_model };
+    phase_start = startup_phase_begin();
     machine->init(&args);
+    startup_phase_end("machine", phase_start);
 
     audio_init();
 
@@ -4328,10 +4483,12 @@ int main(int argc, char **argv, char **envp)
 
     qdev_machine_creation_done();
 
+    phase_start = startup_phase_begin();
     if (rom_load_all() != 0) {
         fprintf(stderr, "rom loading failed\n");
         exit(1);
     }
+    startup_phase_end("roms", phase_start);
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
@@ -4363,6 +4520,8 @@ int main(int argc, char **argv, char **envp)
 
     os_setup_post();
 
+    startup_phase_end("startup", startup_time);
+
     main_loop();
     bdrv_close_all();
     pause_all_vcpus();
@@ -11,6 +11,7 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -23,12 +24,142 @@
 
   length = uleb128 encoded integer
  */
+
+/*
+ * Run scanners: return the first offset in [i, end) where the run starting
+ * at i ends, or end.  A zrun (@zrun true) ends at the first byte that
+ * differs between the buffers, an nzrun at the first byte that is equal.
+ * Every implementation returns the same offsets, so the encoding does not
+ * depend on the host CPU.
+ */
+static int xbzrle_find_run_end_generic(const uint8_t *old_buf,
+                                       const uint8_t *new_buf,
+                                       int i, int end, bool zrun)
+{
+    /* truncation to 32-bit long okay */
+    const long mask = (long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    while (i < end && i % sizeof(long)) {
+        if ((old_buf[i] == new_buf[i]) != zrun) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (i + (int)sizeof(long) <= end) {
+        long xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+
+        if (zrun ? xor != 0 : ((xor - mask) & ~xor & (mask << 7)) != 0) {
+            /* the run ends within the current long */
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < end && (old_buf[i] == new_buf[i]) == zrun) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static int xbzrle_find_run_end_sse2(const uint8_t *old_buf,
+                                    const uint8_t *new_buf,
+                                    int i, int end, bool zrun)
+{
+    while (i + (int)sizeof(__m128i) <= end) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        /* bit n is set if byte n is unchanged */
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+        uint32_t stop = zrun ? ~eq & 0xffff : eq;
+
+        if (stop) {
+            return i + ctz32(stop);
+        }
+        i += sizeof(__m128i);
+    }
+
+    return xbzrle_find_run_end_generic(old_buf, new_buf, i, end, zrun);
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#include <immintrin.h>
+
+static int __attribute__((target("avx2")))
+xbzrle_find_run_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int end, bool zrun)
+{
+    while (i + (int)sizeof(__m256i) <= end) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+        uint32_t stop = zrun ? ~eq : eq;
+
+        if (stop) {
+            return i + ctz32(stop);
+        }
+        i += sizeof(__m256i);
+    }
+
+    return xbzrle_find_run_end_generic(old_buf, new_buf, i, end, zrun);
+}
+#endif
+
+static int (*xbzrle_find_run_end)(const uint8_t *old_buf,
+                                  const uint8_t *new_buf,
+                                  int i, int end, bool zrun) =
+    xbzrle_find_run_end_generic;
+
+static void init_accel(void)
+{
+    xbzrle_find_run_end = xbzrle_find_run_end_generic;
+#ifdef __SSE2__
+    xbzrle_find_run_end = xbzrle_find_run_end_sse2;
+#endif
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (cpu_has_avx2()) {
+        xbzrle_find_run_end = xbzrle_find_run_end_avx2;
+    }
+#endif
+}
+
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+    init_accel();
+}
+
+bool test_xbzrle_next_accel(void)
+{
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+    if (xbzrle_find_run_end == xbzrle_find_run_end_avx2) {
+        xbzrle_find_run_end = xbzrle_find_run_end_sse2;
+        return true;
+    }
+#endif
+#ifdef __SSE2__
+    if (xbzrle_find_run_end == xbzrle_find_run_end_sse2) {
+        xbzrle_find_run_end = xbzrle_find_run_end_generic;
+        return true;
+    }
+#endif
+
+    /* Start over with the fastest implementation */
+    init_accel();
+    return false;
+}
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
+    int d = 0, i = 0, end;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -40,28 +171,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = xbzrle_find_run_end(old_buf, new_buf, i, slen, true);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,40 +187,19 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
 
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+        /* An nzrun longer than the space left overflows anyway, so stop
+         * scanning one byte past it */
+        end = xbzrle_find_run_end(old_buf, new_buf, i,
+                                  MIN(slen, i + dlen - d + 1), false);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -117,7 +208,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
@@ -14,7 +14,10 @@
 
 #include "hw/xen/xen_backend.h"
 #include "sysemu/blockdev.h"
+#include "sysemu/sysemu.h"
 #include "qemu/bitmap.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 #include <xen/hvm/params.h>
 #include <sys/mman.h>
@@ -49,34 +52,58 @@
  */
 #define NON_MCACHE_MEMORY_SIZE (80 * 1024 * 1024)
 
-#define mapcache_lock()   ((void)0)
-#define mapcache_unlock() ((void)0)
+#define mapcache_lock()   qemu_mutex_lock(&mapcache->lock)
+#define mapcache_unlock() qemu_mutex_unlock(&mapcache->lock)
 
+/*
+ * The mapping of an entry never changes once it is visible in a bucket
+ * chain, so lookups only need the RCU read lock.  Entries are unlinked and
+ * freed after a grace period instead of being remapped in place.
+ */
 typedef struct MapCacheEntry {
+    struct rcu_head rcu;
     hwaddr paddr_index;
     uint8_t *vaddr_base;
     unsigned long *valid_mapping;
-    uint8_t lock;
     hwaddr size;
     struct MapCacheEntry *next;
+
+    /* set by lookups, cleared when the entry gets a second chance */
+    bool referenced;
+
+    /* Protected by MapCache.lock; only unlocked entries are in the LRU */
+    unsigned int lock;
+    QTAILQ_ENTRY(MapCacheEntry) lru;
 } MapCacheEntry;
 
 typedef struct MapCacheRev {
     uint8_t *vaddr_req;
     hwaddr paddr_index;
-    hwaddr size;
+    MapCacheEntry *entry;
     QTAILQ_ENTRY(MapCacheRev) next;
 } MapCacheRev;
 
 typedef struct MapCache {
-    MapCacheEntry *entry;
+    QemuMutex lock;
+
+    /* Bucket chain heads, hashed by address index */
+    MapCacheEntry **bucket;
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
 
-    /* For most cases (>99.9%), the page address is the same. */
+    /* Unlocked entries, most recently used first */
+    QTAILQ_HEAD(map_cache_lru, MapCacheEntry) lru;
+    unsigned long nr_lru;
+
+    /* For most cases (>99.9%), the page address is the same.
+     * Only updated with the lock held, so that it never points to an
+     * entry that has been removed.
+     */
     MapCacheEntry *last_entry;
     unsigned long max_mcache_size;
-    unsigned int mcache_bucket_shift;
+    unsigned long mapped_size;
+    unsigned int bucket_shift;
+    hwaddr bucket_size;
 
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     void *opaque;
@@ -95,15 +122,29 @@ static inline int test_bits(int nr, int size, const unsigned long *addr)
 
 void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 {
-    unsigned long size;
+    uint64_t bucket_size;
     struct rlimit rlimit_as;
 
     mapcache = g_malloc0(sizeof (MapCache));
 
     mapcache->phys_offset_to_gaddr = f;
     mapcache->opaque = opaque;
+    qemu_mutex_init(&mapcache->lock);
 
     QTAILQ_INIT(&mapcache->locked_entries);
+    QTAILQ_INIT(&mapcache->lru);
+
+    bucket_size = qemu_opt_get_size(qemu_get_machine_opts(),
+                                    "xen_mapcache_bucket", MCACHE_BUCKET_SIZE);
+    if (bucket_size < XC_PAGE_SIZE || bucket_size > MCACHE_MAX_SIZE ||
+        (bucket_size & (bucket_size - 1))) {
+        fprintf(stderr, "xen_mapcache_bucket must be a power of 2 between "
+                "%lu and %lu bytes\n", (unsigned long)XC_PAGE_SIZE,
+                MCACHE_MAX_SIZE);
+        exit(1);
+    }
+    mapcache->bucket_size = bucket_size;
+    mapcache->bucket_shift = ctz64(bucket_size);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -129,20 +170,17 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     mapcache->nr_buckets =
         (((mapcache->max_mcache_size >> XC_PAGE_SHIFT) +
-          (1UL << (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT)) - 1) >>
-         (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT));
-
-    size = mapcache->nr_buckets * sizeof (MapCacheEntry);
-    size = (size + XC_PAGE_SIZE - 1) & ~(XC_PAGE_SIZE - 1);
-    DPRINTF("%s, nr_buckets = %lx size %lu\n", __func__,
-            mapcache->nr_buckets, size);
-    mapcache->entry = g_malloc0(size);
+          (1UL << (mapcache->bucket_shift - XC_PAGE_SHIFT)) - 1) >>
+         (mapcache->bucket_shift - XC_PAGE_SHIFT));
+
+    DPRINTF("%s, nr_buckets = %lx bucket size %#" PRIx64 "\n", __func__,
+            mapcache->nr_buckets, mapcache->bucket_size);
+    mapcache->bucket = g_new0(MapCacheEntry *, mapcache->nr_buckets);
 }
 
-static void xen_remap_bucket(MapCacheEntry *entry,
-                             hwaddr size,
-                             hwaddr address_index)
+static MapCacheEntry *xen_remap_bucket(hwaddr size, hwaddr address_index)
 {
+    MapCacheEntry *entry;
     uint8_t *vaddr_base;
     xen_pfn_t *pfns;
     int *err;
@@ -154,19 +192,9 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     pfns = g_malloc0(nb_pfn * sizeof (xen_pfn_t));
     err = g_malloc0(nb_pfn * sizeof (int));
 
-    if (entry->vaddr_base != NULL) {
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-    }
-    if (entry->valid_mapping != NULL) {
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
-    }
-
     for (i = 0; i < nb_pfn; i++) {
-        pfns[i] = (address_index << (MCACHE_BUCKET_SHIFT-XC_PAGE_SHIFT)) + i;
+        pfns[i] = (address_index <<
+                   (mapcache->bucket_shift - XC_PAGE_SHIFT)) + i;
     }
 
     vaddr_base = xc_map_foreign_bulk(xen_xc, xen_domid, PROT_READ|PROT_WRITE,
@@ -176,13 +204,11 @@ static void xen_remap_bucket(MapCacheEntry *entry,
         exit(-1);
     }
 
+    entry = g_malloc0(sizeof (MapCacheEntry));
     entry->vaddr_base = vaddr_base;
     entry->paddr_index = address_index;
     entry->size = size;
-    entry->valid_mapping = (unsigned long *) g_malloc0(sizeof(unsigned long) *
-            BITS_TO_LONGS(size >> XC_PAGE_SHIFT));
-
-    bitmap_zero(entry->valid_mapping, nb_pfn);
+    entry->valid_mapping = bitmap_new(nb_pfn);
     for (i = 0; i < nb_pfn; i++) {
         if (!err[i]) {
             bitmap_set(entry->valid_mapping, i, 1);
@@ -191,21 +217,144 @@ static void xen_remap_bucket(MapCacheEntry *entry,
 
     g_free(pfns);
     g_free(err);
+    return entry;
+}
+
+static void xen_map_cache_entry_free(MapCacheEntry *entry)
+{
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    g_free(entry->valid_mapping);
+    g_free(entry);
+}
+
+static bool xen_map_cache_match(MapCacheEntry *entry, hwaddr address_index,
+                                hwaddr address_offset, hwaddr size,
+                                hwaddr test_bit_size)
+{
+    return entry->paddr_index == address_index && entry->size >= size &&
+           test_bits(address_offset >> XC_PAGE_SHIFT,
+                     test_bit_size >> XC_PAGE_SHIFT,
+                     entry->valid_mapping);
+}
+
+/* Called with the RCU read lock or MapCache.lock held */
+static MapCacheEntry *xen_map_cache_find(hwaddr address_index,
+                                         hwaddr address_offset,
+                                         hwaddr size, hwaddr test_bit_size)
+{
+    MapCacheEntry *entry;
+
+    entry = atomic_rcu_read(&mapcache->last_entry);
+    if (!entry || !xen_map_cache_match(entry, address_index, address_offset,
+                                       size, test_bit_size)) {
+        entry = atomic_rcu_read(&mapcache->bucket[address_index %
+                                                  mapcache->nr_buckets]);
+        while (entry && !xen_map_cache_match(entry, address_index,
+                                             address_offset, size,
+                                             test_bit_size)) {
+            entry = atomic_rcu_read(&entry->next);
+        }
+        if (!entry) {
+            return NULL;
+        }
+    }
+
+    if (!atomic_read(&entry->referenced)) {
+        atomic_set(&entry->referenced, true);
+    }
+    return entry;
+}
+
+/* Called with MapCache.lock held */
+static void xen_map_cache_remove(MapCacheEntry *entry)
+{
+    MapCacheEntry **pprev;
+
+    assert(entry->lock == 0);
+    trace_xen_map_cache_evict(entry->paddr_index, entry->size);
+
+    pprev = &mapcache->bucket[entry->paddr_index % mapcache->nr_buckets];
+    while (*pprev != entry) {
+        pprev = &(*pprev)->next;
+    }
+    atomic_rcu_set(pprev, entry->next);
+    if (mapcache->last_entry == entry) {
+        atomic_rcu_set(&mapcache->last_entry, NULL);
+    }
+
+    QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+    mapcache->nr_lru--;
+    mapcache->mapped_size -= entry->size;
+
+    /* lock-free lookups may still be looking at the mapping */
+    call_rcu(entry, xen_map_cache_entry_free, rcu);
+}
+
+/*
+ * Evict unlocked entries until @reserve more bytes fit in max_mcache_size,
+ * in LRU order with a second chance for the ones that were used since the
+ * last scan.  Lookups only set a flag, so hits never take MapCache.lock.
+ *
+ * Called with MapCache.lock held.
+ */
+static void xen_map_cache_shrink(hwaddr reserve)
+{
+    MapCacheEntry *entry;
+    unsigned long scan = mapcache->nr_lru;
+
+    while (mapcache->mapped_size + reserve > mapcache->max_mcache_size &&
+           (entry = QTAILQ_LAST(&mapcache->lru, map_cache_lru)) != NULL) {
+        if (scan && atomic_read(&entry->referenced)) {
+            atomic_set(&entry->referenced, false);
+            QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+            QTAILQ_INSERT_HEAD(&mapcache->lru, entry, lru);
+            scan--;
+            continue;
+        }
+        xen_map_cache_remove(entry);
+    }
+}
+
+/* Called with MapCache.lock held */
+static MapCacheEntry *xen_map_cache_add(hwaddr address_index, hwaddr size)
+{
+    MapCacheEntry *entry, **head;
+
+    xen_map_cache_shrink(size);
+    entry = xen_remap_bucket(size, address_index);
+    if (bitmap_empty(entry->valid_mapping, size >> XC_PAGE_SHIFT)) {
+        /* nothing to cache, the caller will retry with a translated address */
+        xen_map_cache_entry_free(entry);
+        return NULL;
+    }
+
+    QTAILQ_INSERT_HEAD(&mapcache->lru, entry, lru);
+    mapcache->nr_lru++;
+    mapcache->mapped_size += entry->size;
+
+    head = &mapcache->bucket[address_index % mapcache->nr_buckets];
+    entry->next = *head;
+    atomic_rcu_set(head, entry);
+    return entry;
 }
 
 uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
                        uint8_t lock)
 {
-    MapCacheEntry *entry, *pentry = NULL;
+    MapCacheEntry *entry;
     hwaddr address_index;
     hwaddr address_offset;
     hwaddr __size = size;
     hwaddr __test_bit_size = size;
     bool translated = false;
+    uint8_t *vaddr;
 
 tryagain:
-    address_index  = phys_addr >> MCACHE_BUCKET_SHIFT;
-    address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
+    address_index  = phys_addr >> mapcache->bucket_shift;
+    address_offset = phys_addr & (mapcache->bucket_size - 1);
 
     trace_xen_map_cache(phys_addr);
 
@@ -220,54 +369,44 @@ tryagain:
         __test_bit_size = XC_PAGE_SIZE;
     }
 
-    if (mapcache->last_entry != NULL &&
-        mapcache->last_entry->paddr_index == address_index &&
-        !lock && !__size &&
-        test_bits(address_offset >> XC_PAGE_SHIFT,
-                  __test_bit_size >> XC_PAGE_SHIFT,
-                  mapcache->last_entry->valid_mapping)) {
-        trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
-        return mapcache->last_entry->vaddr_base + address_offset;
-    }
-
-    /* size is always a multiple of MCACHE_BUCKET_SIZE */
+    /* size is always a multiple of the bucket size */
     if (size) {
         __size = size + address_offset;
-        if (__size % MCACHE_BUCKET_SIZE) {
-            __size += MCACHE_BUCKET_SIZE - (__size % MCACHE_BUCKET_SIZE);
+        if (__size % mapcache->bucket_size) {
+            __size += mapcache->bucket_size - (__size % mapcache->bucket_size);
         }
     } else {
-        __size = MCACHE_BUCKET_SIZE;
+        __size = mapcache->bucket_size;
     }
 
-    entry = &mapcache->entry[address_index % mapcache->nr_buckets];
-
-    while (entry && entry->lock && entry->vaddr_base &&
-            (entry->paddr_index != address_index || entry->size != __size ||
-             !test_bits(address_offset >> XC_PAGE_SHIFT,
-                 __test_bit_size >> XC_PAGE_SHIFT,
-                 entry->valid_mapping))) {
-        pentry = entry;
-        entry = entry->next;
+    /* Unlocked mappings of cached buckets need neither the lock nor the
+     * reverse map.  They stay valid at least until the caller leaves its
+     * RCU critical section.
+     */
+    if (!lock) {
+        rcu_read_lock();
+        entry = xen_map_cache_find(address_index, address_offset, __size,
+                                   __test_bit_size);
+        if (entry) {
+            vaddr = entry->vaddr_base + address_offset;
+            rcu_read_unlock();
+            trace_xen_map_cache_return(vaddr);
+            return vaddr;
+        }
+        rcu_read_unlock();
     }
+
+    mapcache_lock();
+    entry = xen_map_cache_find(address_index, address_offset, __size,
+                               __test_bit_size);
     if (!entry) {
-        entry = g_malloc0(sizeof (MapCacheEntry));
-        pentry->next = entry;
-        xen_remap_bucket(entry, __size, address_index);
-    } else if (!entry->lock) {
-        if (!entry->vaddr_base || entry->paddr_index != address_index ||
-                entry->size != __size ||
-                !test_bits(address_offset >> XC_PAGE_SHIFT,
-                    __test_bit_size >> XC_PAGE_SHIFT,
-                    entry->valid_mapping)) {
-            xen_remap_bucket(entry, __size, address_index);
-        }
+        entry = xen_map_cache_add(address_index, __size);
     }
 
-    if(!test_bits(address_offset >> XC_PAGE_SHIFT,
-                __test_bit_size >> XC_PAGE_SHIFT,
-                entry->valid_mapping)) {
-        mapcache->last_entry = NULL;
+    if (!entry || !test_bits(address_offset >> XC_PAGE_SHIFT,
+                             __test_bit_size >> XC_PAGE_SHIFT,
+                             entry->valid_mapping)) {
+        mapcache_unlock();
         if (!translated && mapcache->phys_offset_to_gaddr) {
             phys_addr = mapcache->phys_offset_to_gaddr(phys_addr, size, mapcache->opaque);
             translated = true;
@@ -277,151 +416,110 @@ tryagain:
         return NULL;
     }
 
-    mapcache->last_entry = entry;
+    atomic_rcu_set(&mapcache->last_entry, entry);
+    vaddr = entry->vaddr_base + address_offset;
     if (lock) {
         MapCacheRev *reventry = g_malloc0(sizeof(MapCacheRev));
-        entry->lock++;
-        reventry->vaddr_req = mapcache->last_entry->vaddr_base + address_offset;
-        reventry->paddr_index = mapcache->last_entry->paddr_index;
-        reventry->size = entry->size;
+        if (entry->lock++ == 0) {
+            QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+            mapcache->nr_lru--;
+        }
+        reventry->vaddr_req = vaddr;
+        reventry->paddr_index = entry->paddr_index;
+        reventry->entry = entry;
         QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
     }
+    mapcache_unlock();
 
-    trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
-    return mapcache->last_entry->vaddr_base + address_offset;
+    trace_xen_map_cache_return(vaddr);
+    return vaddr;
 }
 
-ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
+/* Called with MapCache.lock held */
+static MapCacheRev *xen_map_cache_find_rev(void *ptr)
 {
-    MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
-    hwaddr paddr_index;
-    hwaddr size;
-    int found = 0;
 
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         if (reventry->vaddr_req == ptr) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
+            return reventry;
         }
     }
-    if (!found) {
+    return NULL;
+}
+
+ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
+{
+    MapCacheRev *reventry;
+    ram_addr_t raddr;
+
+    mapcache_lock();
+    reventry = xen_map_cache_find_rev(ptr);
+    if (!reventry) {
         fprintf(stderr, "%s, could not find %p\n", __func__, ptr);
         QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
             DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index,
                     reventry->vaddr_req);
         }
         abort();
-        return 0;
     }
 
-    entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        entry = entry->next;
-    }
-    if (!entry) {
-        DPRINTF("Trying to find address %p that is not in the mapcache!\n", ptr);
-        return 0;
-    }
-    return (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
-        ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
+    raddr = (reventry->paddr_index << mapcache->bucket_shift) +
+        ((unsigned long) ptr - (unsigned long) reventry->entry->vaddr_base);
+    mapcache_unlock();
+    return raddr;
 }
 
 void xen_invalidate_map_cache_entry(uint8_t *buffer)
 {
-    MapCacheEntry *entry = NULL, *pentry = NULL;
+    MapCacheEntry *entry;
     MapCacheRev *reventry;
-    hwaddr paddr_index;
-    hwaddr size;
-    int found = 0;
 
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        if (reventry->vaddr_req == buffer) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+    mapcache_lock();
+    reventry = xen_map_cache_find_rev(buffer);
+    if (!reventry) {
         DPRINTF("%s, could not find %p\n", __func__, buffer);
         QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
             DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index, reventry->vaddr_req);
         }
+        mapcache_unlock();
         return;
     }
     QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
+    entry = reventry->entry;
     g_free(reventry);
 
-    if (mapcache->last_entry != NULL &&
-        mapcache->last_entry->paddr_index == paddr_index) {
-        mapcache->last_entry = NULL;
-    }
-
-    entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        pentry = entry;
-        entry = entry->next;
-    }
-    if (!entry) {
-        DPRINTF("Trying to unmap address %p that is not in the mapcache!\n", buffer);
-        return;
-    }
-    entry->lock--;
-    if (entry->lock > 0 || pentry == NULL) {
-        return;
-    }
-
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
+    /* Keep the mapping around for the next request, the LRU scan drops
+     * it when the address space is needed for something else.
+     */
+    if (--entry->lock == 0) {
+        QTAILQ_INSERT_HEAD(&mapcache->lru, entry, lru);
+        mapcache->nr_lru++;
     }
-    g_free(entry->valid_mapping);
-    g_free(entry);
+    mapcache_unlock();
 }
 
 void xen_invalidate_map_cache(void)
 {
-    unsigned long i;
+    MapCacheEntry *entry, *next;
     MapCacheRev *reventry;
 
     /* Flush pending AIO before destroying the mapcache */
     bdrv_drain_all();
 
+    mapcache_lock();
+
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         DPRINTF("There should be no locked mappings at this time, "
                 "but "TARGET_FMT_plx" -> %p is present\n",
                 reventry->paddr_index, reventry->vaddr_req);
     }
 
-    mapcache_lock();
-
-    for (i = 0; i < mapcache->nr_buckets; i++) {
-        MapCacheEntry *entry = &mapcache->entry[i];
-
-        if (entry->vaddr_base == NULL) {
-            continue;
-        }
-        if (entry->lock > 0) {
-            continue;
-        }
-
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-
-        entry->paddr_index = 0;
-        entry->vaddr_base = NULL;
-        entry->size = 0;
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+    QTAILQ_FOREACH_SAFE(entry, &mapcache->lru, lru, next) {
+        xen_map_cache_remove(entry);
     }
 
-    mapcache->last_entry = NULL;
+    atomic_rcu_set(&mapcache->last_entry, NULL);
 
     mapcache_unlock();
 }